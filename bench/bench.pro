@@ -0,0 +1,51 @@
+# Benchmark of the ESP8266 flashing protocol against an emulated device.
+# Emulator uses pseudo terminals, so this only builds on UNIX.
+TEMPLATE = app
+TARGET = esp-bench
+QT -= gui
+QT += serialport network
+CONFIG += c++11 console
+CONFIG -= app_bundle
+
+SRC_PATH = ../src
+COMMON_PATH = ../common
+UTIL_PATH = $${COMMON_PATH}/util
+INCLUDEPATH += . $${SRC_PATH} .. $${UTIL_PATH}
+
+HEADERS += \
+  esp_emulator.h \
+  $${SRC_PATH}/crc32.h \
+  $${SRC_PATH}/esp_erase_model.h \
+  $${SRC_PATH}/esp_flasher_client.h \
+  $${SRC_PATH}/esp_rom_client.h \
+  $${SRC_PATH}/flash_span.h \
+  $${SRC_PATH}/latency_histogram.h \
+  $${SRC_PATH}/log.h \
+  $${SRC_PATH}/net_serial.h \
+  $${SRC_PATH}/serial.h \
+  $${SRC_PATH}/serial_trace.h \
+  $${SRC_PATH}/slip.h \
+  $${SRC_PATH}/status_qt.h
+
+SOURCES += \
+  esp_bench.cc \
+  esp_emulator.cc \
+  $${SRC_PATH}/crc32.cc \
+  $${SRC_PATH}/esp_erase_model.cc \
+  $${SRC_PATH}/esp_flasher_client.cc \
+  $${SRC_PATH}/esp_rom_client.cc \
+  $${SRC_PATH}/flash_span.cc \
+  $${SRC_PATH}/latency_histogram.cc \
+  $${SRC_PATH}/log.cc \
+  $${SRC_PATH}/net_serial.cc \
+  $${SRC_PATH}/serial.cc \
+  $${SRC_PATH}/serial_trace.cc \
+  $${SRC_PATH}/slip.cc \
+  $${SRC_PATH}/status_qt.cc \
+  $${UTIL_PATH}/error_codes.cc \
+  $${UTIL_PATH}/logging.cc \
+  $${UTIL_PATH}/status.cc
+
+RESOURCES = bench.qrc
+
+QMAKE_CLEAN += -r $$TARGET
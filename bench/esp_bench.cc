@@ -0,0 +1,400 @@
+// Measures ESPFlasherClient throughput against an emulated device, so changes
+// to the flashing protocol can be compared without hardware. With --replay,
+// plays the host side of a trace recorded with --trace-serial to the
+// emulator instead.
+
+#include <algorithm>
+#include <functional>
+#include <iostream>
+
+#include <QBuffer>
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <QMap>
+#include <QSerialPort>
+#include <QStringList>
+#include <QTextStream>
+
+#include <common/util/status.h>
+
+#include "esp_emulator.h"
+#include "esp_flasher_client.h"
+#include "esp_rom_client.h"
+#include "serial.h"
+#include "serial_trace.h"
+#include "status_qt.h"
+
+namespace {
+
+const char kBaudRateOption[] = "baud-rate";
+const char kSizeOption[] = "size";
+const char kDataOption[] = "data";
+const char kStubVersionOption[] = "stub-version";
+const char kRxBufSizesOption[] = "rx-buf-sizes";
+const char kLatencyOption[] = "latency-us";
+const char kEraseSectorOption[] = "erase-sector-us";
+const char kWriteOption[] = "write-kb-us";
+const char kReadOption[] = "read-kb-us";
+const char kReplayOption[] = "replay";
+const char kReplayIdleOption[] = "replay-idle-ms";
+const char kTraceOption[] = "trace-serial";
+const char kVerboseOption[] = "verbose";
+
+const quint32 regionSize = 65536;
+
+bool verbose = false;
+
+void messageHandler(QtMsgType type, const QMessageLogContext &context,
+                    const QString &msg) {
+  Q_UNUSED(context);
+  if (!verbose && type != QtCriticalMsg && type != QtFatalMsg) return;
+  std::cerr << msg.toStdString() << std::endl;
+}
+
+QByteArray makeData(const QString &kind, int size) {
+  QByteArray data(size, 0);
+  quint32 x = 0x12345678;
+  for (int i = 0; i < size; i++) {
+    x = x * 1103515245 + 12345;
+    if (kind == "zeros") {
+      data[i] = 0;
+    } else if (kind == "mixed") {
+      // Firmware-like: text and code compress some, tables not at all.
+      const bool text = (i / 4096) % 2 == 0;
+      data[i] = text ? char('a' + (x >> 16) % 16) : char(x >> 16);
+    } else {
+      data[i] = char(x >> 16);
+    }
+  }
+  return data;
+}
+
+class Bench {
+ public:
+  Bench(const ESPEmulator::Params &params, qint32 baudRate,
+        const QByteArray &data, const QString &traceFile)
+      : params_(params),
+        baudRate_(baudRate),
+        data_(data),
+        traceFile_(traceFile),
+        out_(stdout) {
+  }
+
+  util::Status run() {
+    ESPEmulator emu(params_);
+    util::Status st = emu.start();
+    if (!st.ok()) return st;
+    emu_ = &emu;
+
+    QSerialPort port;
+    st = openEmulator(emu, &port);
+    if (!st.ok()) return st;
+
+    ESPROMClient rom(&port, &port);
+    ESPFlasherClient fc(&rom);
+    measure("connect", QString::number(baudRate_), 0, [&]() {
+      util::Status st = rom.connect();
+      if (!st.ok()) return st;
+      return fc.connect(baudRate_);
+    });
+    if (!rom.connected()) return QS(util::error::UNAVAILABLE, "no device");
+    out_ << "# stub version " << fc.stubVersion() << ", rx buffer "
+         << params_.rxBufSize << endl;
+
+    const quint32 size = data_.length();
+    const FlashSpan data(data_);
+    measure("write", "erase", size, [&]() { return fc.write(0, data, true); });
+    if (fc.canWriteCompressed()) {
+      measure("write_deflated", "erase", size,
+              [&]() { return fc.writeCompressed(0, data, true); });
+    }
+    if (fc.canWriteRegions()) {
+      QMap<quint32, FlashSpan> regions;
+      for (quint32 a = 0; a < size; a += regionSize) {
+        regions[a] = data.mid(a, regionSize);
+      }
+      measure("write_regions", QString::number(regions.size()), size,
+              [&]() { return fc.writeRegions(regions, true); });
+    }
+    for (quint32 bs : {1024, 2048, 4096}) {
+      for (quint32 window : {4096, 8192, 16384}) {
+        if (window < bs) continue;
+        if (!fc.canReadWindowed() && (bs != 1024 || window != 4096)) continue;
+        measure("read", QString("%1/%2").arg(bs).arg(window), size, [&]() {
+          QByteArray result;
+          QBuffer buf(&result);
+          buf.open(QIODevice::WriteOnly);
+          util::Status st = fc.read(0, size, &buf, bs, window);
+          if (st.ok() && result != data_) {
+            st = QS(util::error::DATA_LOSS, "data mismatch");
+          }
+          return st;
+        });
+      }
+    }
+    for (quint32 bs : {0, 4096}) {
+      measure("digest", QString::number(bs), size, [&]() {
+        auto res = fc.digest(0, size, bs);
+        if (!res.ok()) return res.status();
+        if (res.ValueOrDie().digest !=
+            QCryptographicHash::hash(data_, QCryptographicHash::Md5)) {
+          return QS(util::error::DATA_LOSS, "digest mismatch");
+        }
+        return util::Status::OK;
+      });
+    }
+    if (fc.canFingerprint()) {
+      measure("fingerprint", "4096", size, [&]() {
+        auto res = fc.fingerprint(0, size, 4096);
+        if (!res.ok()) return res.status();
+        if (res.ValueOrDie() !=
+            ESPFlasherClient::fingerprintData(data_, 4096)) {
+          return QS(util::error::DATA_LOSS, "fingerprint mismatch");
+        }
+        return util::Status::OK;
+      });
+    }
+    if (fc.canGetBlankMap()) {
+      measure("blank_map", "", size,
+              [&]() { return fc.blankMap(0, size).status(); });
+    }
+    fc.disconnect();
+    port.close();
+    emu.stop();
+    emu_ = nullptr;
+    return util::Status::OK;
+  }
+
+  // Writes what the host wrote, each time after the emulator has sent as
+  // much as the device had by then, or has been quiet for idleMs. The host
+  // side is not delayed otherwise, so the difference from the recorded time
+  // is the host's own overhead plus whatever the emulator models
+  // differently. Control line changes other than baud rate are ignored, the
+  // emulator is always in the boot loader.
+  util::Status replay(const SerialTrace::Trace &trace, int idleMs) {
+    ESPEmulator emu(params_);
+    util::Status st = emu.start();
+    if (!st.ok()) return st;
+
+    QSerialPort port;
+    st = openEmulator(emu, &port);
+    if (!st.ok()) return st;
+
+    quint64 expected = 0, received = 0, written = 0;
+    int stalls = 0;
+    // Waits for the device data recorded before the next host action.
+    auto catchUp = [&port, &expected, &received, &stalls, idleMs]() {
+      while (received < expected) {
+        if (port.bytesAvailable() == 0 && !port.waitForReadyRead(idleMs)) {
+          stalls++;
+          break;
+        }
+        const QByteArray data = port.readAll();
+        SerialTrace::recordRead(&port, data.constData(), data.length());
+        received += data.length();
+      }
+      // Whatever the device sent on top of the recording.
+      expected = std::max(expected, received);
+    };
+    QElapsedTimer t;
+    t.start();
+    for (const SerialTrace::Record &r : trace.records) {
+      switch (r.event) {
+        case SerialTrace::Event::Write: {
+          catchUp();
+          const qint64 n = port.write(r.data);
+          SerialTrace::recordWrite(&port, r.data.constData(), n);
+          if (n != r.data.length() || !port.waitForBytesWritten(1000)) {
+            return QS(util::error::UNAVAILABLE,
+                      QObject::tr("write failed: %1").arg(port.errorString()));
+          }
+          written += n;
+          break;
+        }
+        case SerialTrace::Event::Read:
+          expected += r.data.length();
+          break;
+        case SerialTrace::Event::BaudRate:
+          catchUp();
+          st = setSpeed(&port, r.value);
+          if (!st.ok()) return st;
+          break;
+        default:
+          break;
+      }
+    }
+    catchUp();
+    const qint64 replayMs = t.elapsed();
+    const qint64 traceMs =
+        trace.records.isEmpty() ? 0 : trace.records.last().us / 1000;
+    out_ << "# " << trace.records.size() << " records from "
+         << trace.portName << endl;
+    out_ << QString("recorded %1 ms, replayed %2 ms, %3 bytes out, %4 of %5 "
+                    "bytes in, %6 stalls")
+                .arg(traceMs)
+                .arg(replayMs)
+                .arg(written)
+                .arg(received)
+                .arg(expected)
+                .arg(stalls)
+         << endl;
+    port.close();
+    emu.stop();
+    return util::Status::OK;
+  }
+
+ private:
+  util::Status openEmulator(const ESPEmulator &emu, QSerialPort *port) {
+    port->setPortName(emu.portName());
+    port->setParity(QSerialPort::NoParity);
+    port->setFlowControl(QSerialPort::NoFlowControl);
+    if (!port->open(QIODevice::ReadWrite)) {
+      return QS(util::error::UNAVAILABLE,
+                QObject::tr("failed to open %1: %2")
+                    .arg(emu.portName())
+                    .arg(port->errorString()));
+    }
+    if (!traceFile_.isEmpty()) {
+      util::Status st = SerialTrace::start(port, traceFile_);
+      if (!st.ok()) return st;
+    }
+    return setSpeed(port, params_.romBaudRate);
+  }
+
+  void measure(const QString &op, const QString &params, quint32 bytes,
+               std::function<util::Status()> f) {
+    const ESPEmulator::Stats before = emu_->stats();
+    QElapsedTimer t;
+    t.start();
+    util::Status st = f();
+    const qint64 ms = std::max(t.elapsed(), qint64(1));
+    const ESPEmulator::Stats after = emu_->stats();
+    const quint64 wire = (after.bytesToDevice - before.bytesToDevice) +
+                         (after.bytesFromDevice - before.bytesFromDevice);
+    out_ << QString("%1 %2 %3 %4 %5 %6 %7 %8")
+                .arg(op, -14)
+                .arg(params, -11)
+                .arg(bytes, 9)
+                .arg(ms, 7)
+                .arg(bytes > 0 ? QString::number(bytes * 1000.0 / 1024 / ms,
+                                                 'f', 1)
+                               : QString("-"),
+                     8)
+                .arg(wire, 9)
+                .arg(after.overruns - before.overruns, 4)
+                .arg(st.ok() ? QString("ok")
+                             : QString::fromStdString(st.ToString()))
+         << endl;
+  }
+
+  const ESPEmulator::Params params_;
+  const qint32 baudRate_;
+  const QByteArray data_;
+  const QString traceFile_;
+  QTextStream out_;
+  ESPEmulator *emu_ = nullptr;
+};
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  QCoreApplication app(argc, argv);
+  // ESPROMClient keeps connection settings, keep them away from MFT's.
+  QCoreApplication::setOrganizationName("Cesanta");
+  QCoreApplication::setApplicationName("esp-bench");
+  qInstallMessageHandler(messageHandler);
+
+  QCommandLineParser parser;
+  parser.setApplicationDescription(
+      "Benchmarks the ESP8266 flashing protocol against an emulated device");
+  parser.addHelpOption();
+  const ESPEmulator::Params defaults;
+  parser.addOptions({
+      {kBaudRateOption, "Baud rate to flash at.", "rate", "921600"},
+      {kSizeOption, "Size of the data to write and read, multiple of 4K.",
+       "bytes", "1048576"},
+      {kDataOption, "Data to write: random, zeros or mixed.", "kind",
+       "random"},
+      {kStubVersionOption, "Stub version to emulate, 0 is the latest.",
+       "version", "0"},
+      {kRxBufSizesOption,
+       "Comma-separated list of stub receive buffer sizes to try.", "sizes",
+       QString::number(defaults.rxBufSize)},
+      {kLatencyOption, "One way latency of the serial link, in microseconds.",
+       "us", QString::number(defaults.latencyUs)},
+      {kEraseSectorOption, "Time to erase a 4K sector, in microseconds.", "us",
+       QString::number(defaults.eraseSectorUs)},
+      {kWriteOption, "Time to program 1K of flash, in microseconds.", "us",
+       QString::number(defaults.writeKBUs)},
+      {kReadOption, "Time to read 1K of flash, in microseconds.", "us",
+       QString::number(defaults.readKBUs)},
+      {kReplayOption,
+       "Instead of benchmarking, replay the host side of a trace recorded "
+       "with --trace-serial.",
+       "file"},
+      {kReplayIdleOption,
+       "When replaying, how long to wait for the emulator to send as much as "
+       "the device did before moving on.",
+       "ms", "200"},
+      {kTraceOption,
+       "Record the traffic with the emulator, see mft-trace. With several "
+       "receive buffer sizes, the last run is kept.",
+       "file"},
+      {kVerboseOption, "Show debug output of the clients."},
+  });
+  parser.process(app);
+  verbose = parser.isSet(kVerboseOption);
+
+  const int size = parser.value(kSizeOption).toInt();
+  if (size <= 0 || size % 4096 != 0) {
+    std::cerr << "Size must be a positive multiple of 4096" << std::endl;
+    return 1;
+  }
+  const QByteArray data = makeData(parser.value(kDataOption), size);
+  ESPEmulator::Params params;
+  params.stubVersion = parser.value(kStubVersionOption).toUInt();
+  params.latencyUs = parser.value(kLatencyOption).toInt();
+  params.eraseSectorUs = parser.value(kEraseSectorOption).toInt();
+  params.writeKBUs = parser.value(kWriteOption).toInt();
+  params.readKBUs = parser.value(kReadOption).toInt();
+  if (params.flashSize < quint32(size)) params.flashSize = size;
+
+  const QString traceFile = parser.value(kTraceOption);
+  if (parser.isSet(kReplayOption)) {
+    auto tr = SerialTrace::load(parser.value(kReplayOption));
+    util::Status st = tr.status();
+    if (st.ok()) {
+      Bench b(params, parser.value(kBaudRateOption).toInt(), data, traceFile);
+      st = b.replay(tr.ValueOrDie(), parser.value(kReplayIdleOption).toInt());
+    }
+    if (!st.ok()) {
+      std::cerr << st << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+
+  QTextStream out(stdout);
+  out << QString("%1 %2 %3 %4 %5 %6 %7 %8")
+             .arg("op", -14)
+             .arg("params", -11)
+             .arg("bytes", 9)
+             .arg("ms", 7)
+             .arg("KB/s", 8)
+             .arg("wire", 9)
+             .arg("ovr", 4)
+             .arg("result")
+      << endl;
+  for (const QString &s : parser.value(kRxBufSizesOption).split(',')) {
+    params.rxBufSize = s.toUInt();
+    Bench b(params, parser.value(kBaudRateOption).toInt(), data, traceFile);
+    util::Status st = b.run();
+    if (!st.ok()) {
+      std::cerr << st << std::endl;
+      return 1;
+    }
+  }
+  return 0;
+}
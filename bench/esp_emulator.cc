@@ -0,0 +1,1059 @@
+#include "esp_emulator.h"
+
+#include <algorithm>
+#include <chrono>
+#include <initializer_list>
+#include <memory>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <QDataStream>
+#include <QObject>
+
+#include "common/miniz.c"
+#include <common/platforms/esp8266/stubs/stub_flasher.h>
+
+#include "status_qt.h"
+
+namespace {
+
+const quint32 flashSectorSize = 4096;
+const quint32 flashBlockSize = 65536;
+// Must match stub_flasher.c.
+const quint32 spiWriteSize = 1024;
+const quint32 flashReadMaxBlockSize = flashSectorSize;
+// Buffer size of stubs that do not report it in the greeting.
+const quint32 legacyRxBufSize = 6144;
+// Hardware TX FIFO, the CPU only blocks in send_packet when it is full.
+const int uartFifoSize = 128;
+// Command frame that version 9+ stubs take: a command byte, args or a batch.
+const int maxCmdFrameLen = 2 + FLASH_BATCH_MAX_CMDS * 10;
+
+const quint8 slipEnd = 0xC0;
+const quint8 slipEsc = 0xDB;
+const quint8 slipEscEnd = 0xDC;
+const quint8 slipEscEsc = 0xDD;
+
+enum class ROMCommand : quint8 {
+  MemWriteStart = 0x05,
+  MemWriteFinish = 0x06,
+  MemWriteBlock = 0x07,
+  Sync = 0x08,
+  ReadRegister = 0x0A,
+};
+
+const quint32 romSoftResetEntry = 0x40000080;
+const quint32 greetingMagic = 0x4941484f;  // OHAI
+
+qint64 nowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Time it takes to process len bytes at the given cost per kilobyte.
+qint64 costNs(int usPerKB, quint32 len) {
+  return qint64(usPerKB) * 1000 * len / 1024;
+}
+
+quint32 getLE32(const QByteArray &data, int offset) {
+  const quint8 *p = reinterpret_cast<const quint8 *>(data.constData()) + offset;
+  return p[0] | (p[1] << 8) | (p[2] << 16) | (quint32(p[3]) << 24);
+}
+
+QByteArray le32(std::initializer_list<quint32> words) {
+  QByteArray result;
+  QDataStream s(&result, QIODevice::WriteOnly);
+  s.setByteOrder(QDataStream::LittleEndian);
+  for (quint32 w : words) s << w;
+  return result;
+}
+
+}  // namespace
+
+ESPEmulator::ESPEmulator(const Params &params)
+    : params_(params),
+      stubVersion_(params.stubVersion > 0 ? params.stubVersion
+                                          : STUB_FLASHER_VERSION),
+      baudRate_(params.romBaudRate) {
+  // Flash of a device that has been used before, nothing is blank.
+  flash_.resize(params_.flashSize);
+  for (int i = 0; i < flash_.size(); i++) flash_[i] = char(i * 7 + (i >> 12));
+}
+
+ESPEmulator::~ESPEmulator() {
+  stop();
+}
+
+util::Status ESPEmulator::start() {
+  master_ = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master_ < 0) {
+    return QS(util::error::UNAVAILABLE,
+              QObject::tr("posix_openpt: %1").arg(strerror(errno)));
+  }
+  if (grantpt(master_) != 0 || unlockpt(master_) != 0) {
+    return QS(util::error::UNAVAILABLE,
+              QObject::tr("unlockpt: %1").arg(strerror(errno)));
+  }
+  portName_ = QString::fromLocal8Bit(ptsname(master_));
+  fcntl(master_, F_SETFL, fcntl(master_, F_GETFL) | O_NONBLOCK);
+  stop_ = false;
+  thread_ = std::thread(&ESPEmulator::run, this);
+  return util::Status::OK;
+}
+
+void ESPEmulator::stop() {
+  stop_ = true;
+  if (thread_.joinable()) thread_.join();
+  if (master_ >= 0) {
+    close(master_);
+    master_ = -1;
+  }
+}
+
+QString ESPEmulator::portName() const {
+  return portName_;
+}
+
+ESPEmulator::Stats ESPEmulator::stats() const {
+  return Stats{bytesToDevice_, bytesFromDevice_, overruns_};
+}
+
+void ESPEmulator::run() {
+  while (romLoop()) {
+  }
+}
+
+qint64 ESPEmulator::byteNs() const {
+  // 8N1: start bit, 8 data bits, stop bit.
+  return 10 * 1000000000LL / baudRate_;
+}
+
+bool ESPEmulator::pump(qint64 untilNs) {
+  while (!stop_) {
+    qint64 now = nowNs();
+    quint8 buf[4096];
+    ssize_t n;
+    while ((n = read(master_, buf, sizeof(buf))) > 0) {
+      for (ssize_t i = 0; i < n; i++) {
+        rxFreeNs_ = std::max(rxFreeNs_, now) + byteNs();
+        rx_.push_back(RxByte{rxFreeNs_ + params_.latencyUs * 1000LL, buf[i]});
+      }
+      bytesToDevice_ += n;
+    }
+    // EIO means the host does not have the terminal open.
+    const bool hup = (n < 0 && errno == EIO);
+    while (!tx_.empty() && tx_.front().dueNs <= now) {
+      TxChunk &c = tx_.front();
+      n = write(master_, c.data.constData() + c.offset,
+                c.data.length() - c.offset);
+      if (n < 0) {
+        // Nobody is listening, the bytes are lost just as on a real line.
+        if (errno == EIO) n = c.data.length() - c.offset;
+        if (errno == EAGAIN) break;
+      }
+      c.offset += n;
+      bytesFromDevice_ += n;
+      if (c.offset < c.data.length()) break;
+      tx_.pop_front();
+    }
+    now = nowNs();
+    if (now >= untilNs) return true;
+    qint64 waitNs = std::min(untilNs - now, 10000000LL);
+    if (!tx_.empty()) {
+      waitNs = std::min(waitNs, std::max(tx_.front().dueNs - now, 0LL));
+    }
+    const bool txStalled = !tx_.empty() && tx_.front().dueNs <= now;
+    struct pollfd pfd = {master_, short(txStalled ? POLLOUT : POLLIN), 0};
+    struct timespec ts = {time_t(waitNs / 1000000000LL),
+                          long(waitNs % 1000000000LL)};
+    if (hup) {
+      nanosleep(&ts, nullptr);
+    } else {
+      ppoll(&pfd, 1, &ts, nullptr);
+    }
+  }
+  return false;
+}
+
+bool ESPEmulator::busy(qint64 ns) {
+  return pump(nowNs() + ns);
+}
+
+int ESPEmulator::rxArrived() const {
+  const qint64 now = nowNs();
+  // Arrival times are monotonic, find the first byte still on the wire.
+  auto it = std::lower_bound(
+      rx_.begin(), rx_.end(), now,
+      [](const RxByte &b, qint64 t) { return b.atNs <= t; });
+  return it - rx_.begin();
+}
+
+int ESPEmulator::rxWait(int n, qint64 deadlineNs) {
+  while (true) {
+    if (!pump(nowNs())) return kStopped;
+    if (rxArrived() >= n) return 1;
+    const qint64 now = nowNs();
+    if (deadlineNs >= 0 && now >= deadlineNs) return 0;
+    qint64 untilNs = now + 10000000LL;
+    if (int(rx_.size()) >= n) untilNs = rx_[n - 1].atNs;
+    if (deadlineNs >= 0) untilNs = std::min(untilNs, deadlineNs);
+    if (!pump(untilNs)) return kStopped;
+  }
+}
+
+QByteArray ESPEmulator::rxTake(int n) {
+  QByteArray result;
+  result.reserve(n);
+  for (int i = 0; i < n && !rx_.empty(); i++) {
+    result.append(char(rx_.front().b));
+    rx_.pop_front();
+  }
+  return result;
+}
+
+bool ESPEmulator::send(const QByteArray &data) {
+  const qint64 now = nowNs();
+  txFreeNs_ = std::max(txFreeNs_, now) + data.length() * byteNs();
+  tx_.push_back(TxChunk{txFreeNs_ + params_.latencyUs * 1000LL, data, 0});
+  // The CPU waits for space in the TX FIFO.
+  return pump(txFreeNs_ - uartFifoSize * byteNs());
+}
+
+bool ESPEmulator::slipSend(const QByteArray &data) {
+  QByteArray frame;
+  frame.reserve(data.length() + 2);
+  frame.append(char(slipEnd));
+  for (char c : data) {
+    if (quint8(c) == slipEnd) {
+      frame.append(char(slipEsc)).append(char(slipEscEnd));
+    } else if (quint8(c) == slipEsc) {
+      frame.append(char(slipEsc)).append(char(slipEscEsc));
+    } else {
+      frame.append(c);
+    }
+  }
+  frame.append(char(slipEnd));
+  return send(frame);
+}
+
+int ESPEmulator::recvByte(qint64 deadlineNs) {
+  const int r = rxWait(1, deadlineNs);
+  if (r <= 0) return r == 0 ? 0 : kStopped;
+  const quint8 b = rx_.front().b;
+  rx_.pop_front();
+  return 0x100 | b;
+}
+
+int ESPEmulator::slipRecv(QByteArray *frame, int maxLen, qint64 timeoutUs) {
+  const qint64 deadlineNs = timeoutUs >= 0 ? nowNs() + timeoutUs * 1000 : -1;
+  int c;
+  frame->clear();
+  do {
+    if ((c = recvByte(deadlineNs)) <= 0) return c;
+  } while (quint8(c) != slipEnd);
+  while (frame->length() < maxLen) {
+    if ((c = recvByte(deadlineNs)) <= 0) return c;
+    if (quint8(c) == slipEnd) return 1;
+    if (quint8(c) == slipEsc) {
+      if ((c = recvByte(deadlineNs)) <= 0) return c;
+      if (quint8(c) == slipEscEnd) {
+        c = slipEnd;
+      } else if (quint8(c) == slipEscEsc) {
+        c = slipEsc;
+      } else {
+        frame->clear();
+        break;  // Bad esc sequence.
+      }
+    }
+    frame->append(char(c));
+  }
+  do {
+    if ((c = recvByte(deadlineNs)) <= 0) return c;
+  } while (quint8(c) != slipEnd);
+  return 1;
+}
+
+bool ESPEmulator::romLoop() {
+  QByteArray frame;
+  // Unused header fields, the largest block ROM accepts and plenty of spare.
+  if (slipRecv(&frame, 0x4000 + 64) == kStopped) return false;
+  if (frame.length() < 8 || frame.at(0) != 0) return true;
+  const quint8 cmd = frame.at(1);
+  const quint8 csum = frame.at(4);
+  const QByteArray data = frame.mid(8);
+  if (!busy(params_.romCommandUs * 1000LL)) return false;
+  bool ok = true;
+  switch (static_cast<ROMCommand>(cmd)) {
+    case ROMCommand::Sync: {
+      for (int i = 0; i < 8 && ok; i++) ok = romResponse(cmd, 0, 0, 0);
+      break;
+    }
+    case ROMCommand::MemWriteStart: {
+      memSeq_ = 0;
+      memParams_.clear();
+      ok = romResponse(cmd, 0, data.length() == 16 ? 0 : 1, 0);
+      break;
+    }
+    case ROMCommand::MemWriteBlock: {
+      if (data.length() < 16 ||
+          getLE32(data, 0) != quint32(data.length() - 16)) {
+        ok = romResponse(cmd, 0, 1, 0x05);
+        break;
+      }
+      const QByteArray block = data.mid(16);
+      quint8 bcsum = 0xEF;
+      for (char c : block) bcsum ^= quint8(c);
+      if (getLE32(data, 4) != memSeq_ || bcsum != csum) {
+        ok = romResponse(cmd, 0, 1, 0x07);
+        break;
+      }
+      if (memSeq_ == 0) memParams_ = block.left(4);
+      memSeq_++;
+      ok = romResponse(cmd, 0, 0, 0);
+      break;
+    }
+    case ROMCommand::MemWriteFinish: {
+      if (data.length() != 8) {
+        ok = romResponse(cmd, 0, 1, 0x05);
+        break;
+      }
+      const quint32 noJump = getLE32(data, 0), entry = getLE32(data, 4);
+      ok = romResponse(cmd, 0, 0, 0);
+      // Soft reset just comes back to the loader.
+      if (ok && noJump == 0 && entry != romSoftResetEntry &&
+          memParams_.length() == 4) {
+        ok = runStub(getLE32(memParams_, 0));
+        baudRate_ = params_.romBaudRate;
+      }
+      break;
+    }
+    case ROMCommand::ReadRegister: {
+      quint32 value = 0;
+      const quint32 addr = data.length() == 4 ? getLE32(data, 0) : 0;
+      if (addr == 0x3ff00050) value = 0x56000000;  // MAC byte 5.
+      if (addr == 0x3ff00054) value = 0x00001234;  // OUI 0, bytes 3 and 4.
+      ok = romResponse(cmd, value, 0, 0);
+      break;
+    }
+    default: {
+      ok = romResponse(cmd, 0, 1, 0x05);
+      break;
+    }
+  }
+  return ok;
+}
+
+bool ESPEmulator::romResponse(quint8 cmd, quint32 value, quint8 status,
+                              quint8 error) {
+  QByteArray resp;
+  QDataStream s(&resp, QIODevice::WriteOnly);
+  s.setByteOrder(QDataStream::LittleEndian);
+  s << quint8(1) << cmd << quint16(2) << value << status << error;
+  return slipSend(resp);
+}
+
+bool ESPEmulator::runStub(quint32 baudRate) {
+  if (baudRate > 0) {
+    if (!busy(1000000)) return false;
+    baudRate_ = baudRate;
+  }
+  // Give host time to get ready too.
+  if (!busy(10000000)) return false;
+  QByteArray greeting = le32({greetingMagic});
+  if (stubVersion_ >= 1) greeting.append(le32({stubVersion_}));
+  if (stubVersion_ >= 7) greeting.append(le32({params_.rxBufSize}));
+  if (!slipSend(greeting)) return false;
+  quint8 cmd = 0xff;
+  do {
+    QByteArray frame, args;
+    // Since version 9 args may come in the same frame as the command.
+    int r = slipRecv(&frame, stubVersion_ >= 9 ? maxCmdFrameLen : 1);
+    if (r == kStopped) return false;
+    if (frame.isEmpty()) continue;
+    cmd = frame.at(0);
+    int resp = 0xff;
+    switch (cmd) {
+      case CMD_FLASH_ERASE: {
+        if (!recvArgs(frame, &args)) return false;
+        resp = args.length() == 8
+                   ? doErase(getLE32(args, 0), getLE32(args, 4))
+                   : 0x31;
+        break;
+      }
+      case CMD_FLASH_WRITE: {
+        if (!recvArgs(frame, &args)) return false;
+        if (args.length() == 12) {
+          WriteCtx wc;
+          wc.regions.append(qMakePair(getLE32(args, 0), getLE32(args, 4)));
+          wc.erase = getLE32(args, 8);
+          resp = doWriteRegions(&wc, 0);
+        } else {
+          resp = 0x41;
+        }
+        break;
+      }
+      case CMD_FLASH_READ: {
+        if (!recvArgs(frame, &args)) return false;
+        // Version 0 takes no max_in_flight and expects no acks.
+        const bool acked = (stubVersion_ >= 1);
+        if (args.length() == (acked ? 16 : 12)) {
+          resp = doRead(getLE32(args, 0), getLE32(args, 4), getLE32(args, 8),
+                        acked ? getLE32(args, 12) : 0, acked);
+        } else {
+          resp = 0x51;
+        }
+        break;
+      }
+      case CMD_FLASH_DIGEST: {
+        if (!recvArgs(frame, &args)) return false;
+        resp = args.length() == 12 ? doDigest(getLE32(args, 0),
+                                              getLE32(args, 4),
+                                              getLE32(args, 8))
+                                   : 0x61;
+        break;
+      }
+      case CMD_FLASH_WRITE_DEFLATED: {
+        if (stubVersion_ < 1) break;
+        if (!recvArgs(frame, &args)) return false;
+        if (args.length() == 16) {
+          WriteCtx wc;
+          wc.regions.append(qMakePair(getLE32(args, 0), getLE32(args, 4)));
+          wc.erase = getLE32(args, 8);
+          wc.longStatus = true;
+          resp = doWriteRegions(&wc, getLE32(args, 12));
+        } else {
+          resp = 0x71;
+        }
+        break;
+      }
+      case CMD_FLASH_WRITE_REGIONS:
+      case CMD_FLASH_WRITE_CHANGED: {
+        if (stubVersion_ < (cmd == CMD_FLASH_WRITE_CHANGED ? 10 : 2)) break;
+        if (!recvArgs(frame, &args)) return false;
+        const quint32 numRegions = args.length() == 12 ? getLE32(args, 0) : 0;
+        if (numRegions == 0 || numRegions > FLASH_WRITE_MAX_REGIONS) {
+          resp = 0x81;
+          break;
+        }
+        QByteArray list;
+        if ((r = slipRecv(&list, FLASH_WRITE_MAX_REGIONS * 8)) == kStopped) {
+          return false;
+        }
+        if (quint32(list.length()) != numRegions * 8) {
+          resp = 0x82;
+          break;
+        }
+        WriteCtx wc;
+        for (quint32 i = 0; i < numRegions; i++) {
+          wc.regions.append(
+              qMakePair(getLE32(list, i * 8), getLE32(list, i * 8 + 4)));
+        }
+        wc.erase = getLE32(args, 4);
+        wc.longStatus = true;
+        wc.changedOnly = (cmd == CMD_FLASH_WRITE_CHANGED);
+        resp = doWriteRegions(&wc, getLE32(args, 8));
+        break;
+      }
+      case CMD_FLASH_PATCH: {
+        if (stubVersion_ < 11) break;
+        if (!recvArgs(frame, &args)) return false;
+        const quint32 numPatches = args.length() == 8 ? getLE32(args, 0) : 0;
+        if (numPatches == 0 || numPatches > FLASH_WRITE_MAX_REGIONS ||
+            getLE32(args, 4) > FLASH_PATCH_MAX_LEN) {
+          resp = 0xf1;
+          break;
+        }
+        QByteArray list, data;
+        if (slipRecv(&list, FLASH_WRITE_MAX_REGIONS * 8) == kStopped ||
+            slipRecv(&data, FLASH_PATCH_MAX_LEN) == kStopped) {
+          return false;
+        }
+        if (quint32(list.length()) != numPatches * 8 ||
+            quint32(data.length()) != getLE32(args, 4)) {
+          resp = 0xf2;
+          break;
+        }
+        QVector<QPair<quint32, quint32>> patches;
+        for (quint32 i = 0; i < numPatches; i++) {
+          patches.append(
+              qMakePair(getLE32(list, i * 8), getLE32(list, i * 8 + 4)));
+        }
+        resp = doPatch(patches, data);
+        break;
+      }
+      case CMD_SET_BAUD_RATE: {
+        if (stubVersion_ < 3) break;
+        if (!recvArgs(frame, &args)) return false;
+        resp = args.length() == 4 ? doSetBaudRate(getLE32(args, 0)) : 0xa1;
+        break;
+      }
+      case CMD_FLASH_FINGERPRINT: {
+        if (stubVersion_ < 4) break;
+        if (!recvArgs(frame, &args)) return false;
+        resp = args.length() == 12 ? doFingerprint(getLE32(args, 0),
+                                                   getLE32(args, 4),
+                                                   getLE32(args, 8))
+                                   : 0xb1;
+        break;
+      }
+      case CMD_FLASH_BLANK_MAP: {
+        if (stubVersion_ < 5) break;
+        if (!recvArgs(frame, &args)) return false;
+        resp = args.length() == 8
+                   ? doBlankMap(getLE32(args, 0), getLE32(args, 4))
+                   : 0xc1;
+        break;
+      }
+      case CMD_SET_SPI_PARAMS: {
+        if (stubVersion_ < 8) break;
+        if (!recvArgs(frame, &args)) return false;
+        // Flash timings are parameters of the emulator, nothing to change.
+        resp = args.length() == 4 ? 0 : 0xd3;
+        break;
+      }
+      case CMD_BATCH: {
+        if (stubVersion_ < 9) break;
+        resp = doBatch(frame.mid(1));
+        break;
+      }
+      case CMD_FLASH_READ_CHIP_ID: {
+        resp = slipSend(le32({chipID()})) ? 0 : kStopped;
+        break;
+      }
+      case CMD_FLASH_ERASE_CHIP: {
+        const quint32 numBlocks = params_.flashSize / flashBlockSize;
+        resp = busy(numBlocks * params_.eraseBlockUs * 1000LL / 2) ? 0
+                                                                   : kStopped;
+        flash_.fill('\xff');
+        break;
+      }
+      case CMD_BOOT_FW:
+      case CMD_REBOOT: {
+        resp = 0;
+        break;
+      }
+    }
+    if (resp == kStopped) return false;
+    if (!slipSend(QByteArray(1, char(resp)))) return false;
+  } while (cmd != CMD_BOOT_FW && cmd != CMD_REBOOT);
+  // Either way the host gets the ROM loader back, there is no firmware.
+  return busy(10000000);
+}
+
+bool ESPEmulator::recvArgs(const QByteArray &frame, QByteArray *args) {
+  if (frame.length() > 1) {
+    *args = frame.mid(1);
+    return true;
+  }
+  return slipRecv(args, 16) != kStopped;
+}
+
+bool ESPEmulator::inFlash(quint32 addr, quint32 len) const {
+  return quint64(addr) + len <= params_.flashSize;
+}
+
+int ESPEmulator::isBlank(quint32 addr, quint32 len) {
+  if (!inFlash(addr, len)) return 0;
+  while (len > 0) {
+    const quint32 n = std::min(len, spiWriteSize);
+    if (!busy(costNs(params_.readKBUs, n))) return kStopped;
+    const char *p = flash_.constData() + addr;
+    for (quint32 i = 0; i < n; i++) {
+      if (p[i] != '\xff') return 0;
+    }
+    addr += n;
+    len -= n;
+  }
+  return 1;
+}
+
+bool ESPEmulator::eraseSector(quint32 addr) {
+  if (!inFlash(addr, flashSectorSize)) return false;
+  if (!busy(params_.eraseSectorUs * 1000LL)) return false;
+  memset(flash_.data() + addr, 0xff, flashSectorSize);
+  return true;
+}
+
+bool ESPEmulator::eraseBlock(quint32 addr) {
+  if (!inFlash(addr, flashBlockSize)) return false;
+  if (!busy(params_.eraseBlockUs * 1000LL)) return false;
+  memset(flash_.data() + addr, 0xff, flashBlockSize);
+  return true;
+}
+
+int ESPEmulator::doErase(quint32 addr, quint32 len) {
+  if (addr % flashSectorSize != 0) return 0x32;
+  if (len % flashSectorSize != 0) return 0x33;
+  while (len > 0 && (addr % flashBlockSize != 0)) {
+    if (!eraseSector(addr)) return stop_ ? kStopped : 0x35;
+    len -= flashSectorSize;
+    addr += flashSectorSize;
+  }
+  while (len > flashBlockSize) {
+    if (!eraseBlock(addr)) return stop_ ? kStopped : 0x36;
+    len -= flashBlockSize;
+    addr += flashBlockSize;
+  }
+  while (len > 0) {
+    if (!eraseSector(addr)) return stop_ ? kStopped : 0x37;
+    len -= flashSectorSize;
+    addr += flashSectorSize;
+  }
+  return 0;
+}
+
+quint32 ESPEmulator::rxBufSize() const {
+  return stubVersion_ >= 7 ? params_.rxBufSize : legacyRxBufSize;
+}
+
+void ESPEmulator::checkOverrun(WriteCtx *wc) {
+  if (quint32(rxArrived()) > rxBufSize()) wc->overrun = true;
+}
+
+int ESPEmulator::eraseNext(WriteCtx *wc, bool useBlocks, quint32 until) {
+  const QPair<quint32, quint32> &r = wc->regions[wc->cur];
+  while (wc->numErased < until) {
+    const quint32 eraseAddr = r.first + wc->numErased;
+    const quint32 numLeft = r.second - wc->numErased;
+    // Older stubs erase whatever is there.
+    const int blank = stubVersion_ >= 5 ? 1 : 0;
+    if (useBlocks && numLeft > flashBlockSize &&
+        eraseAddr % flashBlockSize == 0) {
+      int b = blank ? isBlank(eraseAddr, flashBlockSize) : 0;
+      if (b == kStopped) return kStopped;
+      if (!b && !eraseBlock(eraseAddr)) return stop_ ? kStopped : 0x35;
+      wc->numErased += flashBlockSize;
+    } else {
+      int b = blank ? isBlank(eraseAddr, flashSectorSize) : 0;
+      if (b == kStopped) return kStopped;
+      if (!b && !eraseSector(eraseAddr)) return stop_ ? kStopped : 0x36;
+      wc->numErased += flashSectorSize;
+    }
+    checkOverrun(wc);
+  }
+  return 0;
+}
+
+int ESPEmulator::eraseAhead(WriteCtx *wc, bool *erased) {
+  *erased = false;
+  // Older stubs only erase right before writing.
+  if (stubVersion_ < 7 || !wc->erase || wc->changedOnly ||
+      wc->cur >= wc->regions.size()) {
+    return 0;
+  }
+  const QPair<quint32, quint32> &r = wc->regions[wc->cur];
+  if (wc->numErased >= r.second) return 0;
+  *erased = true;
+  // Sector by sector, data keeps arriving meanwhile.
+  return eraseNext(wc, false, wc->numErased + flashSectorSize);
+}
+
+int ESPEmulator::programChunk(quint32 addr, const char *data) {
+  if (!busy(costNs(params_.writeKBUs, spiWriteSize))) return kStopped;
+  if (!inFlash(addr, spiWriteSize)) return 0x37;
+  // NOR flash can only clear bits.
+  char *f = flash_.data() + addr;
+  for (quint32 i = 0; i < spiWriteSize; i++) f[i] &= data[i];
+  if (stubVersion_ >= 6) {
+    if (!busy(costNs(params_.readKBUs, spiWriteSize))) return kStopped;
+    if (memcmp(flash_.constData() + addr, data, spiWriteSize) != 0) {
+      return 0x3c;
+    }
+  }
+  return 0;
+}
+
+int ESPEmulator::writeChangedChunk(WriteCtx *wc, const char *data) {
+  const QPair<quint32, quint32> &r = wc->regions[wc->cur];
+  wc->sector.append(data, spiWriteSize);
+  if (quint32(wc->sector.size()) < flashSectorSize) return 0;
+  const quint32 addr =
+      r.first + wc->numWritten + spiWriteSize - flashSectorSize;
+  if (!inFlash(addr, flashSectorSize)) return 0x37;
+  if (!busy(costNs(params_.readKBUs, flashSectorSize))) return kStopped;
+  const QByteArray sector = wc->sector;
+  wc->sector.clear();
+  if (memcmp(flash_.constData() + addr, sector.constData(),
+             flashSectorSize) == 0) {
+    return 0;
+  }
+  const quint32 n = (addr - r.first) / flashSectorSize;
+  wc->changed[n / 8] = wc->changed[n / 8] | (1 << (n % 8));
+  if (wc->erase) {
+    const int b = isBlank(addr, flashSectorSize);
+    if (b == kStopped) return kStopped;
+    if (!b && !eraseSector(addr)) return stop_ ? kStopped : 0x36;
+  }
+  for (quint32 i = 0; i < flashSectorSize; i += spiWriteSize) {
+    const int ret = programChunk(addr + i, sector.constData() + i);
+    if (ret != 0) return ret;
+  }
+  return 0;
+}
+
+int ESPEmulator::writeChunk(WriteCtx *wc, const char *data,
+                            quint32 numConsumed) {
+  if (wc->cur >= wc->regions.size()) return 0x38;
+  const QPair<quint32, quint32> &r = wc->regions[wc->cur];
+  wc->md5.addData(data, spiWriteSize);
+  if (!busy(costNs(params_.hashKBUs, spiWriteSize))) return kStopped;
+  int ret;
+  if (wc->changedOnly) {
+    ret = writeChangedChunk(wc, data);
+  } else {
+    ret = wc->erase ? eraseNext(wc, true, wc->numWritten + spiWriteSize) : 0;
+    if (ret == 0) ret = programChunk(r.first + wc->numWritten, data);
+  }
+  if (ret != 0) return ret;
+  checkOverrun(wc);
+  wc->numWritten += spiWriteSize;
+  wc->totalWritten += spiWriteSize;
+  if (!sendWriteStatus(*wc, numConsumed)) return kStopped;
+  if (wc->numWritten == r.second) {
+    const int bitmapLen =
+        wc->changedOnly ? (r.second / flashSectorSize + 7) / 8 : 0;
+    if (!slipSend(wc->md5.result() + wc->changed.left(bitmapLen))) {
+      return kStopped;
+    }
+    wc->changed.fill(0);
+    wc->md5.reset();
+    wc->cur++;
+    wc->numWritten = wc->numErased = 0;
+  }
+  return 0;
+}
+
+bool ESPEmulator::sendWriteStatus(const WriteCtx &wc, quint32 numConsumed) {
+  if (wc.longStatus) {
+    return slipSend(le32({numConsumed, wc.totalWritten}));
+  }
+  return slipSend(le32({wc.totalWritten}));
+}
+
+int ESPEmulator::doWriteRegions(WriteCtx *wc, quint32 zlen) {
+  quint32 totalLen = 0, numConsumed = 0, numReported = 0;
+  for (const auto &r : wc->regions) {
+    if (r.first % flashSectorSize != 0) return 0x32;
+    if (r.second == 0 || r.second % flashSectorSize != 0) return 0x33;
+    if (wc->changedOnly &&
+        r.second / flashSectorSize > FLASH_BLANK_MAP_MAX_SECTORS) {
+      return 0x3d;
+    }
+    totalLen += r.second;
+  }
+  wc->changed = QByteArray(FLASH_BLANK_MAP_MAX_SECTORS / 8, 0);
+  int ret = sendWriteStatus(*wc, numConsumed) ? 0 : kStopped;
+
+  while (ret == 0 && zlen == 0 && wc->totalWritten < totalLen) {
+    // Wait for data to arrive, erasing ahead meanwhile.
+    while (quint32(rxArrived()) < spiWriteSize) {
+      bool erased;
+      if ((ret = eraseAhead(wc, &erased)) != 0) break;
+      if (!erased && rxWait(spiWriteSize, -1) == kStopped) ret = kStopped;
+      if (ret != 0) break;
+    }
+    if (ret != 0) break;
+    checkOverrun(wc);
+    const QByteArray chunk = rxTake(spiWriteSize);
+    ret = writeChunk(wc, chunk.constData(), numConsumed + spiWriteSize);
+    numConsumed += spiWriteSize;
+  }
+
+  std::unique_ptr<tinfl_decompressor> inf(new tinfl_decompressor);
+  QByteArray dict(TINFL_LZ_DICT_SIZE, 0);
+  quint8 *dictp = reinterpret_cast<quint8 *>(dict.data());
+  quint32 outPos = 0, flushedPos = 0;
+  tinfl_status status = TINFL_STATUS_NEEDS_MORE_INPUT;
+  tinfl_init(inf.get());
+  while (ret == 0 && zlen > 0 && status != TINFL_STATUS_DONE) {
+    mz_uint32 flags = TINFL_FLAG_PARSE_ZLIB_HEADER;
+    size_t inLen = 0, outLen = dict.size() - outPos;
+    QByteArray in;
+    if (numConsumed < zlen) {
+      if (rxArrived() == 0 && numConsumed != numReported) {
+        // Let the host know there is space in the buffer.
+        if (!sendWriteStatus(*wc, numConsumed)) ret = kStopped;
+        numReported = numConsumed;
+      }
+      while (ret == 0 && rxArrived() == 0) {
+        bool erased;
+        if ((ret = eraseAhead(wc, &erased)) != 0) break;
+        if (!erased && rxWait(1, -1) == kStopped) ret = kStopped;
+      }
+      if (ret != 0) break;
+      checkOverrun(wc);
+      inLen = std::min(quint32(rxArrived()), rxBufSize());
+      for (size_t i = 0; i < inLen; i++) in.append(char(rx_[i].b));
+      if (numConsumed + inLen < zlen) flags |= TINFL_FLAG_HAS_MORE_INPUT;
+    }
+    status = tinfl_decompress(
+        inf.get(), reinterpret_cast<const mz_uint8 *>(in.constData()), &inLen,
+        dictp, dictp + outPos, &outLen, flags);
+    if (status < TINFL_STATUS_DONE ||
+        (status == TINFL_STATUS_NEEDS_MORE_INPUT && numConsumed == zlen)) {
+      ret = 0x39;
+      break;
+    }
+    if (!busy(costNs(params_.inflateKBUs, outLen))) ret = kStopped;
+    rxTake(inLen);
+    numConsumed += inLen;
+    outPos += outLen;
+    // Write out complete chunks. TINFL_LZ_DICT_SIZE % spiWriteSize == 0.
+    while (ret == 0 && outPos - flushedPos >= spiWriteSize) {
+      ret = writeChunk(wc, dict.constData() + flushedPos, numConsumed);
+      flushedPos += spiWriteSize;
+      numReported = numConsumed;
+    }
+    if (outPos == quint32(dict.size())) outPos = flushedPos = 0;
+  }
+
+  if (ret == 0 && (wc->totalWritten != totalLen || outPos != flushedPos)) {
+    ret = 0x3a;
+  }
+  if (wc->overrun) overruns_++;
+  return ret;
+}
+
+int ESPEmulator::doRead(quint32 addr, quint32 len, quint32 blockSize,
+                        quint32 maxInFlight, bool acked) {
+  QCryptographicHash md5(QCryptographicHash::Md5);
+  quint32 numSent = 0, numAcked = 0;
+  if (blockSize == 0 || blockSize > flashReadMaxBlockSize) return 0x52;
+  if (!acked) maxInFlight = len;
+  while (numAcked < len) {
+    while (numSent < len && numSent - numAcked < maxInFlight) {
+      const quint32 n = std::min(len - numSent, blockSize);
+      if (!inFlash(addr, n)) return 0x53;
+      if (!busy(costNs(params_.readKBUs, n))) return kStopped;
+      const QByteArray block = flash_.mid(addr, n);
+      if (!slipSend(block)) return kStopped;
+      md5.addData(block);
+      addr += n;
+      numSent += n;
+    }
+    if (!acked) {
+      numAcked = numSent;
+      continue;
+    }
+    QByteArray ack;
+    if (slipRecv(&ack, 4) == kStopped) return kStopped;
+    if (ack.length() != 4) return 0x54;
+    numAcked = getLE32(ack, 0);
+    if (numAcked > numSent) return 0x55;
+  }
+  return slipSend(md5.result()) ? 0 : kStopped;
+}
+
+int ESPEmulator::flashDigest(quint32 addr, quint32 len, quint32 blockSize,
+                             QByteArray *digest) {
+  QCryptographicHash md5(QCryptographicHash::Md5);
+  const quint32 readBlockSize = blockSize ? blockSize : flashSectorSize;
+  if (blockSize > flashSectorSize) return 0x62;
+  while (len > 0) {
+    const quint32 n = std::min(len, readBlockSize);
+    if (!inFlash(addr, n)) return 0x63;
+    qint64 ns = costNs(params_.readKBUs, n) + costNs(params_.hashKBUs, n);
+    if (blockSize > 0) ns += costNs(params_.hashKBUs, n);
+    if (!busy(ns)) return kStopped;
+    const QByteArray block = flash_.mid(addr, n);
+    md5.addData(block);
+    if (blockSize > 0 &&
+        !slipSend(QCryptographicHash::hash(block, QCryptographicHash::Md5))) {
+      return kStopped;
+    }
+    addr += n;
+    len -= n;
+  }
+  *digest = md5.result();
+  return 0;
+}
+
+int ESPEmulator::doDigest(quint32 addr, quint32 len, quint32 blockSize) {
+  QByteArray digest;
+  const int ret = flashDigest(addr, len, blockSize, &digest);
+  if (ret != 0) return ret;
+  return slipSend(digest) ? 0 : kStopped;
+}
+
+quint32 ESPEmulator::chipID() const {
+  int sizeLog2 = 0;
+  while ((1U << (sizeLog2 + 1)) <= params_.flashSize) sizeLog2++;
+  // Winbond, 25Q series.
+  return 0xEF | (0x40 << 8) | (sizeLog2 << 16);
+}
+
+int ESPEmulator::doBatch(const QByteArray &cmds) {
+  auto argsLen = [](quint8 cmd) {
+    switch (cmd) {
+      case CMD_FLASH_ERASE:
+      case CMD_FLASH_DIGEST:
+        return 8;
+      case CMD_FLASH_READ_CHIP_ID:
+        return 0;
+    }
+    return -1;
+  };
+  const int numCmds = cmds.isEmpty() ? 0 : quint8(cmds.at(0));
+  if (numCmds == 0 || numCmds > FLASH_BATCH_MAX_CMDS) return 0xe1;
+  int off = 1;
+  for (int i = 0; i < numCmds; i++) {
+    const int n = off + 2 <= cmds.length() ? argsLen(cmds.at(off + 1)) : -1;
+    if (n < 0 || off + 2 + n > cmds.length()) return 0xe2;
+    off += 2 + n;
+  }
+  if (off != cmds.length()) return 0xe2;
+  off = 1;
+  for (int i = 0; i < numCmds; i++) {
+    const quint8 cmd = cmds.at(off + 1);
+    QByteArray resp = cmds.mid(off, 1), out;
+    int ret = 0;
+    if (cmd == CMD_FLASH_ERASE) {
+      ret = doErase(getLE32(cmds, off + 2), getLE32(cmds, off + 6));
+    } else if (cmd == CMD_FLASH_DIGEST) {
+      ret = flashDigest(getLE32(cmds, off + 2), getLE32(cmds, off + 6), 0,
+                        &out);
+    } else {
+      out = le32({chipID()});
+    }
+    if (ret == kStopped) return kStopped;
+    resp.append(char(ret));
+    if (ret == 0) resp.append(out);
+    if (!slipSend(resp)) return kStopped;
+    if (ret != 0) return ret;
+    off += 2 + argsLen(cmd);
+  }
+  return 0;
+}
+
+int ESPEmulator::doFingerprint(quint32 addr, quint32 len, quint32 blockSize) {
+  QByteArray result;
+  if (blockSize == 0 || blockSize > flashSectorSize) return 0xb2;
+  if ((len + blockSize - 1) / blockSize > FLASH_FINGERPRINT_MAX_BLOCKS) {
+    return 0xb2;
+  }
+  while (len > 0) {
+    const quint32 n = std::min(len, blockSize);
+    if (!inFlash(addr, n)) return 0xb3;
+    if (!busy(costNs(params_.readKBUs, n) + costNs(params_.hashKBUs, n))) {
+      return kStopped;
+    }
+    const auto *p = reinterpret_cast<const quint8 *>(flash_.constData()) + addr;
+    result.append(le32({quint32(mz_crc32(MZ_CRC32_INIT, p, n))}));
+    addr += n;
+    len -= n;
+  }
+  return slipSend(result) ? 0 : kStopped;
+}
+
+int ESPEmulator::doBlankMap(quint32 addr, quint32 len) {
+  const quint32 numSectors = len / flashSectorSize;
+  if (addr % flashSectorSize != 0 || len % flashSectorSize != 0 ||
+      numSectors == 0 || numSectors > FLASH_BLANK_MAP_MAX_SECTORS) {
+    return 0xc2;
+  }
+  QByteArray map((numSectors + 7) / 8, 0);
+  for (quint32 i = 0; i < numSectors; i++) {
+    const int b = isBlank(addr + i * flashSectorSize, flashSectorSize);
+    if (b == kStopped) return kStopped;
+    if (b) map.data()[i / 8] |= (1 << (i % 8));
+  }
+  return slipSend(map) ? 0 : kStopped;
+}
+
+int ESPEmulator::flushPatchedSector(quint32 addr, const QByteArray &sector,
+                                    quint32 stats[2]) {
+  if (!inFlash(addr, flashSectorSize)) return 0xf5;
+  if (!busy(costNs(params_.readKBUs, flashSectorSize))) return kStopped;
+  const char *f = flash_.constData() + addr;
+  bool erase = false;
+  QVector<bool> changed;
+  for (quint32 off = 0; off < flashSectorSize; off += spiWriteSize) {
+    bool c = false;
+    for (quint32 i = off; i < off + spiWriteSize; i++) {
+      if (f[i] != sector[i]) c = true;
+      if ((f[i] & sector[i]) != sector[i]) erase = true;
+    }
+    changed.append(c);
+  }
+  if (!changed.contains(true)) return 0;
+  if (erase && !eraseSector(addr)) return stop_ ? kStopped : 0xf6;
+  for (quint32 off = 0; off < flashSectorSize; off += spiWriteSize) {
+    if (!erase && !changed[off / spiWriteSize]) continue;
+    const int ret = programChunk(addr + off, sector.constData() + off);
+    if (ret != 0) return ret;
+  }
+  stats[0]++;
+  if (erase) stats[1]++;
+  return 0;
+}
+
+int ESPEmulator::doPatch(const QVector<QPair<quint32, quint32>> &patches,
+                         const QByteArray &data) {
+  quint32 len = 0, pos = 0, stats[2] = {0, 0};
+  for (const auto &p : patches) {
+    if (p.first + p.second < p.first) return 0xf3;
+    len += p.second;
+  }
+  if (len != quint32(data.length())) return 0xf3;
+  const quint32 none = 1;  // Not a sector address.
+  quint32 cur = none;
+  QByteArray sector;
+  int ret;
+  for (const auto &p : patches) {
+    quint32 addr = p.first, left = p.second;
+    while (left > 0) {
+      const quint32 off = addr % flashSectorSize;
+      const quint32 n = std::min(left, flashSectorSize - off);
+      if (addr - off != cur) {
+        if (cur != none) {
+          ret = flushPatchedSector(cur, sector, stats);
+          if (ret != 0) return ret;
+        }
+        cur = addr - off;
+        if (!inFlash(cur, flashSectorSize)) return 0xf4;
+        if (!busy(costNs(params_.readKBUs, flashSectorSize))) return kStopped;
+        sector = flash_.mid(cur, flashSectorSize);
+      }
+      memcpy(sector.data() + off, data.constData() + pos, n);
+      addr += n;
+      left -= n;
+      pos += n;
+    }
+  }
+  if (cur != none) {
+    ret = flushPatchedSector(cur, sector, stats);
+    if (ret != 0) return ret;
+  }
+  return slipSend(le32({stats[0], stats[1]})) ? 0 : kStopped;
+}
+
+int ESPEmulator::doSetBaudRate(quint32 baudRate) {
+  const int oldBaudRate = baudRate_;
+  if (baudRate == 0) return 0xa2;
+  if (!slipSend(le32({baudRate}))) return kStopped;
+  // Let the response drain and the host switch too.
+  if (!busy(1000000)) return kStopped;
+  baudRate_ = baudRate;
+  QByteArray probe, confirm;
+  int r = slipRecv(&probe, 16, 500000);
+  if (r == kStopped) return kStopped;
+  if (r > 0 && probe.length() == 16) {
+    if (!slipSend(probe)) return kStopped;
+    r = slipRecv(&confirm, 4, 500000);
+    if (r == kStopped) return kStopped;
+    if (r > 0 && confirm.length() == 4 &&
+        getLE32(confirm, 0) == greetingMagic) {
+      return 0;
+    }
+  }
+  if (!busy(1000000)) return kStopped;
+  baudRate_ = oldBaudRate;
+  return 0xa3;
+}
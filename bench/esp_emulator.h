@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ */
+
+#ifndef CS_MFT_BENCH_ESP_EMULATOR_H_
+#define CS_MFT_BENCH_ESP_EMULATOR_H_
+
+#include <atomic>
+#include <deque>
+#include <thread>
+
+#include <QByteArray>
+#include <QCryptographicHash>
+#include <QPair>
+#include <QString>
+#include <QVector>
+
+#include <common/util/status.h>
+
+// Emulates an ESP8266 in the UART boot loader: the ROM protocol and, once a
+// stub has been uploaded and started, the stub_flasher protocol. The device
+// end of a pseudo terminal is served from a separate thread, so the real
+// ESPROMClient and ESPFlasherClient can talk to it through QSerialPort.
+//
+// Timing is modelled, not measured: bytes take 10 bits at the current baud
+// rate to cross the link plus a fixed latency each way, and flash operations
+// take as long as the parameters say.
+class ESPEmulator {
+ public:
+  struct Params {
+    int romBaudRate = 115200;
+    int latencyUs = 2000;  // One way, typical for USB serial adapters.
+    int romCommandUs = 100;
+    int eraseSectorUs = 45000;
+    int eraseBlockUs = 300000;
+    int writeKBUs = 2800;  // Programming 4 pages.
+    int readKBUs = 100;
+    int hashKBUs = 100;  // MD5 or CRC32.
+    int inflateKBUs = 150;
+    quint32 flashSize = 4 * 1024 * 1024;
+    quint32 stubVersion = 0;  // 0 means the latest, see STUB_FLASHER_VERSION.
+    quint32 rxBufSize = 16384;  // Reported in the greeting by version 7+.
+  };
+
+  struct Stats {
+    quint64 bytesToDevice;
+    quint64 bytesFromDevice;
+    // Number of writes during which the host sent more data than the stub
+    // could buffer. A real device would have lost data.
+    int overruns;
+  };
+
+  explicit ESPEmulator(const Params &params);
+  ~ESPEmulator();
+
+  // Opens the pseudo terminal and starts serving it.
+  util::Status start();
+  void stop();
+
+  // Terminal for the host to open.
+  QString portName() const;
+  Stats stats() const;
+
+ private:
+  struct RxByte {
+    qint64 atNs;  // When the byte has fully arrived.
+    quint8 b;
+  };
+  struct TxChunk {
+    qint64 dueNs;
+    QByteArray data;
+    int offset;
+  };
+  struct WriteCtx {
+    QVector<QPair<quint32, quint32>> regions;  // addr, len
+    bool erase = false;
+    bool longStatus = false;
+    bool changedOnly = false;  // CMD_FLASH_WRITE_CHANGED.
+    bool overrun = false;
+    int cur = 0;
+    quint32 numWritten = 0;  // Within the current region.
+    quint32 numErased = 0;   // Within the current region.
+    quint32 totalWritten = 0;
+    QCryptographicHash md5{QCryptographicHash::Md5};
+    QByteArray sector;   // Collected data of the current sector.
+    QByteArray changed;  // Bitmap of the rewritten sectors of the region.
+  };
+
+  void run();
+
+  // Link. Functions that return bool return false when the emulator is being
+  // stopped, int ones return kStopped.
+  qint64 byteNs() const;
+  // Moves data between the terminal and the queues until the given time.
+  bool pump(qint64 untilNs);
+  bool busy(qint64 ns);
+  // Number of bytes that have made it across the line.
+  int rxArrived() const;
+  // Waits for n bytes to arrive, deadlineNs < 0 means forever.
+  // Returns 1 if they did, 0 on timeout.
+  int rxWait(int n, qint64 deadlineNs);
+  QByteArray rxTake(int n);
+  bool send(const QByteArray &data);
+  bool slipSend(const QByteArray &data);
+  // Returns 0x100 | byte, 0 on timeout.
+  int recvByte(qint64 deadlineNs);
+  // Same semantics as the stub's SLIP_recv: frames longer than maxLen are
+  // truncated, a bad escape sequence yields an empty frame.
+  // Returns 1 if a frame was received, 0 on timeout (timeoutUs < 0: never).
+  int slipRecv(QByteArray *frame, int maxLen, qint64 timeoutUs = -1);
+
+  // ROM loader.
+  bool romLoop();
+  bool romResponse(quint8 cmd, quint32 value, quint8 status, quint8 error);
+
+  // Stub. do* functions return the stub's status codes.
+  bool runStub(quint32 baudRate);
+  // Args of the command in frame, from the frame itself or the next one.
+  bool recvArgs(const QByteArray &frame, QByteArray *args);
+  bool inFlash(quint32 addr, quint32 len) const;
+  // Returns 1 if the region is all 0xff, 0 if not.
+  int isBlank(quint32 addr, quint32 len);
+  bool eraseSector(quint32 addr);
+  bool eraseBlock(quint32 addr);
+  int doErase(quint32 addr, quint32 len);
+  quint32 rxBufSize() const;
+  void checkOverrun(WriteCtx *wc);
+  // Erases the current region up to the given offset, skipping blank sectors.
+  int eraseNext(WriteCtx *wc, bool useBlocks, quint32 until);
+  int eraseAhead(WriteCtx *wc, bool *erased);
+  // Writes spiWriteSize bytes and, if the stub does, reads them back.
+  int programChunk(quint32 addr, const char *data);
+  // Collects the sector and rewrites it if it differs from flash.
+  int writeChangedChunk(WriteCtx *wc, const char *data);
+  int writeChunk(WriteCtx *wc, const char *data, quint32 numConsumed);
+  bool sendWriteStatus(const WriteCtx &wc, quint32 numConsumed);
+  int doWriteRegions(WriteCtx *wc, quint32 zlen);
+  int doRead(quint32 addr, quint32 len, quint32 blockSize, quint32 maxInFlight,
+             bool acked);
+  // Sends block digests, if asked for, and stores the overall one in digest.
+  int flashDigest(quint32 addr, quint32 len, quint32 blockSize,
+                  QByteArray *digest);
+  int doDigest(quint32 addr, quint32 len, quint32 blockSize);
+  quint32 chipID() const;
+  int doBatch(const QByteArray &cmds);
+  int doFingerprint(quint32 addr, quint32 len, quint32 blockSize);
+  int doBlankMap(quint32 addr, quint32 len);
+  // Writes the patched sector back if it differs, stats counts sectors
+  // written and erased.
+  int flushPatchedSector(quint32 addr, const QByteArray &sector,
+                         quint32 stats[2]);
+  int doPatch(const QVector<QPair<quint32, quint32>> &patches,
+              const QByteArray &data);
+  int doSetBaudRate(quint32 baudRate);
+
+  static const int kStopped = -1;
+
+  const Params params_;
+  quint32 stubVersion_;
+  int master_ = -1;
+  QString portName_;
+  std::thread thread_;
+  std::atomic<bool> stop_{false};
+
+  int baudRate_;
+  std::deque<RxByte> rx_;
+  qint64 rxFreeNs_ = 0;  // When the host to device line is free.
+  std::deque<TxChunk> tx_;
+  qint64 txFreeNs_ = 0;  // When the device to host line is free.
+  std::atomic<quint64> bytesToDevice_{0};
+  std::atomic<quint64> bytesFromDevice_{0};
+  std::atomic<int> overruns_{0};
+
+  QByteArray flash_;
+  QByteArray memParams_;  // First block of the last memory write.
+  quint32 memSeq_ = 0;
+
+  ESPEmulator(const ESPEmulator &other) = delete;
+};
+
+#endif /* CS_MFT_BENCH_ESP_EMULATOR_H_ */
@@ -0,0 +1,58 @@
+# Microbenchmarks of the host-side hot paths: SLIP framing, firmware bundle
+# loading, filesystem merging and sector hashing.
+TEMPLATE = app
+TARGET = host-bench
+QT -= gui
+QT += concurrent serialport network
+CONFIG += c++11 console
+CONFIG -= app_bundle
+
+# Keeps frame pointers and symbols, for perf and flame graphs.
+CONFIG(profile) {
+  QMAKE_CFLAGS += -g -fno-omit-frame-pointer
+  QMAKE_CXXFLAGS += -g -fno-omit-frame-pointer
+}
+
+SRC_PATH = ../../src
+COMMON_PATH = ../../common
+SPIFFS_PATH = $${COMMON_PATH}/spiffs
+UTIL_PATH = $${COMMON_PATH}/util
+INCLUDEPATH += . $${SRC_PATH} ../.. $${UTIL_PATH} $${SPIFFS_PATH}
+
+HEADERS += \
+  $${SRC_PATH}/crc32.h \
+  $${SRC_PATH}/fs.h \
+  $${SRC_PATH}/fw_bundle.h \
+  $${SRC_PATH}/log.h \
+  $${SRC_PATH}/net_serial.h \
+  $${SRC_PATH}/prompter.h \
+  $${SRC_PATH}/serial.h \
+  $${SRC_PATH}/serial_trace.h \
+  $${SRC_PATH}/slip.h \
+  $${SRC_PATH}/status_qt.h
+
+SOURCES += \
+  host_bench.cc \
+  $${SRC_PATH}/crc32.cc \
+  $${SRC_PATH}/fs.cc \
+  $${SRC_PATH}/fw_bundle.cc \
+  $${SRC_PATH}/fw_bundle_zip.cc \
+  $${SRC_PATH}/log.cc \
+  $${SRC_PATH}/net_serial.cc \
+  $${SRC_PATH}/serial.cc \
+  $${SRC_PATH}/serial_trace.cc \
+  $${SRC_PATH}/slip.cc \
+  $${SRC_PATH}/status_qt.cc \
+  $${UTIL_PATH}/error_codes.cc \
+  $${UTIL_PATH}/logging.cc \
+  $${UTIL_PATH}/status.cc
+
+SOURCES += \
+  $${SPIFFS_PATH}/spiffs_cache.c \
+  $${SPIFFS_PATH}/spiffs_gc.c \
+  $${SPIFFS_PATH}/spiffs_nucleus.c \
+  $${SPIFFS_PATH}/spiffs_check.c \
+  $${SPIFFS_PATH}/spiffs_hydrogen.c
+DEFINES += SPIFFS_TEST_VISUALISATION=1 SPIFFS_HAL_CALLBACK_EXTRA=1
+
+QMAKE_CLEAN += -r $$TARGET
@@ -0,0 +1,416 @@
+// Microbenchmarks of the work MFT does on the host: SLIP framing, loading and
+// verifying firmware bundles, merging filesystem images, hashing sectors and,
+// given --mft-cli, starting the CLI binary.
+// Each benchmark is repeated for at least --min-time-ms. To profile one of
+// them, build with CONFIG+=profile and run it alone for longer, e.g.
+// perf record -g ./host-bench --filter=merge_fs --min-time-ms=20000
+
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+
+#include <QBuffer>
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QCryptographicHash>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QLoggingCategory>
+#include <QList>
+#include <QMap>
+#include <QPair>
+#include <QProcess>
+#include <QRegExp>
+#include <QStandardPaths>
+#include <QStringList>
+#include <QTemporaryDir>
+#include <QTextStream>
+
+#include <common/util/status.h>
+
+#define MINIZ_HEADER_FILE_ONLY
+#include "common/miniz.c"
+
+#include "fs.h"
+#include "fw_bundle.h"
+#include "slip.h"
+#include "status_qt.h"
+
+namespace {
+
+const char kFilterOption[] = "filter";
+const char kMinTimeOption[] = "min-time-ms";
+const char kMFTCLIOption[] = "mft-cli";
+const char kVerboseOption[] = "verbose";
+
+const int kSectorSize = 4096;
+// A start that takes longer than this has hung.
+const int kStartupTimeoutMs = 10000;
+
+bool verbose = false;
+
+void messageHandler(QtMsgType type, const QMessageLogContext &context,
+                    const QString &msg) {
+  Q_UNUSED(context);
+  if (!verbose && type != QtCriticalMsg && type != QtFatalMsg) return;
+  std::cerr << msg.toStdString() << std::endl;
+}
+
+// Firmware-like: text and code compress some, tables not at all.
+QByteArray makeData(int size, quint32 seed = 0x12345678) {
+  QByteArray data(size, 0);
+  quint32 x = seed;
+  for (int i = 0; i < size; i++) {
+    x = x * 1103515245 + 12345;
+    const bool text = (i / 4096) % 2 == 0;
+    data[i] = text ? char('a' + (x >> 16) % 16) : char(x >> 16);
+  }
+  return data;
+}
+
+// In-memory device for SLIP::send and SLIP::recv. Writes complete at once
+// and there is no more data to wait for than what is in the buffer.
+class MemoryDevice : public QBuffer {
+ public:
+  bool waitForBytesWritten(int msecs) override {
+    Q_UNUSED(msecs);
+    return true;
+  }
+  bool waitForReadyRead(int msecs) override {
+    Q_UNUSED(msecs);
+    return bytesAvailable() > 0;
+  }
+};
+
+// Writes a bundle with a part of each of the given sizes, named part0,
+// part1 and so on, to fileName.
+util::Status writeBundle(const QString &fileName, const QList<int> &sizes) {
+  mz_zip_archive zip;
+  memset(&zip, 0, sizeof(zip));
+  const QByteArray zipName = fileName.toUtf8();
+  if (!mz_zip_writer_init_file(&zip, zipName.constData(), 0)) {
+    return QS(util::error::UNAVAILABLE, "mz_zip_writer_init_file failed");
+  }
+  QJsonObject parts;
+  quint32 addr = 0;
+  bool ok = true;
+  for (int i = 0; i < sizes.size(); i++) {
+    const QString name = QString("part%1").arg(i);
+    const QByteArray data = makeData(sizes[i], i + 1);
+    const QByteArray src = (name + ".bin").toUtf8();
+    QJsonObject p;
+    p["src"] = QString::fromUtf8(src);
+    p["addr"] = QString("0x%1").arg(addr, 0, 16);
+    p["cs_sha1"] = QString::fromLatin1(
+        QCryptographicHash::hash(data, QCryptographicHash::Sha1).toHex());
+    parts[name] = p;
+    addr += sizes[i];
+    ok = ok && mz_zip_writer_add_mem(&zip, src.constData(), data.constData(),
+                                     data.size(), MZ_DEFAULT_LEVEL);
+  }
+  QJsonObject manifest;
+  manifest["name"] = "bench";
+  manifest["platform"] = "esp8266";
+  manifest["parts"] = parts;
+  const QByteArray json = QJsonDocument(manifest).toJson();
+  ok = ok && mz_zip_writer_add_mem(&zip, "manifest.json", json.constData(),
+                                   json.size(), MZ_DEFAULT_LEVEL);
+  ok = ok && mz_zip_writer_finalize_archive(&zip);
+  mz_zip_writer_end(&zip);
+  if (!ok) return QS(util::error::UNAVAILABLE, "failed to write the bundle");
+  return util::Status::OK;
+}
+
+// Files with about a third of size in total, version changes contents of
+// every other file and adds one.
+QMap<QString, QByteArray> makeFiles(int size, int count, int version) {
+  QMap<QString, QByteArray> files;
+  const int fileSize = size / 3 / count;
+  for (int i = 0; i < count; i++) {
+    const int seed = (i % 2 == 0 ? i : i + version * count) + 1;
+    files[QString("file%1").arg(i, 3, 10, QChar('0'))] =
+        makeData(fileSize, seed);
+  }
+  if (version > 0) files["new"] = makeData(fileSize, version);
+  return files;
+}
+
+class Bench {
+ public:
+  Bench(const QRegExp &filter, qint64 minTimeMs)
+      : filter_(filter), minTimeMs_(minTimeMs), out_(stdout) {
+  }
+
+  void header() {
+    out_ << QString("%1 %2 %3 %4 %5 %6 %7")
+                .arg("op", -18)
+                .arg("params", -11)
+                .arg("bytes", 9)
+                .arg("iters", 7)
+                .arg("us/iter", 10)
+                .arg("MB/s", 8)
+                .arg("result")
+         << endl;
+  }
+
+  void slip() {
+    if (!enabled({"slip_encode", "slip_decode", "slip_send", "slip_recv"})) {
+      return;
+    }
+    for (int size : {256, 4096, 65536}) {
+      const QString params = QString::number(size);
+      const QByteArray data = makeData(size);
+      SLIP::Encoder enc;
+      measure("slip_encode", params, size, [&]() {
+        enc.encode(data);
+        return util::Status::OK;
+      });
+      const QByteArray frame = enc.encode(data);
+      SLIP::Decoder dec;
+      measure("slip_decode", params, size, [&]() {
+        dec.feed(frame.constData(), frame.length());
+        if (!dec.hasFrame() || dec.takeFrame().length() != size) {
+          return QS(util::error::DATA_LOSS, "bad frame");
+        }
+        return util::Status::OK;
+      });
+      MemoryDevice dev;
+      dev.open(QIODevice::ReadWrite);
+      measure("slip_send", params, size, [&]() {
+        dev.seek(0);
+        return SLIP::send(&dev, data);
+      });
+      dev.close();
+      dev.setData(frame);
+      dev.open(QIODevice::ReadOnly);
+      measure("slip_recv", params, size,
+              [&]() {
+                auto res = SLIP::recv(&dev);
+                if (!res.ok()) return res.status();
+                if (res.ValueOrDie().length() != size) {
+                  return QS(util::error::DATA_LOSS, "bad frame");
+                }
+                return util::Status::OK;
+              },
+              [&]() { dev.seek(0); });
+    }
+  }
+
+  void bundles() {
+    if (!enabled({"bundle_load", "bundle_verify"})) return;
+    QTemporaryDir dir;
+    const QString cacheDir =
+        QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+    // Sizes of the parts: boot loader, firmware and filesystem.
+    const QList<QList<int>> bundles = {
+        {4096, 256 * 1024, 64 * 1024},
+        {4096, 1024 * 1024, 512 * 1024},
+        {4096, 3 * 1024 * 1024, 1024 * 1024},
+    };
+    for (const QList<int> &sizes : bundles) {
+      int total = 0;
+      for (int s : sizes) total += s;
+      const QString params = QString("%1K").arg(total / 1024);
+      const QString fileName = dir.path() + "/" + params + ".zip";
+      util::Status st = writeBundle(fileName, sizes);
+      if (!st.ok()) {
+        result("bundle_load", params, total, 0, 0, st);
+        continue;
+      }
+      std::unique_ptr<FirmwareBundle> fwb;
+      auto load = [&]() {
+        auto res = NewZipFWBundle(fileName);
+        if (!res.ok()) return res.status();
+        fwb = res.MoveValueOrDie();
+        return util::Status::OK;
+      };
+      auto verify = [&]() {
+        for (const QString &name : fwb->parts().keys()) {
+          auto res = fwb->getPartSource(name);
+          if (!res.ok()) return res.status();
+        }
+        return util::Status::OK;
+      };
+      measure("bundle_load", params, total, load);
+      // Without the cache parts are extracted and hashed, with it they are
+      // read from files of the cache.
+      measure("bundle_verify", params + "/cold", total, verify, [&]() {
+        QDir(cacheDir).removeRecursively();
+        load();
+      });
+      measure("bundle_verify", params + "/cached", total, verify, load);
+    }
+    QDir(cacheDir).removeRecursively();
+  }
+
+  void filesystems() {
+    if (!enabled({"merge_fs", "merge_fs_in_place"})) return;
+    for (int size : {64 * 1024, 512 * 1024, 3 * 1024 * 1024}) {
+      for (int count : {4, 16}) {
+        const QString params = QString("%1K/%2").arg(size / 1024).arg(count);
+        auto oldImage = makeFilesystem(size, makeFiles(size, count, 0));
+        auto newImage = makeFilesystem(size, makeFiles(size, count, 1));
+        if (!oldImage.ok() || !newImage.ok()) {
+          result("merge_fs", params, size, 0, 0,
+                 oldImage.ok() ? newImage.status() : oldImage.status());
+          continue;
+        }
+        measure("merge_fs", params, size, [&]() {
+          return mergeFilesystems(oldImage.ValueOrDie(), newImage.ValueOrDie())
+              .status();
+        });
+        measure("merge_fs_in_place", params, size, [&]() {
+          QList<int> dirty;
+          return mergeFilesystemsInPlace(oldImage.ValueOrDie(),
+                                         newImage.ValueOrDie(), &dirty)
+              .status();
+        });
+      }
+    }
+  }
+
+  void hashes() {
+    if (!enabled({"md5_sectors", "sha1_sectors"})) return;
+    const int size = 4 * 1024 * 1024;
+    const QByteArray data = makeData(size);
+    const QList<QPair<QString, QCryptographicHash::Algorithm>> algos = {
+        {"md5_sectors", QCryptographicHash::Md5},
+        {"sha1_sectors", QCryptographicHash::Sha1},
+    };
+    for (const auto &algo : algos) {
+      measure(algo.first, QString::number(kSectorSize), size, [&]() {
+        QByteArray digests;
+        for (int i = 0; i < size; i += kSectorSize) {
+          digests.append(QCryptographicHash::hash(
+              QByteArray::fromRawData(data.constData() + i, kSectorSize),
+              algo.second));
+        }
+        return util::Status::OK;
+      });
+    }
+  }
+
+  // Whole runs of the CLI binary that do no flashing: one that exits after
+  // parsing the options and one that gets as far as opening a port. For a
+  // small update over a fast link, this is a good part of the time it takes.
+  void startup(const QString &binary) {
+    if (binary.isEmpty() || !enabled({"cli_startup"})) return;
+    const QList<QPair<QString, QStringList>> runs = {
+        {"version", {"--version"}},
+        {"no_port",
+         {"--platform=esp8266", "--probe", "--port=/nonexistent", "-V", "0"}},
+    };
+    for (const auto &run : runs) {
+      measure("cli_startup", run.first, 0, [&]() {
+        QProcess p;
+        p.setProcessChannelMode(QProcess::MergedChannels);
+        p.start(binary, run.second);
+        if (!p.waitForFinished(kStartupTimeoutMs)) {
+          p.kill();
+          p.waitForFinished();
+          return QS(util::error::DEADLINE_EXCEEDED,
+                    QString("%1 did not exit").arg(binary));
+        }
+        // Exit code of no_port is an error, it only has to exit normally.
+        if (p.exitStatus() != QProcess::NormalExit) {
+          return QS(util::error::INTERNAL, QString("%1 crashed").arg(binary));
+        }
+        return util::Status::OK;
+      });
+    }
+  }
+
+ private:
+  // Whether any of the ops is going to run, so the setup for them can be
+  // skipped if not.
+  bool enabled(const QStringList &ops) const {
+    return filter_.isEmpty() || !ops.filter(filter_).isEmpty();
+  }
+
+  // Runs f until minTimeMs_ has been spent in it. setup, if given, is called
+  // before each run and is not counted.
+  void measure(const QString &op, const QString &params, qint64 bytes,
+               std::function<util::Status()> f,
+               std::function<void()> setup = nullptr) {
+    if (!filter_.isEmpty() && !op.contains(filter_)) return;
+    util::Status st;
+    qint64 iters = 0, ns = 0;
+    QElapsedTimer t;
+    while (st.ok() && (iters == 0 || ns < minTimeMs_ * 1000000)) {
+      if (setup) setup();
+      t.start();
+      st = f();
+      ns += t.nsecsElapsed();
+      iters++;
+    }
+    result(op, params, bytes, iters, ns, st);
+  }
+
+  void result(const QString &op, const QString &params, qint64 bytes,
+              qint64 iters, qint64 ns, const util::Status &st) {
+    const double us = iters > 0 ? ns / 1000.0 / iters : 0;
+    out_ << QString("%1 %2 %3 %4 %5 %6 %7")
+                .arg(op, -18)
+                .arg(params, -11)
+                .arg(bytes, 9)
+                .arg(iters, 7)
+                .arg(QString::number(us, 'f', 1), 10)
+                .arg(us > 0 ? QString::number(bytes / us, 'f', 1)
+                            : QString("-"),
+                     8)
+                .arg(st.ok() ? QString("ok")
+                             : QString::fromStdString(st.ToString()))
+         << endl;
+  }
+
+  const QRegExp filter_;
+  const qint64 minTimeMs_;
+  QTextStream out_;
+};
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  QCoreApplication app(argc, argv);
+  // Bundles are cached, keep them away from MFT's.
+  QCoreApplication::setOrganizationName("Cesanta");
+  QCoreApplication::setApplicationName("host-bench");
+  qInstallMessageHandler(messageHandler);
+
+  QCommandLineParser parser;
+  parser.setApplicationDescription(
+      "Benchmarks SLIP framing, firmware bundles, filesystem merging, "
+      "hashing and CLI startup");
+  parser.addHelpOption();
+  parser.addOptions({
+      {kFilterOption, "Only run benchmarks with names matching the regexp.",
+       "regexp"},
+      {kMinTimeOption, "Time to spend repeating each benchmark.", "ms",
+       "500"},
+      {kVerboseOption, "Show debug output, frame dumps included."},
+      {kMFTCLIOption, "Also time starts of the given MFT CLI binary.",
+       "binary"},
+  });
+  parser.process(app);
+  verbose = parser.isSet(kVerboseOption);
+  // Frames would be formatted for the log on every call otherwise.
+  QLoggingCategory::setFilterRules(
+      QString("mft.proto.debug=%1").arg(verbose ? "true" : "false"));
+
+  const qint64 minTimeMs = parser.value(kMinTimeOption).toLongLong();
+  if (minTimeMs < 0) {
+    std::cerr << "Time must not be negative" << std::endl;
+    return 1;
+  }
+  Bench b(QRegExp(parser.value(kFilterOption)), minTimeMs);
+  b.header();
+  b.slip();
+  b.bundles();
+  b.filesystems();
+  b.hashes();
+  b.startup(parser.value(kMFTCLIOption));
+  return 0;
+}
@@ -0,0 +1,386 @@
+// Decodes serial traces recorded with --trace-serial: splits the traffic into
+// ESP8266 ROM and stub commands or CC3200 boot loader commands and shows
+// where the time went. For each command, gap is the time the host took to
+// start it after the previous one ended, latency is how long the device took
+// to start answering after the host last wrote something. Times are those at
+// which the host wrote and read the data, not when it was on the wire.
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QMap>
+#include <QString>
+#include <QTextStream>
+#include <QVector>
+
+#include <common/util/status.h>
+
+#include "serial_trace.h"
+#include "slip.h"
+#include "status_qt.h"
+
+namespace {
+
+const char kProtocolOption[] = "protocol";
+const char kTimelineOption[] = "timeline";
+const char kTopGapsOption[] = "top-gaps";
+
+using SerialTrace::Event;
+using SerialTrace::Record;
+
+struct Command {
+  QString name;
+  qint64 startUs = 0;
+  qint64 endUs = 0;
+  qint64 lastWriteUs = 0;
+  qint64 gapUs = 0;
+  qint64 latencyUs = -1;  // No response.
+  quint64 bytesOut = 0;
+  quint64 bytesIn = 0;
+};
+
+QString hexName(const char *prefix, quint8 op) {
+  return QString("%1%2").arg(prefix).arg(op, 2, 16, QChar('0'));
+}
+
+QString romCommandName(quint8 op) {
+  switch (op) {
+    case 0x02:
+      return "rom_flash_write_start";
+    case 0x03:
+      return "rom_flash_write_block";
+    case 0x04:
+      return "rom_flash_write_finish";
+    case 0x05:
+      return "rom_mem_write_start";
+    case 0x06:
+      return "rom_mem_write_finish";
+    case 0x07:
+      return "rom_mem_write_block";
+    case 0x08:
+      return "rom_sync";
+    case 0x0a:
+      return "rom_read_register";
+  }
+  return hexName("rom_", op);
+}
+
+// See CMD_* in stub_flasher.h.
+QString stubCommandName(quint8 op) {
+  static const char *names[] = {
+      "flash_erase",         "flash_write",       "flash_read",
+      "flash_digest",        "read_chip_id",      "erase_chip",
+      "boot_fw",             "reboot",            "flash_write_deflated",
+      "flash_write_regions", "set_baud_rate",     "flash_fingerprint",
+      "flash_blank_map",     "set_spi_params",    "batch",
+      "flash_write_changed", "flash_patch",
+  };
+  if (op < sizeof(names) / sizeof(names[0])) return names[op];
+  return hexName("stub_", op);
+}
+
+QString cc3200CommandName(quint8 op) {
+  switch (op) {
+    case 0x21:
+      return "start_upload";
+    case 0x22:
+      return "finish_upload";
+    case 0x24:
+      return "file_chunk";
+    case 0x28:
+      return "format_flash";
+    case 0x2a:
+      return "get_file_info";
+    case 0x2b:
+      return "read_file_chunk";
+    case 0x2d:
+      return "storage_write";
+    case 0x2e:
+      return "file_erase";
+    case 0x2f:
+      return "get_version_info";
+    case 0x30:
+      return "erase_blocks";
+    case 0x31:
+      return "get_storage_info";
+    case 0x32:
+      return "exec_from_ram";
+    case 0x33:
+      return "switch_uart2_apps";
+  }
+  return hexName("op_", op);
+}
+
+// Tells where commands start, from what the host writes and the device
+// sends back.
+class Protocol {
+ public:
+  virtual ~Protocol() {
+  }
+  // Name of the command that the write starts, empty if it continues the
+  // current one.
+  virtual QString commandFor(const QByteArray &data) = 0;
+  virtual void deviceData(const QByteArray &data) = 0;
+};
+
+// ROM requests are the frames that start with a zero byte and the opcode,
+// each of them is a command. Once the stub greets the host, every stub
+// command ends with a one byte status frame, whatever else comes with it
+// (arguments, data, acks) is a part of it.
+class ESPProtocol : public Protocol {
+ public:
+  QString commandFor(const QByteArray &data) override {
+    // Frames are sent with one write each, raw data is not framed.
+    if (data.length() < 2 || quint8(data[0]) != 0xc0 ||
+        quint8(data[data.length() - 1]) != 0xc0) {
+      return QString();
+    }
+    SLIP::Decoder dec;
+    dec.feed(data.constData(), data.length(), true);
+    if (!dec.hasFrame()) return QString();
+    const QByteArray frame = dec.takeFrame();
+    if (frame.isEmpty()) return QString();
+    if (!stub_) {
+      if (frame.length() < 8 || frame[0] != 0) return QString();
+      return romCommandName(frame[1]);
+    }
+    if (!stubIdle_) return QString();
+    stubIdle_ = false;
+    return stubCommandName(frame[0]);
+  }
+
+  void deviceData(const QByteArray &data) override {
+    dec_.feed(data.constData(), data.length());
+    while (dec_.hasFrame()) {
+      const QByteArray frame = dec_.takeFrame();
+      if (frame.length() == 12 && frame.startsWith("OHAI")) {
+        stub_ = true;
+        stubIdle_ = true;
+      } else if (stub_ && frame.length() == 1) {
+        stubIdle_ = true;
+      }
+    }
+  }
+
+ private:
+  SLIP::Decoder dec_;
+  bool stub_ = false;
+  bool stubIdle_ = false;
+};
+
+// Frames are the 2 byte length, checksum and payload, the first byte of
+// which is the opcode. Each frame the host sends is a command, acks (00 CC)
+// are a part of the current one.
+class CC3200Protocol : public Protocol {
+ public:
+  QString commandFor(const QByteArray &data) override {
+    if (data.length() < 4) return QString();
+    return cc3200CommandName(data[3]);
+  }
+
+  void deviceData(const QByteArray &data) override {
+    Q_UNUSED(data);
+  }
+};
+
+QString controlName(const Record &r) {
+  switch (r.event) {
+    case Event::DataTerminalReady:
+      return QString("dtr=%1").arg(r.value);
+    case Event::RequestToSend:
+      return QString("rts=%1").arg(r.value);
+    case Event::Break:
+      return QString("break=%1").arg(r.value);
+    case Event::BaudRate:
+      return QString("baud=%1").arg(r.value);
+    default:
+      break;
+  }
+  return QString();
+}
+
+QString ms(qint64 us) {
+  return QString::number(us / 1000.0, 'f', 1);
+}
+
+QVector<Command> splitCommands(const SerialTrace::Trace &trace,
+                               Protocol *proto, bool timeline,
+                               QTextStream &out) {
+  QVector<Command> commands;
+  Command cur;
+  cur.name = "(before first command)";
+  auto finish = [&commands, &cur]() {
+    if (cur.bytesOut > 0 || cur.bytesIn > 0) commands.append(cur);
+  };
+  for (const Record &r : trace.records) {
+    if (r.event == Event::Write) {
+      QString name = proto->commandFor(r.data);
+      if (!name.isEmpty()) {
+        const qint64 prevEndUs = cur.endUs;
+        finish();
+        cur = Command();
+        cur.name = name;
+        cur.startUs = r.us;
+        cur.gapUs = commands.isEmpty() ? 0 : r.us - prevEndUs;
+        if (timeline) {
+          out << QString("%1 %2 gap %3")
+                     .arg(ms(r.us), 10)
+                     .arg(name, -24)
+                     .arg(ms(cur.gapUs))
+              << endl;
+        }
+      }
+      cur.bytesOut += r.data.length();
+      cur.lastWriteUs = cur.endUs = r.us;
+    } else if (r.event == Event::Read) {
+      proto->deviceData(r.data);
+      if (cur.latencyUs < 0 && cur.bytesOut > 0) {
+        cur.latencyUs = r.us - cur.lastWriteUs;
+      }
+      cur.bytesIn += r.data.length();
+      cur.endUs = r.us;
+    } else if (timeline) {
+      out << QString("%1 %2").arg(ms(r.us), 10).arg(controlName(r)) << endl;
+    }
+  }
+  finish();
+  return commands;
+}
+
+struct Summary {
+  int count = 0;
+  quint64 bytesOut = 0;
+  quint64 bytesIn = 0;
+  qint64 totalUs = 0;
+  qint64 gapUs = 0;
+  qint64 latencyUs = 0;
+  qint64 maxLatencyUs = 0;
+  int numLatencies = 0;
+};
+
+void printSummary(const SerialTrace::Trace &trace,
+                  const QVector<Command> &commands, int topGaps,
+                  QTextStream &out) {
+  QMap<QString, Summary> byName;
+  Summary total;
+  for (const Command &c : commands) {
+    for (Summary *s : {&byName[c.name], &total}) {
+      s->count++;
+      s->bytesOut += c.bytesOut;
+      s->bytesIn += c.bytesIn;
+      s->totalUs += c.endUs - c.startUs;
+      s->gapUs += c.gapUs;
+      if (c.latencyUs >= 0) {
+        s->latencyUs += c.latencyUs;
+        s->maxLatencyUs = std::max(s->maxLatencyUs, c.latencyUs);
+        s->numLatencies++;
+      }
+    }
+  }
+  const qint64 traceUs =
+      trace.records.isEmpty() ? 0 : trace.records.last().us;
+  out << "# " << trace.portName << ", " << trace.records.size()
+      << " records, " << ms(traceUs) << " ms" << endl;
+  out << QString("%1 %2 %3 %4 %5 %6 %7 %8")
+             .arg("command", -24)
+             .arg("count", 6)
+             .arg("out", 9)
+             .arg("in", 9)
+             .arg("ms", 9)
+             .arg("gap_ms", 9)
+             .arg("lat_avg", 8)
+             .arg("lat_max", 8)
+      << endl;
+  auto line = [&out](const QString &name, const Summary &s) {
+    out << QString("%1 %2 %3 %4 %5 %6 %7 %8")
+               .arg(name, -24)
+               .arg(s.count, 6)
+               .arg(s.bytesOut, 9)
+               .arg(s.bytesIn, 9)
+               .arg(ms(s.totalUs), 9)
+               .arg(ms(s.gapUs), 9)
+               .arg(s.numLatencies > 0 ? ms(s.latencyUs / s.numLatencies)
+                                       : QString("-"),
+                    8)
+               .arg(s.numLatencies > 0 ? ms(s.maxLatencyUs) : QString("-"),
+                    8)
+        << endl;
+  };
+  for (auto it = byName.constBegin(); it != byName.constEnd(); ++it) {
+    line(it.key(), it.value());
+  }
+  line("total", total);
+
+  QVector<const Command *> gaps;
+  for (const Command &c : commands) gaps.append(&c);
+  std::sort(gaps.begin(), gaps.end(), [](const Command *a, const Command *b) {
+    return a->gapUs > b->gapUs;
+  });
+  if (topGaps > 0 && !gaps.isEmpty()) {
+    out << endl << "# largest gaps" << endl;
+  }
+  for (int i = 0; i < std::min(topGaps, gaps.size()); i++) {
+    out << QString("%1 ms before %2 at %3 ms")
+               .arg(ms(gaps[i]->gapUs), 9)
+               .arg(gaps[i]->name)
+               .arg(ms(gaps[i]->startUs))
+        << endl;
+  }
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  QCoreApplication app(argc, argv);
+  QCommandLineParser parser;
+  parser.setApplicationDescription(
+      "Shows per-command latency and gaps in a trace from --trace-serial");
+  parser.addHelpOption();
+  parser.addOptions({
+      {kProtocolOption,
+       "esp8266 or cc3200. By default, traces that have SLIP frames in them "
+       "are taken to be ESP8266 ones.",
+       "protocol"},
+      {kTimelineOption, "Also print commands and line changes as they come."},
+      {kTopGapsOption, "Number of largest gaps to list.", "n", "10"},
+  });
+  parser.addPositionalArgument("trace", "Trace file.");
+  parser.process(app);
+  if (parser.positionalArguments().size() != 1) parser.showHelp(1);
+
+  auto tr = SerialTrace::load(parser.positionalArguments()[0]);
+  if (!tr.ok()) {
+    std::cerr << tr.status() << std::endl;
+    return 1;
+  }
+  const SerialTrace::Trace &trace = tr.ValueOrDie();
+
+  QString protocol = parser.value(kProtocolOption);
+  if (protocol.isEmpty()) {
+    protocol = "cc3200";
+    for (const Record &r : trace.records) {
+      if (r.event == Event::Write && r.data.startsWith('\xc0')) {
+        protocol = "esp8266";
+        break;
+      }
+    }
+  }
+  std::unique_ptr<Protocol> proto;
+  if (protocol == "esp8266") {
+    proto.reset(new ESPProtocol);
+  } else if (protocol == "cc3200") {
+    proto.reset(new CC3200Protocol);
+  } else {
+    std::cerr << "Unknown protocol " << protocol.toStdString() << std::endl;
+    return 1;
+  }
+
+  QTextStream out(stdout);
+  const QVector<Command> commands = splitCommands(
+      trace, proto.get(), parser.isSet(kTimelineOption), out);
+  printSummary(trace, commands, parser.value(kTopGapsOption).toInt(), out);
+  return 0;
+}
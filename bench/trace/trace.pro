@@ -0,0 +1,34 @@
+# Decoder of the serial traces recorded with --trace-serial.
+TEMPLATE = app
+TARGET = mft-trace
+QT -= gui
+QT += serialport network
+CONFIG += c++11 console
+CONFIG -= app_bundle
+
+SRC_PATH = ../../src
+COMMON_PATH = ../../common
+UTIL_PATH = $${COMMON_PATH}/util
+INCLUDEPATH += . $${SRC_PATH} ../.. $${UTIL_PATH}
+
+HEADERS += \
+  $${SRC_PATH}/log.h \
+  $${SRC_PATH}/net_serial.h \
+  $${SRC_PATH}/serial.h \
+  $${SRC_PATH}/serial_trace.h \
+  $${SRC_PATH}/slip.h \
+  $${SRC_PATH}/status_qt.h
+
+SOURCES += \
+  mft_trace.cc \
+  $${SRC_PATH}/log.cc \
+  $${SRC_PATH}/net_serial.cc \
+  $${SRC_PATH}/serial.cc \
+  $${SRC_PATH}/serial_trace.cc \
+  $${SRC_PATH}/slip.cc \
+  $${SRC_PATH}/status_qt.cc \
+  $${UTIL_PATH}/error_codes.cc \
+  $${UTIL_PATH}/logging.cc \
+  $${UTIL_PATH}/status.cc
+
+QMAKE_CLEAN += -r $$TARGET
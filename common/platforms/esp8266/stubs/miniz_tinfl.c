@@ -0,0 +1,17 @@
+/*
+ * Copyright (c) 2016 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Inflater used by CMD_FLASH_WRITE_DEFLATED and CRC32 used by
+ * CMD_FLASH_FINGERPRINT. Only tinfl_decompress() and mz_crc32() are used,
+ * the rest of miniz is discarded by the linker (--gc-sections).
+ * Built separately because libc headers conflict with rom_functions.h.
+ */
+
+#define MINIZ_NO_STDIO
+#define MINIZ_NO_TIME
+#define MINIZ_NO_ARCHIVE_APIS
+#define MINIZ_NO_ZLIB_APIS
+#define MINIZ_NO_MALLOC
+#define NDEBUG
+#include "common/miniz.c"
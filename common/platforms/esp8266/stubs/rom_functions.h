@@ -46,6 +46,8 @@ int_handler_t ets_isr_attach(uint32_t int_num, int_handler_t handler,
 void ets_intr_lock();
 void ets_intr_unlock();
 void ets_set_user_start(void (*user_start_fn)());
+void ets_update_cpu_frequency(uint32_t ticks_per_us);
+uint32_t ets_get_cpu_frequency();
 
 uint32_t rtc_get_reset_reason();
 void software_reset();
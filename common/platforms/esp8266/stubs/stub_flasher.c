@@ -9,7 +9,8 @@
  * SLIP protocol is used for communication.
  * First packet is a single byte - command number.
  * After that, a packet with a variable number of 32-bit (LE) arguments,
- * depending on command.
+ * depending on command. Since version 9 the arguments may follow the command
+ * byte in the same packet instead, which saves a round of USB transfers.
  *
  * Then command produces variable number of packets of output, but first
  * packet of length 1 is the response code: 0 for success, non-zero - error.
@@ -27,6 +28,14 @@
 
 #include "slip.h"
 
+#define MINIZ_NO_STDIO
+#define MINIZ_NO_TIME
+#define MINIZ_NO_ARCHIVE_APIS
+#define MINIZ_NO_ZLIB_APIS
+#define MINIZ_NO_MALLOC
+#define MINIZ_HEADER_FILE_ONLY
+#include "common/miniz.c"
+
 /* Param: baud rate. */
 uint32_t params[1] __attribute__((section(".params")));
 
@@ -35,7 +44,12 @@ uint32_t params[1] __attribute__((section(".params")));
 #define FLASH_BLOCK_SIZE 65536
 #define UART_CLKDIV_26MHZ(B) (52000000 + B / 2) / B
 
-#define UART_BUF_SIZE 6144
+/*
+ * Receive buffer, must be a multiple of SPI_WRITE_SIZE. Big enough to keep
+ * receiving at 2 Mbaud while a sector is being erased. Size is reported to the
+ * host in the greeting, host keeps at most this much data in flight.
+ */
+#define UART_BUF_SIZE 16384
 #define SPI_WRITE_SIZE 1024
 
 #define UART_RX_INTS (UART_RXFIFO_FULL_INT_ENA | UART_RXFIFO_TOUT_INT_ENA)
@@ -48,6 +62,42 @@ uint32_t params[1] __attribute__((section(".params")));
 
 #define SPI_W0(i) (REG_SPI_BASE(i) + 0x40)
 
+#define SPI_CTRL(i) (REG_SPI_BASE(i) + 0x8)
+#define SPI_DIO_MODE (BIT(23))
+#define SPI_DOUT_MODE (BIT(14))
+#define SPI_FASTRD_MODE (BIT(13))
+#define SPI_READ_MODE_MASK (BIT(24) | BIT(23) | BIT(20) | BIT(14) | BIT(13))
+
+#define SPI_CLOCK(i) (REG_SPI_BASE(i) + 0x18)
+#define SPI_CLK_EQU_SYSCLK (BIT(31))
+/* Divider fields: f = sysclk / (n + 1), h = (n + 1) / 2 - 1, l = n. */
+#define SPI_CLOCK_DIV(n) (((n) << 12) | ((((n) + 1) / 2 - 1) << 6) | (n))
+
+#define PERIPHS_IO_MUX_CONF 0x60000800
+#define SPI0_CLK_EQU_SYSCLK (BIT(8))
+
+/* CPU clock doubler, the same bit system_update_cpu_freq() flips. */
+#define DPORT_CPU_CLK_REG 0x3ff00014
+#define DPORT_CPU_CLK_X2 (BIT(0))
+
+/* Clock and SPI settings we found, to be put back before booting firmware. */
+struct saved_clocks {
+  uint32_t cpu_freq;
+  uint32_t dport_cpu_clk;
+  uint32_t spi_ctrl;
+  uint32_t spi_clock;
+  uint32_t io_mux_conf;
+  int spi_changed;
+};
+static struct saved_clocks s_saved_clocks;
+
+/*
+ * Inflater state and dictionary are too big for the stack and are not part
+ * of the uploaded image (.noinit is not loaded).
+ */
+static tinfl_decompressor s_inf __attribute__((section(".noinit")));
+static uint8_t s_dict[TINFL_LZ_DICT_SIZE] __attribute__((section(".noinit")));
+
 int do_flash_erase(uint32_t addr, uint32_t len) {
   if (addr % FLASH_SECTOR_SIZE != 0) return 0x32;
   if (len % FLASH_SECTOR_SIZE != 0) return 0x33;
@@ -80,6 +130,8 @@ struct uart_buf {
   uint8_t *pr, *pw;
 };
 
+static struct uart_buf s_ub __attribute__((section(".noinit")));
+
 void uart_isr(void *arg) {
   uint32_t int_st = READ_PERI_REG(UART_INT_ST(0));
   struct uart_buf *ub = (struct uart_buf *) arg;
@@ -96,59 +148,384 @@ void uart_isr(void *arg) {
   WRITE_PERI_REG(UART_INT_CLR(0), int_st);
 }
 
-int do_flash_write(uint32_t addr, uint32_t len, uint32_t erase) {
-  struct uart_buf ub;
-  uint8_t digest[16];
-  uint32_t num_written = 0, num_erased = 0;
-  struct MD5Context ctx;
-  MD5Init(&ctx);
+struct flash_region {
+  uint32_t addr;
+  uint32_t len;
+};
 
-  if (addr % FLASH_SECTOR_SIZE != 0) return 0x32;
-  if (len % FLASH_SECTOR_SIZE != 0) return 0x33;
+static struct flash_region s_regions[FLASH_WRITE_MAX_REGIONS]
+    __attribute__((section(".noinit")));
+
+static uint32_t s_fingerprints[FLASH_FINGERPRINT_MAX_BLOCKS]
+    __attribute__((section(".noinit")));
+
+/* Sector being collected by CMD_FLASH_WRITE_CHANGED or patched. */
+static uint8_t s_sector[FLASH_SECTOR_SIZE]
+    __attribute__((section(".noinit"), aligned(4)));
+/* Data of CMD_FLASH_PATCH. */
+static uint8_t s_patch_data[FLASH_PATCH_MAX_LEN]
+    __attribute__((section(".noinit")));
+
+/* Digest of the current region and the bitmap of rewritten sectors. */
+static uint8_t s_changed[16 + FLASH_BLANK_MAP_MAX_SECTORS / 8]
+    __attribute__((section(".noinit")));
+
+struct write_ctx {
+  const struct flash_region *regions;
+  uint32_t num_regions;
+  uint32_t erase;
+  uint32_t long_status;
+  uint32_t changed_only; /* Only rewrite sectors that differ. */
+  uint32_t cur;         /* Current region. */
+  uint32_t num_written; /* Within the current region. */
+  uint32_t num_erased;  /* Within the current region. */
+  uint32_t total_written;
+  struct MD5Context ctx; /* Of the current region. */
+};
+
+static void send_write_status(const struct write_ctx *wc,
+                              uint32_t num_consumed) {
+  uint32_t st[2] = {num_consumed, wc->total_written};
+  if (wc->long_status) {
+    SLIP_send(st, sizeof(st));
+  } else {
+    SLIP_send(&st[1], sizeof(st[1]));
+  }
+}
+
+/*
+ * Returns 1 if the region reads as all 0xff, 0 otherwise (or on read error).
+ * addr and len must be multiples of 4.
+ */
+static int is_blank(uint32_t addr, uint32_t len) {
+  uint32_t buf[SPI_WRITE_SIZE / 4];
+  while (len > 0) {
+    uint32_t i, n = len;
+    if (n > sizeof(buf)) n = sizeof(buf);
+    if (SPIRead(addr, buf, n) != 0) return 0;
+    for (i = 0; i < n / 4; i++) {
+      if (buf[i] != 0xffffffff) return 0;
+    }
+    addr += n;
+    len -= n;
+  }
+  return 1;
+}
+
+/* Writes SPI_WRITE_SIZE bytes, reads them back and compares. */
+static int program_chunk(uint32_t addr, const uint8_t *data) {
+  uint32_t buf[SPI_WRITE_SIZE / 4];
+  const uint8_t *rb = (const uint8_t *) buf;
+  uint32_t i;
+  if (SPIWrite(addr, data, SPI_WRITE_SIZE) != 0) return 0x37;
+  /* Read back and compare, so the host does not need to verify separately. */
+  if (SPIRead(addr, buf, sizeof(buf)) != 0) return 0x3b;
+  for (i = 0; i < SPI_WRITE_SIZE; i++) {
+    if (rb[i] != data[i]) return 0x3c;
+  }
+  return 0;
+}
+
+/*
+ * Returns 1 if flash at addr has the same contents as data, 0 otherwise (or
+ * on read error). len must be a multiple of SPI_WRITE_SIZE.
+ */
+static int same_as_flash(uint32_t addr, const uint8_t *data, uint32_t len) {
+  uint32_t buf[SPI_WRITE_SIZE / 4];
+  const uint8_t *rb = (const uint8_t *) buf;
+  uint32_t i, off;
+  for (off = 0; off < len; off += SPI_WRITE_SIZE) {
+    if (SPIRead(addr + off, buf, sizeof(buf)) != 0) return 0;
+    for (i = 0; i < SPI_WRITE_SIZE; i++) {
+      if (rb[i] != data[off + i]) return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+ * Collects data of the current sector in s_sector. Once it is complete, the
+ * sector is compared with flash and erased and written only if it differs.
+ */
+static int write_changed_chunk(struct write_ctx *wc, const uint8_t *data) {
+  const struct flash_region *r = &wc->regions[wc->cur];
+  const uint32_t off = wc->num_written % FLASH_SECTOR_SIZE;
+  uint32_t i, sector, sector_addr;
+  for (i = 0; i < SPI_WRITE_SIZE; i++) s_sector[off + i] = data[i];
+  if (off + SPI_WRITE_SIZE < FLASH_SECTOR_SIZE) return 0;
+  sector_addr = r->addr + wc->num_written - off;
+  if (same_as_flash(sector_addr, s_sector, FLASH_SECTOR_SIZE)) return 0;
+  sector = (sector_addr - r->addr) / FLASH_SECTOR_SIZE;
+  s_changed[16 + sector / 8] |= 1 << (sector % 8);
+  if (wc->erase && !is_blank(sector_addr, FLASH_SECTOR_SIZE) &&
+      SPIEraseSector(sector_addr / FLASH_SECTOR_SIZE) != 0) {
+    return 0x36;
+  }
+  for (i = 0; i < FLASH_SECTOR_SIZE; i += SPI_WRITE_SIZE) {
+    int ret = program_chunk(sector_addr + i, s_sector + i);
+    if (ret != 0) return ret;
+  }
+  return 0;
+}
+
+/*
+ * Writes SPI_WRITE_SIZE bytes at the current position, erasing ahead if asked
+ * to (unless already blank), and reports progress. Digest of a region is sent
+ * once it is complete.
+ */
+static int write_chunk(struct write_ctx *wc, uint8_t *data,
+                       uint32_t num_consumed) {
+  const struct flash_region *r;
+  if (wc->cur >= wc->num_regions) return 0x38;
+  r = &wc->regions[wc->cur];
+  if (wc->changed_only) {
+    int ret = write_changed_chunk(wc, data);
+    if (ret != 0) return ret;
+  }
+  while (!wc->changed_only && wc->erase &&
+         wc->num_erased < wc->num_written + SPI_WRITE_SIZE) {
+    const uint32_t erase_addr = r->addr + wc->num_erased;
+    const uint32_t num_left = r->len - wc->num_erased;
+    /* Reading is much faster than erasing, skip the erase if possible. */
+    if (num_left > FLASH_BLOCK_SIZE && erase_addr % FLASH_BLOCK_SIZE == 0) {
+      if (!is_blank(erase_addr, FLASH_BLOCK_SIZE) &&
+          SPIEraseBlock(erase_addr / FLASH_BLOCK_SIZE) != 0) {
+        return 0x35;
+      }
+      wc->num_erased += FLASH_BLOCK_SIZE;
+    } else {
+      /* len % FLASH_SECTOR_SIZE == 0 is enforced, no further checks needed */
+      if (!is_blank(erase_addr, FLASH_SECTOR_SIZE) &&
+          SPIEraseSector(erase_addr / FLASH_SECTOR_SIZE) != 0) {
+        return 0x36;
+      }
+      wc->num_erased += FLASH_SECTOR_SIZE;
+    }
+  }
+  MD5Update(&wc->ctx, data, SPI_WRITE_SIZE);
+  if (!wc->changed_only) {
+    int ret = program_chunk(r->addr + wc->num_written, data);
+    if (ret != 0) return ret;
+  }
+  wc->num_written += SPI_WRITE_SIZE;
+  wc->total_written += SPI_WRITE_SIZE;
+  send_write_status(wc, num_consumed);
+  if (wc->num_written == r->len) {
+    const uint32_t num_sectors = r->len / FLASH_SECTOR_SIZE;
+    uint32_t i;
+    MD5Final(s_changed, &wc->ctx);
+    SLIP_send(s_changed,
+              16 + (wc->changed_only ? (num_sectors + 7) / 8 : 0));
+    for (i = 16; i < sizeof(s_changed); i++) s_changed[i] = 0;
+    MD5Init(&wc->ctx);
+    wc->cur++;
+    wc->num_written = wc->num_erased = 0;
+  }
+  return 0;
+}
+
+/*
+ * Erases the next sector of the current region ahead of time, while waiting
+ * for data. Sectors are erased one by one to keep the wait short, since data
+ * keeps arriving meanwhile.
+ */
+static int erase_ahead(struct write_ctx *wc) {
+  const struct flash_region *r;
+  uint32_t erase_addr;
+  if (!wc->erase || wc->changed_only || wc->cur >= wc->num_regions) return 0;
+  r = &wc->regions[wc->cur];
+  if (wc->num_erased >= r->len) return 0;
+  erase_addr = r->addr + wc->num_erased;
+  if (!is_blank(erase_addr, FLASH_SECTOR_SIZE) &&
+      SPIEraseSector(erase_addr / FLASH_SECTOR_SIZE) != 0) {
+    return 0x36;
+  }
+  wc->num_erased += FLASH_SECTOR_SIZE;
+  return 0;
+}
+
+/*
+ * Receives a stream of data and writes it to a list of regions, in order.
+ * If zlen > 0, the stream is zlib-compressed and zlen bytes long.
+ */
+int do_flash_write_regions(const struct flash_region *regions,
+                           uint32_t num_regions, uint32_t erase, uint32_t zlen,
+                           uint32_t long_status, uint32_t changed_only) {
+  struct write_ctx wc;
+  volatile uint32_t *nr = &s_ub.nr;
+  uint32_t i, total_len = 0, num_consumed = 0, num_reported = 0;
+  uint32_t out_pos = 0, flushed_pos = 0;
+  tinfl_status status = TINFL_STATUS_NEEDS_MORE_INPUT;
+  int ret = 0;
+
+  for (i = 0; i < num_regions; i++) {
+    if (regions[i].addr % FLASH_SECTOR_SIZE != 0) return 0x32;
+    if (regions[i].len == 0 || regions[i].len % FLASH_SECTOR_SIZE != 0) {
+      return 0x33;
+    }
+    if (changed_only &&
+        regions[i].len / FLASH_SECTOR_SIZE > FLASH_BLANK_MAP_MAX_SECTORS) {
+      return 0x3d;
+    }
+    total_len += regions[i].len;
+  }
   if (SPIUnlock() != 0) return 0x34;
 
-  ub.nr = 0;
-  ub.pr = ub.pw = ub.data;
-  ets_isr_attach(ETS_UART_INUM, uart_isr, &ub);
+  memset(&wc, 0, sizeof(wc));
+  wc.regions = regions;
+  wc.num_regions = num_regions;
+  wc.erase = erase;
+  wc.long_status = long_status;
+  wc.changed_only = changed_only;
+  for (i = 16; i < sizeof(s_changed); i++) s_changed[i] = 0;
+  MD5Init(&wc.ctx);
+  if (zlen > 0) tinfl_init(&s_inf);
+
+  s_ub.nr = 0;
+  s_ub.pr = s_ub.pw = s_ub.data;
+  ets_isr_attach(ETS_UART_INUM, uart_isr, &s_ub);
   SET_PERI_REG_MASK(UART_INT_ENA(0), UART_RX_INTS);
   ets_isr_unmask(1 << ETS_UART_INUM);
 
-  SLIP_send(&num_written, 4);
-
-  while (num_written < len) {
-    volatile uint32_t *nr = &ub.nr;
-    /* Prepare the space ahead. */
-    while (erase && num_erased < num_written + SPI_WRITE_SIZE) {
-      const uint32_t num_left = (len - num_erased);
-      if (num_left > FLASH_BLOCK_SIZE && addr % FLASH_BLOCK_SIZE == 0) {
-        if (SPIEraseBlock(addr / FLASH_BLOCK_SIZE) != 0) return 0x35;
-        num_erased += FLASH_BLOCK_SIZE;
-      } else {
-        /* len % FLASH_SECTOR_SIZE == 0 is enforced, no further checks needed */
-        if (SPIEraseSector(addr / FLASH_SECTOR_SIZE) != 0) return 0x36;
-        num_erased += FLASH_SECTOR_SIZE;
-      }
-    }
-    /* Wait for data to arrive. */
+  send_write_status(&wc, num_consumed);
+
+  while (zlen == 0 && wc.total_written < total_len) {
+    /* Wait for data to arrive, erasing ahead meanwhile. */
     while (*nr < SPI_WRITE_SIZE) {
+      ret = erase_ahead(&wc);
+      if (ret != 0) goto out;
     }
-    MD5Update(&ctx, ub.pr, SPI_WRITE_SIZE);
-    if (SPIWrite(addr, ub.pr, SPI_WRITE_SIZE) != 0) return 0x37;
+    /* UART_BUF_SIZE % SPI_WRITE_SIZE == 0, chunks never wrap. */
+    ret = write_chunk(&wc, s_ub.pr, num_consumed + SPI_WRITE_SIZE);
+    if (ret != 0) goto out;
     ets_intr_lock();
     *nr -= SPI_WRITE_SIZE;
     ets_intr_unlock();
-    num_written += SPI_WRITE_SIZE;
-    addr += SPI_WRITE_SIZE;
-    ub.pr += SPI_WRITE_SIZE;
-    if (ub.pr >= ub.data + UART_BUF_SIZE) ub.pr = ub.data;
-    SLIP_send(&num_written, 4);
+    num_consumed += SPI_WRITE_SIZE;
+    s_ub.pr += SPI_WRITE_SIZE;
+    if (s_ub.pr >= s_ub.data + UART_BUF_SIZE) s_ub.pr = s_ub.data;
+  }
+
+  while (zlen > 0 && status != TINFL_STATUS_DONE) {
+    uint32_t flags = TINFL_FLAG_PARSE_ZLIB_HEADER;
+    size_t in_len = 0, out_len = sizeof(s_dict) - out_pos;
+    if (num_consumed < zlen) {
+      if (*nr == 0 && num_consumed != num_reported) {
+        /* Let the host know there is space in the buffer. */
+        send_write_status(&wc, num_consumed);
+        num_reported = num_consumed;
+      }
+      /* Wait for data to arrive, erasing ahead meanwhile. */
+      while (*nr == 0) {
+        ret = erase_ahead(&wc);
+        if (ret != 0) goto out;
+      }
+      in_len = *nr;
+      if (s_ub.pr + in_len > s_ub.data + UART_BUF_SIZE) {
+        in_len = s_ub.data + UART_BUF_SIZE - s_ub.pr;
+      }
+      if (num_consumed + in_len < zlen) flags |= TINFL_FLAG_HAS_MORE_INPUT;
+    }
+    status = tinfl_decompress(&s_inf, s_ub.pr, &in_len, s_dict,
+                              s_dict + out_pos, &out_len, flags);
+    if (status < TINFL_STATUS_DONE ||
+        (status == TINFL_STATUS_NEEDS_MORE_INPUT && num_consumed == zlen)) {
+      ret = 0x39;
+      goto out;
+    }
+    ets_intr_lock();
+    *nr -= in_len;
+    ets_intr_unlock();
+    num_consumed += in_len;
+    s_ub.pr += in_len;
+    if (s_ub.pr >= s_ub.data + UART_BUF_SIZE) s_ub.pr = s_ub.data;
+    out_pos += out_len;
+    /* Write out complete chunks. TINFL_LZ_DICT_SIZE % SPI_WRITE_SIZE == 0. */
+    while (out_pos - flushed_pos >= SPI_WRITE_SIZE) {
+      ret = write_chunk(&wc, s_dict + flushed_pos, num_consumed);
+      if (ret != 0) goto out;
+      flushed_pos += SPI_WRITE_SIZE;
+      num_reported = num_consumed;
+    }
+    if (out_pos == sizeof(s_dict)) out_pos = flushed_pos = 0;
   }
 
+  if (wc.total_written != total_len || out_pos != flushed_pos) ret = 0x3a;
+
+out:
   ets_isr_mask(1 << ETS_UART_INUM);
+  return ret;
+}
 
-  MD5Final(digest, &ctx);
-  SLIP_send(digest, 16);
+/*
+ * Writes back s_sector, the sector at addr with patches applied, if it differs
+ * from flash. Sectors are only erased if a bit needs to go from 0 to 1,
+ * otherwise only the chunks that changed are programmed. stats counts
+ * sectors written and erased.
+ */
+static int flush_patched_sector(uint32_t addr, uint32_t stats[2]) {
+  uint32_t buf[SPI_WRITE_SIZE / 4];
+  const uint8_t *rb = (const uint8_t *) buf;
+  uint8_t changed[FLASH_SECTOR_SIZE / SPI_WRITE_SIZE];
+  uint32_t i, off, any = 0, erase = 0;
+  for (off = 0; off < FLASH_SECTOR_SIZE; off += SPI_WRITE_SIZE) {
+    const uint8_t *p = s_sector + off;
+    uint8_t c = 0;
+    if (SPIRead(addr + off, buf, sizeof(buf)) != 0) return 0xf5;
+    for (i = 0; i < SPI_WRITE_SIZE; i++) {
+      if (rb[i] != p[i]) c = 1;
+      if ((rb[i] & p[i]) != p[i]) erase = 1;
+    }
+    changed[off / SPI_WRITE_SIZE] = c;
+    any |= c;
+  }
+  if (!any) return 0;
+  if (erase && SPIEraseSector(addr / FLASH_SECTOR_SIZE) != 0) return 0xf6;
+  for (off = 0; off < FLASH_SECTOR_SIZE; off += SPI_WRITE_SIZE) {
+    int ret;
+    if (!erase && !changed[off / SPI_WRITE_SIZE]) continue;
+    ret = program_chunk(addr + off, s_sector + off);
+    if (ret != 0) return ret;
+  }
+  stats[0]++;
+  if (erase) stats[1]++;
+  return 0;
+}
 
+int do_flash_patch(const struct flash_region *patches, uint32_t num_patches,
+                   const uint8_t *data, uint32_t data_len) {
+  const uint32_t none = 1; /* Not a sector address. */
+  uint32_t i, j, len = 0, pos = 0, cur = none, stats[2] = {0, 0};
+  int ret;
+  for (i = 0; i < num_patches; i++) {
+    if (patches[i].addr + patches[i].len < patches[i].addr) return 0xf3;
+    len += patches[i].len;
+  }
+  if (len != data_len) return 0xf3;
+  if (SPIUnlock() != 0) return 0x34;
+  for (i = 0; i < num_patches; i++) {
+    uint32_t addr = patches[i].addr, left = patches[i].len;
+    while (left > 0) {
+      const uint32_t off = addr % FLASH_SECTOR_SIZE;
+      uint32_t n = FLASH_SECTOR_SIZE - off;
+      if (n > left) n = left;
+      if (addr - off != cur) {
+        if (cur != none && (ret = flush_patched_sector(cur, stats)) != 0) {
+          return ret;
+        }
+        cur = addr - off;
+        if (SPIRead(cur, s_sector, FLASH_SECTOR_SIZE) != 0) return 0xf4;
+      }
+      for (j = 0; j < n; j++) s_sector[off + j] = data[pos + j];
+      addr += n;
+      left -= n;
+      pos += n;
+    }
+  }
+  if (cur != none && (ret = flush_patched_sector(cur, stats)) != 0) {
+    return ret;
+  }
+  SLIP_send(stats, sizeof(stats));
   return 0;
 }
 
@@ -180,9 +557,12 @@ int do_flash_read(uint32_t addr, uint32_t len, uint32_t block_size,
   return 0;
 }
 
-int do_flash_digest(uint32_t addr, uint32_t len, uint32_t digest_block_size) {
+/*
+ * Sends block digests, if asked for, and stores the overall one in digest.
+ */
+static int flash_digest(uint32_t addr, uint32_t len, uint32_t digest_block_size,
+                        uint8_t digest[16]) {
   uint8_t buf[FLASH_SECTOR_SIZE];
-  uint8_t digest[16];
   uint32_t read_block_size =
       digest_block_size ? digest_block_size : sizeof(buf);
   struct MD5Context ctx;
@@ -198,38 +578,256 @@ int do_flash_digest(uint32_t addr, uint32_t len, uint32_t digest_block_size) {
     if (digest_block_size > 0) {
       MD5Update(&block_ctx, buf, n);
       MD5Final(digest, &block_ctx);
-      send_packet(digest, sizeof(digest));
+      send_packet(digest, 16);
     }
     addr += n;
     len -= n;
   }
   MD5Final(digest, &ctx);
-  send_packet(digest, sizeof(digest));
   return 0;
 }
 
-int do_flash_read_chip_id(void) {
-  uint32_t chip_id = 0;
+int do_flash_digest(uint32_t addr, uint32_t len, uint32_t digest_block_size) {
+  uint8_t digest[16];
+  int ret = flash_digest(addr, len, digest_block_size, digest);
+  if (ret == 0) send_packet(digest, sizeof(digest));
+  return ret;
+}
+
+int do_flash_fingerprint(uint32_t addr, uint32_t len, uint32_t block_size) {
+  uint8_t buf[FLASH_SECTOR_SIZE];
+  uint32_t num_blocks = 0;
+  if (block_size == 0 || block_size > sizeof(buf)) return 0xb2;
+  if ((len + block_size - 1) / block_size > FLASH_FINGERPRINT_MAX_BLOCKS) {
+    return 0xb2;
+  }
+  while (len > 0) {
+    uint32_t n = len;
+    if (n > block_size) n = block_size;
+    if (SPIRead(addr, buf, n) != 0) return 0xb3;
+    s_fingerprints[num_blocks++] = mz_crc32(MZ_CRC32_INIT, buf, n);
+    addr += n;
+    len -= n;
+  }
+  send_packet(s_fingerprints, num_blocks * sizeof(s_fingerprints[0]));
+  return 0;
+}
+
+int do_flash_blank_map(uint32_t addr, uint32_t len) {
+  uint8_t map[FLASH_BLANK_MAP_MAX_SECTORS / 8];
+  uint32_t i, num_sectors = len / FLASH_SECTOR_SIZE;
+  if (addr % FLASH_SECTOR_SIZE != 0 || len % FLASH_SECTOR_SIZE != 0 ||
+      num_sectors == 0 || num_sectors > FLASH_BLANK_MAP_MAX_SECTORS) {
+    return 0xc2;
+  }
+  memset(map, 0, sizeof(map));
+  for (i = 0; i < num_sectors; i++) {
+    if (is_blank(addr + i * FLASH_SECTOR_SIZE, FLASH_SECTOR_SIZE)) {
+      map[i / 8] |= (1 << (i % 8));
+    }
+  }
+  send_packet(map, (num_sectors + 7) / 8);
+  return 0;
+}
+
+static uint32_t read_chip_id(void) {
   WRITE_PERI_REG(SPI_CMD(0), SPI_RDID);
   while (READ_PERI_REG(SPI_CMD(0)) & SPI_RDID) {
   }
-  chip_id = READ_PERI_REG(SPI_W0(0)) & 0xFFFFFF;
+  return READ_PERI_REG(SPI_W0(0)) & 0xFFFFFF;
+}
+
+int do_flash_read_chip_id(void) {
+  uint32_t chip_id = read_chip_id();
   send_packet(&chip_id, sizeof(chip_id));
   return 0;
 }
 
+static uint32_t get_le32(const uint8_t *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/* Size of the args of a command in a CMD_BATCH, -1 if it cannot be batched. */
+static int batch_args_len(uint8_t cmd) {
+  switch (cmd) {
+    case CMD_FLASH_ERASE:
+    case CMD_FLASH_DIGEST:
+      return 8;
+    case CMD_FLASH_READ_CHIP_ID:
+      return 0;
+  }
+  return -1;
+}
+
+/*
+ * Runs the commands of a CMD_BATCH packet (what follows the command byte)
+ * and sends a tagged response for each. The packet is checked as a whole
+ * before anything is run. Stops at the first command that fails.
+ */
+int do_batch(const uint8_t *p, uint32_t len) {
+  uint32_t i, num_cmds, off;
+  if (len < 1 || p[0] == 0 || p[0] > FLASH_BATCH_MAX_CMDS) return 0xe1;
+  num_cmds = p[0];
+  for (i = 0, off = 1; i < num_cmds; i++) {
+    int args_len = off + 2 <= len ? batch_args_len(p[off + 1]) : -1;
+    if (args_len < 0 || off + 2 + args_len > len) return 0xe2;
+    off += 2 + args_len;
+  }
+  if (off != len) return 0xe2;
+  for (i = 0, off = 1; i < num_cmds; i++) {
+    /* Tag, status, up to 16 bytes of output. */
+    uint8_t resp[2 + 16];
+    uint32_t resp_len = 2;
+    const uint8_t *args = p + off + 2;
+    int ret = 0;
+    resp[0] = p[off];
+    switch (p[off + 1]) {
+      case CMD_FLASH_ERASE:
+        ret = do_flash_erase(get_le32(args), get_le32(args + 4));
+        break;
+      case CMD_FLASH_DIGEST:
+        ret = flash_digest(get_le32(args), get_le32(args + 4), 0, resp + 2);
+        resp_len += 16;
+        break;
+      case CMD_FLASH_READ_CHIP_ID: {
+        uint32_t chip_id = read_chip_id();
+        resp[2] = chip_id;
+        resp[3] = chip_id >> 8;
+        resp[4] = chip_id >> 16;
+        resp[5] = chip_id >> 24;
+        resp_len += 4;
+        break;
+      }
+    }
+    resp[1] = ret;
+    if (ret != 0) resp_len = 2;
+    send_packet(resp, resp_len);
+    if (ret != 0) return ret;
+    off += 2 + batch_args_len(p[off + 1]);
+  }
+  return 0;
+}
+
+int do_set_baud_rate(uint32_t baud_rate) {
+  uint8_t probe[16];
+  uint32_t confirm = 0;
+  const uint32_t old_div = READ_PERI_REG(UART_CLKDIV(0)) & UART_CLKDIV_CNT;
+  if (baud_rate == 0) return 0xa2;
+  SLIP_send(&baud_rate, sizeof(baud_rate));
+  /* Let the response drain and the host switch too. */
+  ets_delay_us(1000);
+  uart_div_modify(0, UART_CLKDIV_26MHZ(baud_rate));
+  if (SLIP_recv_timeout(probe, sizeof(probe), 500000) == sizeof(probe)) {
+    SLIP_send(probe, sizeof(probe));
+    if (SLIP_recv_timeout(&confirm, sizeof(confirm), 500000) ==
+            sizeof(confirm) &&
+        confirm == 0x4941484f /* OHAI */) {
+      return 0;
+    }
+  }
+  ets_delay_us(1000);
+  uart_div_modify(0, old_div);
+  return 0xa3;
+}
+
+/*
+ * Runs the CPU at double clock. Peripheral (and thus UART) clock is not
+ * affected, but ets_delay_us needs to know.
+ */
+void boost_cpu(void) {
+  s_saved_clocks.cpu_freq = ets_get_cpu_frequency();
+  s_saved_clocks.dport_cpu_clk = READ_PERI_REG(DPORT_CPU_CLK_REG);
+  if (s_saved_clocks.dport_cpu_clk & DPORT_CPU_CLK_X2) return;
+  SET_PERI_REG_MASK(DPORT_CPU_CLK_REG, DPORT_CPU_CLK_X2);
+  ets_update_cpu_frequency(s_saved_clocks.cpu_freq * 2);
+}
+
+int do_set_spi_params(uint32_t flash_params) {
+  uint32_t mode = (flash_params >> 8) & 0xf, freq = flash_params & 0xf;
+  uint32_t ctrl, clock, io_mux;
+  if (!s_saved_clocks.spi_changed) {
+    s_saved_clocks.spi_ctrl = READ_PERI_REG(SPI_CTRL(0));
+    s_saved_clocks.spi_clock = READ_PERI_REG(SPI_CLOCK(0));
+    s_saved_clocks.io_mux_conf = READ_PERI_REG(PERIPHS_IO_MUX_CONF);
+  }
+  ctrl = s_saved_clocks.spi_ctrl & ~SPI_READ_MODE_MASK;
+  io_mux = s_saved_clocks.io_mux_conf & ~SPI0_CLK_EQU_SYSCLK;
+  switch (mode) {
+    case 0: /* QIO */
+    case 2: /* DIO */
+      ctrl |= SPI_DIO_MODE | SPI_FASTRD_MODE;
+      break;
+    case 1: /* QOUT */
+    case 3: /* DOUT */
+      ctrl |= SPI_DOUT_MODE | SPI_FASTRD_MODE;
+      break;
+    default:
+      return 0xd1;
+  }
+  switch (freq) {
+    case 0: /* 40 MHz */
+      clock = SPI_CLOCK_DIV(1);
+      break;
+    case 1: /* 26 MHz */
+      clock = SPI_CLOCK_DIV(2);
+      break;
+    case 2: /* 20 MHz */
+      clock = SPI_CLOCK_DIV(3);
+      break;
+    case 0xf: /* 80 MHz */
+      clock = SPI_CLK_EQU_SYSCLK;
+      io_mux |= SPI0_CLK_EQU_SYSCLK;
+      break;
+    default:
+      return 0xd2;
+  }
+  WRITE_PERI_REG(PERIPHS_IO_MUX_CONF, io_mux);
+  WRITE_PERI_REG(SPI_CLOCK(0), clock);
+  WRITE_PERI_REG(SPI_CTRL(0), ctrl);
+  s_saved_clocks.spi_changed = 1;
+  return 0;
+}
+
+void restore_clocks(void) {
+  if (s_saved_clocks.spi_changed) {
+    WRITE_PERI_REG(SPI_CTRL(0), s_saved_clocks.spi_ctrl);
+    WRITE_PERI_REG(SPI_CLOCK(0), s_saved_clocks.spi_clock);
+    WRITE_PERI_REG(PERIPHS_IO_MUX_CONF, s_saved_clocks.io_mux_conf);
+    s_saved_clocks.spi_changed = 0;
+  }
+  WRITE_PERI_REG(DPORT_CPU_CLK_REG, s_saved_clocks.dport_cpu_clk);
+  ets_update_cpu_frequency(s_saved_clocks.cpu_freq);
+}
+
+/* Command packet: the command byte, args may follow (version 9+). */
+static uint8_t s_cmd[1 + 1 + FLASH_BATCH_MAX_CMDS * 10];
+
+/*
+ * Args of the command in s_cmd, pkt_len long: from the same packet or, if
+ * there are none there, from the next one. Returns their length; more than
+ * max_len if they do not fit.
+ */
+static uint32_t recv_args(uint32_t *args, uint32_t max_len, uint32_t pkt_len) {
+  uint32_t i;
+  if (pkt_len <= 1) return SLIP_recv(args, max_len);
+  if (pkt_len - 1 > max_len) return max_len + 1;
+  for (i = 0; i < pkt_len - 1; i++) ((uint8_t *) args)[i] = s_cmd[1 + i];
+  return pkt_len - 1;
+}
+
 uint8_t cmd_loop(void) {
   uint8_t cmd;
   do {
     uint32_t args[4];
-    uint32_t len = SLIP_recv(&cmd, 1);
-    if (len != 1) {
+    uint32_t len = SLIP_recv(s_cmd, sizeof(s_cmd));
+    if (len < 1) {
       continue;
     }
+    cmd = s_cmd[0];
     uint8_t resp = 0xff;
     switch (cmd) {
       case CMD_FLASH_ERASE: {
-        len = SLIP_recv(args, sizeof(args));
+        len = recv_args(args, sizeof(args), len);
         if (len == 8) {
           resp = do_flash_erase(args[0] /* addr */, args[1] /* len */);
         } else {
@@ -238,17 +836,20 @@ uint8_t cmd_loop(void) {
         break;
       }
       case CMD_FLASH_WRITE: {
-        len = SLIP_recv(args, sizeof(args));
+        len = recv_args(args, sizeof(args), len);
         if (len == 12) {
-          resp = do_flash_write(args[0] /* addr */, args[1] /* len */,
-                                args[2] /* erase */);
+          s_regions[0].addr = args[0];
+          s_regions[0].len = args[1];
+          resp = do_flash_write_regions(s_regions, 1, args[2] /* erase */,
+                                        0 /* zlen */, 0 /* long_status */,
+                                        0 /* changed_only */);
         } else {
           resp = 0x41;
         }
         break;
       }
       case CMD_FLASH_READ: {
-        len = SLIP_recv(args, sizeof(args));
+        len = recv_args(args, sizeof(args), len);
         if (len == 16) {
           resp = do_flash_read(args[0] /* addr */, args[1], /* len */
                                args[2] /* block_size */,
@@ -259,7 +860,7 @@ uint8_t cmd_loop(void) {
         break;
       }
       case CMD_FLASH_DIGEST: {
-        len = SLIP_recv(args, sizeof(args));
+        len = recv_args(args, sizeof(args), len);
         if (len == 12) {
           resp = do_flash_digest(args[0] /* addr */, args[1], /* len */
                                  args[2] /* digest_block_size */);
@@ -268,6 +869,97 @@ uint8_t cmd_loop(void) {
         }
         break;
       }
+      case CMD_FLASH_WRITE_DEFLATED: {
+        len = recv_args(args, sizeof(args), len);
+        if (len == 16) {
+          s_regions[0].addr = args[0];
+          s_regions[0].len = args[1];
+          resp = do_flash_write_regions(s_regions, 1, args[2] /* erase */,
+                                        args[3] /* zlen */, 1, 0);
+        } else {
+          resp = 0x71;
+        }
+        break;
+      }
+      case CMD_FLASH_WRITE_REGIONS:
+      case CMD_FLASH_WRITE_CHANGED: {
+        len = recv_args(args, sizeof(args), len);
+        if (len != 12 || args[0] == 0 || args[0] > FLASH_WRITE_MAX_REGIONS) {
+          resp = 0x81;
+          break;
+        }
+        len = SLIP_recv(s_regions, sizeof(s_regions));
+        if (len == args[0] * sizeof(s_regions[0])) {
+          resp = do_flash_write_regions(s_regions, args[0] /* num_regions */,
+                                        args[1] /* erase */, args[2] /* zlen */,
+                                        1, cmd == CMD_FLASH_WRITE_CHANGED);
+        } else {
+          resp = 0x82;
+        }
+        break;
+      }
+      case CMD_FLASH_PATCH: {
+        len = recv_args(args, sizeof(args), len);
+        if (len != 8 || args[0] == 0 || args[0] > FLASH_WRITE_MAX_REGIONS ||
+            args[1] > FLASH_PATCH_MAX_LEN) {
+          resp = 0xf1;
+          break;
+        }
+        len = SLIP_recv(s_regions, sizeof(s_regions));
+        if (len != args[0] * sizeof(s_regions[0])) {
+          resp = 0xf2;
+          break;
+        }
+        len = SLIP_recv(s_patch_data, sizeof(s_patch_data));
+        if (len == args[1]) {
+          resp = do_flash_patch(s_regions, args[0] /* num_patches */,
+                                s_patch_data, len);
+        } else {
+          resp = 0xf2;
+        }
+        break;
+      }
+      case CMD_SET_BAUD_RATE: {
+        len = recv_args(args, sizeof(args), len);
+        if (len == 4) {
+          resp = do_set_baud_rate(args[0] /* baud_rate */);
+        } else {
+          resp = 0xa1;
+        }
+        break;
+      }
+      case CMD_FLASH_FINGERPRINT: {
+        len = recv_args(args, sizeof(args), len);
+        if (len == 12) {
+          resp = do_flash_fingerprint(args[0] /* addr */, args[1] /* len */,
+                                      args[2] /* block_size */);
+        } else {
+          resp = 0xb1;
+        }
+        break;
+      }
+      case CMD_FLASH_BLANK_MAP: {
+        len = recv_args(args, sizeof(args), len);
+        if (len == 8) {
+          resp = do_flash_blank_map(args[0] /* addr */, args[1] /* len */);
+        } else {
+          resp = 0xc1;
+        }
+        break;
+      }
+      case CMD_SET_SPI_PARAMS: {
+        len = recv_args(args, sizeof(args), len);
+        if (len == 4) {
+          resp = do_set_spi_params(args[0] /* flash_params */);
+        } else {
+          resp = 0xd3;
+        }
+        break;
+      }
+      case CMD_BATCH: {
+        resp = do_batch(s_cmd + 1, len - 1);
+        break;
+      }
       case CMD_FLASH_READ_CHIP_ID: {
         resp = do_flash_read_chip_id();
         break;
@@ -290,7 +982,8 @@ uint8_t cmd_loop(void) {
 
 void stub_main(void) {
   uint32_t baud_rate = params[0];
-  uint32_t greeting = 0x4941484f; /* OHAI */
+  uint32_t greeting[3] = {0x4941484f /* OHAI */, STUB_FLASHER_VERSION,
+                          UART_BUF_SIZE};
   uint8_t last_cmd;
 
   /* This points at us right now, reset for next boot. */
@@ -299,6 +992,8 @@ void stub_main(void) {
   /* Selects SPI functions for flash pins. */
   SelectSpiFunction();
 
+  boost_cpu();
+
   if (baud_rate > 0) {
     ets_delay_us(1000);
     uart_div_modify(0, UART_CLKDIV_26MHZ(baud_rate));
@@ -307,12 +1002,14 @@ void stub_main(void) {
   /* Give host time to get ready too. */
   ets_delay_us(10000);
 
-  SLIP_send(&greeting, 4);
+  SLIP_send(greeting, sizeof(greeting));
 
   last_cmd = cmd_loop();
 
   ets_delay_us(10000);
 
+  restore_clocks();
+
   if (last_cmd == CMD_BOOT_FW) {
     /*
      * Find the return address in our own stack and change it.
@@ -320,6 +1017,8 @@ void stub_main(void) {
      * patch up its RA: it returns from UartDwnLdProc, then from f_400011ac,
      * then jumps to 0x4000108a, then checks strapping bits again (which will
      * not have changed), and then proceeds to 0x400010a8.
+     * When uploaded by stub_loader, we are started with the stack and
+     * registers the ROM gave the loader, so the same RA is found there.
      */
     volatile uint32_t *sp = &baud_rate;
     while (*sp != (uint32_t) 0x40001100) sp++;
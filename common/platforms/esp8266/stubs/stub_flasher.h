@@ -1,6 +1,39 @@
 #ifndef CS_COMMON_PLATFORMS_ESP8266_STUBS_STUB_FLASHER_H_
 #define CS_COMMON_PLATFORMS_ESP8266_STUBS_STUB_FLASHER_H_
 
+/*
+ * Protocol version, sent as a 32-bit LE word right after the "OHAI" greeting,
+ * in the same packet. Older stubs send just "OHAI", which means version 0.
+ *
+ * 1: CMD_FLASH_WRITE_DEFLATED, flow control in CMD_FLASH_READ.
+ * 2: CMD_FLASH_WRITE_REGIONS.
+ * 3: CMD_SET_BAUD_RATE.
+ * 4: CMD_FLASH_FINGERPRINT.
+ * 5: CMD_FLASH_BLANK_MAP, writes skip erasing sectors that are already blank.
+ * 6: Written data is read back and compared, writes fail on mismatch.
+ * 7: Size of the write receive buffer follows the version in the greeting.
+ * 8: CMD_SET_SPI_PARAMS, CPU runs at double clock while the stub is active.
+ * 9: Args may follow the command byte in the same packet, CMD_BATCH.
+ * 10: CMD_FLASH_WRITE_CHANGED.
+ * 11: CMD_FLASH_PATCH.
+ */
+#define STUB_FLASHER_VERSION 11
+
+/* Maximum number of regions in a single CMD_FLASH_WRITE_REGIONS. */
+#define FLASH_WRITE_MAX_REGIONS 64
+
+/* Maximum number of blocks in a single CMD_FLASH_FINGERPRINT. */
+#define FLASH_FINGERPRINT_MAX_BLOCKS 1024
+
+/* Maximum number of sectors in a single CMD_FLASH_BLANK_MAP (16 MB). */
+#define FLASH_BLANK_MAP_MAX_SECTORS 4096
+
+/* Maximum number of commands in a single CMD_BATCH. */
+#define FLASH_BATCH_MAX_CMDS 32
+
+/* Maximum length of the data of a single CMD_FLASH_PATCH. */
+#define FLASH_PATCH_MAX_LEN 2048
+
 enum stub_cmd {
   /*
    * Erase a region of SPI flash.
@@ -15,7 +48,8 @@ enum stub_cmd {
    * Write to the SPI flash.
    *
    * Args: addr, len, erase; addr and len must be SECTOR_SIZE-aligned.
-   *       If erase != 0, perform erase before writing.
+   *       If erase != 0, perform erase before writing. Sectors that are
+   *       already blank are not erased.
    * Input: Stream of data to be written, note: no SLIP encapsulation here.
    * Output: SLIP packets with number of bytes written after every write.
    *         This can (and should) be used for flow control. Flasher will
@@ -28,13 +62,15 @@ enum stub_cmd {
   /*
    * Read from the SPI flash.
    *
-   * Args: addr, len, block_size; no alignment requirements, block_size <= 4K.
-   * Input: None.
+   * Args: addr, len, block_size, max_in_flight; no alignment requirements,
+   *       block_size <= 4K.
+   * Input: Acks, 32-bit LE total number of bytes received so far. Host must
+   *        ack before max_in_flight bytes are outstanding and the last ack
+   *        must be len.
    * Output: Packets of up to block_size with data.
    *         Last packet is the MD5 digest of the data.
    *
-   * Note: No flow control is performed, it is assumed that the host can cope
-   * with the inbound stream.
+   * Note: Version 0 stubs take no max_in_flight and expect no acks.
    */
   CMD_FLASH_READ = 2,
 
@@ -88,6 +124,131 @@ enum stub_cmd {
    * Output: None.
    */
   CMD_REBOOT = 7,
+
+  /*
+   * Write zlib-compressed data to the SPI flash.
+   *
+   * Args: addr, len, erase, zlen; addr and len must be SECTOR_SIZE-aligned,
+   *       len is the size of uncompressed data, zlen - of compressed.
+   *       If erase != 0, perform erase before writing.
+   * Input: Stream of zlen bytes of compressed data, no SLIP encapsulation.
+   * Output: SLIP packets with two 32-bit words: number of compressed bytes
+   *         consumed and number of bytes written. Sent after every write and
+   *         whenever the flasher runs out of input.
+   *         Host should use the first number for flow control, same way as
+   *         with CMD_FLASH_WRITE.
+   *         Final packet will contain MD5 digest of the uncompressed data.
+   */
+  CMD_FLASH_WRITE_DEFLATED = 8,
+
+  /*
+   * Write a list of regions of the SPI flash in one go.
+   *
+   * Args: num_regions, erase, zlen; num_regions <= FLASH_WRITE_MAX_REGIONS.
+   *       If erase != 0, perform erase before writing.
+   *       If zlen != 0, input is a zlib stream of zlen bytes.
+   * Input: A SLIP packet with num_regions pairs of (addr, len), SECTOR_SIZE
+   *        aligned, followed by a stream of data for all the regions, in
+   *        order, no SLIP encapsulation.
+   * Output: Same as CMD_FLASH_WRITE_DEFLATED, number of bytes written counts
+   *         all the regions. MD5 digest of each region is sent when the region
+   *         is complete.
+   */
+  CMD_FLASH_WRITE_REGIONS = 9,
+
+  /*
+   * Switch UART to a different baud rate.
+   *
+   * Args: baud_rate.
+   * Input: At the new rate: a 16-byte probe packet, then, after it has been
+   *        echoed back, a 4-byte "OHAI" confirmation packet.
+   * Output: At the old rate: a 4-byte packet with the new rate, sent before
+   *         switching. At the new rate: echo of the probe.
+   *         If either packet does not arrive within 500 ms, the flasher goes
+   *         back to the old rate and responds with an error there.
+   */
+  CMD_SET_BAUD_RATE = 10,
+
+  /*
+   * Compute CRC32 (same as zlib's) of each block of the specified region.
+   * Much cheaper than CMD_FLASH_DIGEST, meant for finding changed blocks.
+   *
+   * Args: addr, len, block_size; no alignment requirements, block_size <= 4K,
+   *       len / block_size (rounded up) <= FLASH_FINGERPRINT_MAX_BLOCKS.
+   * Input: None.
+   * Output: A single packet with checksums of all the blocks, 32-bit LE each.
+   */
+  CMD_FLASH_FINGERPRINT = 11,
+
+  /*
+   * Find out which sectors of the specified region are blank (all 0xff).
+   *
+   * Args: addr, len; must be FLASH_SECTOR_SIZE-aligned,
+   *       len / FLASH_SECTOR_SIZE <= FLASH_BLANK_MAP_MAX_SECTORS.
+   * Input: None.
+   * Output: A single packet with a bitmap, one bit per sector, LSB first.
+   *         Bit is set if the sector is blank.
+   */
+  CMD_FLASH_BLANK_MAP = 12,
+
+  /*
+   * Speed up SPI flash access for the rest of the session. Original settings
+   * are restored before booting the firmware.
+   *
+   * Args: flash_params; same as bytes 2 (mode) and 3 (size, freq) of the
+   *       firmware header: mode << 8 | size << 4 | freq. Quad modes fall back
+   *       to their dual counterparts, the flash may not have QE enabled yet.
+   * Input: None.
+   * Output: None, only the status.
+   */
+  CMD_SET_SPI_PARAMS = 13,
+
+  /*
+   * Run several small commands in a row, without a round trip for each.
+   *
+   * Args: In the same packet as the command byte, packed: number of commands
+   *       (8 bits, at most FLASH_BATCH_MAX_CMDS), then for each of them a tag
+   *       byte, the command byte and its args. Commands that can be batched:
+   *       CMD_FLASH_ERASE (addr, len), CMD_FLASH_DIGEST (addr, len; overall
+   *       digest only) and CMD_FLASH_READ_CHIP_ID (none).
+   * Input: None.
+   * Output: A packet for each command as it completes: the tag, the status
+   *         and, on success, the output (16 byte digest or 32-bit chip ID).
+   *         Nothing is run if the packet is malformed, running stops at the
+   *         first command that fails.
+   */
+  CMD_BATCH = 14,
+
+  /*
+   * Same as CMD_FLASH_WRITE_REGIONS, but each sector is first compared with
+   * the data received for it and is only erased and written if it differs.
+   * Saves the host a digest pass over flash before writing.
+   *
+   * Args: Same as CMD_FLASH_WRITE_REGIONS. Regions may not be longer than
+   *       FLASH_BLANK_MAP_MAX_SECTORS.
+   * Input: Same as CMD_FLASH_WRITE_REGIONS.
+   * Output: Same as CMD_FLASH_WRITE_REGIONS, except that the MD5 digest of a
+   *         region is followed, in the same packet, by a bitmap of the
+   *         sectors that were rewritten, one bit per sector, LSB first.
+   */
+  CMD_FLASH_WRITE_CHANGED = 15,
+
+  /*
+   * Replaces bytes at any offset, keeping the rest of the sectors they are
+   * in. Each sector a patch touches is read, patched in RAM and written back
+   * only if that changes it, without erasing it if the patch only clears
+   * bits. Written data is read back and compared.
+   *
+   * Args: number of patches (at most FLASH_WRITE_MAX_REGIONS), total length
+   *       of their data (at most FLASH_PATCH_MAX_LEN).
+   * Input: A packet with an (addr, len) pair for each patch, then a packet
+   *        with their data, concatenated. Sectors are written out as patches
+   *        move on to another sector, patches in the same sector should be
+   *        next to each other.
+   * Output: A packet with the number of sectors written and how many of them
+   *         had to be erased.
+   */
+  CMD_FLASH_PATCH = 16,
 };
 
 #endif /* CS_COMMON_PLATFORMS_ESP8266_STUBS_STUB_FLASHER_H_ */
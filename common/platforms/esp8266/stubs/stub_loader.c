@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2016 Cesanta Software Limited
+ * All rights reserved
+ *
+ * First stage loader for the flasher stub, see stub_loader.h.
+ */
+
+#include "stub_loader.h"
+
+#include "rom_functions.h"
+
+#include "slip.h"
+
+#define UART_CLKDIV_26MHZ(B) (52000000 + B / 2) / B
+
+/* Baud rate. */
+uint32_t params[1] __attribute__((section(".params")));
+
+/* IRAM only supports 32-bit access, data is received here first. */
+static uint32_t s_buf[STUB_LOADER_PACKET_SIZE / 4];
+
+/*
+ * Registers the ROM entered us with: a0 (return address), a1 (stack pointer)
+ * and the callee-saved a12-a15. The flasher is started with exactly these,
+ * as if the ROM had called it directly, so it can find its way back into the
+ * ROM and boot the firmware the same way it does when uploaded without us.
+ */
+uint32_t s_entry_regs[6];
+
+void stub_main(void);
+
+__asm__(
+    "  .section .text.stub_entry, \"ax\", @progbits\n"
+    "  .literal_position\n"
+    "  .literal .Lentry_regs, s_entry_regs\n"
+    "  .literal .Lstub_main, stub_main\n"
+    "  .align 4\n"
+    "  .global stub_entry\n"
+    "  .type stub_entry, @function\n"
+    "stub_entry:\n"
+    "  l32r a2, .Lentry_regs\n"
+    "  s32i a0, a2, 0\n"
+    "  s32i a1, a2, 4\n"
+    "  s32i a12, a2, 8\n"
+    "  s32i a13, a2, 12\n"
+    "  s32i a14, a2, 16\n"
+    "  s32i a15, a2, 20\n"
+    "  l32r a2, .Lstub_main\n"
+    "  jx a2\n"
+    "  .size stub_entry, . - stub_entry\n");
+
+/* Drops our frame and transfers control to entry, does not return. */
+static void __attribute__((noreturn)) jump_to(uint32_t entry) {
+  __asm volatile(
+      "mov a3, %0\n"
+      "mov a2, %1\n"
+      "l32i a0, a2, 0\n"
+      "l32i a1, a2, 4\n"
+      "l32i a12, a2, 8\n"
+      "l32i a13, a2, 12\n"
+      "l32i a14, a2, 16\n"
+      "l32i a15, a2, 20\n"
+      "jx a3\n"
+      :
+      : "r"(entry), "r"(s_entry_regs)
+      : "a2", "a3", "memory");
+  while (1) {
+  }
+}
+
+static uint32_t load_segment(uint32_t *dst, uint32_t len) {
+  uint8_t digest[16];
+  struct MD5Context ctx;
+  MD5Init(&ctx);
+  while (len > 0) {
+    uint32_t i, n = SLIP_recv(s_buf, sizeof(s_buf));
+    if (n == 0 || n % 4 != 0 || n > len) return 2;
+    MD5Update(&ctx, s_buf, n);
+    for (i = 0; i < n / 4; i++) *dst++ = s_buf[i];
+    len -= n;
+  }
+  MD5Final(digest, &ctx);
+  SLIP_send(digest, sizeof(digest));
+  return 0;
+}
+
+void stub_main(void) {
+  uint32_t baud_rate = params[0];
+  uint32_t greeting = STUB_LOADER_GREETING;
+
+  if (baud_rate > 0) {
+    ets_delay_us(1000);
+    uart_div_modify(0, UART_CLKDIV_26MHZ(baud_rate));
+  }
+
+  /* Give host time to get ready too. */
+  ets_delay_us(10000);
+
+  SLIP_send(&greeting, sizeof(greeting));
+
+  while (1) {
+    uint32_t hdr[2];
+    uint8_t resp;
+    if (SLIP_recv(hdr, sizeof(hdr)) != sizeof(hdr)) {
+      resp = 1;
+      SLIP_send(&resp, 1);
+      continue;
+    }
+    if (hdr[1] == 0) jump_to(hdr[0]);
+    if (hdr[0] % 4 != 0 || hdr[1] % 4 != 0) {
+      resp = 1;
+      SLIP_send(&resp, 1);
+      continue;
+    }
+    resp = load_segment((uint32_t *) hdr[0], hdr[1]);
+    if (resp != 0) SLIP_send(&resp, 1);
+  }
+}
@@ -0,0 +1,24 @@
+#ifndef CS_COMMON_PLATFORMS_ESP8266_STUBS_STUB_LOADER_H_
+#define CS_COMMON_PLATFORMS_ESP8266_STUBS_STUB_LOADER_H_
+
+/*
+ * First stage loader. It is small, so uploading it through the ROM at the
+ * ROM's baud rate is quick. It switches UART to the baud rate given in the
+ * first param and receives the actual stub at that rate.
+ *
+ * Protocol (SLIP packets):
+ *  - Loader sends a 4-byte greeting, STUB_LOADER_GREETING, at the new rate.
+ *  - Host sends a segment header: addr, len (32-bit LE words). addr and len
+ *    must be 4-byte aligned.
+ *    If len is 0, loader jumps to addr and does not return. The stub at addr
+ *    starts with the stack and registers the ROM started the loader with.
+ *  - Host sends len bytes of data in packets of up to STUB_LOADER_PACKET_SIZE
+ *    (multiples of 4), without waiting for acknowledgement.
+ *  - Loader responds with MD5 digest of the segment (16 bytes) or with a
+ *    single byte error code.
+ */
+
+#define STUB_LOADER_GREETING 0x5244414c /* LADR */
+#define STUB_LOADER_PACKET_SIZE 1024
+
+#endif /* CS_COMMON_PLATFORMS_ESP8266_STUBS_STUB_LOADER_H_ */
@@ -194,6 +194,12 @@
 #define SPIFFS_READ_ONLY                      0
 #endif
 
+// Enable this to have object lookup searches for a given id compare 64-bit
+// words of entries at a time. Needs a fast 64-bit memcpy, meant for hosts.
+#ifndef SPIFFS_LU_SCAN_WORDS
+#define SPIFFS_LU_SCAN_WORDS                  0
+#endif
+
 // Set SPIFFS_TEST_VISUALISATION to non-zero to enable SPIFFS_vis function
 // in the api. This function will visualize all filesystem using given printf
 // function.
@@ -118,6 +118,37 @@ s32_t spiffs_phys_cpy(
 }
 #endif // !SPIFFS_READ_ONLY
 
+#if SPIFFS_LU_SCAN_WORDS
+// Returns the index of the first of ids [from, to) that equals obj_id, or to
+// if there is none. Compares a 64-bit word of ids at a time: a word has a
+// matching id if, xored with the id in every lane, it has a zero lane.
+static int spiffs_obj_lu_find_in_page(
+    const spiffs_obj_id *ids,
+    int from,
+    int to,
+    spiffs_obj_id obj_id) {
+  const int lanes = sizeof(uint64_t) / sizeof(spiffs_obj_id);
+  const int bits = 8 * sizeof(spiffs_obj_id);
+  uint64_t pattern = 0, lo = 0, hi, x;
+  int i;
+  for (i = 0; i < lanes; i++) {
+    pattern = (pattern << bits) | obj_id;
+    lo = (lo << bits) | 1;
+  }
+  hi = lo << (bits - 1);
+  for (; from + lanes <= to; from += lanes) {
+    memcpy(&x, ids + from, sizeof(x));
+    x ^= pattern;
+    if (((x - lo) & ~x & hi) != 0) break;
+  }
+  // The matching word, if any, and the tail.
+  for (; from < to; from++) {
+    if (ids[from] == obj_id) return from;
+  }
+  return to;
+}
+#endif
+
 // Find object lookup entry containing given id with visitor.
 // Iterate over object lookup pages in each block until a given object id entry is found.
 // When found, the visitor function is called with block index, entry index and user data.
@@ -185,6 +216,18 @@ s32_t spiffs_obj_lu_find_entry_visitor(
           cur_entry - entry_offset < entries_per_page && // for non-last obj lookup pages
           cur_entry < (int)SPIFFS_OBJ_LOOKUP_MAX_ENTRIES(fs)) // for last obj lookup page
       {
+#if SPIFFS_LU_SCAN_WORDS
+        if (flags & SPIFFS_VIS_CHECK_ID) {
+          // skip to the next matching entry of this page
+          int end = MIN(entry_offset + entries_per_page,
+              (int)SPIFFS_OBJ_LOOKUP_MAX_ENTRIES(fs));
+          int next = entry_offset + spiffs_obj_lu_find_in_page(obj_lu_buf,
+              cur_entry - entry_offset, end - entry_offset, obj_id);
+          entry_count -= next - cur_entry;
+          cur_entry = next;
+          if (cur_entry >= end) break;
+        }
+#endif
         if ((flags & SPIFFS_VIS_CHECK_ID) == 0 || obj_lu_buf[cur_entry-entry_offset] == obj_id) {
           if (block_ix) *block_ix = cur_block;
           if (lu_entry) *lu_entry = cur_entry;
@@ -812,6 +855,9 @@ s32_t spiffs_object_create(
   fs->stats_p_allocated++;
 
   // write empty object index page
+  // padding is written too, keep it the same as erased flash and the image
+  // a function of the contents only
+  memset(&oix_hdr, 0xff, sizeof(oix_hdr));
   oix_hdr.p_hdr.obj_id = obj_id;
   oix_hdr.p_hdr.span_ix = 0;
   oix_hdr.p_hdr.flags = 0xff & ~(SPIFFS_PH_FLAG_FINAL | SPIFFS_PH_FLAG_INDEX | SPIFFS_PH_FLAG_USED);
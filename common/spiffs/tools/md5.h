@@ -0,0 +1,21 @@
+#ifndef _MD5_H_
+#define _MD5_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* MD5 (RFC 1321), for manifests of the tools' images. */
+struct md5_ctx {
+  uint32_t state[4];
+  uint64_t len; /* Bytes hashed so far. */
+  uint8_t buf[64];
+};
+
+void md5_init(struct md5_ctx *ctx);
+void md5_update(struct md5_ctx *ctx, const void *data, size_t len);
+void md5_final(struct md5_ctx *ctx, uint8_t digest[16]);
+
+/* Lowercase hex of a digest, out must have room for 33 chars. */
+void md5_hex(const uint8_t digest[16], char *out);
+
+#endif
@@ -3,12 +3,21 @@
 
 #include <spiffs.h>
 
-extern spiffs fs;
+#define MEM_SPIFFS_LOG_PAGE_SIZE 256
 
-extern char *image; /* in memory flash image */
-extern size_t image_size;
+/*
+ * A filesystem on an in-memory flash image. Instances are independent of
+ * each other, so several of them can be worked on in parallel.
+ */
+struct mem_spiffs {
+  spiffs fs;
+  char *image; /* in memory flash image */
+  size_t image_size;
+  u8_t work_buf[MEM_SPIFFS_LOG_PAGE_SIZE * 2];
+  u8_t fds[32 * 4];
+};
 
-s32_t mem_spiffs_erase(u32_t addr, u32_t size);
-int mem_spiffs_mount(void);
+s32_t mem_spiffs_erase(struct mem_spiffs *m, u32_t addr, u32_t size);
+int mem_spiffs_mount(struct mem_spiffs *m);
 
 #endif
@@ -1,122 +1,316 @@
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <dirent.h>
 
+#include "md5.h"
 #include "mem_spiffs.h"
 
-void copy(char *path, char *fname) {
+/* A file of the source tree, read once and added to every image. */
+struct src_file {
+  char name[SPIFFS_OBJ_NAME_LEN];
+  u8_t *data;
   int size;
-  u8_t *buf;
+  u8_t md5[16];
+};
+
+/* An image to build: its size, where it goes and how it went. */
+struct variant {
+  size_t size;
+  const char *out; /* NULL means stdout. */
+  const struct src_file *files;
+  int num_files;
+  char *added; /* Whether each file made it into the image. */
+  int verbose;
+  int all_files; /* Fail unless every file makes it into the image. */
+  int ok;
+  u8_t md5[16];
+};
+
+int read_file(const char *path, const char *fname, struct src_file *f) {
   struct stat st;
-  spiffs_file sfd;
+  struct md5_ctx ctx;
   int ifd;
 
   ifd = open(path, O_RDONLY);
   if (ifd == -1) {
     fprintf(stderr, "cannot open %s\n", path);
     perror("cannot open");
-    return;
+    return -1;
   }
 
   if (fstat(ifd, &st) == -1) {
     fprintf(stderr, "cannot stat %s\n", path);
-    return;
+    close(ifd);
+    return -1;
   }
-  size = st.st_size;
+  f->size = st.st_size;
 
-  if (size == -1) {
-    fprintf(stderr, "skipping %s\n", path);
-    return;
+  f->data = malloc(f->size > 0 ? f->size : 1);
+  if (read(ifd, f->data, f->size) != f->size) {
+    fprintf(stderr, "unable to read file %s\n", fname);
+    free(f->data);
+    close(ifd);
+    return -1;
   }
+  close(ifd);
 
-  buf = malloc(size);
+  snprintf(f->name, sizeof(f->name), "%s", fname);
+  md5_init(&ctx);
+  md5_update(&ctx, f->data, f->size);
+  md5_final(&ctx, f->md5);
+  return 0;
+}
 
-  if (read(ifd, buf, size) != size) {
-    fprintf(stderr, "unable to read file %s\n", fname);
-    return;
-  }
+int copy(spiffs *fs, const struct src_file *f, int verbose) {
+  spiffs_file sfd;
+  int ret = -1;
 
-  if ((sfd = SPIFFS_open(&fs, fname, SPIFFS_CREAT | SPIFFS_TRUNC | SPIFFS_RDWR,
-                         0)) == -1) {
-    fprintf(stderr, "SPIFFS_open %s failed: %d\n", fname, SPIFFS_errno(&fs));
-    goto cleanup;
+  if ((sfd = SPIFFS_open(fs, (char *) f->name,
+                         SPIFFS_CREAT | SPIFFS_TRUNC | SPIFFS_RDWR, 0)) == -1) {
+    fprintf(stderr, "SPIFFS_open %s failed: %d\n", f->name, SPIFFS_errno(fs));
+    return -1;
   }
 
-  if (SPIFFS_write(&fs, sfd, (uint8_t *) buf, size) == -1) {
-    fprintf(stderr, "SPIFFS_write %s failed: %d\n", fname, SPIFFS_errno(&fs));
+  if (SPIFFS_write(fs, sfd, f->data, f->size) == -1) {
+    fprintf(stderr, "SPIFFS_write %s failed: %d\n", f->name, SPIFFS_errno(fs));
     goto spifs_cleanup;
   }
 
-  fprintf(stderr, "a %s\n", fname);
+  if (verbose) fprintf(stderr, "a %s\n", f->name);
+  ret = 0;
 
 spifs_cleanup:
-  SPIFFS_close(&fs, sfd);
-cleanup:
-  free(buf);
-  close(ifd);
+  SPIFFS_close(fs, sfd);
+  return ret;
+}
+
+static int skip_hidden(const struct dirent *ent) {
+  /* Excludes ".", ".." and hidden files. */
+  return ent->d_name[0] != '.';
+}
+
+static int by_name(const struct dirent **a, const struct dirent **b) {
+  return strcmp((*a)->d_name, (*b)->d_name);
 }
 
-void read_dir(DIR *dir, const char *dir_path) {
+/*
+ * Files are added in name order rather than in readdir order, so the same set
+ * of files always produces the same image and an image that differs in one
+ * file only differs in the sectors of that file and those after it.
+ */
+int read_dir(const char *dir_path, struct src_file **files, int *num_files) {
   char path[512];
-  struct dirent *ent;
+  struct dirent **ents;
+  int i, n;
 
-  while ((ent = readdir(dir)) != NULL) {
-    if (ent->d_name[0] == '.') { /* Excludes ".", ".." and hidden files. */
-      continue;
+  n = scandir(dir_path, &ents, skip_hidden, by_name);
+  if (n < 0) return -1;
+  *files = calloc(n > 0 ? n : 1, sizeof(**files));
+  *num_files = 0;
+  for (i = 0; i < n; i++) {
+    snprintf(path, sizeof(path), "%s/%s", dir_path, ents[i]->d_name);
+    if (read_file(path, ents[i]->d_name, *files + *num_files) == 0) {
+      (*num_files)++;
     }
-    sprintf(path, "%s/%s", dir_path, ent->d_name);
-    copy(path, ent->d_name);
+    free(ents[i]);
   }
-  closedir(dir);
+  free(ents);
+  return 0;
 }
 
-int main(int argc, char **argv) {
-  const char *root_dir;
-  DIR *dir;
+static void write_json_string(FILE *fp, const char *s) {
+  fputc('"', fp);
+  for (; *s != '\0'; s++) {
+    if (*s == '"' || *s == '\\') {
+      fprintf(fp, "\\%c", *s);
+    } else if ((unsigned char) *s < 0x20) {
+      fprintf(fp, "\\u%04x", *s);
+    } else {
+      fputc(*s, fp);
+    }
+  }
+  fputc('"', fp);
+}
 
-  if (argc < 3) {
-    fprintf(stderr, "usage: %s <size> <root_dir>\n", argv[0]);
-    return 1;
+/*
+ * Manifest of an image: its size and MD5, and the size and MD5 of each file,
+ * for comparing with what is on a device without reading the image.
+ */
+int write_manifest(const struct variant *v, const char *path) {
+  char hex[33];
+  int i, n = 0;
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) {
+    fprintf(stderr, "cannot write %s, err: %d\n", path, errno);
+    return -1;
+  }
+  md5_hex(v->md5, hex);
+  fprintf(fp, "{\n  \"size\": %lu,\n  \"md5\": \"%s\",\n  \"files\": {",
+          (unsigned long) v->size, hex);
+  for (i = 0; i < v->num_files; i++) {
+    if (!v->added[i]) continue;
+    md5_hex(v->files[i].md5, hex);
+    fprintf(fp, "%s\n    ", n++ > 0 ? "," : "");
+    write_json_string(fp, v->files[i].name);
+    fprintf(fp, ": {\"size\": %d, \"md5\": \"%s\"}", v->files[i].size, hex);
   }
+  fprintf(fp, "\n  }\n}\n");
+  return fclose(fp) == 0 ? 0 : -1;
+}
 
-  image_size = atoi(argv[1]);
-  if (image_size == 0) {
-    fprintf(stderr, "invalid size '%s'\n", argv[1]);
-    return 1;
+void *build_image(void *arg) {
+  struct variant *v = (struct variant *) arg;
+  struct mem_spiffs m;
+  struct md5_ctx ctx;
+  char manifest[512];
+  u32_t total, used;
+  FILE *fp;
+  int i, num_dropped = 0;
+
+  memset(&m, 0, sizeof(m));
+  m.image_size = v->size;
+  m.image = malloc(m.image_size);
+  v->added = calloc(v->num_files > 0 ? v->num_files : 1, 1);
+  if (m.image == NULL || v->added == NULL) {
+    fprintf(stderr, "cannot allocate %lu bytes\n", (unsigned long) v->size);
+    goto out;
   }
-  root_dir = argv[2];
 
-  image = malloc(image_size);
-  if (image == NULL) {
-    fprintf(stderr, "cannot allocate %lu bytes\n", image_size);
-    return 1;
+  mem_spiffs_erase(&m, 0, m.image_size);
+  mem_spiffs_mount(&m);  // Will fail but is required.
+  SPIFFS_format(&m.fs);
+  if (mem_spiffs_mount(&m) != SPIFFS_OK) {
+    fprintf(stderr, "SPIFFS_mount failed: %d\n", SPIFFS_errno(&m.fs));
+    goto out;
   }
 
-  mem_spiffs_erase(0, image_size);
-  mem_spiffs_mount();  // Will fail but is required.
-  SPIFFS_format(&fs);
-  if (mem_spiffs_mount() != SPIFFS_OK) {
-    fprintf(stderr, "SPIFFS_mount failed: %d\n", SPIFFS_errno(&fs));
-    return 1;
+  for (i = 0; i < v->num_files; i++) {
+    v->added[i] = (copy(&m.fs, &v->files[i], v->verbose) == 0);
+    if (!v->added[i]) num_dropped++;
   }
+  SPIFFS_info(&m.fs, &total, &used);
+  SPIFFS_unmount(&m.fs);
+  if (v->all_files && num_dropped > 0) {
+    fprintf(stderr, "%s: %d of %d files do not fit:",
+            v->out != NULL ? v->out : "image", num_dropped, v->num_files);
+    for (i = 0; i < v->num_files; i++) {
+      if (!v->added[i]) fprintf(stderr, " %s", v->files[i].name);
+    }
+    fprintf(stderr, "\n");
+    goto out;
+  }
+
+  md5_init(&ctx);
+  md5_update(&ctx, m.image, m.image_size);
+  md5_final(&ctx, v->md5);
+
+  fp = v->out != NULL ? fopen(v->out, "wb") : stdout;
+  if (fp == NULL) {
+    fprintf(stderr, "cannot write %s, err: %d\n", v->out, errno);
+    goto out;
+  }
+  if (fwrite(m.image, m.image_size, 1, fp) != 1) {
+    fprintf(stderr, "cannot write %s, err: %d\n",
+            v->out != NULL ? v->out : "image", errno);
+    if (v->out != NULL) fclose(fp);
+    goto out;
+  }
+  if (v->out != NULL) {
+    if (fclose(fp) != 0) goto out;
+    snprintf(manifest, sizeof(manifest), "%s.json", v->out);
+    if (write_manifest(v, manifest) != 0) goto out;
+  }
+
+  fprintf(stderr, "%s%sImage stats: size=%u, space: total=%u, used=%u, "
+          "free=%u\n", v->out != NULL ? v->out : "",
+          v->out != NULL ? ": " : "", (unsigned int) m.image_size, total, used,
+          total - used);
+  v->ok = 1;
+
+out:
+  free(m.image);
+  return NULL;
+}
+
+static void show_usage(char *argv[]) {
+  fprintf(stderr,
+          "usage: %s <size> <root_dir>\n"
+          "       %s -b <root_dir> <size>:<out_file> ...\n"
+          "Batch mode (-b) reads the files once and builds each image in its "
+          "own thread,\nwriting it to <out_file> and its manifest to "
+          "<out_file>.json. Images that\nnot all the files fit in are not "
+          "written and make the exit status nonzero.\n",
+          argv[0], argv[0]);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  const char *root_dir;
+  struct src_file *files;
+  struct variant *variants;
+  pthread_t *threads;
+  int batch, num_files, num_variants, i, ret = 0;
+
+  batch = (argc > 1 && strcmp(argv[1], "-b") == 0);
+  if (argc < 3 || (batch && argc < 4)) show_usage(argv);
+
+  num_variants = batch ? argc - 3 : 1;
+  variants = calloc(num_variants, sizeof(*variants));
+  threads = calloc(num_variants, sizeof(*threads));
+  for (i = 0; i < num_variants; i++) {
+    const char *spec = argv[batch ? 3 + i : 1];
+    char *end;
+    variants[i].size = strtoul(spec, &end, 0);
+    if (batch) {
+      if (*end != ':' || end[1] == '\0') {
+        fprintf(stderr, "invalid image spec '%s'\n", spec);
+        return 1;
+      }
+      variants[i].out = end + 1;
+    }
+    if (variants[i].size == 0) {
+      fprintf(stderr, "invalid size '%s'\n", spec);
+      return 1;
+    }
+  }
+  root_dir = argv[2];
 
   fprintf(stderr, "adding files in directory %s\n", root_dir);
-  if ((dir = opendir(root_dir)) == NULL) {
+  if (read_dir(root_dir, &files, &num_files) != 0) {
     fprintf(stderr, "unable to open directory %s\n", root_dir);
     return 1;
-  } else {
-    read_dir(dir, root_dir);
   }
 
-  fwrite(image, image_size, 1, stdout);
-
-  u32_t total, used;
-  SPIFFS_info(&fs, &total, &used);
-  fprintf(stderr, "Image stats: size=%u, space: total=%u, used=%u, free=%u\n",
-          (unsigned int) image_size, total, used, total - used);
+  for (i = 0; i < num_variants; i++) {
+    variants[i].files = files;
+    variants[i].num_files = num_files;
+    variants[i].verbose = !batch;
+    variants[i].all_files = batch;
+  }
+  if (!batch) {
+    build_image(&variants[0]);
+  } else {
+    for (i = 0; i < num_variants; i++) {
+      if (pthread_create(&threads[i], NULL, build_image, &variants[i]) != 0) {
+        fprintf(stderr, "cannot start a thread for %s\n", variants[i].out);
+        return 1;
+      }
+    }
+    for (i = 0; i < num_variants; i++) pthread_join(threads[i], NULL);
+  }
+  for (i = 0; i < num_variants; i++) {
+    if (!variants[i].ok) ret = 1;
+  }
 
-  return 0;
+  for (i = 0; i < num_variants; i++) free(variants[i].added);
+  for (i = 0; i < num_files; i++) free(files[i].data);
+  free(files);
+  free(threads);
+  free(variants);
+  return ret;
 }
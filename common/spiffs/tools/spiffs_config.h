@@ -23,6 +23,9 @@ typedef uint16_t u16_t;
 typedef int8_t s8_t;
 typedef uint8_t u8_t;
 
+// HAL callbacks get the filesystem, images do not have to be globals.
+#define SPIFFS_HAL_CALLBACK_EXTRA 1
+
 #include "spiffs_config_common.h"
 
 #endif /* SPIFFS_CONFIG_H_ */
@@ -15,6 +15,8 @@ int main(int argc, char **argv) {
   int i;
   int list = 0, vis = 0;
   const char *extDir = ".";
+  struct mem_spiffs m;
+  spiffs *fs = &m.fs;
 
   for (i = 1; i < argc && argv[i][0] == '-'; i++) {
     if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
@@ -41,23 +43,23 @@ int main(int argc, char **argv) {
   }
 
   fseek(fp, 0, SEEK_END);
-  image_size = ftell(fp);
+  m.image_size = ftell(fp);
   fseek(fp, 0, SEEK_SET);
 
-  image = (char *) malloc(image_size);
-  if (fread(image, image_size, 1, fp) < 1) {
+  m.image = (char *) malloc(m.image_size);
+  if (fread(m.image, m.image_size, 1, fp) < 1) {
     fprintf(stderr, "cannot read %s, err: %d\n", filename, errno);
     return 1;
   }
 
-  mem_spiffs_mount();
+  mem_spiffs_mount(&m);
 
-  if (vis) SPIFFS_vis(&fs);
+  if (vis) SPIFFS_vis(fs);
 
   {
     spiffs_DIR d;
     struct spiffs_dirent de;
-    SPIFFS_opendir(&fs, ".", &d);
+    SPIFFS_opendir(fs, ".", &d);
 
     while (SPIFFS_readdir(&d, &de) != NULL) {
       if (list) {
@@ -77,21 +79,21 @@ int main(int argc, char **argv) {
           return 1;
         }
 
-        in = SPIFFS_open_by_dirent(&fs, &de, SPIFFS_RDONLY, 0);
+        in = SPIFFS_open_by_dirent(fs, &de, SPIFFS_RDONLY, 0);
         if (in < 0) {
           fprintf(stderr, "cannot open spiffs file %s, err: %d\n", de.name,
-                  SPIFFS_errno(&fs));
+                  SPIFFS_errno(fs));
           return 1;
         }
 
         buf = malloc(de.size);
-        if (SPIFFS_read(&fs, in, buf, de.size) != de.size) {
+        if (SPIFFS_read(fs, in, buf, de.size) != de.size) {
           fprintf(stderr, "cannot read %s, err: %d\n", de.name,
-                  SPIFFS_errno(&fs));
+                  SPIFFS_errno(fs));
           return 1;
         }
 
-        SPIFFS_close(&fs, in);
+        SPIFFS_close(fs, in);
         fwrite(buf, de.size, 1, out);
         free(buf);
         fclose(out);
@@ -101,7 +103,7 @@ int main(int argc, char **argv) {
     SPIFFS_closedir(&d);
   }
 
-  free(image);
+  free(m.image);
   fclose(fp);
 
   return 0;
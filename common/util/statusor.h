@@ -59,8 +59,10 @@ class StatusOr {
   // Shorthand for status().ok().
   bool ok() const { return status_.ok(); }
 
-  // Returns value or crashes if ok() is false.
-  inline const T& ValueOrDie() const;
+  // Returns value or crashes if ok() is false. Called on a temporary, e.g.
+  // f().ValueOrDie(), the value is moved out instead of copied.
+  inline const T& ValueOrDie() const &;
+  inline T ValueOrDie() &&;
 
   // Extracts the value, reverts the object to UNKNOWN status.
   inline T MoveValueOrDie();
@@ -146,11 +148,17 @@ inline StatusOr<T>& StatusOr<T>::operator=(StatusOr<U>&& other) {
 }
 
 template<typename T>
-const T& StatusOr<T>::ValueOrDie() const {
+const T& StatusOr<T>::ValueOrDie() const & {
   assert(ok());
   return value_;
 }
 
+template<typename T>
+inline T StatusOr<T>::ValueOrDie() && {
+  assert(ok());
+  return std::move(value_);
+}
+
 template<typename T>
 inline T StatusOr<T>::MoveValueOrDie() {
   assert(ok());
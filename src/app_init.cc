@@ -50,12 +50,25 @@ util::Status initApp(int *argc, char *argv[], Config *config,
       "If set, bytes read from a serial port in console mode will be "
       "appended to the given file.",
       "file"));
+  commonOpts.append(QCommandLineOption(
+      "console-log-timestamps",
+      "Prefix each line in the console log with the time it was received."));
+  commonOpts.append(QCommandLineOption(
+      "console-log-max-size",
+      "When the console log gets this big, it is renamed to <file>.1 and a "
+      "new one is started. 0 means no limit.",
+      "bytes", "0"));
   commonOpts.append(QCommandLineOption(
       Flasher::kMergeFSOption,
       "If set, merge the device FS data with the factory image"));
   commonOpts.append(QCommandLineOption(
       Flasher::kDumpFSOption,
       "Dump file system image to a given file before merging.", "filename"));
+  commonOpts.append(QCommandLineOption(
+      Flasher::kPlanOption,
+      "Connect to the device and print what flashing would erase and write, "
+      "with an estimate of how long it takes, without changing anything. "
+      "ESP8266 only."));
   commonOpts.append(QCommandLineOption(
       {"verbose", "V"},
       "Verbosity level. 0 – normal output, 1 - also print critical (but not "
@@ -80,13 +93,107 @@ util::Status initApp(int *argc, char *argv[], Config *config,
       {"p", "platform"},
       "Target device platform. Required. Valid values: esp8266, cc3200.",
       "platform"));
-  cliOpts.append(QCommandLineOption("port", "Serial port to use.", "port"));
+  cliOpts.append(QCommandLineOption(
+      "port",
+      "Serial port to use. For ESP8266, tcp://host:port connects to a network "
+      "serial bridge using RFC 2217, add ?raw if the bridge does not speak "
+      "telnet.",
+      "port"));
+  cliOpts.append(QCommandLineOption(
+      "ports",
+      "Comma-separated list of serial ports to flash in parallel, instead of "
+      "--port. Wildcards are allowed, e.g. /dev/ttyUSB*.",
+      "ports"));
+  cliOpts.append(QCommandLineOption(
+      "max-parallel",
+      "With --ports, flash at most this many devices at a time, starting the "
+      "rest as others finish. 0 means all at once.",
+      "n", "0"));
+  cliOpts.append(QCommandLineOption(
+      "max-writers-per-hub",
+      "With --ports or --batch, let at most this many devices behind the same "
+      "USB hub write or read flash at a time, the rest connect and verify "
+      "meanwhile. Full-speed adapters on a hub share its bandwidth. Hubs are "
+      "only known on Linux. 0 means no limit.",
+      "n", "0"));
+  cliOpts.append(QCommandLineOption(
+      "workers",
+      "With --ports or --batch, flash in this many worker processes, each "
+      "one a --server of its own, pinned to a CPU on Linux. This process "
+      "hands out the devices and collects results and metrics. Expanded "
+      "firmware parts are mapped from the cache, shared by all of them. 0 "
+      "means flash in this process.",
+      "n", "0"));
+  cliOpts.append(QCommandLineOption(
+      "ota",
+      "With --flash, first ask the firmware running on the device for its IP "
+      "address. If it has one, upload the bundle to the firmware's updater "
+      "over Wi-Fi instead of flashing it over serial. Devices that are not "
+      "on the network, or do not run the firmware, are flashed over serial."));
+  cliOpts.append(QCommandLineOption(
+      "watch",
+      "With --ports, keep running and flash devices as they are plugged into "
+      "ports that match it."));
   cliOpts.append(
       QCommandLineOption("probe", "Check device presence on a given port."));
   cliOpts.append(QCommandLineOption(
       "get-mac", "Output MAC address of the device on a given port."));
   cliOpts.append(QCommandLineOption(
       "flash", "Flash firmware from the given file.", "file"));
+  cliOpts.append(QCommandLineOption(
+      "metrics-textfile",
+      "After each device, write statistics of all the runs so far (per-port "
+      "throughput, phase durations, retries, failures by adapter) to this "
+      "file in the Prometheus text format, e.g. for the node_exporter "
+      "textfile collector. With --server, they can also be fetched with the "
+      "metrics request.",
+      "file"));
+  cliOpts.append(QCommandLineOption(
+      "server",
+      "Keep running and take flash, probe and get-mac requests as JSON lines "
+      "on a local socket with the given name (a path on UNIX). Firmware "
+      "bundles are cached between requests.",
+      "name"));
+  cliOpts.append(QCommandLineOption(
+      "batch",
+      "Flash devices as listed in a JSON file, in one go: {\"firmware\": "
+      "\"fw.zip\", \"max_parallel\": 4, \"jobs\": [{\"port\": "
+      "\"/dev/ttyUSB0\", \"firmware\": \"other.zip\", \"options\": "
+      "{\"esp8266-flash-size\": \"4M\"}}, ...]}. Top-level firmware "
+      "defaults to --flash, max_parallel to --max-parallel, paths are "
+      "relative to the file. Flags are set with true and unset with false.",
+      "file"));
+  cliOpts.append(QCommandLineOption(
+      "register-devices",
+      "Register each device that is flashed successfully with the cloud at "
+      "the given URL, e.g. https://console.mongoose-iot.com/register_device. "
+      "Requests go out in the background, the device can be unplugged as "
+      "soon as flashing is done. Needs the MAC address, so ESP8266 only.",
+      "URL"));
+  cliOpts.append(QCommandLineOption(
+      "registrations-file",
+      "With --register-devices, append the cloud ID and key of each "
+      "registered device to the given file, one JSON object per line, "
+      "instead of printing them.",
+      "file"));
+  cliOpts.append(QCommandLineOption(
+      "report",
+      "With --ports or --batch, write a JSON report with the result, time "
+      "taken and bytes written for each device to the given file, or to "
+      "stdout if it is -.",
+      "file"));
+  cliOpts.append(QCommandLineOption(
+      "metrics",
+      "After flashing, output time spent in each phase, data throughput and "
+      "other counters. Printed if the value is -, otherwise written to the "
+      "given file as JSON.",
+      "file"));
+  cliOpts.append(QCommandLineOption(
+      "trace-serial",
+      "Record the traffic on the serial port, with timestamps, to the given "
+      "file. With --ports or --batch, each port gets its own file, "
+      "<file>.<port>. See mft-trace for decoding it.",
+      "file"));
   cliOpts.append(QCommandLineOption(
       {"debug", "d"}, "Enable debug output. Equivalent to --V=4"));
 #if (QT_VERSION < QT_VERSION_CHECK(5, 4, 0))
@@ -0,0 +1,86 @@
+#include "bandwidth_scheduler.h"
+
+#include <QDebug>
+#include <QDir>
+#include <QFileInfo>
+#include <QMutexLocker>
+#include <QRegExp>
+#include <QStringList>
+
+QString usbHubOf(const QString &portName) {
+#ifdef Q_OS_LINUX
+  // /sys/class/tty/ttyUSB0/device resolves to something like
+  // /sys/devices/pci0000:00/0000:00:14.0/usb1/1-1/1-1.4/1-1.4:1.0/ttyUSB0,
+  // interface 1-1.4:1.0 of device 1-1.4 on port 4 of hub 1-1.
+  const QString dev = QFileInfo(QFileInfo(portName).canonicalFilePath())
+                          .fileName();
+  const QString path =
+      QFileInfo("/sys/class/tty/" + dev + "/device").canonicalFilePath();
+  if (path.isEmpty()) return QString();
+  const QStringList parts = path.split('/', QString::SkipEmptyParts);
+  const QRegExp iface("\\d+-[\\d.]+:\\d+\\.\\d+");
+  for (int i = parts.size() - 1; i >= 2; i--) {
+    if (iface.exactMatch(parts[i])) return parts[i - 2];
+  }
+#else
+  Q_UNUSED(portName);
+#endif
+  return QString();
+}
+
+class BandwidthScheduler::Gate : public Flasher::BandwidthGate {
+ public:
+  Gate(BandwidthScheduler *scheduler, const QString &hub)
+      : scheduler_(scheduler), hub_(hub) {
+  }
+
+  void acquire() override {
+    scheduler_->acquire(hub_);
+  }
+
+  void release() override {
+    scheduler_->release(hub_);
+  }
+
+ private:
+  BandwidthScheduler *const scheduler_;
+  const QString hub_;
+};
+
+BandwidthScheduler::BandwidthScheduler(int maxPerHub) : maxPerHub_(maxPerHub) {
+}
+
+BandwidthScheduler::~BandwidthScheduler() {
+}
+
+Flasher::BandwidthGate *BandwidthScheduler::gate(const QString &portName) {
+  if (maxPerHub_ <= 0) return nullptr;
+  const QString hub = usbHubOf(portName);
+  if (hub.isEmpty()) return nullptr;
+  qInfo() << portName << "is on USB hub" << hub;
+  QMutexLocker lock(&lock_);
+  // A port can be on another hub by the time the next device shows up on it.
+  std::unique_ptr<Gate> &g = gates_[hub + " " + portName];
+  if (g == nullptr) g.reset(new Gate(this, hub));
+  return g.get();
+}
+
+void BandwidthScheduler::acquire(const QString &hubName) {
+  QMutexLocker lock(&lock_);
+  Hub &hub = hubs_[hubName];
+  const quint64 ticket = nextTicket_++;
+  hub.queue.append(ticket);
+  while (hub.active >= maxPerHub_ || hub.queue.first() != ticket) {
+    changed_.wait(&lock_);
+  }
+  hub.queue.removeFirst();
+  hub.active++;
+  // The next in line may fit as well.
+  changed_.wakeAll();
+}
+
+void BandwidthScheduler::release(const QString &hubName) {
+  QMutexLocker lock(&lock_);
+  hubs_[hubName].active--;
+  changed_.wakeAll();
+}
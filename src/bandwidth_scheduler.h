@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ */
+
+#ifndef CS_MFT_SRC_BANDWIDTH_SCHEDULER_H_
+#define CS_MFT_SRC_BANDWIDTH_SCHEDULER_H_
+
+#include <map>
+#include <memory>
+
+#include <QList>
+#include <QMutex>
+#include <QString>
+#include <QWaitCondition>
+
+#include "flasher.h"
+
+// Full-speed USB-serial bridges behind a USB 2.0 hub share the hub's
+// transaction translator, and with many of them streaming at high baud rates
+// at once it becomes the bottleneck for all of them. Returns the hub a
+// serial port hangs off, as its sysfs device name (e.g. "1-1.4", "usb2" for
+// root hubs), or an empty string if it is not known: not a USB port, or not
+// Linux.
+QString usbHubOf(const QString &portName);
+
+// Limits the number of flashers that move bulk data (write, read flash) at
+// the same time through the same hub. The rest wait their turn in the order
+// they asked, connecting, erasing and verifying in the meantime, so the
+// latency-bound phases of some ports overlap with bulk transfers of others.
+// Ports with no known hub are not limited. Thread-safe.
+class BandwidthScheduler {
+ public:
+  // maxPerHub of 0 means no limit.
+  explicit BandwidthScheduler(int maxPerHub);
+  ~BandwidthScheduler();
+
+  // Gate for a flasher using the port, owned by the scheduler. Null if the
+  // port is not limited.
+  Flasher::BandwidthGate *gate(const QString &portName);
+
+ private:
+  class Gate;
+  struct Hub {
+    int active = 0;
+    QList<quint64> queue;  // Tickets of the waiting flashers, in order.
+  };
+
+  void acquire(const QString &hub);
+  void release(const QString &hub);
+
+  const int maxPerHub_;
+  QMutex lock_;
+  QWaitCondition changed_;
+  quint64 nextTicket_ = 0;
+  std::map<QString, Hub> hubs_;
+  std::map<QString, std::unique_ptr<Gate>> gates_;  // By hub and port.
+};
+
+#endif /* CS_MFT_SRC_BANDWIDTH_SCHEDULER_H_ */
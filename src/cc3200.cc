@@ -1,8 +1,8 @@
 #include "cc3200.h"
 
+#include <algorithm>
 #include <map>
 #include <memory>
-#include <vector>
 #ifdef Q_OS_OSX
 #include <sys/ioctl.h>
 #include <IOKit/serial/ioss.h>
@@ -13,11 +13,13 @@
 #include <QDataStream>
 #include <QDebug>
 #include <QDir>
+#include <QElapsedTimer>
 #include <QFile>
 #include <QMutex>
 #include <QMutexLocker>
 #include <QSerialPort>
 #include <QSerialPortInfo>
+#include <QSet>
 #include <QThread>
 #ifndef NO_LIBFTDI
 #include <ftdi.h>
@@ -28,7 +30,11 @@
 
 #include "config.h"
 #include "fs.h"
+#include "latency_histogram.h"
+#include "log.h"
 #include "serial.h"
+#include "serial_profile.h"
+#include "serial_trace.h"
 #include "status_qt.h"
 
 #if (QT_VERSION < QT_VERSION_CHECK(5, 5, 0))
@@ -38,6 +44,8 @@
 namespace CC3200 {
 
 const char kFormatFailFS[] = "cc3200-format-sflash";
+const char kPipelineWritesOption[] = "cc3200-pipeline-writes";
+const char kSPIFFSInPlaceOption[] = "cc3200-spiffs-in-place";
 
 namespace {
 
@@ -45,6 +53,14 @@ const int kSerialSpeed = 921600;
 const int kVendorID = 0x0451;
 const int kProductID = 0xC32A;
 const int kDefaultTimeoutMs = 1000;
+// Bootloader detection: break is held for kBreakMs and the ACK is expected
+// within kBreakAckTimeoutMs of its release. Breaks are repeated until the
+// loader responds, for at most kBootLoaderWaitMs.
+const int kBreakMs = 50;
+const int kBreakAckTimeoutMs = 50;
+const int kBootLoaderWaitMs = 1500;
+// How long the reset line is held low.
+const int kResetPulseMs = 5;
 
 const int kStorageID = 0;
 const char kFWFilename[] = "/sys/mcuimg.bin";
@@ -81,6 +97,39 @@ const char kOpcodeSwitchUART2Apps = 0x33;
 
 const qint32 kFlashBlockSize = 4096;
 
+// Name of the opcode in latency metrics.
+QString opcodeName(char opcode) {
+  switch (opcode) {
+    case kOpcodeStartUpload:
+      return "start_upload";
+    case kOpcodeFinishUpload:
+      return "finish_upload";
+    case kOpcodeFileChunk:
+      return "file_chunk";
+    case kOpcodeFormatFlash:
+      return "format_flash";
+    case kOpcodeGetFileInfo:
+      return "get_file_info";
+    case kOpcodeReadFileChunk:
+      return "read_file_chunk";
+    case kOpcodeStorageWrite:
+      return "storage_write";
+    case kOpcodeFileErase:
+      return "file_erase";
+    case kOpcodeGetVersionInfo:
+      return "get_version_info";
+    case kOpcodeEraseBlocks:
+      return "erase_blocks";
+    case kOpcodeGetStorageInfo:
+      return "get_storage_info";
+    case kOpcodeExecFromRAM:
+      return "exec_from_ram";
+    case kOpcodeSwitchUART2Apps:
+      return "switch_uart2_apps";
+  }
+  return QString("opcode_%1").arg(quint8(opcode), 2, 16, QChar('0'));
+}
+
 struct VersionInfo {
   quint8 byte1;
   quint8 byte16;
@@ -119,13 +168,15 @@ util::StatusOr<QByteArray> readBytes(QSerialPort *s, int n,
   char c = 0;
   while (i < n) {
     if (s->bytesAvailable() == 0 && !s->waitForReadyRead(timeout)) {
-      qDebug() << "Read bytes:" << r.toHex();
+      qCDebug(Log::proto) << "Read bytes:" << r.toHex();
+      SerialTrace::recordRead(s, r.constData(), r.length());
       return util::Status(
           util::error::DEADLINE_EXCEEDED,
           QString("Timeout on reading byte %1").arg(i).toStdString());
     }
     if (!s->getChar(&c)) {
-      qDebug() << "Read bytes:" << r.toHex();
+      qCDebug(Log::proto) << "Read bytes:" << r.toHex();
+      SerialTrace::recordRead(s, r.constData(), r.length());
       return util::Status(util::error::UNKNOWN,
                           QString("Error reading byte %1: %2")
                               .arg(i)
@@ -135,14 +186,17 @@ util::StatusOr<QByteArray> readBytes(QSerialPort *s, int n,
     r.append(c);
     i++;
   }
-  qDebug() << "Read bytes:" << r.toHex();
+  qCDebug(Log::proto) << "Read bytes:" << r.toHex();
+  SerialTrace::recordRead(s, r.constData(), r.length());
   return r;
 }
 
 util::Status writeBytes(QSerialPort *s, const QByteArray &bytes,
                         int timeout = kDefaultTimeoutMs) {
   // qDebug() << "Writing bytes:" << bytes.toHex();
-  if (!s->write(bytes)) {
+  const qint64 written = s->write(bytes);
+  SerialTrace::recordWrite(s, bytes.constData(), written);
+  if (!written) {
     return util::Status(
         util::error::UNKNOWN,
         QString("Write failed: %1").arg(s->errorString()).toStdString());
@@ -173,8 +227,8 @@ util::Status sendAck(QSerialPort *s, int timeout = kDefaultTimeoutMs) {
   return writeBytes(s, QByteArray("\x00\xCC", 2), timeout);
 }
 
-util::Status doBreak(QSerialPort *s, int timeout = kDefaultTimeoutMs) {
-  qInfo() << "Sending break...";
+util::Status doBreak(QSerialPort *s, int timeout = kBreakAckTimeoutMs) {
+  qDebug() << "Sending break...";
   s->clear();
   if (!s->setBreakEnabled(true)) {
     return util::Status(util::error::UNKNOWN,
@@ -182,17 +236,37 @@ util::Status doBreak(QSerialPort *s, int timeout = kDefaultTimeoutMs) {
                             .arg(s->errorString())
                             .toStdString());
   }
-  QThread::msleep(500);
+  SerialTrace::recordControl(s, SerialTrace::Event::Break, 1);
+  QThread::msleep(kBreakMs);
   if (!s->setBreakEnabled(false)) {
     return util::Status(util::error::UNKNOWN,
                         QString("setBreakEnabled(false) failed: %1")
                             .arg(s->errorString())
                             .toStdString());
   }
+  SerialTrace::recordControl(s, SerialTrace::Event::Break, 0);
   return recvAck(s, timeout);
 }
 
-util::StatusOr<QByteArray> recvPacket(QSerialPort *s,
+// Sends breaks until the bootloader ACKs one, so it is picked up as soon as
+// it starts listening instead of after a fixed delay.
+util::Status waitForBootLoader(QSerialPort *s,
+                               int timeout = kBootLoaderWaitMs) {
+  qInfo() << "Waiting for the boot loader...";
+  QElapsedTimer timer;
+  timer.start();
+  util::Status st;
+  do {
+    st = doBreak(s);
+  } while (!st.ok() && !timer.hasExpired(timeout));
+  if (st.ok()) {
+    qInfo() << "Boot loader responded after" << timer.elapsed() << "ms";
+  }
+  return st;
+}
+
+// Reads a frame without sending the ACK for it.
+util::StatusOr<QByteArray> readPacket(QSerialPort *s,
                                       int timeout = kDefaultTimeoutMs) {
   auto r = readBytes(s, 3, timeout);
   if (!r.ok()) {
@@ -215,21 +289,39 @@ util::StatusOr<QByteArray> recvPacket(QSerialPort *s,
                             .arg(csum)
                             .toStdString());
   }
-  sendAck(s, timeout);  // return value ignored
   return payload.ValueOrDie();
 }
 
-util::Status sendPacket(QSerialPort *s, const QByteArray &bytes,
-                        int timeout = kDefaultTimeoutMs) {
-  QByteArray header;
-  QDataStream hs(&header, QIODevice::WriteOnly);
+util::StatusOr<QByteArray> recvPacket(QSerialPort *s,
+                                      int timeout = kDefaultTimeoutMs) {
+  auto r = readPacket(s, timeout);
+  if (!r.ok()) {
+    return r.status();
+  }
+  sendAck(s, timeout);  // return value ignored
+  return r;
+}
+
+QByteArray makeFrame(const QByteArray &bytes) {
+  QByteArray frame;
+  frame.reserve(bytes.length() + 3);
+  QDataStream hs(&frame, QIODevice::WriteOnly);
   hs.setByteOrder(QDataStream::BigEndian);
   hs << quint16(bytes.length() + 2) << checksum(bytes);
-  util::Status st = writeBytes(s, header, timeout);
-  if (!st.ok()) {
-    return st;
-  }
-  st = writeBytes(s, bytes, timeout);
+  frame.append(bytes);
+  return frame;
+}
+
+// Sends a frame without waiting for the ACK. Header and payload go out in a
+// single write.
+util::Status writePacket(QSerialPort *s, const QByteArray &bytes,
+                         int timeout = kDefaultTimeoutMs) {
+  return writeBytes(s, makeFrame(bytes), timeout);
+}
+
+util::Status sendPacket(QSerialPort *s, const QByteArray &bytes,
+                        int timeout = kDefaultTimeoutMs) {
+  util::Status st = writePacket(s, bytes, timeout);
   if (!st.ok()) {
     return st;
   }
@@ -256,30 +348,30 @@ util::StatusOr<ftdi_context *> openFTDI() {
   return ctx.release();
 }
 
-util::Status doReset(ftdi_context *ctx) {
-  unsigned char c = 1;
+// Pulses nRESET (bit 5) low with the other pins set to pins. Bit 0 drives
+// SOP2. Returns right after the release, callers wait for whatever they
+// expect to see from the device next.
+util::Status pulseReset(ftdi_context *ctx, unsigned char pins) {
+  unsigned char c = pins & ~0x20;
   if (ftdi_write_data(ctx, &c, 1) < 0) {
     return util::Status(util::error::UNKNOWN, "ftdi_write_data failed");
   }
-  QThread::msleep(5);
+  QThread::msleep(kResetPulseMs);
   c |= 0x20;
   if (ftdi_write_data(ctx, &c, 1) < 0) {
     return util::Status(util::error::UNKNOWN, "ftdi_write_data failed");
   }
-  QThread::msleep(1000);
   return util::Status::OK;
 }
 
+// Resets into the bootloader.
+util::Status doReset(ftdi_context *ctx) {
+  return pulseReset(ctx, 1);
+}
+
+// Resets into the firmware.
 util::Status boot(ftdi_context *ctx) {
-  util::Status st;
-  const std::vector<unsigned char> seq = {0, 0x20};
-  for (unsigned char b : seq) {
-    if (ftdi_write_data(ctx, &b, 1) < 0) {
-      return util::Status(util::error::UNKNOWN, "ftdi_write_data failed");
-    }
-    QThread::msleep(100);
-  }
-  return util::Status::OK;
+  return pulseReset(ctx, 0);
 }
 #endif
 
@@ -295,7 +387,7 @@ util::Status connectToBootLoader(QSerialPort *port) {
 #ifndef NO_LIBFTDI
     if (ctx != nullptr) doReset(ctx);
 #endif
-    st = doBreak(port);
+    st = waitForBootLoader(port);
   } while (!st.ok() && i++ < 3);
   if (!st.ok()) {
     st = QS(util::error::UNAVAILABLE,
@@ -327,7 +419,10 @@ class FlasherImpl : public Flasher {
   }
 #endif
 
-  util::Status setFirmware(FirmwareBundle *fw) override {
+  util::Status setFirmware(const FirmwareBundle *fw) override {
+    // Extracts and checks all the parts at once.
+    util::Status vst = fw->verifyAll();
+    if (!vst.ok()) return QSP(tr("invalid firmware bundle"), vst);
     auto code = fw->getPartSource(kFWFilename);
     if (!code.ok()) {
       code = fw->getPartSource(kFWBundleFWPartNameOld);
@@ -397,6 +492,10 @@ class FlasherImpl : public Flasher {
 
   int totalBytes() const override {
     QMutexLocker lock(&lock_);
+    return totalBytesLocked();
+  }
+
+  int totalBytesLocked() const {
     int r = 0;
     if (spiffs_image_.length() > 0) {
       r += spiffs_image_.length() + kSPIFFSMetadataSize;
@@ -410,7 +509,17 @@ class FlasherImpl : public Flasher {
   void run() override {
     QMutexLocker lock(&lock_);
 
+    QElapsedTimer runTimer;
+    runTimer.start();
+    metrics_.clear();
+    latencies_ = CommandLatencies();
+    metrics_["serial_profile"] = serialProfile(port_).name;
     util::Status st = runLocked();
+    metrics_["total_ms"] = runTimer.elapsed();
+    if (!latencies_.isEmpty()) metrics_["latency"] = latencies_.toVariant();
+    metrics_["ok"] = st.ok();
+    flushProgress();
+    emit metrics(metrics_);
     if (!st.ok()) {
       emit done(QString::fromStdString(st.error_message()), false);
       return;
@@ -444,6 +553,31 @@ class FlasherImpl : public Flasher {
       }
       failfs_size_ = size.find(value.toString().toStdString())->second;
       return util::Status::OK;
+    } else if (name == kPipelineWritesOption) {
+      if (value.type() != QVariant::Bool) {
+        return util::Status(util::error::INVALID_ARGUMENT,
+                            "value must be boolean");
+      }
+      pipeline_writes_ = value.toBool();
+      return util::Status::OK;
+    } else if (name == kSPIFFSInPlaceOption) {
+      if (value.type() != QVariant::Bool) {
+        return util::Status(util::error::INVALID_ARGUMENT,
+                            "value must be boolean");
+      }
+      spiffs_in_place_ = value.toBool();
+      return util::Status::OK;
+    } else if (name == kPlanOption) {
+      if (value.type() != QVariant::Bool) {
+        return util::Status(util::error::INVALID_ARGUMENT,
+                            "value must be boolean");
+      }
+      // Better to refuse than to flash when asked not to.
+      if (value.toBool()) {
+        return util::Status(util::error::UNIMPLEMENTED,
+                            "not supported on CC3200");
+      }
+      return util::Status::OK;
     }
     return util::Status(util::error::INVALID_ARGUMENT, "Unknown option");
   }
@@ -451,7 +585,8 @@ class FlasherImpl : public Flasher {
   util::Status setOptionsFromConfig(const Config &config) override {
     util::Status r;
 
-    QStringList boolOpts({kMergeFSOption});
+    QStringList boolOpts({kMergeFSOption, kPipelineWritesOption,
+                          kSPIFFSInPlaceOption, kPlanOption});
     QStringList stringOpts({kFormatFailFS});
 
     for (const auto &opt : boolOpts) {
@@ -489,7 +624,7 @@ class FlasherImpl : public Flasher {
   util::Status runLocked() {
     util::Status st = util::Status::UNKNOWN;
     progress_ = 0;
-    emit progress(progress_);
+    startProgress(totalBytesLocked());
 
     // Optimization - device may already be in the boot loader mode,
     // such as if a successful probe() was performed previously.
@@ -527,9 +662,9 @@ class FlasherImpl : public Flasher {
       }
     }
 
-    for (const QString &f : files_.keys()) {
-      st = uploadFile(files_[f]);
-      if (!st.ok()) return st;
+    st = uploadFiles();
+    if (!st.ok()) {
+      return st;
     }
 
     if (spiffs_image_.length() > 0) {
@@ -563,7 +698,7 @@ class FlasherImpl : public Flasher {
 
   util::StatusOr<VersionInfo> getVersion() {
     emit statusMessage(tr("Getting device version info..."), true);
-    util::Status st = sendPacket(port_, QByteArray(&kOpcodeGetVersionInfo, 1));
+    util::Status st = sendCommand(QByteArray(&kOpcodeGetVersionInfo, 1));
     if (!st.ok()) {
       return st;
     }
@@ -587,7 +722,7 @@ class FlasherImpl : public Flasher {
     QDataStream ps(&payload, QIODevice::WriteOnly);
     ps.setByteOrder(QDataStream::BigEndian);
     ps << quint8(kOpcodeGetStorageInfo) << quint32(kStorageID);
-    auto st = sendPacket(port_, payload);
+    auto st = sendCommand(payload);
     if (!st.ok()) {
       return st;
     }
@@ -614,7 +749,7 @@ class FlasherImpl : public Flasher {
     ps.setByteOrder(QDataStream::BigEndian);
     ps << quint8(kOpcodeEraseBlocks) << quint32(kStorageID) << quint32(start)
        << quint32(count);
-    return sendPacket(port_, payload);
+    return sendCommand(payload);
   }
 
   util::Status sendChunk(int offset, const QByteArray &bytes) {
@@ -624,7 +759,57 @@ class FlasherImpl : public Flasher {
     ps << quint8(kOpcodeStorageWrite) << quint32(kStorageID) << quint32(offset)
        << quint32(bytes.length());
     payload.append(bytes);
-    return sendPacket(port_, payload);
+    return sendDataPacket(payload);
+  }
+
+  // Sends a packet of a series of data chunks. With pipeline_writes_, the
+  // ACK of the previous packet is only read after this one is sent, so the
+  // device has the next chunk by the time it is done with the last one.
+  // flushAcks() must be called at the end of the series.
+  util::Status sendDataPacket(const QByteArray &payload) {
+    QElapsedTimer timer;
+    timer.start();
+    util::Status st = writePacket(port_, payload);
+    if (!st.ok()) {
+      ack_pending_ = false;
+      return st;
+    }
+    st = flushAcks();
+    if (!st.ok()) return st;
+    if (pipeline_writes_) {
+      ack_pending_ = true;
+      pending_opcode_ = payload[0];
+      pending_timer_ = timer;
+      return util::Status::OK;
+    }
+    st = recvAck(port_);
+    if (st.ok()) {
+      latencies_.record(opcodeName(payload[0]), timer.nsecsElapsed() / 1000);
+    }
+    return st;
+  }
+
+  util::Status flushAcks() {
+    if (!ack_pending_) return util::Status::OK;
+    ack_pending_ = false;
+    util::Status st = recvAck(port_);
+    if (st.ok()) {
+      latencies_.record(opcodeName(pending_opcode_),
+                        pending_timer_.nsecsElapsed() / 1000);
+    }
+    return st;
+  }
+
+  // sendPacket() that records the time to the ACK in latencies_.
+  util::Status sendCommand(const QByteArray &payload,
+                           int timeout = kDefaultTimeoutMs) {
+    QElapsedTimer timer;
+    timer.start();
+    util::Status st = sendPacket(port_, payload, timeout);
+    if (st.ok()) {
+      latencies_.record(opcodeName(payload[0]), timer.nsecsElapsed() / 1000);
+    }
+    return st;
   }
 
   util::Status rawWrite(quint32 offset, const QByteArray &bytes) {
@@ -653,11 +838,11 @@ class FlasherImpl : public Flasher {
       }
       sent += kChunkSize;
     }
-    return util::Status::OK;
+    return flushAcks();
   }
 
   util::Status execFromRAM() {
-    return sendPacket(port_, QByteArray(&kOpcodeExecFromRAM, 1));
+    return sendCommand(QByteArray(&kOpcodeExecFromRAM, 1));
   }
 
   util::Status switchUART2Apps() {
@@ -666,7 +851,7 @@ class FlasherImpl : public Flasher {
     QDataStream ps(&payload, QIODevice::WriteOnly);
     ps.setByteOrder(QDataStream::BigEndian);
     ps << quint8(kOpcodeSwitchUART2Apps) << quint32(magic);
-    return sendPacket(port_, payload);
+    return sendCommand(payload);
   }
 
   util::Status switchToNWPBootloader() {
@@ -703,15 +888,8 @@ class FlasherImpl : public Flasher {
         return st;
       }
     }
-    util::Status st;
-    for (int attempt = 0; attempt < 3; attempt++) {
-      QThread::sleep(1);
-      qInfo() << "Checking if the device is back online...";
-      st = doBreak(port_);
-      if (st.ok()) {
-        break;
-      }
-    }
+    qInfo() << "Checking if the device is back online...";
+    util::Status st = waitForBootLoader(port_, 3 * kBootLoaderWaitMs);
     if (!st.ok()) {
       return st;
     }
@@ -752,7 +930,7 @@ class FlasherImpl : public Flasher {
     ps << quint8(kOpcodeFileErase) << quint32(0);
     payload.append(name.toUtf8());
     payload.append('\0');
-    return sendPacket(port_, payload);
+    return sendCommand(payload);
   }
 
   util::Status openFileForWrite(const SLFSFileInfo &fi) {
@@ -784,7 +962,7 @@ class FlasherImpl : public Flasher {
     payload.append(fi.name.toUtf8());
     payload.append('\0');
     payload.append('\0');
-    util::Status st = sendPacket(port_, payload, 10000);
+    util::Status st = sendCommand(payload, 10000);
     if (!st.ok()) {
       return st;
     }
@@ -803,7 +981,7 @@ class FlasherImpl : public Flasher {
     payload.append(filename.toUtf8());
     payload.append('\0');
     payload.append('\0');
-    util::Status st = sendPacket(port_, payload, 10000);
+    util::Status st = sendCommand(payload, 10000);
     if (!st.ok()) {
       return st;
     }
@@ -823,7 +1001,81 @@ class FlasherImpl : public Flasher {
       payload.append(QByteArray("\x46", 1).repeated(256));
     }
     payload.append("\0", 1);
-    return sendPacket(port_, payload);
+    return sendCommand(payload);
+  }
+
+  // A phase for run metrics, see Flasher::metrics.
+  static QVariantMap phase(const QString &name, qint64 ms, qint64 bytes = 0) {
+    QVariantMap p;
+    p["name"] = name;
+    p["ms"] = ms;
+    if (bytes > 0) {
+      p["bytes"] = bytes;
+      if (ms > 0) p["bytes_per_sec"] = bytes * 1000 / ms;
+    }
+    return p;
+  }
+
+  // Time spent on file uploads, to tell per-file overhead (erasing, opening
+  // and closing) from transferring the data.
+  struct UploadStats {
+    int files = 0;
+    int skipped = 0;
+    qint64 bytes = 0;
+    qint64 infoMs = 0;  // Getting file info and comparing.
+    qint64 overheadMs = 0;
+    qint64 dataMs = 0;
+  };
+
+  // Uploads files_ that the device does not have yet. Info for all of them is
+  // fetched up front, one request after another, and reused for comparing and
+  // uploading. The loader only has one file open at a time, so the files
+  // themselves still go one by one.
+  util::Status uploadFiles() {
+    if (files_.isEmpty()) return util::Status::OK;
+    UploadStats stats;
+    QElapsedTimer timer;
+    timer.start();
+    emit statusMessage(tr("Getting file info..."), true);
+    QMap<QString, FileInfo> infos;
+    for (const SLFSFileInfo &fi : files_) {
+      auto info = getFileInfo(fi.name);
+      if (!info.ok()) {
+        return info.status();
+      }
+      infos[fi.name] = info.ValueOrDie();
+    }
+    stats.infoMs += timer.elapsed();
+    for (const SLFSFileInfo &fi : files_) {
+      timer.restart();
+      auto same = isOnDevice(fi, infos[fi.name]);
+      stats.infoMs += timer.elapsed();
+      if (!same.ok()) {
+        qWarning() << "Failed to compare" << fi.name << ":" << same.status();
+      } else if (same.ValueOrDie()) {
+        qInfo() << fi.name << "is up to date";
+        stats.skipped++;
+        progress_ += fi.data.length();
+        reportProgress(progress_);
+        continue;
+      }
+      util::Status st = uploadFile(fi, infos[fi.name], &stats);
+      if (!st.ok()) return st;
+    }
+    metrics_["phases"] =
+        QVariantList{phase("file_info", stats.infoMs),
+                     phase("file_data", stats.dataMs, stats.bytes),
+                     phase("file_overhead", stats.overheadMs)};
+    metrics_["files_uploaded"] = stats.files;
+    metrics_["files_skipped"] = stats.skipped;
+    metrics_["bytes_uploaded"] = stats.bytes;
+    qInfo() << "Uploaded" << stats.files << "files," << stats.bytes
+            << "bytes, skipped" << stats.skipped << "- info" << stats.infoMs
+            << "ms, data" << stats.dataMs << "ms, per-file overhead"
+            << stats.overheadMs << "ms ("
+            << (stats.files > 0 ? stats.overheadMs / stats.files : 0)
+            << "ms per file)";
+    return util::Status::OK;
   }
 
   util::Status uploadFile(const SLFSFileInfo &fi) {
@@ -831,8 +1083,17 @@ class FlasherImpl : public Flasher {
     if (!info.ok()) {
       return info.status();
     }
+    return uploadFile(fi, info.ValueOrDie(), nullptr);
+  }
+
+  // info is what getFileInfo() returned for the file. Timings are added to
+  // stats, if given.
+  util::Status uploadFile(const SLFSFileInfo &fi, const FileInfo &info,
+                          UploadStats *stats) {
+    QElapsedTimer timer;
+    timer.start();
     util::Status st;
-    if (info.ValueOrDie().exists) {
+    if (info.exists) {
       st = eraseFile(fi.name);
       if (!st.ok()) {
         return st;
@@ -842,25 +1103,76 @@ class FlasherImpl : public Flasher {
     if (!st.ok()) {
       return st;
     }
+    // Waiting for a turn on a shared hub counts as per-file overhead.
+    const qint64 waitMs = beginBulkTransfer();
+    if (waitMs > 0) {
+      metrics_["bandwidth_wait_ms"] =
+          metrics_["bandwidth_wait_ms"].toLongLong() + waitMs;
+    }
+    const qint64 opened = timer.elapsed();
+    st = writeFileData(0, fi.data);
+    if (st.ok()) st = flushAcks();
+    endBulkTransfer();
+    if (!st.ok()) {
+      return st;
+    }
+    const qint64 written = timer.elapsed();
+    emit statusMessage(tr("Upload finished."), true);
+    st = closeFile(fi.signature);
+    if (st.ok() && stats != nullptr) {
+      stats->files++;
+      stats->bytes += fi.data.length();
+      stats->dataMs += written - opened;
+      stats->overheadMs += timer.elapsed() - (written - opened);
+    }
+    return st;
+  }
+
+  // Writes data at offset of the file that is open for writing. ACKs may be
+  // left pending, see sendDataPacket.
+  util::Status writeFileData(quint32 offset, const QByteArray &data) {
     int start = 0;
-    while (start < fi.data.length()) {
-      emit statusMessage(tr("Writing @ 0x%1...").arg(start, 0, 16));
+    while (start < data.length()) {
+      emit statusMessage(
+          tr("Writing @ 0x%1...").arg(offset + start, 0, 16));
       QByteArray payload;
       QDataStream ps(&payload, QIODevice::WriteOnly);
       ps.setByteOrder(QDataStream::BigEndian);
-      ps << quint8(kOpcodeFileChunk) << quint32(start);
-      payload.append(fi.data.mid(start, kFileUploadBlockSize));
+      ps << quint8(kOpcodeFileChunk) << quint32(offset + start);
+      payload.append(data.mid(start, kFileUploadBlockSize));
 
-      st = sendPacket(port_, payload);
+      util::Status st = sendDataPacket(payload);
       if (!st.ok()) {
         return st;
       }
       start += kFileUploadBlockSize;
       progress_ += kFileUploadBlockSize;
-      emit progress(progress_);
+      reportProgress(progress_);
     }
-    emit statusMessage(tr("Upload finished."), true);
-    return closeFile(fi.signature);
+    return util::Status::OK;
+  }
+
+  // Checks if the device has the file with the same contents. Reading back is
+  // a lot faster than writing, and only done if the size allows the file to
+  // be the same. Secure files cannot be read back and are never the same.
+  // info is what getFileInfo() returned for the file.
+  util::StatusOr<bool> isOnDevice(const SLFSFileInfo &fi,
+                                  const FileInfo &info) {
+    if (!fi.signature.isEmpty()) return false;
+    // Size is that of the space allocated for the file.
+    const quint32 size = info.size;
+    if (!info.exists || size < quint32(fi.data.length()) ||
+        size < quint32(fi.allocSize)) {
+      return false;
+    }
+    emit statusMessage(tr("Comparing %1...").arg(fi.name), true);
+    // Uploading erases the whole allocation, so the rest of it has to be
+    // blank, not just the data the same.
+    auto data = getFile(fi.name, 0, size);
+    if (!data.ok()) return data.status();
+    const QByteArray want =
+        fi.data + QByteArray(size - fi.data.length(), '\xff');
+    return data.ValueOrDie() == want;
   }
 
   util::StatusOr<FileInfo> getFileInfo(const QString &filename) {
@@ -869,7 +1181,7 @@ class FlasherImpl : public Flasher {
     ps.setByteOrder(QDataStream::BigEndian);
     ps << quint8(kOpcodeGetFileInfo) << quint32(filename.length());
     payload.append(filename.toUtf8());
-    util::Status st = sendPacket(port_, payload);
+    util::Status st = sendCommand(payload);
     if (!st.ok()) {
       return st;
     }
@@ -886,7 +1198,10 @@ class FlasherImpl : public Flasher {
     return r;
   }
 
-  util::StatusOr<QByteArray> getFile(const QString &filename) {
+  // Reads up to maxSize bytes of the file starting at offset, all the rest of
+  // it if maxSize is negative.
+  util::StatusOr<QByteArray> getFile(const QString &filename,
+                                     quint32 offset = 0, int maxSize = -1) {
     auto info = getFileInfo(filename);
     if (!info.ok()) {
       return info.status();
@@ -899,30 +1214,58 @@ class FlasherImpl : public Flasher {
     if (!st.ok()) {
       return st;
     }
-    int size = info.ValueOrDie().size;
-    QByteArray r;
-    while (r.length() < size) {
+    int size = 0;
+    if (info.ValueOrDie().size > offset) {
+      size = info.ValueOrDie().size - offset;
+    }
+    if (maxSize >= 0 && size > maxSize) size = maxSize;
+    QByteArray r(size, Qt::Uninitialized);
+    int pos = 0;
+    // ACK for a chunk goes out in the same write as the request for the next
+    // one, which is the order the loader expects them in anyway.
+    QByteArray ack;
+    while (pos < size) {
       int n = kFileUploadBlockSize;
-      if (n > size - r.length()) {
-        n = size - r.length();
+      if (n > size - pos) {
+        n = size - pos;
       }
 
       QByteArray payload;
       QDataStream ps(&payload, QIODevice::WriteOnly);
-      ps << quint8(kOpcodeReadFileChunk) << quint32(r.length()) << quint32(n);
-      st = sendPacket(port_, payload);
+      ps << quint8(kOpcodeReadFileChunk) << quint32(offset + pos)
+         << quint32(n);
+      st = writeBytes(port_, ack + makeFrame(payload));
+      if (st.ok()) {
+        st = recvAck(port_);
+      }
       if (!st.ok()) {
-        qCritical() << "getChunk failed at " << r.length() << ": "
+        qCritical() << "getChunk failed at " << pos << ": "
                     << st.ToString().c_str();
         return st;
       }
-      auto resp = recvPacket(port_);
+      auto resp = readPacket(port_);
       if (!resp.ok()) {
-        qCritical() << "Failed to read chunk at " << r.length() << ": "
+        qCritical() << "Failed to read chunk at " << pos << ": "
                     << resp.status().ToString().c_str();
         return resp.status();
       }
-      r.append(resp.ValueOrDie());
+      const QByteArray &chunk = resp.ValueOrDie();
+      if (chunk.isEmpty() || chunk.length() > n) {
+        return QS(util::error::UNKNOWN,
+                  tr("Got %1 bytes at %2, asked for %3")
+                      .arg(chunk.length())
+                      .arg(pos)
+                      .arg(n));
+      }
+      r.replace(pos, chunk.length(), chunk);
+      pos += chunk.length();
+      ack = QByteArray("\x00\xCC", 2);
+    }
+    if (!ack.isEmpty()) {
+      st = sendAck(port_);
+      if (!st.ok()) {
+        return st;
+      }
     }
 
     st = closeFile("");
@@ -932,50 +1275,72 @@ class FlasherImpl : public Flasher {
     return r;
   }
 
-  util::StatusOr<QByteArray> readSPIFFS(const QString &filename, quint64 *seq,
-                                        quint32 *block_size,
-                                        quint32 *page_size) {
+  // Reads the metadata at the end of a SPIFFS container. Size of the
+  // container, without metadata, is stored in image_size, zero if there is
+  // no such container.
+  util::Status readSPIFFSMeta(const QString &filename, quint64 *seq,
+                              quint32 *block_size, quint32 *page_size,
+                              quint32 *image_size) {
+    *image_size = 0;
     auto info = getFileInfo(filename);
     if (!info.ok()) {
       return info.status();
     }
     if (!info.ValueOrDie().exists) {
-      return QByteArray();
-    }
-    auto data = getFile(filename);
-    if (!data.ok()) {
-      return data.status();
+      return util::Status::OK;
     }
-    QByteArray bytes = data.ValueOrDie();
-    if (bytes.length() < kSPIFFSMetadataSize) {
+    const quint32 size = info.ValueOrDie().size;
+    if (size < quint32(kSPIFFSMetadataSize)) {
       return util::Status(util::error::FAILED_PRECONDITION,
                           "Image is too short");
     }
-    QDataStream meta(bytes.mid(bytes.length() - kSPIFFSMetadataSize));
+    auto data = getFile(filename, size - kSPIFFSMetadataSize);
+    if (!data.ok()) {
+      return data.status();
+    }
+    QDataStream meta(data.ValueOrDie());
     meta.setByteOrder(QDataStream::LittleEndian);
     quint32 fs_size;
     // See struct fs_info in platforms/cc3200/cc3200_fs_spiffs_container.c
     meta >> *seq >> fs_size >> *block_size >> *page_size;
-    return bytes.mid(0, bytes.length() - kSPIFFSMetadataSize);
+    *image_size = size - kSPIFFSMetadataSize;
+    return util::Status::OK;
+  }
+
+  // Metadata that goes at the end of a SPIFFS container.
+  static QByteArray spiffsMeta(quint64 seq, quint32 fs_size) {
+    qInfo() << "FS meta:" << seq << fs_size << quint32(FLASH_BLOCK_SIZE)
+            << quint32(LOG_PAGE_SIZE);
+    QByteArray meta;
+    QDataStream ms(&meta, QIODevice::WriteOnly);
+    ms.setByteOrder(QDataStream::LittleEndian);
+    ms << seq << fs_size;
+    // TODO(imax): make mkspiffs write page size and block size into a separate
+    // file and use it here instead of hardcoded values.
+    ms << quint32(FLASH_BLOCK_SIZE) << quint32(LOG_PAGE_SIZE);
+    meta.append(
+        QByteArray("\xFF", 1).repeated(kSPIFFSMetadataSize - meta.length()));
+    return meta;
   }
 
   util::Status updateSPIFFS() {
     quint64 seq[2] = {~(0ULL), ~(0ULL)};
     quint32 page_size[2] = {0, 0}, block_size[2] = {0, 0};
-    auto fs0 = readSPIFFS(kFS0Filename, &seq[0], &block_size[0], &page_size[0]);
-    if (!fs0.ok()) {
-      return fs0.status();
+    quint32 image_size[2] = {0, 0};
+    // Only the metadata is needed to pick the container to overwrite.
+    util::Status st = readSPIFFSMeta(kFS0Filename, &seq[0], &block_size[0],
+                                     &page_size[0], &image_size[0]);
+    if (!st.ok()) {
+      return st;
     }
-    auto fs1 = readSPIFFS(kFS1Filename, &seq[1], &block_size[1], &page_size[1]);
-    if (!fs1.ok()) {
-      return fs1.status();
+    st = readSPIFFSMeta(kFS1Filename, &seq[1], &block_size[1], &page_size[1],
+                        &image_size[1]);
+    if (!st.ok()) {
+      return st;
     }
     qInfo() << "Sequence nubmer of 0.fs:" << seq[0];
     qInfo() << "Sequence nubmer of 1.fs:" << seq[1];
-    QByteArray meta;
     int min_seq = 0;
-    QDataStream ms(&meta, QIODevice::WriteOnly);
-    ms.setByteOrder(QDataStream::LittleEndian);
     quint64 new_seq;
     if (seq[0] < seq[1]) {
       new_seq = seq[0] - 1;
@@ -984,18 +1349,29 @@ class FlasherImpl : public Flasher {
       new_seq = seq[1] - 1;
       min_seq = 1;
     }
-    qInfo() << "FS meta:" << new_seq << spiffs_image_.length()
-            << quint32(FLASH_BLOCK_SIZE) << quint32(LOG_PAGE_SIZE);
-    ms << new_seq << quint32(spiffs_image_.length());
-    // TODO(imax): make mkspiffs write page size and block size into a separate
-    // file and use it here instead of hardcoded values.
-    ms << quint32(FLASH_BLOCK_SIZE) << quint32(LOG_PAGE_SIZE);
-    meta.append(
-        QByteArray("\xFF", 1).repeated(kSPIFFSMetadataSize - meta.length()));
+    QByteArray meta = spiffsMeta(new_seq, spiffs_image_.length());
     QByteArray image = spiffs_image_;
-    if ((fs0.ValueOrDie().length() > 0 || fs1.ValueOrDie().length() > 0) &&
-        merge_spiffs_) {
-      QByteArray dev = (min_seq == 0 ? fs0.ValueOrDie() : fs1.ValueOrDie());
+    if ((image_size[0] > 0 || image_size[1] > 0) && merge_spiffs_) {
+      QByteArray dev;
+      const QString dev_fname = min_seq == 0 ? kFS0Filename : kFS1Filename;
+      if (image_size[min_seq] > 0) {
+        auto data = getFile(dev_fname, 0, image_size[min_seq]);
+        if (!data.ok()) {
+          return data.status();
+        }
+        dev = data.ValueOrDie();
+      }
+
+      if (spiffs_in_place_ && !dev.isEmpty()) {
+        st = updateSPIFFSInPlace(dev_fname, dev, new_seq);
+        if (st.ok()) {
+          return st;
+        }
+        qWarning() << "In-place update of" << dev_fname << "failed:" << st;
+        // The container may have been written to, make sure the other one
+        // takes precedence. dev still has what it was before.
+        meta = spiffsMeta(new_seq - 1, spiffs_image_.length());
+      }
 
       auto merged = mergeFilesystems(dev, spiffs_image_);
       if (!merged.ok()) {
@@ -1018,6 +1394,99 @@ class FlasherImpl : public Flasher {
     return uploadFile(fi);
   }
 
+  // Applies the update to the image of the newest container, dev, in place
+  // and writes only the sectors that change, followed by the metadata with
+  // seq. Before any sector is touched, the container's metadata is marked as
+  // the oldest possible, so if the update is cut short the device boots
+  // the other one. Unwritten parts of the container have to survive it
+  // being opened for writing, which is checked by reading one of them back
+  // afterwards. On failure the container may be left in any state, other
+  // than the newest.
+  util::Status updateSPIFFSInPlace(const QString &fname, const QByteArray &dev,
+                                   quint64 seq) {
+    QList<int> sectors;
+    auto merged = mergeFilesystemsInPlace(dev, spiffs_image_, &sectors);
+    if (!merged.ok()) {
+      return merged.status();
+    }
+    QSet<int> dirty = QSet<int>::fromList(sectors);
+    if (!extra_spiffs_files_.empty()) {
+      auto extra = makeFilesystem(dev.length(), extra_spiffs_files_);
+      if (!extra.ok()) {
+        return extra.status();
+      }
+      merged = mergeFilesystemsInPlace(merged.ValueOrDie(), extra.ValueOrDie(),
+                                       &sectors);
+      if (!merged.ok()) {
+        return merged.status();
+      }
+      dirty.unite(QSet<int>::fromList(sectors));
+    }
+    const QByteArray &image = merged.ValueOrDie();
+    const int num_sectors =
+        (image.length() + FLASH_BLOCK_SIZE - 1) / FLASH_BLOCK_SIZE;
+    int clean = 0;
+    while (clean < num_sectors && dirty.contains(clean)) clean++;
+    if (clean == num_sectors) {
+      return util::Status(util::error::FAILED_PRECONDITION,
+                          "all sectors change");
+    }
+    qInfo() << "Updating" << fname << "in place," << dirty.size() << "of"
+            << num_sectors << "sectors changed";
+
+    const QByteArray meta = spiffsMeta(seq, image.length());
+    SLFSFileInfo fi;
+    fi.name = fname;
+    fi.allocSize = image.length() + meta.length();
+    util::Status st = openFileForWrite(fi);
+    if (!st.ok()) {
+      return st;
+    }
+    st = writeFileData(image.length(), spiffsMeta(~quint64(0), image.length()));
+    if (st.ok()) {
+      st = flushAcks();
+    }
+    if (!st.ok()) {
+      return st;
+    }
+    sectors = dirty.toList();
+    std::sort(sectors.begin(), sectors.end());
+    for (int i : sectors) {
+      st = writeFileData(i * FLASH_BLOCK_SIZE,
+                         image.mid(i * FLASH_BLOCK_SIZE, FLASH_BLOCK_SIZE));
+      if (!st.ok()) {
+        return st;
+      }
+    }
+    // Metadata goes last, so the container only gets the new sequence number
+    // once everything else is there.
+    st = flushAcks();
+    if (st.ok()) {
+      st = writeFileData(image.length(), meta);
+    }
+    if (st.ok()) {
+      st = flushAcks();
+    }
+    if (!st.ok()) {
+      return st;
+    }
+    st = closeFile("");
+    if (!st.ok()) {
+      return st;
+    }
+    auto check = getFile(fname, clean * FLASH_BLOCK_SIZE, FLASH_BLOCK_SIZE);
+    if (!check.ok()) {
+      return check.status();
+    }
+    if (check.ValueOrDie() != dev.mid(clean * FLASH_BLOCK_SIZE,
+                                      FLASH_BLOCK_SIZE)) {
+      return util::Status(util::error::DATA_LOSS,
+                          "unchanged data was not preserved");
+    }
+    emit statusMessage(tr("Upload finished."), true);
+    return util::Status::OK;
+  }
+
   util::Status formatFailFS(int size) {
     emit statusMessage(tr("Formatting SFLASH file system (%1)...").arg(size),
                        true);
@@ -1027,7 +1496,7 @@ class FlasherImpl : public Flasher {
     ps << quint8(kOpcodeFormatFlash) << quint32(2)
        << quint32(size / kFlashBlockSize) << quint32(0) << quint32(0)
        << quint32(2);
-    return sendPacket(port_, payload, 10000);
+    return sendCommand(payload, 10000);
   }
 
   mutable QMutex lock_;
@@ -1043,7 +1512,16 @@ class FlasherImpl : public Flasher {
   QMap<QString, SLFSFileInfo> files_;
   bool merge_spiffs_ = false;
   int failfs_size_ = -1;
+  bool pipeline_writes_ = false;
+  bool spiffs_in_place_ = false;
+  bool ack_pending_ = false;
+  // Opcode and send time of the packet whose ACK is pending.
+  char pending_opcode_ = 0;
+  QElapsedTimer pending_timer_;
   int progress_ = 0;
+  // Run metrics, see Flasher::metrics.
+  QVariantMap metrics_;
+  CommandLatencies latencies_;
 };
 
 QString FlasherImpl::SLFSFileInfo::toString() const {
@@ -1144,6 +1622,15 @@ void addOptions(Config *config) {
                                  "Format SFLASH file system before flashing. "
                                  "Accepted sizes: 512K, 1M, 2M, 4M, 8M, 16M.",
                                  "size", "1M"));
+  opts.append(QCommandLineOption(
+      kPipelineWritesOption,
+      "Send the next chunk of data before the previous one is acknowledged. "
+      "Faster, but not known to work with all bootloader versions."));
+  opts.append(QCommandLineOption(
+      kSPIFFSInPlaceOption,
+      "When merging file systems, update the current SPIFFS container in "
+      "place, writing only the sectors that change. Falls back to writing "
+      "the other container if the bootloader does not keep the rest."));
   config->addOptions(opts);
 }
 
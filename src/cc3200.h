@@ -21,6 +21,8 @@ std::unique_ptr<HAL> HAL(QSerialPort *port);
 void addOptions(Config *config);
 
 extern const char kFormatFailFS[];
+extern const char kPipelineWritesOption[];
+extern const char kSPIFFSInPlaceOption[];
 
 }  // namespace CC3200
 
@@ -2,27 +2,52 @@
 
 #include <fcntl.h>
 #include <stdio.h>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
 
+#include <algorithm>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <map>
 #include <memory>
+#include <vector>
 
 #include <QCommandLineParser>
 #include <QCoreApplication>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QEventLoop>
 #include <QFile>
 #include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMap>
+#include <QRegExp>
 #include <QSocketNotifier>
+#include <QThread>
 #include <QTimer>
 #include <QSerialPort>
 #include <QSerialPortInfo>
 
 #include <common/util/error_codes.h>
 
-#include "cc3200.h"
+#include "bandwidth_scheduler.h"
 #include "config.h"
+#include "console_log.h"
 #include "esp8266.h"
+#include "flash_server.h"
+#include "hal.h"
+#include "net_serial.h"
+#include "ota_flasher.h"
+#include "port_watcher.h"
 #include "prompter.h"
 #include "serial.h"
+#include "serial_trace.h"
 #include "status_qt.h"
+#include "worker_pool.h"
 
 #if (QT_VERSION < QT_VERSION_CHECK(5, 5, 0))
 #define qInfo qWarning
@@ -46,6 +71,172 @@ class CLIPrompterImpl : public Prompter {
   }
 };
 
+namespace {
+
+// Makes sure the process can have at least n more descriptors open, as far as
+// the hard limit allows. The soft limit is as low as 256 on OS X, which
+// is not enough for a hundred or so ports.
+void raiseFileLimit(int n) {
+#ifndef _WIN32
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) != 0) return;
+  // Whatever else is open, plus a few per port.
+  const rlim_t want = 64 + rlim_t(n) * 4;
+  if (rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < want) {
+    rl.rlim_cur =
+        rl.rlim_max == RLIM_INFINITY ? want : std::min(want, rl.rlim_max);
+    if (setrlimit(RLIMIT_NOFILE, &rl) != 0) {
+      qWarning() << "Failed to raise open file limit to" << rl.rlim_cur;
+    }
+  }
+#else
+  (void) n;
+#endif
+}
+
+// Descriptors to make room for when watching for devices, whose number is not
+// known up front. A full hub tree of a flashing station is well within this.
+const int kWatchedPortsHint = 256;
+
+bool isPattern(const QString &name) {
+  return !name.startsWith(NetSerialPort::kScheme) &&
+         name.contains(QRegExp("[*?\\[]"));
+}
+
+bool portMatches(const QString &pattern, const QSerialPortInfo &info) {
+  const QRegExp re(pattern, Qt::CaseSensitive, QRegExp::Wildcard);
+  return re.exactMatch(info.systemLocation()) ||
+         re.exactMatch(info.portName());
+}
+
+// Whether the port is in a comma-separated list of ports and patterns, such as
+// --ports takes.
+bool portMatchesSpec(const QString &spec, const QSerialPortInfo &info) {
+  for (const QString &name : spec.split(',', QString::SkipEmptyParts)) {
+    if (isPattern(name) ? portMatches(name, info)
+                        : name == info.systemLocation()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Expands a comma-separated list of port names, which may contain wildcards.
+// Patterns that match nothing are an error unless allowNoMatch is set.
+util::StatusOr<QStringList> expandPorts(const QString &spec,
+                                        bool allowNoMatch = false) {
+  QStringList result;
+  const auto available = QSerialPortInfo::availablePorts();
+  for (const QString &name : spec.split(',', QString::SkipEmptyParts)) {
+    if (!isPattern(name)) {
+      result << name;
+      continue;
+    }
+    bool found = false;
+    for (const auto &info : available) {
+      if (portMatches(name, info)) {
+        if (!result.contains(info.systemLocation())) {
+          result << info.systemLocation();
+        }
+        found = true;
+      }
+    }
+    if (!found && !allowNoMatch) {
+      return QS(util::error::NOT_FOUND,
+                QObject::tr("no ports match %1").arg(name));
+    }
+  }
+  if (allowNoMatch) return result;
+  if (result.isEmpty()) {
+    return QS(util::error::INVALID_ARGUMENT, QObject::tr("no ports given"));
+  }
+  return result;
+}
+
+void printMetrics(const QVariantMap &metrics, const QString &prefix) {
+  for (const QVariant &pv : metrics["phases"].toList()) {
+    const QVariantMap p = pv.toMap();
+    QString line = QString("%1%2 %3 ms")
+                       .arg(prefix)
+                       .arg(p["name"].toString(), -12)
+                       .arg(p["ms"].toLongLong(), 8);
+    if (p.contains("bytes")) {
+      line += QString(", %1 bytes, %2 B/s")
+                  .arg(p["bytes"].toULongLong())
+                  .arg(p["bytes_per_sec"].toULongLong());
+    }
+    cout << line.toStdString() << endl;
+  }
+  const QVariantMap latency = metrics["latency"].toMap();
+  for (auto it = latency.constBegin(); it != latency.constEnd(); it++) {
+    const QVariantMap h = it.value().toMap();
+    const auto ms = [&h](const char *key) {
+      return QString::number(h[key].toLongLong() / 1000.0, 'f', 2);
+    };
+    cout << QString("%1%2 n=%3 p50 %4 ms, p90 %5 ms, p99 %6 ms, max %7 ms")
+                .arg(prefix)
+                .arg(it.key(), -20)
+                .arg(h["count"].toULongLong())
+                .arg(ms("p50_us"), ms("p90_us"), ms("p99_us"), ms("max_us"))
+                .toStdString()
+         << endl;
+  }
+  for (auto it = metrics.constBegin(); it != metrics.constEnd(); it++) {
+    if (it.key() == "phases" || it.key() == "latency") continue;
+    cout << (prefix + it.key() + ": " + it.value().toString()).toStdString()
+         << endl;
+  }
+}
+
+// Writes the report to stdout if dest is -, to a file otherwise.
+util::Status outputReport(const QString &dest, const QJsonObject &report) {
+  const QByteArray json = QJsonDocument(report).toJson();
+  if (dest == "-") {
+    cout << json.constData() << std::flush;
+    return util::Status::OK;
+  }
+  QFile f(dest);
+  if (!f.open(QIODevice::WriteOnly | QIODevice::Truncate) ||
+      f.write(json) != json.size()) {
+    return QS(util::error::UNAVAILABLE, QObject::tr("failed to write %1: %2")
+                                            .arg(dest)
+                                            .arg(f.errorString()));
+  }
+  return util::Status::OK;
+}
+
+// Prints metrics if dest is -, writes them as JSON otherwise.
+util::Status outputMetrics(const QString &dest, const QVariantMap &metrics,
+                           bool perPort) {
+  if (dest == "-") {
+    if (!perPort) {
+      printMetrics(metrics, "");
+      return util::Status::OK;
+    }
+    for (auto it = metrics.constBegin(); it != metrics.constEnd(); it++) {
+      printMetrics(it.value().toMap(), QString("[%1] ").arg(it.key()));
+    }
+    return util::Status::OK;
+  }
+  QFile f(dest);
+  if (!f.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+    return QS(util::error::UNAVAILABLE, QObject::tr("failed to open %1: %2")
+                                            .arg(dest)
+                                            .arg(f.errorString()));
+  }
+  f.write(QJsonDocument(QJsonObject::fromVariantMap(metrics)).toJson());
+  return util::Status::OK;
+}
+
+// With several ports, each of them gets its own trace: <file>.<port>.
+QString traceFileName(const QString &base, const QString &portName) {
+  QString suffix = portName.section('/', -1);
+  suffix.replace(QRegExp("[^A-Za-z0-9_.-]"), "_");
+  return QString("%1.%2").arg(base).arg(suffix);
+}
+
+}  // namespace
+
 CLI::CLI(Config *config, QCommandLineParser *parser, QObject *parent)
     : QObject(parent),
       config_(config),
@@ -61,8 +252,30 @@ CLI::CLI(Config *config, QCommandLineParser *parser, QObject *parent)
 void CLI::run() {
   int exit_code = 0;
 
-  std::unique_ptr<QSerialPort> port;
-  if (parser_->isSet("port")) {
+  if (parser_->isSet("server")) {
+    // Ports and platform are given with each request.
+    FlashServer *server =
+        new FlashServer(config_, prompter_, parser_->value("platform"), this);
+    server->setMetrics(&metricsRegistry_, parser_->value("metrics-textfile"));
+    util::Status st = server->listen(parser_->value("server"));
+    if (!st.ok()) {
+      qCritical() << st;
+      qApp->exit(1);
+    }
+    return;
+  }
+
+  if (parser_->isSet("port") &&
+      parser_->value("port").startsWith(NetSerialPort::kScheme)) {
+    const QString portName = parser_->value("port");
+    auto sp = openPort(portName, 115200);
+    if (!sp.ok()) {
+      qCritical() << "Error opening " << portName << ": " << sp.status();
+      qApp->exit(1);
+      return;
+    }
+    port_.reset(sp.ValueOrDie());
+  } else if (parser_->isSet("port")) {
     QString portName = parser_->value("port");
 #ifdef __unix__
     // Resolve symlinks if any.
@@ -73,13 +286,7 @@ void CLI::run() {
       portName = qf.canonicalFilePath();
     }
 #endif
-    const auto qspi = findSerial(portName);
-    if (!qspi.ok()) {
-      qCritical() << qspi.status();
-      qApp->exit(1);
-      return;
-    }
-    auto sp = connectSerial(qspi.ValueOrDie(), 115200);
+    auto sp = connectSerial(portName, 115200);
     if (!sp.ok()) {
       qCritical() << "Error opening " << portName << ": " << sp.status();
       qApp->exit(1);
@@ -87,24 +294,44 @@ void CLI::run() {
     }
     port_.reset(sp.ValueOrDie());
   }
+  if (port_ != nullptr && parser_->isSet("trace-serial")) {
+    util::Status st =
+        SerialTrace::start(port_.get(), parser_->value("trace-serial"));
+    if (!st.ok()) {
+      qCritical() << st;
+      qApp->exit(1);
+      return;
+    }
+  }
 
   const QString platform = parser_->value("platform");
-  if (platform == "esp8266") {
-    hal_ = ESP8266::HAL(port_.get());
-  } else if (platform == "cc3200") {
-    hal_ = CC3200::HAL(port_.get());
-  } else if (platform == "") {
+  if (platform == "") {
     qCritical() << "Flag --platform is required.";
     qApp->exit(1);
     return;
-  } else {
-    qCritical() << "Unknown platform: " << platform;
+  }
+  hal_ = newHAL(platform, port_.get());
+  if (hal_ == nullptr) {
+    qCritical() << "Unknown platform or unsupported port: " << platform;
     parser_->showHelp(1);
   }
 
   util::Status r;
   bool exit = true;
-  if (parser_->isSet("probe")) {
+  if (parser_->isSet("batch")) {
+    r = flashBatch(parser_->value("batch"));
+  } else if (parser_->isSet("ports")) {
+    if (parser_->isSet("flash")) {
+      const bool watch = parser_->isSet("watch");
+      auto ports = expandPorts(parser_->value("ports"), watch);
+      r = ports.ok() ? flashParallel(parser_->value("flash"),
+                                     ports.ValueOrDie(),
+                                     watch ? parser_->value("ports") : "")
+                     : ports.status();
+    } else {
+      r = QS(util::error::INVALID_ARGUMENT, "--ports only works with --flash");
+    }
+  } else if (parser_->isSet("probe")) {
     r = hal_->probe();
   } else if (parser_->isSet("get-mac")) {
     auto smac = hal_->getMAC();
@@ -118,6 +345,9 @@ void CLI::run() {
       r = console();
       if (r.ok()) exit = false;
     }
+  } else if (config_->isSet("esp8266-backup-flash") ||
+             config_->isSet("esp8266-restore-flash")) {
+    r = flash(QString());
   } else if (parser_->isSet("console")) {
     r = console();
     if (r.ok()) exit = false;
@@ -126,6 +356,8 @@ void CLI::run() {
     parser_->showHelp(1);
   }
   if (exit) {
+    if (hal_ != nullptr) hal_->release();
+    if (port_ != nullptr) SerialTrace::stop(port_.get());
     if (r.ok()) {
       exit_code = 0;
     } else {
@@ -142,25 +374,31 @@ util::Status CLI::flash(const QString &path) {
   }
 
   std::unique_ptr<Flasher> f(hal_->flasher(prompter_));
+  if (parser_->isSet("ota")) f = newOTAFlasher(port_.get(), std::move(f));
   util::Status config_status = f->setOptionsFromConfig(*config_);
   if (!config_status.ok()) {
     return config_status;
   }
   util::Status st;
 
-  auto fwbs = NewZipFWBundle(path);
-  if (!fwbs.ok()) {
-    return QSP("failed to load firmware bundle", fwbs.status());
-  }
+  // Without a firmware bundle the flasher is configured by options alone
+  // (e.g. flash backup and restore).
+  std::unique_ptr<FirmwareBundle> fwb;
+  if (!path.isEmpty()) {
+    auto fwbs = NewZipFWBundle(path);
+    if (!fwbs.ok()) {
+      return QSP("failed to load firmware bundle", fwbs.status());
+    }
 
-  FirmwareBundle *fwb = fwbs.ValueOrDie().get();
-  util::Status err = f->setFirmware(fwb);
-  if (!err.ok()) {
-    return err;
-  }
+    fwb = fwbs.MoveValueOrDie();
+    util::Status err = f->setFirmware(fwb.get());
+    if (!err.ok()) {
+      return err;
+    }
 
-  qInfo() << "Flashing" << fwb->name() << fwb->platform().toUpper()
-          << fwb->buildId();
+    qInfo() << "Flashing" << fwb->name() << fwb->platform().toUpper()
+            << fwb->buildId();
+  }
 
   bool success = false;
   connect(f.get(), &Flasher::done, [&success](QString msg, bool ok) {
@@ -185,20 +423,713 @@ util::Status CLI::flash(const QString &path) {
     prev = important;
   });
 
+  QVariantMap metrics;
+  connect(f.get(), &Flasher::metrics,
+          [&metrics](QVariantMap m) { metrics = m; });
+
   f->run();  // connected slots should be called inline, so we don't need to
              // unblock the event loop for to print progress on terminal.
 
   cout << endl;
 
+  if (parser_->isSet("metrics")) {
+    st = outputMetrics(parser_->value("metrics"), metrics, false);
+    if (!st.ok()) qCritical() << "Failed to output metrics:" << st;
+  }
+  recordMetrics(parser_->value("port"), success, metrics);
+  if (success && fwb != nullptr) {
+    registerFlashed(fwb->buildId(), metrics);
+    waitForRegistrations();
+  }
+
   if (!success) {
     return util::Status(util::error::ABORTED, "Flashing failed.");
   }
   return util::Status::OK;
 }
 
+void CLI::registerFlashed(const QString &buildId, const QVariantMap &metrics) {
+  if (!parser_->isSet("register-devices")) return;
+  const QString mac = metrics.value("mac").toString();
+  if (mac.isEmpty()) {
+    qCritical() << "Device MAC is not known, not registering it";
+    return;
+  }
+  if (registrations_ == nullptr) {
+    registrations_.reset(
+        new RegistrationQueue(parser_->value("register-devices")));
+    connect(registrations_.get(), &RegistrationQueue::registered, this,
+            &CLI::registrationDone);
+    connect(registrations_.get(), &RegistrationQueue::failed, this,
+            [](QString mac, util::Status error) {
+              cout << endl << mac.toStdString()
+                   << ": registration failed: " << error.ToString() << endl;
+            });
+  }
+  RegistrationQueue::Device dev;
+  dev.arch = parser_->value("platform");
+  dev.mac = mac;
+  dev.fwBuild = buildId;
+  registrations_->add(dev);
+}
+
+void CLI::waitForRegistrations() {
+  if (registrations_ == nullptr || registrations_->pending() == 0) return;
+  cout << "Waiting for " << registrations_->pending()
+       << " devices to be registered..." << endl;
+  QEventLoop loop;
+  connect(registrations_.get(), &RegistrationQueue::idle, &loop,
+          &QEventLoop::quit);
+  loop.exec();
+}
+
+void CLI::registrationDone(const QString &mac, const QString &id,
+                           const QString &psk) {
+  QJsonObject r;
+  r["mac"] = mac;
+  r["device_id"] = id;
+  r["device_psk"] = psk;
+  const QByteArray line =
+      QJsonDocument(r).toJson(QJsonDocument::Compact) + "\n";
+  if (!parser_->isSet("registrations-file")) {
+    cout << endl << line.toStdString() << std::flush;
+    return;
+  }
+  QFile f(parser_->value("registrations-file"));
+  if (!f.open(QIODevice::WriteOnly | QIODevice::Append) ||
+      f.write(line) != line.length()) {
+    qCritical() << "Failed to write" << f.fileName() << ":" << f.errorString()
+                << line;
+  }
+}
+
+void CLI::recordMetrics(const QString &port, bool success,
+                        const QVariantMap &metrics) {
+  metricsRegistry_.record(port, success, metrics);
+  if (!parser_->isSet("metrics-textfile")) return;
+  util::Status st =
+      metricsRegistry_.writeTextFile(parser_->value("metrics-textfile"));
+  if (!st.ok()) qCritical() << "Failed to write metrics:" << st;
+}
+
+util::Status CLI::flashParallel(const QString &path, const QStringList &ports,
+                                const QString &watchSpec) {
+  QList<FlashJobSpec> specs;
+  for (const QString &port : ports) {
+    FlashJobSpec spec;
+    spec.port = port;
+    spec.firmware = path;
+    specs << spec;
+  }
+  bool ok;
+  const int maxParallel = parser_->value("max-parallel").toInt(&ok);
+  if (!ok || maxParallel < 0) {
+    return QS(util::error::INVALID_ARGUMENT, tr("invalid --max-parallel"));
+  }
+  return flashJobs(specs, maxParallel, watchSpec, path);
+}
+
+util::Status CLI::flashBatch(const QString &jobFile) {
+  QFile f(jobFile);
+  if (!f.open(QIODevice::ReadOnly)) {
+    return QS(util::error::UNAVAILABLE,
+              tr("failed to open %1: %2").arg(jobFile).arg(f.errorString()));
+  }
+  QJsonParseError err;
+  const QJsonDocument doc = QJsonDocument::fromJson(f.readAll(), &err);
+  if (err.error != QJsonParseError::NoError || !doc.isObject()) {
+    return QS(util::error::INVALID_ARGUMENT, tr("%1: invalid job file: %2")
+                                                 .arg(jobFile)
+                                                 .arg(err.errorString()));
+  }
+  const QJsonObject batch = doc.object();
+  // Relative bundle paths are relative to the job file.
+  const QDir baseDir = QFileInfo(jobFile).absoluteDir();
+  QString defaultFirmware =
+      batch["firmware"].toString(parser_->value("flash"));
+  if (!defaultFirmware.isEmpty()) {
+    defaultFirmware = baseDir.absoluteFilePath(defaultFirmware);
+  }
+  QList<FlashJobSpec> specs;
+  for (const QJsonValue &jv : batch["jobs"].toArray()) {
+    const QJsonObject j = jv.toObject();
+    FlashJobSpec spec;
+    spec.port = j["port"].toString();
+    if (spec.port.isEmpty()) {
+      return QS(util::error::INVALID_ARGUMENT,
+                tr("%1: job without a port").arg(jobFile));
+    }
+    spec.firmware = j.contains("firmware")
+                        ? baseDir.absoluteFilePath(j["firmware"].toString())
+                        : defaultFirmware;
+    if (spec.firmware.isEmpty()) {
+      return QS(util::error::INVALID_ARGUMENT,
+                tr("%1: no firmware for %2").arg(jobFile).arg(spec.port));
+    }
+    spec.options = j["options"].toObject();
+    // Checked up front, so a typo does not fail the job half way through.
+    Config check(*config_);
+    util::Status st = check.fromJSON(spec.options, Config::Level::Flags);
+    if (!st.ok()) {
+      return QSP(tr("%1: %2").arg(jobFile).arg(spec.port), st);
+    }
+    specs << spec;
+  }
+  if (specs.isEmpty()) {
+    return QS(util::error::INVALID_ARGUMENT, tr("%1: no jobs").arg(jobFile));
+  }
+  int maxParallel = batch["max_parallel"].toInt(-1);
+  if (maxParallel < 0) {
+    bool ok;
+    maxParallel = parser_->value("max-parallel").toInt(&ok);
+    if (!ok || maxParallel < 0) {
+      return QS(util::error::INVALID_ARGUMENT, tr("invalid --max-parallel"));
+    }
+  }
+  return flashJobs(specs, maxParallel, QString(), QString());
+}
+
+util::Status CLI::flashJobs(const QList<FlashJobSpec> &specs, int maxParallel,
+                            const QString &watchSpec,
+                            const QString &watchFirmware) {
+  bool ok;
+  const int numWorkers = parser_->value("workers").toInt(&ok);
+  if (!ok || numWorkers < 0) {
+    return QS(util::error::INVALID_ARGUMENT, tr("invalid --workers"));
+  }
+  if (numWorkers > 0) {
+    return flashInWorkers(specs, maxParallel, numWorkers, watchSpec,
+                          watchFirmware);
+  }
+  // Bundles are loaded and verified once and shared by all the flashers
+  // that use them, they only read from them.
+  std::map<QString, std::unique_ptr<FirmwareBundle>> bundles;
+  auto getBundle = [&bundles](
+      const QString &path) -> util::StatusOr<const FirmwareBundle *> {
+    const QString key = QFileInfo(path).absoluteFilePath();
+    auto it = bundles.find(key);
+    if (it != bundles.end()) return it->second.get();
+    auto fwbs = NewZipFWBundle(path);
+    if (!fwbs.ok()) {
+      return QSP(tr("failed to load firmware bundle %1").arg(path),
+                 fwbs.status());
+    }
+    std::unique_ptr<FirmwareBundle> fwb = fwbs.MoveValueOrDie();
+    util::Status vst = fwb->verifyAll();
+    if (!vst.ok()) return QSP(tr("invalid firmware bundle %1").arg(path), vst);
+    qInfo() << "Loaded" << path << fwb->name() << fwb->platform().toUpper()
+            << fwb->buildId();
+    const FirmwareBundle *result = fwb.get();
+    bundles[key] = std::move(fwb);
+    return result;
+  };
+  if (maxParallel == 0) maxParallel = std::numeric_limits<int>::max();
+  const int maxPerHub = parser_->value("max-writers-per-hub").toInt(&ok);
+  if (!ok || maxPerHub < 0) {
+    return QS(util::error::INVALID_ARGUMENT,
+              tr("invalid --max-writers-per-hub"));
+  }
+  BandwidthScheduler scheduler(maxPerHub);
+  const bool watching = !watchSpec.isEmpty();
+  raiseFileLimit(watching ? std::max(kWatchedPortsHint, specs.size())
+                          : specs.size());
+  QElapsedTimer batchTimer;
+  batchTimer.start();
+
+  struct Job {
+    QString portName;
+    std::unique_ptr<Config> config;  // With the job's own option overrides.
+    std::unique_ptr<QIODevice> port;
+    std::unique_ptr<HAL> hal;
+    std::unique_ptr<Flasher> flasher;
+    std::unique_ptr<QThread> thread;
+    int progress = 0;
+    int etaMs = -1;
+    bool started = false;
+    bool done = false;
+    QString buildId;
+    QElapsedTimer timer;
+    FlashJobResult result;
+  };
+  std::vector<std::unique_ptr<Job>> jobs;
+  // Results of jobs that are gone: those that could not be set up, e.g.
+  // because the port failed to open, and, when watching, those freed once
+  // done.
+  QList<FlashJobResult> results;
+  QEventLoop loop;
+  int numDone = 0;
+  int numRunning = 0;
+
+  auto printProgress = [&jobs, watching]() {
+    QString line;
+    for (const auto &job : jobs) {
+      // Finished ones pile up when watching.
+      if (watching && (!job->started || job->done)) continue;
+      const int total = std::max(job->flasher->totalBytes(), 1);
+      line += QString("%1 %2% ")
+                  .arg(QFileInfo(job->portName).fileName())
+                  .arg(job->progress * 100 / total);
+      if (job->etaMs >= 0 && !job->done) {
+        line += QString("%1s ").arg((job->etaMs + 999) / 1000);
+      }
+    }
+    cout << "\r" << line.toStdString() << std::flush;
+  };
+  // Jobs over maxParallel wait for others to finish. Ports are all open from
+  // the start, so devices do not get other ports by accident in the meantime.
+  auto startNext = [&jobs, &numRunning, maxParallel]() {
+    for (auto &job : jobs) {
+      if (numRunning >= maxParallel) break;
+      if (job->started) continue;
+      job->started = true;
+      numRunning++;
+      job->timer.start();
+      job->thread->start();
+    }
+  };
+  std::function<void(Job *)> jobDone;
+  auto addJob = [this, &getBundle, &jobs, &printProgress, &jobDone,
+                 &scheduler](const FlashJobSpec &spec) -> util::Status {
+    const QString &portName = spec.port;
+    std::unique_ptr<Job> job(new Job);
+    job->portName = portName;
+    job->result.port = portName;
+    job->result.firmware = spec.firmware;
+    job->config.reset(new Config(*config_));
+    util::Status st =
+        job->config->fromJSON(spec.options, Config::Level::Flags);
+    if (!st.ok()) return QSP(portName, st);
+    auto fwbr = getBundle(spec.firmware);
+    if (!fwbr.ok()) return fwbr.status();
+    const FirmwareBundle *fwb = fwbr.ValueOrDie();
+    auto sp = openPort(portName, 115200);
+    if (!sp.ok()) return QSP(tr("error opening %1").arg(portName), sp.status());
+    job->port.reset(sp.ValueOrDie());
+    job->buildId = fwb->buildId();
+    if (parser_->isSet("trace-serial")) {
+      st = SerialTrace::start(
+          job->port.get(),
+          traceFileName(parser_->value("trace-serial"), portName));
+      if (!st.ok()) return QSP(portName, st);
+    }
+    job->hal = newHAL(parser_->value("platform"), job->port.get());
+    if (job->hal == nullptr) {
+      return QS(util::error::INVALID_ARGUMENT,
+                tr("platform %1 can not be flashed via %2")
+                    .arg(parser_->value("platform"))
+                    .arg(portName));
+    }
+    job->flasher = job->hal->flasher(prompter_);
+    if (parser_->isSet("ota")) {
+      job->flasher = newOTAFlasher(job->port.get(), std::move(job->flasher));
+    }
+    st = job->flasher->setOptionsFromConfig(*job->config);
+    if (!st.ok()) return QSP(portName, st);
+    st = job->flasher->setFirmware(fwb);
+    if (!st.ok()) return QSP(portName, st);
+    job->flasher->setBandwidthGate(scheduler.gate(portName));
+
+    Job *j = job.get();
+    Flasher *f = j->flasher.get();
+    const QString tag = QString("[%1] ").arg(portName);
+    // Signals are delivered to this thread, via queued connections.
+    connect(f, &Flasher::statusMessage, this,
+            [tag](QString s, bool important) {
+              if (important) {
+                cout << endl << (tag + s).toStdString() << std::flush;
+              }
+            });
+    // Rate follows each progress update, the line is printed on that.
+    connect(f, &Flasher::progress, this,
+            [j](int bytes) { j->progress = bytes; });
+    connect(f, &Flasher::progressRate, this,
+            [j, &printProgress](int bytesPerSec, int etaMs) {
+              Q_UNUSED(bytesPerSec);
+              j->etaMs = etaMs;
+              printProgress();
+            });
+    connect(f, &Flasher::metrics, this,
+            [j](QVariantMap m) { j->result.metrics = m; });
+    // Runs on the flasher's thread, the port lives there. Releases the port
+    // for the next device plugged into it.
+    QIODevice *port = j->port.get();
+    connect(f, &Flasher::done, port, [port]() { port->close(); },
+            Qt::DirectConnection);
+    connect(f, &Flasher::done, this, [j, &jobDone](QString msg, bool ok) {
+      j->done = true;
+      j->result.elapsedMs = j->timer.elapsed();
+      j->result.message = msg;
+      j->result.success = ok;
+      j->result.bytesWritten = j->progress;
+      j->thread->quit();
+      jobDone(j);
+    });
+    j->thread.reset(new QThread);
+    j->thread->setStackSize(Flasher::kThreadStackSize);
+    f->moveToThread(j->thread.get());
+    j->port->moveToThread(j->thread.get());
+    connect(j->thread.get(), &QThread::started, f, [f]() { f->run(); });
+    jobs.push_back(std::move(job));
+    return util::Status::OK;
+  };
+  jobDone = [this, &jobs, &results, &numDone, &numRunning, &loop, &startNext,
+             watching](Job *job) {
+    numRunning--;
+    numDone++;
+    const FlashJobResult &r = job->result;
+    recordMetrics(r.port, r.success, r.metrics);
+    // Goes on in the background, the port is free for the next device.
+    if (r.success) registerFlashed(job->buildId, r.metrics);
+    if (watching) {
+      cout << endl << r.port.toStdString() << ": "
+           << (r.success ? "OK" : "FAILED") << ", " << r.message.toStdString()
+           << endl;
+      // Stations run for days, the thread, flasher and port go now. The
+      // thread has been told to quit and has nothing left to do.
+      results << r;
+      job->thread->wait();
+      jobs.erase(std::find_if(jobs.begin(), jobs.end(),
+                              [job](const std::unique_ptr<Job> &j) {
+                                return j.get() == job;
+                              }));
+    } else if (numDone == int(jobs.size())) {
+      loop.quit();
+    }
+    startNext();
+  };
+
+  // Jobs that could not be set up count as failed and do not hold up the
+  // rest.
+  auto setupFailed = [&results](const FlashJobSpec &spec,
+                                const util::Status &st) {
+    cout << endl << spec.port.toStdString() << ": " << st.ToString() << endl;
+    FlashJobResult r;
+    r.port = spec.port;
+    r.firmware = spec.firmware;
+    r.message = QString::fromStdString(st.ToString());
+    results << r;
+  };
+  for (const FlashJobSpec &spec : specs) {
+    util::Status st = addJob(spec);
+    if (!st.ok()) setupFailed(spec, st);
+  }
+
+  std::unique_ptr<PortWatcher> watcher;
+  if (watching) {
+    watcher.reset(new PortWatcher);
+    connect(watcher.get(), &PortWatcher::portAdded, this,
+            [&jobs, &addJob, &setupFailed, &startNext, watchSpec,
+             watchFirmware](const QSerialPortInfo &info) {
+              if (!portMatchesSpec(watchSpec, info)) return;
+              for (const auto &job : jobs) {
+                if (job->portName == info.systemLocation() && !job->done) {
+                  return;
+                }
+              }
+              qInfo() << "New device on" << info.systemLocation();
+              FlashJobSpec spec;
+              spec.port = info.systemLocation();
+              spec.firmware = watchFirmware;
+              util::Status st = addJob(spec);
+              if (!st.ok()) {
+                setupFailed(spec, st);
+                return;
+              }
+              startNext();
+            });
+    cout << "Waiting for devices on " << watchSpec.toStdString()
+         << ", press Ctrl-C to stop" << endl;
+  }
+  startNext();
+  if (watching || !jobs.empty()) loop.exec();
+  waitForRegistrations();
+
+  for (auto &job : jobs) {
+    job->thread->wait();
+    results << job->result;
+  }
+  return summarizeJobs(results, batchTimer.elapsed());
+}
+
+util::Status CLI::flashInWorkers(const QList<FlashJobSpec> &specs,
+                                 int maxParallel, int numWorkers,
+                                 const QString &watchSpec,
+                                 const QString &watchFirmware) {
+  if (parser_->value("max-writers-per-hub").toInt() != 0 ||
+      parser_->isSet("ota") || parser_->isSet("trace-serial")) {
+    return QS(util::error::INVALID_ARGUMENT,
+              tr("--max-writers-per-hub, --ota and --trace-serial do not "
+                 "work with --workers"));
+  }
+  // Bundles are checked here once, which leaves the expanded parts in the
+  // cache for the workers to map.
+  std::map<QString, QString> buildIds;  // By absolute path.
+  auto loadBundle = [&buildIds](const QString &path) -> util::Status {
+    const QString key = QFileInfo(path).absoluteFilePath();
+    if (buildIds.count(key) > 0) return util::Status::OK;
+    auto fwbs = NewZipFWBundle(path);
+    if (!fwbs.ok()) {
+      return QSP(tr("failed to load firmware bundle %1").arg(path),
+                 fwbs.status());
+    }
+    std::unique_ptr<FirmwareBundle> fwb = fwbs.MoveValueOrDie();
+    util::Status vst = fwb->verifyAll();
+    if (!vst.ok()) return QSP(tr("invalid firmware bundle %1").arg(path), vst);
+    buildIds[key] = fwb->buildId();
+    return util::Status::OK;
+  };
+  if (maxParallel == 0) maxParallel = std::numeric_limits<int>::max();
+  const bool watching = !watchSpec.isEmpty();
+  QElapsedTimer batchTimer;
+  batchTimer.start();
+
+  // Logging options are given on the command line, the rest of the config
+  // goes with each request.
+  QStringList workerArgs;
+  workerArgs << "--platform" << parser_->value("platform");
+  if (parser_->isSet("debug")) {
+    workerArgs << "--debug";
+  } else {
+    workerArgs << "--V" << parser_->value("V");
+  }
+  if (parser_->isSet("log")) workerArgs << "--log" << parser_->value("log");
+  WorkerPool pool(numWorkers, workerArgs);
+  util::Status st = pool.start();
+  if (!st.ok()) return QSP(tr("failed to start workers"), st);
+
+  struct Job {
+    FlashJobSpec spec;
+    QString buildId;
+    bool started = false;
+    bool done = false;
+    int progress = 0;
+    int total = 0;
+    int etaMs = -1;
+    FlashJobResult result;
+  };
+  std::vector<std::unique_ptr<Job>> jobs;
+  std::map<int, Job *> byId;
+  // Results of jobs that are gone: those that could not be set up and, when
+  // watching, those dropped once done.
+  QList<FlashJobResult> finished;
+  QEventLoop loop;
+  int numDone = 0;
+  int numRunning = 0;
+
+  auto printProgress = [&jobs]() {
+    QString line;
+    for (const auto &job : jobs) {
+      if (!job->started || job->done) continue;
+      line += QString("%1 %2% ")
+                  .arg(QFileInfo(job->spec.port).fileName())
+                  .arg(job->progress * 100 / std::max(job->total, 1));
+      if (job->etaMs >= 0) {
+        line += QString("%1s ").arg((job->etaMs + 999) / 1000);
+      }
+    }
+    cout << "\r" << line.toStdString() << std::flush;
+  };
+  std::function<void(Job *)> jobDone;
+  auto startNext = [this, &jobs, &byId, &numRunning, &pool, &jobDone,
+                    maxParallel, watching]() {
+    if (watching) {
+      jobs.erase(std::remove_if(jobs.begin(), jobs.end(),
+                                [](const std::unique_ptr<Job> &job) {
+                                  return job->done;
+                                }),
+                 jobs.end());
+    }
+    for (auto &job : jobs) {
+      if (numRunning >= maxParallel) break;
+      if (job->started) continue;
+      job->started = true;
+      numRunning++;
+      QJsonObject options;
+      Config config(*config_);
+      // Checked by addJob.
+      config.fromJSON(job->spec.options, Config::Level::Flags);
+      for (const QCommandLineOption &opt : config.options()) {
+        const QString name = opt.names()[0];
+        if (name == "verbose" || name == "log" || !config.isSet(name)) {
+          continue;
+        }
+        if (opt.valueName().isEmpty()) {
+          options[name] = config.boolValue(name);
+        } else {
+          options[name] = config.value(name);
+        }
+      }
+      auto idr = pool.flash(job->spec.port, job->spec.firmware, options);
+      if (!idr.ok()) {
+        // Counted as done right away, which lets the next one start.
+        job->result.message = QString::fromStdString(idr.status().ToString());
+        jobDone(job.get());
+        continue;
+      }
+      byId[idr.ValueOrDie()] = job.get();
+    }
+  };
+  jobDone = [this, &jobs, &finished, &numDone, &numRunning, &loop,
+             watching](Job *job) {
+    job->done = true;
+    numRunning--;
+    numDone++;
+    const FlashJobResult &r = job->result;
+    recordMetrics(r.port, r.success, r.metrics);
+    if (r.success) registerFlashed(job->buildId, r.metrics);
+    if (watching) {
+      cout << endl << r.port.toStdString() << ": "
+           << (r.success ? "OK" : "FAILED") << ", " << r.message.toStdString()
+           << endl;
+      // The job itself goes on the next startNext.
+      finished << r;
+    } else if (numDone == int(jobs.size())) {
+      loop.quit();
+    }
+  };
+  connect(&pool, &WorkerPool::event, this,
+          [&byId, &printProgress, &jobDone, &startNext](int id,
+                                                        QJsonObject e) {
+            auto it = byId.find(id);
+            if (it == byId.end()) return;
+            Job *job = it->second;
+            const QString event = e["event"].toString();
+            if (event == "progress") {
+              job->progress = e["bytes"].toInt();
+              job->total = e["total"].toInt();
+              job->etaMs = e["eta_ms"].toInt(-1);
+              printProgress();
+            } else if (event == "status") {
+              cout << endl << QString("[%1] %2")
+                                  .arg(job->spec.port)
+                                  .arg(e["message"].toString())
+                                  .toStdString()
+                   << std::flush;
+            } else if (event == "done") {
+              byId.erase(it);
+              FlashJobResult &r = job->result;
+              r.success = e["success"].toBool();
+              r.message = e["message"].toString();
+              r.elapsedMs = qint64(e["elapsed_ms"].toDouble());
+              r.bytesWritten = job->progress;
+              r.metrics = e["metrics"].toObject().toVariantMap();
+              jobDone(job);
+              startNext();
+            }
+          });
+  auto setupFailed = [&finished](const FlashJobSpec &spec,
+                                 const util::Status &st) {
+    cout << endl << spec.port.toStdString() << ": " << st.ToString() << endl;
+    FlashJobResult r;
+    r.port = spec.port;
+    r.firmware = spec.firmware;
+    r.message = QString::fromStdString(st.ToString());
+    finished << r;
+  };
+  auto addJob = [this, &jobs, &loadBundle, &buildIds](
+      const FlashJobSpec &spec) -> util::Status {
+    Config check(*config_);
+    util::Status st = check.fromJSON(spec.options, Config::Level::Flags);
+    if (!st.ok()) return QSP(spec.port, st);
+    st = loadBundle(spec.firmware);
+    if (!st.ok()) return st;
+    std::unique_ptr<Job> job(new Job);
+    job->spec = spec;
+    job->buildId = buildIds[QFileInfo(spec.firmware).absoluteFilePath()];
+    job->result.port = spec.port;
+    job->result.firmware = spec.firmware;
+    jobs.push_back(std::move(job));
+    return util::Status::OK;
+  };
+
+  for (const FlashJobSpec &spec : specs) {
+    st = addJob(spec);
+    if (!st.ok()) setupFailed(spec, st);
+  }
+  std::unique_ptr<PortWatcher> watcher;
+  if (watching) {
+    watcher.reset(new PortWatcher);
+    connect(watcher.get(), &PortWatcher::portAdded, this,
+            [&jobs, &addJob, &setupFailed, &startNext, watchSpec,
+             watchFirmware](const QSerialPortInfo &info) {
+              if (!portMatchesSpec(watchSpec, info)) return;
+              for (const auto &job : jobs) {
+                if (job->spec.port == info.systemLocation() && !job->done) {
+                  return;
+                }
+              }
+              qInfo() << "New device on" << info.systemLocation();
+              FlashJobSpec spec;
+              spec.port = info.systemLocation();
+              spec.firmware = watchFirmware;
+              util::Status st = addJob(spec);
+              if (!st.ok()) {
+                setupFailed(spec, st);
+                return;
+              }
+              startNext();
+            });
+    cout << "Waiting for devices on " << watchSpec.toStdString()
+         << ", press Ctrl-C to stop" << endl;
+  }
+  startNext();
+  // Requests that fail to go out are done before the loop runs.
+  if (watching || numDone < int(jobs.size())) loop.exec();
+  waitForRegistrations();
+
+  QList<FlashJobResult> results = finished;
+  for (auto &job : jobs) {
+    if (!job->done || !watching) results << job->result;
+  }
+  return summarizeJobs(results, batchTimer.elapsed());
+}
+
+util::Status CLI::summarizeJobs(const QList<FlashJobResult> &results,
+                                qint64 elapsedMs) {
+  cout << endl;
+  int numFailed = 0;
+  for (const FlashJobResult &r : results) {
+    cout << r.port.toStdString() << ": " << (r.success ? "OK" : "FAILED")
+         << ", " << r.message.toStdString() << endl;
+    if (!r.success) numFailed++;
+  }
+  if (parser_->isSet("metrics")) {
+    QVariantMap metrics;
+    for (const FlashJobResult &r : results) metrics[r.port] = r.metrics;
+    util::Status st = outputMetrics(parser_->value("metrics"), metrics, true);
+    if (!st.ok()) qCritical() << "Failed to output metrics:" << st;
+  }
+  if (parser_->isSet("report")) {
+    QJsonArray jobsReport;
+    for (const FlashJobResult &r : results) {
+      QJsonObject jr;
+      jr["port"] = r.port;
+      jr["firmware"] = r.firmware;
+      jr["success"] = r.success;
+      jr["message"] = r.message;
+      jr["elapsed_ms"] = double(r.elapsedMs);
+      jr["bytes_written"] = r.bytesWritten;
+      jr["metrics"] = QJsonObject::fromVariantMap(r.metrics);
+      jobsReport.append(jr);
+    }
+    QJsonObject report;
+    report["jobs"] = jobsReport;
+    report["failed"] = numFailed;
+    report["elapsed_ms"] = double(elapsedMs);
+    util::Status st = outputReport(parser_->value("report"), report);
+    if (!st.ok()) qCritical() << "Failed to output report:" << st;
+  }
+  if (numFailed > 0) {
+    return QS(util::error::ABORTED, tr("Flashing failed on %1 of %2 devices.")
+                                        .arg(numFailed)
+                                        .arg(results.size()));
+  }
+  return util::Status::OK;
+}
+
 #ifndef _WIN32
 util::Status CLI::console() {
-  QSerialPort *port = port_.get();
+  QIODevice *port = port_.get();
   util::Status st = setSpeed(port, config_->value("console-baud-rate").toInt());
   if (!st.ok()) return st;
 
@@ -207,14 +1138,10 @@ util::Status CLI::console() {
   QFile *cout = new QFile();
   cout->open(fileno(stdout), QIODevice::WriteOnly);
 
-  QFile *console_log = nullptr;
-  if (config_->isSet("console-log")) {
-    QString fn = config_->value("console-log");
-    console_log = new QFile(fn, this);
-    if (!console_log->open(QIODevice::ReadWrite | QIODevice::Append)) {
-      return QS(util::error::UNAVAILABLE, tr("Error opening %1").arg(fn));
-    }
-  }
+  auto clr = ConsoleLog::fromConfig(*config_, false /* truncate */);
+  if (!clr.ok()) return clr.status();
+  ConsoleLog *console_log = clr.ValueOrDie();
+  if (console_log != nullptr) console_log->setParent(this);
 
   QSocketNotifier *qsn =
       new QSocketNotifier(fileno(stdin), QSocketNotifier::Read, this);
@@ -225,8 +1152,7 @@ util::Status CLI::console() {
       for (int i = 0; i < data.length(); i++) {
         if (data[i] < ' ' && data[i] != '\r' && data[i] != '\n') data[i] = ' ';
       }
-      console_log->write(data);
-      console_log->flush();
+      console_log->append(data);
     }
     cout->write(data);
     cout->flush();
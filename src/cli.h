@@ -9,13 +9,19 @@
 #include <memory>
 
 #include <QObject>
-#include <QSerialPort>
+#include <QIODevice>
+#include <QJsonObject>
+#include <QList>
 #include <QString>
+#include <QStringList>
+#include <QVariantMap>
 
 #include <common/util/status.h>
 
 #include "hal.h"
+#include "metrics_registry.h"
 #include "prompter.h"
+#include "registration_queue.h"
 
 class Config;
 class QCommandLineParser;
@@ -27,7 +33,58 @@ class CLI : public QObject {
   CLI(Config *config, QCommandLineParser *parser, QObject *parent = 0);
 
  private:
+  // A device to flash as part of a batch.
+  struct FlashJobSpec {
+    QString port;
+    QString firmware;
+    // Override the config for this device, see Config::fromJSON.
+    QJsonObject options;
+  };
+  // How it went.
+  struct FlashJobResult {
+    QString port;
+    QString firmware;
+    bool success = false;
+    QString message;
+    qint64 elapsedMs = 0;
+    int bytesWritten = 0;
+    QVariantMap metrics;
+  };
+
   util::Status flash(const QString &path);
+  // Flashes devices on all the ports at the same time, one thread per port.
+  // If watchSpec is set, keeps running and also flashes devices that appear
+  // on ports matching it (see --ports).
+  util::Status flashParallel(const QString &path, const QStringList &ports,
+                             const QString &watchSpec);
+  // Runs the jobs listed in a JSON file (see --batch).
+  util::Status flashBatch(const QString &jobFile);
+  // Flashes the devices in parallel, up to maxParallel (0 - no limit) at a
+  // time. Bundles are loaded once for all the jobs that use them. With
+  // watchSpec, devices that appear later are flashed with watchFirmware.
+  util::Status flashJobs(const QList<FlashJobSpec> &specs, int maxParallel,
+                         const QString &watchSpec,
+                         const QString &watchFirmware);
+  // Same as flashJobs, with the devices flashed by numWorkers worker
+  // processes (see --workers) and the results collected here.
+  util::Status flashInWorkers(const QList<FlashJobSpec> &specs,
+                              int maxParallel, int numWorkers,
+                              const QString &watchSpec,
+                              const QString &watchFirmware);
+  // Prints the result of each job and outputs --metrics and --report. Fails
+  // if any of the jobs did.
+  util::Status summarizeJobs(const QList<FlashJobResult> &results,
+                             qint64 elapsedMs);
+  // Adds the run to the fleet statistics (see --metrics-textfile).
+  void recordMetrics(const QString &port, bool success,
+                     const QVariantMap &metrics);
+  // Queues registration of a flashed device with the cloud (see
+  // --register-devices), if asked to and the flasher reported the MAC.
+  void registerFlashed(const QString &buildId, const QVariantMap &metrics);
+  // Lets the registrations that are still going on finish.
+  void waitForRegistrations();
+  void registrationDone(const QString &mac, const QString &id,
+                        const QString &psk);
   util::Status console();
   util::Status generateID(const QString &filename, const QString &domain);
   void run();
@@ -35,7 +92,9 @@ class CLI : public QObject {
   Config *config_;
   QCommandLineParser *parser_;
   std::unique_ptr<HAL> hal_;
-  std::unique_ptr<QSerialPort> port_;
+  std::unique_ptr<QIODevice> port_;
+  MetricsRegistry metricsRegistry_;
+  std::unique_ptr<RegistrationQueue> registrations_;
   Prompter *prompter_;
 };
 
@@ -1,6 +1,12 @@
 #include "config.h"
 
 #include <QCommandLineParser>
+#include <QJsonValue>
+#include <QObject>
+
+#include <common/util/error_codes.h>
+
+#include "status_qt.h"
 
 void Config::addOptions(const QList<QCommandLineOption> &options) {
   options_.append(options);
@@ -80,6 +86,33 @@ void Config::fromCommandLine(const QCommandLineParser &parser) {
   }
 }
 
+util::Status Config::fromJSON(const QJsonObject &options,
+                              Config::Level level) {
+  for (auto it = options.begin(); it != options.end(); ++it) {
+    bool known = false;
+    for (const auto &opt : options_) {
+      if (opt.names().contains(it.key())) known = true;
+    }
+    if (!known) {
+      return QS(util::error::INVALID_ARGUMENT,
+                QObject::tr("unknown option: %1").arg(it.key()));
+    }
+    const QJsonValue v = it.value();
+    if (v.isBool()) {
+      if (v.toBool()) {
+        setValue(it.key(), "true", level);
+      } else {
+        unset(it.key(), level);
+      }
+    } else if (v.isDouble()) {
+      setValue(it.key(), QString::number(v.toDouble(), 'g', 15), level);
+    } else {
+      setValue(it.key(), v.toString(), level);
+    }
+  }
+  return util::Status::OK;
+}
+
 bool Config::addOptionsToParser(QCommandLineParser *parser) const {
 #if (QT_VERSION < QT_VERSION_CHECK(5, 4, 0))
   for (const auto &opt : options_) {
@@ -7,10 +7,13 @@
 #define CS_MFT_SRC_CONFIG_H_
 
 #include <QCommandLineOption>
+#include <QJsonObject>
 #include <QList>
 #include <QString>
 #include <QMap>
 
+#include <common/util/status.h>
+
 class QCommandLineParser;
 
 // Config is responsible for both storage of configuration knob values and
@@ -58,6 +61,11 @@ class Config {
   // stores them at Flags level.
   void fromCommandLine(const QCommandLineParser &parser);
 
+  // fromJSON stores values of options given as a JSON object at a given
+  // level. Strings and numbers are values, true sets a flag and false unsets
+  // it. Fails on the first option that is not known.
+  util::Status fromJSON(const QJsonObject &options, Level level);
+
   // addOptionsToParser adds all known options to the parser.
   bool addOptionsToParser(QCommandLineParser *parser) const;
 
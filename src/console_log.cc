@@ -0,0 +1,148 @@
+#include "console_log.h"
+
+#include <memory>
+
+#include <QDateTime>
+#include <QDebug>
+#include <QMutexLocker>
+
+#include "config.h"
+#include "status_qt.h"
+
+namespace {
+
+const int kFlushIntervalMs = 200;
+// The writer is woken up early once this much is pending.
+const qint64 kFlushSize = 64 * 1024;
+// Beyond this, new data is dropped until the writer catches up.
+const qint64 kMaxPending = 16 * 1024 * 1024;
+
+}  // namespace
+
+ConsoleLog::ConsoleLog(const QString &fileName, bool timestamps,
+                       qint64 maxSize)
+    : timestamps_(timestamps), maxSize_(maxSize), file_(fileName) {
+}
+
+ConsoleLog::~ConsoleLog() {
+  {
+    QMutexLocker lock(&mtx_);
+    stop_ = true;
+    cond_.wakeOne();
+  }
+  wait();
+}
+
+// static
+util::StatusOr<ConsoleLog *> ConsoleLog::fromConfig(const Config &config,
+                                                    bool truncate) {
+  if (!config.isSet("console-log")) return nullptr;
+  bool ok = false;
+  const qint64 maxSize = config.value("console-log-max-size").toLongLong(&ok);
+  if (!ok || maxSize < 0) {
+    return QS(util::error::INVALID_ARGUMENT,
+              QObject::tr("invalid value for --console-log-max-size: %1")
+                  .arg(config.value("console-log-max-size")));
+  }
+  std::unique_ptr<ConsoleLog> log(
+      new ConsoleLog(config.value("console-log"),
+                     config.isSet("console-log-timestamps"), maxSize));
+  util::Status st = log->open(truncate);
+  if (!st.ok()) return st;
+  return log.release();
+}
+
+util::Status ConsoleLog::open(bool truncate) {
+  if (!file_.open(QIODevice::WriteOnly |
+                  (truncate ? QIODevice::Truncate : QIODevice::Append))) {
+    return QS(util::error::UNAVAILABLE, QObject::tr("error opening %1: %2")
+                                            .arg(file_.fileName())
+                                            .arg(file_.errorString()));
+  }
+  start(QThread::LowPriority);
+  return util::Status::OK;
+}
+
+QString ConsoleLog::fileName() const {
+  return file_.fileName();
+}
+
+void ConsoleLog::append(const QByteArray &data) {
+  if (data.isEmpty()) return;
+  const qint64 ts = timestamps_ ? QDateTime::currentMSecsSinceEpoch() : 0;
+  QMutexLocker lock(&mtx_);
+  if (pendingBytes_ + data.size() > kMaxPending) {
+    dropped_ += data.size();
+    return;
+  }
+  // QByteArray is implicitly shared, this does not copy the data.
+  pending_.append(Chunk{ts, data});
+  pendingBytes_ += data.size();
+  if (pendingBytes_ >= kFlushSize) cond_.wakeOne();
+}
+
+void ConsoleLog::run() {
+  bool stop = false;
+  while (!stop) {
+    QList<Chunk> chunks;
+    qint64 dropped = 0;
+    {
+      QMutexLocker lock(&mtx_);
+      if (!stop_ && pendingBytes_ < kFlushSize) {
+        cond_.wait(&mtx_, kFlushIntervalMs);
+      }
+      chunks.swap(pending_);
+      pendingBytes_ = 0;
+      dropped = dropped_;
+      dropped_ = 0;
+      stop = stop_;
+    }
+    if (chunks.isEmpty() && dropped == 0) continue;
+    writeChunks(chunks, dropped);
+  }
+  file_.close();
+}
+
+void ConsoleLog::writeChunks(const QList<Chunk> &chunks, qint64 dropped) {
+  QByteArray out;
+  for (const Chunk &c : chunks) {
+    if (!timestamps_) {
+      out.append(c.data);
+      continue;
+    }
+    const QByteArray prefix =
+        QDateTime::fromMSecsSinceEpoch(c.ts)
+            .toString("[yyyy-MM-dd hh:mm:ss.zzz] ")
+            .toUtf8();
+    for (char ch : c.data) {
+      if (atLineStart_) out.append(prefix);
+      out.append(ch);
+      atLineStart_ = (ch == '\n');
+    }
+  }
+  if (dropped > 0) {
+    out.append(QString("\n--- %1 bytes dropped, log writer fell behind\n")
+                   .arg(dropped)
+                   .toUtf8());
+    atLineStart_ = true;
+  }
+  if (file_.write(out) != out.size() || !file_.flush()) {
+    qCritical() << "Failed to write console log:" << file_.errorString();
+  }
+  if (maxSize_ > 0 && file_.size() >= maxSize_) rotate();
+}
+
+// Keeps one old file around, with ".1" appended to the name.
+void ConsoleLog::rotate() {
+  const QString fileName = file_.fileName();
+  const QString oldFileName = fileName + ".1";
+  file_.close();
+  QFile::remove(oldFileName);
+  if (!QFile::rename(fileName, oldFileName)) {
+    qCritical() << "Failed to rename" << fileName << "to" << oldFileName;
+  }
+  if (!file_.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+    qCritical() << "Failed to reopen console log:" << file_.errorString();
+  }
+  atLineStart_ = true;
+}
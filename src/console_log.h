@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ */
+
+#ifndef CS_MFT_SRC_CONSOLE_LOG_H_
+#define CS_MFT_SRC_CONSOLE_LOG_H_
+
+#include <QByteArray>
+#include <QFile>
+#include <QList>
+#include <QMutex>
+#include <QString>
+#include <QThread>
+#include <QWaitCondition>
+
+#include <common/util/statusor.h>
+
+class Config;
+
+// Writes console output to a file from a thread of its own, so a slow disk
+// does not hold up whoever reads the serial port. Data is buffered and
+// written every 200 ms, or sooner if enough of it is pending. If the writer
+// falls too far behind, data is dropped rather than blocking append().
+class ConsoleLog : public QThread {
+  Q_OBJECT
+
+ public:
+  ConsoleLog(const QString &fileName, bool timestamps, qint64 maxSize);
+  // Writes out what is pending.
+  ~ConsoleLog() override;
+
+  // Opens the file and starts the writer.
+  util::Status open(bool truncate);
+  QString fileName() const;
+
+  // Thread-safe, never blocks on I/O.
+  void append(const QByteArray &data);
+
+  static util::StatusOr<ConsoleLog *> fromConfig(const Config &config,
+                                                 bool truncate);
+
+ protected:
+  void run() override;
+
+ private:
+  struct Chunk {
+    qint64 ts;  // ms since epoch, only used with timestamps.
+    QByteArray data;
+  };
+
+  void writeChunks(const QList<Chunk> &chunks, qint64 dropped);
+  void rotate();
+
+  const bool timestamps_;
+  const qint64 maxSize_;  // The file is rotated when it gets this big.
+  QFile file_;
+  bool atLineStart_ = true;  // Only used by the writer.
+
+  QMutex mtx_;  // Guards the fields below.
+  QWaitCondition cond_;
+  QList<Chunk> pending_;
+  qint64 pendingBytes_ = 0;
+  qint64 dropped_ = 0;
+  bool stop_ = false;
+};
+
+#endif /* CS_MFT_SRC_CONSOLE_LOG_H_ */
@@ -0,0 +1,186 @@
+#include "crc32.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CRC32_X86_CLMUL 1
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <smmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+namespace CRC32 {
+
+namespace {
+
+const quint32 kPoly = 0xedb88320;  // Reflected 0x04c11db7.
+
+struct Tables {
+  quint32 t[8][256];
+
+  Tables() {
+    for (quint32 i = 0; i < 256; i++) {
+      quint32 c = i;
+      for (int k = 0; k < 8; k++) c = (c >> 1) ^ (kPoly & (0 - (c & 1)));
+      t[0][i] = c;
+    }
+    for (int k = 1; k < 8; k++) {
+      for (int i = 0; i < 256; i++) {
+        t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+      }
+    }
+  }
+};
+
+const Tables &tables() {
+  static const Tables t;
+  return t;
+}
+
+inline quint32 load32(const quint8 *p) {
+  return quint32(p[0]) | (quint32(p[1]) << 8) | (quint32(p[2]) << 16) |
+         (quint32(p[3]) << 24);
+}
+
+// Slicing-by-8. Works on the inverted CRC, as do the other variants.
+quint32 crc32Tables(quint32 c, const quint8 *p, size_t len) {
+  const auto &t = tables().t;
+  for (; len >= 8; p += 8, len -= 8) {
+    const quint32 a = c ^ load32(p), b = load32(p + 4);
+    c = t[7][a & 0xff] ^ t[6][(a >> 8) & 0xff] ^ t[5][(a >> 16) & 0xff] ^
+        t[4][a >> 24] ^ t[3][b & 0xff] ^ t[2][(b >> 8) & 0xff] ^
+        t[1][(b >> 16) & 0xff] ^ t[0][b >> 24];
+  }
+  for (; len > 0; p++, len--) c = (c >> 8) ^ t[0][(c ^ *p) & 0xff];
+  return c;
+}
+
+#ifdef CRC32_X86_CLMUL
+
+bool hasClmul() {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+  return (ecx & bit_PCLMUL) != 0 && (ecx & bit_SSE4_1) != 0;
+}
+
+const bool kHasClmul = hasClmul();
+
+// Folds 64 bytes at a time with carry-less multiplication and reduces the
+// result with Barrett reduction, as in Intel's "Fast CRC Computation for
+// Generic Polynomials Using PCLMULQDQ Instruction". len must be a multiple
+// of 16, at least 64.
+__attribute__((target("sse4.1,pclmul"))) quint32 crc32Clmul(quint32 c,
+                                                           const quint8 *p,
+                                                           size_t len) {
+  // Constants for the reflected polynomial, from the paper.
+  const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+  const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+  const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+  const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+  const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+  const __m128i *in = reinterpret_cast<const __m128i *>(p);
+
+  __m128i x1 = _mm_loadu_si128(in + 0);
+  __m128i x2 = _mm_loadu_si128(in + 1);
+  __m128i x3 = _mm_loadu_si128(in + 2);
+  __m128i x4 = _mm_loadu_si128(in + 3);
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(int(c)));
+  in += 4;
+  len -= 64;
+
+  __m128i k = k1k2;
+  for (; len >= 64; in += 4, len -= 64) {
+    const __m128i x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+    const __m128i x6 = _mm_clmulepi64_si128(x2, k, 0x00);
+    const __m128i x7 = _mm_clmulepi64_si128(x3, k, 0x00);
+    const __m128i x8 = _mm_clmulepi64_si128(x4, k, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, k, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, k, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, k, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128(in + 0));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128(in + 1));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128(in + 2));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128(in + 3));
+  }
+
+  // Fold the four lanes into one, then the remaining 16-byte blocks.
+  k = k3k4;
+  const __m128i lanes[] = {x2, x3, x4};
+  for (const __m128i &x : lanes) {
+    const __m128i lo = _mm_clmulepi64_si128(x1, k, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x), lo);
+  }
+  for (; len >= 16; in++, len -= 16) {
+    const __m128i lo = _mm_clmulepi64_si128(x1, k, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128(in)), lo);
+  }
+
+  // 128 -> 64 bits.
+  x2 = _mm_clmulepi64_si128(x1, k, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, mask32);
+  x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k5k0, 0x00), x2);
+
+  // Barrett reduction to 32 bits.
+  x2 = _mm_and_si128(x1, mask32);
+  x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+  x2 = _mm_and_si128(x2, mask32);
+  x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+  return quint32(_mm_extract_epi32(x1, 1));
+}
+
+#endif  // CRC32_X86_CLMUL
+
+#if defined(__ARM_FEATURE_CRC32)
+
+quint32 crc32Arm(quint32 c, const quint8 *p, size_t len) {
+  for (; len >= 8; p += 8, len -= 8) {
+    c = __crc32w(c, load32(p));
+    c = __crc32w(c, load32(p + 4));
+  }
+  for (; len > 0; p++, len--) c = __crc32b(c, *p);
+  return c;
+}
+
+#endif  // __ARM_FEATURE_CRC32
+
+}  // namespace
+
+quint32 update(quint32 crc, const void *data, size_t len) {
+  const quint8 *p = static_cast<const quint8 *>(data);
+  quint32 c = ~crc;
+#if defined(__ARM_FEATURE_CRC32)
+  return ~crc32Arm(c, p, len);
+#else
+#ifdef CRC32_X86_CLMUL
+  if (kHasClmul && len >= 64) {
+    const size_t n = len & ~size_t(15);
+    c = crc32Clmul(c, p, n);
+    p += n;
+    len -= n;
+  }
+#endif
+  return ~crc32Tables(c, p, len);
+#endif
+}
+
+const char *implementation() {
+#if defined(__ARM_FEATURE_CRC32)
+  return "armv8";
+#else
+#ifdef CRC32_X86_CLMUL
+  if (kHasClmul) return "pclmul";
+#endif
+  return "tables";
+#endif
+}
+
+}  // namespace CRC32
@@ -0,0 +1,28 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ */
+
+#ifndef CS_MFT_SRC_CRC32_H_
+#define CS_MFT_SRC_CRC32_H_
+
+#include <cstddef>
+
+#include <QtGlobal>
+
+// CRC-32 as used by ZIP and zlib (and mz_crc32). Not named crc32, which
+// miniz.c defines as a macro.
+namespace CRC32 {
+
+// Start with 0, feed the result of one call into the next. Uses carry-less
+// multiplication on x86 CPUs that have it (checked at run time) and the
+// CRC32 instructions on ARM builds that target them, 8 bytes at a time with
+// tables otherwise.
+quint32 update(quint32 crc, const void *data, size_t len);
+
+// Name of the implementation update() uses on this machine, for logging.
+const char *implementation();
+
+}  // namespace CRC32
+
+#endif /* CS_MFT_SRC_CRC32_H_ */
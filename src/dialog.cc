@@ -14,6 +14,7 @@
 #include <QEvent>
 #include <QFile>
 #include <QFileDialog>
+#include <QFileInfo>
 #include <QFont>
 #include <QFontDatabase>
 #include <QFormLayout>
@@ -51,6 +52,13 @@ const char kPromptEnd[] = "$ ";
 
 const int kDefaultConsoleBaudRate = 115200;
 
+// Serial data is shown at most this often, redrawing the console on every
+// read does not keep up with a device that logs a lot.
+const int kConsoleFlushIntervalMs = 33;
+// If the console falls this far behind, the oldest data is not shown (it is
+// still written to the console log).
+const int kMaxConsolePending = 1024 * 1024;
+
 }  // namespace
 
 // static
@@ -101,6 +109,11 @@ MainDialog::MainDialog(Config *config, QWidget *parent)
   ui_.terminal->setFont(fixedFont);
   ui_.terminalInput->installEventFilter(this);
 
+  console_flush_timer_.setSingleShot(true);
+  console_flush_timer_.setInterval(kConsoleFlushIntervalMs);
+  connect(&console_flush_timer_, &QTimer::timeout, this,
+          &MainDialog::flushConsole);
+
   action_enabled_in_state_.insert(ui_.actionConfigure_Wi_Fi, State::Terminal);
   action_enabled_in_state_.insert(ui_.actionUpload_a_file, State::Terminal);
   enabled_in_state_.insert(ui_.connectBtn, State::Connected);
@@ -124,9 +137,12 @@ MainDialog::MainDialog(Config *config, QWidget *parent)
 #else
   QTimer::singleShot(0, this, &MainDialog::updatePortList);
 #endif
-  refresh_timer_ = new QTimer(this);
-  refresh_timer_->start(500);
-  connect(refresh_timer_, &QTimer::timeout, this, &MainDialog::updatePortList);
+  port_watcher_ = new PortWatcher(this);
+  connect(port_watcher_, &PortWatcher::changed, this,
+          &MainDialog::updatePortList);
+  // Changes are not applied while connected in the background.
+  connect(qApp, &QGuiApplication::applicationStateChanged, this,
+          &MainDialog::updatePortList);
 
   connect(this, &MainDialog::gotPrompt, this, &MainDialog::sendQueuedCommand);
 
@@ -320,6 +336,7 @@ util::Status MainDialog::closeSerial() {
     case State::Terminal:
       disconnectTerminal();
       readSerial();  // read the remainder of the buffer before closing the port
+      flushConsole();
       break;
     case State::Flashing:
       setState(State::PortGoneWhileFlashing);
@@ -399,6 +416,7 @@ util::Status MainDialog::disconnectTerminal() {
              &MainDialog::readSerial);
 
   setState(State::Connected);
+  flushConsole();
   ui_.terminal->appendPlainText(tr("--- disconnected"));
   return util::Status::OK;
 }
@@ -420,26 +438,45 @@ void MainDialog::readSerial() {
     return;
   }
   QByteArray data = serial_port_->readAll();
-  if (data.length() >= 2 && data.right(2) == kPromptEnd) {
+  if (data.isEmpty()) return;
+  // The prompt may be split between reads.
+  const QByteArray tail = console_last_byte_ + data.right(2);
+  console_last_byte_ = data.right(1);
+  if (tail.right(2) == kPromptEnd) {
     emit gotPrompt();
   }
-  if (console_log_) {
-    console_log_->write(data);
-    console_log_->flush();
+  if (console_log_) console_log_->append(data);
+  console_pending_.append(data);
+  if (console_pending_.size() > kMaxConsolePending) {
+    const int dropped = console_pending_.size() - kMaxConsolePending;
+    console_pending_.remove(0, dropped);
+    console_dropped_ += dropped;
   }
+  if (!console_flush_timer_.isActive()) console_flush_timer_.start();
+}
+
+void MainDialog::flushConsole() {
+  console_flush_timer_.stop();
+  if (console_pending_.isEmpty()) return;
   auto *scroll = ui_.terminal->verticalScrollBar();
   bool autoscroll = scroll->value() == scroll->maximum();
   // Appending a bunch of text the hard way, because
   // QPlainTextEdit::appendPlainText creates a new paragraph on each call,
   // making it look like extra newlines.
-  const QStringList parts = QString(data).split('\n');
+  QStringList parts = QString(console_pending_).split('\n');
+  console_pending_.clear();
+  for (QString &part : parts) part = trimRight(part);
+  if (console_dropped_ > 0) {
+    parts.prepend(tr("--- %1 bytes not shown").arg(console_dropped_));
+    console_dropped_ = 0;
+  }
   QTextCursor cursor = QTextCursor(ui_.terminal->document());
   cursor.movePosition(QTextCursor::End);
-  for (int i = 0; i < parts.length() - 1; i++) {
-    cursor.insertText(trimRight(parts[i]));
-    cursor.insertBlock();
-  }
-  cursor.insertText(trimRight(parts.last()));
+  // A single edit block, so the layout is only updated once. Line feeds
+  // become block separators.
+  cursor.beginEditBlock();
+  cursor.insertText(parts.join('\n'));
+  cursor.endEditBlock();
 
   if (autoscroll) {
     scroll->setValue(scroll->maximum());
@@ -504,13 +541,7 @@ void MainDialog::updatePortList() {
     }
   }
 
-  auto ports = QSerialPortInfo::availablePorts();
-  for (const auto &info : ports) {
-#ifdef Q_OS_MAC
-    if (info.portName().contains("Bluetooth")) {
-      continue;
-    }
-#endif
+  for (const auto &info : port_watcher_->ports()) {
     to_add.insert(info.portName());
   }
 
@@ -556,6 +587,7 @@ void MainDialog::selectFirmwareFile() {
 void MainDialog::flashingDone(QString msg, bool success) {
   Q_UNUSED(msg);
   ui_.progressBar->hide();
+  ui_.progressBar->setFormat("%p%");
   if (scroll_after_flashing_) {
     auto *scroll = ui_.terminal->verticalScrollBar();
     scroll->setValue(scroll->maximum());
@@ -642,6 +674,20 @@ void MainDialog::downloadAndFlashFirmware(const QString &url) {
             &MainDialog::downloadFinished);
   }
   fd_->start();
+  // Get the device ready in the meantime, if it is not in use. Errors are
+  // left for flashing to report.
+  if (prevState_ == State::Connected && preparedFlasher_ == nullptr) {
+    if (hal_ == nullptr) createHAL();
+    auto fr = startFlasherThread();
+    if (fr.ok()) {
+      preparedFlasher_ = fr.ValueOrDie();
+#if (QT_VERSION < QT_VERSION_CHECK(5, 4, 0))
+      QTimer::singleShot(0, preparedFlasher_, SLOT(prepare()));
+#else
+      QTimer::singleShot(0, preparedFlasher_, &Flasher::prepare);
+#endif
+    }
+  }
 }
 
 void MainDialog::downloadProgress(qint64 recd, qint64 total) {
@@ -660,22 +706,50 @@ void MainDialog::downloadFinished() {
   ui_.progressBar->setValue(0);
   ui_.progressBar->hide();
   setState(prevState_);
-  if (fd_->status().ok()) flashFirmware(fd_->fileName());
+  if (fd_->status().ok()) {
+    flashFirmware(fd_->fileName());
+  } else if (preparedFlasher_ != nullptr) {
+    releaseFlasher(preparedFlasher_);
+    preparedFlasher_ = nullptr;
+  }
 }
 
 void MainDialog::flashFirmware(const QString &file) {
+  // Flasher that has been connecting to the device during the download.
+  Flasher *f = preparedFlasher_;
+  preparedFlasher_ = nullptr;
+  util::Status s;
+  if (f == nullptr) {
+    if (state_ == State::Terminal) disconnectTerminal();
+    s = openSerial();
+    if (!s.ok()) {
+      setStatusMessage(MsgType::ERROR, s.ToString().c_str());
+      return;
+    }
+    if (state_ != State::Connected) {
+      setStatusMessage(MsgType::ERROR, tr("port is not connected"));
+      return;
+    }
+    // The device is connected to while the bundle is loaded and hashed.
+    // HAL of the port is kept between runs, and so is its ROM session.
+    if (hal_ == nullptr) createHAL();
+    auto fr = startFlasherThread();
+    if (!fr.ok()) {
+      setStatusMessage(MsgType::ERROR,
+                       tr("Invalid command line flag setting: ") +
+                           fr.status().ToString().c_str());
+      return;
+    }
+    f = fr.ValueOrDie();
+#if (QT_VERSION < QT_VERSION_CHECK(5, 4, 0))
+    QTimer::singleShot(0, f, SLOT(prepare()));
+#else
+    QTimer::singleShot(0, f, &Flasher::prepare);
+#endif
+  }
   if (!loadFirmwareBundle(file).ok()) {
     // Error already shown by loadFirmwareBundle.
-    return;
-  }
-  if (state_ == State::Terminal) disconnectTerminal();
-  util::Status s = openSerial();
-  if (!s.ok()) {
-    setStatusMessage(MsgType::ERROR, s.ToString().c_str());
-    return;
-  }
-  if (state_ != State::Connected) {
-    setStatusMessage(MsgType::ERROR, tr("port is not connected"));
+    releaseFlasher(f);
     return;
   }
   setState(State::Flashing);
@@ -684,23 +758,34 @@ void MainDialog::flashFirmware(const QString &file) {
   auto *scroll = ui_.terminal->verticalScrollBar();
   scroll_after_flashing_ = scroll->value() == scroll->maximum();
 
-  if (hal_ == nullptr) createHAL();
-  std::unique_ptr<Flasher> f(hal_->flasher(&prompter_));
-  s = f->setOptionsFromConfig(*config_);
-  if (!s.ok()) {
-    setStatusMessage(MsgType::ERROR, tr("Invalid command line flag setting: ") +
-                                         s.ToString().c_str());
-    return;
-  }
   s = f->setFirmware(fw_.get());
   if (!s.ok()) {
+    releaseFlasher(f);
     setStatusMessage(MsgType::ERROR, s.ToString().c_str());
     return;
   }
   ui_.progressBar->show();
   ui_.progressBar->setRange(0, f->totalBytes());
-  connect(f.get(), &Flasher::progress, ui_.progressBar,
-          &QProgressBar::setValue);
+  connect(f, &Flasher::progress, ui_.progressBar, &QProgressBar::setValue);
+  connect(f, &Flasher::progressRate, this, [this](int bytesPerSec, int etaMs) {
+    Q_UNUSED(bytesPerSec);
+    ui_.progressBar->setFormat(
+        etaMs < 0 ? QString("%p%")
+                  : tr("%p% (%1 s left)").arg((etaMs + 999) / 1000));
+  });
+  connect(f, &Flasher::done, this, &MainDialog::flashingDone);
+  connect(f, &Flasher::done, worker_.get(), &QThread::quit);
+#if (QT_VERSION < QT_VERSION_CHECK(5, 4, 0))
+  QTimer::singleShot(0, f, SLOT(run()));
+#else
+  QTimer::singleShot(0, f, &Flasher::run);
+#endif
+}
+
+util::StatusOr<Flasher *> MainDialog::startFlasherThread() {
+  std::unique_ptr<Flasher> f(hal_->flasher(&prompter_));
+  util::Status s = f->setOptionsFromConfig(*config_);
+  if (!s.ok()) return s;
   connect(f.get(), &Flasher::done,
           [this]() { serial_port_->moveToThread(this->thread()); });
   connect(f.get(), &Flasher::statusMessage,
@@ -708,19 +793,24 @@ void MainDialog::flashFirmware(const QString &file) {
             setStatusMessage(MsgType::INFO, msg);
             (void) important;
           });
-  connect(f.get(), &Flasher::done, this, &MainDialog::flashingDone);
 
   worker_.reset(new QThread);  // TODO(imax): handle already running thread?
   connect(worker_.get(), &QThread::finished, f.get(), &QObject::deleteLater);
-  connect(f.get(), &Flasher::done, worker_.get(), &QThread::quit);
   f->moveToThread(worker_.get());
   serial_port_->moveToThread(worker_.get());
   worker_->start();
-#if (QT_VERSION < QT_VERSION_CHECK(5, 4, 0))
-  QTimer::singleShot(0, f.release(), SLOT(run()));
-#else
-  QTimer::singleShot(0, f.release(), &Flasher::run);
-#endif
+  return f.release();
+}
+
+void MainDialog::releaseFlasher(Flasher *f) {
+  // Runs after prepare(), if it was started. The device is let go of and the
+  // port given back from the thread it is in.
+  QThread *worker = worker_.get();
+  QTimer::singleShot(0, f, [this, f, worker]() {
+    f->release();
+    serial_port_->moveToThread(this->thread());
+    worker->quit();
+  });
 }
 
 void MainDialog::showAboutBox() {
@@ -890,15 +980,24 @@ void MainDialog::showSettings() {
 }
 
 util::Status MainDialog::loadFirmwareBundle(const QString &fileName) {
-  auto fwbs = NewZipFWBundle(fileName);
-  if (!fwbs.ok()) {
-    setStatusMessage(MsgType::ERROR,
-                     tr("Failed to load %1: %2")
-                         .arg(fileName)
-                         .arg(fwbs.status().ToString().c_str()));
-    return QS(util::error::INVALID_ARGUMENT, "");
+  const QFileInfo fi(fileName);
+  FirmwareBundle *fwb = fw_.get();
+  std::unique_ptr<FirmwareBundle> loaded;
+  if (fwb != nullptr && fi.canonicalFilePath() == fwFile_ &&
+      fi.lastModified() == fwFileModified_ && fi.size() == fwFileSize_) {
+    qInfo() << fileName << "has not changed, reusing the bundle";
+  } else {
+    auto fwbs = NewZipFWBundle(fileName);
+    if (!fwbs.ok()) {
+      setStatusMessage(MsgType::ERROR,
+                       tr("Failed to load %1: %2")
+                           .arg(fileName)
+                           .arg(fwbs.status().ToString().c_str()));
+      return QS(util::error::INVALID_ARGUMENT, "");
+    }
+    loaded = fwbs.MoveValueOrDie();
+    fwb = loaded.get();
   }
-  std::unique_ptr<FirmwareBundle> fwb = fwbs.MoveValueOrDie();
   if (fwb->platform().toUpper() !=
       ui_.platformSelector->currentText().toUpper()) {
     setStatusMessage(MsgType::ERROR,
@@ -911,7 +1010,12 @@ util::Status MainDialog::loadFirmwareBundle(const QString &fileName) {
                                       .arg(fwb->name())
                                       .arg(fwb->platform().toUpper())
                                       .arg(fwb->buildId()));
-  fw_ = std::move(fwb);
+  if (loaded != nullptr) {
+    fw_ = std::move(loaded);
+    fwFile_ = fi.canonicalFilePath();
+    fwFileModified_ = fi.lastModified();
+    fwFileSize_ = fi.size();
+  }
   settings_.setValue(
       QString("selectedFirmware_%1").arg(ui_.platformSelector->currentText()),
       ui_.firmwareFileName->text());
@@ -924,13 +1028,13 @@ void MainDialog::openConsoleLogFile(bool truncate) {
     ui_.actionTruncate_log_file->setEnabled(true);
     if (console_log_ == nullptr ||
         console_log_->fileName() != config_->value("console-log")) {
-      console_log_.reset(new QFile(config_->value("console-log")));
-      if (!console_log_->open(
-              QIODevice::ReadWrite |
-              (truncate ? QIODevice::Truncate : QIODevice::Append))) {
+      console_log_.reset();
+      auto r = ConsoleLog::fromConfig(*config_, truncate);
+      if (!r.ok()) {
         qCritical() << "Failed to open console log file:"
-                    << console_log_->errorString();
-        console_log_->reset();
+                    << r.status().ToString().c_str();
+      } else {
+        console_log_.reset(r.ValueOrDie());
       }
     }
   } else {
@@ -976,6 +1080,11 @@ void MainDialog::updateConfig(const QString &name) {
           << std::endl;
       Log::setFile(logfile);
     }
+  } else if ((name == "console-log-timestamps" ||
+              name == "console-log-max-size") &&
+             console_log_ != nullptr) {
+    console_log_.reset();  // Reopened with the new settings.
+    openConsoleLogFile(false /* truncate */);
   } else if (name == "console-line-count") {
     bool ok = false;
     int n = config_->value("console-line-count").toInt(&ok);
@@ -8,6 +8,8 @@
 
 #include <memory>
 
+#include <QByteArray>
+#include <QDateTime>
 #include <QDir>
 #include <QFile>
 #include <QList>
@@ -21,15 +23,18 @@
 #include <QString>
 #include <QStringList>
 #include <QThread>
+#include <QTimer>
 
 #include <common/util/statusor.h>
 
 #include "about_dialog.h"
+#include "console_log.h"
 #include "file_downloader.h"
 #include "fw_bundle.h"
 #include "gui_prompter.h"
 #include "hal.h"
 #include "log_viewer.h"
+#include "port_watcher.h"
 #include "prompter.h"
 #include "settings.h"
 #include "ui_main.h"
@@ -73,6 +78,8 @@ class MainDialog : public QMainWindow {
   void flashingDone(QString msg, bool success);
   util::Status disconnectTerminal();
   void readSerial();
+  // Shows serial data received since the last call in the console.
+  void flushConsole();
   void writeSerial();
   void reboot();
   void configureWiFi();
@@ -116,6 +123,12 @@ signals:
   void createHAL();
   void downloadAndFlashFirmware(const QString &url);
   void flashFirmware(const QString &file);
+  // Creates a flasher and starts a thread for it.
+  util::StatusOr<Flasher *> startFlasherThread();
+  // Stops the thread of a flasher that is not going to be run.
+  void releaseFlasher(Flasher *f);
+  // Keeps the bundle loaded last if the file has not changed since, so
+  // reflashing it does not redo the loading, verification and hashing.
   util::Status loadFirmwareBundle(const QString &fileName);
   void openConsoleLogFile(bool truncate);
   static QString stateToString(MainDialog::State s);
@@ -123,11 +136,17 @@ signals:
   Config *config_ = nullptr;
   bool skip_detect_warning_ = false;
   std::unique_ptr<QThread> worker_;
+  // Connects to the device while the firmware is being downloaded or loaded.
+  Flasher *preparedFlasher_ = nullptr;
   std::unique_ptr<FirmwareBundle> fw_;
+  // What fw_ was loaded from.
+  QString fwFile_;
+  QDateTime fwFileModified_;
+  qint64 fwFileSize_ = -1;
   std::unique_ptr<QSerialPort> serial_port_;
   QMultiMap<QWidget *, State> enabled_in_state_;
   QMultiMap<QAction *, State> action_enabled_in_state_;
-  QTimer *refresh_timer_;
+  PortWatcher *port_watcher_;
   QStringList input_history_;
   QString incomplete_input_;
   int history_cursor_ = -1;
@@ -135,7 +154,11 @@ signals:
   QStringList command_queue_;
   std::unique_ptr<HAL> hal_;
   bool scroll_after_flashing_ = false;
-  std::unique_ptr<QFile> console_log_;
+  std::unique_ptr<ConsoleLog> console_log_;
+  QByteArray console_pending_;  // Not shown in the console yet.
+  int console_dropped_ = 0;
+  QByteArray console_last_byte_;
+  QTimer console_flush_timer_;
   GUIPrompter prompter_;
   SettingsDialog settingsDlg_;
   std::unique_ptr<AboutDialog> aboutBox_;
@@ -1,5 +1,7 @@
 #include "esp8266.h"
 
+#include <algorithm>
+#include <functional>
 #include <iostream>
 #include <map>
 #include <memory>
@@ -9,24 +11,38 @@
 #include <QCryptographicHash>
 #include <QDataStream>
 #include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
 #include <QtDebug>
 #include <QIODevice>
 #include <QMutex>
 #include <QMutexLocker>
 #include <QSerialPort>
+#include <QSaveFile>
 #include <QSerialPortInfo>
+#include <QSettings>
 #include <QStringList>
 #include <QTextStream>
 #include <QThread>
+#include <QtConcurrent>
 
 #include <common/util/error_codes.h>
 #include <common/util/statusor.h>
 
 #include "config.h"
+#include "esp_erase_model.h"
+#include "esp_flash_cache.h"
+#include "esp_flash_index.h"
+#include "esp_flash_journal.h"
 #include "esp_flasher_client.h"
 #include "esp_rom_client.h"
+#include "flash_span.h"
 #include "fs.h"
+#include "fw_bundle.h"
+#include "fw_delta.h"
+#include "latency_histogram.h"
 #include "serial.h"
+#include "serial_profile.h"
 #include "status_qt.h"
 
 #if (QT_VERSION < QT_VERSION_CHECK(5, 5, 0))
@@ -38,6 +54,7 @@ namespace ESP8266 {
 namespace {
 
 const char kFlashEraseChipOption[] = "esp8266-flash-erase-chip";
+const char kFlashEraseOption[] = "esp8266-flash-erase";
 const char kFlashParamsOption[] = "esp8266-flash-params";
 const char kFlashSizeOption[] = "esp8266-flash-size";
 const char kFlashingDataPortOption[] = "esp8266-flashing-data-port";
@@ -46,12 +63,83 @@ const char kDefaultSPIFFSOffset[] = "0xec000";
 const char kSPIFFSSizeOption[] = "esp8266-spiffs-size";
 const char kDefaultSPIFFSSize[] = "65536";
 const char kNoMinimizeWritesOption[] = "esp8266-no-minimize-writes";
+const char kFlashBaudRateAutoOption[] = "esp8266-flash-baud-rate-auto";
+const char kFlashVerifyOption[] = "esp8266-flash-verify";
+const char kFlashCacheOption[] = "esp8266-flash-cache";
+const char kCompactFSOption[] = "esp8266-compact-fs";
+const char kFlashBackupOption[] = "esp8266-backup-flash";
+const char kFlashRestoreOption[] = "esp8266-restore-flash";
+const char kSerialProfilesOption[] = "esp8266-serial-profiles";
+const char kFlashPatchOption[] = "esp8266-flash-patch";
 
 const int kDefaultROMBaudRate = 115200;
 const int kDefaultFlashBaudRate = 230400;
+// Candidates for automatic baud rate selection, tried in ascending order.
+const qint32 kAutoFlashBaudRates[] = {230400, 460800, 921600, 1500000,
+                                      2000000};
 /* Last 16K of flash are reserved for system params. */
 const quint32 kSystemParamsAreaSize = 16 * 1024;
 const char kSystemParamsPartType[] = "sys_params";
+// Manifest attribute with the address of the sector reserved for
+// ESPFlashIndex, if the firmware has one.
+const char kFlashIndexAddrAttr[] = "flash_index_addr";
+// Part attribute: if true, the part replaces bytes at its address and the
+// rest of the sectors it is in stays as it is, instead of being padded with
+// 0xFF to whole sectors. Meant for small per-device data.
+const char kPatchAttr[] = "patch";
+
+const char kLinkSettingsGroup[] = "esp8266/link";
+// Writes shorter than this say more about latency than about throughput.
+const quint64 kMinWriteRateSampleBytes = 65536;
+// Weight of a new sample in the average.
+const double kWriteRateSampleWeight = 0.3;
+// Command round trip assumed until one has been timed, mostly the latency
+// timer of the USB serial adapter.
+const qint64 kDefaultRoundTripUs = 8000;
+
+// Flash write throughput measured at a baud rate in earlier runs, bytes per
+// second of data before compression. 0 if there are no measurements.
+qint64 measuredWriteRate(qint32 baudRate) {
+  QSettings settings;
+  settings.beginGroup(kLinkSettingsGroup);
+  return settings.value(QString("writeRate%1").arg(baudRate), 0).toLongLong();
+}
+
+// Parses ADDR:FILE[,ADDR:FILE...] of kFlashPatchOption and reads the files.
+util::StatusOr<QMap<quint32, QByteArray>> parsePatchOption(
+    const QString &value) {
+  QMap<quint32, QByteArray> result;
+  for (const QString &entry : value.split(',', QString::SkipEmptyParts)) {
+    const int sep = entry.indexOf(':');
+    bool ok = false;
+    const quint32 addr = entry.left(sep).toUInt(&ok, 0);
+    if (sep <= 0 || !ok) {
+      return QS(util::error::INVALID_ARGUMENT,
+                QObject::tr("%1 is not ADDR:FILE").arg(entry));
+    }
+    QFile f(entry.mid(sep + 1));
+    if (!f.open(QIODevice::ReadOnly)) {
+      return QS(util::error::INVALID_ARGUMENT,
+                QObject::tr("failed to open %1: %2")
+                    .arg(f.fileName())
+                    .arg(f.errorString()));
+    }
+    result[addr] = f.readAll();
+  }
+  return result;
+}
+
+void addWriteRateSample(qint32 baudRate, quint64 bytes, qint64 ms) {
+  if (bytes < kMinWriteRateSampleBytes || ms <= 0) return;
+  const double sample = double(bytes) * 1000 / ms;
+  const qint64 avg = measuredWriteRate(baudRate);
+  QSettings settings;
+  settings.beginGroup(kLinkSettingsGroup);
+  settings.setValue(QString("writeRate%1").arg(baudRate),
+                    qint64(avg == 0 ? sample
+                                    : avg * (1 - kWriteRateSampleWeight) +
+                                          sample * kWriteRateSampleWeight));
+}
 
 #define FLASHING_MSG                                             \
   "Failed to talk to bootloader. See <a "                        \
@@ -61,11 +149,66 @@ const char kSystemParamsPartType[] = "sys_params";
   "(GPIO0 = 0, reset) manually and "                             \
   "retry now."
 
+// Connection to the ROM shared by the HAL and its flashers. Connecting
+// involves resetting the device, so the connection is kept between operations
+// until the device leaves the ROM or the session is released.
+class ROMSession {
+ public:
+  ROMSession(QIODevice *port) : rom_(port, port) {
+  }
+
+  // Returns a connected client, reusing the existing connection if the ROM
+  // still responds.
+  util::StatusOr<ESPROMClient *> connect() {
+    QMutexLocker lock(&lock_);
+    if (rom_.connected()) {
+      if (rom_.sync(100).ok()) {
+        qDebug() << "Reusing ROM connection";
+        return &rom_;
+      }
+      qInfo() << "ROM connection lost, reconnecting";
+    }
+    util::Status st = rom_.connect();
+    if (!st.ok()) return st;
+    return &rom_;
+  }
+
+  // Device is no longer running the ROM (e.g. has been rebooted).
+  void invalidate() {
+    QMutexLocker lock(&lock_);
+    rom_.disconnect();
+  }
+
+  CommandLatencies takeLatencies() {
+    QMutexLocker lock(&lock_);
+    return rom_.takeLatencies();
+  }
+
+  // Lets the device boot firmware, if it's still in the ROM.
+  void release() {
+    QMutexLocker lock(&lock_);
+    if (rom_.connected()) {
+      rom_.softReset();
+      rom_.disconnect();
+    }
+  }
+
+ private:
+  QMutex lock_;
+  ESPROMClient rom_;
+};
+
 class FlasherImpl : public Flasher {
   Q_OBJECT
  public:
-  FlasherImpl(QSerialPort *port, Prompter *prompter)
-      : port_(port), prompter_(prompter) {
+  FlasherImpl(QIODevice *port, Prompter *prompter,
+              std::shared_ptr<ROMSession> session)
+      : port_(port), prompter_(prompter), session_(session) {
+  }
+
+  ~FlasherImpl() override {
+    // Prepared but never run, the device is left in the stub.
+    if (prepared_) session_->invalidate();
   }
 
   util::Status setOption(const QString &name, const QVariant &value) override {
@@ -114,6 +257,7 @@ class FlasherImpl : public Flasher {
                             "value must be a positive integer");
       }
       flashing_speed_ = value.toInt();
+      flashing_speed_set_ = flashing_speed_ > 0;
       if (flashing_speed_ <= 0) {
         flashing_speed_ = kDefaultFlashBaudRate;
       }
@@ -146,6 +290,110 @@ class FlasherImpl : public Flasher {
       }
       minimize_writes_ = !value.toBool();
       return util::Status::OK;
+    } else if (name == kFlashBaudRateAutoOption) {
+      if (value.type() != QVariant::Bool) {
+        return util::Status(util::error::INVALID_ARGUMENT,
+                            "value must be boolean");
+      }
+      flashing_speed_auto_ = value.toBool();
+      return util::Status::OK;
+    } else if (name == kCompactFSOption) {
+      if (value.type() != QVariant::Bool) {
+        return util::Status(util::error::INVALID_ARGUMENT,
+                            "value must be boolean");
+      }
+      compact_fs_ = value.toBool();
+      return util::Status::OK;
+    } else if (name == kFlashCacheOption) {
+      if (value.type() != QVariant::Bool) {
+        return util::Status(util::error::INVALID_ARGUMENT,
+                            "value must be boolean");
+      }
+      use_flash_cache_ = value.toBool();
+      return util::Status::OK;
+    } else if (name == kFlashEraseOption) {
+      const QString v = value.toString();
+      if (v == "auto") {
+        erase_mode_ = EraseMode::Auto;
+      } else if (v == "inline") {
+        erase_mode_ = EraseMode::Inline;
+      } else if (v == "chip") {
+        erase_mode_ = EraseMode::Chip;
+      } else if (v == "blocks") {
+        erase_mode_ = EraseMode::Blocks;
+      } else if (v == "sectors") {
+        erase_mode_ = EraseMode::Sectors;
+      } else {
+        return util::Status(
+            util::error::INVALID_ARGUMENT,
+            "value must be one of: auto, inline, chip, blocks, sectors");
+      }
+      return util::Status::OK;
+    } else if (name == kFlashVerifyOption) {
+      const QString v = value.toString();
+      if (v == "full") {
+        verify_mode_ = VerifyMode::Full;
+      } else if (v == "unwritten") {
+        verify_mode_ = VerifyMode::Unwritten;
+      } else if (v == "none") {
+        verify_mode_ = VerifyMode::None;
+      } else {
+        return util::Status(util::error::INVALID_ARGUMENT,
+                            "value must be one of: full, unwritten, none");
+      }
+      return util::Status::OK;
+    } else if (name == kFlashBackupOption) {
+      if (value.type() != QVariant::String) {
+        return util::Status(util::error::INVALID_ARGUMENT,
+                            "value must be a string");
+      }
+      backup_filename_ = value.toString();
+      return util::Status::OK;
+    } else if (name == kSerialProfilesOption) {
+      if (value.type() != QVariant::String) {
+        return util::Status(util::error::INVALID_ARGUMENT,
+                            "value must be a string");
+      }
+      auto res = parseSerialProfiles(value.toString());
+      if (!res.ok()) return res.status();
+      serial_profiles_ = res.ValueOrDie();
+      return util::Status::OK;
+    } else if (name == kFlashRestoreOption) {
+      if (value.type() != QVariant::String) {
+        return util::Status(util::error::INVALID_ARGUMENT,
+                            "value must be a string");
+      }
+      QFile f(value.toString());
+      if (!f.open(QIODevice::ReadOnly)) {
+        return QS(util::error::INVALID_ARGUMENT,
+                  tr("failed to open %1: %2")
+                      .arg(value.toString())
+                      .arg(f.errorString()));
+      }
+      QMutexLocker lock(&lock_);
+      images_.clear();
+      images_[0] = {.addr = 0, .data = f.readAll(), .attrs = {}};
+      images_[0].digests = FirmwareBundle::computeDigests(
+          images_[0].data, ESPFlasherClient::kFlashSectorSize);
+      restore_ = true;
+      return util::Status::OK;
+    } else if (name == kPlanOption) {
+      if (value.type() != QVariant::Bool) {
+        return util::Status(util::error::INVALID_ARGUMENT,
+                            "value must be boolean");
+      }
+      plan_only_ = value.toBool();
+      return util::Status::OK;
+    } else if (name == kFlashPatchOption) {
+      if (value.type() != QVariant::String) {
+        return util::Status(util::error::INVALID_ARGUMENT,
+                            "value must be a string");
+      }
+      auto res = parsePatchOption(value.toString());
+      if (!res.ok()) return res.status();
+      QMutexLocker lock(&lock_);
+      option_patches_ = res.ValueOrDie();
+      return util::Status::OK;
     } else {
       return util::Status(util::error::INVALID_ARGUMENT, "unknown option");
     }
@@ -154,8 +402,9 @@ class FlasherImpl : public Flasher {
   util::Status setOptionsFromConfig(const Config &config) override {
     util::Status r;
 
-    QStringList boolOpts(
-        {kMergeFSOption, kNoMinimizeWritesOption, kFlashEraseChipOption});
+    QStringList boolOpts({kMergeFSOption, kNoMinimizeWritesOption,
+                          kFlashEraseChipOption, kFlashBaudRateAutoOption,
+                          kFlashCacheOption, kCompactFSOption, kPlanOption});
     for (const auto &opt : boolOpts) {
       auto s = setOption(opt, config.boolValue(opt));
       if (!s.ok()) {
@@ -166,7 +415,10 @@ class FlasherImpl : public Flasher {
     }
 
     QStringList stringOpts({kFlashSizeOption, kFlashParamsOption,
-                            kFlashingDataPortOption, kDumpFSOption});
+                            kFlashingDataPortOption, kDumpFSOption,
+                            kFlashVerifyOption, kFlashBackupOption,
+                            kFlashRestoreOption, kFlashEraseOption,
+                            kSerialProfilesOption, kFlashPatchOption});
     for (const auto &opt : stringOpts) {
       // XXX: currently there's no way to "unset" a string option.
       if (config.isSet(opt)) {
@@ -198,8 +450,16 @@ class FlasherImpl : public Flasher {
     return util::Status::OK;
   }
 
-  util::Status setFirmware(FirmwareBundle *fw) override {
+  util::Status setFirmware(const FirmwareBundle *fw) override {
     QMutexLocker lock(&lock_);
+    if (restore_ || !backup_filename_.isEmpty()) {
+      return QS(util::error::FAILED_PRECONDITION,
+                tr("cannot flash firmware and back up or restore at once"));
+    }
+    // Extracts and checks all the parts at once.
+    util::Status vst = fw->verifyAll();
+    if (!vst.ok()) return QSP(tr("invalid firmware bundle"), vst);
+    bundle_patches_.clear();
     for (const auto &p : fw->parts()) {
       if (!p.attrs["addr"].isValid()) {
         return QS(util::error::INVALID_ARGUMENT,
@@ -217,18 +477,75 @@ class FlasherImpl : public Flasher {
       if (!data.ok()) return data.status();
       qInfo() << p.name << ":" << data.ValueOrDie().length() << "@" << hex
               << showbase << addr;
+      if (p.attrs[kPatchAttr].toBool()) {
+        bundle_patches_[addr] = data.ValueOrDie();
+        continue;
+      }
+      if (p.attrs.contains(kDeltaBaseAttr)) {
+        auto dr = parseDelta(data.ValueOrDie(), p.attrs);
+        if (!dr.ok()) {
+          return QSP(QObject::tr("part %1 is not a valid delta").arg(p.name),
+                     dr.status());
+        }
+        deltas_[addr] = dr.ValueOrDie();
+        continue;
+      }
       images_[addr] = {
           .addr = addr, .data = data.ValueOrDie(), .attrs = p.attrs};
+      // Hashed now, in parallel, so dedup and verify do not have to do it on
+      // the thread that talks to the device.
+      auto dr = fw->getPartDigests(p.name, ESPFlasherClient::kFlashSectorSize);
+      if (dr.ok()) images_[addr].digests = dr.ValueOrDie();
+    }
+    build_id_ = fw->buildId();
+    flash_index_addr_ = -1;
+    const QString fia = fw->getAttr(kFlashIndexAddrAttr);
+    if (!fia.isEmpty()) {
+      bool ok;
+      const quint32 addr = fia.toUInt(&ok, 0);
+      const quint32 ss = ESPFlasherClient::kFlashSectorSize;
+      if (!ok || addr % ss != 0) {
+        return QS(util::error::INVALID_ARGUMENT,
+                  tr("invalid %1: %2").arg(kFlashIndexAddrAttr).arg(fia));
+      }
+      for (const Image &image : images_) {
+        if (addr < image.addr + image.data.length() && image.addr < addr + ss) {
+          return QS(util::error::INVALID_ARGUMENT,
+                    tr("flash index @ 0x%1 overlaps image @ 0x%2")
+                        .arg(addr, 0, 16)
+                        .arg(image.addr, 0, 16));
+        }
+      }
+      flash_index_addr_ = addr;
+    }
+    // Files on the device are compared with this when merging.
+    fs_manifest_ = util::StatusOr<FileManifest>();
+    if (merge_flash_filesystem_ && images_.contains(spiffs_offset_)) {
+      SPIFFS fs(images_[spiffs_offset_].data);
+      fs_manifest_ = fs.manifest();
+      if (!fs_manifest_.ok()) {
+        qWarning() << "Failed to list SPIFFS image files:"
+                   << fs_manifest_.status();
+      }
     }
     return util::Status::OK;
   }
 
   int totalBytes() const override {
     QMutexLocker lock(&lock_);
+    return totalBytesLocked();
+  }
+
+  int totalBytesLocked() const {
+    // Size of the backup is not known until the flash is detected.
+    if (!backup_filename_.isEmpty()) return flashSize_;
     int r = 0;
     for (const auto &image : images_.values()) {
       r += image.data.length();
     }
+    for (const auto &delta : deltas_.values()) {
+      for (const auto &patch : delta.patches) r += patch.length();
+    }
     // Add FS once again for reading.
     if (merge_flash_filesystem_ && images_.contains(spiffs_offset_)) {
       r += images_[spiffs_offset_].data.length();
@@ -270,10 +587,64 @@ class FlasherImpl : public Flasher {
     return std::move(second_port);
   }
 
+  void prepare() override {
+    QMutexLocker lock(&prepare_lock_);
+    if (prepared_) return;
+    startMetrics();
+    prepare_status_ = prepareLocked();
+    endPhase();
+    prepared_ = true;
+  }
+
+  void release() override {
+    QMutexLocker plock(&prepare_lock_);
+    if (!prepared_) return;
+    // The stub may be running at the flashing rate even if prepare failed.
+    if (flasher_client_ != nullptr) {
+      util::Status st = flasher_client_->bootFirmware();
+      if (!st.ok()) qWarning() << "Failed to boot firmware:" << st;
+      flasher_client_->disconnect();
+    }
+    if (prepare_status_.ok()) rom_->rebootIntoFirmware();
+    session_->invalidate();
+    flasher_client_.reset();
+    own_rom_.reset();
+    data_port_.reset();
+    prepared_ = false;
+  }
+
   void run() override {
     QMutexLocker lock(&lock_);
+    QMutexLocker plock(&prepare_lock_);
 
-    util::Status st = runLocked();
+    util::Status st;
+    if (images_.empty() && deltas_.empty() && backup_filename_.isEmpty()) {
+      st = QS(util::error::FAILED_PRECONDITION, tr("No firmware loaded"));
+    } else {
+      if (!prepared_) {
+        startMetrics();
+        prepare_status_ = prepareLocked();
+      }
+      st = prepare_status_.ok() ? runLocked() : prepare_status_;
+    }
+    endPhase();
+    CommandLatencies latencies = session_->takeLatencies();
+    if (own_rom_ != nullptr) latencies.merge(own_rom_->takeLatencies());
+    if (flasher_client_ != nullptr) {
+      latencies.merge(flasher_client_->takeLatencies());
+    }
+    if (!latencies.isEmpty()) metrics_["latency"] = latencies.toVariant();
+    // Whatever happened, the device is not in the ROM anymore.
+    session_->invalidate();
+    flasher_client_.reset();
+    own_rom_.reset();
+    data_port_.reset();
+    prepared_ = false;
+    metrics_["phases"] = phases_;
+    metrics_["total_ms"] = run_timer_.elapsed();
+    metrics_["ok"] = st.ok();
+    flushProgress();
+    emit metrics(metrics_);
     if (!st.ok()) {
       emit done(QString::fromStdString(st.error_message()), false);
       return;
@@ -286,28 +657,79 @@ class FlasherImpl : public Flasher {
     ulong addr;
     QByteArray data;
     QMap<QString, QVariant> attrs;
+    // Host digests of data by flash sector, made when the firmware was set.
+    // Images derived from this one keep them, digestsOf() checks they apply.
+    std::shared_ptr<const FirmwareBundle::Digests> digests;
   };
 
-  util::Status runLocked() {
-    if (images_.empty()) {
-      return QS(util::error::FAILED_PRECONDITION, tr("No firmware loaded"));
-    }
-    progress_ = 0;
-    emit progress(progress_);
+  // What the run does to flash, worked out before anything there is changed.
+  // runLocked executes it, with kPlanOption it is only reported.
+  struct WritePlan {
+    // Images to write, what is left after resuming or deduping.
+    QMap<ulong, Image> images;
+    // What gets sent, address -> data padded to sectors. With a single
+    // session for all the images, they are split at block boundaries.
+    QMap<quint32, FlashSpan> regions;
+    // Sizes before padding, used for progress reporting.
+    QMap<quint32, int> origLengths;
+    quint64 writeBytes = 0;
+    // Inline means the stub erases sectors as it writes them.
+    bool eraseInline = false;
+    // With inline erase, the stub may also compare sectors with their data
+    // and leave the ones that are the same alone. Catches scattered sectors
+    // that deduping does not split images for.
+    bool changedOnly = false;
+    ESPEraseModel::Method eraseMethod = ESPEraseModel::Method::Blocks;
+    // Address -> length. For inline erase, the sectors written.
+    QMap<quint32, quint32> erase;
+    // Sectors that images only have 0xFF for are erased, not written. With
+    // inline erase they have to be erased separately, address -> length.
+    QMap<quint32, quint32> eraseOnly;
+    // 0xFF that is not sent: blank sectors and trailing bytes.
+    quint64 blankBytes = 0;
+    int eraseOps = 0;
+    qint64 eraseMs = 0;
+    qint64 writeMs = 0;
+  };
+
+  void startMetrics() {
+    run_timer_.start();
+    metrics_.clear();
+    phases_.clear();
+    // Left from probes and earlier runs.
+    session_->takeLatencies();
+  }
 
+  // Everything that does not depend on the firmware: gets the stub running
+  // and detects the flash. Leaves the connection in flasher_client_.
+  util::Status prepareLocked() {
     auto fdps = getFlashingDataPort();
     if (!fdps.ok()) {
       return QSP("failed to open flashing data port", fdps.status());
     }
+    data_port_ = fdps.MoveValueOrDie();
 
-    ESPROMClient rom(port_,
-                     fdps.ValueOrDie().get() ? fdps.ValueOrDie().get() : port_);
+    // Connection of the HAL session is reused, unless a separate data port is
+    // used.
+    if (data_port_ != nullptr) {
+      own_rom_.reset(new ESPROMClient(port_, data_port_.get()));
+    }
 
     emit statusMessage("Connecting to ROM...", true);
 
+    beginPhase("connect");
     util::Status st;
+    ESPROMClient *romp = nullptr;
+    int connectRetries = 0;
     while (true) {
-      st = rom.connect();
+      if (own_rom_ != nullptr) {
+        st = own_rom_->connect();
+        if (st.ok()) romp = own_rom_.get();
+      } else {
+        auto rr = session_->connect();
+        st = rr.status();
+        if (st.ok()) romp = rr.ValueOrDie();
+      }
       if (st.ok()) break;
       qCritical() << st;
       QString msg = tr(FLASHING_MSG "\n\nError: %1")
@@ -319,22 +741,78 @@ class FlasherImpl : public Flasher {
         return util::Status(util::error::UNAVAILABLE,
                             "Failed to talk to bootloader.");
       }
+      metrics_["connect_retries"] = ++connectRetries;
+    }
+    ESPROMClient &rom = *romp;
+
+    // Identifies the device to the flash cache and the journal and, through
+    // metrics, to whoever registers it once it is flashed.
+    mac_.clear();
+    auto mr = rom.readMAC();
+    if (mr.ok()) {
+      mac_ = mr.ValueOrDie();
+      metrics_["mac"] = QString::fromLatin1(mac_.toHex());
+    } else {
+      qWarning() << "Failed to read MAC:" << mr.status();
     }
 
-    emit statusMessage(tr("Running flasher @ %1...").arg(flashing_speed_),
+    const SerialProfile profile =
+        serialProfile(rom.data_port(), serial_profiles_);
+    qInfo() << "Serial adapter profile:" << profile.toString();
+    metrics_["serial_profile"] = profile.name;
+    int flashing_speed = flashing_speed_;
+    if (!flashing_speed_set_ && profile.flashBaudRate > 0) {
+      flashing_speed = profile.flashBaudRate;
+    }
+    if (profile.latencyTimerMs >= 0) {
+      const int latency =
+          setLatencyTimer(rom.data_port(), profile.latencyTimerMs);
+      if (latency >= 0) metrics_["latency_timer_ms"] = latency;
+    }
+
+    emit statusMessage(tr("Running flasher @ %1...").arg(flashing_speed),
                        true);
 
-    ESPFlasherClient flasher_client(&rom);
+    flasher_client_.reset(new ESPFlasherClient(&rom));
+    ESPFlasherClient &flasher_client = *flasher_client_;
+    flasher_client.setMaxWriteWindow(profile.writeWindow);
+    if (profile.readBlockSize > 0 && profile.readMaxInFlight > 0) {
+      flasher_client.setReadWindow(profile.readBlockSize,
+                                   profile.readMaxInFlight);
+    }
 
-    st = flasher_client.connect(flashing_speed_);
+    beginPhase("stub");
+    st = flasher_client.connect(flashing_speed);
     if (!st.ok()) {
       return QSP("Failed to run and communicate with flasher stub", st);
     }
+    metrics_["stub_version"] = flasher_client.stubVersion();
+
+    if (flashing_speed_auto_ && flasher_client.canSetBaudRate()) {
+      beginPhase("baud");
+      emit statusMessage(tr("Selecting baud rate..."), true);
+      QVector<qint32> candidates;
+      for (qint32 baudRate : kAutoFlashBaudRates) {
+        if (profile.maxBaudRate > 0 && baudRate > profile.maxBaudRate) break;
+        candidates.append(baudRate);
+      }
+      auto res = flasher_client.negotiateBaudRate(candidates);
+      if (!res.ok()) {
+        return QSP("Failed to select flashing baud rate", res.status());
+      }
+      emit statusMessage(tr("Flashing @ %1").arg(res.ValueOrDie()), true);
+    } else if (flashing_speed_auto_) {
+      qWarning() << "Stub does not support baud rate switching, staying at"
+                 << flashing_speed;
+    }
+    metrics_["baud_rate"] = flasher_client.baudRate();
 
+    quint32 flash_size = flashSize_;
     if (override_flash_params_ >= 0) {
       // This really can't go wrong, we parsed the params.
-      flashSize_ = flashSizeFromParams(override_flash_params_).ValueOrDie();
-    } else if (flashSize_ == 0) {
+      flash_size = flashSizeFromParams(override_flash_params_).ValueOrDie();
+    } else if (flash_size == 0) {
+      beginPhase("detect");
       qInfo() << "Detecting flash size...";
       auto flashChipIDRes = flasher_client.getFlashChipID();
       if (flashChipIDRes.ok()) {
@@ -345,20 +823,46 @@ class FlasherImpl : public Flasher {
                 << capacity;
         if (mfg != 0 && capacity >= 0x13 && capacity < 0x20) {
           // Capacity is the power of two.
-          flashSize_ = 1 << capacity;
+          flash_size = 1 << capacity;
         }
       }
-      if (flashSize_ == 0) {
+      if (flash_size == 0) {
         qWarning()
             << "Failed to detect flash size:" << flashChipIDRes.status()
             << ", defaulting 512K. You may want to specify size explicitly "
                "using --flash-size.";
-        flashSize_ = 512 * 1024;  // A safe default.
+        flash_size = 512 * 1024;  // A safe default.
       } else {
-        emit statusMessage(tr("Detected flash size: %1").arg(flashSize_), true);
+        emit statusMessage(tr("Detected flash size: %1").arg(flash_size), true);
       }
     }
-    qInfo() << "Flash size:" << flashSize_;
+    qInfo() << "Flash size:" << flash_size;
+    prepared_flash_size_ = flash_size;
+    rom_ = romp;
+    return util::Status::OK;
+  }
+
+  // The rest of the run, once the firmware is set and prepareLocked is done.
+  util::Status runLocked() {
+    util::Status st;
+    ESPROMClient &rom = *rom_;
+    ESPFlasherClient &flasher_client = *flasher_client_;
+    flashSize_ = prepared_flash_size_;
+    progress_ = 0;
+    startProgress(totalBytesLocked());
+    const QByteArray &mac = mac_;
+
+    if (!backup_filename_.isEmpty()) {
+      beginPhase("backup");
+      const quint64 received = flasher_client.bytesReceived();
+      st = backupFlash(&flasher_client);
+      endPhase(flasher_client.bytesReceived() - received);
+      if (!st.ok()) return st;
+      beginPhase("boot");
+      st = flasher_client.bootFirmware();
+      rom.rebootIntoFirmware();
+      return st;
+    }
 
     /* Based on our knowledge of flash size, adjust type=sys_params image. */
     adjustSysParamsLocation(flashSize_);
@@ -366,37 +870,64 @@ class FlasherImpl : public Flasher {
     st = sanityCheckImages(flashSize_, flasher_client.kFlashSectorSize);
     if (!st.ok()) return st;
 
-    if (images_.contains(0) && images_[0].data.length() >= 4) {
-      int flashParams = 0;
-      if (override_flash_params_ >= 0) {
-        flashParams = override_flash_params_;
-      } else {
-        // We don't have constants for larger flash sizes.
-        if (flashSize_ > 4194304) flashSize_ = 4194304;
-        // We use detected size + DIO @ 40MHz which should be a safe default.
-        // Advanced users wishing to use other modes and freqs can override.
-        flashParams =
-            flashParamsFromString(
-                tr("dio,%1m,40m").arg(flashSize_ * 8 / 1048576)).ValueOrDie();
+    int flashParams = 0;
+    if (restore_) {
+      // Backup is written as is, its header has the right params already.
+      const QByteArray &header = images_[0].data;
+      if (header.length() >= 4) {
+        flashParams = (quint8(header[2]) << 8) | quint8(header[3]);
       }
+    } else if (override_flash_params_ >= 0) {
+      flashParams = override_flash_params_;
+    } else {
+      // We don't have constants for larger flash sizes.
+      const quint32 size = std::min(flashSize_, quint32(4194304));
+      // We use detected size + DIO @ 40MHz which should be a safe default.
+      // Advanced users wishing to use other modes and freqs can override.
+      flashParams =
+          flashParamsFromString(tr("dio,%1m,40m").arg(size * 8 / 1048576))
+              .ValueOrDie();
+    }
+    // Header is only patched if it differs: writing to the image detaches it
+    // from the bundle's buffer, which is shared with other flashers, and its
+    // digests have to be computed again.
+    if (!restore_ && images_.contains(0) && images_[0].data.length() >= 4 &&
+        ((quint8(images_[0].data[2]) << 8) | quint8(images_[0].data[3])) !=
+            flashParams) {
       images_[0].data[2] = (flashParams >> 8) & 0xff;
       images_[0].data[3] = flashParams & 0xff;
+      images_[0].digests = FirmwareBundle::computeDigests(
+          images_[0].data, flasher_client.kFlashSectorSize);
       emit statusMessage(
           tr("Setting flash params to 0x%1").arg(flashParams, 0, 16), true);
     }
 
+    // The rest of the session runs with the same SPI settings the firmware
+    // will use, stub puts back the original ones before booting it.
+    if (flasher_client.canSetSPIParams()) {
+      st = flasher_client.setSPIParams(flashParams);
+      if (!st.ok()) {
+        qWarning() << "Failed to speed up flash access:" << st;
+      }
+    }
+
+    if (!deltas_.isEmpty()) {
+      st = resolveDeltasLocked(&flasher_client);
+      if (!st.ok()) return st;
+    }
+
     qInfo() << QString("SPIFFS params: %1 @ 0x%2")
                    .arg(spiffs_size_)
                    .arg(spiffs_offset_, 0, 16)
                    .toUtf8();
     if (merge_flash_filesystem_ && images_.contains(spiffs_offset_)) {
+      beginPhase("merge");
+      const quint64 received = flasher_client.bytesReceived();
       auto res = mergeFlashLocked(&flasher_client);
+      endPhase(flasher_client.bytesReceived() - received);
       if (res.ok()) {
-        if (res.ValueOrDie().size() > 0) {
-          images_[spiffs_offset_].data = res.ValueOrDie();
-        } else {
-          images_.remove(spiffs_offset_);
-        }
+        images_.remove(spiffs_offset_);
+        images_.unite(res.ValueOrDie());
         emit statusMessage(tr("Merged flash content"), true);
       } else {
         emit statusMessage(tr("Failed to merge flash content: %1")
@@ -407,51 +938,190 @@ class FlasherImpl : public Flasher {
       qInfo() << "No SPIFFS image in new firmware";
     }
 
-    auto flashImages = images_;
-    if (erase_chip_) {
-      emit statusMessage(tr("Erasing chip..."), true);
-      st = flasher_client.eraseChip();
-      if (!st.ok()) return st;
-    } else if (minimize_writes_) {
-      flashImages = dedupImages(&flasher_client);
+    quint32 chipID = 0;
+    auto cr = flasher_client.getFlashChipID();
+    if (cr.ok()) {
+      chipID = cr.ValueOrDie();
+    } else {
+      qWarning() << "Failed to read chip ID:" << cr.status();
+    }
+    std::unique_ptr<ESPFlashCache> cache;
+    if (use_flash_cache_ && !mac.isEmpty() && chipID != 0) {
+      cache.reset(new ESPFlashCache(mac, chipID));
+      st = cache->load();
+      if (!st.ok()) {
+        qWarning() << "Failed to load flash cache:" << st;
+        cache->clear();
+      }
     }
+    ESPEraseModel eraseModel(chipID, flashSize_);
+    eraseModel.load();
+    flasher_client.setEraseModel(&eraseModel);
 
-    emit statusMessage(tr("Writing..."), true);
-    for (ulong image_addr : flashImages.keys()) {
-      const Image &image = flashImages[image_addr];
-      QByteArray data = image.data;
-      emit progress(progress_);
-      int origLength = data.length();
+    ESPFlashJournal journal(
+        mac.isEmpty() ? portName(port_) : QString::fromLatin1(mac.toHex()),
+        journalBuildId());
+    journal.load();
 
-      if (data.length() % flasher_client.kFlashSectorSize != 0) {
-        quint32 padLen = flasher_client.kFlashSectorSize -
-                         (data.length() % flasher_client.kFlashSectorSize);
-        data.reserve(data.length() + padLen);
-        while (padLen-- > 0) data.append('\x00');
-      }
+    const QMap<quint32, QByteArray> patches = allPatchesLocked();
+    st = checkPatches(patches);
+    if (!st.ok()) return st;
 
-      emit statusMessage(
-          tr("  %1 @ 0x%2...").arg(data.length()).arg(image_addr, 0, 16), true);
-      connect(
-          &flasher_client, &ESPFlasherClient::progress,
-          [this, origLength](int bytesWritten) {
-            emit progress(this->progress_ + std::min(bytesWritten, origLength));
+    // Read before planning, deduping takes the regions it lists as in place.
+    ESPFlashIndex flashIndex;
+    bool flashIndexBlank = true;
+    if (flash_index_addr_ >= 0) {
+      flashIndex = readFlashIndex(&flasher_client, &flashIndexBlank);
+    }
+
+    const WritePlan plan = planWrites(&flasher_client, &eraseModel,
+                                      cache.get(), &journal, &flashIndex);
+    if (plan_only_) {
+      reportPlan(plan, flasher_client.baudRate());
+      beginPhase("boot");
+      st = flasher_client.bootFirmware();
+      rom.rebootIntoFirmware();
+      return st;
+    }
+    const QMap<ulong, Image> &flashImages = plan.images;
+    if (cache != nullptr) cache->invalidate();
+    // Same for the index: it is written again once everything is verified.
+    if (!flashIndexBlank) {
+      st = flasher_client.erase(flash_index_addr_,
+                                ESPFlasherClient::kFlashSectorSize);
+      if (!st.ok()) return QSP("failed to erase flash index", st);
+    }
+
+    beginPhase("erase");
+    st = eraseFlash(&flasher_client, plan, cache.get(), &journal);
+    if (!st.ok()) return st;
+    eraseModel.save();
+    // Nothing is sent for blank sectors.
+    progress_ += plan.blankBytes;
+    const bool erase = plan.eraseInline;
+    const bool changedOnly = plan.changedOnly;
+    emit statusMessage(tr("Writing..."), true);
+    beginPhase("write");
+    const quint64 sent = flasher_client.bytesSent();
+    const QMap<quint32, int> &origLengths = plan.origLengths;
+    const QMap<quint32, FlashSpan> &regions = plan.regions;
+    connect(&flasher_client, &ESPFlasherClient::regionWritten,
+            [&journal, &regions](quint32 addr, quint32 len) {
+              if (quint32(regions.value(addr).length()) == len) {
+                journal.add(addr, regions[addr]);
+              }
+            });
+
+    if (flasher_client.canWriteRegions()) {
+      // Single session for all the images, the link does not go idle between
+      // them.
+      int totalLength = 0;
+      for (const Image &image : flashImages) {
+        emit statusMessage(tr("  %1 @ 0x%2...")
+                               .arg(padToSector(image.data).length())
+                               .arg(image.addr, 0, 16),
+                           true);
+      }
+      for (int origLength : origLengths) totalLength += origLength;
+      reportProgress(progress_);
+      connect(&flasher_client, &ESPFlasherClient::progress,
+              [this, totalLength](int bytesWritten) {
+                reportProgress(this->progress_ +
+                               std::min(bytesWritten, totalLength));
+              });
+      st = writeWithFallback(
+          &flasher_client, [&flasher_client, &regions, erase, changedOnly]() {
+            return flasher_client.writeRegions(regions, erase, changedOnly);
           });
-      st = flasher_client.write(image_addr, data, true /* erase */);
       disconnect(&flasher_client, &ESPFlasherClient::progress, 0, 0);
       if (!st.ok()) {
-        return QS(util::error::UNAVAILABLE,
-                  tr("failed to flash image at 0x%1: %2")
-                      .arg(image_addr, 0, 16)
-                      .arg(st.ToString().c_str()));
+        return QSP(tr("failed to flash %1 images").arg(flashImages.size()),
+                   st);
+      }
+      progress_ += totalLength;
+    } else {
+      for (ulong image_addr : regions.keys()) {
+        const FlashSpan &data = regions[image_addr];
+        const int origLength = origLengths[image_addr];
+        reportProgress(progress_);
+
+        emit statusMessage(
+            tr("  %1 @ 0x%2...").arg(data.length()).arg(image_addr, 0, 16),
+            true);
+        connect(&flasher_client, &ESPFlasherClient::progress,
+                [this, origLength](int bytesWritten) {
+                  reportProgress(this->progress_ +
+                                 std::min(bytesWritten, origLength));
+                });
+        st = writeWithFallback(&flasher_client, [&flasher_client, image_addr,
+                                                 &data, erase]() {
+          if (flasher_client.canWriteCompressed()) {
+            return flasher_client.writeCompressed(image_addr, data, erase);
+          }
+          return flasher_client.write(image_addr, data, erase);
+        });
+        disconnect(&flasher_client, &ESPFlasherClient::progress, 0, 0);
+        if (!st.ok()) {
+          return QS(util::error::UNAVAILABLE,
+                    tr("failed to flash image at 0x%1: %2")
+                        .arg(image_addr, 0, 16)
+                        .arg(st.ToString().c_str()));
+        }
+        progress_ += origLength;
       }
-      progress_ += origLength;
+    }
+    disconnect(&flasher_client, &ESPFlasherClient::regionWritten, 0, 0);
+    // Everything is in place, nothing to resume.
+    journal.clear();
+
+    addWriteRateSample(flasher_client.baudRate(), plan.writeBytes,
+                       phaseTimer_.elapsed());
+    endPhase(flasher_client.bytesSent() - sent);
+
+    // Images write whole sectors, patches go on top of what is there.
+    if (!patches.isEmpty()) {
+      beginPhase("patch");
+      const quint64 patchSent = flasher_client.bytesSent();
+      st = applyPatches(&flasher_client, patches);
+      endPhase(flasher_client.bytesSent() - patchSent);
+      if (!st.ok()) return QSP("failed to apply patches", st);
     }
 
-    st = verifyImages(&flasher_client);
-    if (!st.ok()) return QSP("verification failed", st);
+    // Written data has been checked by the stub already, if it can.
+    beginPhase("verify");
+    QMap<ulong, Image> verify;
+    if (verify_mode_ == VerifyMode::Full || !flasher_client.canVerifyWrites()) {
+      verify = images_;
+    } else if (verify_mode_ == VerifyMode::Unwritten) {
+      verify = unwrittenImages(flashImages);
+    }
+    if (verify_mode_ != VerifyMode::None) {
+      st = verifyImages(&flasher_client, verify);
+      if (!st.ok()) return QSP("verification failed", st);
+    }
+    if (verify_mode_ == VerifyMode::Full && !patches.isEmpty()) {
+      st = verifyPatches(&flasher_client, patches);
+      if (!st.ok()) return QSP("verification failed", st);
+    }
+
+    if (flash_index_addr_ >= 0) {
+      st = writeFlashIndex(&flasher_client);
+      if (!st.ok()) qWarning() << "Failed to write flash index:" << st;
+    }
+
+    if (cache != nullptr) {
+      for (const auto &image : images_) cache->update(image.addr, image.data);
+      st = cache->save();
+      if (!st.ok()) qWarning() << "Failed to save flash cache:" << st;
+    }
 
     emit statusMessage(tr("Flashing successful, booting firmare..."), true);
+    beginPhase("boot");
+    metrics_["bytes_sent"] = flasher_client.bytesSent();
+    if (changedOnly) {
+      metrics_["sectors_rewritten"] = flasher_client.sectorsRewritten();
+    }
+    metrics_["bytes_received"] = flasher_client.bytesReceived();
 
     // So, this is a bit tricky. Rebooting ESP8266 "properly" from software
     // seems to be impossible due to GPIO strapping: at this point we have
@@ -470,6 +1140,25 @@ class FlasherImpl : public Flasher {
     return st;
   }
 
+  // With automatic baud rate selection, retries writes that fail with a
+  // digest mismatch at lower rates.
+  util::Status writeWithFallback(ESPFlasherClient *fc,
+                                 std::function<util::Status()> write) {
+    while (true) {
+      util::Status st = write();
+      if (st.ok() || !flashing_speed_auto_ ||
+          st.error_code() != util::error::DATA_LOSS) {
+        return st;
+      }
+      qWarning() << st;
+      if (!fc->lowerBaudRate().ok()) return st;
+      metrics_["write_retries"] = metrics_["write_retries"].toInt() + 1;
+      metrics_["baud_rate"] = fc->baudRate();
+      emit statusMessage(tr("Write failed, retrying @ %1").arg(fc->baudRate()),
+                         true);
+    }
+  }
+
   void adjustSysParamsLocation(quint32 flashSize) {
     for (auto it = images_.begin(); it != images_.end(); it++) {
       Image image = it.value();
@@ -511,7 +1200,7 @@ class FlasherImpl : public Flasher {
                       .arg(imageBegin, 0, 16)
                       .arg(flashSectorSize));
       }
-      if (imageBegin == 0 && data.length() >= 1) {
+      if (imageBegin == 0 && data.length() >= 1 && !restore_) {
         if (data[0] != (char) 0xE9) {
           return QS(util::error::INVALID_ARGUMENT,
                     tr("Invalid magic byte in the first image"));
@@ -545,19 +1234,188 @@ class FlasherImpl : public Flasher {
     return util::Status::OK;
   }
 
+  // Starts timing a phase of the run, ending the previous one.
+  void beginPhase(const QString &name) {
+    endPhase();
+    // Phases that stream flash data wait for their turn on a shared hub
+    // before they start, the wait is not part of their time.
+    if (name == "write" || name == "backup" || name == "merge") {
+      const qint64 waitMs = beginBulkTransfer();
+      if (waitMs > 0) {
+        metrics_["bandwidth_wait_ms"] =
+            metrics_["bandwidth_wait_ms"].toLongLong() + waitMs;
+      }
+    }
+    phase_ = name;
+    phaseTimer_.start();
+  }
+
+  // bytes is the amount of flash data moved during the phase, if any.
+  void endPhase(quint64 bytes = 0) {
+    endBulkTransfer();
+    if (phase_.isEmpty()) return;
+    const qint64 ms = phaseTimer_.elapsed();
+    QVariantMap p;
+    p["name"] = phase_;
+    p["ms"] = ms;
+    if (bytes > 0) {
+      p["bytes"] = bytes;
+      if (ms > 0) p["bytes_per_sec"] = bytes * 1000 / ms;
+    }
+    phases_.append(p);
+    phase_.clear();
+  }
+
+  // Streams the whole flash into backup_filename_. The file is only replaced
+  // once all of it has been read.
+  util::Status backupFlash(ESPFlasherClient *fc) {
+    emit statusMessage(
+        tr("Backing up %1 bytes of flash to %2...")
+            .arg(flashSize_)
+            .arg(backup_filename_),
+        true);
+    QSaveFile f(backup_filename_);
+    if (!f.open(QIODevice::WriteOnly)) {
+      return QS(util::error::UNAVAILABLE, tr("failed to open %1: %2")
+                                              .arg(backup_filename_)
+                                              .arg(f.errorString()));
+    }
+    connect(fc, &ESPFlasherClient::progress, [this](int bytesRead) {
+      reportProgress(this->progress_ + bytesRead);
+    });
+    util::Status st = fc->read(0, flashSize_, &f);
+    disconnect(fc, &ESPFlasherClient::progress, 0, 0);
+    if (!st.ok()) return QSP("failed to read flash", st);
+    if (!f.commit()) {
+      return QS(util::error::UNAVAILABLE, tr("failed to write %1: %2")
+                                              .arg(backup_filename_)
+                                              .arg(f.errorString()));
+    }
+    progress_ += flashSize_;
+    emit statusMessage(tr("Backup saved"), true);
+    return util::Status::OK;
+  }
+
+  // resolveDeltasLocked checks that the device has the base images deltas_
+  // apply to and adds the sectors they change to images_.
+  util::Status resolveDeltasLocked(ESPFlasherClient *fc) {
+    for (auto it = deltas_.constBegin(); it != deltas_.constEnd(); it++) {
+      const quint32 addr = it.key();
+      const FirmwareDelta &delta = *it;
+      emit statusMessage(tr("Checking base image at 0x%1...").arg(addr, 0, 16),
+                         true);
+      auto dr = fc->digest(addr, delta.baseSize, 0 /* no block sums */);
+      if (!dr.ok()) return QSP("failed to compute digest", dr.status());
+      if (dr.ValueOrDie().digest != delta.baseMD5) {
+        return QS(util::error::FAILED_PRECONDITION,
+                  tr("flash at 0x%1 does not match build %2 that the update "
+                     "applies to, flash the full firmware")
+                      .arg(addr, 0, 16)
+                      .arg(delta.base));
+      }
+      auto sr = delta.patchedSectors(
+          fc->kFlashSectorSize, [fc, addr](quint32 offset, quint32 size) {
+            return fc->read(addr + offset, size);
+          });
+      if (!sr.ok()) return QSP("failed to apply delta", sr.status());
+      const auto sectors = sr.ValueOrDie();
+      for (auto si = sectors.constBegin(); si != sectors.constEnd(); si++) {
+        const quint32 sa = addr + si.key();
+        images_[sa] = {.addr = sa, .data = *si, .attrs = {}};
+      }
+      qInfo() << "Delta against" << delta.base << "at" << hex << showbase
+              << addr << "changes" << dec << sectors.size() << "sectors";
+    }
+    deltas_.clear();
+    return util::Status::OK;
+  }
+
   // mergeFlashLocked reads the spiffs filesystem from the device
   // and mounts it in memory. Then it overwrites the files that are
   // present in the software update but it leaves the existing ones.
   // The idea is that the filesystem is mostly managed by the user
   // or by the software update utility, while the core system uploaded by
   // the flasher should only upload a few core files.
-  util::StatusOr<QByteArray> mergeFlashLocked(ESPFlasherClient *fc) {
+  // When minimizing writes, the device filesystem is read only as far as
+  // mounting it and comparing files requires, files are updated in place and
+  // only the sectors that changed are returned.
+  // Returns images to replace the new filesystem image with.
+  util::StatusOr<QMap<ulong, Image>> mergeFlashLocked(ESPFlasherClient *fc) {
+    const Image fsImage = images_[spiffs_offset_];
+    QMap<ulong, Image> result;
+    if (minimize_writes_ && fs_dump_filename_.isEmpty()) {
+      emit statusMessage(tr("Reading file system (%1 @ %2)...")
+                             .arg(spiffs_size_)
+                             .arg(spiffs_offset_, 0, 16),
+                         true);
+      quint32 fetched = 0;
+      SPIFFS dev_fs(spiffs_size_,
+                    [this, fc, &fetched](quint32 addr, quint32 size) {
+                      auto res = fc->read(spiffs_offset_ + addr, size);
+                      fetched += size;
+                      reportProgress(this->progress_ + fetched);
+                      return res;
+                    });
+      util::Status st =
+          fs_manifest_.ok()
+              ? updateFilesystem(&dev_fs, fsImage.data,
+                                 fs_manifest_.ValueOrDie())
+              : updateFilesystem(&dev_fs, fsImage.data);
+      if (st.ok() && compact_fs_ && !dev_fs.dirtySectors().isEmpty()) {
+        // Compaction moves everything, so the rest of the image is needed.
+        auto ar = dev_fs.originalImage();
+        auto cr = ar.ok() ? compactFilesystem(dev_fs.image())
+                          : util::StatusOr<QByteArray>(ar.status());
+        if (cr.ok()) {
+          progress_ += spiffs_size_;
+          qInfo() << "File system merged and compacted";
+          result[spiffs_offset_] = fsImage;
+          result[spiffs_offset_].data = cr.ValueOrDie();
+          return result;
+        }
+        qWarning() << "Failed to compact file system:" << cr.status();
+        if (!dev_fs.readerStatus().ok()) return dev_fs.readerStatus();
+      }
+      if (st.ok()) {
+        progress_ += spiffs_size_;
+        const QByteArray merged = dev_fs.image();
+        const QList<int> dirty = dev_fs.dirtySectors();
+        const int ss = ESPFlasherClient::kFlashSectorSize;
+        qInfo() << "File system merged in place, read" << fetched << "bytes,"
+                << dirty.size() << "of" << spiffs_size_ / ss
+                << "sectors changed";
+        // Unchanged sectors may not have been read, only write the rest.
+        for (int i = 0; i < dirty.size();) {
+          int j = i + 1;
+          while (j < dirty.size() && dirty[j] == dirty[j - 1] + 1) j++;
+          Image image(fsImage);
+          image.addr = spiffs_offset_ + dirty[i] * ss;
+          image.data = merged.mid(dirty[i] * ss, (j - i) * ss);
+          result[image.addr] = image;
+          i = j;
+        }
+        return result;
+      }
+      qWarning() << "In-place merge failed:" << st;
+      if (!dev_fs.readerStatus().ok()) return dev_fs.readerStatus();
+      // Fall back to a full merge, re-using what has been read.
+      auto dev_image = dev_fs.originalImage();
+      if (!dev_image.ok()) return dev_image.status();
+      progress_ += spiffs_size_;
+      auto merged = mergeFullLocked(dev_image.ValueOrDie());
+      if (!merged.ok()) return merged.status();
+      if (!merged.ValueOrDie().isEmpty()) {
+        result[spiffs_offset_] = fsImage;
+        result[spiffs_offset_].data = merged.ValueOrDie();
+      }
+      return result;
+    }
     emit statusMessage(tr("Reading file system image (%1 @ %2)...")
                            .arg(spiffs_size_)
                            .arg(spiffs_offset_, 0, 16),
                        true);
     connect(fc, &ESPFlasherClient::progress, [this](int bytesRead) {
-      emit progress(this->progress_ + bytesRead);
+      reportProgress(this->progress_ + bytesRead);
     });
     auto dev_fs = fc->read(spiffs_offset_, spiffs_size_);
     disconnect(fc, &ESPFlasherClient::progress, 0, 0);
@@ -574,8 +1432,19 @@ class FlasherImpl : public Flasher {
                     << f.errorString();
       }
     }
-    auto merged =
-        mergeFilesystems(dev_fs.ValueOrDie(), images_[spiffs_offset_].data);
+    auto merged = mergeFullLocked(dev_fs.ValueOrDie());
+    if (!merged.ok()) return merged.status();
+    if (!merged.ValueOrDie().isEmpty()) {
+      result[spiffs_offset_] = fsImage;
+      result[spiffs_offset_].data = merged.ValueOrDie();
+    }
+    return result;
+  }
+
+  // Merges the new filesystem image into dev_image, asking what to do if that
+  // fails. Empty result means the device filesystem is to be kept.
+  util::StatusOr<QByteArray> mergeFullLocked(const QByteArray &dev_image) {
+    auto merged = mergeFilesystems(dev_image, images_[spiffs_offset_].data);
     if (!merged.ok()) {
       QString msg = tr("Failed to merge file system: ") +
                     QString(merged.status().ToString().c_str()) +
@@ -597,8 +1466,94 @@ class FlasherImpl : public Flasher {
     return merged;
   }
 
-  QMap<ulong, Image> dedupImages(ESPFlasherClient *fc) {
+  // For each sector of data, determines whether flash at addr already has the
+  // same contents. Uses fingerprints if the stub supports them, MD5 otherwise.
+  util::StatusOr<QVector<bool>> sameBlocks(ESPFlasherClient *fc,
+                                           const Image &image) {
+    const ulong addr = image.addr;
+    const QByteArray &data = image.data;
+    const quint32 bs = fc->kFlashSectorSize;
+    QVector<bool> result;
+    if (fc->canFingerprint()) {
+      auto fr = fc->fingerprint(addr, data.length(), bs);
+      if (!fr.ok()) return fr.status();
+      const QVector<quint32> &dev = fr.ValueOrDie();
+      const QVector<quint32> host = fc->fingerprintData(data, bs);
+      if (dev.size() != host.size()) {
+        return QS(util::error::INTERNAL, tr("fingerprint count mismatch"));
+      }
+      for (int i = 0; i < host.size(); i++) {
+        result.push_back(host[i] == dev[i]);
+      }
+      return result;
+    }
+    auto dr = fc->digest(addr, data.length(), bs);
+    if (!dr.ok()) return dr.status();
+    const ESPFlasherClient::DigestResult &digests = dr.ValueOrDie();
+    const int numBlocks = (data.length() + bs - 1) / bs;
+    if (digests.blockDigests.size() != numBlocks) {
+      return QS(util::error::INTERNAL, tr("digest count mismatch"));
+    }
+    const auto host = digestsOf(image);
+    for (int i = 0; i < numBlocks; i++) {
+      result.push_back(host->blockMd5s[i] == digests.blockDigests[i]);
+    }
+    return result;
+  }
+
+  // Same as sameBlocks, but sectors are compared with what the cache says we
+  // wrote last time. Runs of sectors that appear to be the same are confirmed
+  // with a digest. Returns an empty vector if the cache cannot be used.
+  QVector<bool> sameBlocksFromCache(ESPFlasherClient *fc,
+                                    const ESPFlashCache &cache, ulong addr,
+                                    const QByteArray &data) {
+    const quint32 bs = fc->kFlashSectorSize;
+    const QVector<quint32> cached = cache.lookup(addr, data.length());
+    if (cached.isEmpty()) return QVector<bool>();
+    const QVector<quint32> host = fc->fingerprintData(data, bs);
+    QVector<bool> result;
+    for (int i = 0; i < host.size(); i++) {
+      result.push_back(host[i] == cached[i]);
+    }
+    QVector<QPair<quint32, quint32>> runs;
+    for (int i = 0; i < result.size();) {
+      if (!result[i]) {
+        i++;
+        continue;
+      }
+      int j = i;
+      while (j < result.size() && result[j]) j++;
+      const int len = std::min(int((j - i) * bs), data.length() - int(i * bs));
+      runs.append(qMakePair(quint32(i * bs), quint32(len)));
+      i = j;
+    }
+    QVector<QPair<quint32, quint32>> regions = runs;
+    for (auto &r : regions) r.first += addr;
+    auto dr = fc->digests(regions);
+    if (!dr.ok()) {
+      qInfo() << "Failed to confirm cached contents:" << dr.status();
+      return QVector<bool>();
+    }
+    for (int i = 0; i < runs.size(); i++) {
+      const QByteArray run = dataView(data, runs[i].first, runs[i].second);
+      if (dr.ValueOrDie()[i] !=
+          QCryptographicHash::hash(run, QCryptographicHash::Md5)) {
+        qInfo() << "Flash contents @" << hex << showbase
+                << addr + runs[i].first << "do not match the cache";
+        return QVector<bool>();
+      }
+    }
+    return result;
+  }
+
+  // Regions the index lists with the same data are taken as they are, without
+  // reading them. Except for the file system, which the firmware writes to.
+  QMap<ulong, Image> dedupImages(ESPFlasherClient *fc,
+                                 const ESPEraseModel *model,
+                                 ESPFlashCache *cache,
+                                 const ESPFlashIndex *index) {
     QMap<ulong, Image> result;
+    int numSectors = 0, numSkipped = 0, numFragments = 0, numIndexed = 0;
     emit statusMessage("Deduping...", true);
     for (auto im = images_.constBegin(); im != images_.constEnd(); im++) {
       const ulong addr = im.key();
@@ -607,95 +1562,715 @@ class FlasherImpl : public Flasher {
       qInfo() << tr("Checksumming %1 @ 0x%2...")
                      .arg(data.length())
                      .arg(addr, 0, 16);
-      ESPFlasherClient::DigestResult digests;
-      auto dr = fc->digest(addr, data.length(), fc->kFlashSectorSize);
-      if (!dr.ok()) {
-        qWarning() << "Error computing digest:" << dr.status();
-        return images_;
+      QVector<bool> same;
+      const int ss = fc->kFlashSectorSize;
+      if (index != nullptr && addr != spiffs_offset_ &&
+          index->contains(addr, data.length(), digestsOf(image)->md5)) {
+        qInfo() << "Flash index has it";
+        same.fill(true, (data.length() + ss - 1) / ss);
+        numIndexed++;
       }
-      QMap<ulong, Image> newImages;
-      digests = dr.ValueOrDie();
-      int numBlocks =
-          (data.length() + fc->kFlashSectorSize - 1) / fc->kFlashSectorSize;
-      quint32 newAddr = addr, newLen = 0;
-      quint32 newImageSize = 0;
-      for (int i = 0; i < numBlocks; i++) {
-        int offset = i * fc->kFlashSectorSize;
-        int len = fc->kFlashSectorSize;
-        if (len > data.length() - offset) len = data.length() - offset;
-        const QByteArray &hash = QCryptographicHash::hash(
-            data.mid(offset, len), QCryptographicHash::Md5);
-        qDebug() << i << offset << len << hash.toHex()
-                 << digests.blockDigests[i].toHex();
-        if (hash == digests.blockDigests[i]) {
-          // This block is the same, skip it. Flush previous image, if any.
-          if (newLen > 0) {
-            Image newImage(image);
-            newImage.addr = newAddr;
-            newImage.data = data.mid(newAddr - addr, newLen);
-            newImages[newAddr] = newImage;
-            newLen = 0;
-            qDebug() << "New image:" << newImage.data.length() << "@" << hex
-                     << showbase << newAddr;
-          }
-          progress_ += len;
-          emit progress(progress_);
-        } else {
-          // This block is different. Start new or extend existing image.
-          if (newLen == 0) {
-            newAddr = addr + i * fc->kFlashSectorSize;
-          }
-          newLen += len;
-          newImageSize += len;
+      if (same.isEmpty() && cache != nullptr) {
+        same = sameBlocksFromCache(fc, *cache, addr, data);
+      }
+      if (same.isEmpty()) {
+        auto sr = sameBlocks(fc, image);
+        if (!sr.ok()) {
+          qWarning() << "Error computing digest:" << sr.status();
+          return images_;
         }
+        same = sr.ValueOrDie();
       }
-      if (newLen > 0) {
+      const QVector<QPair<int, int>> fragments =
+          dedupFragments(fc, *model, addr, data.length(), same);
+      QMap<ulong, Image> newImages;
+      int newImageSize = 0, numWritten = 0;
+      for (const auto &f : fragments) {
         Image newImage(image);
-        newImage.addr = newAddr;
-        newImage.data = data.mid(newAddr - addr, newLen);
-        newImages[newAddr] = newImage;
-        qDebug() << "New image:" << newImage.data.length() << "@" << hex
-                 << showbase << newAddr;
+        newImage.addr = addr + f.first * ss;
+        const int len = std::min(f.second * ss, data.length()) - f.first * ss;
+        newImage.data = dataView(data, f.first * ss, len);
+        newImages[newImage.addr] = newImage;
+        newImageSize += len;
+        numWritten += f.second - f.first;
+        qDebug() << "New image:" << len << "@" << hex << showbase
+                 << newImage.addr;
       }
+      progress_ += data.length() - newImageSize;
+      reportProgress(progress_);
       qInfo() << hex << showbase << addr << "was" << dec << data.length()
-              << "now" << newImageSize << "diff"
-              << (data.length() - newImageSize);
-      // There's a price for fragmenting a large image: erasing many individual
-      // sectors is slower than erasing a whole block. So unless the difference
-      // is substantial, don't bother.
-      if (data.length() - newImageSize >= ESPFlasherClient::kFlashBlockSize) {
-        result.unite(newImages);  // There are no dup keys, so unite is ok.
-        emit statusMessage(tr("  %1 @ 0x%2 reduced to %3")
+              << "now" << newImageSize << "in" << fragments.size()
+              << "fragments, diff" << (data.length() - newImageSize);
+      numSectors += same.size();
+      numSkipped += same.size() - numWritten;
+      numFragments += fragments.size();
+      result.unite(newImages);  // There are no dup keys, so unite is ok.
+      if (newImageSize < data.length()) {
+        emit statusMessage(tr("  %1 @ 0x%2 reduced to %3 in %4 fragments")
                                .arg(data.length())
                                .arg(addr, 0, 16)
-                               .arg(newImageSize),
+                               .arg(newImageSize)
+                               .arg(fragments.size()),
                            true);
-      } else {
-        result[addr] = image;
       }
     }
     qDebug() << "After deduping:" << result.size() << "images";
+    metrics_["dedup_sectors"] = numSectors;
+    metrics_["dedup_sectors_skipped"] = numSkipped;
+    metrics_["dedup_fragments"] = numFragments;
+    if (index != nullptr && !index->isEmpty()) {
+      metrics_["flash_index_hits"] = numIndexed;
+    }
     return result;
   }
 
-  util::Status verifyImages(ESPFlasherClient *fc) {
-    emit statusMessage("Verifying...", true);
+  // Sector ranges [first, last) of an image to write, given which of its
+  // sectors are in flash already. Changed runs are merged across clean gaps
+  // and extended to block boundaries where the time model says it pays:
+  // each fragment costs commands and erasing in sectors is slower than in
+  // blocks, while bigger fragments send more data.
+  QVector<QPair<int, int>> dedupFragments(ESPFlasherClient *fc,
+                                          const ESPEraseModel &model,
+                                          ulong addr, int length,
+                                          const QVector<bool> &same) {
+    const int ss = fc->kFlashSectorSize;
+    const int perBlock = fc->kFlashBlockSize / ss;
+    const int n = same.size();
+    QVector<QPair<int, int>> runs;
+    for (int i = 0; i < n; i++) {
+      if (same[i]) continue;
+      if (!runs.isEmpty() && runs.last().second == i) {
+        runs.last().second++;
+      } else {
+        runs.append(qMakePair(i, i + 1));
+      }
+    }
+    if (runs.isEmpty()) return runs;
+
+    QVector<ESPEraseModel::Method> methods;
+    if (erase_mode_ != EraseMode::Blocks) {
+      methods << ESPEraseModel::Method::Sectors;
+    }
+    if (erase_mode_ == EraseMode::Blocks || erase_mode_ == EraseMode::Auto) {
+      methods << ESPEraseModel::Method::Blocks;
+    }
+    const double cmdMs =
+        (fc->roundTripUs() > 0 ? fc->roundTripUs() : kDefaultRoundTripUs) /
+        1000.0;
+    // Regions share a write session, batched erase commands share a round
+    // trip. The stub erases inline ones itself.
+    const double writeCmdMs = fc->canWriteRegions() ? 0 : cmdMs;
+    const double eraseCmdMs =
+        erase_mode_ == EraseMode::Inline
+            ? 0
+            : (fc->canBatch() ? cmdMs / FLASH_BATCH_MAX_CMDS : cmdMs);
+    const double bytesPerMs = writeBytesPerMs(fc);
+    auto costMs = [&](int first, int last) -> double {
+      const quint32 fAddr = addr + first * ss;
+      const quint32 len = std::min(last * ss, length) - first * ss;
+      const quint32 eraseLen = (len + ss - 1) / ss * ss;
+      QMap<quint32, quint32> region;
+      region[fAddr] = eraseLen;
+      double eraseMs = -1;
+      for (ESPEraseModel::Method m : methods) {
+        const double ms =
+            model.estimateMs(m, region) +
+            ESPEraseModel::numOps(m, fAddr, eraseLen) * eraseCmdMs;
+        if (eraseMs < 0 || ms < eraseMs) eraseMs = ms;
+      }
+      return eraseMs + len / bytesPerMs + writeCmdMs;
+    };
+    // Runs i to j, optionally extended to the blocks they start and end in.
+    // A side is only extended if that does not reach the next run, merging
+    // takes care of that, so fragments never overlap.
+    const int blockOffset = (addr / ss) % perBlock;
+    auto fragment = [&](int i, int j, bool extend) -> QPair<int, int> {
+      QPair<int, int> f(runs[i].first, runs[j].second);
+      if (!extend) return f;
+      const int first = std::max(
+          0, (f.first + blockOffset) / perBlock * perBlock - blockOffset);
+      const int last = std::min(
+          n, (f.second + blockOffset + perBlock - 1) / perBlock * perBlock -
+                 blockOffset);
+      if (i == 0 || first >= runs[i - 1].second) f.first = first;
+      if (j == runs.size() - 1 || last <= runs[j + 1].first) f.second = last;
+      return f;
+    };
+
+    // Cheapest cover of the first k runs, and its last fragment.
+    const int k = runs.size();
+    QVector<double> best(k + 1, 0);
+    QVector<QPair<int, int>> lastFragment(k + 1);
+    QVector<int> from(k + 1, 0);  // Its first run.
+    for (int j = 0; j < k; j++) {
+      best[j + 1] = -1;
+      for (int i = 0; i <= j; i++) {
+        for (bool extend : {false, true}) {
+          const QPair<int, int> f = fragment(i, j, extend);
+          const double ms = best[i] + costMs(f.first, f.second);
+          if (best[j + 1] < 0 || ms < best[j + 1]) {
+            best[j + 1] = ms;
+            lastFragment[j + 1] = f;
+            from[j + 1] = i;
+          }
+        }
+      }
+    }
+    QVector<QPair<int, int>> result;
+    for (int j = k; j > 0; j = from[j]) result.prepend(lastFragment[j]);
+    return result;
+  }
+
+  // Works out what to erase and write: skips what the journal says has been
+  // written already or, failing that, what is in flash already, and picks
+  // the erase method. Only reads flash.
+  WritePlan planWrites(ESPFlasherClient *fc, ESPEraseModel *model,
+                       ESPFlashCache *cache, ESPFlashJournal *journal,
+                       const ESPFlashIndex *index) {
+    WritePlan plan;
+    plan.images = images_;
+    const bool eraseChip = erase_chip_ || erase_mode_ == EraseMode::Chip;
+    bool resumed = false;
+    if (!eraseChip && !journal->isEmpty()) {
+      beginPhase("resume");
+      plan.images = resumeImages(fc, journal, &resumed);
+    }
+    if (!eraseChip && !resumed && minimize_writes_) {
+      beginPhase("dedup");
+      plan.images = dedupImages(fc, model, cache, index);
+    }
+
+    beginPhase("plan");
+    if (erase_mode_ == EraseMode::Inline && !eraseChip) {
+      plan.eraseInline = true;
+      plan.eraseMethod = ESPEraseModel::Method::Sectors;
+      plan.changedOnly = minimize_writes_ && fc->canWriteChanged();
+    } else {
+      plan.erase = erasePlan(fc, plan.images);
+      if (eraseChip) {
+        plan.eraseMethod = ESPEraseModel::Method::Chip;
+      } else if (erase_mode_ == EraseMode::Sectors) {
+        plan.eraseMethod = ESPEraseModel::Method::Sectors;
+      } else if (erase_mode_ == EraseMode::Auto) {
+        // Chip erase means writing everything, and only if there is nothing
+        // else in flash to lose.
+        const auto regionEst = model->best(plan.erase, false /* allowChip */);
+        plan.eraseMethod = regionEst.method;
+        const qint64 regionMs = regionEst.ms + transferMs(fc, plan.images);
+        const qint64 chipMs =
+            model->estimateMs(ESPEraseModel::Method::Chip, plan.erase) +
+            transferMs(fc, images_);
+        // The stub erases ahead of the data while it comes in, so inline
+        // erase mostly overlaps with sending. Blank sectors are not sent and
+        // are still erased separately.
+        QMap<ulong, Image> blank;
+        const QMap<ulong, Image> written = splitBlank(plan.images, &blank);
+        const qint64 inlineMs =
+            std::max(model->estimateMs(ESPEraseModel::Method::Blocks,
+                                       erasePlan(fc, written)),
+                     transferMs(fc, plan.images)) +
+            model->estimateMs(ESPEraseModel::Method::Sectors,
+                              erasePlan(fc, blank));
+        qInfo() << "Estimated erase and write time:"
+                << ESPEraseModel::methodName(plan.eraseMethod) << regionMs
+                << "ms, inline" << inlineMs << "ms, chip" << chipMs << "ms";
+        if (chipMs < std::min(regionMs, inlineMs) && onlyImagesInFlash(fc)) {
+          plan.eraseMethod = ESPEraseModel::Method::Chip;
+        } else if (inlineMs < regionMs) {
+          plan.eraseInline = true;
+          plan.eraseMethod = ESPEraseModel::Method::Sectors;
+          plan.changedOnly = minimize_writes_ && fc->canWriteChanged();
+          // Filled in with the written regions below.
+          plan.erase.clear();
+        }
+      }
+      if (plan.eraseMethod == ESPEraseModel::Method::Chip) {
+        plan.images = images_;
+      }
+    }
+
+    // Erasing takes care of blank sectors, they are left out of the writes.
+    // The erase plan covers them already, except for inline erase.
+    QMap<ulong, Image> blank;
+    for (const Image &image : plan.images) {
+      plan.blankBytes += image.data.length();
+    }
+    plan.images = splitBlank(plan.images, &blank);
+    for (const Image &image : plan.images) {
+      plan.blankBytes -= image.data.length();
+    }
+    if (plan.eraseInline) plan.eraseOnly = erasePlan(fc, blank);
+
+    // With a single session for all the images, they are sent block by block
+    // for the journal to keep track of.
+    const QMap<ulong, Image> writeImages =
+        fc->canWriteRegions() ? splitImages(plan.images) : plan.images;
+    for (const Image &image : writeImages) {
+      plan.origLengths[image.addr] = image.data.length();
+      plan.regions[image.addr] = padToSector(image.data);
+      plan.writeBytes += plan.regions[image.addr].length();
+      if (plan.eraseInline) {
+        plan.erase[image.addr] = plan.regions[image.addr].length();
+      }
+    }
+    for (auto it = plan.eraseOnly.constBegin(); it != plan.eraseOnly.constEnd();
+         it++) {
+      plan.erase[it.key()] = it.value();
+    }
+    plan.writeMs = transferMs(fc, plan.images);
+
+    if (plan.eraseMethod == ESPEraseModel::Method::Chip) {
+      plan.eraseOps = 1;
+    } else {
+      for (auto it = plan.erase.constBegin(); it != plan.erase.constEnd();
+           it++) {
+        plan.eraseOps +=
+            ESPEraseModel::numOps(plan.eraseMethod, it.key(), it.value());
+      }
+    }
+    plan.eraseMs = model->estimateMs(plan.eraseMethod, plan.erase);
+
+    metrics_["erase_method"] =
+        plan.eraseInline ? QString("inline")
+                         : ESPEraseModel::methodName(plan.eraseMethod);
+    metrics_["erase_estimate_ms"] = plan.eraseMs;
+    metrics_["erase_ops"] = plan.eraseOps;
+    metrics_["blank_bytes_skipped"] = plan.blankBytes;
+    metrics_["write_changed_only"] = plan.changedOnly;
+    metrics_["write_estimate_ms"] = plan.writeMs;
+    return plan;
+  }
+
+  // Lists the regions to erase and write, with the expected time.
+  void reportPlan(const WritePlan &plan, qint32 baudRate) {
+    if (plan.eraseMethod == ESPEraseModel::Method::Chip) {
+      emit statusMessage(tr("Erase: whole chip, 1 op"), true);
+    } else {
+      quint32 total = 0;
+      for (quint32 len : plan.erase) total += len;
+      emit statusMessage(
+          tr("Erase: %1 bytes in %2 regions, %3 ops (%4)")
+              .arg(total)
+              .arg(plan.erase.size())
+              .arg(plan.eraseOps)
+              .arg(plan.eraseInline
+                       ? QString("inline")
+                       : ESPEraseModel::methodName(plan.eraseMethod)),
+          true);
+      for (auto it = plan.erase.constBegin(); it != plan.erase.constEnd();
+           it++) {
+        emit statusMessage(
+            tr("  %1 @ 0x%2, %3 ops")
+                .arg(it.value())
+                .arg(it.key(), 0, 16)
+                .arg(ESPEraseModel::numOps(plan.eraseMethod, it.key(),
+                                           it.value())),
+            true);
+      }
+    }
+    emit statusMessage(tr("Write: %1 bytes in %2 regions @ %3, %4 bytes of "
+                          "0xFF left out%5")
+                           .arg(plan.writeBytes)
+                           .arg(plan.regions.size())
+                           .arg(baudRate)
+                           .arg(plan.blankBytes)
+                           .arg(plan.changedOnly
+                                    ? tr(", only changed sectors rewritten")
+                                    : QString()),
+                       true);
+    for (auto it = plan.regions.constBegin(); it != plan.regions.constEnd();
+         it++) {
+      emit statusMessage(
+          tr("  %1 @ 0x%2").arg(it.value().length()).arg(it.key(), 0, 16),
+          true);
+    }
+    const qint64 rate = measuredWriteRate(baudRate);
+    emit statusMessage(
+        tr("Estimated time: %1 s (erase %2 s, write %3 s%4)")
+            .arg((plan.eraseMs + plan.writeMs) / 1000.0, 0, 'f', 1)
+            .arg(plan.eraseMs / 1000.0, 0, 'f', 1)
+            .arg(plan.writeMs / 1000.0, 0, 'f', 1)
+            .arg(rate > 0 ? tr(" at %1 bytes/s measured").arg(rate)
+                          : tr(", no measurements yet")),
+        true);
+    emit statusMessage(tr("Nothing has been written"), true);
+  }
+
+  // Erases flash as planned. If the chip gets erased, the journal and the
+  // cache are cleared.
+  util::Status eraseFlash(ESPFlasherClient *fc, const WritePlan &plan,
+                          ESPFlashCache *cache, ESPFlashJournal *journal) {
+    if (plan.eraseInline) {
+      // The stub only erases sectors it writes to.
+      QMap<quint32, quint32> ops;
+      for (auto it = plan.eraseOnly.constBegin();
+           it != plan.eraseOnly.constEnd(); it++) {
+        addEraseOps(&ops, it.key(), it.value(),
+                    ESPEraseModel::Method::Sectors);
+      }
+      return fc->eraseRegions(ops);
+    }
+    if (plan.eraseMethod == ESPEraseModel::Method::Chip) {
+      emit statusMessage(tr("Erasing chip..."), true);
+      journal->clear();
+      util::Status st = fc->eraseChip();
+      if (!st.ok()) return st;
+      if (cache != nullptr) cache->clear();
+      return util::Status::OK;
+    }
+    if (plan.erase.isEmpty()) return util::Status::OK;
+    quint32 total = 0;
+    for (quint32 len : plan.erase) total += len;
+    emit statusMessage(tr("Erasing %1 bytes in %2 regions (%3)...")
+                           .arg(total)
+                           .arg(plan.erase.size())
+                           .arg(ESPEraseModel::methodName(plan.eraseMethod)),
+                       true);
+    QMap<quint32, quint32> ops;
+    for (auto it = plan.erase.constBegin(); it != plan.erase.constEnd(); it++) {
+      addEraseOps(&ops, it.key(), it.value(), plan.eraseMethod);
+    }
+    return fc->eraseRegions(ops);
+  }
+
+  // Adds erase commands for a region to ops, address -> length.
+  static void addEraseOps(QMap<quint32, quint32> *ops, quint32 addr,
+                          quint32 len, ESPEraseModel::Method method) {
+    if (method == ESPEraseModel::Method::Blocks) {
+      (*ops)[addr] = len;
+      return;
+    }
+    // Pieces within a block are erased sector by sector.
+    const quint32 bs = ESPFlasherClient::kFlashBlockSize;
+    const quint32 end = addr + len;
+    while (addr < end) {
+      const quint32 n = std::min(end, (addr / bs + 1) * bs) - addr;
+      (*ops)[addr] = n;
+      addr += n;
+    }
+  }
+
+  // Sectors to erase for writing the images, address -> length. Sectors that
+  // are blank already are left out, if the stub can tell.
+  QMap<quint32, quint32> erasePlan(ESPFlasherClient *fc,
+                                   const QMap<ulong, Image> &images) {
+    QMap<quint32, quint32> result;
+    const quint32 ss = fc->kFlashSectorSize;
+    for (const Image &image : images) {
+      const quint32 len = (image.data.length() + ss - 1) / ss * ss;
+      if (len == 0) continue;
+      if (!fc->canGetBlankMap()) {
+        result[image.addr] = len;
+        continue;
+      }
+      auto br = fc->blankMap(image.addr, len);
+      if (!br.ok()) {
+        qWarning() << "Failed to get blank map:" << br.status();
+        result[image.addr] = len;
+        continue;
+      }
+      const QVector<bool> &blank = br.ValueOrDie();
+      quint32 runAddr = 0, runLen = 0;
+      for (int i = 0; i < blank.size(); i++) {
+        if (!blank[i]) {
+          if (runLen == 0) runAddr = image.addr + i * ss;
+          runLen += ss;
+          continue;
+        }
+        if (runLen > 0) result[runAddr] = runLen;
+        runLen = 0;
+      }
+      if (runLen > 0) result[runAddr] = runLen;
+    }
+    return result;
+  }
+
+  // Whether flash outside images_ is blank, i.e. erasing the whole chip will
+  // not lose anything.
+  bool onlyImagesInFlash(ESPFlasherClient *fc) {
+    const quint32 ss = fc->kFlashSectorSize;
+    QVector<bool> covered(flashSize_ / ss);
+    for (const Image &image : images_) {
+      const int end = (image.addr + image.data.length() + ss - 1) / ss;
+      for (int i = image.addr / ss; i < end && i < covered.size(); i++) {
+        covered[i] = true;
+      }
+    }
+    int i = 0;
+    while (i < covered.size()) {
+      if (covered[i]) {
+        i++;
+        continue;
+      }
+      int end = i;
+      while (end < covered.size() && !covered[end]) end++;
+      if (!fc->canGetBlankMap()) return false;
+      auto br = fc->blankMap(i * ss, (end - i) * ss);
+      if (!br.ok() || br.ValueOrDie().contains(false)) return false;
+      i = end;
+    }
+    return true;
+  }
+
+  // Time to send the images at the current baud rate: at the rate measured
+  // in earlier runs or, until there is one, compression aside.
+  qint64 transferMs(ESPFlasherClient *fc, const QMap<ulong, Image> &images) {
+    qint64 bytes = 0;
+    QMap<ulong, Image> blank;
+    for (const Image &image : splitBlank(images, &blank)) {
+      bytes += image.data.length();
+    }
+    return bytes / writeBytesPerMs(fc);
+  }
+
+  static double writeBytesPerMs(ESPFlasherClient *fc) {
+    const qint64 rate = measuredWriteRate(fc->baudRate());
+    if (rate > 0) return rate / 1000.0;
+    // 10 bits per byte.
+    return std::max(fc->baudRate(), 1) / 10000.0;
+  }
+
+  // Build ID of the firmware for the journal. Backups have none, their
+  // contents are used instead.
+  QString journalBuildId() const {
+    if (!build_id_.isEmpty()) return build_id_;
+    QCryptographicHash h(QCryptographicHash::Md5);
+    for (const Image &image : images_) h.addData(image.data);
+    return QString::fromLatin1(h.result().toHex());
+  }
+
+  // Images split at flash block boundaries.
+  static QMap<ulong, Image> splitImages(const QMap<ulong, Image> &images) {
+    const quint32 bs = ESPFlasherClient::kFlashBlockSize;
+    QMap<ulong, Image> result;
+    for (const Image &image : images) {
+      const ulong end = image.addr + image.data.length();
+      ulong addr = image.addr;
+      while (addr < end) {
+        const ulong next = std::min(end, (addr / bs + 1) * bs);
+        Image part(image);
+        part.addr = addr;
+        part.data = dataView(image.data, addr - image.addr, next - addr);
+        result[addr] = part;
+        addr = next;
+      }
+    }
+    return result;
+  }
+
+  // Images without the sectors they only have 0xFF for, which are there
+  // once the flash is erased. The rest is split at such sectors and trailing
+  // 0xFF is trimmed, padding puts it back. Parts that are left out go to
+  // blank. Images that do not start at a sector boundary are kept whole.
+  static QMap<ulong, Image> splitBlank(const QMap<ulong, Image> &images,
+                                       QMap<ulong, Image> *blank) {
+    const int ss = ESPFlasherClient::kFlashSectorSize;
+    QMap<ulong, Image> result;
+    for (const Image &image : images) {
+      if (image.addr % ss != 0) {
+        result[image.addr] = image;
+        continue;
+      }
+      const QByteArray &data = image.data;
+      auto sectorBlank = [&data, ss](int offset) {
+        const char *p = data.constData() + offset;
+        return std::all_of(p, p + std::min(ss, data.length() - offset),
+                           [](char c) { return c == '\xff'; });
+      };
+      int begin = 0;
+      while (begin < data.length()) {
+        const bool isBlank = sectorBlank(begin);
+        int end = begin + ss;
+        while (end < data.length() && sectorBlank(end) == isBlank) end += ss;
+        end = std::min(end, data.length());
+        int dataEnd = end;
+        while (!isBlank && data[dataEnd - 1] == '\xff') dataEnd--;
+        Image part(image);
+        part.addr = image.addr + begin;
+        part.data = dataView(data, begin, dataEnd - begin);
+        (isBlank ? *blank : result)[part.addr] = part;
+        begin = end;
+      }
+    }
+    return result;
+  }
+
+  // Data as written: padded with 0xFF to a whole number of sectors.
+  // Padding is not stored, the span shares the image data.
+  static FlashSpan padToSector(const QByteArray &data) {
+    return FlashSpan(data, ESPFlasherClient::kFlashSectorSize);
+  }
+
+  // Part of an image's data, without a copy. Images made of these are only
+  // used while images_, where the data comes from, stays as it is.
+  static QByteArray dataView(const QByteArray &data, int offset, int len) {
+    return QByteArray::fromRawData(data.constData() + offset, len);
+  }
+
+  // Images without the parts that the journal says an earlier, interrupted
+  // run has written. All of them are checked with digests; if any does not
+  // match, the journal is discarded and all the images are returned.
+  QMap<ulong, Image> resumeImages(ESPFlasherClient *fc,
+                                  ESPFlashJournal *journal, bool *resumed) {
+    *resumed = false;
+    QMap<ulong, Image> result, done, blank;
+    // Split the way the writes are, blank sectors have been erased already.
+    const auto parts = splitImages(splitBlank(images_, &blank));
+    for (const Image &part : parts) {
+      if (journal->contains(part.addr, padToSector(part.data))) {
+        done[part.addr] = part;
+      } else {
+        result[part.addr] = part;
+      }
+    }
+    if (done.isEmpty()) return images_;
+    // Anything may have been written since, e.g. another build that left
+    // this journal in place, so all of it is checked.
+    QVector<QPair<quint32, quint32>> regions;
+    QVector<QByteArray> expected;
+    for (const Image &part : done) {
+      const FlashSpan data = padToSector(part.data);
+      regions.append(qMakePair(quint32(part.addr), quint32(data.length())));
+      expected.append(data.md5());
+    }
+    auto dr = fc->digests(regions);
+    if (!dr.ok() || dr.ValueOrDie() != expected) {
+      qWarning() << "Flash does not match the journal, starting over";
+      journal->clear();
+      return images_;
+    }
+    // Blank sectors and trimmed 0xFF are not in the parts.
+    int numBytes = 0, blankBytes = 0;
+    for (const Image &part : done) numBytes += part.data.length();
+    for (const Image &image : images_) blankBytes += image.data.length();
+    for (const Image &part : parts) blankBytes -= part.data.length();
+    progress_ += numBytes + blankBytes;
+    reportProgress(progress_);
+    emit statusMessage(tr("Resuming, %1 bytes in %2 blocks already written")
+                           .arg(numBytes)
+                           .arg(done.size()),
+                       true);
+    metrics_["resumed_bytes"] = numBytes;
+    *resumed = true;
+    return result;
+  }
+
+  // Parts of images_ not covered by the written images, i.e. the ones that
+  // dedupImages found to be already in place.
+  QMap<ulong, Image> unwrittenImages(const QMap<ulong, Image> &written) {
+    QMap<ulong, Image> result;
+    auto addPart = [&result](const Image &image, ulong begin, ulong end) {
+      Image part(image);
+      part.addr = begin;
+      part.data = dataView(image.data, begin - image.addr, end - begin);
+      result[begin] = part;
+    };
     for (const auto &image : images_) {
+      const ulong end = image.addr + image.data.length();
+      ulong pos = image.addr;
+      for (auto it = written.lowerBound(image.addr);
+           it != written.end() && it.key() < end; it++) {
+        if (it.key() > pos) addPart(image, pos, it.key());
+        pos = std::max(pos, it.key() + it.value().data.length());
+      }
+      if (pos < end) addPart(image, pos, end);
+    }
+    return result;
+  }
+
+  // What the on-device index lists, empty if there is none or it cannot be
+  // read. *blank tells whether the sector is erased.
+  ESPFlashIndex readFlashIndex(ESPFlasherClient *fc, bool *blank) {
+    *blank = false;
+    auto rr = fc->read(flash_index_addr_, fc->kFlashSectorSize);
+    if (!rr.ok()) {
+      qWarning() << "Failed to read flash index:" << rr.status();
+      return ESPFlashIndex();
+    }
+    const QByteArray &sector = rr.ValueOrDie();
+    *blank = sector.count('\xff') == sector.length();
+    auto ir = ESPFlashIndex::parse(sector);
+    if (!ir.ok()) {
+      qWarning() << "Ignoring flash index:" << ir.status();
+      return ESPFlashIndex();
+    }
+    qInfo() << "Flash index:" << ir.ValueOrDie().regions.size()
+            << "regions of" << ir.ValueOrDie().buildId;
+    return ir.MoveValueOrDie();
+  }
+
+  util::Status writeFlashIndex(ESPFlasherClient *fc) {
+    ESPFlashIndex index;
+    index.buildId = build_id_;
+    const QVector<QByteArray> md5s = imageMd5s(images_);
+    int i = 0;
+    for (const Image &image : images_) {
+      index.add(image.addr, image.data.length(), md5s[i++]);
+    }
+    auto sr = index.serialize();
+    if (!sr.ok()) return sr.status();
+    return fc->write(flash_index_addr_, FlashSpan(sr.ValueOrDie()),
+                     true /* erase */);
+  }
+
+  // Host digests of the image, the precomputed ones if they are of its data.
+  static std::shared_ptr<const FirmwareBundle::Digests> digestsOf(
+      const Image &image) {
+    const int ss = ESPFlasherClient::kFlashSectorSize;
+    if (image.digests != nullptr && image.digests->matches(image.data, ss)) {
+      return image.digests;
+    }
+    return FirmwareBundle::computeDigests(image.data, ss);
+  }
+
+  // MD5 of each image's data, in the order of the map. Images that were
+  // split or merged since the firmware was set are hashed in parallel.
+  static QVector<QByteArray> imageMd5s(const QMap<ulong, Image> &images) {
+    const int ss = ESPFlasherClient::kFlashSectorSize;
+    const QList<Image> list = images.values();
+    QVector<QByteArray> result(list.size());
+    QVector<int> missing;
+    for (int i = 0; i < list.size(); i++) {
+      const auto &d = list[i].digests;
+      if (d != nullptr && d->matches(list[i].data, ss)) {
+        result[i] = d->md5;
+      } else {
+        missing.append(i);
+      }
+    }
+    QByteArray *out = result.data();
+    QtConcurrent::blockingMap(missing, [&list, out](int i) {
+      out[i] = QCryptographicHash::hash(list[i].data, QCryptographicHash::Md5);
+    });
+    return result;
+  }
+
+  util::Status verifyImages(ESPFlasherClient *fc,
+                            const QMap<ulong, Image> &images) {
+    if (images.isEmpty()) return util::Status::OK;
+    emit statusMessage("Verifying...", true);
+    QVector<QPair<quint32, quint32>> regions;
+    for (const auto &image : images) {
+      regions.append(qMakePair(quint32(image.addr),
+                               quint32(image.data.length())));
+    }
+    auto dr = fc->digests(regions);
+    if (!dr.ok()) {
+      return QSP(tr("failed to compute digests of %1 images")
+                     .arg(images.size()),
+                 dr.status());
+    }
+    const QVector<QByteArray> &digests = dr.ValueOrDie();
+    const QVector<QByteArray> hashes = imageMd5s(images);
+    int i = 0;
+    for (const auto &image : images) {
       const ulong addr = image.addr;
       const QByteArray &data = image.data;
-      auto dr = fc->digest(addr, data.length(), 0 /* no block sums */);
-      if (!dr.ok()) {
-        return QSP(tr("failed to compute digest of %1 @ 0x%2")
-                       .arg(data.length())
-                       .arg(addr, 0, 16),
-                   dr.status());
-      }
-      ESPFlasherClient::DigestResult digests = dr.ValueOrDie();
-      const QByteArray &hash =
-          QCryptographicHash::hash(data, QCryptographicHash::Md5);
+      const QByteArray &hash = hashes[i];
+      const QByteArray &digest = digests[i++];
       qDebug() << hex << showbase << addr << data.length() << hash.toHex()
-               << digests.digest.toHex();
-      if (hash != digests.digest) {
+               << digest.toHex();
+      if (hash != digest) {
         return QS(util::error::DATA_LOSS,
                   tr("digest mismatch for image 0x%1").arg(addr, 0, 16));
       } else {
@@ -706,56 +2281,218 @@ class FlasherImpl : public Flasher {
     return util::Status::OK;
   }
 
-  QSerialPort *port_;
+  // Patches from the bundle and from kFlashPatchOption, the latter win.
+  QMap<quint32, QByteArray> allPatchesLocked() const {
+    QMap<quint32, QByteArray> result = bundle_patches_;
+    for (auto it = option_patches_.constBegin();
+         it != option_patches_.constEnd(); it++) {
+      result[it.key()] = it.value();
+    }
+    return result;
+  }
+
+  // Patches must not overlap each other or share sectors with images, which
+  // are written over whole sectors, or with the flash index.
+  util::Status checkPatches(const QMap<quint32, QByteArray> &patches) const {
+    const quint32 ss = ESPFlasherClient::kFlashSectorSize;
+    quint64 end = 0;
+    for (auto it = patches.constBegin(); it != patches.constEnd(); it++) {
+      const quint32 addr = it.key(), len = it.value().length();
+      if (it != patches.constBegin() && addr < end) {
+        return QS(
+            util::error::INVALID_ARGUMENT,
+            tr("patch @ 0x%1 overlaps the previous one").arg(addr, 0, 16));
+      }
+      end = quint64(addr) + len;
+      if (len == 0) continue;
+      if (end > flashSize_) {
+        return QS(util::error::INVALID_ARGUMENT,
+                  tr("patch @ 0x%1 does not fit in flash").arg(addr, 0, 16));
+      }
+      const quint64 first = addr - addr % ss, last = (end + ss - 1) / ss * ss;
+      for (const Image &image : images_) {
+        const quint64 imageEnd =
+            image.addr + padToSector(image.data).length();
+        if (first < imageEnd && image.addr < last) {
+          return QS(util::error::INVALID_ARGUMENT,
+                    tr("patch @ 0x%1 shares a sector with image @ 0x%2")
+                        .arg(addr, 0, 16)
+                        .arg(image.addr, 0, 16));
+        }
+      }
+      if (flash_index_addr_ >= 0 && first <= quint64(flash_index_addr_) &&
+          quint64(flash_index_addr_) < last) {
+        return QS(util::error::INVALID_ARGUMENT,
+                  tr("patch @ 0x%1 is in the flash index sector")
+                      .arg(addr, 0, 16));
+      }
+    }
+    return util::Status::OK;
+  }
+
+  // The stub applies patches itself, older ones get each sector read back,
+  // patched and written whole.
+  util::Status applyPatches(ESPFlasherClient *fc,
+                            const QMap<quint32, QByteArray> &patches) {
+    int bytes = 0;
+    for (const QByteArray &data : patches) bytes += data.length();
+    emit statusMessage(
+        tr("Patching %1 bytes in %2 places...").arg(bytes).arg(patches.size()),
+        true);
+    metrics_["patch_bytes"] = bytes;
+    if (fc->canPatch()) {
+      auto res = fc->patch(patches);
+      if (!res.ok()) return res.status();
+      metrics_["sectors_patched"] = res.ValueOrDie();
+      return util::Status::OK;
+    }
+    const quint32 ss = ESPFlasherClient::kFlashSectorSize;
+    QMap<quint32, QByteArray> sectors, original;
+    for (auto it = patches.constBegin(); it != patches.constEnd(); it++) {
+      const quint32 addr = it.key();
+      for (quint32 off = 0; off < quint32(it.value().length());) {
+        const quint32 sector = (addr + off) / ss * ss;
+        const quint32 n =
+            qMin(quint32(it.value().length()) - off, sector + ss - addr - off);
+        if (!sectors.contains(sector)) {
+          auto rr = fc->read(sector, ss);
+          if (!rr.ok()) {
+            return QSP(tr("failed to read sector @ 0x%1").arg(sector, 0, 16),
+                       rr.status());
+          }
+          sectors[sector] = original[sector] = rr.ValueOrDie();
+        }
+        sectors[sector].replace(addr + off - sector, n,
+                                it.value().constData() + off, n);
+        off += n;
+      }
+    }
+    int written = 0;
+    for (auto it = sectors.constBegin(); it != sectors.constEnd(); it++) {
+      if (it.value() == original[it.key()]) continue;
+      util::Status st = fc->write(it.key(), FlashSpan(it.value()), true);
+      if (!st.ok()) return st;
+      written++;
+    }
+    metrics_["sectors_patched"] = written;
+    return util::Status::OK;
+  }
+
+  util::Status verifyPatches(ESPFlasherClient *fc,
+                             const QMap<quint32, QByteArray> &patches) {
+    for (auto it = patches.constBegin(); it != patches.constEnd(); it++) {
+      auto rr = fc->read(it.key(), it.value().length());
+      if (!rr.ok()) return rr.status();
+      if (rr.ValueOrDie() != it.value()) {
+        return QS(util::error::DATA_LOSS,
+                  tr("mismatch in patch @ 0x%1").arg(it.key(), 0, 16));
+      }
+    }
+    return util::Status::OK;
+  }
+
+  QIODevice *port_;
   Prompter *prompter_;
+  std::shared_ptr<ROMSession> session_;
 
   mutable QMutex lock_;
 
+  // Guards the connection set up by prepare(), which runs without lock_ so
+  // the firmware can be set meanwhile. Taken after lock_.
+  QMutex prepare_lock_;
+  bool prepared_ = false;
+  util::Status prepare_status_;
+  std::unique_ptr<QSerialPort> data_port_;
+  std::unique_ptr<ESPROMClient> own_rom_;
+  ESPROMClient *rom_ = nullptr;
+  std::unique_ptr<ESPFlasherClient> flasher_client_;
+  QByteArray mac_;
+  quint32 prepared_flash_size_ = 0;
+  QElapsedTimer run_timer_;
+
   QMap<ulong, Image> images_;
-  std::unique_ptr<ESPROMClient> rom_;
+  // Parts that are deltas against a base build, by address. Turned into
+  // images_ once the base is confirmed to be on the device.
+  QMap<ulong, FirmwareDelta> deltas_;
   int progress_ = 0;
   quint32 flashSize_ = 0;
   bool erase_chip_ = false;
+  QString build_id_;
+  util::StatusOr<FileManifest> fs_manifest_;
   qint32 override_flash_params_ = -1;
   bool merge_flash_filesystem_ = false;
   QString flashing_port_name_;
   int flashing_speed_ = kDefaultFlashBaudRate;
+  bool flashing_speed_set_ = false;  // Otherwise the adapter's profile says.
+  QList<SerialProfile> serial_profiles_;  // Overrides.
+  bool flashing_speed_auto_ = false;
   bool minimize_writes_ = true;
+  bool compact_fs_ = false;
+  enum class VerifyMode {
+    Full,       // Digest all the images after writing.
+    Unwritten,  // Only the parts that were not written.
+    None,
+  };
+  VerifyMode verify_mode_ = VerifyMode::Unwritten;
+  enum class EraseMode {
+    Auto,    // Whichever ESPEraseModel expects to be the fastest.
+    Inline,  // Stub erases as it writes.
+    Chip,
+    Blocks,
+    Sectors,
+  };
+  EraseMode erase_mode_ = EraseMode::Auto;
+  bool use_flash_cache_ = false;
   ulong spiffs_size_ = 0;
   ulong spiffs_offset_ = 0;
+  // Sector of ESPFlashIndex, -1 if the firmware has none.
+  qint64 flash_index_addr_ = -1;
+  // Bytes to replace in place, by address, see kPatchAttr.
+  QMap<quint32, QByteArray> bundle_patches_;
+  QMap<quint32, QByteArray> option_patches_;  // From kFlashPatchOption.
   QString fs_dump_filename_;
+  QString backup_filename_;
+  // Run metrics, see Flasher::metrics.
+  QVariantMap metrics_;
+  QVariantList phases_;
+  QString phase_;
+  QElapsedTimer phaseTimer_;
+  // images_ holds a backup to be written back as is.
+  bool restore_ = false;
+  // Only work out and report the write plan.
+  bool plan_only_ = false;
 };
 
 class ESP8266HAL : public HAL {
  public:
-  ESP8266HAL(QSerialPort *port) : port_(port) {
+  ESP8266HAL(QIODevice *port)
+      : port_(port), session_(std::make_shared<ROMSession>(port)) {
   }
 
   util::Status probe() const override {
-    ESPROMClient rom(port_, port_);
-
-    if (!rom.connect().ok()) {
+    auto rr = session_->connect();
+    if (!rr.ok()) {
       return QS(util::error::UNAVAILABLE, FLASHING_MSG);
     }
 
-    auto mac = rom.readMAC();
+    auto mac = rr.ValueOrDie()->readMAC();
+    // Probing leaves the device running its firmware, as it found it.
+    session_->release();
     if (!mac.ok()) {
       qDebug() << "Error reading MAC address:" << mac.status();
       return mac.status();
     }
     qInfo() << "MAC address: " << mac.ValueOrDie().toHex();
 
-    rom.softReset();
-
     return util::Status::OK;
   }
 
   util::StatusOr<QString> getMAC() const override {
-    ESPROMClient rom(port_, port_);
-    if (!rom.connect().ok()) {
+    auto rr = session_->connect();
+    if (!rr.ok()) {
       return QS(util::error::UNAVAILABLE, FLASHING_MSG);
     }
-    auto mac = rom.readMAC();
+    auto mac = rr.ValueOrDie()->readMAC();
     if (!mac.ok()) {
       qDebug() << "Error reading MAC address:" << mac.status();
       return mac.status();
@@ -765,7 +2502,7 @@ class ESP8266HAL : public HAL {
 
   std::unique_ptr<Flasher> flasher(Prompter *prompter) const override {
     return std::move(
-        std::unique_ptr<Flasher>(new FlasherImpl(port_, prompter)));
+        std::unique_ptr<Flasher>(new FlasherImpl(port_, prompter, session_)));
   }
 
   std::string name() const override {
@@ -774,20 +2511,26 @@ class ESP8266HAL : public HAL {
 
   util::Status reboot() override {
     // TODO(rojer): Bring flashing data port setting here somehow.
-    ESPROMClient rom(port_, port_);
     // To make sure we actually control things, connect to ROM first.
-    util::Status st = rom.connect();
-    if (!st.ok()) return QSP("failed to communicate to ROM", st);
-    return rom.rebootIntoFirmware();
+    auto rr = session_->connect();
+    if (!rr.ok()) return QSP("failed to communicate to ROM", rr.status());
+    util::Status st = rr.ValueOrDie()->rebootIntoFirmware();
+    session_->invalidate();
+    return st;
+  }
+
+  void release() override {
+    session_->release();
   }
 
  private:
-  QSerialPort *port_;
+  QIODevice *port_;
+  std::shared_ptr<ROMSession> session_;
 };
 
 }  // namespace
 
-std::unique_ptr<::HAL> HAL(QSerialPort *port) {
+std::unique_ptr<::HAL> HAL(QIODevice *port) {
   return std::move(std::unique_ptr<::HAL>(new ESP8266HAL(port)));
 }
 
@@ -907,6 +2650,72 @@ void addOptions(Config *config) {
   opts.append(QCommandLineOption(kFlashEraseChipOption,
                                  "If set, erase entire chip before flashing.",
                                  "<true|false>", "false"));
+  opts.append(QCommandLineOption(
+      kFlashEraseOption,
+      "How to erase flash before writing. auto: pick the fastest way, inline "
+      "or one of the others, based on erase times measured earlier on the "
+      "same flash chip type, chip erase is only used if there is nothing "
+      "else in flash; inline: the flasher erases as it writes and, if it "
+      "can, leaves sectors that already have the right contents alone; chip: "
+      "erase the entire chip; blocks: erase what is about to be written, in "
+      "64K blocks where possible; sectors: same, in 4K sectors.",
+      "<auto|inline|chip|blocks|sectors>", "auto"));
+  opts.append(QCommandLineOption(
+      kFlashBaudRateAutoOption,
+      "If set, start at --flash-baud-rate and switch to the fastest baud rate "
+      "that works with the device. If writes fail verification, lower rates "
+      "are tried.",
+      "<true|false>", "false"));
+  opts.append(QCommandLineOption(
+      kFlashVerifyOption,
+      "How to verify flash contents after writing. full: compute digests of "
+      "all the images; unwritten: only of the parts that were skipped because "
+      "they were already in place, written data is checked by the flasher as "
+      "it goes (full is used with older flashers); none: do not verify.",
+      "<full|unwritten|none>", "unwritten"));
+  opts.append(QCommandLineOption(
+      kFlashCacheOption,
+      "If set, remember what was written to each device (identified by MAC "
+      "address and flash chip ID) and use that instead of reading back flash "
+      "contents when minimizing writes. Contents are still confirmed with a "
+      "digest.",
+      "<true|false>", "false"));
+  opts.append(QCommandLineOption(
+      kCompactFSOption,
+      "If set, when merging file systems and some files need to be updated, "
+      "rebuild the device file system with all the files packed together, so "
+      "the firmware does not need to collect garbage after it boots. Only "
+      "matters when minimizing writes, file systems are rebuilt otherwise.",
+      "<true|false>", "false"));
+  opts.append(QCommandLineOption(
+      kFlashBackupOption,
+      "Instead of flashing firmware, save contents of the whole flash chip to "
+      "the given file.",
+      "file"));
+  opts.append(QCommandLineOption(
+      kFlashRestoreOption,
+      "Instead of flashing firmware, write back a backup made with --" +
+          QString(kFlashBackupOption) +
+          ". Only sectors that differ are written, unless minimizing writes "
+          "is disabled.",
+      "file"));
+  opts.append(QCommandLineOption(
+      kFlashPatchOption,
+      "After flashing, replace bytes at the given addresses with contents of "
+      "the files, keeping the rest of the flash sectors they are in, e.g. "
+      "0x3fb000:id.bin for per-device data. Entries are separated by commas. "
+      "Sectors are only rewritten if they change.",
+      "ADDR:FILE[,...]"));
+  opts.append(QCommandLineOption(
+      kSerialProfilesOption,
+      "Override settings picked for the USB serial adapter. Entries are "
+      "separated by ';', each has the adapter's vendor and product IDs "
+      "followed by settings, e.g. \"1a86:7523 baud=460800 max-baud=921600 "
+      "window=2048 read-block=1024 read-in-flight=4096 latency=2\". baud is "
+      "used unless --" +
+          QString(Flasher::kFlashBaudRateOption) +
+          " is set, max-baud limits automatic selection.",
+      "profiles"));
   config->addOptions(opts);
 }
 
@@ -8,7 +8,7 @@
 
 #include <memory>
 
-#include <QSerialPort>
+#include <QIODevice>
 #include <QString>
 
 #include <common/util/status.h>
@@ -27,7 +27,7 @@ void addOptions(Config *config);
 
 QByteArray makeIDBlock(const QString &domain);
 
-std::unique_ptr<HAL> HAL(QSerialPort *port);
+std::unique_ptr<HAL> HAL(QIODevice *port);
 
 }  // namespace ESP8266
 
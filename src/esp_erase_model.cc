@@ -0,0 +1,198 @@
+#include "esp_erase_model.h"
+
+#include <algorithm>
+
+#include <QSettings>
+#include <QtDebug>
+
+namespace {
+
+const char kSettingsGroup[] = "esp8266/erase";
+
+const quint32 kSectorSize = 4096;
+const quint32 kBlockSize = 65536;
+
+// Typical for the chips found on ESP8266 modules, used until measured.
+const double kTypicalSectorMs = 50;
+const double kTypicalBlockMs = 300;
+// Round trip of an erase command, on top of the erase itself.
+const qint64 kCommandMs = 5;
+
+// Used as timeouts when there are no measurements.
+const int kMaxSectorMs = 400;
+const int kMaxBlockMs = 900;
+const int kMinEraseTimeoutMs = 5000;
+const int kMaxChipMs = 20000;
+
+// Weight of a new sample in the average.
+const double kSampleWeight = 0.3;
+
+// Number of sector and block erases ESPFlasherClient::erase performs, same
+// logic as do_flash_erase in the stub.
+void countErases(quint32 addr, quint32 size, int *numSectors, int *numBlocks) {
+  *numSectors = *numBlocks = 0;
+  while (size > 0 && addr % kBlockSize != 0) {
+    (*numSectors)++;
+    addr += kSectorSize;
+    size -= kSectorSize;
+  }
+  while (size > kBlockSize) {
+    (*numBlocks)++;
+    addr += kBlockSize;
+    size -= kBlockSize;
+  }
+  *numSectors += size / kSectorSize;
+}
+
+void addSample(double *avg, double sample) {
+  *avg = (*avg == 0 ? sample
+                    : *avg * (1 - kSampleWeight) + sample * kSampleWeight);
+}
+
+int withMargin(qint64 expectedMs) {
+  return expectedMs * 2 + 1000;
+}
+
+}  // namespace
+
+ESPEraseModel::ESPEraseModel(quint32 chipID, quint32 flashSize)
+    : chipID_(chipID), flashSize_(flashSize) {
+}
+
+void ESPEraseModel::load() {
+  if (chipID_ == 0) return;
+  QSettings settings;
+  settings.beginGroup(kSettingsGroup);
+  settings.beginGroup(QString("%1").arg(chipID_, 6, 16, QChar('0')));
+  sectorMs_ = settings.value("sectorMs", 0).toDouble();
+  blockMs_ = settings.value("blockMs", 0).toDouble();
+  chipMs_ = settings.value("chipMs", 0).toDouble();
+  qDebug() << "Erase times for chip" << hex << chipID_ << dec << ": sector"
+           << sectorMs_ << "block" << blockMs_ << "chip" << chipMs_;
+}
+
+void ESPEraseModel::save() const {
+  if (chipID_ == 0) return;
+  QSettings settings;
+  settings.beginGroup(kSettingsGroup);
+  settings.beginGroup(QString("%1").arg(chipID_, 6, 16, QChar('0')));
+  if (sectorMs_ > 0) settings.setValue("sectorMs", sectorMs_);
+  if (blockMs_ > 0) settings.setValue("blockMs", blockMs_);
+  if (chipMs_ > 0) settings.setValue("chipMs", chipMs_);
+}
+
+qint64 ESPEraseModel::estimateMs(Method method,
+                                 const QMap<quint32, quint32> &regions) const {
+  qint64 result = 0;
+  switch (method) {
+    case Method::Chip:
+      return chipMs() + kCommandMs;
+    case Method::Blocks:
+      for (auto it = regions.constBegin(); it != regions.constEnd(); it++) {
+        result += eraseMs(it.key(), it.value()) + kCommandMs;
+      }
+      break;
+    case Method::Sectors:
+      for (auto it = regions.constBegin(); it != regions.constEnd(); it++) {
+        // Erased in pieces that do not cross block boundaries.
+        const quint32 numSectors = it.value() / kSectorSize;
+        const quint32 numCommands =
+            (it.key() + it.value() + kBlockSize - 1) / kBlockSize -
+            it.key() / kBlockSize;
+        result += numSectors * sectorMs() + numCommands * kCommandMs;
+      }
+      break;
+  }
+  return result;
+}
+
+ESPEraseModel::Estimate ESPEraseModel::best(
+    const QMap<quint32, quint32> &regions, bool allowChip) const {
+  Estimate result{Method::Blocks, estimateMs(Method::Blocks, regions)};
+  const qint64 sectorsMs = estimateMs(Method::Sectors, regions);
+  if (sectorsMs < result.ms) result = {Method::Sectors, sectorsMs};
+  const qint64 chipMs = estimateMs(Method::Chip, regions);
+  if (allowChip && chipMs < result.ms) result = {Method::Chip, chipMs};
+  return result;
+}
+
+qint64 ESPEraseModel::eraseMs(quint32 addr, quint32 size) const {
+  int numSectors, numBlocks;
+  countErases(addr, size, &numSectors, &numBlocks);
+  return numSectors * sectorMs() + numBlocks * blockMs();
+}
+
+qint64 ESPEraseModel::sectorMs() const {
+  return sectorMs_ > 0 ? sectorMs_ : kTypicalSectorMs;
+}
+
+qint64 ESPEraseModel::blockMs() const {
+  return blockMs_ > 0 ? blockMs_ : kTypicalBlockMs;
+}
+
+qint64 ESPEraseModel::chipMs() const {
+  // Until measured, assume it's no faster than erasing block by block.
+  if (chipMs_ > 0) return chipMs_;
+  return qint64(flashSize_ / kBlockSize) * blockMs();
+}
+
+int ESPEraseModel::eraseTimeoutMs(quint32 addr, quint32 size) const {
+  int numSectors, numBlocks;
+  countErases(addr, size, &numSectors, &numBlocks);
+  const int sectorTimeoutMs =
+      sectorMs_ > 0 ? withMargin(sectorMs_) : kMaxSectorMs;
+  return std::max(kMinEraseTimeoutMs,
+                  numSectors * sectorTimeoutMs + numBlocks * blockTimeoutMs());
+}
+
+int ESPEraseModel::blockTimeoutMs() const {
+  return blockMs_ > 0 ? withMargin(blockMs_) : kMaxBlockMs;
+}
+
+int ESPEraseModel::chipTimeoutMs() const {
+  if (chipMs_ > 0) return withMargin(chipMs_);
+  return std::max(kMaxChipMs, withMargin(chipMs()));
+}
+
+void ESPEraseModel::addEraseSample(quint32 addr, quint32 size, qint64 ms) {
+  int numSectors, numBlocks;
+  countErases(addr, size, &numSectors, &numBlocks);
+  ms = std::max(qint64(0), ms - kCommandMs);
+  if (numBlocks == 0 && numSectors > 0) {
+    addSample(&sectorMs_, double(ms) / numSectors);
+  } else if (numBlocks > 0) {
+    // Sectors are cheap and there are at most 31 of them, an estimate will do.
+    const double blocksMs = std::max(1.0, double(ms - numSectors * sectorMs()));
+    addSample(&blockMs_, blocksMs / numBlocks);
+  }
+}
+
+void ESPEraseModel::addChipSample(qint64 ms) {
+  addSample(&chipMs_, ms);
+}
+
+int ESPEraseModel::numOps(Method method, quint32 addr, quint32 size) {
+  int numSectors, numBlocks;
+  switch (method) {
+    case Method::Chip:
+      return 1;
+    case Method::Blocks:
+      countErases(addr, size, &numSectors, &numBlocks);
+      return numSectors + numBlocks;
+    case Method::Sectors:
+      return size / kSectorSize;
+  }
+  return 0;
+}
+
+QString ESPEraseModel::methodName(Method method) {
+  switch (method) {
+    case Method::Chip:
+      return "chip";
+    case Method::Blocks:
+      return "blocks";
+    case Method::Sectors:
+      return "sectors";
+  }
+  return "";
+}
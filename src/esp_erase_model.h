@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ */
+
+#ifndef CS_MFT_SRC_ESP_ERASE_MODEL_H_
+#define CS_MFT_SRC_ESP_ERASE_MODEL_H_
+
+#include <QMap>
+#include <QString>
+
+// Predicts how long erasing takes on a particular flash chip, to pick the
+// fastest way to erase and to set timeouts. Erase speed varies a lot between
+// chip makes and sizes, so typical numbers are only used until operations
+// have been timed. Measurements are kept in settings, per flash chip ID.
+class ESPEraseModel {
+ public:
+  enum class Method {
+    Chip,
+    Blocks,   // 64K blocks where possible, sectors at unaligned ends.
+    Sectors,  // 4K sectors only.
+  };
+
+  struct Estimate {
+    Method method;
+    qint64 ms;
+  };
+
+  // Chip ID 0 means unknown, nothing is loaded or saved then.
+  ESPEraseModel(quint32 chipID, quint32 flashSize);
+
+  void load();
+  void save() const;
+
+  // Regions are address -> length, sector-aligned.
+  qint64 estimateMs(Method method,
+                    const QMap<quint32, quint32> &regions) const;
+  // Cheapest of region methods or, if allowChip, chip erase.
+  Estimate best(const QMap<quint32, quint32> &regions, bool allowChip) const;
+
+  // Expected time of erasing with ESPFlasherClient::erase, which uses
+  // blocks when the region allows.
+  qint64 eraseMs(quint32 addr, quint32 size) const;
+  qint64 sectorMs() const;
+  qint64 blockMs() const;
+  qint64 chipMs() const;
+
+  // Timeouts follow measurements with a margin and are conservative for
+  // operations that have not been measured yet.
+  int eraseTimeoutMs(quint32 addr, quint32 size) const;
+  int blockTimeoutMs() const;
+  int chipTimeoutMs() const;
+
+  // Measured times of ESPFlasherClient::erase and eraseChip.
+  void addEraseSample(quint32 addr, quint32 size, qint64 ms);
+  void addChipSample(qint64 ms);
+
+  // Number of erase operations the method performs on a region.
+  static int numOps(Method method, quint32 addr, quint32 size);
+
+  static QString methodName(Method method);
+
+ private:
+  const quint32 chipID_;
+  const quint32 flashSize_;
+  // Averages of measured times, 0 if not measured yet.
+  double sectorMs_ = 0;
+  double blockMs_ = 0;
+  double chipMs_ = 0;
+};
+
+#endif /* CS_MFT_SRC_ESP_ERASE_MODEL_H_ */
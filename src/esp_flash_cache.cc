@@ -0,0 +1,102 @@
+#include "esp_flash_cache.h"
+
+#include <QDataStream>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QObject>
+#include <QStandardPaths>
+#include <QtDebug>
+
+#include "esp_flasher_client.h"
+#include "status_qt.h"
+
+namespace {
+
+const quint32 kCacheFileMagic = 0x4d464301;  // "MFC", version 1.
+
+}  // namespace
+
+ESPFlashCache::ESPFlashCache(const QByteArray &mac, quint32 chipID)
+    : mac_(mac), chipID_(chipID) {
+}
+
+QString ESPFlashCache::fileName() const {
+  return QString("%1/esp8266/%2-%3.dat")
+      .arg(QStandardPaths::writableLocation(QStandardPaths::CacheLocation))
+      .arg(QString::fromLatin1(mac_.toHex()))
+      .arg(chipID_, 6, 16, QChar('0'));
+}
+
+util::Status ESPFlashCache::load() {
+  fingerprints_.clear();
+  QFile f(fileName());
+  if (!f.exists()) return util::Status::OK;
+  if (!f.open(QIODevice::ReadOnly)) {
+    return QS(util::error::UNAVAILABLE,
+              QObject::tr("failed to open %1: %2")
+                  .arg(f.fileName())
+                  .arg(f.errorString()));
+  }
+  QDataStream s(&f);
+  quint32 magic = 0;
+  s >> magic;
+  if (magic != kCacheFileMagic) {
+    return QS(util::error::INVALID_ARGUMENT,
+              QObject::tr("%1: invalid format").arg(f.fileName()));
+  }
+  s >> fingerprints_;
+  if (s.status() != QDataStream::Ok) {
+    fingerprints_.clear();
+    return QS(util::error::INVALID_ARGUMENT,
+              QObject::tr("%1: truncated").arg(f.fileName()));
+  }
+  qDebug() << "Loaded" << fingerprints_.size() << "entries from"
+           << f.fileName();
+  return util::Status::OK;
+}
+
+util::Status ESPFlashCache::save() {
+  const QString fn = fileName();
+  QDir().mkpath(QFileInfo(fn).path());
+  QFile f(fn);
+  if (!f.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+    return QS(util::error::UNAVAILABLE, QObject::tr("failed to open %1: %2")
+                                            .arg(fn)
+                                            .arg(f.errorString()));
+  }
+  QDataStream s(&f);
+  s << kCacheFileMagic << fingerprints_;
+  if (s.status() != QDataStream::Ok) {
+    return QS(util::error::UNAVAILABLE,
+              QObject::tr("failed to write %1").arg(fn));
+  }
+  return util::Status::OK;
+}
+
+void ESPFlashCache::invalidate() {
+  QFile::remove(fileName());
+}
+
+void ESPFlashCache::clear() {
+  fingerprints_.clear();
+}
+
+QVector<quint32> ESPFlashCache::lookup(quint32 addr, quint32 size) const {
+  const quint32 ss = ESPFlasherClient::kFlashSectorSize;
+  QVector<quint32> result;
+  for (quint32 a = addr; a < addr + size; a += ss) {
+    auto it = fingerprints_.find(a);
+    if (it == fingerprints_.end()) return QVector<quint32>();
+    result.push_back(it.value());
+  }
+  return result;
+}
+
+void ESPFlashCache::update(quint32 addr, const QByteArray &data) {
+  const quint32 ss = ESPFlasherClient::kFlashSectorSize;
+  const QVector<quint32> fps = ESPFlasherClient::fingerprintData(data, ss);
+  for (int i = 0; i < fps.size(); i++) {
+    fingerprints_[addr + i * ss] = fps[i];
+  }
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ */
+
+#ifndef CS_MFT_SRC_ESP_FLASH_CACHE_H_
+#define CS_MFT_SRC_ESP_FLASH_CACHE_H_
+
+#include <QByteArray>
+#include <QMap>
+#include <QString>
+#include <QVector>
+
+#include <common/util/status.h>
+
+// Remembers what was last written to the flash of a particular device, as
+// CRC32 fingerprints of flash sectors (same as
+// ESPFlasherClient::fingerprintData). Devices are identified by MAC address
+// and flash chip ID. Entries are stored on disk, in the user's cache
+// directory.
+//
+// Contents of a device can change behind our back, so the cache can only
+// suggest which sectors are already in place, this needs to be confirmed.
+class ESPFlashCache {
+ public:
+  ESPFlashCache(const QByteArray &mac, quint32 chipID);
+
+  // Loads the entry, if there is one. Missing entry is not an error.
+  util::Status load();
+  util::Status save();
+
+  // Removes the entry from disk, in-memory contents are kept. Used before
+  // modifying flash, so an interrupted write leaves no stale entry behind.
+  void invalidate();
+
+  // Forgets contents of the whole device, e.g. after erasing the chip.
+  void clear();
+
+  // Returns fingerprints of the sectors covering the region, or an empty
+  // vector if any of them is not known. addr must be sector-aligned.
+  QVector<quint32> lookup(quint32 addr, quint32 size) const;
+
+  // Records data as written at addr, which must be sector-aligned.
+  void update(quint32 addr, const QByteArray &data);
+
+ private:
+  QString fileName() const;
+
+  const QByteArray mac_;
+  const quint32 chipID_;
+  QMap<quint32, quint32> fingerprints_;  // Sector address -> CRC32.
+};
+
+#endif /* CS_MFT_SRC_ESP_FLASH_CACHE_H_ */
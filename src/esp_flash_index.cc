@@ -0,0 +1,108 @@
+#include "esp_flash_index.h"
+
+#include <QDataStream>
+#include <QObject>
+
+#include <common/util/error_codes.h>
+
+#include "crc32.h"
+#include "esp_flasher_client.h"
+#include "status_qt.h"
+
+namespace {
+
+const char kMagic[] = "MFTI";
+const int kMagicLen = sizeof(kMagic) - 1;
+const quint8 kVersion = 1;
+const int kMD5Len = 16;
+
+}  // namespace
+
+// static
+util::StatusOr<ESPFlashIndex> ESPFlashIndex::parse(const QByteArray &sector) {
+  ESPFlashIndex index;
+  if (sector.count('\xff') == sector.length()) return index;
+  const util::Status invalid =
+      QS(util::error::DATA_LOSS, QObject::tr("not a valid flash index"));
+  if (!sector.startsWith(kMagic)) return invalid;
+  QDataStream s(sector);
+  s.setByteOrder(QDataStream::LittleEndian);
+  s.skipRawData(kMagicLen);
+  quint8 version = 0;
+  s >> version;
+  if (version != kVersion) {
+    return QS(util::error::DATA_LOSS,
+              QObject::tr("unsupported flash index version %1").arg(version));
+  }
+  s.skipRawData(3);
+  quint32 len = 0;
+  s >> len;
+  if (s.status() != QDataStream::Ok || len > quint32(sector.length())) {
+    return invalid;
+  }
+  QByteArray buildId(len, 0);
+  s.readRawData(buildId.data(), len);
+  index.buildId = QString::fromUtf8(buildId);
+  quint32 n = 0;
+  s >> n;
+  if (s.status() != QDataStream::Ok || n > quint32(sector.length())) {
+    return invalid;
+  }
+  for (quint32 i = 0; i < n; i++) {
+    quint32 addr = 0;
+    Region r;
+    r.md5.resize(kMD5Len);
+    s >> addr >> r.length;
+    s.readRawData(r.md5.data(), kMD5Len);
+    index.regions[addr] = r;
+  }
+  const int end = s.device()->pos();
+  quint32 crc = 0;
+  s >> crc;
+  if (s.status() != QDataStream::Ok ||
+      crc != CRC32::update(0, sector.constData(), end)) {
+    return invalid;
+  }
+  return index;
+}
+
+util::StatusOr<QByteArray> ESPFlashIndex::serialize() const {
+  QByteArray result;
+  QDataStream s(&result, QIODevice::WriteOnly);
+  s.setByteOrder(QDataStream::LittleEndian);
+  s.writeRawData(kMagic, kMagicLen);
+  s << kVersion << quint8(0) << quint8(0) << quint8(0);
+  const QByteArray buildIdUtf8 = buildId.toUtf8();
+  s << quint32(buildIdUtf8.length());
+  s.writeRawData(buildIdUtf8.constData(), buildIdUtf8.length());
+  s << quint32(regions.size());
+  for (auto it = regions.constBegin(); it != regions.constEnd(); it++) {
+    s << it.key() << it.value().length;
+    s.writeRawData(it.value().md5.constData(), kMD5Len);
+  }
+  s << CRC32::update(0, result.constData(), result.length());
+  const int size = ESPFlasherClient::kFlashSectorSize;
+  if (result.length() > size) {
+    return QS(util::error::OUT_OF_RANGE,
+              QObject::tr("%1 regions do not fit in a flash index")
+                  .arg(regions.size()));
+  }
+  return result.append(QByteArray(size - result.length(), '\xff'));
+}
+
+bool ESPFlashIndex::isEmpty() const {
+  return regions.isEmpty();
+}
+
+bool ESPFlashIndex::contains(quint32 addr, quint32 length,
+                             const QByteArray &md5) const {
+  auto it = regions.constFind(addr);
+  return it != regions.constEnd() && it->length == length && it->md5 == md5;
+}
+
+void ESPFlashIndex::add(quint32 addr, quint32 length, const QByteArray &md5) {
+  Region r;
+  r.length = length;
+  r.md5 = md5.left(kMD5Len);
+  regions[addr] = r;
+}
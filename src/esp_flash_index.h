@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ */
+
+#ifndef CS_MFT_SRC_ESP_FLASH_INDEX_H_
+#define CS_MFT_SRC_ESP_FLASH_INDEX_H_
+
+#include <QByteArray>
+#include <QMap>
+#include <QString>
+
+#include <common/util/statusor.h>
+
+// What was written to flash by the last successful run, kept in a flash
+// sector of the device itself (see the flash_index_addr manifest attribute).
+// Unlike ESPFlashCache, it travels with the device, so any host can tell
+// which regions are in place by reading one sector.
+//
+// Format, little-endian: "MFTI", a version byte, 3 reserved bytes, the
+// length and bytes of the build ID, the number of regions and, for each of
+// them, address, length and MD5 of the data. Followed by a CRC-32 of all of
+// the above. The rest of the sector is 0xFF.
+class ESPFlashIndex {
+ public:
+  struct Region {
+    quint32 length = 0;
+    QByteArray md5;
+  };
+
+  // Blank sector gives an empty index, anything else that is not an index
+  // is an error.
+  static util::StatusOr<ESPFlashIndex> parse(const QByteArray &sector);
+  // One sector, padded with 0xFF. Fails if the regions do not fit.
+  util::StatusOr<QByteArray> serialize() const;
+
+  bool isEmpty() const;
+  // True if data of the given MD5 was written at addr.
+  bool contains(quint32 addr, quint32 length, const QByteArray &md5) const;
+  void add(quint32 addr, quint32 length, const QByteArray &md5);
+
+  QString buildId;
+  QMap<quint32, Region> regions;  // By address.
+};
+
+#endif /* CS_MFT_SRC_ESP_FLASH_INDEX_H_ */
@@ -0,0 +1,80 @@
+#include "esp_flash_journal.h"
+
+#include <QCryptographicHash>
+#include <QSettings>
+#include <QStringList>
+#include <QtDebug>
+
+#if (QT_VERSION < QT_VERSION_CHECK(5, 5, 0))
+#define qInfo qWarning
+#endif
+
+namespace {
+
+const char kSettingsGroup[] = "esp8266/journal";
+
+QByteArray md5(const QByteArray &data) {
+  return QCryptographicHash::hash(data, QCryptographicHash::Md5);
+}
+
+}  // namespace
+
+ESPFlashJournal::ESPFlashJournal(const QString &device, const QString &build)
+    // Port names have slashes, which QSettings treats as group separators.
+    : key_(QString::fromLatin1(md5((device + "|" + build).toUtf8()).toHex())) {
+}
+
+void ESPFlashJournal::load() {
+  regions_.clear();
+  QSettings settings;
+  settings.beginGroup(kSettingsGroup);
+  // Entries are "addr:len:md5", in hex.
+  for (const QString &e : settings.value(key_).toStringList()) {
+    const QStringList parts = e.split(':');
+    if (parts.size() != 3) continue;
+    bool ok1, ok2;
+    const quint32 addr = parts[0].toUInt(&ok1, 16);
+    const quint32 len = parts[1].toUInt(&ok2, 16);
+    const QByteArray digest = QByteArray::fromHex(parts[2].toLatin1());
+    if (!ok1 || !ok2 || digest.length() != 16) continue;
+    regions_[addr] = qMakePair(len, digest);
+  }
+  if (!regions_.isEmpty()) {
+    qInfo() << "Journal has" << regions_.size() << "regions written earlier";
+  }
+}
+
+void ESPFlashJournal::add(quint32 addr, const FlashSpan &data) {
+  regions_[addr] = qMakePair(data.length(), data.md5());
+  save();
+}
+
+bool ESPFlashJournal::contains(quint32 addr, const FlashSpan &data) const {
+  auto it = regions_.find(addr);
+  return it != regions_.end() && it->first == data.length() &&
+         it->second == data.md5();
+}
+
+bool ESPFlashJournal::isEmpty() const {
+  return regions_.isEmpty();
+}
+
+void ESPFlashJournal::clear() {
+  regions_.clear();
+  QSettings settings;
+  settings.beginGroup(kSettingsGroup);
+  settings.remove(key_);
+}
+
+void ESPFlashJournal::save() const {
+  QStringList entries;
+  for (auto it = regions_.constBegin(); it != regions_.constEnd(); it++) {
+    entries << QString("%1:%2:%3")
+                   .arg(it.key(), 0, 16)
+                   .arg(it->first, 0, 16)
+                   .arg(QString::fromLatin1(it->second.toHex()));
+  }
+  QSettings settings;
+  settings.beginGroup(kSettingsGroup);
+  settings.setValue(key_, entries);
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ */
+
+#ifndef CS_MFT_SRC_ESP_FLASH_JOURNAL_H_
+#define CS_MFT_SRC_ESP_FLASH_JOURNAL_H_
+
+#include <QByteArray>
+#include <QMap>
+#include <QPair>
+#include <QString>
+
+#include "flash_span.h"
+
+// Records which regions of a firmware have been written to a device and
+// confirmed by the flasher's digest, so an interrupted run can be resumed
+// instead of starting over. Entries are kept in settings, keyed by device
+// (MAC address, or port if it is not known) and firmware build, and removed
+// once a run completes.
+class ESPFlashJournal {
+ public:
+  ESPFlashJournal(const QString &device, const QString &build);
+
+  void load();
+
+  // Records data as written at addr. Saved right away, the run may not get
+  // to finish.
+  void add(quint32 addr, const FlashSpan &data);
+
+  // Whether exactly this data has been recorded as written at addr.
+  bool contains(quint32 addr, const FlashSpan &data) const;
+
+  bool isEmpty() const;
+
+  // Forgets all the regions and removes the entry.
+  void clear();
+
+ private:
+  void save() const;
+
+  QString key_;
+  QMap<quint32, QPair<quint32, QByteArray>> regions_;  // addr -> len, MD5
+};
+
+#endif /* CS_MFT_SRC_ESP_FLASH_JOURNAL_H_ */
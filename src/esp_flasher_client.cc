@@ -1,14 +1,30 @@
 #include "esp_flasher_client.h"
 
+#include <algorithm>
+#include <cstring>
+
+#include <QBuffer>
 #include <QCryptographicHash>
 #include <QDataStream>
+#include <QElapsedTimer>
 #include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMap>
 #include <QObject>
+#include <QPair>
 
+#include "crc32.h"
+#include "flasher.h"
+#include "log.h"
 #include "serial.h"
+#include "serial_trace.h"
 #include "slip.h"
 #include "status_qt.h"
 
+#define MINIZ_HEADER_FILE_ONLY
+#include "common/miniz.c"
+
 #if (QT_VERSION < QT_VERSION_CHECK(5, 5, 0))
 #define qInfo qWarning
 #endif
@@ -22,7 +38,40 @@ const quint32 flashBlockEraseTimeMs = 900;
 const quint32 flashEraseMinTimeoutMs = 5000;
 const quint32 flashChipEraseTimeMs = 20000;
 
-const quint32 flashReadBlockSize = 1024;
+// Block size used by stubs that do not support windowed reads.
+const quint32 flashReadLegacyBlockSize = 1024;
+
+// Older stubs buffer up to 6K of data, 1K is written at a time.
+const quint32 flashWriteDefaultBufferSize = 6144;
+const quint32 flashWriteChunkSize = 1024;
+// Pieces of padding are made up this big to be compressed.
+const quint32 deflateInputChunkSize = 64 * 1024;
+
+// Stub waits this long for each packet at the new rate (see CMD_SET_BAUD_RATE).
+const int setBaudRateStubTimeoutMs = 500;
+
+const char kFlasherStub[] = ":/esp8266/stub_flasher.json";
+const char kLoaderStub[] = ":/esp8266/stub_loader.json";
+
+// Contents of a stub resource, empty if there is no such resource. Read on
+// first use and kept for the rest of the process, every device connects with
+// the same stubs.
+const QByteArray &stubResource(const char *name) {
+  struct Stubs {
+    Stubs() {
+      for (const char *n : {kFlasherStub, kLoaderStub}) {
+        QFile f(n);
+        if (f.open(QIODevice::ReadOnly)) data[n] = f.readAll();
+      }
+    }
+    QMap<QString, QByteArray> data;
+  };
+  // Initialized once, even if devices connect on several threads at once.
+  static const Stubs stubs;
+  static const QByteArray empty;
+  auto it = stubs.data.constFind(name);
+  return it != stubs.data.constEnd() ? *it : empty;
+}
 
 QByteArray cmdByte(enum stub_cmd cmd) {
   QByteArray result;
@@ -30,6 +79,41 @@ QByteArray cmdByte(enum stub_cmd cmd) {
   return result;
 }
 
+// Compresses the spans as a single stream, the same way mz_compress2 would
+// compress them concatenated. Input is fed a piece at a time, so neither the
+// concatenation nor the padding is ever made.
+util::StatusOr<QByteArray> deflate(const QVector<FlashSpan> &spans) {
+  mz_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  int st = mz_deflateInit(&zs, MZ_BEST_COMPRESSION);
+  if (st != MZ_OK) {
+    return QS(util::error::INTERNAL, QObject::tr("mz_deflateInit: %1").arg(st));
+  }
+  mz_ulong len = 0;
+  for (const FlashSpan &span : spans) len += span.length();
+  QByteArray zdata(mz_deflateBound(&zs, len), 0);
+  zs.next_out = reinterpret_cast<unsigned char *>(zdata.data());
+  zs.avail_out = zdata.length();
+  for (const FlashSpan &span : spans) {
+    for (quint32 offset = 0; offset < span.length() && st == MZ_OK;
+         offset += deflateInputChunkSize) {
+      const QByteArray in = span.bytes(offset, deflateInputChunkSize);
+      zs.next_in = reinterpret_cast<const unsigned char *>(in.constData());
+      zs.avail_in = in.length();
+      st = mz_deflate(&zs, MZ_NO_FLUSH);
+      // Output is sized for all of it, the input is consumed in one go.
+      if (st == MZ_OK && zs.avail_in > 0) st = MZ_BUF_ERROR;
+    }
+  }
+  if (st == MZ_OK) st = mz_deflate(&zs, MZ_FINISH);
+  mz_deflateEnd(&zs);
+  if (st != MZ_STREAM_END) {
+    return QS(util::error::INTERNAL, QObject::tr("mz_deflate: %1").arg(st));
+  }
+  zdata.truncate(zs.total_out);
+  return zdata;
+}
+
 }  // namespace
 
 ESPFlasherClient::ESPFlasherClient(ESPROMClient *rom) : rom_(rom) {
@@ -41,45 +125,219 @@ ESPFlasherClient::~ESPFlasherClient() {
 
 const quint32 ESPFlasherClient::kFlashSectorSize = 4096;
 const quint32 ESPFlasherClient::kFlashBlockSize = 65536;
+const quint32 ESPFlasherClient::kFlashReadMaxBlockSize = 4096;
+const quint32 ESPFlasherClient::kFlashReadDefaultBlockSize = 4096;
+const quint32 ESPFlasherClient::kFlashReadDefaultMaxInFlight = 4 * 4096;
 
 util::Status ESPFlasherClient::connect(qint32 baudRate) {
-  const QString prefix = tr("ESPFlasherClient::connect(%1): ").arg(baudRate);
-  qDebug() << prefix;
+  const LazyPrefix prefix =
+      LazyPrefix("ESPFlasherClient::connect(%1): ").arg(baudRate);
+  qCDebug(Log::proto) << prefix;
   if (!rom_->connected()) {
     return util::Status(util::error::FAILED_PRECONDITION,
                         "ESPROMClient not connected");
   }
 
-  if (baudRate == rom_->data_port()->baudRate()) baudRate = 0;  // Don't change
+  if (baudRate == ::baudRate(rom_->data_port())) baudRate = 0;  // Don't change
 
-  QFile f(":/esp8266/stub_flasher.json");
-  if (!f.open(QIODevice::ReadOnly)) {
+  const QByteArray &stub = stubResource(kFlasherStub);
+  if (stub.isEmpty()) {
     return util::Status(util::error::UNAVAILABLE, "Failed to open stub");
   }
-  util::Status st = rom_->runStub(f.readAll(), {quint32(baudRate)});
-  if (!st.ok()) return QSP(prefix + "runStub failed", st);
+  util::Status st;
+  const QByteArray &loader = stubResource(kLoaderStub);
+  if (baudRate > 0 && !loader.isEmpty()) {
+    st = runStubWithLoader(loader, stub, baudRate);
+    if (!st.ok()) return QSP(prefix + "failed to load stub", st);
+  } else {
+    st = rom_->runStub(stub, {quint32(baudRate)});
+    if (!st.ok()) return QSP(prefix + "runStub failed", st);
 
-  if (baudRate > 0) {
-    oldBaudRate_ = rom_->data_port()->baudRate();
-    st = setSpeed(rom_->data_port(), baudRate);
-    if (!st.ok()) return QSP(prefix + "failed to set baud rate", st);
+    if (baudRate > 0) {
+      oldBaudRate_ = ::baudRate(rom_->data_port());
+      st = setSpeed(rom_->data_port(), baudRate);
+      if (!st.ok()) return QSP(prefix + "failed to set baud rate", st);
+    }
   }
 
-  auto res = SLIP::recv(rom_->data_port());
+  auto res = recv();
   if (!res.ok()) return QSP(prefix + "failed to read hello", res.status());
 
-  const QString greeting = QString::fromLatin1(res.ValueOrDie());
+  const QByteArray greeting = res.MoveValueOrDie();
 
-  if (greeting != "OHAI") {
+  if (!greeting.startsWith("OHAI")) {
     return QS(util::error::INTERNAL,
-              prefix + tr("unexpected greeting: %1").arg(greeting));
+              prefix + tr("unexpected greeting: %1")
+                           .arg(QString::fromLatin1(greeting.toHex())));
   }
 
-  qInfo() << "Connected to flasher";
+  // Older stubs only send the greeting.
+  stubVersion_ = 0;
+  quint32 rxBufSize = flashWriteDefaultBufferSize;
+  if (greeting.length() >= 8) {
+    QDataStream s(greeting.mid(4));
+    s.setByteOrder(QDataStream::LittleEndian);
+    s >> stubVersion_;
+    // Version 7+ also reports the size of its write receive buffer.
+    if (greeting.length() >= 12) s >> rxBufSize;
+  }
+  if (rxBufSize <= flashWriteChunkSize) rxBufSize = flashWriteDefaultBufferSize;
+  writeWindowSize_ = rxBufSize - flashWriteChunkSize;
+  setMaxWriteWindow(maxWriteWindowSize_);
 
+  qInfo() << "Connected to flasher, version" << stubVersion_
+          << "write window" << writeWindowSize_;
   return util::Status::OK;
 }
 
+util::Status ESPFlasherClient::setBaudRate(qint32 baudRate) {
+  const LazyPrefix prefix =
+      LazyPrefix("ESPFlasherClient::setBaudRate(%1): ").arg(baudRate);
+  qCDebug(Log::proto) << prefix;
+  if (!canSetBaudRate()) {
+    return QS(util::error::FAILED_PRECONDITION,
+              prefix + tr("not supported by the stub (version %1)")
+                           .arg(stubVersion_));
+  }
+  QIODevice *port = rom_->data_port();
+  const qint32 curBaudRate = ::baudRate(port);
+  if (baudRate == curBaudRate) return util::Status::OK;
+  QByteArray args;
+  QDataStream s(&args, QIODevice::WriteOnly);
+  s.setByteOrder(QDataStream::LittleEndian);
+  s << quint32(baudRate);
+  util::Status st = sendCmd(CMD_SET_BAUD_RATE, args, prefix);
+  if (!st.ok()) return st;
+  auto res = recv();
+  if (!res.ok()) return QSP(prefix + "failed to read response", res.status());
+  if (res.ValueOrDie().length() != 4) {
+    return QS(util::error::INVALID_ARGUMENT,
+              prefix + tr("rejected, code: %1")
+                           .arg(QString::fromLatin1(res.ValueOrDie().toHex())));
+  }
+  st = setSpeed(port, baudRate);
+  if (st.ok()) {
+    const QByteArray probe = randomBytes(16);
+    clearInput(port);
+    st = SLIP::send(port, probe);
+    if (st.ok()) res = recv(setBaudRateStubTimeoutMs);
+    if (st.ok() && res.ok() && res.ValueOrDie() == probe) {
+      st = SLIP::send(port, "OHAI");
+      res = recv(setBaudRateStubTimeoutMs);
+      if (st.ok() && res.ok() && res.ValueOrDie() == QByteArray(1, '\x00')) {
+        if (oldBaudRate_ == 0) oldBaudRate_ = curBaudRate;
+        qInfo() << "Flasher baud rate is now" << baudRate;
+        return util::Status::OK;
+      }
+    }
+  }
+  // The stub goes back to the old rate when the check fails.
+  qWarning() << prefix << "link check failed, going back to" << curBaudRate;
+  st = setSpeed(port, curBaudRate);
+  if (!st.ok()) return QSP(prefix + "failed to restore baud rate", st);
+  clearInput(port);
+  res = recv(setBaudRateStubTimeoutMs * 3);
+  if (!res.ok()) {
+    return QSP(prefix + "lost communication with the stub", res.status());
+  }
+  return QS(util::error::UNAVAILABLE, prefix + tr("link check failed"));
+}
+
+util::StatusOr<qint32> ESPFlasherClient::negotiateBaudRate(
+    const QVector<qint32> &candidates) {
+  baudRates_ = candidates;
+  std::sort(baudRates_.begin(), baudRates_.end());
+  for (qint32 baudRate : baudRates_) {
+    if (baudRate <= ::baudRate(rom_->data_port())) continue;
+    util::Status st = setBaudRate(baudRate);
+    if (!st.ok()) {
+      qInfo() << "Baud rate" << baudRate << "does not work:" << st;
+      if (st.error_code() != util::error::UNAVAILABLE) return st;
+      break;
+    }
+  }
+  return ::baudRate(rom_->data_port());
+}
+
+util::Status ESPFlasherClient::lowerBaudRate() {
+  const qint32 curBaudRate = ::baudRate(rom_->data_port());
+  for (int i = baudRates_.size() - 1; i >= 0; i--) {
+    if (baudRates_[i] >= curBaudRate) continue;
+    util::Status st = setBaudRate(baudRates_[i]);
+    if (st.ok() || st.error_code() != util::error::UNAVAILABLE) return st;
+  }
+  return QS(util::error::OUT_OF_RANGE,
+            tr("no usable baud rate below %1").arg(curBaudRate));
+}
+
+util::Status ESPFlasherClient::runStubWithLoader(const QByteArray &loaderJSON,
+                                                const QByteArray &stubJSON,
+                                                qint32 baudRate) {
+  QIODevice *port = rom_->data_port();
+  util::Status st = rom_->runStub(loaderJSON, {quint32(baudRate)});
+  if (!st.ok()) return QSP("failed to run loader", st);
+  oldBaudRate_ = ::baudRate(port);
+  st = setSpeed(port, baudRate);
+  if (!st.ok()) return QSP("failed to set baud rate", st);
+  auto res = recv();
+  if (!res.ok()) return QSP("failed to read loader greeting", res.status());
+  QDataStream gs(res.ValueOrDie());
+  gs.setByteOrder(QDataStream::LittleEndian);
+  quint32 greeting = 0;
+  gs >> greeting;
+  if (greeting != STUB_LOADER_GREETING) {
+    return QS(util::error::INTERNAL,
+              tr("unexpected loader greeting: %1")
+                  .arg(QString::fromLatin1(res.ValueOrDie().toHex())));
+  }
+
+  const QJsonObject stub = QJsonDocument::fromJson(stubJSON).object();
+  // Baud rate has already been set by the loader.
+  QByteArray code;
+  QDataStream cs(&code, QIODevice::WriteOnly);
+  cs.setByteOrder(QDataStream::LittleEndian);
+  cs << quint32(0);
+  code.append(QByteArray::fromHex(stub["code"].toString().toLatin1()));
+  QVector<QPair<quint32, QByteArray>> segments;
+  segments.append(
+      qMakePair(quint32(stub["data_start"].toDouble()),
+                QByteArray::fromHex(stub["data"].toString().toLatin1())));
+  segments.append(qMakePair(quint32(stub["params_start"].toDouble()), code));
+  for (auto &seg : segments) {
+    QByteArray &data = seg.second;
+    if (data.isEmpty()) continue;
+    while (data.length() % 4 != 0) data.append('\x00');
+    QByteArray hdr;
+    QDataStream hs(&hdr, QIODevice::WriteOnly);
+    hs.setByteOrder(QDataStream::LittleEndian);
+    hs << seg.first << quint32(data.length());
+    st = SLIP::send(port, hdr);
+    const int ps = STUB_LOADER_PACKET_SIZE;
+    for (int i = 0; st.ok() && i < data.length(); i += ps) {
+      st = SLIP::send(port, data.mid(i, ps));
+    }
+    if (!st.ok()) return QSP("failed to send segment", st);
+    res = recv();
+    if (!res.ok()) return QSP("failed to read segment digest", res.status());
+    if (res.ValueOrDie() !=
+        QCryptographicHash::hash(data, QCryptographicHash::Md5)) {
+      return QS(util::error::DATA_LOSS,
+                tr("segment @ 0x%1 digest mismatch: %2")
+                    .arg(seg.first, 0, 16)
+                    .arg(QString::fromLatin1(res.ValueOrDie().toHex())));
+    }
+  }
+  QByteArray jump;
+  QDataStream js(&jump, QIODevice::WriteOnly);
+  js.setByteOrder(QDataStream::LittleEndian);
+  js << quint32(stub["entry"].toDouble()) << quint32(0);
+  return SLIP::send(port, jump);
+}
+
+qint32 ESPFlasherClient::baudRate() const {
+  return ::baudRate(rom_->data_port());
+}
+
 util::Status ESPFlasherClient::disconnect() {
   if (oldBaudRate_ > 0) {
     util::Status st = setSpeed(rom_->data_port(), oldBaudRate_);
@@ -89,96 +347,400 @@ util::Status ESPFlasherClient::disconnect() {
   return util::Status::OK;
 }
 
+int ESPFlasherClient::eraseTimeoutMs(quint32 addr, quint32 size) const {
+  if (eraseModel_ != nullptr) return eraseModel_->eraseTimeoutMs(addr, size);
+  return std::max(flashEraseMinTimeoutMs,
+                  flashBlockEraseTimeMs * (size / flashBlockSize + 1));
+}
+
 util::Status ESPFlasherClient::erase(quint32 addr, quint32 size) {
-  const QString prefix =
-      tr("ESPFlasherClient::erase(0x%1, %2): ").arg(addr, 0, 16).arg(size);
-  qDebug() << prefix;
-  util::Status st = SLIP::send(rom_->data_port(), cmdByte(CMD_FLASH_ERASE));
-  if (!st.ok()) return QSP(prefix + "command write failed", st);
+  const LazyPrefix prefix =
+      LazyPrefix("ESPFlasherClient::erase(0x%1, %2): ")
+          .arg(addr, 16)
+          .arg(size);
+  qCDebug(Log::proto) << prefix;
   QByteArray args;
   QDataStream s(&args, QIODevice::WriteOnly);
   s.setByteOrder(QDataStream::LittleEndian);
   s << addr << size;
+  util::Status st = sendCmd(CMD_FLASH_ERASE, args, prefix);
+  if (!st.ok()) return st;
+  QElapsedTimer t;
+  t.start();
+  auto res = recv(eraseTimeoutMs(addr, size));
+  if (!res.ok()) return QSP(prefix + "failed to read response", res.status());
+  if (res.ValueOrDie() != QByteArray(1, '\x00')) {
+    return QS(util::error::UNAVAILABLE,
+              prefix + tr("failed, code: %1")
+                           .arg(QString::fromLatin1(res.ValueOrDie().toHex())));
+  }
+  qCDebug(Log::proto) << prefix << "took" << t.elapsed() << "ms";
+  if (eraseModel_ != nullptr) {
+    eraseModel_->addEraseSample(addr, size, t.elapsed());
+  }
+  return util::Status::OK;
+}
+
+util::Status ESPFlasherClient::eraseRegions(
+    const QMap<quint32, quint32> &regions) {
+  const LazyPrefix prefix =
+      LazyPrefix("ESPFlasherClient::eraseRegions(%1): ").arg(regions.size());
+  if (!canBatch()) {
+    for (auto it = regions.constBegin(); it != regions.constEnd(); it++) {
+      util::Status st = erase(it.key(), it.value());
+      if (!st.ok()) return st;
+    }
+    return util::Status::OK;
+  }
+  qCDebug(Log::proto) << prefix;
+  QVector<QPair<quint32, quint32>> list;
+  for (auto it = regions.constBegin(); it != regions.constEnd(); it++) {
+    list.append(qMakePair(it.key(), it.value()));
+  }
+  return batch(CMD_FLASH_ERASE, list, prefix).status();
+}
+
+util::Status ESPFlasherClient::sendCmd(enum stub_cmd cmd,
+                                       const QByteArray &args,
+                                       const LazyPrefix &prefix) {
+  cmdTimer_.start();
+  pendingCmd_ = cmd;
+  // Each frame is a write completion to wait for, at least one USB frame.
+  if (canBatch() || args.isEmpty()) {
+    util::Status st = SLIP::send(rom_->data_port(), cmdByte(cmd) + args);
+    if (!st.ok()) return QSP(prefix + "command write failed", st);
+    return util::Status::OK;
+  }
+  util::Status st = SLIP::send(rom_->data_port(), cmdByte(cmd));
+  if (!st.ok()) return QSP(prefix + "command write failed", st);
   st = SLIP::send(rom_->data_port(), args);
   if (!st.ok()) return QSP(prefix + "arg write failed", st);
-  const int timeoutMs =
-      std::max(flashEraseMinTimeoutMs,
-               flashBlockEraseTimeMs * (size / flashBlockSize + 1));
-  auto res = SLIP::recv(rom_->data_port(), timeoutMs);
-  if (!res.ok()) return QSP(prefix + "failed to read response", res.status());
   return util::Status::OK;
 }
 
-util::Status ESPFlasherClient::write(quint32 addr, QByteArray data,
-                                     bool erase) {
-  const QString prefix = tr("ESPFlasherClient::write(0x%1, %2, %3): ")
-                             .arg(addr, 0, 16)
-                             .arg(data.length())
-                             .arg(erase);
-  qDebug() << prefix;
-  util::Status st = SLIP::send(rom_->data_port(), cmdByte(CMD_FLASH_WRITE));
-  if (!st.ok()) {
-    return QSP(prefix + "command write failed", st);
+util::StatusOr<QByteArray> ESPFlasherClient::recv(int timeoutMs) {
+  auto res = SLIP::recv(rom_->data_port(), timeoutMs);
+  if (pendingCmd_ >= 0) {
+    if (res.ok()) {
+      latencies_.record(commandName(stub_cmd(pendingCmd_)),
+                        cmdTimer_.nsecsElapsed() / 1000);
+    }
+    pendingCmd_ = -1;
+  }
+  return res;
+}
+
+// static
+QString ESPFlasherClient::commandName(enum stub_cmd cmd) {
+  switch (cmd) {
+    case CMD_FLASH_ERASE:
+      return "flash_erase";
+    case CMD_FLASH_WRITE:
+      return "flash_write";
+    case CMD_FLASH_READ:
+      return "flash_read";
+    case CMD_FLASH_DIGEST:
+      return "flash_digest";
+    case CMD_FLASH_READ_CHIP_ID:
+      return "read_chip_id";
+    case CMD_FLASH_ERASE_CHIP:
+      return "erase_chip";
+    case CMD_BOOT_FW:
+      return "boot_fw";
+    case CMD_REBOOT:
+      return "reboot";
+    case CMD_FLASH_WRITE_DEFLATED:
+      return "flash_write_deflated";
+    case CMD_FLASH_WRITE_REGIONS:
+      return "flash_write_regions";
+    case CMD_SET_BAUD_RATE:
+      return "set_baud_rate";
+    case CMD_FLASH_FINGERPRINT:
+      return "flash_fingerprint";
+    case CMD_FLASH_BLANK_MAP:
+      return "flash_blank_map";
+    case CMD_SET_SPI_PARAMS:
+      return "set_spi_params";
+    case CMD_BATCH:
+      return "batch";
+    case CMD_FLASH_WRITE_CHANGED:
+      return "flash_write_changed";
+    case CMD_FLASH_PATCH:
+      return "flash_patch";
   }
+  return QString("stub_%1").arg(int(cmd));
+}
+
+util::StatusOr<QVector<QByteArray>> ESPFlasherClient::batch(
+    enum stub_cmd cmd, const QVector<QPair<quint32, quint32>> &regions,
+    const LazyPrefix &prefix) {
+  QVector<QByteArray> result;
+  for (int first = 0; first < regions.size(); first += FLASH_BATCH_MAX_CMDS) {
+    const int n = std::min(regions.size() - first, FLASH_BATCH_MAX_CMDS);
+    QByteArray args;
+    QDataStream s(&args, QIODevice::WriteOnly);
+    s.setByteOrder(QDataStream::LittleEndian);
+    s << quint8(n);
+    for (int i = 0; i < n; i++) {
+      s << quint8(i) << quint8(cmd) << regions[first + i].first
+        << regions[first + i].second;
+    }
+    util::Status st = sendCmd(CMD_BATCH, args, prefix);
+    if (!st.ok()) return st;
+    // Responses come as the commands complete, tagged with their index.
+    QElapsedTimer t;
+    t.start();
+    for (int i = 0; i < n; i++) {
+      const quint32 addr = regions[first + i].first;
+      const quint32 size = regions[first + i].second;
+      const int timeoutMs =
+          cmd == CMD_FLASH_ERASE
+              ? eraseTimeoutMs(addr, size)
+              : flashBlockReadWriteTimeMs * (size / flashBlockSize + 1);
+      auto res = recv(timeoutMs);
+      if (!res.ok()) {
+        return QSP(prefix + "failed to read response", res.status());
+      }
+      const QByteArray &r = res.ValueOrDie();
+      if (r.length() == 1) {
+        // Final status, the batch was rejected as a whole.
+        return QS(util::error::UNAVAILABLE,
+                  prefix + tr("rejected, code: %1")
+                               .arg(QString::fromLatin1(r.toHex())));
+      }
+      if (r.length() < 2 || quint8(r[0]) != i) {
+        return QS(util::error::INTERNAL,
+                  prefix + tr("unexpected response: %1")
+                               .arg(QString::fromLatin1(r.toHex())));
+      }
+      if (r[1] != '\0') {
+        recv();  // Status of the batch, same code.
+        return QS(util::error::UNAVAILABLE,
+                  prefix + tr("0x%1 (%2) failed, code: %3")
+                               .arg(addr, 0, 16)
+                               .arg(size)
+                               .arg(quint8(r[1]), 0, 16));
+      }
+      if (cmd == CMD_FLASH_ERASE && eraseModel_ != nullptr) {
+        eraseModel_->addEraseSample(addr, size, t.restart());
+      }
+      result.append(r.mid(2));
+    }
+    auto res = recv();
+    if (!res.ok()) return QSP(prefix + "failed to read status", res.status());
+    const QByteArray &status = res.ValueOrDie();
+    if (status != QByteArray(1, '\x00')) {
+      return QS(util::error::UNAVAILABLE,
+                prefix + tr("failed, code: %1")
+                             .arg(QString::fromLatin1(status.toHex())));
+    }
+  }
+  return result;
+}
+
+util::Status ESPFlasherClient::write(quint32 addr, const FlashSpan &data,
+                                     bool erase) {
+  const LazyPrefix prefix =
+      LazyPrefix("ESPFlasherClient::write(0x%1, %2, %3): ")
+          .arg(addr, 16)
+          .arg(data.length())
+          .arg(erase);
+  qCDebug(Log::proto) << prefix;
   QByteArray args;
   QDataStream s(&args, QIODevice::WriteOnly);
   s.setByteOrder(QDataStream::LittleEndian);
   s << addr << quint32(data.length()) << quint32(erase);
-  st = SLIP::send(rom_->data_port(), args);
-  if (!st.ok()) return QSP(prefix + "arg write failed", st);
-  quint32 numSent = 0, numWritten = 0;
-  while (numWritten < quint32(data.length())) {
-    auto res = SLIP::recv(rom_->data_port(), flashBlockEraseTimeMs);
+  util::Status st = sendCmd(CMD_FLASH_WRITE, args, prefix);
+  if (!st.ok()) return st;
+  return streamWriteData(prefix, {addr}, {data}, {data},
+                         false /* longStatus */, 0);
+}
+
+util::Status ESPFlasherClient::writeCompressed(quint32 addr,
+                                               const FlashSpan &data,
+                                               bool erase) {
+  const LazyPrefix prefix =
+      LazyPrefix("ESPFlasherClient::writeCompressed(0x%1, %2, %3): ")
+          .arg(addr, 16)
+          .arg(data.length())
+          .arg(erase);
+  qCDebug(Log::proto) << prefix;
+  if (!canWriteCompressed()) {
+    return QS(util::error::FAILED_PRECONDITION,
+              prefix + tr("not supported by the stub (version %1)")
+                           .arg(stubVersion_));
+  }
+  auto zres = deflate({data});
+  if (!zres.ok()) return QSP(prefix + "compression failed", zres.status());
+  const QByteArray &zdata = zres.ValueOrDie();
+  qCDebug(Log::proto) << prefix << "compressed to" << zdata.length();
+  if (quint32(zdata.length()) >= data.length()) {
+    return write(addr, data, erase);
+  }
+  QByteArray args;
+  QDataStream s(&args, QIODevice::WriteOnly);
+  s.setByteOrder(QDataStream::LittleEndian);
+  s << addr << quint32(data.length()) << quint32(erase)
+    << quint32(zdata.length());
+  util::Status st = sendCmd(CMD_FLASH_WRITE_DEFLATED, args, prefix);
+  if (!st.ok()) return st;
+  return streamWriteData(prefix, {addr}, {data}, {FlashSpan(zdata)},
+                         true /* longStatus */, 0);
+}
+
+util::Status ESPFlasherClient::writeRegions(
+    const QMap<quint32, FlashSpan> &regions, bool erase, bool changedOnly) {
+  const LazyPrefix prefix =
+      LazyPrefix("ESPFlasherClient::writeRegions(%1, %2, %3): ")
+          .arg(regions.size())
+          .arg(erase)
+          .arg(changedOnly);
+  qCDebug(Log::proto) << prefix;
+  if (!canWriteRegions() || (changedOnly && !canWriteChanged())) {
+    return QS(util::error::FAILED_PRECONDITION,
+              prefix + tr("not supported by the stub (version %1)")
+                           .arg(stubVersion_));
+  }
+  quint32 numWritten = 0;
+  auto it = regions.constBegin();
+  while (it != regions.constEnd()) {
+    QByteArray regionList;
+    QDataStream rs(&regionList, QIODevice::WriteOnly);
+    rs.setByteOrder(QDataStream::LittleEndian);
+    QVector<quint32> batchAddrs;
+    QVector<FlashSpan> batch;
+    quint32 batchLen = 0;
+    for (; it != regions.constEnd() && batch.size() < FLASH_WRITE_MAX_REGIONS;
+         it++) {
+      rs << it.key() << it.value().length();
+      batchAddrs.append(it.key());
+      batch.append(it.value());
+      batchLen += it.value().length();
+    }
+    auto zres = deflate(batch);
+    if (!zres.ok()) return QSP(prefix + "compression failed", zres.status());
+    const QByteArray &zdata = zres.ValueOrDie();
+    const bool compressed = (quint32(zdata.length()) < batchLen);
+    qCDebug(Log::proto) << prefix << batch.size() << "regions," << batchLen
+                        << "bytes, compressed:" << zdata.length();
+    QByteArray args;
+    QDataStream s(&args, QIODevice::WriteOnly);
+    s.setByteOrder(QDataStream::LittleEndian);
+    s << quint32(batch.size()) << quint32(erase)
+      << quint32(compressed ? zdata.length() : 0);
+    util::Status st = sendCmd(
+        changedOnly ? CMD_FLASH_WRITE_CHANGED : CMD_FLASH_WRITE_REGIONS, args,
+        prefix);
+    if (!st.ok()) return st;
+    st = SLIP::send(rom_->data_port(), regionList);
+    if (!st.ok()) return QSP(prefix + "region list write failed", st);
+    st = streamWriteData(prefix, batchAddrs, batch,
+                         compressed ? QVector<FlashSpan>{FlashSpan(zdata)}
+                                    : batch,
+                         true /* longStatus */, numWritten);
+    if (!st.ok()) return st;
+    numWritten += batchLen;
+  }
+  return util::Status::OK;
+}
+
+util::Status ESPFlasherClient::streamWriteData(
+    const LazyPrefix &prefix, const QVector<quint32> &addrs,
+    const QVector<FlashSpan> &regions, const QVector<FlashSpan> &payload,
+    bool longStatus, quint32 progressBase) {
+  quint32 payloadLen = 0;
+  for (const FlashSpan &span : payload) payloadLen += span.length();
+  // Position of the next byte to send within the payload spans.
+  int sendSpan = 0;
+  quint32 sendOffset = 0;
+  const int respLen = longStatus ? 8 : 4;
+  quint32 numSent = 0, numAcked = 0, numWritten = 0;
+  int numDigests = 0;
+  util::Status digestStatus;
+  while (numDigests < regions.size()) {
+    // Stub may be erasing a block in between status reports.
+    auto res = recv(eraseModel_ != nullptr ? eraseModel_->blockTimeoutMs()
+                                           : flashBlockEraseTimeMs);
     if (!res.ok()) {
       return QSP(prefix + tr("failed to read response @ %1").arg(numWritten),
                  res.status());
     }
-    QByteArray respBytes = res.ValueOrDie();
+    QByteArray respBytes = res.MoveValueOrDie();
     if (respBytes.length() == 1) {
-      return QS(util::error::UNAVAILABLE,
+      // 0x3c: data read back from flash did not match.
+      return QS(respBytes[0] == '\x3c' ? util::error::DATA_LOSS
+                                        : util::error::UNAVAILABLE,
                 prefix +
                     tr("failed to write, code: %1")
                         .arg(QString::fromLatin1(respBytes.toHex())));
     }
-    if (respBytes.length() != 4) {
-      return QS(
-          util::error::INTERNAL,
-          prefix + tr("expected 4 bytes, got %1").arg(respBytes.length()));
+    if (respBytes.length() >= 16) {
+      const QByteArray expHash = respBytes.left(16);
+      // Bitmap of the sectors rewritten by CMD_FLASH_WRITE_CHANGED.
+      for (int i = 16; i < respBytes.length(); i++) {
+        for (quint8 b = respBytes[i]; b != 0; b &= b - 1) sectorsRewritten_++;
+      }
+      const QByteArray hash = regions[numDigests].md5();
+      if (hash != expHash && digestStatus.ok()) {
+        // Keep going to stay in sync with the stub, report at the end.
+        digestStatus = QS(util::error::DATA_LOSS,
+                          prefix +
+                              tr("hash mismatch in region %1: expected %2, "
+                                 "got %3")
+                                  .arg(numDigests)
+                                  .arg(QString::fromLatin1(expHash.toHex()))
+                                  .arg(QString::fromLatin1(hash.toHex())));
+      } else if (hash == expHash) {
+        emit regionWritten(addrs[numDigests], regions[numDigests].length());
+      }
+      numDigests++;
+      continue;
+    }
+    if (respBytes.length() != respLen) {
+      return QS(util::error::INTERNAL,
+                prefix + tr("expected %1 bytes, got %2")
+                             .arg(respLen)
+                             .arg(respBytes.length()));
     }
     QDataStream s(respBytes);
     s.setByteOrder(QDataStream::LittleEndian);
-    s >> numWritten;
-    emit progress(numWritten);
-    while (numSent - numWritten <= 5120 && numSent < quint32(data.length())) {
-      quint32 toSend = data.length();
-      if (toSend > 1024) toSend = 1024;
-      qint64 ns = rom_->data_port()->write(data.mid(numSent, toSend));
+    if (longStatus) {
+      s >> numAcked >> numWritten;
+    } else {
+      s >> numWritten;
+      numAcked = numWritten;
+    }
+    emit progress(progressBase + numWritten);
+    while (numSent - numAcked <= writeWindowSize_ &&
+           numSent < payloadLen) {
+      const FlashSpan &span = payload[sendSpan];
+      const quint32 toSend =
+          std::min(span.length() - sendOffset, flashWriteChunkSize);
+      // A view of the data, padding aside.
+      const QByteArray chunk = span.bytes(sendOffset, toSend);
+      qint64 ns = rom_->data_port()->write(chunk.constData(), chunk.length());
+      SerialTrace::recordWrite(rom_->data_port(), chunk.constData(), ns);
       if (ns < 0) {
-        return QSP(prefix + tr("failed to write @ %1").arg(numSent), st);
+        return QS(util::error::UNAVAILABLE,
+                  prefix + tr("failed to write @ %1: %2")
+                               .arg(numSent)
+                               .arg(rom_->data_port()->errorString()));
       }
       numSent += ns;
+      bytesSent_ += ns;
+      sendOffset += ns;
+      if (sendOffset == span.length()) {
+        sendSpan++;
+        sendOffset = 0;
+      }
     }
   }
-  auto hres = SLIP::recv(rom_->data_port());
-  if (!hres.ok()) {
-    return QSP(prefix + "digest read failed", hres.status());
-  }
-  const QByteArray &expHash = hres.ValueOrDie();
-  const QByteArray &hash =
-      QCryptographicHash::hash(data, QCryptographicHash::Md5);
-  if (hash != expHash) {
-    return QS(util::error::DATA_LOSS,
-              prefix +
-                  tr("hash mismatch: expected %3, got %4")
-                      .arg(QString::fromLatin1(expHash.toHex()))
-                      .arg(QString::fromLatin1(hash.toHex())));
-  }
-  auto res = SLIP::recv(rom_->data_port());
+  auto res = recv();
   if (!res.ok()) {
     return QSP(prefix + tr("failed to read response @ %1").arg(numWritten),
                res.status());
   }
-  QByteArray respBytes = res.ValueOrDie();
+  QByteArray respBytes = res.MoveValueOrDie();
   if (respBytes.length() != 1) {
     return QS(util::error::INTERNAL,
               prefix + tr("expected 1 byte, got %1").arg(respBytes.length()));
@@ -190,80 +752,137 @@ util::Status ESPFlasherClient::write(quint32 addr, QByteArray data,
                       .arg(QString::fromLatin1(respBytes.toHex())));
   }
 
-  return util::Status::OK;
+  return digestStatus;
 }
 
 util::StatusOr<QByteArray> ESPFlasherClient::read(quint32 addr, quint32 size) {
-  const QString prefix =
-      tr("ESPFlasherClient::read(0x%1, %2): ").arg(addr, 0, 16).arg(size);
-  qDebug() << prefix;
-  util::Status st = SLIP::send(rom_->data_port(), cmdByte(CMD_FLASH_READ));
-  if (!st.ok()) return QSP(prefix + "command write failed", st);
+  QByteArray data;
+  data.reserve(size);
+  QBuffer buf(&data);
+  buf.open(QIODevice::WriteOnly);
+  util::Status st = read(addr, size, &buf);
+  if (!st.ok()) return st;
+  return data;
+}
+
+void ESPFlasherClient::setReadWindow(quint32 blockSize, quint32 maxInFlight) {
+  readBlockSize_ = blockSize;
+  readMaxInFlight_ = maxInFlight;
+}
+
+void ESPFlasherClient::setMaxWriteWindow(quint32 size) {
+  maxWriteWindowSize_ = size;
+  // Less than a chunk would not let any data through.
+  if (size > 0) size = std::max(size, flashWriteChunkSize);
+  if (size > 0 && writeWindowSize_ > size) writeWindowSize_ = size;
+}
+
+util::Status ESPFlasherClient::read(quint32 addr, quint32 size, QIODevice *out,
+                                    quint32 blockSize, quint32 maxInFlight) {
+  if (blockSize == 0) blockSize = readBlockSize_;
+  if (maxInFlight == 0) maxInFlight = readMaxInFlight_;
+  const LazyPrefix prefix =
+      LazyPrefix("ESPFlasherClient::read(0x%1, %2, %3, %4): ")
+          .arg(addr, 16)
+          .arg(size)
+          .arg(blockSize)
+          .arg(maxInFlight);
+  qCDebug(Log::proto) << prefix;
+  if (blockSize == 0 || blockSize > kFlashReadMaxBlockSize ||
+      maxInFlight < blockSize) {
+    return QS(util::error::INVALID_ARGUMENT, prefix + tr("invalid arguments"));
+  }
+  // Older stubs do not support flow control and read 1K blocks.
+  const bool acked = canReadWindowed();
+  if (!acked) blockSize = flashReadLegacyBlockSize;
   QByteArray args;
   QDataStream s(&args, QIODevice::WriteOnly);
   s.setByteOrder(QDataStream::LittleEndian);
-  s << addr << size << flashReadBlockSize;
-  st = SLIP::send(rom_->data_port(), args);
-  if (!st.ok()) return QSP(prefix + "arg write failed", st);
-  QByteArray data;
-  while (quint32(data.length()) < size) {
-    auto bres = SLIP::recv(rom_->data_port());
+  s << addr << size << blockSize;
+  if (acked) s << maxInFlight;
+  util::Status st = sendCmd(CMD_FLASH_READ, args, prefix);
+  if (!st.ok()) return st;
+  // Allow for a full window to be in the pipe.
+  const int timeoutMs =
+      500 + qint64(maxInFlight) * 10 * 1000 / std::max(baudRate(), 9600);
+  QCryptographicHash hash(QCryptographicHash::Md5);
+  quint32 numReceived = 0, numAcked = 0;
+  while (numReceived < size) {
+    auto bres = recv(timeoutMs);
     if (!bres.ok()) {
-      return QSP(prefix + tr("data read failed @ %3").arg(data.length()),
+      return QSP(prefix + tr("data read failed @ %1").arg(numReceived),
                  bres.status());
     }
-    data.append(bres.ValueOrDie());
-    emit progress(data.length());
-  }
-  if (quint32(data.length()) > size) {
-    return QS(
-        util::error::INTERNAL,
-        prefix + tr("expected %3 bytes, got %4").arg(size).arg(data.length()));
+    const QByteArray &block = bres.ValueOrDie();
+    numReceived += block.length();
+    bytesReceived_ += block.length();
+    if (numReceived > size) {
+      return QS(util::error::INTERNAL,
+                prefix + tr("expected %1 bytes, got %2")
+                             .arg(size)
+                             .arg(numReceived));
+    }
+    // Stub reads acks one by one until it gets the final one, so there must
+    // be no extra acks after that. Half a window keeps the stub busy.
+    if (acked &&
+        (numReceived == size || numReceived - numAcked >= maxInFlight / 2)) {
+      QByteArray ack;
+      QDataStream as(&ack, QIODevice::WriteOnly);
+      as.setByteOrder(QDataStream::LittleEndian);
+      as << numReceived;
+      st = SLIP::send(rom_->data_port(), ack);
+      if (!st.ok()) return QSP(prefix + tr("ack write failed"), st);
+      numAcked = numReceived;
+    }
+    hash.addData(block);
+    if (out->write(block) != block.length()) {
+      return QS(util::error::UNAVAILABLE,
+                prefix + tr("output write failed: %1").arg(out->errorString()));
+    }
+    emit progress(numReceived);
   }
-  auto hres = SLIP::recv(rom_->data_port());
+  auto hres = recv();
   if (!hres.ok()) {
     return QSP(prefix + "digest read failed", hres.status());
   }
-  const QByteArray &hash = hres.ValueOrDie();
-  const QByteArray &expHash =
-      QCryptographicHash::hash(data, QCryptographicHash::Md5);
-  if (hash != expHash) {
+  const QByteArray &digest = hres.ValueOrDie();
+  const QByteArray expDigest = hash.result();
+  if (digest != expDigest) {
     return QS(util::error::DATA_LOSS,
               prefix +
-                  tr("hash mismatch: expected %3, got %4")
-                      .arg(QString::fromLatin1(expHash.toHex()))
-                      .arg(QString::fromLatin1(hash.toHex())));
+                  tr("hash mismatch: expected %1, got %2")
+                      .arg(QString::fromLatin1(expDigest.toHex()))
+                      .arg(QString::fromLatin1(digest.toHex())));
   }
-  auto sres = SLIP::recv(rom_->data_port());
+  auto sres = recv();
   if (!sres.ok()) {
     return QSP(prefix + tr("failed to read status"), sres.status());
   }
   /* We don't verify the status. Hash matched, so - whatever. */
-  return data;
+  return util::Status::OK;
 }
 
 util::StatusOr<ESPFlasherClient::DigestResult> ESPFlasherClient::digest(
     quint32 addr, quint32 size, quint32 digestBlockSize) {
-  const QString prefix = tr("ESPFlasherClient::digest(0x%1, %2, %3): ")
-                             .arg(addr, 0, 16)
-                             .arg(size)
-                             .arg(digestBlockSize);
-  qDebug() << prefix;
-  util::Status st = SLIP::send(rom_->data_port(), cmdByte(CMD_FLASH_DIGEST));
-  if (!st.ok()) return QSP(prefix + "command write failed", st);
+  const LazyPrefix prefix =
+      LazyPrefix("ESPFlasherClient::digest(0x%1, %2, %3): ")
+          .arg(addr, 16)
+          .arg(size)
+          .arg(digestBlockSize);
+  qCDebug(Log::proto) << prefix;
   QByteArray args;
   QDataStream s(&args, QIODevice::WriteOnly);
   s.setByteOrder(QDataStream::LittleEndian);
   s << addr << size << digestBlockSize;
-  st = SLIP::send(rom_->data_port(), args);
-  if (!st.ok()) return QSP(prefix + "arg write failed", st);
+  util::Status st = sendCmd(CMD_FLASH_DIGEST, args, prefix);
+  if (!st.ok()) return st;
   DigestResult dres;
   while (true) {
     int timeoutMs = flashBlockReadWriteTimeMs *
                     (digestBlockSize > 0 ? 10 : (size / flashBlockSize + 1));
-    auto res = SLIP::recv(rom_->data_port(), timeoutMs);
+    auto res = recv(timeoutMs);
     if (!res.ok()) return QSP(prefix + "read failed", res.status());
-    QByteArray r = res.ValueOrDie();
+    QByteArray r = res.MoveValueOrDie();
     switch (r.length()) {
       case 16: {
         if (dres.digest.length() > 0) {
@@ -284,16 +903,217 @@ util::StatusOr<ESPFlasherClient::DigestResult> ESPFlasherClient::digest(
   // Not reached.
 }
 
+util::StatusOr<QVector<QByteArray>> ESPFlasherClient::digests(
+    const QVector<QPair<quint32, quint32>> &regions) {
+  const LazyPrefix prefix =
+      LazyPrefix("ESPFlasherClient::digests(%1): ").arg(regions.size());
+  if (!canBatch()) {
+    QVector<QByteArray> result;
+    for (const auto &r : regions) {
+      auto res = digest(r.first, r.second, 0);
+      if (!res.ok()) return res.status();
+      result.append(res.ValueOrDie().digest);
+    }
+    return result;
+  }
+  qCDebug(Log::proto) << prefix;
+  auto res = batch(CMD_FLASH_DIGEST, regions, prefix);
+  if (!res.ok()) return res.status();
+  for (const QByteArray &d : res.ValueOrDie()) {
+    if (d.length() != 16) {
+      return QS(util::error::INTERNAL,
+                prefix + tr("unexpected digest length: %1").arg(d.length()));
+    }
+  }
+  return res;
+}
+
+util::StatusOr<QVector<quint32>> ESPFlasherClient::fingerprint(
+    quint32 addr, quint32 size, quint32 blockSize) {
+  const LazyPrefix prefix =
+      LazyPrefix("ESPFlasherClient::fingerprint(0x%1, %2, %3): ")
+          .arg(addr, 16)
+          .arg(size)
+          .arg(blockSize);
+  qCDebug(Log::proto) << prefix;
+  if (blockSize == 0 || blockSize > kFlashSectorSize) {
+    return QS(util::error::INVALID_ARGUMENT, prefix + tr("invalid block size"));
+  }
+  QVector<quint32> result;
+  result.reserve((size + blockSize - 1) / blockSize);
+  while (size > 0) {
+    const quint32 len =
+        std::min(size, FLASH_FINGERPRINT_MAX_BLOCKS * blockSize);
+    QByteArray args;
+    QDataStream s(&args, QIODevice::WriteOnly);
+    s.setByteOrder(QDataStream::LittleEndian);
+    s << addr << len << blockSize;
+    util::Status st = sendCmd(CMD_FLASH_FINGERPRINT, args, prefix);
+    if (!st.ok()) return st;
+    const int timeoutMs =
+        flashBlockReadWriteTimeMs * (len / flashBlockSize + 1);
+    auto res = recv(timeoutMs);
+    if (!res.ok()) return QSP(prefix + "read failed", res.status());
+    const QByteArray &r = res.ValueOrDie();
+    const quint32 numBlocks = (len + blockSize - 1) / blockSize;
+    if (quint32(r.length()) != numBlocks * 4) {
+      return QS(util::error::INTERNAL,
+                prefix + tr("unexpected response length: %1 (code %2)")
+                             .arg(r.length())
+                             .arg(QString::fromLatin1(r.toHex())));
+    }
+    QDataStream rs(r);
+    rs.setByteOrder(QDataStream::LittleEndian);
+    for (quint32 i = 0; i < numBlocks; i++) {
+      quint32 crc;
+      rs >> crc;
+      result.push_back(crc);
+    }
+    auto sres = recv();
+    if (!sres.ok()) return QSP(prefix + "failed to read status", sres.status());
+    addr += len;
+    size -= len;
+  }
+  return result;
+}
+
+util::StatusOr<QVector<bool>> ESPFlasherClient::blankMap(quint32 addr,
+                                                         quint32 size) {
+  const LazyPrefix prefix =
+      LazyPrefix("ESPFlasherClient::blankMap(0x%1, %2): ")
+          .arg(addr, 16)
+          .arg(size);
+  qCDebug(Log::proto) << prefix;
+  if (addr % kFlashSectorSize != 0 || size % kFlashSectorSize != 0) {
+    return QS(util::error::INVALID_ARGUMENT, prefix + tr("unaligned region"));
+  }
+  QVector<bool> result;
+  result.reserve(size / kFlashSectorSize);
+  while (size > 0) {
+    const quint32 len =
+        std::min(size, FLASH_BLANK_MAP_MAX_SECTORS * kFlashSectorSize);
+    const quint32 numSectors = len / kFlashSectorSize;
+    QByteArray args;
+    QDataStream s(&args, QIODevice::WriteOnly);
+    s.setByteOrder(QDataStream::LittleEndian);
+    s << addr << len;
+    util::Status st = sendCmd(CMD_FLASH_BLANK_MAP, args, prefix);
+    if (!st.ok()) return st;
+    const int timeoutMs =
+        flashBlockReadWriteTimeMs * (len / flashBlockSize + 1);
+    auto res = recv(timeoutMs);
+    if (!res.ok()) return QSP(prefix + "read failed", res.status());
+    const QByteArray &r = res.ValueOrDie();
+    if (quint32(r.length()) != (numSectors + 7) / 8) {
+      return QS(util::error::INTERNAL,
+                prefix + tr("unexpected response length: %1 (code %2)")
+                             .arg(r.length())
+                             .arg(QString::fromLatin1(r.toHex())));
+    }
+    for (quint32 i = 0; i < numSectors; i++) {
+      result.push_back((quint8(r[i / 8]) & (1 << (i % 8))) != 0);
+    }
+    auto sres = recv();
+    if (!sres.ok()) return QSP(prefix + "failed to read status", sres.status());
+    addr += len;
+    size -= len;
+  }
+  return result;
+}
+
+util::StatusOr<int> ESPFlasherClient::patch(
+    const QMap<quint32, QByteArray> &patches) {
+  const LazyPrefix prefix =
+      LazyPrefix("ESPFlasherClient::patch(%1): ").arg(patches.size());
+  qCDebug(Log::proto) << prefix;
+  if (!canPatch()) {
+    return QS(util::error::FAILED_PRECONDITION,
+              prefix + tr("not supported by the stub (version %1)")
+                           .arg(stubVersion_));
+  }
+  // Pieces that fit in a command, in address order, so the ones in the same
+  // sector go together.
+  QVector<QPair<quint32, QByteArray>> pieces;
+  for (auto it = patches.constBegin(); it != patches.constEnd(); it++) {
+    for (int off = 0; off < it.value().length(); off += FLASH_PATCH_MAX_LEN) {
+      pieces.append(qMakePair(it.key() + off,
+                              it.value().mid(off, FLASH_PATCH_MAX_LEN)));
+    }
+  }
+  int written = 0;
+  for (int first = 0; first < pieces.size();) {
+    QByteArray list, data;
+    QDataStream ls(&list, QIODevice::WriteOnly);
+    ls.setByteOrder(QDataStream::LittleEndian);
+    int n = 0;
+    for (; first + n < pieces.size() && n < FLASH_WRITE_MAX_REGIONS; n++) {
+      const auto &p = pieces[first + n];
+      if (data.length() + p.second.length() > FLASH_PATCH_MAX_LEN) break;
+      ls << p.first << quint32(p.second.length());
+      data.append(p.second);
+    }
+    first += n;
+    QByteArray args;
+    QDataStream s(&args, QIODevice::WriteOnly);
+    s.setByteOrder(QDataStream::LittleEndian);
+    s << quint32(n) << quint32(data.length());
+    util::Status st = sendCmd(CMD_FLASH_PATCH, args, prefix);
+    if (!st.ok()) return st;
+    st = SLIP::send(rom_->data_port(), list);
+    if (!st.ok()) return QSP(prefix + "patch list write failed", st);
+    st = SLIP::send(rom_->data_port(), data);
+    if (!st.ok()) return QSP(prefix + "patch data write failed", st);
+    bytesSent_ += data.length();
+    // Each patch is in at most two sectors, each of them may be erased.
+    const int timeoutMs =
+        flashEraseMinTimeoutMs + 2 * n * flashBlockReadWriteTimeMs;
+    auto res = recv(timeoutMs);
+    if (!res.ok()) return QSP(prefix + "read failed", res.status());
+    const QByteArray &r = res.ValueOrDie();
+    if (r.length() != 8) {
+      return QS(util::error::INTERNAL,
+                prefix + tr("failed to patch, code: %1")
+                             .arg(QString::fromLatin1(r.toHex())));
+    }
+    QDataStream rs(r);
+    rs.setByteOrder(QDataStream::LittleEndian);
+    quint32 sectorsWritten = 0, sectorsErased = 0;
+    rs >> sectorsWritten >> sectorsErased;
+    qCDebug(Log::proto) << prefix << sectorsWritten << "sectors written,"
+                        << sectorsErased << "erased";
+    written += sectorsWritten;
+    auto sres = recv();
+    if (!sres.ok()) return QSP(prefix + "failed to read status", sres.status());
+  }
+  return written;
+}
+
+// static
+QVector<quint32> ESPFlasherClient::fingerprintData(const QByteArray &data,
+                                                   quint32 blockSize) {
+  QVector<quint32> result;
+  const unsigned char *p = reinterpret_cast<const unsigned char *>(data.data());
+  for (int offset = 0; offset < data.length(); offset += blockSize) {
+    const int len = std::min(blockSize, quint32(data.length() - offset));
+    result.push_back(CRC32::update(0, p + offset, len));
+  }
+  return result;
+}
+
 util::StatusOr<quint32> ESPFlasherClient::getFlashChipID() {
-  const QString prefix = tr("ESPFlasherClient::getFlashChipID(): ");
-  qDebug() << prefix;
-  util::Status st =
-      SLIP::send(rom_->data_port(), cmdByte(CMD_FLASH_READ_CHIP_ID));
-  if (!st.ok()) return QSP(prefix + "command write failed", st);
-  auto res = SLIP::recv(rom_->data_port(), 1000);
+  const LazyPrefix prefix =
+      LazyPrefix("ESPFlasherClient::getFlashChipID(): ");
+  qCDebug(Log::proto) << prefix;
+  QElapsedTimer t;
+  t.start();
+  util::Status st = sendCmd(CMD_FLASH_READ_CHIP_ID, QByteArray(), prefix);
+  if (!st.ok()) return st;
+  auto res = recv(1000);
   if (!res.ok()) return QSP(prefix + "failed to read result", res.status());
+  const qint64 us = t.nsecsElapsed() / 1000;
+  if (roundTripUs_ == 0 || us < roundTripUs_) roundTripUs_ = us;
   quint32 chipID = 0;
-  QByteArray respBytes = res.ValueOrDie();
+  QByteArray respBytes = res.MoveValueOrDie();
   if (respBytes.length() != 4)
     return QS(util::error::INTERNAL,
               prefix + tr("invalid result length: %1").arg(respBytes.length()));
@@ -303,24 +1123,74 @@ util::StatusOr<quint32> ESPFlasherClient::getFlashChipID() {
   if (chipID == 0) {
     return QS(util::error::INTERNAL, prefix + "0 is not a valid chip ID");
   }
-  res = SLIP::recv(rom_->data_port());
+  res = recv();
   if (!res.ok()) return QSP(prefix + "failed to read status", res.status());
   return chipID;
 }
 
-util::Status ESPFlasherClient::simpleCmd(enum stub_cmd cmd, const QString &name,
+util::Status ESPFlasherClient::setSPIParams(quint32 flashParams) {
+  const LazyPrefix prefix =
+      LazyPrefix("ESPFlasherClient::setSPIParams(0x%1): ").arg(flashParams, 16);
+  qCDebug(Log::proto) << prefix;
+  if (!canSetSPIParams()) {
+    return QS(util::error::FAILED_PRECONDITION,
+              prefix + tr("not supported by the stub (version %1)")
+                           .arg(stubVersion_));
+  }
+  QByteArray args;
+  QDataStream s(&args, QIODevice::WriteOnly);
+  s.setByteOrder(QDataStream::LittleEndian);
+  s << flashParams;
+  util::Status st = sendCmd(CMD_SET_SPI_PARAMS, args, prefix);
+  if (!st.ok()) return st;
+  auto res = recv(1000);
+  if (!res.ok()) return QSP(prefix + "failed to read status", res.status());
+  if (res.ValueOrDie().length() != 1 || res.ValueOrDie()[0] != '\0') {
+    return QS(util::error::INVALID_ARGUMENT,
+              prefix + tr("rejected, code: %1")
+                           .arg(QString::fromLatin1(res.ValueOrDie().toHex())));
+  }
+  return util::Status::OK;
+}
+
+util::Status ESPFlasherClient::simpleCmd(enum stub_cmd cmd, const char *name,
                                          int timeoutMs) {
-  const QString prefix = QString("ESPFlasherClient::%1()").arg(name);
-  qDebug() << prefix;
-  util::Status st = SLIP::send(rom_->data_port(), cmdByte(cmd));
-  if (!st.ok()) return QSP(prefix + tr(": command write failed"), st);
-  auto res = SLIP::recv(rom_->data_port(), timeoutMs);
-  if (!st.ok()) return QSP(prefix + tr(": failed to read response"), st);
+  const LazyPrefix prefix =
+      LazyPrefix("ESPFlasherClient::%1(): ").arg(name);
+  qCDebug(Log::proto) << prefix;
+  util::Status st = sendCmd(cmd, QByteArray(), prefix);
+  if (!st.ok()) return st;
+  auto res = recv(timeoutMs);
+  if (!res.ok()) {
+    return QSP(prefix + tr("failed to read response"), res.status());
+  }
   return util::Status::OK;
 }
 
 util::Status ESPFlasherClient::eraseChip() {
-  return simpleCmd(CMD_FLASH_ERASE_CHIP, "eraseChip", flashChipEraseTimeMs);
+  const LazyPrefix prefix =
+      LazyPrefix("ESPFlasherClient::eraseChip(): ");
+  qCDebug(Log::proto) << prefix;
+  const int timeoutMs = eraseModel_ != nullptr ? eraseModel_->chipTimeoutMs()
+                                               : flashChipEraseTimeMs;
+  QElapsedTimer t;
+  t.start();
+  util::Status st = sendCmd(CMD_FLASH_ERASE_CHIP, QByteArray(), prefix);
+  if (!st.ok()) return st;
+  auto res = recv(timeoutMs);
+  if (!res.ok()) return QSP(prefix + "failed to read response", res.status());
+  if (res.ValueOrDie() != QByteArray(1, '\x00')) {
+    return QS(util::error::UNAVAILABLE,
+              prefix + tr("failed, code: %1")
+                           .arg(QString::fromLatin1(res.ValueOrDie().toHex())));
+  }
+  qInfo() << "Chip erase took" << t.elapsed() << "ms";
+  if (eraseModel_ != nullptr) eraseModel_->addChipSample(t.elapsed());
+  return util::Status::OK;
+}
+
+void ESPFlasherClient::setEraseModel(ESPEraseModel *model) {
+  eraseModel_ = model;
 }
 
 util::Status ESPFlasherClient::bootFirmware() {
@@ -330,3 +1200,73 @@ util::Status ESPFlasherClient::bootFirmware() {
 util::Status ESPFlasherClient::reboot() {
   return simpleCmd(CMD_REBOOT, "reboot", 200);
 }
+
+quint64 ESPFlasherClient::bytesSent() const {
+  return bytesSent_;
+}
+
+quint64 ESPFlasherClient::bytesReceived() const {
+  return bytesReceived_;
+}
+
+quint64 ESPFlasherClient::sectorsRewritten() const {
+  return sectorsRewritten_;
+}
+
+qint64 ESPFlasherClient::roundTripUs() const {
+  return roundTripUs_;
+}
+
+CommandLatencies ESPFlasherClient::takeLatencies() {
+  CommandLatencies result;
+  std::swap(result, latencies_);
+  return result;
+}
+
+quint32 ESPFlasherClient::stubVersion() const {
+  return stubVersion_;
+}
+
+bool ESPFlasherClient::canReadWindowed() const {
+  return stubVersion_ >= 1;
+}
+
+bool ESPFlasherClient::canFingerprint() const {
+  return stubVersion_ >= 4;
+}
+
+bool ESPFlasherClient::canGetBlankMap() const {
+  return stubVersion_ >= 5;
+}
+
+bool ESPFlasherClient::canVerifyWrites() const {
+  return stubVersion_ >= 6;
+}
+
+bool ESPFlasherClient::canWriteCompressed() const {
+  return stubVersion_ >= 1;
+}
+
+bool ESPFlasherClient::canWriteRegions() const {
+  return stubVersion_ >= 2;
+}
+
+bool ESPFlasherClient::canSetBaudRate() const {
+  return stubVersion_ >= 3;
+}
+
+bool ESPFlasherClient::canSetSPIParams() const {
+  return stubVersion_ >= 8;
+}
+
+bool ESPFlasherClient::canBatch() const {
+  return stubVersion_ >= 9;
+}
+
+bool ESPFlasherClient::canWriteChanged() const {
+  return stubVersion_ >= 10;
+}
+
+bool ESPFlasherClient::canPatch() const {
+  return stubVersion_ >= 11;
+}
@@ -6,12 +6,21 @@
 #ifndef CS_MFT_SRC_ESP_FLASHER_CLIENT_H_
 #define CS_MFT_SRC_ESP_FLASHER_CLIENT_H_
 
+#include <QElapsedTimer>
+#include <QIODevice>
+#include <QMap>
 #include <QObject>
-#include <QSerialPort>
+#include <QPair>
+#include <QVector>
 
+#include "esp_erase_model.h"
 #include "esp_rom_client.h"
+#include "flash_span.h"
+#include "latency_histogram.h"
+#include "status_qt.h"
 
 #include <common/platforms/esp8266/stubs/stub_flasher.h>
+#include <common/platforms/esp8266/stubs/stub_loader.h>
 
 class ESPFlasherClient : public QObject {
   Q_OBJECT
@@ -21,25 +30,82 @@ class ESPFlasherClient : public QObject {
 
   static const quint32 kFlashSectorSize;
   static const quint32 kFlashBlockSize;
+  static const quint32 kFlashReadMaxBlockSize;
+  static const quint32 kFlashReadDefaultBlockSize;
+  static const quint32 kFlashReadDefaultMaxInFlight;
 
-  // Load the flasher stub.
+  // Load the flasher stub. If the first stage loader is available, only the
+  // loader is uploaded at the ROM baud rate and the stub is sent at baudRate.
   util::Status connect(qint32 baudRate);
 
+  // Switch the stub and the port to a different baud rate. The link is checked
+  // with an echo round-trip, on failure both sides go back to the old rate.
+  // Requires canSetBaudRate().
+  util::Status setBaudRate(qint32 baudRate);
+
+  // Step up through the candidate rates that are higher than the current one,
+  // in ascending order, and settle on the fastest one that works.
+  // Candidates are remembered for lowerBaudRate(). Returns the rate in use.
+  util::StatusOr<qint32> negotiateBaudRate(const QVector<qint32> &candidates);
+
+  // Switch to the next lower candidate rate, e.g. after a transfer error.
+  util::Status lowerBaudRate();
+
+  // Current baud rate of the data port.
+  qint32 baudRate() const;
+
   // Disconnect from the flasher stub. The stub stays running.
   util::Status disconnect();
 
-  // Erase a region of SPI flash.
+  // Erase a region of SPI flash. Blocks are used where possible, regions of
+  // up to a block that do not cross block boundaries are erased by sectors.
   // Address and size must be aligned to flash sector size.
   util::Status erase(quint32 addr, quint32 size);
 
+  // Erase a number of regions (address -> size), several of them per command
+  // if canBatch(). Same requirements as erase.
+  util::Status eraseRegions(const QMap<quint32, quint32> &regions);
+
   // Write a region of SPI flash. Performs erase before writing.
-  // Address and size must be aligned to flash sector size.
-  util::Status write(quint32 addr, QByteArray data, bool erase);
+  // Address and size must be aligned to flash sector size. Data is sent
+  // straight from the span, it is not copied.
+  util::Status write(quint32 addr, const FlashSpan &data, bool erase);
+
+  // Same as write, but data is compressed before sending and inflated by the
+  // stub. Falls back to write if data does not compress.
+  // Requires canWriteCompressed().
+  util::Status writeCompressed(quint32 addr, const FlashSpan &data,
+                               bool erase);
+
+  // Write a number of regions (address -> data) in a single session, with
+  // compression. Same alignment requirements as write.
+  // Progress is reported as the total number of bytes written so far.
+  // With changedOnly, the stub compares each sector with its data and only
+  // erases and writes the ones that differ; requires canWriteChanged().
+  // Requires canWriteRegions().
+  util::Status writeRegions(const QMap<quint32, FlashSpan> &regions,
+                            bool erase, bool changedOnly = false);
 
   // Read a region of SPI flash.
   // No special alignment requirements.
   util::StatusOr<QByteArray> read(quint32 addr, quint32 size);
 
+  // Same as above, but data is written to the out device as it arrives.
+  // Data is sent in blocks of up to blockSize (<= kFlashReadMaxBlockSize),
+  // with at most maxInFlight bytes unacknowledged. Zero means the value set
+  // with setReadWindow().
+  // Block size and window are ignored if !canReadWindowed().
+  util::Status read(quint32 addr, quint32 size, QIODevice *out,
+                    quint32 blockSize = 0, quint32 maxInFlight = 0);
+
+  // Block size and window for reads that do not specify them, by default
+  // kFlashReadDefaultBlockSize and kFlashReadDefaultMaxInFlight.
+  void setReadWindow(quint32 blockSize, quint32 maxInFlight);
+
+  // Caps the write window reported by the stub, e.g. for adapters that
+  // cannot buffer as much. Zero means no cap.
+  void setMaxWriteWindow(quint32 size);
+
   // Compute MD5 digest of SPI flash contents.
   // No special alignment requirements.
   typedef struct {
@@ -49,22 +115,134 @@ class ESPFlasherClient : public QObject {
   util::StatusOr<DigestResult> digest(quint32 addr, quint32 size,
                                       quint32 digestBlockSize);
 
+  // Overall digests of a number of regions (address, size), in the same
+  // order, several of them per command if canBatch().
+  util::StatusOr<QVector<QByteArray>> digests(
+      const QVector<QPair<quint32, quint32>> &regions);
+
+  // Compute CRC32 of each blockSize block of SPI flash contents.
+  // Cheaper than digest, used to find blocks that need to be written.
+  // blockSize must not exceed kFlashSectorSize. Requires canFingerprint().
+  util::StatusOr<QVector<quint32>> fingerprint(quint32 addr, quint32 size,
+                                               quint32 blockSize);
+
+  // Host side counterpart of fingerprint.
+  static QVector<quint32> fingerprintData(const QByteArray &data,
+                                          quint32 blockSize);
+
+  // Find out which sectors of SPI flash are blank (erased), one entry per
+  // sector. Address and size must be aligned to flash sector size.
+  // Requires canGetBlankMap(). Such stubs also skip erasing blank sectors
+  // when writing.
+  util::StatusOr<QVector<bool>> blankMap(quint32 addr, quint32 size);
+
+  // Replaces bytes at any address (address -> data), the rest of the sectors
+  // stays as it is. The stub reads each sector, patches it and writes it
+  // back only if it changes, so nothing but the patches goes over the link.
+  // Patches must not overlap. Returns the number of sectors written.
+  // Requires canPatch().
+  util::StatusOr<int> patch(const QMap<quint32, QByteArray> &patches);
+
   util::StatusOr<quint32> getFlashChipID();
 
+  // Speed up flash access for the rest of the session according to flash
+  // params (as in the firmware header: mode << 8 | size << 4 | freq).
+  // Requires canSetSPIParams().
+  util::Status setSPIParams(quint32 flashParams);
+
   util::Status eraseChip();
 
+  // Erase operations take timeouts from the model and add their measured
+  // times to it. Not owned, may be nullptr.
+  void setEraseModel(ESPEraseModel *model);
+
   util::Status bootFirmware();
 
   util::Status reboot();
 
+  // Flash data sent by writes (after compression) and received by reads.
+  // Commands and protocol overhead are not counted.
+  quint64 bytesSent() const;
+  quint64 bytesReceived() const;
+  // Sectors that changed-only writes found different and rewrote.
+  quint64 sectorsRewritten() const;
+  // Shortest round trip of a command that does no work to speak of (chip ID
+  // reads), in microseconds. 0 if none has been timed yet.
+  qint64 roundTripUs() const;
+  // Times from sending a command to the first response to it since the last
+  // call, by command (flash_read, flash_write_regions, ...).
+  CommandLatencies takeLatencies();
+
+  // Protocol version reported by the stub, see STUB_FLASHER_VERSION.
+  quint32 stubVersion() const;
+  bool canReadWindowed() const;
+  bool canFingerprint() const;
+  bool canGetBlankMap() const;
+  // Stub reads back written data and fails the write on mismatch.
+  bool canVerifyWrites() const;
+  bool canWriteCompressed() const;
+  bool canWriteRegions() const;
+  bool canSetBaudRate() const;
+  bool canSetSPIParams() const;
+  // Args go in the same frame as the command, and erase and digest commands
+  // can be batched.
+  bool canBatch() const;
+  // Writes can leave sectors that are the same as their data alone.
+  bool canWriteChanged() const;
+  // Bytes can be patched in place, see patch().
+  bool canPatch() const;
+
 signals:
   void progress(quint32 bytes);
+  // A region has been written and the stub's digest of it matches.
+  void regionWritten(quint32 addr, quint32 len);
 
  private:
-  util::Status simpleCmd(enum stub_cmd cmd, const QString &name, int timeoutMs);
+  util::Status simpleCmd(enum stub_cmd cmd, const char *name, int timeoutMs);
+  // Runs the loader, switches to baudRate and uploads the stub through it.
+  util::Status runStubWithLoader(const QByteArray &loaderJSON,
+                                 const QByteArray &stubJSON, qint32 baudRate);
+  // Sends the command and its args, in one frame if the stub can take it.
+  util::Status sendCmd(enum stub_cmd cmd, const QByteArray &args,
+                       const LazyPrefix &prefix);
+  // Receives a frame from the stub. The first one after sendCmd is taken as
+  // the response for latencies.
+  util::StatusOr<QByteArray> recv(int timeoutMs = 500);
+  static QString commandName(enum stub_cmd cmd);
+  // Runs cmd (CMD_FLASH_ERASE or CMD_FLASH_DIGEST) for each of the regions
+  // with CMD_BATCH, returns outputs of the commands. Requires canBatch().
+  util::StatusOr<QVector<QByteArray>> batch(
+      enum stub_cmd cmd, const QVector<QPair<quint32, quint32>> &regions,
+      const LazyPrefix &prefix);
+  int eraseTimeoutMs(quint32 addr, quint32 size) const;
+  // Streams payload to the stub after one of the CMD_FLASH_WRITE* commands
+  // and checks digests of the written regions (addrs has their addresses).
+  // Payload is either the regions themselves or their compressed data. With
+  // longStatus, progress reports include consumed input, which is used for
+  // flow control. Digests may be followed by a bitmap of rewritten sectors.
+  util::Status streamWriteData(const LazyPrefix &prefix,
+                               const QVector<quint32> &addrs,
+                               const QVector<FlashSpan> &regions,
+                               const QVector<FlashSpan> &payload,
+                               bool longStatus, quint32 progressBase);
 
   ESPROMClient *rom_;  // Not owned.
   qint32 oldBaudRate_ = 0;
+  quint32 stubVersion_ = 0;
+  // How much unacknowledged write data the stub can buffer.
+  quint32 writeWindowSize_ = 5120;
+  quint32 maxWriteWindowSize_ = 0;
+  quint32 readBlockSize_ = kFlashReadDefaultBlockSize;
+  quint32 readMaxInFlight_ = kFlashReadDefaultMaxInFlight;
+  QVector<qint32> baudRates_;  // Candidates for lowerBaudRate, ascending.
+  quint64 bytesSent_ = 0;
+  quint64 bytesReceived_ = 0;
+  quint64 sectorsRewritten_ = 0;
+  qint64 roundTripUs_ = 0;
+  ESPEraseModel *eraseModel_ = nullptr;
+  CommandLatencies latencies_;
+  QElapsedTimer cmdTimer_;
+  int pendingCmd_ = -1;  // Sent, no response yet.
 };
 
 #endif /* CS_MFT_SRC_ESP_FLASHER_CLIENT_H_ */
@@ -1,11 +1,18 @@
 #include "esp_rom_client.h"
 
+#include <algorithm>
+
 #include <QDataStream>
+#include <QElapsedTimer>
 #include <QJsonDocument>
 #include <QJsonObject>
+#include <QSettings>
 #include <QtDebug>
 #include <QThread>
 
+#include "log.h"
+#include "serial.h"
+#include "serial_trace.h"
 #include "slip.h"
 #include "status_qt.h"
 
@@ -17,10 +24,24 @@ namespace {
 
 const int numConnectAttempts = 4;
 const int memWriteBlockSize = 4096;
+// ROM processes a block much faster than the next one arrives, so a few
+// blocks in flight are enough to hide the round trip. 1 disables pipelining.
+const int memWriteMaxInFlight = 4;
+
+// Reset is held for this long.
+const int resetPulseMs = 10;
+// After reset is released, sync is attempted for this long, with a short
+// timeout for each attempt. ROM usually answers within tens of ms.
+const int syncWindowMs = 500;
+const int syncPollTimeoutMs = 50;
+// Start polling slightly earlier than the remembered delay.
+const int syncDelayMarginMs = 20;
+
+const char connectSettingsGroup[] = "esp8266/connect";
 
 }  // namespace
 
-ESPROMClient::ESPROMClient(QSerialPort *control_port, QSerialPort *data_port)
+ESPROMClient::ESPROMClient(QIODevice *control_port, QIODevice *data_port)
     : control_port_(control_port), data_port_(data_port) {
 }
 
@@ -31,56 +52,80 @@ bool ESPROMClient::connected() const {
   return connected_;
 }
 
-QSerialPort *ESPROMClient::control_port() {
+QIODevice *ESPROMClient::control_port() {
   return control_port_;
 }
 
-QSerialPort *ESPROMClient::data_port() {
+QIODevice *ESPROMClient::data_port() {
   return data_port_;
 }
 
 util::Status ESPROMClient::connect() {
   qInfo() << "ESPROMClient::connect(): control port"
-          << control_port_->portName() << "data port" << data_port_->portName();
+          << portName(control_port_) << "data port" << portName(data_port_);
   connected_ = false;
+  // Polarity and boot delay that worked last time on this port.
+  QSettings settings;
+  settings.beginGroup(connectSettingsGroup);
+  settings.beginGroup(portName(control_port_));
+  inverted_ = settings.value("inverted", inverted_).toBool();
+  const int syncDelayMs =
+      std::max(0, settings.value("syncDelayMs", 0).toInt() - syncDelayMarginMs);
+  QElapsedTimer total;
+  total.start();
   // This targets the NodeMCU flip-flop-like circuit but will also work with
   // direct DTR -> GPIO0, RTS -> RST connections.
   util::Status r;
   for (int i = 0; i < numConnectAttempts; i++) {
     qDebug() << "Connect attempt" << (i + 1) << "inverted?" << inverted_;
-    control_port_->setDataTerminalReady(false ^ inverted_);
-    control_port_->setRequestToSend(true ^ inverted_);
-    QThread::msleep(10);
-    control_port_->setDataTerminalReady(true ^ inverted_);
-    control_port_->setRequestToSend(false ^ inverted_);
-    QThread::msleep(250);
-    control_port_->setDataTerminalReady(false ^ inverted_);
-    control_port_->setRequestToSend(false ^ inverted_);
-    r = sync();
+    setDataTerminalReady(control_port_, false ^ inverted_);
+    setRequestToSend(control_port_, true ^ inverted_);
+    QThread::msleep(resetPulseMs);
+    // GPIO0 is held low until the ROM answers, so no need to guess how long
+    // it takes to sample the strapping pins.
+    setDataTerminalReady(control_port_, true ^ inverted_);
+    setRequestToSend(control_port_, false ^ inverted_);
+    QElapsedTimer sinceReset;
+    sinceReset.start();
+    QThread::msleep(syncDelayMs);
+    do {
+      r = sync(syncPollTimeoutMs);
+    } while (!r.ok() && sinceReset.elapsed() < syncWindowMs);
+    const int elapsedMs = sinceReset.elapsed();
+    setDataTerminalReady(control_port_, false ^ inverted_);
+    setRequestToSend(control_port_, false ^ inverted_);
     if (r.ok()) {
-      qInfo() << "ESPROMClient connected, inverted?" << inverted_;
+      qInfo() << "ESPROMClient connected in" << total.elapsed() << "ms, ROM"
+              << "answered" << elapsedMs << "ms after reset, inverted?"
+              << inverted_;
+      settings.setValue("inverted", inverted_);
+      settings.setValue("syncDelayMs", elapsedMs);
       connected_ = true;
       return util::Status::OK;
     }
-    inverted_ = (i % 2 == 0);
+    inverted_ = !inverted_;
   }
   return QSP("ESPROMClient::connect()", r);
 }
 
+void ESPROMClient::disconnect() {
+  connected_ = false;
+}
+
 util::Status ESPROMClient::rebootIntoFirmware() {
-  control_port_->setDataTerminalReady(false ^ inverted_);  // pull up GPIO0
-  control_port_->setRequestToSend(true ^ inverted_);       // pull down RESET
+  setDataTerminalReady(control_port_, false ^ inverted_);  // pull up GPIO0
+  setRequestToSend(control_port_, true ^ inverted_);       // pull down RESET
   QThread::msleep(50);
-  control_port_->setDataTerminalReady(false ^ inverted_);
-  control_port_->setRequestToSend(false ^ inverted_);  // pull up RESET
+  setDataTerminalReady(control_port_, false ^ inverted_);
+  setRequestToSend(control_port_, false ^ inverted_);  // pull up RESET
   return util::Status::OK;
 }
 
-util::Status ESPROMClient::sync() {
+util::Status ESPROMClient::sync(int timeoutMs) {
   QByteArray arg("\x07\x07\x12\x20");
   arg.append(QByteArray("U").repeated(32));
-  command(Command::Sync, arg);
-  auto cs = command(Command::Sync, arg, 100);
+  command(Command::Sync, arg, 0, true, timeoutMs);
+  auto cs = command(Command::Sync, arg, 0, true, timeoutMs);
   if (!cs.ok()) return cs.status();
   util::StatusOr<QByteArray> s;
   for (int i = 0; i < 7; i++) {
@@ -111,12 +156,53 @@ util::Status ESPROMClient::memWriteBlock(quint32 seq, const QByteArray &data) {
   if (!connected_) {
     return util::Status(util::error::INVALID_ARGUMENT, "Not connected");
   }
+  return command(Command::MemWriteBlock, blockArg(seq, data), checksum(data))
+      .status();
+}
+
+// static
+QByteArray ESPROMClient::blockArg(quint32 seq, const QByteArray &data) {
   QByteArray arg;
   QDataStream s(&arg, QIODevice::WriteOnly);
   s.setByteOrder(QDataStream::LittleEndian);
   s << quint32(data.length()) << seq << quint32(0) << quint32(0);
   arg.append(data);
-  return command(Command::MemWriteBlock, arg, checksum(data)).status();
+  return arg;
+}
+
+util::Status ESPROMClient::memWriteBlocks(const QByteArray &data,
+                                          int maxInFlight) {
+  if (!connected_) {
+    return util::Status(util::error::INVALID_ARGUMENT, "Not connected");
+  }
+  const int numBlocks =
+      (data.length() + memWriteBlockSize - 1) / memWriteBlockSize;
+  // Flush the buffer before the first command.
+  const QByteArray stale = data_port_->readAll();
+  SerialTrace::recordRead(data_port_, stale.constData(), stale.length());
+  int numSent = 0, numAcked = 0;
+  QElapsedTimer t;
+  t.start();
+  QVector<qint64> sentNs(numBlocks);
+  while (numAcked < numBlocks) {
+    while (numSent < numBlocks && numSent - numAcked < maxInFlight) {
+      const QByteArray block =
+          data.mid(numSent * memWriteBlockSize, memWriteBlockSize);
+      sentNs[numSent] = t.nsecsElapsed();
+      util::Status st = sendCommand(Command::MemWriteBlock,
+                                    blockArg(numSent, block), checksum(block));
+      if (!st.ok()) return st;
+      numSent++;
+    }
+    util::Status st =
+        checkStatus(recvResponse(Command::MemWriteBlock, 0),
+                    QObject::tr("memWriteBlock(%1)").arg(numAcked));
+    if (!st.ok()) return st;
+    latencies_.record(commandName(Command::MemWriteBlock),
+                      (t.nsecsElapsed() - sentNs[numAcked]) / 1000);
+    numAcked++;
+  }
+  return util::Status::OK;
 }
 
 util::Status ESPROMClient::memWriteFinish(quint32 jumpAddr) {
@@ -240,12 +326,17 @@ util::Status ESPROMClient::writeMem(quint32 addr, const QByteArray &data,
   util::Status st =
       memWriteStart(data.length(), numBlocks, memWriteBlockSize, addr);
   if (!st.ok()) return st;
-  for (int offset = 0; offset < data.length(); offset += memWriteBlockSize) {
-    int len = data.length() - offset;
-    if (len > memWriteBlockSize) len = memWriteBlockSize;
-    st = memWriteBlock(offset / memWriteBlockSize, data.mid(offset, len));
+  st = memWriteBlocks(data, memWriteMaxInFlight);
+  if (!st.ok() && memWriteMaxInFlight > 1) {
+    // Start over, one block at a time.
+    qWarning() << "Pipelined memory write failed, retrying:" << st;
+    QThread::msleep(50);
+    clearInput(data_port_);
+    st = memWriteStart(data.length(), numBlocks, memWriteBlockSize, addr);
     if (!st.ok()) return st;
+    st = memWriteBlocks(data, 1);
   }
+  if (!st.ok()) return st;
   return memWriteFinish(jumpAddr);
 }
 
@@ -262,7 +353,7 @@ quint8 ESPROMClient::checksum(const QByteArray &data) {
 util::Status ESPROMClient::checkStatus(util::StatusOr<Response> sr,
                                        const QString &label) {
   if (!sr.ok()) return sr.status();
-  Response r = sr.ValueOrDie();
+  Response r = sr.MoveValueOrDie();
   if (r.status != 0) {
     return QS(util::error::UNAVAILABLE, QObject::tr("%1 error: %2 %3")
                                             .arg(label)
@@ -275,61 +366,106 @@ util::Status ESPROMClient::checkStatus(util::StatusOr<Response> sr,
 util::StatusOr<ESPROMClient::Response> ESPROMClient::command(
     Command cmd, const QByteArray &arg, quint8 csum, bool expectResponse,
     int timeoutMs) {
-  Response resp;
+  // Flush the buffer before command.
+  const QByteArray stale = data_port_->readAll();
+  SerialTrace::recordRead(data_port_, stale.constData(), stale.length());
+  QElapsedTimer t;
+  t.start();
+  util::Status st = sendCommand(cmd, arg, csum);
+  if (!st.ok()) return st;
+  if (!expectResponse) return Response();
+  auto res = recvResponse(cmd, timeoutMs);
+  if (res.ok()) latencies_.record(commandName(cmd), t.nsecsElapsed() / 1000);
+  return res;
+}
+
+CommandLatencies ESPROMClient::takeLatencies() {
+  CommandLatencies result;
+  std::swap(result, latencies_);
+  return result;
+}
+
+// static
+QString ESPROMClient::commandName(Command cmd) {
+  switch (cmd) {
+    case Command::FlashWriteStart:
+      return "rom_flash_write_start";
+    case Command::FlashWriteBlock:
+      return "rom_flash_write_block";
+    case Command::FlashWriteFinish:
+      return "rom_flash_write_finish";
+    case Command::MemWriteStart:
+      return "rom_mem_write_start";
+    case Command::MemWriteFinish:
+      return "rom_mem_write_finish";
+    case Command::MemWriteBlock:
+      return "rom_mem_write_block";
+    case Command::Sync:
+      return "rom_sync";
+    case Command::ReadRegister:
+      return "rom_read_register";
+  }
+  return QString("rom_%1").arg(int(cmd));
+}
+
+util::Status ESPROMClient::sendCommand(Command cmd, const QByteArray &arg,
+                                       quint8 csum) {
   QByteArray frame;
   QDataStream s(&frame, QIODevice::WriteOnly);
   s.setByteOrder(QDataStream::LittleEndian);
   s << quint8(0) << quint8(cmd) << quint16(arg.length());
   s << quint32(csum);  // Yes, it is indeed padded with 3 zero bytes.
   frame.append(arg);
-  data_port_->readAll();  // Flush the buffer before command.
-  qDebug() << "Command:" << quint8(cmd) << "arg:" << arg.toHex();
-  SLIP::send(data_port_, frame);
-
-  if (expectResponse) {
-    auto frame =
-        SLIP::recv(data_port_, timeoutMs > 0 ? timeoutMs : commandTimeoutMs_);
-    if (!frame.ok()) return frame.status();
-    const QByteArray &respBytes = frame.ValueOrDie();
-    if (respBytes.length() < 10) {
-      return QS(util::error::INTERNAL,
-                QString("Incomplete response: ") + respBytes.toHex());
-    }
-    QDataStream s(respBytes);
-    s.setByteOrder(QDataStream::LittleEndian);
-    quint8 direction;
-    s >> direction;
-    if (direction != 1) {
-      return QS(
-          util::error::INTERNAL,
-          QString("Invalid direction (first byte) in response:") + direction);
-    }
+  qCDebug(Log::proto) << "Command:" << quint8(cmd)
+                      << "arg:" << arg.left(32).toHex();
+  return SLIP::send(data_port_, frame);
+}
 
-    quint8 respCommand;
-    quint16 bodySize;
-    s >> respCommand >> bodySize >> resp.value;
+util::StatusOr<ESPROMClient::Response> ESPROMClient::recvResponse(
+    Command cmd, int timeoutMs) {
+  Response resp;
+  auto frame =
+      SLIP::recv(data_port_, timeoutMs > 0 ? timeoutMs : commandTimeoutMs_);
+  if (!frame.ok()) return frame.status();
+  const QByteArray &respBytes = frame.ValueOrDie();
+  if (respBytes.length() < 10) {
+    return QS(util::error::INTERNAL,
+              QString("Incomplete response: ") + respBytes.toHex());
+  }
+  QDataStream s(respBytes);
+  s.setByteOrder(QDataStream::LittleEndian);
+  quint8 direction;
+  s >> direction;
+  if (direction != 1) {
+    return QS(util::error::INTERNAL,
+              QString("Invalid direction (first byte) in response:") +
+                  direction);
+  }
 
-    if (respCommand != static_cast<quint8>(cmd)) {
-      return QS(util::error::INTERNAL,
-                QString("Response to a different command (") + respCommand +
-                    "vs" + static_cast<quint8>(cmd) + ")");
-    }
+  quint8 respCommand;
+  quint16 bodySize;
+  s >> respCommand >> bodySize >> resp.value;
 
-    quint16 expectedSize = 1 + 1 + 2 + 4 + bodySize;
-    if (respBytes.length() != expectedSize) {
-      return QS(util::error::INTERNAL,
-                QString("Incorrect response size. Expected ") + expectedSize +
-                    ", got" + respBytes.size());
-    }
+  if (respCommand != static_cast<quint8>(cmd)) {
+    return QS(util::error::INTERNAL,
+              QString("Response to a different command (") + respCommand +
+                  "vs" + static_cast<quint8>(cmd) + ")");
+  }
 
-    resp.body.resize(bodySize);
-    s.readRawData(resp.body.data(), bodySize);
+  quint16 expectedSize = 1 + 1 + 2 + 4 + bodySize;
+  if (respBytes.length() != expectedSize) {
+    return QS(util::error::INTERNAL,
+              QString("Incorrect response size. Expected ") + expectedSize +
+                  ", got" + respBytes.size());
+  }
 
-    if (bodySize == 2) {
-      char *body = resp.body.data();
-      resp.status = body[0];
-      resp.lastError = body[1];
-    }
+  resp.body.resize(bodySize);
+  s.readRawData(resp.body.data(), bodySize);
+
+  if (bodySize == 2) {
+    char *body = resp.body.data();
+    resp.status = body[0];
+    resp.lastError = body[1];
   }
   return resp;
 }
@@ -338,7 +474,8 @@ util::Status ESPROMClient::runStub(const QByteArray &stubJSON,
                                    QVector<quint32> params) {
   QJsonDocument stubDoc(QJsonDocument::fromJson(stubJSON));
   const QJsonObject &stub = stubDoc.object();
-  qDebug() << "Running stub:" << stub;
+  // The whole stub, code included, would be formatted on every connect.
+  qCDebug(Log::proto) << "Running stub:" << stub;
   qDebug() << "Params:" << params;
   int numParams = stub["num_params"].toDouble();
   if (numParams != params.length()) {
@@ -7,27 +7,34 @@
 #define CS_MFT_SRC_ESP_ROM_CLIENT_H_
 
 #include <QByteArray>
-#include <QSerialPort>
+#include <QIODevice>
 #include <QString>
 #include <QVector>
 
 #include <common/util/statusor.h>
 
+#include "latency_histogram.h"
+
 class ESPROMClient {
  public:
-  ESPROMClient(QSerialPort *control_port, QSerialPort *data_port);
+  ESPROMClient(QIODevice *control_port, QIODevice *data_port);
   ~ESPROMClient();
 
   // Accessors
-  QSerialPort *control_port();
-  QSerialPort *data_port();
+  QIODevice *control_port();
+  QIODevice *data_port();
   bool connected() const;
 
-  // Establishes communication with the boot loader.
+  // Establishes communication with the boot loader. Reset polarity and timing
+  // that worked are remembered per port in settings.
   util::Status connect();
+  // Marks the connection as no longer established, e.g. after the device has
+  // been rebooted. Does not talk to the device.
+  void disconnect();
 
   // Low-level commands to the loader.
-  util::Status sync();
+  // timeoutMs applies to each of the sync commands, 0 means default.
+  util::Status sync(int timeoutMs = 0);
   util::Status rebootIntoFirmware();
   util::StatusOr<quint32> readRegister(quint32 addr);
   util::Status memWriteStart(quint32 size, quint32 numBlocks, quint32 blockSize,
@@ -50,6 +57,10 @@ class ESPROMClient {
   util::Status writeMem(quint32 addr, const QByteArray &data,
                         quint32 jumpAddr = 0);
 
+  // Request to response times of the commands since the last call, by
+  // command (rom_sync, rom_mem_write_block, ...).
+  CommandLatencies takeLatencies();
+
  private:
   enum class Command {
     FlashWriteStart = 0x02,
@@ -70,6 +81,7 @@ class ESPROMClient {
     quint8 lastError = 0;
   };
 
+  static QString commandName(Command cmd);
   static quint8 checksum(const QByteArray &data);
   static util::Status checkStatus(util::StatusOr<Response> sr,
                                   const QString &label);
@@ -77,11 +89,21 @@ class ESPROMClient {
   util::StatusOr<Response> command(Command cmd, const QByteArray &arg,
                                    quint8 csum = 0, bool expectResponse = true,
                                    int timeoutMs = 0);
-
-  QSerialPort *control_port_;  // Not owned
-  QSerialPort *data_port_;     // Not owned
+  // Halves of command(), for keeping several commands in flight.
+  util::Status sendCommand(Command cmd, const QByteArray &arg, quint8 csum);
+  util::StatusOr<Response> recvResponse(Command cmd, int timeoutMs);
+
+  static QByteArray blockArg(quint32 seq, const QByteArray &data);
+  // Sends data in MemWriteBlock commands with up to maxInFlight of them
+  // unacknowledged. ROM answers in order, so responses are matched to blocks
+  // by position.
+  util::Status memWriteBlocks(const QByteArray &data, int maxInFlight);
+
+  QIODevice *control_port_;  // Not owned
+  QIODevice *data_port_;     // Not owned
   bool connected_ = false;
   bool inverted_ = false;
+  CommandLatencies latencies_;
   int commandTimeoutMs_ = 2000;
 
   ESPROMClient(const ESPROMClient &other) = delete;
@@ -1,11 +1,45 @@
 #include "file_downloader.h"
 
+#include <algorithm>
+
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFileInfo>
 #include <QNetworkReply>
 #include <QNetworkRequest>
+#include <QSaveFile>
+#include <QSettings>
+#include <QStandardPaths>
 
+#include "fw_bundle.h"
 #include "status_qt.h"
 
+namespace {
+
+const char kSettingsGroup[] = "downloads";
+// Files at least this big are fetched in chunks of kChunkSize, over up to
+// kNumConnections connections at once.
+const qint64 kMinRangedSize = 1024 * 1024;
+const qint64 kChunkSize = 256 * 1024;
+const int kNumConnections = 4;
+
+}  // namespace
+
 FileDownloader::FileDownloader(const QUrl &url) : url_(url) {
+  const QString dir =
+      QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+  if (dir.isEmpty()) return;
+  cacheKey_ = QString::fromLatin1(
+      QCryptographicHash::hash(url_.toEncoded(), QCryptographicHash::Sha1)
+          .toHex());
+  cacheFile_ = dir + "/downloads/" + cacheKey_;
+  // Headers are only good for as long as the file is there.
+  if (!QFileInfo(cacheFile_).isFile()) return;
+  QSettings settings;
+  settings.beginGroup(kSettingsGroup);
+  settings.beginGroup(cacheKey_);
+  etag_ = settings.value("etag").toByteArray();
+  lastModified_ = settings.value("last_modified").toByteArray();
 }
 
 QUrl FileDownloader::url() const {
@@ -17,12 +51,71 @@ util::Status FileDownloader::status() const {
 }
 
 QString FileDownloader::fileName() const {
-  if (tempFile_ == nullptr) return "";
-  return tempFile_->fileName();
+  return fileName_;
 }
 
 void FileDownloader::start() {
-  startURL(url_);
+  if (cacheFile_.isEmpty()) {
+    startURL(url_);
+  } else {
+    startProbe(url_);
+  }
+}
+
+void FileDownloader::startProbe(const QUrl &url) {
+  reply_ = nam_.head(QNetworkRequest(url));
+  connect(reply_, &QNetworkReply::finished, this,
+          &FileDownloader::probeFinished);
+}
+
+void FileDownloader::probeFinished() {
+  QNetworkReply *reply = reply_;
+  reply_ = nullptr;
+  reply->deleteLater();
+  const QUrl url = reply->url();
+  const int code =
+      reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+  QVariant redir =
+      reply->attribute(QNetworkRequest::RedirectionTargetAttribute);
+  if (!reply->error() && !redir.isNull()) {
+    QUrl newURL = url.resolved(redir.toUrl());
+    qDebug() << "Redirected to" << newURL;
+    startProbe(newURL);
+    return;
+  }
+  const qint64 size =
+      reply->header(QNetworkRequest::ContentLengthHeader).toLongLong();
+  QByteArray etag = reply->rawHeader("ETag");
+  if (etag.startsWith("W/")) etag.clear();
+  const QByteArray lastModified = reply->rawHeader("Last-Modified");
+  qDebug() << "Probe" << url << code << size << etag << lastModified;
+  if (reply->error() == QNetworkReply::OperationCanceledError) {
+    status_ = QS(util::error::ABORTED, tr("Download aborted"));
+    emit finished();
+    return;
+  }
+  // Anything unexpected is left for the plain GET to deal with.
+  if (reply->error() || code != 200) {
+    startURL(url);
+    return;
+  }
+  if ((!etag.isEmpty() || !lastModified.isEmpty()) && etag == etag_ &&
+      lastModified == lastModified_ && QFileInfo(cacheFile_).isFile()) {
+    qDebug() << "Not modified, using" << cacheFile_;
+    fileName_ = cacheFile_;
+    status_ = util::Status::OK;
+    emit finished();
+    return;
+  }
+  // Chunks need something to check that they all come from the same file.
+  if (reply->rawHeader("Accept-Ranges") != "bytes" || size < kMinRangedSize ||
+      (etag.isEmpty() && lastModified.isEmpty())) {
+    startURL(url);
+    return;
+  }
+  etag_ = etag;
+  lastModified_ = lastModified;
+  startRanged(url, size);
 }
 
 void FileDownloader::startURL(const QUrl &url) {
@@ -30,6 +123,9 @@ void FileDownloader::startURL(const QUrl &url) {
   if (!etag_.isEmpty()) {
     req.setRawHeader(QByteArray("If-None-Match"), etag_);
   }
+  if (!lastModified_.isEmpty()) {
+    req.setRawHeader(QByteArray("If-Modified-Since"), lastModified_);
+  }
   reply_ = nam_.get(req);
   connect(reply_, &QNetworkReply::downloadProgress, this,
           &FileDownloader::networkRequestProgress);
@@ -63,28 +159,20 @@ void FileDownloader::networkRequestFinished() {
     } else {
       if (code == 200) {
         qDebug() << "Download finished," << reply_->bytesAvailable() << "bytes";
-        tempFile_.reset(new QTemporaryFile());
-        if (tempFile_->open()) {
-          QByteArray data = reply_->readAll();
-          if (tempFile_->write(data) == data.length() && tempFile_->flush()) {
-            status_ = util::Status::OK;
-            etag_ = reply_->rawHeader("ETag");
-            if (etag_.startsWith("W/")) etag_.clear();
-            qDebug() << "Wrote" << data.length() << "bytes to"
-                     << tempFile_->fileName() << "ETag" << etag_;
-          } else {
-            status_ = QS(
-                util::error::UNAVAILABLE,
-                tr("Failed to write data: %1").arg(tempFile_->errorString()));
-          }
-        } else {
-          status_ =
-              QS(util::error::UNAVAILABLE, tr("Failed to create temp file: %1")
-                                               .arg(tempFile_->errorString()));
-        }
+        etag_ = reply_->rawHeader("ETag");
+        if (etag_.startsWith("W/")) etag_.clear();
+        lastModified_ = reply_->rawHeader("Last-Modified");
+        status_ = saveData(reply_->readAll());
+      } else if (code == 304 && QFileInfo(cacheFile_).isFile()) {
+        qDebug() << "Not modified, using" << cacheFile_;
+        fileName_ = cacheFile_;
+        status_ = util::Status::OK;
       } else if (code == 304) {
+        // Got an earlier copy during this session but failed to cache it.
         qDebug() << "Not modified";
-        status_ = util::Status::OK;
+        status_ = tempFile_ != nullptr
+                      ? util::Status::OK
+                      : QS(util::error::INTERNAL, tr("Cached file is gone"));
       } else {
         status_ = QS(util::error::INTERNAL, tr("Bad error code %1").arg(code));
       }
@@ -95,6 +183,250 @@ void FileDownloader::networkRequestFinished() {
   emit finished();
 }
 
+util::Status FileDownloader::saveData(const QByteArray &data) {
+  if (!cacheFile_.isEmpty()) {
+    QDir().mkpath(QFileInfo(cacheFile_).path());
+    // Replaced atomically, a bundle opened from the old copy keeps reading it.
+    QSaveFile f(cacheFile_);
+    if (f.open(QIODevice::WriteOnly) && f.write(data) == data.length() &&
+        f.commit()) {
+      saveHeaders();
+      fileName_ = cacheFile_;
+      qDebug() << "Wrote" << data.length() << "bytes to" << fileName_ << "ETag"
+               << etag_ << "Last-Modified" << lastModified_;
+      return util::Status::OK;
+    }
+    qWarning() << "Failed to cache" << cacheFile_ << ":" << f.errorString();
+    // Without the file there is nothing to revalidate against next time.
+    QSettings settings;
+    settings.beginGroup(kSettingsGroup);
+    settings.remove(cacheKey_);
+  }
+  tempFile_.reset(new QTemporaryFile());
+  if (!tempFile_->open()) {
+    return QS(util::error::UNAVAILABLE, tr("Failed to create temp file: %1")
+                                            .arg(tempFile_->errorString()));
+  }
+  if (tempFile_->write(data) != data.length() || !tempFile_->flush()) {
+    return QS(util::error::UNAVAILABLE,
+              tr("Failed to write data: %1").arg(tempFile_->errorString()));
+  }
+  fileName_ = tempFile_->fileName();
+  qDebug() << "Wrote" << data.length() << "bytes to" << fileName_;
+  return util::Status::OK;
+}
+
+void FileDownloader::saveHeaders() {
+  QSettings settings;
+  settings.beginGroup(kSettingsGroup);
+  settings.beginGroup(cacheKey_);
+  settings.setValue("url", url_.toString());
+  settings.setValue("etag", etag_);
+  settings.setValue("last_modified", lastModified_);
+}
+
+void FileDownloader::startRanged(const QUrl &url, qint64 size) {
+  rangedURL_ = url;
+  size_ = size;
+  received_ = 0;
+  const int numChunks = int((size + kChunkSize - 1) / kChunkSize);
+  partFile_.setFileName(cacheFile_ + ".part");
+  // What is already there is only used if it is a part of the same file.
+  QSettings settings;
+  settings.beginGroup(kSettingsGroup);
+  settings.beginGroup(cacheKey_);
+  settings.beginGroup("partial");
+  done_ = settings.value("done").toBitArray();
+  if (settings.value("etag").toByteArray() != etag_ ||
+      settings.value("last_modified").toByteArray() != lastModified_ ||
+      settings.value("size").toLongLong() != size ||
+      done_.size() != numChunks || QFileInfo(partFile_).size() != size) {
+    done_ = QBitArray(numChunks);
+  }
+  QDir().mkpath(QFileInfo(cacheFile_).path());
+  if (!partFile_.open(QIODevice::ReadWrite) || !partFile_.resize(size)) {
+    qWarning() << "Failed to create" << partFile_.fileName() << ":"
+               << partFile_.errorString();
+    partFile_.close();
+    startURL(url);
+    return;
+  }
+  queue_.clear();
+  for (int i = 0; i < numChunks; i++) {
+    if (!done_.testBit(i)) {
+      queue_.append(i);
+    } else {
+      received_ += std::min(kChunkSize, size - i * kChunkSize);
+    }
+  }
+  saveRangedState();
+  qDebug() << "Fetching" << size << "bytes in" << queue_.size() << "chunks,"
+           << received_ << "bytes already there";
+  for (int i = 0; i < kNumConnections && !queue_.isEmpty(); i++) {
+    startChunk();
+  }
+  if (chunks_.isEmpty()) finishRanged();
+}
+
+void FileDownloader::startChunk() {
+  const int chunk = queue_.takeFirst();
+  const qint64 begin = chunk * kChunkSize;
+  const qint64 end = std::min(begin + kChunkSize, size_) - 1;
+  QNetworkRequest req(rangedURL_);
+  req.setRawHeader(QByteArray("Range"),
+                   QString("bytes=%1-%2").arg(begin).arg(end).toLatin1());
+  // Server sends the whole file instead if it has changed since.
+  req.setRawHeader(QByteArray("If-Range"),
+                   etag_.isEmpty() ? lastModified_ : etag_);
+  QNetworkReply *reply = nam_.get(req);
+  chunks_[reply] = {.chunk = chunk, .received = 0};
+  connect(reply, &QNetworkReply::downloadProgress, this,
+          &FileDownloader::chunkProgress);
+  connect(reply, &QNetworkReply::finished, this,
+          &FileDownloader::chunkFinished);
+}
+
+void FileDownloader::chunkProgress(qint64 recd, qint64 total) {
+  Q_UNUSED(total);
+  auto it = chunks_.find(qobject_cast<QNetworkReply *>(sender()));
+  if (it == chunks_.end()) return;
+  it->received = recd;
+  emitRangedProgress();
+}
+
+void FileDownloader::emitRangedProgress() {
+  qint64 recd = received_;
+  for (const ChunkRequest &cr : chunks_) recd += cr.received;
+  emit progress(recd, size_);
+}
+
+void FileDownloader::chunkFinished() {
+  QNetworkReply *reply = qobject_cast<QNetworkReply *>(sender());
+  if (reply == nullptr || !chunks_.contains(reply)) return;
+  const int chunk = chunks_.take(reply).chunk;
+  reply->deleteLater();
+  const int code =
+      reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+  if (reply->error()) {
+    failRanged(QS(util::error::UNAVAILABLE, reply->errorString()));
+    return;
+  }
+  if (code == 200) {
+    // If-Range did not match, the file has changed and this is all of it.
+    qDebug() << "File changed during download, using the full reply";
+    failRanged(util::Status::OK);
+    clearRangedState();
+    etag_ = reply->rawHeader("ETag");
+    if (etag_.startsWith("W/")) etag_.clear();
+    lastModified_ = reply->rawHeader("Last-Modified");
+    status_ = saveData(reply->readAll());
+    emit finished();
+    return;
+  }
+  const qint64 begin = chunk * kChunkSize;
+  const qint64 length = std::min(kChunkSize, size_ - begin);
+  const QByteArray data = reply->readAll();
+  if (code != 206 || data.length() != length) {
+    failRanged(QS(util::error::UNAVAILABLE,
+                  tr("Bad reply to range request: %1, %2 bytes")
+                      .arg(code)
+                      .arg(data.length())));
+    return;
+  }
+  if (!partFile_.seek(begin) || partFile_.write(data) != length ||
+      !partFile_.flush()) {
+    failRanged(QS(util::error::UNAVAILABLE,
+                  tr("Failed to write data: %1").arg(partFile_.errorString())));
+    return;
+  }
+  done_.setBit(chunk);
+  received_ += length;
+  saveRangedState();
+  emitRangedProgress();
+  if (!queue_.isEmpty()) {
+    startChunk();
+  } else if (chunks_.isEmpty()) {
+    finishRanged();
+  }
+}
+
+void FileDownloader::saveRangedState() {
+  QSettings settings;
+  settings.beginGroup(kSettingsGroup);
+  settings.beginGroup(cacheKey_);
+  settings.beginGroup("partial");
+  settings.setValue("etag", etag_);
+  settings.setValue("last_modified", lastModified_);
+  settings.setValue("size", size_);
+  settings.setValue("done", done_);
+}
+
+void FileDownloader::clearRangedState() {
+  QSettings settings;
+  settings.beginGroup(kSettingsGroup);
+  settings.beginGroup(cacheKey_);
+  settings.remove("partial");
+  QFile::remove(partFile_.fileName());
+}
+
+void FileDownloader::failRanged(const util::Status &st) {
+  // Chunks written so far stay on disk, to be resumed from next time.
+  for (QNetworkReply *reply : chunks_.keys()) {
+    reply->disconnect(this);
+    reply->abort();
+    reply->deleteLater();
+  }
+  chunks_.clear();
+  queue_.clear();
+  partFile_.close();
+  if (st.ok()) return;
+  status_ = st;
+  emit finished();
+}
+
+void FileDownloader::finishRanged() {
+  partFile_.close();
+  // Chunks come from different connections, so check that together they
+  // make up a bundle with parts matching the manifest. Anything else is
+  // passed on as is.
+  util::Status st = util::Status::OK;
+  QByteArray magic;
+  if (partFile_.open(QIODevice::ReadOnly)) {
+    magic = partFile_.read(4);
+    partFile_.close();
+  }
+  if (magic == "PK\x03\x04") {
+    auto br = NewZipFWBundle(partFile_.fileName());
+    st = br.ok() ? br.ValueOrDie()->verifyAll() : br.status();
+  }
+  if (!st.ok()) {
+    qWarning() << "Downloaded file is corrupt:" << st;
+    clearRangedState();
+    status_ = QSP("downloaded file is corrupt", st);
+    emit finished();
+    return;
+  }
+  QFile::remove(cacheFile_);
+  if (!QFile::rename(partFile_.fileName(), cacheFile_)) {
+    status_ = QS(util::error::UNAVAILABLE,
+                 tr("Failed to rename %1").arg(partFile_.fileName()));
+    emit finished();
+    return;
+  }
+  QSettings settings;
+  settings.beginGroup(kSettingsGroup);
+  settings.beginGroup(cacheKey_);
+  settings.remove("partial");
+  saveHeaders();
+  fileName_ = cacheFile_;
+  status_ = util::Status::OK;
+  qDebug() << "Download finished," << size_ << "bytes in" << cacheFile_;
+  emit finished();
+}
+
 void FileDownloader::abort() {
   if (reply_ != nullptr) reply_->abort();
+  if (!chunks_.isEmpty()) {
+    failRanged(QS(util::error::ABORTED, tr("Download aborted")));
+  }
 }
@@ -8,7 +8,11 @@
 
 #include <memory>
 
+#include <QBitArray>
 #include <QByteArray>
+#include <QFile>
+#include <QList>
+#include <QMap>
 #include <QNetworkAccessManager>
 #include <QObject>
 #include <QTemporaryFile>
@@ -16,6 +20,11 @@
 
 #include <common/util/status.h>
 
+// Downloads url to a file. Downloaded files are kept in the cache location
+// along with their ETag and Last-Modified, and are not fetched again unless
+// the server says they have changed. Large files are fetched in chunks over
+// several connections if the server supports ranges, and a download that
+// fails part way is resumed from where it stopped, even after a restart.
 class FileDownloader : public QObject {
   Q_OBJECT
 
@@ -23,6 +32,7 @@ class FileDownloader : public QObject {
   FileDownloader(const QUrl &url);
   QUrl url() const;
   util::Status status() const;
+  // Valid once the download has finished successfully.
   QString fileName() const;
 
   void start();
@@ -35,16 +45,50 @@ signals:
  private slots:
   void networkRequestProgress(qint64 recd, qint64 total);
   void networkRequestFinished();
+  void probeFinished();
+  void chunkProgress(qint64 recd, qint64 total);
+  void chunkFinished();
 
  private:
+  // Sends a HEAD request to find out if the file can be fetched in ranges.
+  void startProbe(const QUrl &url);
   void startURL(const QUrl &url);
+  // Stores data in the cache, or in a temporary file if that fails.
+  util::Status saveData(const QByteArray &data);
+  void saveHeaders();
+
+  // Ranged download into cacheFile_ + ".part".
+  void startRanged(const QUrl &url, qint64 size);
+  void startChunk();
+  void saveRangedState();
+  void clearRangedState();
+  void finishRanged();
+  void failRanged(const util::Status &st);
+  void emitRangedProgress();
 
   const QUrl url_;
+  // Cached copy of url_ and key of its headers, empty if there is no cache.
+  QString cacheFile_;
+  QString cacheKey_;
   QNetworkAccessManager nam_;
   std::unique_ptr<QTemporaryFile> tempFile_;
+  QString fileName_;
   QByteArray etag_;
-  QNetworkReply *reply_;
+  QByteArray lastModified_;
+  QNetworkReply *reply_ = nullptr;
   util::Status status_;
+
+  QUrl rangedURL_;
+  QFile partFile_;
+  qint64 size_ = 0;
+  QBitArray done_;       // Chunks that have been written to partFile_.
+  QList<int> queue_;     // Chunks yet to be requested.
+  qint64 received_ = 0;  // Bytes in done_ chunks.
+  struct ChunkRequest {
+    int chunk;
+    qint64 received;
+  };
+  QMap<QNetworkReply *, ChunkRequest> chunks_;
 };
 
 #endif /* CS_MFT_SRC_FILE_DOWNLOADER_H_ */
@@ -0,0 +1,326 @@
+#include "flash_server.h"
+
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QJsonDocument>
+#include <QLocalSocket>
+#include <QPointer>
+#include <QThread>
+#include <QVariantMap>
+
+#include "config.h"
+#include "hal.h"
+#include "serial.h"
+#include "status_qt.h"
+
+#if (QT_VERSION < QT_VERSION_CHECK(5, 5, 0))
+#define qInfo qWarning
+#endif
+
+namespace {
+
+// Progress events are sent at most this often.
+const int kProgressIntervalMs = 250;
+
+QJsonObject failure(const util::Status &st) {
+  QJsonObject r;
+  r["event"] = QString("done");
+  r["success"] = false;
+  r["message"] = QString::fromStdString(st.ToString());
+  return r;
+}
+
+// Runs one request. Lives on a thread of its own: the port is opened there,
+// and the HAL and the flasher block on it.
+class ServerJob : public QObject {
+  Q_OBJECT
+
+ public:
+  ServerJob(const QString &cmd, const QString &port, const QString &platform,
+            std::unique_ptr<Config> config,
+            std::shared_ptr<FirmwareBundle> fw, Prompter *prompter)
+      : cmd_(cmd),
+        port_(port),
+        platform_(platform),
+        config_(std::move(config)),
+        fw_(fw),
+        prompter_(prompter) {
+  }
+
+ public slots:
+  void run() {
+    QElapsedTimer timer;
+    timer.start();
+    QJsonObject r = runRequest();
+    r["elapsed_ms"] = double(timer.elapsed());
+    emit event(r);
+  }
+
+signals:
+  void event(QJsonObject e);
+
+ private:
+  QJsonObject runRequest() {
+    auto sp = openPort(port_, 115200);
+    if (!sp.ok()) return failure(sp.status());
+    std::unique_ptr<QIODevice> port(sp.ValueOrDie());
+    std::unique_ptr<HAL> hal = newHAL(platform_, port.get());
+    if (hal == nullptr) {
+      return failure(QS(util::error::INVALID_ARGUMENT,
+                        tr("platform %1 can not be used with %2")
+                            .arg(platform_)
+                            .arg(port_)));
+    }
+    QJsonObject r;
+    util::Status st;
+    if (cmd_ == "probe") {
+      st = hal->probe();
+    } else if (cmd_ == "get-mac") {
+      auto mac = hal->getMAC();
+      st = mac.status();
+      if (st.ok()) r["mac"] = mac.ValueOrDie();
+    } else {
+      st = flash(hal.get(), &r);
+    }
+    hal->release();
+    port->close();
+    if (!st.ok()) return failure(st);
+    r["event"] = QString("done");
+    r["success"] = true;
+    if (!r.contains("message")) r["message"] = QString("OK");
+    return r;
+  }
+
+  util::Status flash(HAL *hal, QJsonObject *r) {
+    std::unique_ptr<Flasher> f(hal->flasher(prompter_));
+    util::Status st = f->setOptionsFromConfig(*config_);
+    if (!st.ok()) return st;
+    st = f->setFirmware(fw_.get());
+    if (!st.ok()) return st;
+    const int total = f->totalBytes();
+    // The flasher lives on this thread, so these are direct calls.
+    connect(f.get(), &Flasher::statusMessage,
+            [this](QString msg, bool important) {
+              if (!important) return;
+              QJsonObject e;
+              e["event"] = QString("status");
+              e["message"] = msg;
+              emit event(e);
+            });
+    QElapsedTimer sinceProgress;
+    sinceProgress.start();
+    int bytes = 0;
+    connect(f.get(), &Flasher::progress, [&bytes](int b) { bytes = b; });
+    connect(f.get(), &Flasher::progressRate,
+            [this, total, &sinceProgress, &bytes](int bytesPerSec, int etaMs) {
+              if (sinceProgress.elapsed() < kProgressIntervalMs &&
+                  bytes < total) {
+                return;
+              }
+              sinceProgress.restart();
+              QJsonObject e;
+              e["event"] = QString("progress");
+              e["bytes"] = bytes;
+              e["total"] = total;
+              e["bytes_per_sec"] = bytesPerSec;
+              if (etaMs >= 0) e["eta_ms"] = etaMs;
+              emit event(e);
+            });
+    QString result;
+    bool success = false;
+    connect(f.get(), &Flasher::done,
+            [&result, &success](QString msg, bool ok) {
+              result = msg;
+              success = ok;
+            });
+    connect(f.get(), &Flasher::metrics, [r](QVariantMap m) {
+      (*r)["metrics"] = QJsonObject::fromVariantMap(m);
+    });
+    f->run();
+    (*r)["message"] = result;
+    if (!success) return QS(util::error::ABORTED, result);
+    return util::Status::OK;
+  }
+
+  const QString cmd_;
+  const QString port_;
+  const QString platform_;
+  std::unique_ptr<Config> config_;
+  std::shared_ptr<FirmwareBundle> fw_;
+  Prompter *prompter_;
+};
+
+}  // namespace
+
+FlashServer::FlashServer(Config *config, Prompter *prompter,
+                         const QString &defaultPlatform, QObject *parent)
+    : QObject(parent),
+      config_(config),
+      prompter_(prompter),
+      defaultPlatform_(defaultPlatform) {
+  connect(&server_, &QLocalServer::newConnection, this,
+          &FlashServer::newConnection);
+}
+
+FlashServer::~FlashServer() {
+}
+
+util::Status FlashServer::listen(const QString &name) {
+  // A socket file may be left over from a previous run.
+  QLocalServer::removeServer(name);
+  // Whoever connects can flash the devices, the names are easy to guess.
+  server_.setSocketOptions(QLocalServer::UserAccessOption);
+  if (!server_.listen(name)) {
+    return QS(util::error::UNAVAILABLE, tr("failed to listen on %1: %2")
+                                            .arg(name)
+                                            .arg(server_.errorString()));
+  }
+  qInfo() << "Listening on" << server_.fullServerName();
+  return util::Status::OK;
+}
+
+void FlashServer::setMetrics(MetricsRegistry *registry,
+                             const QString &textFile) {
+  metrics_ = registry;
+  metricsTextFile_ = textFile;
+}
+
+void FlashServer::newConnection() {
+  while (QLocalSocket *c = server_.nextPendingConnection()) {
+    connect(c, &QLocalSocket::readyRead, this,
+            [this, c]() { readRequests(c); });
+    connect(c, &QLocalSocket::disconnected, c, &QObject::deleteLater);
+  }
+}
+
+void FlashServer::readRequests(QLocalSocket *client) {
+  while (client->canReadLine()) {
+    const QByteArray line = client->readLine().trimmed();
+    if (line.isEmpty()) continue;
+    QJsonParseError err;
+    const QJsonDocument doc = QJsonDocument::fromJson(line, &err);
+    util::Status st;
+    if (err.error != QJsonParseError::NoError || !doc.isObject()) {
+      st = QS(util::error::INVALID_ARGUMENT,
+              tr("invalid request: %1").arg(err.errorString()));
+    } else {
+      st = startRequest(client, doc.object());
+    }
+    if (!st.ok()) {
+      QJsonObject r = failure(st);
+      if (doc.isObject()) r["id"] = doc.object()["id"];
+      send(client, r);
+    }
+  }
+}
+
+util::Status FlashServer::startRequest(QLocalSocket *client,
+                                       const QJsonObject &req) {
+  const QJsonValue id = req["id"];
+  const QString cmd = req["cmd"].toString();
+  const QString port = req["port"].toString();
+  if (cmd == "metrics") {
+    QJsonObject r;
+    r["id"] = id;
+    r["event"] = QString("done");
+    r["success"] = true;
+    r["text"] = QString::fromUtf8(
+        metrics_ != nullptr ? metrics_->exposition() : QByteArray());
+    send(client, r);
+    return util::Status::OK;
+  }
+  if (cmd != "flash" && cmd != "probe" && cmd != "get-mac") {
+    return QS(util::error::INVALID_ARGUMENT,
+              tr("unknown command: %1").arg(cmd));
+  }
+  if (port.isEmpty()) {
+    return QS(util::error::INVALID_ARGUMENT, tr("no port given"));
+  }
+  if (cmd == "flash" && req["firmware"].toString().isEmpty()) {
+    return QS(util::error::INVALID_ARGUMENT, tr("no firmware given"));
+  }
+  if (busyPorts_.contains(port)) {
+    return QS(util::error::UNAVAILABLE, tr("%1 is busy").arg(port));
+  }
+  std::unique_ptr<Config> config(new Config(*config_));
+  util::Status st =
+      config->fromJSON(req["options"].toObject(), Config::Level::Flags);
+  if (!st.ok()) return st;
+  std::shared_ptr<FirmwareBundle> fw;
+  if (cmd == "flash") {
+    auto fwr = bundle(req["firmware"].toString());
+    if (!fwr.ok()) return fwr.status();
+    fw = fwr.ValueOrDie();
+  }
+
+  ServerJob *job =
+      new ServerJob(cmd, port, req["platform"].toString(defaultPlatform_),
+                    std::move(config), fw, prompter_);
+  QThread *thread = new QThread(this);
+  thread->setStackSize(Flasher::kThreadStackSize);
+  job->moveToThread(thread);
+  QPointer<QLocalSocket> c(client);
+  connect(job, &ServerJob::event, this,
+          [this, c, id, cmd, port, thread](QJsonObject e) {
+            e["id"] = id;
+            // The client may be gone, the request still runs to completion.
+            if (c != nullptr) send(c, e);
+            if (e["event"].toString() == "done") {
+              qInfo() << port << cmd << "done:" << e["message"].toString();
+              busyPorts_.remove(port);
+              thread->quit();
+              if (cmd == "flash") recordMetrics(port, e);
+            }
+          });
+  connect(thread, &QThread::started, job, &ServerJob::run);
+  connect(thread, &QThread::finished, job, &QObject::deleteLater);
+  connect(thread, &QThread::finished, thread, &QObject::deleteLater);
+  busyPorts_.insert(port);
+  thread->start();
+
+  QJsonObject started;
+  started["id"] = id;
+  started["event"] = QString("started");
+  send(client, started);
+  return util::Status::OK;
+}
+
+void FlashServer::recordMetrics(const QString &port, const QJsonObject &done) {
+  if (metrics_ == nullptr) return;
+  metrics_->record(port, done["success"].toBool(),
+                   done["metrics"].toObject().toVariantMap());
+  if (metricsTextFile_.isEmpty()) return;
+  util::Status st = metrics_->writeTextFile(metricsTextFile_);
+  if (!st.ok()) qCritical() << "Failed to write metrics:" << st;
+}
+
+void FlashServer::send(QLocalSocket *client, const QJsonObject &msg) {
+  client->write(QJsonDocument(msg).toJson(QJsonDocument::Compact) + "\n");
+}
+
+util::StatusOr<std::shared_ptr<FirmwareBundle>> FlashServer::bundle(
+    const QString &path) {
+  const QFileInfo fi(path);
+  const QString key = fi.absoluteFilePath();
+  auto it = bundles_.find(key);
+  if (it != bundles_.end() && it->second.modified == fi.lastModified()) {
+    return it->second.bundle;
+  }
+  auto fwbs = NewZipFWBundle(key);
+  if (!fwbs.ok()) {
+    return QSP(tr("failed to load firmware bundle %1").arg(path),
+               fwbs.status());
+  }
+  std::shared_ptr<FirmwareBundle> fwb(fwbs.MoveValueOrDie().release());
+  util::Status st = fwb->verifyAll();
+  if (!st.ok()) return QSP(tr("invalid firmware bundle %1").arg(path), st);
+  qInfo() << "Loaded" << key << fwb->name() << fwb->platform().toUpper()
+          << fwb->buildId();
+  CachedBundle &cb = bundles_[key];
+  cb.modified = fi.lastModified();
+  cb.bundle = fwb;
+  return fwb;
+}
+
+#include "flash_server.moc"
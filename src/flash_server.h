@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ */
+
+#ifndef CS_MFT_SRC_FLASH_SERVER_H_
+#define CS_MFT_SRC_FLASH_SERVER_H_
+
+#include <map>
+#include <memory>
+
+#include <QDateTime>
+#include <QJsonObject>
+#include <QLocalServer>
+#include <QObject>
+#include <QSet>
+#include <QString>
+
+#include <common/util/statusor.h>
+
+#include "fw_bundle.h"
+#include "metrics_registry.h"
+#include "prompter.h"
+
+class Config;
+class QLocalSocket;
+
+// Stays resident and runs requests from clients of a local socket (a Unix
+// domain socket, or a named pipe on Windows), each on a thread of its own.
+// Requests and replies are JSON objects, one per line. Requests:
+//   {"id": 1, "cmd": "flash", "port": "/dev/ttyUSB0", "platform": "esp8266",
+//    "firmware": "fw.zip", "options": {"esp8266-flash-size": "4M"}}
+//   {"id": 2, "cmd": "probe", "port": "/dev/ttyUSB1"}
+//   {"id": 3, "cmd": "get-mac", "port": "/dev/ttyUSB1"}
+// platform defaults to --platform, options override the config for that
+// request only, firmware is required for flash. Replies carry the id of the
+// request they are for:
+//   {"id": 1, "event": "started"}
+//   {"id": 1, "event": "status", "message": "..."}
+//   {"id": 1, "event": "progress", "bytes": 4096, "total": 393216,
+//    "bytes_per_sec": 50000, "eta_ms": 7782}
+//   {"id": 1, "event": "done", "success": true, "message": "...",
+//    "elapsed_ms": 12345, "metrics": {...}}
+// get-mac sets "mac" in the done event. A "metrics" request (no port)
+// returns statistics of the runs so far (see MetricsRegistry) in "text".
+// Requests that could not be started get a done event with success set to
+// false right away.
+class FlashServer : public QObject {
+  Q_OBJECT
+
+ public:
+  FlashServer(Config *config, Prompter *prompter,
+              const QString &defaultPlatform, QObject *parent = nullptr);
+  ~FlashServer() override;
+
+  util::Status listen(const QString &name);
+  // Runs are recorded in the registry, which is also written to textFile
+  // after each of them, unless it is empty.
+  void setMetrics(MetricsRegistry *registry, const QString &textFile);
+
+ private slots:
+  void newConnection();
+
+ private:
+  struct CachedBundle {
+    QDateTime modified;
+    std::shared_ptr<FirmwareBundle> bundle;
+  };
+
+  void readRequests(QLocalSocket *client);
+  util::Status startRequest(QLocalSocket *client, const QJsonObject &req);
+  void send(QLocalSocket *client, const QJsonObject &msg);
+  void recordMetrics(const QString &port, const QJsonObject &done);
+  // Bundles are loaded and verified once, and again only if the file
+  // changes. Requests that are running keep the old one.
+  util::StatusOr<std::shared_ptr<FirmwareBundle>> bundle(const QString &path);
+
+  Config *config_;
+  Prompter *prompter_;
+  const QString defaultPlatform_;
+  QLocalServer server_;
+  std::map<QString, CachedBundle> bundles_;  // By absolute path.
+  QSet<QString> busyPorts_;
+  MetricsRegistry *metrics_ = nullptr;
+  QString metricsTextFile_;
+};
+
+#endif /* CS_MFT_SRC_FLASH_SERVER_H_ */
@@ -0,0 +1,62 @@
+#include "flash_span.h"
+
+#include <algorithm>
+
+#include <QCryptographicHash>
+
+namespace {
+
+quint32 alignUp(quint32 len, quint32 alignment) {
+  return (len + alignment - 1) / alignment * alignment;
+}
+
+}  // namespace
+
+FlashSpan::FlashSpan(const QByteArray &data, quint32 alignment)
+    : data_(data),
+      dataLength_(data.length()),
+      paddedLength_(alignUp(data.length(), alignment)) {
+}
+
+FlashSpan FlashSpan::mid(quint32 offset, quint32 len) const {
+  FlashSpan result;
+  offset = std::min(offset, paddedLength_);
+  len = std::min(len, paddedLength_ - offset);
+  result.data_ = data_;
+  result.offset_ = offset_ + std::min(offset, dataLength_);
+  result.dataLength_ =
+      offset < dataLength_ ? std::min(len, dataLength_ - offset) : 0;
+  result.paddedLength_ = len;
+  return result;
+}
+
+FlashSpan FlashSpan::padded(quint32 alignment) const {
+  FlashSpan result(*this);
+  result.paddedLength_ = alignUp(paddedLength_, alignment);
+  return result;
+}
+
+QByteArray FlashSpan::bytes(quint32 offset, quint32 len) const {
+  offset = std::min(offset, paddedLength_);
+  len = std::min(len, paddedLength_ - offset);
+  if (offset + len <= dataLength_) {
+    return QByteArray::fromRawData(data_.constData() + offset_ + offset, len);
+  }
+  QByteArray result(len, '\xff');
+  if (offset < dataLength_) {
+    std::copy_n(data_.constData() + offset_ + offset, dataLength_ - offset,
+                result.data());
+  }
+  return result;
+}
+
+QByteArray FlashSpan::md5() const {
+  QCryptographicHash h(QCryptographicHash::Md5);
+  h.addData(data_.constData() + offset_, dataLength_);
+  const QByteArray blank(4096, '\xff');
+  for (quint32 n = dataLength_; n < paddedLength_; n += blank.length()) {
+    h.addData(blank.constData(), std::min(paddedLength_ - n,
+                                          quint32(blank.length())));
+  }
+  return h.result();
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ */
+
+#ifndef CS_MFT_SRC_FLASH_SPAN_H_
+#define CS_MFT_SRC_FLASH_SPAN_H_
+
+#include <QByteArray>
+
+// Data to be written to flash: a part of an image, followed by 0xFF up to
+// the padded length, which is what erased flash reads as, so padding leaves
+// it as it is. The image data is shared (QByteArray is implicitly
+// shared and never modified here) and the padding is not stored, so spans of
+// a firmware bundle's parts can be handed to any number of flashers without
+// copies being made.
+class FlashSpan {
+ public:
+  FlashSpan() {
+  }
+  // All of data, padded with 0xFF to a multiple of alignment.
+  explicit FlashSpan(const QByteArray &data, quint32 alignment = 1);
+
+  // len bytes from offset, padding included, e.g. to split a span at block
+  // boundaries.
+  FlashSpan mid(quint32 offset, quint32 len) const;
+  // The same span, padded to a multiple of alignment.
+  FlashSpan padded(quint32 alignment) const;
+
+  // With the padding.
+  quint32 length() const {
+    return paddedLength_;
+  }
+  bool isEmpty() const {
+    return paddedLength_ == 0;
+  }
+
+  // len bytes from offset, padding included. As long as they are all image
+  // data, this is a view of it that is only valid while the span is around;
+  // otherwise the bytes are copied.
+  QByteArray bytes(quint32 offset, quint32 len) const;
+
+  QByteArray md5() const;
+
+ private:
+  QByteArray data_;
+  quint32 offset_ = 0;      // Where the span starts in data_.
+  quint32 dataLength_ = 0;  // Bytes of data_ in the span, the rest is 0xFF.
+  quint32 paddedLength_ = 0;
+};
+
+#endif /* CS_MFT_SRC_FLASH_SPAN_H_ */
@@ -1,28 +1,85 @@
 #include "flasher.h"
 
 #include <QByteArray>
-#include <QDataStream>
 #include <QDateTime>
+#include <QElapsedTimer>
+#include <QFile>
+#if (QT_VERSION >= QT_VERSION_CHECK(5, 10, 0))
+#include <QRandomGenerator>
+#endif
 
 #include "status_qt.h"
 
 const char Flasher::kMergeFSOption[] = "merge-flash-fs";
 const char Flasher::kFlashBaudRateOption[] = "flash-baud-rate";
 const char Flasher::kDumpFSOption[] = "dump-fs";
+const char Flasher::kPlanOption[] = "plan";
 
-QByteArray randomDeviceID(const QString &domain) {
-  qsrand(QDateTime::currentMSecsSinceEpoch() & 0xFFFFFFFF);
-  QByteArray random;
-  QDataStream s(&random, QIODevice::WriteOnly);
-  for (int i = 0; i < 6; i++) {
-    // Minimal value for RAND_MAX is 32767, so we are guaranteed to get at
-    // least 15 bits of randomness. In that case highest bit of each word will
-    // be 0, but whatever, we're not doing crypto here (although we should).
-    s << qint16(qrand() & 0xFFFF);
-    // TODO(imax): use a proper cryptographic PRNG at least for PSK. It must
-    // be hard to guess PSK knowing the ID, which is not the case with
-    // qrand(): there are at most 2^32 unique sequences.
+void Flasher::startProgress(int total) {
+  flushProgress();
+  progressMeter_.start(total);
+  emit progress(0);
+}
+
+void Flasher::reportProgress(int bytes) {
+  if (!progressMeter_.update(bytes)) return;
+  emit progress(bytes);
+  emit progressRate(progressMeter_.bytesPerSec(), progressMeter_.etaMs());
+}
+
+void Flasher::flushProgress() {
+  if (!progressMeter_.flush()) return;
+  emit progress(progressMeter_.bytes());
+  emit progressRate(progressMeter_.bytesPerSec(), progressMeter_.etaMs());
+}
+
+void Flasher::setBandwidthGate(BandwidthGate *gate) {
+  bandwidthGate_ = gate;
+}
+
+qint64 Flasher::beginBulkTransfer() {
+  if (bandwidthGate_ == nullptr || inBulkTransfer_) return 0;
+  QElapsedTimer timer;
+  timer.start();
+  bandwidthGate_->acquire();
+  inBulkTransfer_ = true;
+  return timer.elapsed();
+}
+
+void Flasher::endBulkTransfer() {
+  flushProgress();
+  if (!inBulkTransfer_) return;
+  bandwidthGate_->release();
+  inBulkTransfer_ = false;
+}
+
+QByteArray randomBytes(int n) {
+  QByteArray random(n, '\0');
+#if (QT_VERSION >= QT_VERSION_CHECK(5, 10, 0))
+  for (int i = 0; i < n; i++) {
+    random[i] = char(QRandomGenerator::system()->generate() & 0xFF);
+  }
+  return random;
+#else
+  QFile f("/dev/urandom");
+  if (f.open(QIODevice::ReadOnly) && f.read(random.data(), n) == n) {
+    return random;
   }
+  // qrand() is seeded per thread. Minimal value for RAND_MAX is 32767, so
+  // only the low byte of each value is taken.
+  static thread_local bool seeded = false;
+  if (!seeded) {
+    qsrand(uint(QDateTime::currentMSecsSinceEpoch()) ^
+           uint(quintptr(&seeded)));
+    seeded = true;
+  }
+  for (int i = 0; i < n; i++) random[i] = char(qrand() & 0xFF);
+  return random;
+#endif
+}
+
+QByteArray randomDeviceID(const QString &domain) {
+  const QByteArray random = randomBytes(12);
   return QString("{\"id\":\"//%1/d/%2\",\"key\":\"%3\"}")
       .arg(domain)
       .arg(QString::fromUtf8(random.mid(0, 5).toBase64(
@@ -14,6 +14,7 @@
 #include <common/util/statusor.h>
 
 #include "fw_bundle.h"
+#include "progress_meter.h"
 
 class Config;
 class QByteArray;
@@ -23,6 +24,12 @@ class QVariant;
 // Flasher overwrites the firmware on the device with a new image.
 // Same object can be re-used, just call load() again to load a new image
 // or setPort() to change the serial port before calling run() again.
+//
+// The protocol code under run() (SLIP, the ROM and stub clients, the CC3200
+// loader) blocks on the port with waitForReadyRead and waitForBytesWritten
+// and is not driven by events, so each device takes a thread. Many devices
+// are flashed with a thread per port and, past what one process handles
+// well, with worker processes (see --workers).
 class Flasher : public QObject {
   Q_OBJECT
 
@@ -30,10 +37,22 @@ class Flasher : public QObject {
   virtual ~Flasher(){};
   // Sets the firmware bundle to be flashed. Implementation should perform any
   // platform-specific validation necessary and return OK if the fw is good.
-  virtual util::Status setFirmware(FirmwareBundle *fw) = 0;
+  // The bundle may be shared with other flashers and must outlive run().
+  virtual util::Status setFirmware(const FirmwareBundle *fw) = 0;
   // totalBytes should return the number of bytes in the loaded firmware.
   // It is used to track the progress of flashing.
   virtual int totalBytes() const = 0;
+  // prepare may be called, in the same thread as run and before it, to do the
+  // part of the work that does not depend on the firmware, e.g. connecting to
+  // the device, while the firmware is still being fetched. setFirmware can be
+  // called while it runs. run picks up where prepare left off and reports
+  // its errors, if any.
+  virtual void prepare(){};
+  // release undoes prepare when run is not going to follow, e.g. because the
+  // firmware turned out to be unusable: the device is rebooted into its
+  // firmware and the port is back at the speed it was. Called in the same
+  // thread as prepare, after it.
+  virtual void release(){};
   // run should actually do the flashing. It needs to be started in a separate
   // thread as it does not return until the flashing is done (or failed).
   virtual void run() = 0;
@@ -48,13 +67,66 @@ class Flasher : public QObject {
   static const char kMergeFSOption[];
   static const char kFlashBaudRateOption[];
   static const char kDumpFSOption[];
+  // If set, run works out what would be erased and written, reports it and
+  // leaves flash as it is.
+  static const char kPlanOption[];
+
+  // Flashers block in port I/O, so each of them runs on its own thread. That
+  // thread does not need the default stack, which is 8 MiB on some systems.
+  static const uint kThreadStackSize = 1024 * 1024;
+
+  // Lets a limited number of flashers move bulk data at once, see
+  // BandwidthScheduler.
+  class BandwidthGate {
+   public:
+    virtual ~BandwidthGate() {
+    }
+    // Blocks until the caller may start.
+    virtual void acquire() = 0;
+    virtual void release() = 0;
+  };
+
+  // Not owned, null (the default) for no limit. Set before run().
+  virtual void setBandwidthGate(BandwidthGate *gate);
+
+ protected:
+  // Implementations report progress through these rather than emitting it
+  // directly, which coalesces the updates and adds the rate.
+  void startProgress(int total);
+  void reportProgress(int bytes);
+  // Reports the last progress if reportProgress held it back. Called by
+  // endBulkTransfer and startProgress, implementations call it before done().
+  void flushProgress();
+
+  // Bracket phases that stream flash data (writing, reading it back) with
+  // these. beginBulkTransfer waits for the gate, if there is one, and returns
+  // how long that took in milliseconds. endBulkTransfer does nothing if no
+  // transfer has begun, so it is safe on error paths.
+  qint64 beginBulkTransfer();
+  void endBulkTransfer();
+
+ private:
+  ProgressMeter progressMeter_;
+  BandwidthGate *bandwidthGate_ = nullptr;
+  bool inBulkTransfer_ = false;
 
 signals:
   void progress(int blocksWritten);
+  // Emitted after each progress, with the transfer rate and the expected time
+  // to finish in milliseconds (-1 if not known yet).
+  void progressRate(int bytesPerSec, int etaMs);
   void statusMessage(QString message, bool important = false);
   void done(QString message, bool success);
+  // Emitted before done() with measurements of the run, if the implementation
+  // collects any. "phases" is a list of maps with "name" and "ms" and, for
+  // phases that move flash data, "bytes" and "bytes_per_sec". Other keys are
+  // implementation-specific counters.
+  void metrics(QVariantMap metrics);
 };
 
+// From the system's cryptographic generator where there is one. Falls back to
+// qrand(), which is not good enough for keys.
+QByteArray randomBytes(int n);
 QByteArray randomDeviceID(const QString &domain);
 util::StatusOr<quint32> parseSize(const QVariant &value);
 
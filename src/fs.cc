@@ -1,7 +1,9 @@
 #include "fs.h"
 
+#include <algorithm>
 #include <memory>
 
+#include <QCryptographicHash>
 #include <QDebug>
 #include <QMutex>
 #include <QMutexLocker>
@@ -15,22 +17,16 @@ namespace {
 
 int32_t mem_spiffs_read(struct spiffs_t *fs, uint32_t addr, uint32_t size,
                         u8_t *dst) {
-  SPIFFS *fsc = static_cast<SPIFFS *>(fs->user_data);
-  memcpy(dst, fsc->mounted_image()->data() + addr, size);
-  return SPIFFS_OK;
+  return static_cast<SPIFFS *>(fs->user_data)->read(addr, size, dst);
 }
 
 int32_t mem_spiffs_write(struct spiffs_t *fs, uint32_t addr, uint32_t size,
                          u8_t *src) {
-  SPIFFS *fsc = static_cast<SPIFFS *>(fs->user_data);
-  memcpy(fsc->mounted_image()->data() + addr, src, size);
-  return SPIFFS_OK;
+  return static_cast<SPIFFS *>(fs->user_data)->write(addr, size, src);
 }
 
 int32_t mem_spiffs_erase(struct spiffs_t *fs, uint32_t addr, uint32_t size) {
-  SPIFFS *fsc = static_cast<SPIFFS *>(fs->user_data);
-  memset(fsc->mounted_image()->data() + addr, 0xff, size);
-  return SPIFFS_OK;
+  return static_cast<SPIFFS *>(fs->user_data)->erase(addr, size);
 }
 
 }  // namespace
@@ -56,12 +52,12 @@ class Mounter {
   SPIFFS *fs_;
 };
 
-SPIFFS::SPIFFS(QByteArray image) : image_(image) {
+SPIFFS::SPIFFS(QByteArray image)
+    : base_(image), loaded_(image.size() / LOG_PAGE_SIZE, true) {
 }
 
-SPIFFS::SPIFFS(int size) {
-  image_.resize(size);
-  for (int i = 0; i < size; i++) image_[i] = 0xff;
+SPIFFS::SPIFFS(int size)
+    : base_(size, 0xff), loaded_(size / LOG_PAGE_SIZE, true) {
   mount();  // This will fail but is required per documentation.
   if (SPIFFS_format(&fs_) != SPIFFS_OK) {
     qFatal("Could not format SPIFFS (size %d): %d", size, SPIFFS_errno(&fs_));
@@ -69,24 +65,151 @@ SPIFFS::SPIFFS(int size) {
   qDebug() << "Created SPIFFS" << this << ", size" << size;
 }
 
-util::Status SPIFFS::mount() {
-  spiffs_config cfg;
+void SPIFFS::initConfig(spiffs_config *cfg) {
+  cfg->phys_size = base_.size();
+  cfg->phys_addr = 0;
 
-  fs_.user_data = this;
+  cfg->phys_erase_block = FLASH_BLOCK_SIZE;
+  cfg->log_block_size = FLASH_BLOCK_SIZE;
+  cfg->log_page_size = LOG_PAGE_SIZE;
+
+  cfg->hal_read_f = mem_spiffs_read;
+  cfg->hal_write_f = mem_spiffs_write;
+  cfg->hal_erase_f = mem_spiffs_erase;
+}
+
+SPIFFS::SPIFFS(int size, Reader reader)
+    : base_(size, 0xff), reader_(reader), loaded_(size / LOG_PAGE_SIZE) {
+}
+
+util::Status SPIFFS::load(quint32 addr, quint32 size) {
+  if (!reader_ || size == 0) return util::Status::OK;
+  int page = addr / LOG_PAGE_SIZE;
+  const int end = std::min(
+      loaded_.size(), int((addr + size + LOG_PAGE_SIZE - 1) / LOG_PAGE_SIZE));
+  while (page < end) {
+    if (loaded_.testBit(page)) {
+      page++;
+      continue;
+    }
+    // Fetch the whole run of missing pages at once.
+    int runEnd = page + 1;
+    while (runEnd < end && !loaded_.testBit(runEnd)) runEnd++;
+    const quint32 runAddr = page * LOG_PAGE_SIZE;
+    const quint32 runSize = (runEnd - page) * LOG_PAGE_SIZE;
+    auto res = reader_(runAddr, runSize);
+    if (res.ok() && quint32(res.ValueOrDie().size()) != runSize) {
+      res = util::Status(util::error::DATA_LOSS, "short read");
+    }
+    if (!res.ok()) {
+      qCritical() << "Failed to read" << runSize << "@" << runAddr << ":"
+                  << res.status().ToString().c_str();
+      reader_status_ = res.status();
+      return reader_status_;
+    }
+    // base_ is our own buffer when there is a reader.
+    memcpy(base_.data() + runAddr, res.ValueOrDie().constData(), runSize);
+    loaded_.fill(true, page, runEnd);
+    page = runEnd;
+  }
+  return util::Status::OK;
+}
+
+util::Status SPIFFS::prepareWrite(quint32 addr, quint32 size) {
+  if (size == 0) return util::Status::OK;
+  const int first = addr / FLASH_BLOCK_SIZE;
+  const int last = (addr + size - 1) / FLASH_BLOCK_SIZE;
+  util::Status st = load(first * FLASH_BLOCK_SIZE,
+                         (last - first + 1) * FLASH_BLOCK_SIZE);
+  if (!st.ok()) return st;
+  for (int i = first; i <= last; i++) {
+    if (!sectors_.contains(i)) {
+      sectors_[i] = QByteArray(base_.constData() + i * FLASH_BLOCK_SIZE,
+                               std::min(int(FLASH_BLOCK_SIZE),
+                                        base_.size() - i * FLASH_BLOCK_SIZE));
+    }
+  }
+  return util::Status::OK;
+}
+
+s32_t SPIFFS::read(quint32 addr, quint32 size, u8_t *dst) {
+  if (!load(addr, size).ok()) return SPIFFS_ERR_NOT_READABLE;
+  while (size > 0) {
+    const int sector = addr / FLASH_BLOCK_SIZE;
+    const quint32 off = addr % FLASH_BLOCK_SIZE;
+    const quint32 n = std::min(size, quint32(FLASH_BLOCK_SIZE) - off);
+    auto it = sectors_.constFind(sector);
+    memcpy(dst, it != sectors_.constEnd() ? it->constData() + off
+                                          : base_.constData() + addr,
+           n);
+    addr += n;
+    dst += n;
+    size -= n;
+  }
+  return SPIFFS_OK;
+}
+
+s32_t SPIFFS::write(quint32 addr, quint32 size, const u8_t *src) {
+  if (!prepareWrite(addr, size).ok()) return SPIFFS_ERR_NOT_WRITABLE;
+  while (size > 0) {
+    const int sector = addr / FLASH_BLOCK_SIZE;
+    const quint32 off = addr % FLASH_BLOCK_SIZE;
+    const quint32 n = std::min(size, quint32(FLASH_BLOCK_SIZE) - off);
+    memcpy(sectors_[sector].data() + off, src, n);
+    addr += n;
+    src += n;
+    size -= n;
+  }
+  return SPIFFS_OK;
+}
+
+s32_t SPIFFS::erase(quint32 addr, quint32 size) {
+  while (size > 0) {
+    const int sector = addr / FLASH_BLOCK_SIZE;
+    const quint32 off = addr % FLASH_BLOCK_SIZE;
+    const quint32 n = std::min(size, quint32(FLASH_BLOCK_SIZE) - off);
+    if (!load(addr, n).ok()) return SPIFFS_ERR_ERASE_FAIL;
+    // Erasing what is already blank leaves the sector shared with base_.
+    bool blank = !sectors_.contains(sector);
+    for (quint32 i = 0; blank && i < n; i++) {
+      blank = quint8(base_.constData()[addr + i]) == 0xff;
+    }
+    if (!blank) {
+      if (!prepareWrite(addr, n).ok()) return SPIFFS_ERR_ERASE_FAIL;
+      memset(sectors_[sector].data() + off, 0xff, n);
+    }
+    addr += n;
+    size -= n;
+  }
+  return SPIFFS_OK;
+}
 
-  cfg.phys_size = image_.size();
-  cfg.phys_addr = 0;
+util::StatusOr<QByteArray> SPIFFS::originalImage() {
+  util::Status st = load(0, base_.size());
+  if (!st.ok()) return st;
+  return base_;
+}
 
-  cfg.phys_erase_block = FLASH_BLOCK_SIZE;
-  cfg.log_block_size = FLASH_BLOCK_SIZE;
-  cfg.log_page_size = LOG_PAGE_SIZE;
+QList<int> SPIFFS::dirtySectors() const {
+  QList<int> result;
+  for (auto it = sectors_.constBegin(); it != sectors_.constEnd(); it++) {
+    if (memcmp(it->constData(), base_.constData() + it.key() * FLASH_BLOCK_SIZE,
+               it->size()) != 0) {
+      result.append(it.key());
+    }
+  }
+  return result;
+}
+
+util::Status SPIFFS::mount() {
+  spiffs_config cfg;
 
-  cfg.hal_read_f = mem_spiffs_read;
-  cfg.hal_write_f = mem_spiffs_write;
-  cfg.hal_erase_f = mem_spiffs_erase;
+  fs_.user_data = this;
+  initConfig(&cfg);
 
   if (SPIFFS_mount(&fs_, &cfg, spiffs_work_buf_, spiffs_fds_,
-                   sizeof(spiffs_fds_), 0, 0, 0) == -1) {
+                   sizeof(spiffs_fds_), spiffs_cache_buf_,
+                   sizeof(spiffs_cache_buf_), 0) == -1) {
     return util::Status(
         util::error::ABORTED,
         "SPIFFS_mount failed: " + std::to_string(SPIFFS_errno(&fs_)));
@@ -99,11 +222,11 @@ util::Status SPIFFS::mount() {
 
 void SPIFFS::unmount() {
   SPIFFS_unmount(&fs_);
+  qDebug() << "Unmounted SPIFFS" << this << ", cache hits" << fs_.cache_hits
+           << "misses" << fs_.cache_misses;
 }
 
-util::StatusOr<std::map<QString, QByteArray>> SPIFFS::files() {
-  std::map<QString, QByteArray> res;
-
+util::Status SPIFFS::forEachFile(FileVisitor visitor) {
   spiffs_DIR dh;
   struct spiffs_dirent de;
   struct spiffs_dirent *d;
@@ -114,109 +237,300 @@ util::StatusOr<std::map<QString, QByteArray>> SPIFFS::files() {
   }
 
   qDebug() << "Listing files in" << this;
+  // Files are visited in name order, not in the order they are stored in, so
+  // filesystems built from them are laid out the same way every time.
+  QMap<QString, int> sizes;
   SPIFFS_opendir(&fs_, (char *) ".", &dh);
   while ((d = SPIFFS_readdir(&dh, &de)) != nullptr) {
-    QString name((const char *) d->name);
-    qDebug() << name << d->size << "bytes";
-    int rfd = SPIFFS_open(&fs_, (char *) d->name, SPIFFS_RDONLY, 0);
+    sizes[QString((const char *) d->name)] = d->size;
+  }
+  SPIFFS_closedir(&dh);
+
+  // Grows to the size of the largest file.
+  QByteArray buf;
+  for (auto it = sizes.constBegin(); it != sizes.constEnd(); it++) {
+    const QString &name = it.key();
+    const std::string fname = name.toStdString();
+    const int size = it.value();
+    qDebug() << name << size << "bytes";
+    int rfd = SPIFFS_open(&fs_, const_cast<char *>(fname.c_str()),
+                          SPIFFS_RDONLY, 0);
     if (rfd == -1) {
-      qCritical() << "Cannot open" << (char *) d->name;
+      qCritical() << "Cannot open" << name;
       return util::Status(util::error::ABORTED, "cannot open");
     }
-    std::unique_ptr<char[]> buf(new char[image_.size()]);
-    s32_t n = SPIFFS_read(&fs_, rfd, buf.get(), image_.size());
+    if (buf.size() < size) buf.resize(size);
+    s32_t n = size > 0 ? SPIFFS_read(&fs_, rfd, buf.data(), size) : 0;
     SPIFFS_close(&fs_, rfd);
     if (n < 0) {
-      qCritical() << "Failed to read" << (char *) d->name;
+      qCritical() << "Failed to read" << name;
       return util::Status(util::error::ABORTED, "read failed");
     }
-    res[name] = QByteArray(buf.get(), n);
+    util::Status st =
+        visitor(name, QByteArray::fromRawData(buf.constData(), n));
+    if (!st.ok()) return st;
+  }
+
+  return util::Status::OK;
+}
+
+util::StatusOr<QSet<QString>> SPIFFS::fileNames() {
+  QSet<QString> res;
+  spiffs_DIR dh;
+  struct spiffs_dirent de;
+  struct spiffs_dirent *d;
+
+  Mounter m(this);
+  if (!m.status().ok()) {
+    return m.status();
   }
 
+  SPIFFS_opendir(&fs_, (char *) ".", &dh);
+  while ((d = SPIFFS_readdir(&dh, &de)) != nullptr) {
+    res.insert(QString((const char *) d->name));
+  }
+  SPIFFS_closedir(&dh);
+
   return res;
 }
 
+util::StatusOr<FileManifest> SPIFFS::manifest() {
+  FileManifest result;
+  util::Status st =
+      forEachFile([&result](const QString &name,
+                            const QByteArray &data) -> util::Status {
+        result[name] = qMakePair(
+            data.size(),
+            QCryptographicHash::hash(data, QCryptographicHash::Md5));
+        return util::Status::OK;
+      });
+  if (!st.ok()) return st;
+  return result;
+}
+
 QByteArray SPIFFS::image() const {
-  return image_;
+  if (sectors_.isEmpty()) return base_;
+  QByteArray result(base_.constData(), base_.size());
+  for (auto it = sectors_.constBegin(); it != sectors_.constEnd(); it++) {
+    memcpy(result.data() + it.key() * FLASH_BLOCK_SIZE, it->constData(),
+           it->size());
+  }
+  return result;
 }
 
 spiffs *SPIFFS::fs() {
   return &fs_;
 }
 
+namespace {
+
+util::Status writeFile(SPIFFS *fs, const QString &name,
+                       const QByteArray &data) {
+  std::string fname = name.toStdString();
+  qDebug("Writing '%s' (%d bytes)", fname.c_str(),
+         static_cast<int>(data.size()));
+  int sfd = SPIFFS_open(fs->fs(), const_cast<char *>(fname.c_str()),
+                        SPIFFS_CREAT | SPIFFS_TRUNC | SPIFFS_RDWR, 0);
+  if (sfd < 0) {
+    qCritical() << "SPIFFS_open " << name
+                << " failed: " << SPIFFS_errno(fs->fs());
+    SPIFFS_close(fs->fs(), sfd);
+    if (SPIFFS_errno(fs->fs()) == SPIFFS_ERR_FULL) {
+      return util::Status(util::error::ABORTED, "SPIFFS filesystem full");
+    }
+    return util::Status(util::error::ABORTED,
+                        "SPIFFS_open '" + fname + "' failed: " +
+                            std::to_string(SPIFFS_errno(fs->fs())));
+  }
+
+  uint8_t *d = reinterpret_cast<uint8_t *>(const_cast<char *>(data.data()));
+  if (SPIFFS_write(fs->fs(), sfd, d, data.size()) == -1) {
+    qCritical() << "SPIFFS_write '" << name << "' (" << data.size()
+                << ") failed: " << SPIFFS_errno(fs->fs());
+    SPIFFS_close(fs->fs(), sfd);
+    if (SPIFFS_errno(fs->fs()) == SPIFFS_ERR_FULL) {
+      SPIFFS_vis(fs->fs());
+      return util::Status(util::error::ABORTED, "SPIFFS filesystem full");
+    }
+    return util::Status(util::error::ABORTED, "SPIFFS_write failed");
+  }
+
+  SPIFFS_close(fs->fs(), sfd);
+  return util::Status::OK;
+}
+
+// Whether the mounted fs has a file of this size and MD5. Contents are only
+// read if the size matches.
+bool sameFile(SPIFFS *fs, const QString &name, int size,
+              const QByteArray &md5) {
+  std::string fname = name.toStdString();
+  int fd = SPIFFS_open(fs->fs(), const_cast<char *>(fname.c_str()),
+                       SPIFFS_RDONLY, 0);
+  if (fd < 0) return false;
+  spiffs_stat st;
+  bool same = false;
+  if (SPIFFS_fstat(fs->fs(), fd, &st) == SPIFFS_OK && int(st.size) == size) {
+    QByteArray buf(size, 0);
+    same = (size == 0 ||
+            SPIFFS_read(fs->fs(), fd, buf.data(), buf.size()) == buf.size()) &&
+           QCryptographicHash::hash(buf, QCryptographicHash::Md5) == md5;
+  }
+  SPIFFS_close(fs->fs(), fd);
+  return same;
+}
+
+// Copies files of the old filesystem that are not in skip to the merged one,
+// one at a time.
+util::Status copyFiles(QByteArray old_fs_image, const QSet<QString> &skip,
+                       SPIFFS *merged_fs) {
+  SPIFFS old_fs(old_fs_image);
+  util::Status write_st;
+  util::Status st = old_fs.forEachFile(
+      [&skip, merged_fs, &write_st](const QString &name,
+                                    const QByteArray &data) -> util::Status {
+        if (skip.contains(name)) return util::Status::OK;
+        write_st = writeFile(merged_fs, name, data);
+        return write_st;
+      });
+  if (!write_st.ok()) return write_st;
+  if (!st.ok()) {
+    return util::Status(util::error::ABORTED,
+                        "Unable to read device file system: " + st.ToString());
+  }
+  return util::Status::OK;
+}
+
+}  // namespace
+
 util::StatusOr<QByteArray> mergeFiles(QByteArray old_fs_image,
                                       QMap<QString, QByteArray> new_files) {
   if (old_fs_image.isEmpty() && new_files.empty()) return QByteArray();
-  std::map<QString, QByteArray> files;
+  SPIFFS merged_fs(old_fs_image.size());
+  Mounter m(&merged_fs);
+  // Files this update leaves alone go first and the new ones after them, both
+  // in name order. The same files always get the same layout, and changes to
+  // the new files do not move the rest around.
   if (!old_fs_image.isEmpty()) {
-    SPIFFS old_fs(old_fs_image);
-    auto old_files = old_fs.files();
-    if (!old_files.ok()) {
-      return util::Status(util::error::ABORTED,
-                          "Unable to read device file system: " +
-                              old_files.status().ToString());
-    }
-    files.insert(old_files.ValueOrDie().begin(), old_files.ValueOrDie().end());
-  }
-  {
-    std::map<QString, QByteArray> new_files_sm(new_files.toStdMap());
-    for (const auto &f : new_files_sm) {
-      files[f.first] = f.second;
-    }
     // There is currently no way to delete files.
+    const QSet<QString> skip = QSet<QString>::fromList(new_files.keys());
+    util::Status st = copyFiles(old_fs_image, skip, &merged_fs);
+    if (!st.ok()) return st;
   }
-  {
-    SPIFFS merged_fs(old_fs_image.size());
-    Mounter m(&merged_fs);
-    for (const auto f : files) {
-      std::string fname = f.first.toStdString();
-      qDebug("Writing '%s' (%d bytes)", fname.c_str(),
-             static_cast<int>(f.second.size()));
-      int sfd = SPIFFS_open(merged_fs.fs(), const_cast<char *>(fname.c_str()),
-                            SPIFFS_CREAT | SPIFFS_RDWR, 0);
-      if (sfd < 0) {
-        qCritical() << "SPIFFS_open " << f.first
-                    << " failed: " << SPIFFS_errno(merged_fs.fs());
-        SPIFFS_close(merged_fs.fs(), sfd);
-        if (SPIFFS_errno(merged_fs.fs()) == SPIFFS_ERR_FULL) {
-          return util::Status(util::error::ABORTED, "SPIFFS filesystem full");
-        }
-        return util::Status(util::error::ABORTED,
-                            "SPIFFS_open '" + f.first.toStdString() +
-                                "' failed: " +
-                                std::to_string(SPIFFS_errno(merged_fs.fs())));
-      }
-
-      uint8_t *d =
-          reinterpret_cast<uint8_t *>(const_cast<char *>(f.second.data()));
-      if (SPIFFS_write(merged_fs.fs(), sfd, d, f.second.size()) == -1) {
-        qCritical() << "SPIFFS_write '" << f.first << "' (" << f.second.size()
-                    << ") failed: " << SPIFFS_errno(merged_fs.fs());
-        if (SPIFFS_errno(merged_fs.fs()) == SPIFFS_ERR_FULL) {
-          SPIFFS_vis(merged_fs.fs());
-          return util::Status(util::error::ABORTED, "SPIFFS filesystem full");
-        }
-        return util::Status(util::error::ABORTED, "SPIFFS_write failed");
-      }
-
-      SPIFFS_close(merged_fs.fs(), sfd);
-    }
-    return std::move(merged_fs.image());
+  for (auto it = new_files.constBegin(); it != new_files.constEnd(); it++) {
+    util::Status st = writeFile(&merged_fs, it.key(), it.value());
+    if (!st.ok()) return st;
+  }
+  return std::move(merged_fs.image());
+}
+
+util::StatusOr<QByteArray> makeFilesystem(
+    int size, const QMap<QString, QByteArray> &files) {
+  SPIFFS fs(size);
+  Mounter m(&fs);
+  if (!m.status().ok()) return m.status();
+  for (auto it = files.constBegin(); it != files.constEnd(); it++) {
+    util::Status st = writeFile(&fs, it.key(), it.value());
+    if (!st.ok()) return st;
   }
+  return std::move(fs.image());
+}
+
+util::StatusOr<QByteArray> compactFilesystem(QByteArray image) {
+  // mergeFiles always builds a new filesystem.
+  return mergeFiles(image, {});
 }
 
 util::StatusOr<QByteArray> mergeFilesystems(QByteArray old_fs_image,
                                             QByteArray new_fs_image) {
-  QMap<QString, QByteArray> new_files;
+  if (new_fs_image.isEmpty()) return mergeFiles(old_fs_image, {});
+  SPIFFS new_fs(new_fs_image);
+  auto names = new_fs.fileNames();
+  if (!names.ok()) {
+    return util::Status(util::error::ABORTED,
+                        "Unable to read new file system: " +
+                            names.status().ToString());
+  }
+  SPIFFS merged_fs(old_fs_image.size());
+  Mounter m(&merged_fs);
+  util::Status st;
+  if (!old_fs_image.isEmpty()) {
+    st = copyFiles(old_fs_image, names.ValueOrDie(), &merged_fs);
+    if (!st.ok()) return st;
+  }
+  util::Status write_st;
+  st = new_fs.forEachFile(
+      [&merged_fs, &write_st](const QString &name,
+                              const QByteArray &data) -> util::Status {
+        write_st = writeFile(&merged_fs, name, data);
+        return write_st;
+      });
+  if (!write_st.ok()) return write_st;
+  if (!st.ok()) {
+    return util::Status(util::error::ABORTED,
+                        "Unable to read new file system: " + st.ToString());
+  }
+  return std::move(merged_fs.image());
+}
+
+util::Status updateFilesystem(SPIFFS *fs, QByteArray new_fs_image,
+                              const FileManifest &new_manifest) {
+  Mounter m(fs);
+  if (!m.status().ok()) {
+    return fs->readerStatus().ok() ? m.status() : fs->readerStatus();
+  }
+  QSet<QString> changed;
+  for (auto it = new_manifest.constBegin(); it != new_manifest.constEnd();
+       it++) {
+    if (!sameFile(fs, it.key(), it->first, it->second)) {
+      changed.insert(it.key());
+    }
+  }
+  if (!fs->readerStatus().ok()) return fs->readerStatus();
+  qDebug() << "Files changed:" << changed.size() << "of" << new_manifest.size();
+  if (changed.isEmpty()) return util::Status::OK;
+  SPIFFS new_fs(new_fs_image);
+  util::Status write_st;
+  util::Status st = new_fs.forEachFile(
+      [fs, &changed, &write_st](const QString &name,
+                                const QByteArray &data) -> util::Status {
+        if (!changed.contains(name)) return util::Status::OK;
+        write_st = writeFile(fs, name, data);
+        return write_st;
+      });
+  if (!fs->readerStatus().ok()) return fs->readerStatus();
+  if (!write_st.ok()) return write_st;
+  if (!st.ok()) {
+    return util::Status(util::error::ABORTED,
+                        "Unable to read new file system: " + st.ToString());
+  }
+  return util::Status::OK;
+}
+
+util::Status updateFilesystem(SPIFFS *fs, QByteArray new_fs_image) {
+  FileManifest manifest;
   if (!new_fs_image.isEmpty()) {
     SPIFFS new_fs(new_fs_image);
-    auto new_files_st = new_fs.files();
-    if (!new_files_st.ok()) {
+    auto mr = new_fs.manifest();
+    if (!mr.ok()) {
       return util::Status(util::error::ABORTED,
                           "Unable to read new file system: " +
-                              new_files_st.status().ToString());
+                              mr.status().ToString());
     }
-    new_files = QMap<QString, QByteArray>(new_files_st.ValueOrDie());
+    manifest = mr.ValueOrDie();
+  }
+  return updateFilesystem(fs, new_fs_image, manifest);
+}
+
+util::StatusOr<QByteArray> mergeFilesystemsInPlace(QByteArray old_fs_image,
+                                                   QByteArray new_fs_image,
+                                                   QList<int> *dirty_sectors) {
+  dirty_sectors->clear();
+  if (old_fs_image.isEmpty()) {
+    return util::Status(util::error::INVALID_ARGUMENT, "no device image");
   }
-  return mergeFiles(old_fs_image, new_files);
+  SPIFFS merged_fs(old_fs_image);
+  util::Status st = updateFilesystem(&merged_fs, new_fs_image);
+  if (!st.ok()) return st;
+  *dirty_sectors = merged_fs.dirtySectors();
+  return merged_fs.image();
 }
@@ -6,11 +6,15 @@
 #ifndef CS_MFT_SRC_FS_H_
 #define CS_MFT_SRC_FS_H_
 
-#include <map>
+#include <functional>
 #include <memory>
 
 #include <QMap>
+#include <QBitArray>
 #include <QByteArray>
+#include <QList>
+#include <QPair>
+#include <QSet>
 #include <QString>
 
 #include "prompter.h"
@@ -22,25 +26,65 @@
 // conf taken from ESP8266 fw config
 #define LOG_PAGE_SIZE 256
 #define FLASH_BLOCK_SIZE (4 * 1024)
+// Number of pages in the read/write cache, SPIFFS uses at most 32.
+#ifndef SPIFFS_CACHE_PAGES
+#define SPIFFS_CACHE_PAGES 32
+#endif
+
+// Size and MD5 of each file, by name.
+typedef QMap<QString, QPair<int, QByteArray>> FileManifest;
 
 // in memory spiffs implementation
 class SPIFFS {
   friend class Mounter;
 
  public:
+  // Reads size bytes at offset addr of the image from wherever it is stored.
+  typedef std::function<util::StatusOr<QByteArray>(quint32 addr,
+                                                   quint32 size)> Reader;
+
+  // The image is never modified, sectors are copied as they get written to.
+  // It can wrap a buffer owned by the caller, e.g. a file mapped with
+  // QFile::map(), with QByteArray::fromRawData(), and be shared by any number
+  // of instances.
   SPIFFS(QByteArray image);
   SPIFFS(int size);
+  // Image of the given size that is fetched with reader page by page, as
+  // SPIFFS accesses it. Sectors are fetched whole before they are modified.
+  SPIFFS(int size, Reader reader);
 
+  // Parts that have not been fetched are left blank.
   QByteArray image() const;
 
+  // The image as it was before any modifications, fetching what is missing.
+  util::StatusOr<QByteArray> originalImage();
+
+  // Indices of FLASH_BLOCK_SIZE sectors that differ from the original image.
+  QList<int> dirtySectors() const;
+
+  // Last error returned by the reader, if any.
+  util::Status readerStatus() const {
+    return reader_status_;
+  }
+
   spiffs *fs();
 
   // For use by C callbacks only.
-  QByteArray *mounted_image() {
-    return &image_;
-  }
+  s32_t read(quint32 addr, quint32 size, u8_t *dst);
+  s32_t write(quint32 addr, quint32 size, const u8_t *src);
+  s32_t erase(quint32 addr, quint32 size);
 
-  util::StatusOr<std::map<QString, QByteArray>> files();
+  // Called with the name and contents of a file. Contents are only valid
+  // during the call, the buffer is reused for the next file.
+  typedef std::function<util::Status(const QString &name,
+                                     const QByteArray &data)> FileVisitor;
+
+  // Calls visitor for each file, stops at the first error it returns.
+  util::Status forEachFile(FileVisitor visitor);
+
+  util::StatusOr<QSet<QString>> fileNames();
+
+  util::StatusOr<FileManifest> manifest();
 
  protected:
   util::Status mount();
@@ -52,11 +96,23 @@ class SPIFFS {
 
   void initConfig(spiffs_config *cfg);
 
-  QByteArray image_;
+  // Makes sure the range has been fetched.
+  util::Status load(quint32 addr, quint32 size);
+  // Same, for whole sectors of the range, and copies them to sectors_.
+  util::Status prepareWrite(quint32 addr, quint32 size);
+
+  QByteArray base_;  // The original image.
+  Reader reader_;
+  util::Status reader_status_;
+  QBitArray loaded_;               // Per LOG_PAGE_SIZE page.
+  QMap<int, QByteArray> sectors_;  // Modified sectors.
   spiffs fs_;
 
   uint8_t spiffs_work_buf_[LOG_PAGE_SIZE * 2];
   uint8_t spiffs_fds_[32 * 4];
+  // Includes space for the cache metadata, so the number of usable pages is
+  // a bit lower.
+  uint8_t spiffs_cache_buf_[SPIFFS_CACHE_PAGES * LOG_PAGE_SIZE];
 };
 
 util::StatusOr<QByteArray> mergeFiles(QByteArray old_fs_image,
@@ -64,4 +120,30 @@ util::StatusOr<QByteArray> mergeFiles(QByteArray old_fs_image,
 util::StatusOr<QByteArray> mergeFilesystems(QByteArray old_fs_image,
                                             QByteArray new_fs_image);
 
+// Formats a filesystem of the given size and writes files to it in name
+// order, the way mkspiffs does, so the same files give the same image.
+util::StatusOr<QByteArray> makeFilesystem(
+    int size, const QMap<QString, QByteArray> &files);
+
+// Rebuilds image with the same files, packed at the start of a freshly
+// formatted filesystem, which leaves nothing for the garbage collector to do.
+util::StatusOr<QByteArray> compactFilesystem(QByteArray image);
+
+// Writes files of new_fs_image that fs does not have or has different
+// content for, keeping the rest of fs as is. Files are compared with
+// new_manifest, the manifest of new_fs_image, and new_fs_image is not looked
+// at if nothing differs.
+util::Status updateFilesystem(SPIFFS *fs, QByteArray new_fs_image,
+                              const FileManifest &new_manifest);
+util::Status updateFilesystem(SPIFFS *fs, QByteArray new_fs_image);
+
+// Like mergeFilesystems, but instead of building a new filesystem, mounts
+// the old image and only writes files that are missing or differ, so most
+// of the image stays the same. Indices of the 4K sectors that differ from
+// old_fs_image are stored in dirty_sectors. Fails if old_fs_image cannot be
+// mounted.
+util::StatusOr<QByteArray> mergeFilesystemsInPlace(QByteArray old_fs_image,
+                                                   QByteArray new_fs_image,
+                                                   QList<int> *dirty_sectors);
+
 #endif /* CS_MFT_SRC_FS_H_ */
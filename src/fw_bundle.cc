@@ -1,9 +1,15 @@
 #include "fw_bundle.h"
 
+#include <algorithm>
+
 #include <QCryptographicHash>
 #include <QDebug>
+#include <QElapsedTimer>
 #include <QJsonDocument>
 #include <QJsonObject>
+#include <QMutexLocker>
+#include <QStringList>
+#include <QtConcurrent>
 
 #include "status_qt.h"
 
@@ -41,14 +47,10 @@ QString FirmwareBundle::buildId() const {
   return getAttr("build_id");
 }
 
-QMap<QString, FirmwareBundle::Part> FirmwareBundle::parts() const {
+const QMap<QString, FirmwareBundle::Part> &FirmwareBundle::parts() const {
   return parts_;
 }
 
-QMap<QString, QByteArray> FirmwareBundle::blobs() const {
-  return blobs_;
-}
-
 util::StatusOr<QByteArray> FirmwareBundle::getPartSource(
     const QString &partName) const {
   if (!parts_.contains(partName)) {
@@ -56,22 +58,117 @@ util::StatusOr<QByteArray> FirmwareBundle::getPartSource(
               QObject::tr("No %1 in fw bundle").arg(partName));
   }
   const Part &p = parts_[partName];
+  {
+    QMutexLocker lock(&verified_lock_);
+    auto it = verified_.constFind(partName);
+    if (it != verified_.constEnd()) return *it;
+  }
+  auto res = verifyPart(p);
+  QMutexLocker lock(&verified_lock_);
+  // Another thread may have got here first. Its result is kept, so there is
+  // only ever one copy of the part's contents and digests cached for it stay
+  // valid.
+  auto it = verified_.constFind(partName);
+  if (it != verified_.constEnd()) return *it;
+  verified_[partName] = res;
+  return res;
+}
+
+util::Status FirmwareBundle::verifyAll(QMap<QString, qint64> *timesMs) const {
+  QStringList names = parts_.keys();
+  QMutex lock;
+  QMap<QString, qint64> times;
+  QMap<QString, util::Status> results;
+  QtConcurrent::blockingMap(
+      names, [this, &lock, &times, &results](const QString &name) {
+        QElapsedTimer timer;
+        timer.start();
+        const util::Status st = getPartSource(name).status();
+        QMutexLocker l(&lock);
+        times[name] = timer.elapsed();
+        results[name] = st;
+      });
+  for (const QString &name : names) {
+    qInfo() << "Part" << name << "verified in" << times[name] << "ms";
+  }
+  if (timesMs != nullptr) *timesMs = times;
+  for (const QString &name : names) {
+    if (!results[name].ok()) return results[name];
+  }
+  return util::Status::OK;
+}
+
+bool FirmwareBundle::Digests::matches(const QByteArray &d, int bs) const {
+  return bs == blockSize && d.constData() == data.constData() &&
+         d.length() == data.length();
+}
+
+// static
+std::shared_ptr<const FirmwareBundle::Digests> FirmwareBundle::computeDigests(
+    const QByteArray &data, int blockSize) {
+  std::shared_ptr<Digests> r = std::make_shared<Digests>();
+  r->data = data;
+  r->blockSize = blockSize;
+  const int numBlocks = (data.length() + blockSize - 1) / blockSize;
+  r->blockMd5s.resize(numBlocks);
+  // Index numBlocks is the whole data. Each task writes its own element, so
+  // no locking is needed.
+  QVector<int> tasks;
+  for (int i = 0; i <= numBlocks; i++) tasks.append(i);
+  QByteArray *md5 = &r->md5;
+  QByteArray *blockMd5s = r->blockMd5s.data();
+  QtConcurrent::blockingMap(tasks, [md5, blockMd5s, &data, numBlocks,
+                                    blockSize](int i) {
+    if (i == numBlocks) {
+      *md5 = QCryptographicHash::hash(data, QCryptographicHash::Md5);
+      return;
+    }
+    const int len = std::min(blockSize, data.length() - i * blockSize);
+    blockMd5s[i] = QCryptographicHash::hash(
+        QByteArray::fromRawData(data.constData() + i * blockSize, len),
+        QCryptographicHash::Md5);
+  });
+  return r;
+}
+
+util::StatusOr<std::shared_ptr<const FirmwareBundle::Digests>>
+FirmwareBundle::getPartDigests(const QString &partName, int blockSize) const {
+  auto data = getPartSource(partName);
+  if (!data.ok()) return data.status();
+  {
+    QMutexLocker lock(&verified_lock_);
+    auto d = digests_[partName].value(blockSize);
+    if (d != nullptr && d->matches(data.ValueOrDie(), blockSize)) return d;
+  }
+  auto d = computeDigests(data.ValueOrDie(), blockSize);
+  QMutexLocker lock(&verified_lock_);
+  digests_[partName][blockSize] = d;
+  return d;
+}
+
+util::StatusOr<QByteArray> FirmwareBundle::verifyPart(const Part &p) const {
   const QString src = p.attrs["src"].toString();
   if (src == "") {
     return QS(util::error::INVALID_ARGUMENT,
               QObject::tr("part %1: no source specified").arg(p.name));
   }
-  if (!blobs_.contains(src)) {
-    return QS(
-        util::error::INVALID_ARGUMENT,
-        QObject::tr("part %1: source %2 does not exist").arg(p.name).arg(src));
-  }
-  const QByteArray &data = blobs_[src];
   const QString &expected_digest = p.attrs["cs_sha1"].toString().toLower();
   if (expected_digest == "") {
     return QS(util::error::INVALID_ARGUMENT,
               QObject::tr("part %1: missing SHA1 digest").arg(p.name));
   }
+  auto cached = getVerifiedBlob(expected_digest);
+  if (cached.ok()) return cached;
+  auto blob = getBlob(src);
+  if (blob.status().error_code() == util::error::NOT_FOUND) {
+    return QS(
+        util::error::INVALID_ARGUMENT,
+        QObject::tr("part %1: source %2 does not exist").arg(p.name).arg(src));
+  }
+  if (!blob.ok()) {
+    return QSP(QObject::tr("part %1").arg(p.name), blob.status());
+  }
+  const QByteArray data = blob.ValueOrDie();
   const QString &digest =
       QCryptographicHash::hash(data, QCryptographicHash::Sha1)
           .toHex()
@@ -83,5 +180,22 @@ util::StatusOr<QByteArray> FirmwareBundle::getPartSource(
                   .arg(expected_digest)
                   .arg(digest));
   }
+  putVerifiedBlob(digest, data);
   return data;
 }
+
+util::StatusOr<QByteArray> FirmwareBundle::archive() const {
+  return QS(util::error::UNIMPLEMENTED, "bundle is not an archive");
+}
+
+util::StatusOr<QByteArray> FirmwareBundle::getVerifiedBlob(
+    const QString &sha1) const {
+  Q_UNUSED(sha1);
+  return QS(util::error::NOT_FOUND, "");
+}
+
+void FirmwareBundle::putVerifiedBlob(const QString &sha1,
+                                     const QByteArray &data) const {
+  Q_UNUSED(sha1);
+  Q_UNUSED(data);
+}
@@ -10,11 +10,19 @@
 
 #include <QByteArray>
 #include <QMap>
+#include <QMutex>
 #include <QString>
 #include <QVariant>
+#include <QVector>
 
 #include <common/util/statusor.h>
 
+// Bundle is not changed once loaded, so one instance can be shared by any
+// number of flashers running on different threads, all of its methods are
+// safe to call concurrently. Part contents are handed out as QByteArrays that
+// share the bundle's buffers, reference counted: a copy costs nothing and
+// stays valid after the bundle is gone. Writing to one detaches it, which is
+// safe but copies the whole part.
 class FirmwareBundle {
  public:
   FirmwareBundle();
@@ -34,17 +42,69 @@ class FirmwareBundle {
     QMap<QString, QVariant> attrs;
   };
 
-  QMap<QString, Part> parts() const;
-  QMap<QString, QByteArray> blobs() const;
+  const QMap<QString, Part> &parts() const;
 
+  // Digests are checked on first access only, the result is remembered and
+  // all callers get the same buffer.
   util::StatusOr<QByteArray> getPartSource(const QString &partName) const;
 
+  // Checks digests of all the parts in parallel. Time it took for each part,
+  // in milliseconds, is stored in timesMs, if given.
+  util::Status verifyAll(QMap<QString, qint64> *timesMs = nullptr) const;
+
+  // MD5 digests of some data and of each of its blocks, for comparing with
+  // what a device reports.
+  struct Digests {
+    // Shares the buffer with the data the digests are of: while it is shared,
+    // the data has not changed, see matches().
+    QByteArray data;
+    int blockSize = 0;
+    QByteArray md5;
+    QVector<QByteArray> blockMd5s;
+
+    bool matches(const QByteArray &d, int bs) const;
+  };
+
+  // Hashes the whole data and its blocks in parallel, on the global thread
+  // pool.
+  static std::shared_ptr<const Digests> computeDigests(const QByteArray &data,
+                                                       int blockSize);
+
+  // Digests of the part's source, computed once per block size and kept with
+  // the bundle, so runs that flash it again do not hash it again.
+  util::StatusOr<std::shared_ptr<const Digests>> getPartDigests(
+      const QString &partName, int blockSize) const;
+
+  // The whole bundle as one archive, for updaters on the device that take it
+  // as it is. UNIMPLEMENTED if the bundle does not come from an archive.
+  virtual util::StatusOr<QByteArray> archive() const;
+
  protected:
-  QMap<QString, QByteArray> blobs_;
+  // Returns contents of the named file of the bundle, NOT_FOUND if there is
+  // no such file. May be called from multiple threads.
+  virtual util::StatusOr<QByteArray> getBlob(const QString &name) const = 0;
+
+  // Storage for data that has been checked against its SHA1 digest, so the
+  // check does not need to be repeated. Nothing is stored by default.
+  virtual util::StatusOr<QByteArray> getVerifiedBlob(const QString &sha1) const;
+  virtual void putVerifiedBlob(const QString &sha1,
+                               const QByteArray &data) const;
+
+  // Returns contents of the part's source if they match its digest. Called
+  // once per part, possibly from multiple threads at once.
+  virtual util::StatusOr<QByteArray> verifyPart(const Part &p) const;
+
   QMap<QString, Part> parts_;
 
  private:
   FirmwareBundle(const FirmwareBundle &other) = delete;
+  FirmwareBundle &operator=(const FirmwareBundle &other) = delete;
+
+  mutable QMutex verified_lock_;
+  // Part -> contents, if the digest matched.
+  mutable QMap<QString, util::StatusOr<QByteArray>> verified_;
+  // Part -> block size -> digests.
+  mutable QMap<QString, QMap<int, std::shared_ptr<const Digests>>> digests_;
 };
 
 util::StatusOr<std::unique_ptr<FirmwareBundle>> NewZipFWBundle(
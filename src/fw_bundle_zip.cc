@@ -1,11 +1,25 @@
 #include "fw_bundle.h"
 
+#include <algorithm>
 #include <cstring>
+#include <memory>
 
+#include <QCryptographicHash>
 #include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
 #include <QJsonDocument>
 #include <QJsonObject>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QRegExp>
+#include <QSaveFile>
+#include <QSet>
+#include <QStandardPaths>
 
+#include "crc32.h"
+#include "fs.h"
 #include "status_qt.h"
 
 #include "common/miniz.c"
@@ -17,6 +31,102 @@
 namespace {
 const char kManifestFileName[] = "manifest.json";
 const char kFSDirPartType[] = "fs_dir";
+// Expanded parts are kept for this many bundles.
+const int kMaxCachedBundles = 4;
+// Number of filesystem images built from fs_dir parts to keep.
+const int kMaxCachedFSImages = 8;
+// Goes into the key of cached filesystem images, to be changed along with
+// the way they are built.
+const char kFSImageVersion[] = "1";
+
+QString cacheRoot() {
+  return QStandardPaths::writableLocation(QStandardPaths::CacheLocation) +
+         "/bundles";
+}
+
+QString fsCacheRoot() {
+  return QStandardPaths::writableLocation(QStandardPaths::CacheLocation) +
+         "/fs_images";
+}
+
+// Removes all but the most recently created bundle directories.
+void pruneCache() {
+  QFileInfoList dirs = QDir(cacheRoot()).entryInfoList(
+      QDir::Dirs | QDir::NoDotAndDotDot, QDir::Time);
+  for (int i = kMaxCachedBundles; i < dirs.size(); i++) {
+    qDebug() << "Removing" << dirs[i].filePath();
+    QDir(dirs[i].filePath()).removeRecursively();
+  }
+}
+
+// Maps a cached part into memory, the pages are shared with other processes
+// that use the same cache, e.g. workers of a coordinator (see --workers),
+// instead of each of them keeping a copy on the heap. Mappings stay for the
+// life of the process, data handed out keeps pointing into them after the
+// bundle is gone. Files in the cache are only ever replaced, never written
+// to, so a mapping keeps the contents it had.
+util::StatusOr<QByteArray> mapCachedFile(const QString &path) {
+  static QMutex lock;
+  // Never freed, neither are the files that back them.
+  static QMap<QString, QByteArray> *mapped = new QMap<QString, QByteArray>();
+  QMutexLocker locker(&lock);
+  auto it = mapped->constFind(path);
+  if (it != mapped->constEnd()) return *it;
+  std::unique_ptr<QFile> f(new QFile(path));
+  if (!f->open(QIODevice::ReadOnly)) return QS(util::error::NOT_FOUND, "");
+  // Empty files can not be mapped, and there is nothing to share.
+  if (f->size() == 0) return QByteArray();
+  const uchar *data = f->map(0, f->size());
+  if (data == nullptr) {
+    qDebug() << "Failed to map" << path << ":" << f->errorString();
+    return f->readAll();
+  }
+  const QByteArray result = QByteArray::fromRawData(
+      reinterpret_cast<const char *>(data), int(f->size()));
+  f.release();
+  mapped->insert(path, result);
+  return result;
+}
+
+// Same for filesystem images.
+void pruneFSCache() {
+  QFileInfoList files =
+      QDir(fsCacheRoot()).entryInfoList(QDir::Files, QDir::Time);
+  for (int i = kMaxCachedFSImages; i < files.size(); i++) {
+    qDebug() << "Removing" << files[i].filePath();
+    QFile::remove(files[i].filePath());
+  }
+}
+
+// Extracts entry i into out, which has room for exactly its contents.
+// Compressed data is read in one go and inflated with a single tinfl call
+// straight into out, which lets tinfl take its non-wrapping fast path, and
+// the CRC is checked with CRC32::update() rather than miniz's nibble table.
+// Returns false if that did not work out, the caller falls back to miniz.
+bool fastExtract(mz_zip_archive *zip, mz_uint i,
+                 const mz_zip_archive_file_stat &stat, char *out) {
+  if (stat.m_bit_flag & (1 | 32)) return false;  // Encrypted or patch.
+  const size_t len = size_t(stat.m_uncomp_size);
+  if (stat.m_method == 0) {
+    if (stat.m_comp_size != stat.m_uncomp_size ||
+        !mz_zip_reader_extract_to_mem(zip, i, out, len,
+                                      MZ_ZIP_FLAG_COMPRESSED_DATA)) {
+      return false;
+    }
+  } else if (stat.m_method == MZ_DEFLATED) {
+    QByteArray comp(int(stat.m_comp_size), Qt::Uninitialized);
+    if (!mz_zip_reader_extract_to_mem(zip, i, comp.data(), comp.size(),
+                                      MZ_ZIP_FLAG_COMPRESSED_DATA) ||
+        tinfl_decompress_mem_to_mem(out, len, comp.constData(), comp.size(),
+                                    0) != len) {
+      return false;
+    }
+  } else {
+    return false;
+  }
+  return CRC32::update(0, out, len) == stat.m_crc32;
+}
+
 }  // namespace
 
 class ZipFWBundle : public FirmwareBundle {
@@ -35,29 +145,112 @@ class ZipFWBundle : public FirmwareBundle {
 
   util::Status loadFile(const QString &zipFileName);
 
+  util::StatusOr<QByteArray> archive() const override;
+
+ protected:
+  util::StatusOr<QByteArray> getBlob(const QString &name) const override;
+  util::StatusOr<QByteArray> getVerifiedBlob(
+      const QString &sha1) const override;
+  void putVerifiedBlob(const QString &sha1,
+                       const QByteArray &data) const override;
+  util::StatusOr<QByteArray> verifyPart(const Part &p) const override;
+
  private:
   util::Status loadContents();
   util::Status readManifest();
+  void initCache();
+  util::StatusOr<QByteArray> extract(mz_uint index) const;
+  // Builds the SPIFFS image of an fs_dir part from files of its directory.
+  util::StatusOr<QByteArray> buildFilesystem(const Part &p) const;
 
+  // Kept open and mapped for the life of the bundle, so it keeps reading the
+  // archive it was loaded from even if the file is replaced, e.g. by a newer
+  // download into the same cache file.
+  QFile file_;
+  QByteArray data_;  // Of file_, mapped or read.
   mz_zip_archive zip_;
   QJsonObject manifest_;
+  QMap<QString, mz_uint> entries_;  // Base name -> file index.
+  QMap<QString, mz_uint> paths_;    // Full name -> file index.
+  QString root_;                    // Directory of the manifest.
+  // Expanded parts of this bundle that passed the digest check, one file per
+  // part named by its SHA1. Empty if there is no cache.
+  QString cache_dir_;
+  // Files are only extracted when asked for.
+  mutable QMutex lock_;  // Guards blobs_.
+  mutable QMap<QString, QByteArray> blobs_;
 };
 
 util::Status ZipFWBundle::loadFile(const QString &zipFileName) {
   qInfo() << "Loading" << zipFileName;
-  QByteArray fn = zipFileName.toUtf8().append('\0');  // NUL-terminate.
-  mz_bool status = mz_zip_reader_init_file(&zip_, fn.data(), 0);
+  file_.setFileName(zipFileName);
+  if (!file_.open(QIODevice::ReadOnly)) {
+    return QS(util::error::UNAVAILABLE, QObject::tr("failed to open %1: %2")
+                                            .arg(zipFileName)
+                                            .arg(file_.errorString()));
+  }
+  const uchar *mapped = file_.size() > 0 ? file_.map(0, file_.size()) : nullptr;
+  if (mapped != nullptr) {
+    data_ = QByteArray::fromRawData(reinterpret_cast<const char *>(mapped),
+                                    int(file_.size()));
+  } else {
+    data_ = file_.readAll();
+  }
+  mz_bool status =
+      mz_zip_reader_init_mem(&zip_, data_.constData(), data_.size(), 0);
   if (!status) {
-    return QS(util::error::UNAVAILABLE, "mz_zip_reader_init_file failed");
+    return QS(util::error::UNAVAILABLE, "mz_zip_reader_init_mem failed");
   }
-  qInfo() << mz_zip_reader_get_num_files(&zip_) << "files";
+  qInfo() << mz_zip_reader_get_num_files(&zip_) << "files, CRC-32:"
+          << CRC32::implementation();
   auto st = loadContents();
   if (!st.ok()) return QSP("failed to load archive contents", st);
   st = readManifest();
   if (!st.ok()) return QSP("failed to read manifest", st);
+  initCache();
   return util::Status::OK;
 }
 
+void ZipFWBundle::initCache() {
+  // Keyed by contents of the archive, so any change to it invalidates the
+  // cache. Build ID is only there to make it easier to tell entries apart.
+  QString key = QString::fromLatin1(
+      QCryptographicHash::hash(data_, QCryptographicHash::Sha1).toHex());
+  if (!buildId().isEmpty()) {
+    key = QString(buildId()).replace(QRegExp("[^A-Za-z0-9._-]"), "_") + "-" +
+          key;
+  }
+  cache_dir_ = cacheRoot() + "/" + key;
+}
+
+util::StatusOr<QByteArray> ZipFWBundle::getVerifiedBlob(
+    const QString &sha1) const {
+  if (cache_dir_.isEmpty() || !QRegExp("[0-9a-f]{40}").exactMatch(sha1)) {
+    return QS(util::error::NOT_FOUND, "");
+  }
+  const QString path = cache_dir_ + "/" + sha1;
+  auto r = mapCachedFile(path);
+  if (r.ok()) qDebug() << "Using" << path;
+  return r;
+}
+
+void ZipFWBundle::putVerifiedBlob(const QString &sha1,
+                                  const QByteArray &data) const {
+  if (cache_dir_.isEmpty() || !QRegExp("[0-9a-f]{40}").exactMatch(sha1)) {
+    return;
+  }
+  if (!QFileInfo(cache_dir_).isDir()) {
+    QDir().mkpath(cache_dir_);
+    pruneCache();
+  }
+  // Written in full or not at all, a partial file would be taken as valid.
+  QSaveFile f(cache_dir_ + "/" + sha1);
+  if (!f.open(QIODevice::WriteOnly) || f.write(data) != data.size() ||
+      !f.commit()) {
+    qWarning() << "Failed to cache" << f.fileName() << ":" << f.errorString();
+  }
+}
+
 util::Status ZipFWBundle::loadContents() {
   for (mz_uint i = 0; i < mz_zip_reader_get_num_files(&zip_); i++) {
     mz_zip_archive_file_stat stat;
@@ -65,30 +258,136 @@ util::Status ZipFWBundle::loadContents() {
       return QS(util::error::INVALID_ARGUMENT,
                 QObject::tr("failed to stat file #%1").arg(i));
     }
+    if (mz_zip_reader_is_file_a_directory(&zip_, i)) continue;
     QString name(stat.m_filename);
     QString base_name = name.split("/").back();
-    size_t uncomp_size;
-    char *data =
-        (char *) mz_zip_reader_extract_to_heap(&zip_, i, &uncomp_size, 0);
-    if (data == NULL) {
-      return QS(util::error::INVALID_ARGUMENT,
-                QObject::tr("failed to extract %1").arg(name));
+    qDebug() << "Blob" << base_name << stat.m_uncomp_size;
+    entries_[base_name] = i;
+    paths_[name] = i;
+    if (base_name == kManifestFileName) {
+      root_ = name.left(name.length() - base_name.length());
     }
-    QByteArray data_array(data, uncomp_size);
-    qDebug() << "Blob" << base_name << data_array.length();
-    mz_free(data);
-    blobs_[base_name] = data_array;
   }
   return util::Status::OK;
 }
 
+util::StatusOr<QByteArray> ZipFWBundle::archive() const {
+  // A copy, the mapping goes with the bundle.
+  return QByteArray(data_.constData(), data_.size());
+}
+
+util::StatusOr<QByteArray> ZipFWBundle::getBlob(const QString &name) const {
+  {
+    QMutexLocker lock(&lock_);
+    auto it = blobs_.constFind(name);
+    if (it != blobs_.constEnd()) return *it;
+  }
+  if (!entries_.contains(name)) {
+    return QS(util::error::NOT_FOUND,
+              QObject::tr("no %1 in archive").arg(name));
+  }
+  auto res = extract(entries_[name]);
+  if (!res.ok()) return res.status();
+  QMutexLocker lock(&lock_);
+  // Another thread may have got here first, keep a single copy.
+  if (!blobs_.contains(name)) blobs_[name] = res.ValueOrDie();
+  return blobs_[name];
+}
+
+util::StatusOr<QByteArray> ZipFWBundle::extract(mz_uint i) const {
+  // Each extraction uses a reader of its own, so parts can be inflated in
+  // parallel.
+  mz_zip_archive zip;
+  std::memset(&zip, 0, sizeof(zip));
+  if (!mz_zip_reader_init_mem(&zip, data_.constData(), data_.size(), 0)) {
+    return QS(util::error::UNAVAILABLE, "mz_zip_reader_init_mem failed");
+  }
+  mz_zip_archive_file_stat stat;
+  if (!mz_zip_reader_file_stat(&zip, i, &stat)) {
+    mz_zip_reader_end(&zip);
+    return QS(util::error::INVALID_ARGUMENT,
+              QObject::tr("failed to stat file #%1").arg(i));
+  }
+  // Extracted right into the buffer it is returned in.
+  QByteArray data(int(stat.m_uncomp_size), Qt::Uninitialized);
+  const mz_bool ok =
+      fastExtract(&zip, i, stat, data.data()) ||
+      mz_zip_reader_extract_to_mem(&zip, i, data.data(), data.size(), 0);
+  mz_zip_reader_end(&zip);
+  if (!ok) {
+    return QS(util::error::INVALID_ARGUMENT,
+              QObject::tr("failed to extract %1").arg(stat.m_filename));
+  }
+  return data;
+}
+
+util::StatusOr<QByteArray> ZipFWBundle::verifyPart(const Part &p) const {
+  if (p.attrs["type"].toString() == kFSDirPartType) return buildFilesystem(p);
+  return FirmwareBundle::verifyPart(p);
+}
+
+util::StatusOr<QByteArray> ZipFWBundle::buildFilesystem(const Part &p) const {
+  const QString src = p.attrs["src"].toString();
+  bool ok;
+  const int size = p.attrs["size"].toInt(&ok);
+  if (src == "" || !ok || size <= 0) {
+    return QS(util::error::INVALID_ARGUMENT,
+              QObject::tr("part %1: source and size must be specified")
+                  .arg(p.name));
+  }
+  // Like mkspiffs, takes files at the top of the directory, skipping hidden
+  // ones.
+  const QString prefix = root_ + src + "/";
+  QMap<QString, QByteArray> files;
+  QCryptographicHash h(QCryptographicHash::Sha1);
+  h.addData(QByteArray(kFSImageVersion) + ":" + QByteArray::number(size));
+  for (auto it = paths_.constBegin(); it != paths_.constEnd(); it++) {
+    if (!it.key().startsWith(prefix)) continue;
+    const QString name = it.key().mid(prefix.length());
+    if (name.contains('/') || name.startsWith('.')) continue;
+    auto data = extract(*it);
+    if (!data.ok()) {
+      return QSP(QObject::tr("part %1").arg(p.name), data.status());
+    }
+    files[name] = data.ValueOrDie();
+  }
+  for (auto it = files.constBegin(); it != files.constEnd(); it++) {
+    h.addData(":" + it.key().toUtf8() + ":" +
+              QByteArray::number(it->size()) + ":");
+    h.addData(*it);
+  }
+  // Keyed by what goes into the image, so it is shared by all the bundles
+  // that have the same files.
+  const QString cacheFile =
+      fsCacheRoot() + "/" + QString::fromLatin1(h.result().toHex());
+  QFile cf(cacheFile);
+  if (cf.open(QIODevice::ReadOnly) && cf.size() == size) {
+    qDebug() << "Using" << cacheFile;
+    return cf.readAll();
+  }
+  qInfo() << "Building" << p.name << "image from" << files.size() << "files";
+  auto image = makeFilesystem(size, files);
+  if (!image.ok()) {
+    return QSP(QObject::tr("part %1").arg(p.name), image.status());
+  }
+  QDir().mkpath(fsCacheRoot());
+  QSaveFile f(cacheFile);
+  if (!f.open(QIODevice::WriteOnly) ||
+      f.write(image.ValueOrDie()) != image.ValueOrDie().size() || !f.commit()) {
+    qWarning() << "Failed to cache" << cacheFile << ":" << f.errorString();
+  }
+  pruneFSCache();
+  return image;
+}
+
 util::Status ZipFWBundle::readManifest() {
-  if (!blobs_.contains(kManifestFileName)) {
+  auto manifest = getBlob(kManifestFileName);
+  if (!manifest.ok()) {
     return QS(util::error::INVALID_ARGUMENT,
               QObject::tr("No %1 in archive").arg(kManifestFileName));
   }
   QJsonParseError err;
-  QJsonDocument doc = QJsonDocument::fromJson(blobs_[kManifestFileName], &err);
+  QJsonDocument doc = QJsonDocument::fromJson(manifest.ValueOrDie(), &err);
   if (err.error != QJsonParseError::NoError) {
     return QS(util::error::INVALID_ARGUMENT,
               QObject::tr("Failed to parse JSON: %1").arg(err.errorString()));
@@ -106,7 +405,12 @@ util::Status ZipFWBundle::readManifest() {
                   QObject::tr("part %1 is not an object").arg(partName));
       }
       const QJsonObject &jsonPart = v.toObject();
-      if (jsonPart["type"].toString() == kFSDirPartType) continue;
+      // Directories are only turned into images for parts that say where to
+      // put them and how big to make them.
+      if (jsonPart["type"].toString() == kFSDirPartType &&
+          !(jsonPart.contains("addr") && jsonPart.contains("size"))) {
+        continue;
+      }
       Part p;
       p.name = partName;
       for (const QString &attr : jsonPart.keys()) {
@@ -115,6 +419,20 @@ util::Status ZipFWBundle::readManifest() {
       parts_[partName] = p;
     }
   }
+  // Bundles that also have a prebuilt image of the directory, at the same
+  // address, are flashed with the image.
+  QSet<QString> images;
+  for (const Part &p : parts_) {
+    if (p.attrs["type"].toString() != kFSDirPartType) {
+      images.insert(p.attrs["addr"].toString());
+    }
+  }
+  for (const Part &p : parts_.values()) {
+    if (p.attrs["type"].toString() == kFSDirPartType &&
+        images.contains(p.attrs["addr"].toString())) {
+      parts_.remove(p.name);
+    }
+  }
   return util::Status::OK;
 }
 
@@ -4,10 +4,13 @@
 
 #include <QDebug>
 #include <QDateTime>
+#include <QIODevice>
 #include <QJsonArray>
 #include <QJsonDocument>
 #include <QJsonObject>
+#include <QList>
 
+#include "log.h"
 #include "status_qt.h"
 
 #if (QT_VERSION < QT_VERSION_CHECK(5, 5, 0))
@@ -23,11 +26,16 @@
 #define WIFI_SCAN_RESULT_TYPE "wsr"
 #define WIFI_STATUS_TYPE "ws"
 #define CLUBBY_STATUS_TYPE "cs"
+#define IP_ADDRESS_TYPE "ip"
 
 namespace {
 
 const char kPromptEnd[] = "] $ ";
 
+// ESP8266 UART receive FIFO is 128 bytes.
+const int kDefaultChunkSize = 64;
+const int kDefaultEchoTimeoutMs = 100;
+
 QString jsEscapeString(const QString &s) {
   QString escaped(s);
   escaped = escaped.replace(R"(\)", R"(\\)");
@@ -35,16 +43,40 @@ QString jsEscapeString(const QString &s) {
   return QString("'%1'").arg(escaped);
 }
 
+// Returns an empty string for values that are not supported.
+QString jsValue(const QJsonValue &v) {
+  switch (v.type()) {
+    case QJsonValue::Null:
+      return "null";
+    case QJsonValue::Bool:
+      return v.toBool() ? "true" : "false";
+    case QJsonValue::Double:
+      if (v.toDouble() == v.toInt()) return QString::number(v.toInt());
+      return QString::number(v.toDouble());
+    case QJsonValue::String:
+      return jsEscapeString(v.toString());
+    default:
+      return QString();
+  }
+}
+
 }  // namespace
 
-FWClient::FWClient(QSerialPort *port)
-    : beginMarker_(BEGIN_MARKER), endMarker_(END_MARKER), port_(port) {
-  connect(port_, &QSerialPort::readyRead, this, &FWClient::portReadyRead);
+FWClient::FWClient(QIODevice *port)
+    : beginMarker_(BEGIN_MARKER),
+      endMarker_(END_MARKER),
+      port_(port),
+      chunkSize_(kDefaultChunkSize) {
+  echoTimer_.setSingleShot(true);
+  echoTimer_.setInterval(kDefaultEchoTimeoutMs);
+  connect(&echoTimer_, &QTimer::timeout, this, &FWClient::echoTimeout);
+  connect(port_, &QIODevice::readyRead, this, &FWClient::portReadyRead);
 }
 
 FWClient::~FWClient() {
   connectTimer_.stop();
-  disconnect(port_, &QSerialPort::readyRead, this, &FWClient::portReadyRead);
+  echoTimer_.stop();
+  disconnect(port_, &QIODevice::readyRead, this, &FWClient::portReadyRead);
 }
 
 void FWClient::doConnect() {
@@ -86,10 +118,20 @@ void FWClient::doWifiSetup(const QString &ssid, const QString &password) {
       R"(Wifi.changed(function (s) {)" BEGIN_MARKER_JS
       R"(print(JSON.stringify({t:')" WIFI_STATUS_TYPE
       R"(', ws:s}));)" END_MARKER_JS "});");
-  cmdQueue_.push_back(QString("Wifi.setup(%1, %2);")
-                          .arg(jsEscapeString(ssid))
-                          .arg(jsEscapeString(password))
-                          .toUtf8());
+  const QString setup = QString("Wifi.setup(%1, %2);")
+                            .arg(jsEscapeString(ssid))
+                            .arg(jsEscapeString(password));
+  cmdQueue_.push_back(setup);
+  secretCmds_.insert(setup);
+  sendCommand();
+}
+
+void FWClient::doGetIP() {
+  if (!connected_) return;
+  qInfo() << "doGetIP";
+  cmdQueue_.push_back(BEGIN_MARKER_JS
+                      "print(JSON.stringify({t:'" IP_ADDRESS_TYPE
+                      "', ip:Wifi.ip() || ''}));" END_MARKER_JS);
   sendCommand();
 }
 
@@ -117,36 +159,29 @@ void FWClient::testClubbyConfig(const QJsonObject &cfg) {
 }
 
 void FWClient::setConfValue(const QString &k, const QJsonValue &v) {
+  QJsonObject values;
+  values[k] = v;
+  setConfValues(values);
+}
+
+void FWClient::setConfValues(const QJsonObject &values, bool save) {
   if (!connected_) return;
-  QString vs;
-  switch (v.type()) {
-    case QJsonValue::Null: {
-      vs = "null";
-      break;
-    }
-    case QJsonValue::Bool: {
-      vs = (v.toBool() ? "true" : "false");
-      break;
+  QString cmd;
+  for (auto it = values.begin(); it != values.end(); ++it) {
+    const QString vs = jsValue(it.value());
+    if (vs.isEmpty()) {
+      qCritical() << "Unsupported value for" << it.key() << it.value();
+      continue;
     }
-    case QJsonValue::Double: {
-      if (v.toDouble() == v.toInt()) {
-        vs = QString("%1").arg(v.toInt());
-      } else {
-        vs = QString("%1").arg(v.toDouble());
-      }
-      break;
-    }
-    case QJsonValue::String: {
-      vs = jsEscapeString(v.toString());
-      break;
-    }
-    default:
-      // Unsupported value.
-      return;
+    cmd += QString("Sys.conf.%1 = %2; ").arg(it.key()).arg(vs);
   }
-  const QString cmd = QString("Sys.conf.%1 = %2;").arg(k).arg(vs);
-  qInfo() << cmd;
+  if (save) cmd += "Sys.conf.save();";
+  cmd = cmd.trimmed();
+  if (cmd.isEmpty()) return;
+  // Passwords and keys are not logged.
+  qInfo() << "setConfValues" << values.keys() << (save ? "and save" : "");
   cmdQueue_.push_back(cmd);
+  secretCmds_.insert(cmd);
   sendCommand();
 }
 
@@ -157,6 +192,11 @@ void FWClient::doSaveConfig() {
   sendCommand();
 }
 
+void FWClient::setFlowControl(int chunkSize, int echoTimeoutMs) {
+  if (chunkSize > 0) chunkSize_ = chunkSize;
+  if (echoTimeoutMs > 0) echoTimer_.setInterval(echoTimeoutMs);
+}
+
 void FWClient::doConnectAttempt() {
   if (connected_) return;
   if (connectAttempt_++ > 6) {
@@ -165,7 +205,7 @@ void FWClient::doConnectAttempt() {
     return;
   }
   qInfo() << "Connecting to FW, attempt" << connectAttempt_;
-  buf_.clear();
+  resetFramer();
   port_->readAll();  // Discard everything in the buffer up till now.
   port_->write("\n");
   syncing_ = true;
@@ -176,30 +216,58 @@ void FWClient::portReadyRead() {
   {
     QByteArray buf = port_->readAll();
     buf_ += buf;
-    qDebug() << "Got" << buf.length() << "bytes, total" << buf_.length();
-    qDebug() << buf;
+    if (curSecret_) {
+      qCDebug(Log::proto) << "Got" << buf.length() << "bytes";
+    } else {
+      qCDebug(Log::proto) << "Got" << buf.length() << "bytes:" << buf;
+    }
+    if (sending_) {
+      consumeEcho(buf);
+      sendMore();
+    }
   }
-  // Consume all the responses in the buffer.
-  int beginIndex, endIndex;
+  // Consume all the complete messages. Scanning resumes where the previous
+  // read left off, so each byte is only looked at about once.
+  int consumed = 0;
+  QList<QByteArray> messages;
   while (true) {
-    beginIndex = buf_.indexOf(beginMarker_);
-    endIndex = buf_.indexOf(endMarker_);
-    if (beginIndex < 0 || endIndex < beginIndex) break;
-    qDebug() << "Found message @" << beginIndex << "-" << endIndex;
-    const QByteArray content =
-        buf_.mid(beginIndex + beginMarker_.length(),
-                 endIndex - beginIndex - beginMarker_.length());
-    qDebug() << content;
-    parseMessage(content);
-    buf_ = buf_.left(beginIndex) + buf_.mid(endIndex + endMarker_.length());
-    qDebug() << buf_;
-    beginIndex = -1;
+    if (msgStart_ < 0) {
+      const int begin = buf_.indexOf(beginMarker_, scanPos_);
+      if (begin < 0) {
+        // Everything but a possible beginning of a marker or a prompt is
+        // console output.
+        const int keep = qMax(beginMarker_.length(), int(sizeof(kPromptEnd)));
+        consumed = qMax(consumed, buf_.length() - keep);
+        scanPos_ = consumed;
+        break;
+      }
+      msgStart_ = begin + beginMarker_.length();
+      scanPos_ = msgStart_;
+    }
+    const int end = buf_.indexOf(endMarker_, scanPos_);
+    if (end < 0) {
+      scanPos_ = qMax(msgStart_, buf_.length() - endMarker_.length());
+      consumed = msgStart_ - beginMarker_.length();
+      break;
+    }
+    qDebug() << "Found message @" << msgStart_ << "-" << end;
+    messages.append(buf_.mid(msgStart_, end - msgStart_));
+    scanPos_ = consumed = end + endMarker_.length();
+    msgStart_ = -1;
+  }
+  if (consumed > 0) {
+    // Shifts what is left in place, the buffer is not reallocated.
+    buf_.remove(0, consumed);
+    scanPos_ -= consumed;
+    if (msgStart_ >= 0) msgStart_ -= consumed;
   }
+  // Handlers may issue commands or even reconnect, so this is done after the
+  // framer is done with the buffer.
+  for (const QByteArray &msg : messages) parseMessage(msg);
   // Sync with the device by waiting for prompt to appear.
   // If we are receiving a message, don't mess with the buffer.
-  qDebug() << beginIndex << buf_;
-  if (syncing_ && beginIndex < 0 && buf_.endsWith(kPromptEnd)) {
-    buf_.clear();
+  if (syncing_ && msgStart_ < 0 && buf_.endsWith(kPromptEnd)) {
+    resetFramer();
     syncing_ = false;
     qInfo() << "Synced";
     if (!connected_) {
@@ -215,31 +283,64 @@ void FWClient::portReadyRead() {
   }
 }
 
+void FWClient::consumeEcho(const QByteArray &buf) {
+  // Anything else, such as the \r of a longer line ending or output that came
+  // in between, is skipped.
+  int n = 0;
+  for (int i = 0; i < buf.length() && n < unechoed_.length(); i++) {
+    if (buf[i] == unechoed_[n]) n++;
+  }
+  unechoed_.remove(0, n);
+}
+
+void FWClient::resetFramer() {
+  buf_.clear();
+  scanPos_ = 0;
+  msgStart_ = -1;
+}
+
 void FWClient::sendMore() {
   if (!connected_) {
     curCmd_.clear();
     return;
   }
-  // Perform poor-man's flow control, try to not overflow serial adapter's FIFO.
-  // At 115200 transmitting 16 chars takes ~15 uS, so 20 ms should be plenty.
-  QByteArray toSend = curCmd_.left(16);
-  qDebug() << "Sending" << toSend;
-  port_->write(toSend);
-  curCmd_ = curCmd_.mid(toSend.length());
+  // Pace by the echo, so the device's FIFO does not overflow: it is drained
+  // at the rate the firmware reads it, whatever the baud rate.
+  while (!curCmd_.isEmpty() && unechoed_.length() < 2 * chunkSize_) {
+    QByteArray toSend = curCmd_.left(chunkSize_);
+    qDebug() << "Sending" << toSend.length() << "bytes";
+    port_->write(toSend);
+    unechoed_ += toSend;
+    curCmd_ = curCmd_.mid(toSend.length());
+  }
   if (!curCmd_.isEmpty()) {
-    QTimer::singleShot(20, this, &FWClient::sendMore);
+    echoTimer_.start();
   } else {
+    echoTimer_.stop();
     sending_ = false;
     syncing_ = true;
   }
 }
 
+void FWClient::echoTimeout() {
+  if (!sending_) return;
+  qDebug() << "No echo for" << unechoed_.length() << "bytes, sending more";
+  unechoed_.clear();
+  sendMore();
+}
+
 void FWClient::sendCommand() {
   if (cmdQueue_.isEmpty() || sending_ || syncing_) return;
   const QByteArray cmd = (cmdQueue_.front() + "\n").toUtf8();
+  curSecret_ = secretCmds_.remove(cmdQueue_.front());
   cmdQueue_.pop_front();
-  qDebug() << "Cmd:" << cmd;
+  if (curSecret_) {
+    qDebug() << "Cmd:" << cmd.length() << "bytes, not logged";
+  } else {
+    qDebug() << "Cmd:" << cmd;
+  }
   curCmd_ = cmd;
+  unechoed_.clear();
   sending_ = true;
   syncing_ = false;
   sendMore();
@@ -284,6 +385,8 @@ void FWClient::parseMessage(const QByteArray &msg) {
         return;
     }
     emit wifiStatusChanged(ws);
+  } else if (type == IP_ADDRESS_TYPE) {
+    emit ipAddress(o["ip"].toString());
   } else if (type == SYS_CONFIG_TYPE) {
     emit getConfigResult(o["sys"].toObject());
   } else if (type == CLUBBY_STATUS_TYPE) {
@@ -10,28 +10,41 @@
 #include <QJsonObject>
 #include <QJsonValue>
 #include <QObject>
-#include <QSerialPort>
+#include <QSet>
 #include <QString>
 #include <QStringList>
 #include <QTimer>
 
 #include <common/util/status.h>
 
+class QIODevice;
+
 class FWClient : public QObject {
   Q_OBJECT
 
  public:
-  FWClient(QSerialPort *port);
+  FWClient(QIODevice *port);
   ~FWClient() override;
 
   void doConnect();
   void doGetConfig();
   void doWifiScan();
   void doWifiSetup(const QString &ssid, const QString &password);
+  // Asks for the station IP address, reported with ipAddress().
+  void doGetIP();
   void testClubbyConfig(const QJsonObject &cfg);
   void setConfValue(const QString &k, const QJsonValue &v);
+  // Sets a bunch of values (keys are paths like "wifi.sta.ssid") in a single
+  // command, so it only takes one round trip. Optionally saves the config
+  // in the same command, too.
+  void setConfValues(const QJsonObject &values, bool save = false);
   void doSaveConfig();
 
+  // Commands are sent in chunks of chunkSize bytes, with no more than two
+  // chunks that have not been echoed back yet. If the echo does not come
+  // within echoTimeoutMs, the next chunk is sent anyway.
+  void setFlowControl(int chunkSize, int echoTimeoutMs);
+
   // This is sj_wifi_status, reproduced here to avoid dependency.
   enum class WifiStatus {
     Disconnected = 0,
@@ -44,20 +57,27 @@ signals:
   void getConfigResult(QJsonObject config);
   void wifiScanResult(QStringList networks);
   void wifiStatusChanged(WifiStatus ws);
+  // Empty if the device is not on the network.
+  void ipAddress(QString ip);
   void clubbyStatus(int status);
 
  private slots:
   void portReadyRead();
   void sendMore();
+  void echoTimeout();
 
  private:
   void doConnectAttempt();
   void sendCommand();
   void parseMessage(const QByteArray &msg);
+  void resetFramer();
+  // Takes the echo of what was sent out of received data. The rest is
+  // console output and does not count.
+  void consumeEcho(const QByteArray &buf);
 
   const QString beginMarker_;
   const QString endMarker_;
-  QSerialPort *port_;
+  QIODevice *port_;
 
   int clubbyTestId_ = 0;
 
@@ -68,8 +88,17 @@ signals:
   bool scanning_ = false;
   int connectAttempt_ = 0;
   QByteArray buf_;
+  int scanPos_ = 0;    // Where to look for the next marker from.
+  int msgStart_ = -1;  // Start of the message being received, if any.
   QStringList cmdQueue_;
+  // Queued commands that have passwords or keys in them. Neither they nor
+  // their echo are logged.
+  QSet<QString> secretCmds_;
   QByteArray curCmd_;
+  bool curSecret_ = false;
+  int chunkSize_;
+  QTimer echoTimer_;
+  QByteArray unechoed_;  // Bytes sent but not echoed yet.
 };
 
 #endif /* CS_MFT_SRC_FW_CLIENT_H_ */
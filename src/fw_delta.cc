@@ -0,0 +1,119 @@
+#include "fw_delta.h"
+
+#include <algorithm>
+#include <limits>
+
+#include <QDataStream>
+#include <QObject>
+
+#include "status_qt.h"
+
+const char kDeltaBaseAttr[] = "delta_base";
+const char kDeltaBaseSizeAttr[] = "delta_base_size";
+const char kDeltaBaseMD5Attr[] = "delta_base_md5";
+
+namespace {
+
+const quint32 kDeltaMagic = 0x4d464401;  // "MFD", version 1.
+
+}  // namespace
+
+util::StatusOr<FirmwareDelta> parseDelta(
+    const QByteArray &data, const QMap<QString, QVariant> &attrs) {
+  FirmwareDelta d;
+  d.base = attrs[kDeltaBaseAttr].toString();
+  bool ok;
+  d.baseSize = attrs[kDeltaBaseSizeAttr].toUInt(&ok);
+  if (!ok) {
+    return QS(util::error::INVALID_ARGUMENT,
+              QObject::tr("invalid %1").arg(kDeltaBaseSizeAttr));
+  }
+  d.baseMD5 =
+      QByteArray::fromHex(attrs[kDeltaBaseMD5Attr].toString().toLatin1());
+  if (d.baseMD5.length() != 16) {
+    return QS(util::error::INVALID_ARGUMENT,
+              QObject::tr("invalid %1").arg(kDeltaBaseMD5Attr));
+  }
+  QDataStream s(data);
+  s.setByteOrder(QDataStream::LittleEndian);
+  quint32 magic = 0, count = 0;
+  s >> magic >> count;
+  if (magic != kDeltaMagic) {
+    return QS(util::error::INVALID_ARGUMENT, QObject::tr("not a delta"));
+  }
+  quint32 end = 0;
+  for (quint32 i = 0; i < count; i++) {
+    quint32 offset = 0, length = 0;
+    s >> offset >> length;
+    if (s.status() != QDataStream::Ok || length > quint32(data.size())) {
+      return QS(util::error::INVALID_ARGUMENT, QObject::tr("truncated delta"));
+    }
+    QByteArray patch(length, Qt::Uninitialized);
+    if (s.readRawData(patch.data(), length) != int(length)) {
+      return QS(util::error::INVALID_ARGUMENT, QObject::tr("truncated delta"));
+    }
+    if (length > std::numeric_limits<quint32>::max() - offset) {
+      return QS(util::error::INVALID_ARGUMENT,
+                QObject::tr("delta patch at 0x%1 is out of range")
+                    .arg(offset, 0, 16));
+    }
+    if (offset < end) {
+      return QS(util::error::INVALID_ARGUMENT,
+                QObject::tr("delta patches overlap or are out of order"));
+    }
+    end = offset + length;
+    if (length > 0) d.patches[offset] = patch;
+  }
+  return d;
+}
+
+util::StatusOr<QMap<quint32, QByteArray>> FirmwareDelta::patchedSectors(
+    quint32 sectorSize, BaseReader readBase) const {
+  quint32 size = baseSize;
+  for (auto it = patches.constBegin(); it != patches.constEnd(); it++) {
+    size = std::max(size, quint32(it.key() + it->length()));
+  }
+  QMap<quint32, QByteArray> result;
+  for (auto it = patches.constBegin(); it != patches.constEnd(); it++) {
+    const quint32 first = it.key() / sectorSize * sectorSize;
+    // 64-bit, so the last sector below 4G does not wrap around.
+    const quint64 patchEnd = quint64(it.key()) + it->length();
+    for (quint64 so64 = first; so64 < patchEnd; so64 += sectorSize) {
+      const quint32 so = quint32(so64);
+      if (result.contains(so)) continue;
+      const quint32 len = std::min(sectorSize, size - so);
+      // Patches do not overlap, so only the last one starting at or before
+      // the sector can reach into it.
+      auto start = patches.upperBound(so);
+      if (start != patches.constBegin()) start--;
+      // Bytes of the sector covered by patches.
+      quint32 covered = 0;
+      for (auto pi = start; pi != patches.constEnd() && pi.key() < so + len;
+           pi++) {
+        const quint32 from = std::max(so, pi.key());
+        const quint32 to = std::min(so + len, quint32(pi.key() + pi->length()));
+        if (to > from) covered += to - from;
+      }
+      QByteArray sector(len, '\xff');
+      if (covered < len && so < baseSize) {
+        const quint32 n = std::min(len, baseSize - so);
+        auto br = readBase(so, n);
+        if (!br.ok()) return br.status();
+        if (quint32(br.ValueOrDie().length()) != n) {
+          return QS(util::error::INTERNAL, QObject::tr("short base read"));
+        }
+        sector.replace(0, n, br.ValueOrDie());
+      }
+      for (auto pi = start; pi != patches.constEnd() && pi.key() < so + len;
+           pi++) {
+        const quint32 from = std::max(so, pi.key());
+        const quint32 to = std::min(so + len, quint32(pi.key() + pi->length()));
+        if (to <= from) continue;
+        sector.replace(from - so, to - from,
+                       pi->constData() + (from - pi.key()), to - from);
+      }
+      result[so] = sector;
+    }
+  }
+  return result;
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ */
+
+#ifndef CS_MFT_SRC_FW_DELTA_H_
+#define CS_MFT_SRC_FW_DELTA_H_
+
+#include <functional>
+
+#include <QByteArray>
+#include <QMap>
+#include <QString>
+#include <QVariant>
+
+#include <common/util/statusor.h>
+
+// A part with these attributes has a delta as its source, to be applied to
+// what the base build put at the part's address. The base image is identified
+// by its size and MD5, so it can be checked without reading it back.
+extern const char kDeltaBaseAttr[];      // build_id of the base build.
+extern const char kDeltaBaseSizeAttr[];  // Size of the image in the base.
+extern const char kDeltaBaseMD5Attr[];   // MD5 of it, hex.
+
+// Delta file: magic, number of patches, then each patch as offset, length and
+// data, all numbers 32-bit little-endian. Patches replace ranges of the base
+// image and must not overlap.
+struct FirmwareDelta {
+  QString base;
+  quint32 baseSize = 0;
+  QByteArray baseMD5;
+  QMap<quint32, QByteArray> patches;  // Offset -> data.
+
+  // Returns contents of the sectors the patches touch, by offset. Sectors
+  // are sectorSize long, except the last one of the image may be shorter.
+  // readBase is only called for sectors that patches do not cover entirely.
+  typedef std::function<util::StatusOr<QByteArray>(quint32 offset,
+                                                   quint32 size)> BaseReader;
+  util::StatusOr<QMap<quint32, QByteArray>> patchedSectors(
+      quint32 sectorSize, BaseReader readBase) const;
+};
+
+// Parses delta data and part attributes.
+util::StatusOr<FirmwareDelta> parseDelta(const QByteArray &data,
+                                         const QMap<QString, QVariant> &attrs);
+
+#endif /* CS_MFT_SRC_FW_DELTA_H_ */
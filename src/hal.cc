@@ -0,0 +1,19 @@
+#include "hal.h"
+
+#include <QSerialPort>
+#include <QString>
+
+#include "cc3200.h"
+#include "esp8266.h"
+
+std::unique_ptr<HAL> newHAL(const QString &platform, QIODevice *port) {
+  if (platform == "esp8266") {
+    return ESP8266::HAL(port);
+  } else if (platform == "cc3200") {
+    // Only local serial ports are supported.
+    QSerialPort *sp = qobject_cast<QSerialPort *>(port);
+    if (port != nullptr && sp == nullptr) return nullptr;
+    return CC3200::HAL(sp);
+  }
+  return nullptr;
+}
@@ -13,8 +13,10 @@
 #include "flasher.h"
 #include "prompter.h"
 
+class QIODevice;
 class QSerialPort;
 class QSerialPortInfo;
+class QString;
 
 class HAL {
  public:
@@ -24,6 +26,12 @@ class HAL {
   virtual std::unique_ptr<Flasher> flasher(Prompter *prompter) const = 0;
   virtual std::string name() const = 0;
   virtual util::Status reboot() = 0;
+  // Implementations may keep the device in a special mode (e.g. boot loader)
+  // between operations to avoid resetting it every time. This lets it go.
+  virtual void release(){};
 };
 
+// Returns nullptr if the platform is unknown or can not use the port.
+std::unique_ptr<HAL> newHAL(const QString &platform, QIODevice *port);
+
 #endif /* CS_MFT_SRC_HAL_H_ */
@@ -0,0 +1,113 @@
+#include "latency_histogram.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <QVariantList>
+
+namespace {
+
+// Sub-buckets per power of two, as a number of bits.
+const int kSubBucketBits = 3;
+const int kSubBuckets = 1 << kSubBucketBits;
+
+}  // namespace
+
+// static
+int LatencyHistogram::bucketIndex(qint64 us) {
+  if (us < kSubBuckets) return std::max(us, qint64(0));
+  int msb = 63;
+  while ((us >> msb) == 0) msb--;
+  const int shift = msb - kSubBucketBits;
+  const int sub = (us >> shift) & (kSubBuckets - 1);
+  return kSubBuckets + shift * kSubBuckets + sub;
+}
+
+// static
+qint64 LatencyHistogram::bucketUpperBoundUs(int index) {
+  if (index < kSubBuckets) return index;
+  const int shift = (index - kSubBuckets) / kSubBuckets;
+  const int sub = (index - kSubBuckets) % kSubBuckets;
+  return ((qint64(kSubBuckets + sub + 1)) << shift) - 1;
+}
+
+void LatencyHistogram::record(qint64 us) {
+  const int i = bucketIndex(us);
+  if (i >= buckets_.size()) buckets_.resize(i + 1);
+  buckets_[i]++;
+  count_++;
+  sumUs_ += us;
+  maxUs_ = std::max(maxUs_, us);
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other) {
+  if (other.buckets_.size() > buckets_.size()) {
+    buckets_.resize(other.buckets_.size());
+  }
+  for (int i = 0; i < other.buckets_.size(); i++) {
+    buckets_[i] += other.buckets_[i];
+  }
+  count_ += other.count_;
+  sumUs_ += other.sumUs_;
+  maxUs_ = std::max(maxUs_, other.maxUs_);
+}
+
+quint64 LatencyHistogram::count() const {
+  return count_;
+}
+
+qint64 LatencyHistogram::maxUs() const {
+  return maxUs_;
+}
+
+qint64 LatencyHistogram::percentileUs(double p) const {
+  if (count_ == 0) return 0;
+  const quint64 rank =
+      std::max(quint64(1), quint64(std::ceil(count_ * p / 100)));
+  quint64 seen = 0;
+  for (int i = 0; i < buckets_.size(); i++) {
+    seen += buckets_[i];
+    if (seen >= rank) return std::min(bucketUpperBoundUs(i), maxUs_);
+  }
+  return maxUs_;
+}
+
+QVariantMap LatencyHistogram::toVariant() const {
+  QVariantMap result;
+  result["count"] = count_;
+  result["mean_us"] = count_ > 0 ? sumUs_ / qint64(count_) : 0;
+  result["p50_us"] = percentileUs(50);
+  result["p90_us"] = percentileUs(90);
+  result["p99_us"] = percentileUs(99);
+  result["max_us"] = maxUs_;
+  QVariantList buckets;
+  for (int i = 0; i < buckets_.size(); i++) {
+    if (buckets_[i] == 0) continue;
+    buckets.append(QVariant(QVariantList{bucketUpperBoundUs(i), buckets_[i]}));
+  }
+  result["buckets"] = buckets;
+  return result;
+}
+
+void CommandLatencies::record(const QString &command, qint64 us) {
+  byCommand_[command].record(us);
+}
+
+void CommandLatencies::merge(const CommandLatencies &other) {
+  for (auto it = other.byCommand_.begin(); it != other.byCommand_.end();
+       ++it) {
+    byCommand_[it.key()].merge(it.value());
+  }
+}
+
+bool CommandLatencies::isEmpty() const {
+  return byCommand_.isEmpty();
+}
+
+QVariantMap CommandLatencies::toVariant() const {
+  QVariantMap result;
+  for (auto it = byCommand_.begin(); it != byCommand_.end(); ++it) {
+    result[it.key()] = it.value().toVariant();
+  }
+  return result;
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ */
+
+#ifndef CS_MFT_SRC_LATENCY_HISTOGRAM_H_
+#define CS_MFT_SRC_LATENCY_HISTOGRAM_H_
+
+#include <QMap>
+#include <QString>
+#include <QVariantMap>
+#include <QVector>
+
+// Distribution of latencies in microseconds, in HDR-style buckets: exact up
+// to 8 us, then 8 buckets per power of two. Percentiles are within 12.5% of
+// the real value at any scale and a histogram is a few hundred counters at
+// most, so keeping one per command costs next to nothing.
+class LatencyHistogram {
+ public:
+  void record(qint64 us);
+  void merge(const LatencyHistogram &other);
+
+  quint64 count() const;
+  qint64 maxUs() const;
+  // Upper bound of the bucket the p-th percentile (0..100) falls into.
+  qint64 percentileUs(double p) const;
+
+  // count, mean_us, p50_us, p90_us, p99_us, max_us and buckets, the
+  // non-empty ones as [upper bound in us, count] pairs.
+  QVariantMap toVariant() const;
+
+  static int bucketIndex(qint64 us);
+  static qint64 bucketUpperBoundUs(int index);
+
+ private:
+  QVector<quint64> buckets_;
+  quint64 count_ = 0;
+  qint64 sumUs_ = 0;
+  qint64 maxUs_ = 0;
+};
+
+// Request to response times of protocol commands, by command name.
+class CommandLatencies {
+ public:
+  void record(const QString &command, qint64 us);
+  void merge(const CommandLatencies &other);
+  bool isEmpty() const;
+  // Command name -> LatencyHistogram::toVariant().
+  QVariantMap toVariant() const;
+
+ private:
+  QMap<QString, LatencyHistogram> byCommand_;
+};
+
+#endif /* CS_MFT_SRC_LATENCY_HISTOGRAM_H_ */
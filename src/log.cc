@@ -1,5 +1,6 @@
 #include "log.h"
 
+#include <atomic>
 #include <iostream>
 #include <memory>
 
@@ -14,64 +15,79 @@ const int kMaxBufferedLines = 10000;
 
 using std::endl;
 
-class LocalLogSource : public Log::EntrySource {
+// A slot in the ring of buffered entries. The flag is only held for as long
+// as it takes to copy an entry, so there is no contention unless a writer
+// laps the reader.
+struct Slot {
+  std::atomic_flag busy = ATOMIC_FLAG_INIT;
+  quint64 seq = 0;  // Index of the entry + 1, 0 if not written yet.
+  Log::Entry entry;
+};
+
+class SlotLocker {
  public:
-  virtual ~LocalLogSource() {
+  explicit SlotLocker(Slot *s) : s_(s) {
+    while (s_->busy.test_and_set(std::memory_order_acquire)) {
+    }
   }
-  void addLogEntry(const Log::Entry &e) {
-    emit newLogEntry(e);
+  ~SlotLocker() {
+    s_->busy.clear(std::memory_order_release);
   }
+
+ private:
+  Slot *s_;
 };
 
-QMutex mtx;  // guards verbosity, logfile and lines.
-int verbosity = 0;
+Slot ring[kMaxBufferedLines];
+std::atomic<quint64> ringHead(0);  // Index of the next entry.
+
+std::atomic<int> verbosity(0);
+QMutex mtx;  // guards logfile.
 std::ostream *logfile = nullptr;
 std::unique_ptr<std::ostream> logfile_owner;
-QList<Log::Entry> lines;
-std::unique_ptr<LocalLogSource> logSource;
+
+void bufferEntry(const Log::Entry &e) {
+  const quint64 idx = ringHead.fetch_add(1);
+  Slot *s = &ring[idx % kMaxBufferedLines];
+  SlotLocker l(s);
+  // Another writer may have lapped this one.
+  if (s->seq > idx) return;
+  s->entry = e;
+  s->seq = idx + 1;
+}
 
 void outputHandler(QtMsgType type, const QMessageLogContext &context,
                    const QString &msg) {
-  QMutexLocker lock(&mtx);
-  const Log::Entry e{type, context.file, context.line, msg};
-  lines.push_back(e);
-  if (lines.length() > kMaxBufferedLines) lines.pop_front();
-  logSource->addLogEntry(e);
-  if (logfile == nullptr) {
-    return;
-  }
-  QByteArray localMsg = msg.toLocal8Bit();
+  bufferEntry(Log::Entry{type, context.file, context.line, msg});
+  const int v = verbosity.load(std::memory_order_relaxed);
   const char *ll = nullptr;
   bool die = false;
   switch (type) {
     case QtDebugMsg:
-      if (verbosity >= 4) ll = "DEBUG";
+      if (v >= 4) ll = "DEBUG";
       break;
 #if (QT_VERSION >= QT_VERSION_CHECK(5, 5, 0))
     case QtInfoMsg:
-      if (verbosity >= 3) ll = "INFO";
+      if (v >= 3) ll = "INFO";
       break;
 #endif
     case QtWarningMsg:
-      if (verbosity >= 2) ll = "WARNING";
+      if (v >= 2) ll = "WARNING";
       break;
     case QtCriticalMsg:
-      if (verbosity >= 1) ll = "CRITICAL";
-      break;
-      if (verbosity >= 1) {
-        *logfile << "CRITICAL: ";
-        if (context.file != NULL) {
-          *logfile << context.file << ":" << context.line << " ";
-        }
-        *logfile << localMsg.constData() << endl;
-      }
+      if (v >= 1) ll = "CRITICAL";
       break;
     case QtFatalMsg:
       ll = "FATAL";
       die = true;
       break;
   }
+  // Most messages end up not being written, the lock is only taken for the
+  // rest.
   if (ll != nullptr) {
+    QMutexLocker lock(&mtx);
+    if (logfile == nullptr) return;
+    const QByteArray localMsg = msg.toLocal8Bit();
     *logfile << ll << ": ";
     if (context.file != NULL) {
       *logfile << context.file << ":" << context.line << " ";
@@ -85,15 +101,17 @@ void outputHandler(QtMsgType type, const QMessageLogContext &context,
 
 namespace Log {
 
+Q_LOGGING_CATEGORY(proto, "mft.proto")
+
 void init() {
-  qRegisterMetaType<Log::Entry>("Log::Entry");
-  logSource.reset(new LocalLogSource);
   qInstallMessageHandler(outputHandler);
 }
 
 void setVerbosity(int v) {
-  QMutexLocker lock(&mtx);
   verbosity = v;
+  // Rules from QT_LOGGING_RULES take precedence over these.
+  QLoggingCategory::setFilterRules(
+      QString("mft.proto.debug=%1").arg(v >= 4 ? "true" : "false"));
 }
 
 void setFile(std::ostream *file) {
@@ -104,13 +122,25 @@ void setFile(std::ostream *file) {
   }
 }
 
-QList<Entry> getBufferedLines() {
-  QMutexLocker l(&mtx);
-  return lines;
+QList<Entry> readEntries(quint64 *cursor, int max) {
+  QList<Entry> result;
+  const quint64 head = ringHead.load();
+  quint64 i = *cursor;
+  if (head - i > kMaxBufferedLines) i = head - kMaxBufferedLines;
+  for (; i < head && result.length() < max; i++) {
+    Slot *s = &ring[i % kMaxBufferedLines];
+    SlotLocker l(s);
+    // Claimed, but not written yet. Pick it up next time.
+    if (s->seq < i + 1) break;
+    if (s->seq == i + 1) result.append(s->entry);
+  }
+  *cursor = i;
+  return result;
 }
 
-EntrySource *entrySource() {
-  return logSource.get();
+QList<Entry> getBufferedLines() {
+  quint64 cursor = 0;
+  return readEntries(&cursor, kMaxBufferedLines);
 }
 
 }  // namespace Log
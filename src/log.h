@@ -9,12 +9,17 @@
 #include <iostream>
 
 #include <QList>
-#include <QObject>
+#include <QLoggingCategory>
 #include <QString>
 #include <QtGlobal>
 
 namespace Log {
 
+// Dumps of protocol frames and other per-packet debug output. Log it with
+// qCDebug(Log::proto), so the message is not even formatted unless debug
+// output is enabled (verbosity 4 or QT_LOGGING_RULES="mft.proto.debug=true").
+Q_DECLARE_LOGGING_CATEGORY(proto)
+
 void init();
 void setVerbosity(int v);
 
@@ -29,16 +34,13 @@ struct Entry {
   QString msg;
 };
 
+// Recent entries are kept in a ring buffer, regardless of verbosity.
+// readEntries returns up to max of them, starting at *cursor, and moves the
+// cursor past them. Entries that have been overwritten since are skipped.
+// Start with a cursor of 0 to get everything that is still buffered.
+QList<Entry> readEntries(quint64 *cursor, int max);
 QList<Entry> getBufferedLines();
 
-class EntrySource : public QObject {
-  Q_OBJECT
-signals:
-  void newLogEntry(const Log::Entry e);
-};
-
-EntrySource *entrySource();
-
 }  // namespace Log
 
 #endif /* CS_MFT_SRC_LOG_H_ */
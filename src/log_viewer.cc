@@ -1,56 +1,206 @@
 #include "log_viewer.h"
 
-#include <iostream>
+#include <algorithm>
 
+#include <QAction>
+#include <QApplication>
+#include <QBrush>
+#include <QClipboard>
+#include <QFontDatabase>
 #include <QScrollBar>
+#include <QStringList>
 
 namespace {
 const int kMaxLineLength = 1000;
+const int kReadIntervalMs = 100;
+const int kMaxEntriesPerRead = 10000;
+const int kMaxEntries = 500000;
+const int kFilterDelayMs = 200;
+}
+
+LogModel::LogModel(QObject *parent) : QAbstractListModel(parent) {
+}
+
+int LogModel::rowCount(const QModelIndex &parent) const {
+  return parent.isValid() ? 0 : entries_.length();
+}
+
+QVariant LogModel::data(const QModelIndex &index, int role) const {
+  if (!index.isValid() || index.row() >= entries_.length()) return QVariant();
+  const Log::Entry &e = entries_[index.row()];
+  switch (role) {
+    case Qt::DisplayRole: {
+      QString line;
+      if (e.file != "") {
+        line = QString("%1 %2:%3 %4")
+                   .arg(e.type)
+                   .arg(e.file)
+                   .arg(e.line)
+                   .arg(e.msg);
+      } else {
+        line = QString("%1 %4").arg(e.type).arg(e.msg);
+      }
+      if (line.length() > kMaxLineLength) {
+        line = QString("%1... (%2)")
+                   .arg(line.left(kMaxLineLength))
+                   .arg(line.length());
+      }
+      return line;
+    }
+    case Qt::ForegroundRole:
+      switch (severity(e.type)) {
+        case 0:
+          return QBrush(Qt::gray);
+        case 2:
+          return QBrush(Qt::darkYellow);
+        case 3:
+        case 4:
+          return QBrush(Qt::red);
+      }
+      return QVariant();
+    case SeverityRole:
+      return severity(e.type);
+    case MessageRole:
+      return e.msg;
+  }
+  return QVariant();
+}
+
+void LogModel::append(const QList<Log::Entry> &entries) {
+  if (entries.isEmpty()) return;
+  // Drop in chunks, removing rows one by one is slow with a filter on top.
+  if (entries_.length() + entries.length() > kMaxEntries) {
+    const int n = qMin(entries_.length(),
+                       entries_.length() + entries.length() - kMaxEntries +
+                           kMaxEntries / 10);
+    beginRemoveRows(QModelIndex(), 0, n - 1);
+    entries_.erase(entries_.begin(), entries_.begin() + n);
+    endRemoveRows();
+  }
+  beginInsertRows(QModelIndex(), entries_.length(),
+                  entries_.length() + entries.length() - 1);
+  entries_.append(entries);
+  endInsertRows();
+}
+
+void LogModel::clear() {
+  beginResetModel();
+  entries_.clear();
+  endResetModel();
+}
+
+// static
+int LogModel::severity(QtMsgType type) {
+  switch (type) {
+    case QtDebugMsg:
+      return 0;
+#if (QT_VERSION >= QT_VERSION_CHECK(5, 5, 0))
+    case QtInfoMsg:
+      return 1;
+#endif
+    case QtWarningMsg:
+      return 2;
+    case QtCriticalMsg:
+      return 3;
+    case QtFatalMsg:
+      return 4;
+  }
+  return 0;
+}
+
+LogFilterModel::LogFilterModel(QObject *parent)
+    : QSortFilterProxyModel(parent) {
+  // New rows are checked as they come in, the whole model is only filtered
+  // again when the filter changes.
+  setDynamicSortFilter(true);
+}
+
+void LogFilterModel::setMinSeverity(int severity) {
+  if (minSeverity_ == severity) return;
+  minSeverity_ = severity;
+  invalidateFilter();
+}
+
+void LogFilterModel::setText(const QString &text) {
+  if (text_ == text) return;
+  text_ = text;
+  invalidateFilter();
+}
+
+bool LogFilterModel::filterAcceptsRow(int sourceRow,
+                                      const QModelIndex &sourceParent) const {
+  const QModelIndex idx = sourceModel()->index(sourceRow, 0, sourceParent);
+  if (idx.data(LogModel::SeverityRole).toInt() < minSeverity_) return false;
+  if (text_.isEmpty()) return true;
+  return idx.data(LogModel::MessageRole)
+      .toString()
+      .contains(text_, Qt::CaseInsensitive);
 }
 
 LogViewer::LogViewer(QWidget *parent) : QWidget(parent) {
   ui_.setupUi(this);
-  cursor_.reset(new QTextCursor(ui_.logView->document()));
-  cursor_->movePosition(QTextCursor::End);
-  for (const auto &e : Log::getBufferedLines()) {
-    newLogEntry(e);
-  }
-  connect(Log::entrySource(), &Log::EntrySource::newLogEntry, this,
-          &LogViewer::newLogEntry);
+  filter_.setSourceModel(&model_);
+  ui_.logView->setModel(&filter_);
+  ui_.logView->setUniformItemSizes(true);
+  ui_.logView->setFont(QFontDatabase::systemFont(QFontDatabase::FixedFont));
+
+  ui_.severitySelector->addItem(tr("All"), 0);
+  ui_.severitySelector->addItem(tr("Info and above"), 1);
+  ui_.severitySelector->addItem(tr("Warnings and above"), 2);
+  ui_.severitySelector->addItem(tr("Errors only"), 3);
+  connect(ui_.severitySelector, static_cast<void (QComboBox::*) (int) >(
+                                    &QComboBox::currentIndexChanged),
+          this, &LogViewer::applyFilter);
+
+  filter_timer_.setSingleShot(true);
+  filter_timer_.setInterval(kFilterDelayMs);
+  connect(&filter_timer_, &QTimer::timeout, this, &LogViewer::applyFilter);
+  connect(ui_.filterText, &QLineEdit::textChanged,
+          [this]() { filter_timer_.start(); });
+
+  QAction *copy = new QAction(this);
+  copy->setShortcut(QKeySequence::Copy);
+  copy->setShortcutContext(Qt::WidgetShortcut);
+  ui_.logView->addAction(copy);
+  connect(copy, &QAction::triggered, this, &LogViewer::copySelection);
+
+  readEntries();
+  connect(&read_timer_, &QTimer::timeout, this, &LogViewer::readEntries);
+  read_timer_.start(kReadIntervalMs);
   connect(ui_.clearButton, &QPushButton::clicked, this, &LogViewer::clearView);
 }
 
 LogViewer::~LogViewer() {
 }
 
-void LogViewer::newLogEntry(const Log::Entry e) {
+void LogViewer::readEntries() {
   QScrollBar *scroll = ui_.logView->verticalScrollBar();
   const bool autoscroll = (scroll->value() == scroll->maximum());
-  {
-    QString line;
-    if (e.file != "") {
-      line =
-          QString("%1 %2:%3 %4").arg(e.type).arg(e.file).arg(e.line).arg(e.msg);
-    } else {
-      line = QString("%1 %4").arg(e.type).arg(e.msg);
-    }
-    if (line.length() > kMaxLineLength) {
-      line = QString("%1... (%2)")
-                 .arg(line.left(kMaxLineLength))
-                 .arg(line.length());
-    }
-    if (!first_) cursor_->insertBlock();
-    cursor_->insertText(line);
-  }
-  if (autoscroll) {
-    scroll->setValue(scroll->maximum());
-  }
-  first_ = false;
+  QList<Log::Entry> entries;
+  do {
+    entries = Log::readEntries(&cursor_pos_, kMaxEntriesPerRead);
+    model_.append(entries);
+  } while (entries.length() == kMaxEntriesPerRead);
+  if (autoscroll) ui_.logView->scrollToBottom();
 }
 
 void LogViewer::clearView() {
-  ui_.logView->clear();
-  first_ = true;
+  model_.clear();
+}
+
+void LogViewer::applyFilter() {
+  filter_timer_.stop();
+  filter_.setMinSeverity(ui_.severitySelector->currentData().toInt());
+  filter_.setText(ui_.filterText->text());
+  ui_.logView->scrollToBottom();
+}
+
+void LogViewer::copySelection() {
+  QModelIndexList rows = ui_.logView->selectionModel()->selectedIndexes();
+  std::sort(rows.begin(), rows.end());
+  QStringList lines;
+  for (const QModelIndex &idx : rows) lines << idx.data().toString();
+  QApplication::clipboard()->setText(lines.join('\n'));
 }
 
 void LogViewer::closeEvent(QCloseEvent *event) {
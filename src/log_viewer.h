@@ -6,14 +6,60 @@
 #ifndef CS_MFT_SRC_LOG_VIEWER_H_
 #define CS_MFT_SRC_LOG_VIEWER_H_
 
-#include <memory>
-
-#include <QTextCursor>
+#include <QAbstractListModel>
+#include <QList>
+#include <QSortFilterProxyModel>
+#include <QTimer>
 #include <QWidget>
 
 #include "log.h"
 #include "ui_log_viewer.h"
 
+// Log entries shown by LogViewer. Rows are only formatted when they are
+// painted, so it copes with a lot of them.
+class LogModel : public QAbstractListModel {
+  Q_OBJECT
+
+ public:
+  enum Role {
+    SeverityRole = Qt::UserRole,  // 0 for debug up to 4 for fatal.
+    MessageRole,
+  };
+
+  explicit LogModel(QObject *parent = nullptr);
+
+  int rowCount(const QModelIndex &parent = QModelIndex()) const override;
+  QVariant data(const QModelIndex &index, int role) const override;
+
+  // Oldest entries are dropped once there are too many.
+  void append(const QList<Log::Entry> &entries);
+  void clear();
+
+  static int severity(QtMsgType type);
+
+ private:
+  QList<Log::Entry> entries_;
+};
+
+// Hides entries below a severity or without a substring in the message.
+class LogFilterModel : public QSortFilterProxyModel {
+  Q_OBJECT
+
+ public:
+  explicit LogFilterModel(QObject *parent = nullptr);
+
+  void setMinSeverity(int severity);
+  void setText(const QString &text);
+
+ protected:
+  bool filterAcceptsRow(int sourceRow,
+                        const QModelIndex &sourceParent) const override;
+
+ private:
+  int minSeverity_ = 0;
+  QString text_;
+};
+
 class LogViewer : public QWidget {
   Q_OBJECT
 
@@ -22,8 +68,11 @@ class LogViewer : public QWidget {
   virtual ~LogViewer();
 
  private slots:
-  void newLogEntry(const Log::Entry e);
+  // Shows the entries logged since the last call.
+  void readEntries();
   void clearView();
+  void applyFilter();
+  void copySelection();
 
 signals:
   void closed();
@@ -32,8 +81,11 @@ signals:
   void closeEvent(QCloseEvent *event);
 
   Ui::LogViewer ui_;
-  std::unique_ptr<QTextCursor> cursor_;
-  bool first_ = true;
+  LogModel model_;
+  LogFilterModel filter_;
+  quint64 cursor_pos_ = 0;  // In the log ring buffer.
+  QTimer read_timer_;
+  QTimer filter_timer_;  // Applies the filter once typing stops.
 };
 
 #endif /* CS_MFT_SRC_LOG_VIEWER_H_ */
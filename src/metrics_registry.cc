@@ -0,0 +1,194 @@
+#include "metrics_registry.h"
+
+#include <QMutexLocker>
+#include <QSaveFile>
+#include <QStringList>
+
+#include "status_qt.h"
+
+namespace {
+
+// Counters reported by flashers, exported as mft_<name>_total.
+const char *const kCounters[] = {
+    "connect_retries", "write_retries", "dedup_sectors",
+    "dedup_sectors_skipped", "resumed_bytes", "bytes_sent", "bytes_received",
+    "files_uploaded", "files_skipped", "bytes_uploaded", "bandwidth_wait_ms",
+    "ota_probe_ms",
+};
+
+QString escape(QString v) {
+  return v.replace("\\", "\\\\").replace("\"", "\\\"").replace("\n", "\\n");
+}
+
+// Label pairs in the order given, as they appear in the output.
+QString labels(const QStringList &kv) {
+  QStringList parts;
+  for (int i = 0; i + 1 < kv.size(); i += 2) {
+    parts << QString("%1=\"%2\"").arg(kv[i]).arg(escape(kv[i + 1]));
+  }
+  return parts.join(',');
+}
+
+QString number(double v) {
+  return QString::number(v, 'g', 15);
+}
+
+}  // namespace
+
+MetricsRegistry::MetricsRegistry() {
+  addFamily("mft_flash_runs_total", "counter", "Flasher runs.");
+  addFamily("mft_flash_failures_total", "counter",
+            "Failed runs, by the phase they failed in.");
+  addFamily("mft_flash_duration_seconds", "histogram",
+            "Duration of whole runs.", {5, 10, 20, 30, 60, 120, 300, 600});
+  addFamily("mft_phase_duration_seconds", "histogram",
+            "Duration of flashing phases (connect, erase, write, ...).",
+            {0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 120});
+  addFamily("mft_phase_bytes_total", "counter",
+            "Data moved in flashing phases.");
+  addFamily("mft_port_bytes_per_second", "gauge",
+            "Data rate of the last run on a port, over the phases that move "
+            "data.");
+  addFamily("mft_command_latency_seconds", "histogram",
+            "Time from sending a protocol command to its response. Sums are "
+            "of the upper bounds of the flasher's own buckets, so slightly "
+            "high.",
+            {0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5,
+             1, 2.5, 5});
+  for (const char *c : kCounters) {
+    addFamily(QString("mft_%1_total").arg(c), "counter",
+              QString("Sum of %1 reported by flashers.").arg(c));
+  }
+}
+
+void MetricsRegistry::record(const QString &port, bool ok,
+                             const QVariantMap &metrics) {
+  QMutexLocker lock(&mtx_);
+  const QString adapter = metrics.value("serial_profile", "unknown").toString();
+  const QVariantList phases = metrics["phases"].toList();
+  const QString result = ok ? "ok" : "failed";
+  add("mft_flash_runs_total",
+      labels({"adapter", adapter, "port", port, "result", result}), 1);
+  if (!ok) {
+    const QString phase =
+        phases.isEmpty() ? "none" : phases.last().toMap()["name"].toString();
+    add("mft_flash_failures_total",
+        labels({"adapter", adapter, "phase", phase}), 1);
+  }
+  if (metrics.contains("total_ms")) {
+    observe("mft_flash_duration_seconds", labels({"adapter", adapter}),
+            metrics["total_ms"].toDouble() / 1000);
+  }
+  qint64 dataBytes = 0, dataMs = 0;
+  for (const QVariant &pv : phases) {
+    const QVariantMap p = pv.toMap();
+    const QString l =
+        labels({"adapter", adapter, "phase", p["name"].toString()});
+    observe("mft_phase_duration_seconds", l, p["ms"].toDouble() / 1000);
+    if (p.contains("bytes")) {
+      add("mft_phase_bytes_total", l, p["bytes"].toDouble());
+      dataBytes += p["bytes"].toLongLong();
+      dataMs += p["ms"].toLongLong();
+    }
+  }
+  if (dataMs > 0) {
+    set("mft_port_bytes_per_second",
+        labels({"adapter", adapter, "port", port}),
+        dataBytes * 1000.0 / dataMs);
+  }
+  const QVariantMap latency = metrics["latency"].toMap();
+  for (auto it = latency.begin(); it != latency.end(); ++it) {
+    const QString l =
+        labels({"adapter", adapter, "port", port, "command", it.key()});
+    for (const QVariant &bv : it.value().toMap()["buckets"].toList()) {
+      const QVariantList b = bv.toList();
+      if (b.size() != 2) continue;
+      observe("mft_command_latency_seconds", l, b[0].toDouble() / 1e6,
+              b[1].toULongLong());
+    }
+  }
+  for (const char *c : kCounters) {
+    if (!metrics.contains(c)) continue;
+    add(QString("mft_%1_total").arg(c), labels({"adapter", adapter}),
+        metrics[c].toDouble());
+  }
+}
+
+QByteArray MetricsRegistry::exposition() const {
+  QMutexLocker lock(&mtx_);
+  QString out;
+  for (auto fi = families_.begin(); fi != families_.end(); ++fi) {
+    const Family &f = fi.value();
+    if (f.series.isEmpty()) continue;
+    const QString &name = fi.key();
+    out += QString("# HELP %1 %2\n# TYPE %1 %3\n").arg(name, f.help, f.type);
+    for (auto si = f.series.begin(); si != f.series.end(); ++si) {
+      const QString &l = si.key();
+      const Series &s = si.value();
+      if (f.type != "histogram") {
+        out += QString("%1{%2} %3\n").arg(name, l, number(s.value));
+        continue;
+      }
+      const QString sep = l.isEmpty() ? "" : ",";
+      quint64 cumulative = 0;
+      for (int i = 0; i < f.bounds.size(); i++) {
+        cumulative += s.buckets[i];
+        out += QString("%1_bucket{%2%3le=\"%4\"} %5\n")
+                   .arg(name, l, sep, number(f.bounds[i]))
+                   .arg(cumulative);
+      }
+      out += QString("%1_bucket{%2%3le=\"+Inf\"} %4\n")
+                 .arg(name, l, sep)
+                 .arg(s.count);
+      out += QString("%1_sum{%2} %3\n").arg(name, l, number(s.sum));
+      out += QString("%1_count{%2} %3\n").arg(name, l).arg(s.count);
+    }
+  }
+  return out.toUtf8();
+}
+
+util::Status MetricsRegistry::writeTextFile(const QString &path) const {
+  const QByteArray data = exposition();
+  QSaveFile f(path);
+  if (!f.open(QIODevice::WriteOnly) || f.write(data) != data.size() ||
+      !f.commit()) {
+    return QS(util::error::UNAVAILABLE, QObject::tr("failed to write %1: %2")
+                                            .arg(path)
+                                            .arg(f.errorString()));
+  }
+  return util::Status::OK;
+}
+
+void MetricsRegistry::addFamily(const QString &name, const QString &type,
+                                const QString &help,
+                                const QVector<double> &bounds) {
+  Family &f = families_[name];
+  f.type = type;
+  f.help = help;
+  f.bounds = bounds;
+}
+
+void MetricsRegistry::add(const QString &name, const QString &labels,
+                          double v) {
+  families_[name].series[labels].value += v;
+}
+
+void MetricsRegistry::set(const QString &name, const QString &labels,
+                          double v) {
+  families_[name].series[labels].value = v;
+}
+
+void MetricsRegistry::observe(const QString &name, const QString &labels,
+                              double v, quint64 n) {
+  Family &f = families_[name];
+  Series &s = f.series[labels];
+  if (s.buckets.isEmpty()) s.buckets.resize(f.bounds.size());
+  for (int i = 0; i < f.bounds.size(); i++) {
+    if (v <= f.bounds[i]) {
+      s.buckets[i] += n;
+      break;
+    }
+  }
+  s.count += n;
+  s.sum += v * n;
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ */
+
+#ifndef CS_MFT_SRC_METRICS_REGISTRY_H_
+#define CS_MFT_SRC_METRICS_REGISTRY_H_
+
+#include <QByteArray>
+#include <QMap>
+#include <QMutex>
+#include <QString>
+#include <QVariantMap>
+#include <QVector>
+
+#include <common/util/status.h>
+
+// Aggregates the metrics of flasher runs (see Flasher::metrics) over many
+// devices and renders them in the Prometheus text exposition format:
+// runs and failures by adapter and port, per-phase durations as
+// histograms, bytes and throughput per phase and the counters flashers
+// report (retries, dedup, resume), and round trip times of protocol
+// commands by port and command. The adapter is the serial profile name
+// from the run metrics. Thread-safe.
+class MetricsRegistry {
+ public:
+  MetricsRegistry();
+
+  void record(const QString &port, bool success, const QVariantMap &metrics);
+
+  QByteArray exposition() const;
+  // Replaces the file atomically, so a collector (e.g. node_exporter's
+  // textfile collector) never reads a partial one.
+  util::Status writeTextFile(const QString &path) const;
+
+ private:
+  struct Series {
+    double value = 0;
+    QVector<quint64> buckets;  // Histograms only, not cumulative.
+    quint64 count = 0;
+    double sum = 0;
+  };
+  struct Family {
+    QString type;
+    QString help;
+    QVector<double> bounds;  // Histograms only.
+    QMap<QString, Series> series;  // By formatted label set.
+  };
+
+  void addFamily(const QString &name, const QString &type,
+                 const QString &help, const QVector<double> &bounds = {});
+  void add(const QString &name, const QString &labels, double v);
+  void set(const QString &name, const QString &labels, double v);
+  // Records n observations of v.
+  void observe(const QString &name, const QString &labels, double v,
+               quint64 n = 1);
+
+  mutable QMutex mtx_;
+  QMap<QString, Family> families_;
+};
+
+#endif /* CS_MFT_SRC_METRICS_REGISTRY_H_ */
@@ -0,0 +1,327 @@
+#include "net_serial.h"
+
+#include <algorithm>
+#include <cstring>
+#include <initializer_list>
+
+#include <QElapsedTimer>
+#include <QTcpSocket>
+#include <QUrl>
+#include <QUrlQuery>
+#include <QtDebug>
+
+#include "status_qt.h"
+
+#if (QT_VERSION < QT_VERSION_CHECK(5, 5, 0))
+#define qInfo qWarning
+#endif
+
+namespace {
+
+const int connectTimeoutMs = 5000;
+// Bridges answer option negotiation right away.
+const int negotiationTimeoutMs = 1000;
+const quint16 defaultTelnetPort = 23;
+
+// Telnet (RFC 854).
+const quint8 SE = 240;
+const quint8 SB = 250;
+const quint8 WILL = 251;
+const quint8 WONT = 252;
+const quint8 DO = 253;
+const quint8 DONT = 254;
+const quint8 IAC = 255;
+
+const quint8 kOptBinary = 0;           // RFC 856
+const quint8 kOptSuppressGoAhead = 3;  // RFC 858
+const quint8 kOptComPort = 44;         // RFC 2217
+
+// COM port option commands (client to server, server adds 100).
+const quint8 kSetBaudRate = 1;
+const quint8 kSetDataSize = 2;
+const quint8 kSetParity = 3;
+const quint8 kSetStopSize = 4;
+const quint8 kSetControl = 5;
+const quint8 kPurgeData = 12;
+
+const quint8 kParityNone = 1;
+const quint8 kStopSize1 = 1;
+const quint8 kControlNoFlowControl = 1;
+const quint8 kControlDTROn = 8;
+const quint8 kControlDTROff = 9;
+const quint8 kControlRTSOn = 11;
+const quint8 kControlRTSOff = 12;
+const quint8 kPurgeReceive = 1;
+
+QByteArray bytes(std::initializer_list<quint8> l) {
+  QByteArray result;
+  for (quint8 b : l) result.append(char(b));
+  return result;
+}
+
+}  // namespace
+
+const char NetSerialPort::kScheme[] = "tcp://";
+
+NetSerialPort::NetSerialPort(const QString &name, QObject *parent)
+    : QIODevice(parent), socket_(new QTcpSocket(this)) {
+  const QUrl url(name);
+  host_ = url.host();
+  port_ = url.port(defaultTelnetPort);
+  telnet_ = !QUrlQuery(url).hasQueryItem("raw");
+  setObjectName(name);
+  connect(socket_, &QTcpSocket::readyRead, this, [this]() {
+    if (processInput()) emit readyRead();
+  });
+}
+
+NetSerialPort::~NetSerialPort() {
+  close();
+}
+
+util::Status NetSerialPort::connectToBridge(qint32 baudRate) {
+  qInfo() << "Connecting to" << host_ << port_ << "telnet?" << telnet_;
+  socket_->connectToHost(host_, port_);
+  if (!socket_->waitForConnected(connectTimeoutMs)) {
+    return QS(util::error::UNAVAILABLE, socket_->errorString());
+  }
+  // Serial protocols are full of small request/response exchanges.
+  socket_->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+  QIODevice::open(QIODevice::ReadWrite);
+  if (!telnet_) {
+    // Bridge is expected to be set up for this speed.
+    if (baudRate > 0) baudRate_ = baudRate;
+    return util::Status::OK;
+  }
+  for (quint8 opt : {kOptBinary, kOptSuppressGoAhead}) {
+    willSent_.append(char(opt));
+    doSent_.append(char(opt));
+    sendTelnet(bytes({IAC, WILL, opt, IAC, DO, opt}));
+  }
+  willSent_.append(char(kOptComPort));
+  sendTelnet(bytes({IAC, WILL, kOptComPort}));
+  QElapsedTimer t;
+  t.start();
+  while (!comPortAnswered_ && t.elapsed() < negotiationTimeoutMs &&
+         socket_->waitForReadyRead(negotiationTimeoutMs - t.elapsed())) {
+    processInput();
+  }
+  if (!comPort_) {
+    qWarning() << objectName() << "does not support RFC 2217, line speed and"
+               << "control lines can not be set";
+    return util::Status::OK;
+  }
+  bool ok = sendComPortCommand(kSetDataSize, bytes({8}));
+  ok = ok && sendComPortCommand(kSetParity, bytes({kParityNone}));
+  ok = ok && sendComPortCommand(kSetStopSize, bytes({kStopSize1}));
+  ok = ok && sendComPortCommand(kSetControl, bytes({kControlNoFlowControl}));
+  ok = ok && (baudRate <= 0 || setBaudRate(baudRate));
+  if (!ok) {
+    return QS(util::error::UNAVAILABLE,
+              tr("failed to set up the line: %1").arg(socket_->errorString()));
+  }
+  return util::Status::OK;
+}
+
+void NetSerialPort::close() {
+  socket_->close();
+  QIODevice::close();
+}
+
+bool NetSerialPort::isSequential() const {
+  return true;
+}
+
+qint64 NetSerialPort::bytesAvailable() const {
+  return rxBuf_.size() + QIODevice::bytesAvailable();
+}
+
+qint64 NetSerialPort::bytesToWrite() const {
+  return socket_->bytesToWrite() + QIODevice::bytesToWrite();
+}
+
+bool NetSerialPort::waitForReadyRead(int msecs) {
+  QElapsedTimer t;
+  t.start();
+  while (true) {
+    processInput();
+    if (!rxBuf_.isEmpty()) return true;
+    const int remaining = msecs < 0 ? -1 : msecs - t.elapsed();
+    if (msecs >= 0 && remaining <= 0) return false;
+    if (!socket_->waitForReadyRead(remaining)) return false;
+  }
+}
+
+bool NetSerialPort::waitForBytesWritten(int msecs) {
+  // Unlike QSerialPort, the socket may have flushed everything already.
+  if (socket_->bytesToWrite() == 0) return true;
+  return socket_->waitForBytesWritten(msecs);
+}
+
+bool NetSerialPort::setDataTerminalReady(bool set) {
+  if (!comPort_) return false;
+  return sendComPortCommand(kSetControl,
+                            bytes({set ? kControlDTROn : kControlDTROff}));
+}
+
+bool NetSerialPort::setRequestToSend(bool set) {
+  if (!comPort_) return false;
+  return sendComPortCommand(kSetControl,
+                            bytes({set ? kControlRTSOn : kControlRTSOff}));
+}
+
+qint32 NetSerialPort::baudRate() const {
+  return baudRate_;
+}
+
+bool NetSerialPort::setBaudRate(qint32 baudRate) {
+  if (!comPort_) return baudRate == baudRate_;
+  QByteArray value;
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    value.append(char((baudRate >> shift) & 0xff));
+  }
+  if (!sendComPortCommand(kSetBaudRate, value)) return false;
+  baudRate_ = baudRate;
+  return true;
+}
+
+bool NetSerialPort::clearInput() {
+  processInput();
+  rxBuf_.clear();
+  if (!comPort_) return true;
+  return sendComPortCommand(kPurgeData, bytes({kPurgeReceive}));
+}
+
+qint64 NetSerialPort::readData(char *data, qint64 maxSize) {
+  processInput();
+  const qint64 n = std::min(maxSize, qint64(rxBuf_.size()));
+  if (n == 0 && socket_->state() != QAbstractSocket::ConnectedState) {
+    return -1;
+  }
+  memcpy(data, rxBuf_.constData(), n);
+  rxBuf_.remove(0, n);
+  return n;
+}
+
+qint64 NetSerialPort::writeData(const char *data, qint64 maxSize) {
+  QByteArray out(data, maxSize);
+  // IAC in the data is sent twice.
+  if (telnet_) out.replace(QByteArray(1, char(IAC)), QByteArray(2, char(IAC)));
+  if (socket_->write(out) != out.length()) return -1;
+  return maxSize;
+}
+
+bool NetSerialPort::processInput() {
+  const QByteArray in = socket_->readAll();
+  const int prevSize = rxBuf_.size();
+  if (!telnet_) {
+    rxBuf_.append(in);
+    return !in.isEmpty();
+  }
+  for (char c : in) {
+    const quint8 b = c;
+    switch (rxState_) {
+      case RxState::Data:
+        if (b == IAC) {
+          rxState_ = RxState::IAC;
+        } else {
+          rxBuf_.append(c);
+        }
+        break;
+      case RxState::IAC:
+        rxState_ = RxState::Data;
+        if (b == IAC) {
+          rxBuf_.append(c);
+        } else if (b == WILL || b == WONT || b == DO || b == DONT) {
+          rxCmd_ = b;
+          rxState_ = RxState::Option;
+        } else if (b == SB) {
+          sb_.clear();
+          rxState_ = RxState::SB;
+        }
+        // Everything else (NOP, GA, etc.) is ignored.
+        break;
+      case RxState::Option:
+        handleOption(rxCmd_, b);
+        rxState_ = RxState::Data;
+        break;
+      case RxState::SB:
+        if (b == IAC) {
+          rxState_ = RxState::SBIAC;
+        } else {
+          sb_.append(c);
+        }
+        break;
+      case RxState::SBIAC:
+        if (b == IAC) {
+          sb_.append(c);
+          rxState_ = RxState::SB;
+        } else {
+          if (b == SE) handleSubnegotiation(sb_);
+          rxState_ = RxState::Data;
+        }
+        break;
+    }
+  }
+  return rxBuf_.size() > prevSize;
+}
+
+void NetSerialPort::handleOption(quint8 cmd, quint8 opt) {
+  const char o = char(opt);
+  switch (cmd) {
+    case WILL:
+      if (opt != kOptBinary && opt != kOptSuppressGoAhead) {
+        sendTelnet(bytes({IAC, DONT, opt}));
+      } else if (!doSent_.contains(o)) {
+        doSent_.append(o);
+        sendTelnet(bytes({IAC, DO, opt}));
+      }
+      break;
+    case DO:
+      if (opt == kOptComPort) {
+        comPort_ = true;
+        comPortAnswered_ = true;
+      }
+      if (opt != kOptBinary && opt != kOptSuppressGoAhead &&
+          opt != kOptComPort) {
+        sendTelnet(bytes({IAC, WONT, opt}));
+      } else if (!willSent_.contains(o)) {
+        willSent_.append(o);
+        sendTelnet(bytes({IAC, WILL, opt}));
+      }
+      break;
+    case DONT:
+      if (opt == kOptComPort) {
+        comPort_ = false;
+        comPortAnswered_ = true;
+      }
+      break;
+    case WONT:
+      break;
+  }
+}
+
+void NetSerialPort::handleSubnegotiation(const QByteArray &sb) {
+  if (sb.length() < 2 || quint8(sb[0]) != kOptComPort) return;
+  // Server tells the speed it has actually set.
+  if (quint8(sb[1]) == kSetBaudRate + 100 && sb.length() >= 6) {
+    qint32 baudRate = 0;
+    for (int i = 2; i < 6; i++) baudRate = (baudRate << 8) | quint8(sb[i]);
+    if (baudRate > 0) baudRate_ = baudRate;
+  }
+}
+
+bool NetSerialPort::sendTelnet(const QByteArray &data) {
+  const bool ok = (socket_->write(data) == data.length());
+  // Control line changes are timing-sensitive, don't wait for the event loop.
+  socket_->flush();
+  return ok;
+}
+
+bool NetSerialPort::sendComPortCommand(quint8 cmd, const QByteArray &value) {
+  QByteArray sb = bytes({IAC, SB, kOptComPort, cmd});
+  QByteArray v = value;
+  sb.append(v.replace(QByteArray(1, char(IAC)), QByteArray(2, char(IAC))));
+  sb.append(bytes({IAC, SE}));
+  return sendTelnet(sb);
+}
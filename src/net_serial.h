@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ */
+
+#ifndef CS_MFT_SRC_NET_SERIAL_H_
+#define CS_MFT_SRC_NET_SERIAL_H_
+
+#include <QByteArray>
+#include <QIODevice>
+#include <QString>
+
+#include <common/util/status.h>
+
+#include "serial.h"
+
+class QTcpSocket;
+
+// Serial port of a network bridge (esp-link, ser2net and the like), reached
+// by TCP. Name is tcp://host:port. By default the connection speaks telnet
+// with the RFC 2217 COM port option, which gives control of line speed and
+// DTR/RTS. With tcp://host:port?raw the connection carries just the data and
+// line speed is whatever the bridge is configured for.
+class NetSerialPort : public QIODevice, public SerialControl {
+  Q_OBJECT
+
+ public:
+  static const char kScheme[];
+
+  explicit NetSerialPort(const QString &name, QObject *parent = nullptr);
+  ~NetSerialPort() override;
+
+  // Connects and sets up the line (8N1, no flow control, given speed).
+  util::Status connectToBridge(qint32 baudRate);
+  void close() override;
+
+  bool isSequential() const override;
+  qint64 bytesAvailable() const override;
+  qint64 bytesToWrite() const override;
+  bool waitForReadyRead(int msecs) override;
+  bool waitForBytesWritten(int msecs) override;
+
+  bool setDataTerminalReady(bool set) override;
+  bool setRequestToSend(bool set) override;
+  qint32 baudRate() const override;
+  bool setBaudRate(qint32 baudRate) override;
+  bool clearInput() override;
+
+ protected:
+  qint64 readData(char *data, qint64 maxSize) override;
+  qint64 writeData(const char *data, qint64 maxSize) override;
+
+ private:
+  // Decodes telnet stream from the socket, appends data to rxBuf_ and
+  // answers option negotiation. Returns true if there is new data.
+  bool processInput();
+  void handleOption(quint8 cmd, quint8 opt);
+  void handleSubnegotiation(const QByteArray &sb);
+  bool sendTelnet(const QByteArray &data);
+  bool sendComPortCommand(quint8 cmd, const QByteArray &value);
+
+  enum class RxState {
+    Data,
+    IAC,
+    Option,  // Got IAC and WILL, WONT, DO or DONT.
+    SB,
+    SBIAC,
+  };
+
+  QString host_;
+  quint16 port_ = 0;
+  bool telnet_ = true;
+  QTcpSocket *socket_;
+
+  QByteArray rxBuf_;
+  RxState rxState_ = RxState::Data;
+  quint8 rxCmd_ = 0;
+  QByteArray sb_;
+  // Options we agreed to, to not answer the same request twice.
+  QByteArray willSent_, doSent_;
+
+  qint32 baudRate_ = 115200;
+  bool comPort_ = false;  // Server accepted the COM port option.
+  bool comPortAnswered_ = false;
+
+  NetSerialPort(const NetSerialPort &other) = delete;
+};
+
+#endif /* CS_MFT_SRC_NET_SERIAL_H_ */
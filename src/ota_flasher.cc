@@ -0,0 +1,245 @@
+#include "ota_flasher.h"
+
+#include <atomic>
+
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QHttpMultiPart>
+#include <QIODevice>
+#include <QNetworkAccessManager>
+#include <QNetworkReply>
+#include <QNetworkRequest>
+#include <QTimer>
+#include <QUrl>
+#include <QVariantList>
+
+#include <common/util/error_codes.h>
+
+#include "fw_client.h"
+#include "status_qt.h"
+
+#if (QT_VERSION < QT_VERSION_CHECK(5, 5, 0))
+#define qInfo qWarning
+#endif
+
+namespace {
+
+// Running firmware answers in a second or so. This is how much longer
+// flashing a device that does not run it (e.g. a blank one) takes.
+const int kProbeTimeoutMs = 3000;
+// The upload is given up if no data moves for this long.
+const int kUploadIdleTimeoutMs = 20000;
+// Endpoint of the firmware's updater, it takes the bundle as a file upload.
+const char kUpdateURL[] = "http://%1/update";
+
+class OTAFlasher : public Flasher {
+  Q_OBJECT
+ public:
+  OTAFlasher(QIODevice *port, std::unique_ptr<Flasher> serial)
+      : port_(port), serial_(serial.release()) {
+    // Owned as a child, so it moves to the thread this one runs on.
+    serial_->setParent(this);
+    // serial runs inside run(), on this thread.
+    connect(serial_, &Flasher::progress, this, &Flasher::progress,
+            Qt::DirectConnection);
+    connect(serial_, &Flasher::progressRate, this, &Flasher::progressRate,
+            Qt::DirectConnection);
+    connect(serial_, &Flasher::statusMessage, this, &Flasher::statusMessage,
+            Qt::DirectConnection);
+    connect(serial_, &Flasher::done, this, &Flasher::done,
+            Qt::DirectConnection);
+    connect(serial_, &Flasher::metrics, this, [this](QVariantMap m) {
+      m["ota_probe_ms"] = probeMs_;
+      emit metrics(m);
+    }, Qt::DirectConnection);
+  }
+
+  util::Status setFirmware(const FirmwareBundle *fw) override {
+    util::Status st = serial_->setFirmware(fw);
+    if (st.ok()) fw_ = fw;
+    return st;
+  }
+
+  int totalBytes() const override {
+    return ota_ ? archiveSize_.load() : serial_->totalBytes();
+  }
+
+  // Nothing is done in advance: preparing serial would reset the device out
+  // of the firmware that is to be asked.
+  void prepare() override {
+  }
+
+  void setBandwidthGate(BandwidthGate *gate) override {
+    Flasher::setBandwidthGate(gate);
+    serial_->setBandwidthGate(gate);
+  }
+
+  void release() override {
+    serial_->release();
+  }
+
+  void run() override {
+    QElapsedTimer timer;
+    timer.start();
+    auto ipr = probeIP();
+    probeMs_ = timer.elapsed();
+    if (!ipr.ok() || ipr.ValueOrDie().isEmpty() || fw_ == nullptr) {
+      qInfo() << "Not updating over the network:"
+              << (ipr.ok() ? "no IP address" : ipr.status().ToString().c_str());
+      serial_->run();
+      return;
+    }
+    const QString ip = ipr.ValueOrDie();
+    QVariantMap m;
+    m["serial_profile"] = "ota";
+    m["ota_probe_ms"] = probeMs_;
+    qint64 uploadMs = 0;
+    util::Status st = upload(ip, &uploadMs);
+    QVariantMap phase;
+    phase["name"] = "upload";
+    phase["ms"] = uploadMs;
+    if (st.ok()) {
+      const qint64 bytes = archiveSize_;
+      phase["bytes"] = bytes;
+      if (uploadMs > 0) phase["bytes_per_sec"] = bytes * 1000 / uploadMs;
+      m["bytes_sent"] = bytes;
+    }
+    m["phases"] = QVariantList{phase};
+    m["total_ms"] = timer.elapsed();
+    flushProgress();
+    emit metrics(m);
+    if (!st.ok()) {
+      emit done(QString::fromStdString(st.ToString()), false);
+      return;
+    }
+    emit done(tr("Firmware uploaded to %1, the device applies it and reboots")
+                  .arg(ip),
+              true);
+  }
+
+  util::Status setOption(const QString &name, const QVariant &value) override {
+    return serial_->setOption(name, value);
+  }
+
+  util::Status setOptionsFromConfig(const Config &config) override {
+    return serial_->setOptionsFromConfig(config);
+  }
+
+ private:
+  // IP address the firmware reports, empty if it is not on the network.
+  util::StatusOr<QString> probeIP() {
+    emit statusMessage(tr("Asking the firmware for its IP address..."), true);
+    FWClient fwc(port_);
+    QEventLoop loop;
+    util::Status st = QS(util::error::DEADLINE_EXCEEDED,
+                         tr("no answer from the firmware"));
+    QString ip;
+    connect(&fwc, &FWClient::connectResult, &loop,
+            [&fwc, &loop, &st](util::Status r) {
+              if (r.ok()) {
+                fwc.doGetIP();
+                return;
+              }
+              st = r;
+              loop.quit();
+            });
+    connect(&fwc, &FWClient::ipAddress, &loop,
+            [&loop, &st, &ip](QString a) {
+              ip = a;
+              st = util::Status::OK;
+              loop.quit();
+            });
+    QTimer::singleShot(kProbeTimeoutMs, &loop, &QEventLoop::quit);
+    fwc.doConnect();
+    loop.exec();
+    if (!st.ok()) return st;
+    return ip;
+  }
+
+  util::Status upload(const QString &ip, qint64 *ms) {
+    auto ar = fw_->archive();
+    if (!ar.ok()) return QSP("failed to read the bundle", ar.status());
+    const QByteArray data = ar.MoveValueOrDie();
+    archiveSize_ = data.length();
+    ota_ = true;
+    const QUrl url(QString(kUpdateURL).arg(ip));
+    emit statusMessage(tr("Uploading %1 bytes to %2...")
+                           .arg(data.length())
+                           .arg(url.toString()),
+                       true);
+
+    QHttpMultiPart *form = new QHttpMultiPart(QHttpMultiPart::FormDataType);
+    QHttpPart file;
+    file.setHeader(QNetworkRequest::ContentDispositionHeader,
+                   "form-data; name=\"file\"; filename=\"fw.zip\"");
+    file.setHeader(QNetworkRequest::ContentTypeHeader, "application/zip");
+    file.setBody(data);
+    form->append(file);
+
+    QElapsedTimer timer;
+    timer.start();
+    startProgress(data.length());
+    QNetworkAccessManager nam;
+    std::unique_ptr<QNetworkReply> reply(nam.post(QNetworkRequest(url), form));
+    form->setParent(reply.get());
+    QEventLoop loop;
+    QTimer idle;
+    idle.setSingleShot(true);
+    idle.setInterval(kUploadIdleTimeoutMs);
+    bool timedOut = false;
+    connect(&idle, &QTimer::timeout, &loop, [&reply, &timedOut]() {
+      timedOut = true;
+      reply->abort();
+    });
+    // Sizes include the form around the file, progress is capped at the file.
+    connect(reply.get(), &QNetworkReply::uploadProgress, &loop,
+            [this, &idle, &data](qint64 sent, qint64 total) {
+              Q_UNUSED(total);
+              idle.start();
+              reportProgress(qMin(sent, qint64(data.length())));
+            });
+    connect(reply.get(), &QNetworkReply::finished, &loop, &QEventLoop::quit);
+    idle.start();
+    loop.exec();
+    *ms = timer.elapsed();
+
+    if (timedOut) {
+      return QS(util::error::DEADLINE_EXCEEDED,
+                tr("no progress uploading to %1 for %2 s")
+                    .arg(url.toString())
+                    .arg(kUploadIdleTimeoutMs / 1000));
+    }
+    const int code =
+        reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    if (reply->error() != QNetworkReply::NoError || code != 200) {
+      return QS(util::error::UNAVAILABLE,
+                tr("update via %1 failed: %2 %3")
+                    .arg(url.toString())
+                    .arg(code > 0 ? QString::number(code) : QString())
+                    .arg(reply->error() != QNetworkReply::NoError
+                             ? reply->errorString()
+                             : QString::fromUtf8(reply->readAll()))
+                    .trimmed());
+    }
+    qInfo() << "Updater says:" << reply->readAll().trimmed();
+    return util::Status::OK;
+  }
+
+  QIODevice *port_;
+  Flasher *serial_;  // Owned, as a child.
+  const FirmwareBundle *fw_ = nullptr;
+  qint64 probeMs_ = 0;
+  // Read by totalBytes() from other threads while run() goes on.
+  std::atomic<bool> ota_{false};
+  std::atomic<int> archiveSize_{0};
+};
+
+}  // namespace
+
+std::unique_ptr<Flasher> newOTAFlasher(QIODevice *port,
+                                       std::unique_ptr<Flasher> serial) {
+  return std::unique_ptr<Flasher>(new OTAFlasher(port, std::move(serial)));
+}
+
+#include "ota_flasher.moc"
@@ -0,0 +1,24 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ */
+
+#ifndef CS_MFT_SRC_OTA_FLASHER_H_
+#define CS_MFT_SRC_OTA_FLASHER_H_
+
+#include <memory>
+
+#include "flasher.h"
+
+class QIODevice;
+
+// Returns a flasher that first asks the firmware running on the device, over
+// its serial console, for its IP address. If the device is on the network,
+// the bundle is uploaded to the firmware's updater over HTTP, which is much
+// faster than the serial port and needs no boot loader. Otherwise, or if the
+// firmware does not answer, serial does the flashing. Options are those of
+// serial, which is taken over.
+std::unique_ptr<Flasher> newOTAFlasher(QIODevice *port,
+                                       std::unique_ptr<Flasher> serial);
+
+#endif /* CS_MFT_SRC_OTA_FLASHER_H_ */
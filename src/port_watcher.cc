@@ -0,0 +1,239 @@
+#include "port_watcher.h"
+
+#include <memory>
+
+#include <QCoreApplication>
+#include <QDebug>
+#include <QSet>
+
+#if defined(Q_OS_LINUX)
+#include <libudev.h>
+#include <QSocketNotifier>
+#elif defined(Q_OS_OSX)
+#include <dispatch/dispatch.h>
+#include <IOKit/IOKitLib.h>
+#include <IOKit/serial/IOSerialKeys.h>
+#elif defined(Q_OS_WIN)
+#include <windows.h>
+#include <dbt.h>
+#endif
+
+namespace {
+
+// Device nodes and their properties may appear a little after the
+// notification, and plugging in a hub produces a burst of them.
+const int kSettleMs = 200;
+const int kPollIntervalMs = 500;
+
+#if defined(Q_OS_LINUX)
+
+struct Notifier {
+  struct udev *udev = nullptr;
+  struct udev_monitor *monitor = nullptr;
+  QSocketNotifier *socketNotifier = nullptr;
+};
+
+#elif defined(Q_OS_OSX)
+
+struct Notifier {
+  IONotificationPortRef port = nullptr;
+  io_iterator_t added = 0;
+  io_iterator_t removed = 0;
+  dispatch_queue_t queue = nullptr;
+};
+
+// Called on the notifier's dispatch queue. Iterators have to be drained for
+// the notification to be armed again.
+void ioKitCallback(void *ctx, io_iterator_t it) {
+  io_object_t obj;
+  while ((obj = IOIteratorNext(it)) != 0) IOObjectRelease(obj);
+  QMetaObject::invokeMethod(static_cast<PortWatcher *>(ctx), "scheduleRescan",
+                            Qt::QueuedConnection);
+}
+
+#endif
+
+}  // namespace
+
+PortWatcher::PortWatcher(QObject *parent) : QObject(parent) {
+  rescanTimer_.setSingleShot(true);
+  rescanTimer_.setInterval(kSettleMs);
+  connect(&rescanTimer_, &QTimer::timeout, this, &PortWatcher::rescan);
+  rescan();
+  if (!startNotifications()) {
+    qDebug() << "No hotplug notifications, polling for ports";
+    connect(&pollTimer_, &QTimer::timeout, this, &PortWatcher::rescan);
+    pollTimer_.start(kPollIntervalMs);
+  }
+}
+
+PortWatcher::~PortWatcher() {
+  stopNotifications();
+}
+
+QList<QSerialPortInfo> PortWatcher::ports() const {
+  return ports_.values();
+}
+
+void PortWatcher::scheduleRescan() {
+  rescanTimer_.start();
+}
+
+void PortWatcher::rescan() {
+  QMap<QString, QSerialPortInfo> ports;
+  for (const auto &info : QSerialPortInfo::availablePorts()) {
+#ifdef Q_OS_MAC
+    if (info.portName().contains("Bluetooth")) continue;
+#endif
+    ports.insert(info.systemLocation(), info);
+  }
+  const QSet<QString> old = QSet<QString>::fromList(ports_.keys());
+  const QSet<QString> cur = QSet<QString>::fromList(ports.keys());
+  ports_ = ports;
+  if (old == cur) return;
+  for (const QString &loc : old - cur) {
+    qDebug() << "Port removed:" << loc;
+    emit portRemoved(loc);
+  }
+  for (const QString &loc : cur - old) {
+    qDebug() << "Port added:" << loc;
+    emit portAdded(ports[loc]);
+  }
+  emit changed();
+}
+
+#if defined(Q_OS_LINUX)
+
+bool PortWatcher::startNotifications() {
+  std::unique_ptr<Notifier> n(new Notifier);
+  n->udev = udev_new();
+  if (n->udev == nullptr) return false;
+  n->monitor = udev_monitor_new_from_netlink(n->udev, "udev");
+  if (n->monitor == nullptr ||
+      udev_monitor_filter_add_match_subsystem_devtype(n->monitor, "tty",
+                                                      nullptr) < 0 ||
+      udev_monitor_enable_receiving(n->monitor) < 0) {
+    if (n->monitor != nullptr) udev_monitor_unref(n->monitor);
+    udev_unref(n->udev);
+    return false;
+  }
+  struct udev_monitor *monitor = n->monitor;
+  n->socketNotifier = new QSocketNotifier(udev_monitor_get_fd(monitor),
+                                          QSocketNotifier::Read, this);
+  connect(n->socketNotifier, &QSocketNotifier::activated, [this, monitor]() {
+    struct udev_device *dev = udev_monitor_receive_device(monitor);
+    if (dev != nullptr) udev_device_unref(dev);
+    scheduleRescan();
+  });
+  notifier_ = n.release();
+  return true;
+}
+
+void PortWatcher::stopNotifications() {
+  Notifier *n = static_cast<Notifier *>(notifier_);
+  if (n == nullptr) return;
+  delete n->socketNotifier;
+  udev_monitor_unref(n->monitor);
+  udev_unref(n->udev);
+  delete n;
+  notifier_ = nullptr;
+}
+
+#elif defined(Q_OS_OSX)
+
+bool PortWatcher::startNotifications() {
+  std::unique_ptr<Notifier> n(new Notifier);
+  n->port = IONotificationPortCreate(kIOMasterPortDefault);
+  if (n->port == nullptr) return false;
+  // A queue of its own, so this does not depend on the event dispatcher
+  // running a CFRunLoop.
+  n->queue = dispatch_queue_create("PortWatcher", DISPATCH_QUEUE_SERIAL);
+  IONotificationPortSetDispatchQueue(n->port, n->queue);
+  // Each call consumes a reference to the matching dictionary.
+  kern_return_t r1 = IOServiceAddMatchingNotification(
+      n->port, kIOFirstMatchNotification,
+      IOServiceMatching(kIOSerialBSDServiceValue), ioKitCallback, this,
+      &n->added);
+  kern_return_t r2 = IOServiceAddMatchingNotification(
+      n->port, kIOTerminatedNotification,
+      IOServiceMatching(kIOSerialBSDServiceValue), ioKitCallback, this,
+      &n->removed);
+  notifier_ = n.release();
+  if (r1 != KERN_SUCCESS || r2 != KERN_SUCCESS) {
+    stopNotifications();
+    return false;
+  }
+  // Drain the ports that are already there to arm the notifications, on the
+  // queue so it does not race with the callbacks.
+  Notifier *np = static_cast<Notifier *>(notifier_);
+  dispatch_sync_f(np->queue, np, [](void *ctx) {
+    Notifier *np = static_cast<Notifier *>(ctx);
+    io_object_t obj;
+    while ((obj = IOIteratorNext(np->added)) != 0) IOObjectRelease(obj);
+    while ((obj = IOIteratorNext(np->removed)) != 0) IOObjectRelease(obj);
+  });
+  return true;
+}
+
+void PortWatcher::stopNotifications() {
+  Notifier *n = static_cast<Notifier *>(notifier_);
+  if (n == nullptr) return;
+  IONotificationPortDestroy(n->port);
+  // Wait for callbacks that may be running.
+  dispatch_sync_f(n->queue, nullptr, [](void *) {});
+  if (n->added != 0) IOObjectRelease(n->added);
+  if (n->removed != 0) IOObjectRelease(n->removed);
+  dispatch_release(n->queue);
+  delete n;
+  notifier_ = nullptr;
+}
+
+#elif defined(Q_OS_WIN)
+
+bool PortWatcher::startNotifications() {
+  // WM_DEVICECHANGE is broadcast to top-level windows, there are none in the
+  // CLI.
+  if (!QCoreApplication::instance()->inherits("QGuiApplication")) {
+    return false;
+  }
+  QCoreApplication::instance()->installNativeEventFilter(this);
+  notifier_ = this;
+  return true;
+}
+
+void PortWatcher::stopNotifications() {
+  if (notifier_ == nullptr) return;
+  QCoreApplication::instance()->removeNativeEventFilter(this);
+  notifier_ = nullptr;
+}
+
+#else
+
+bool PortWatcher::startNotifications() {
+  return false;
+}
+
+void PortWatcher::stopNotifications() {
+}
+
+#endif
+
+bool PortWatcher::nativeEventFilter(const QByteArray &eventType,
+                                    void *message, long *result) {
+  Q_UNUSED(result);
+#ifdef Q_OS_WIN
+  if (eventType == "windows_generic_MSG") {
+    const MSG *msg = static_cast<const MSG *>(message);
+    if (msg->message == WM_DEVICECHANGE &&
+        (msg->wParam == DBT_DEVICEARRIVAL ||
+         msg->wParam == DBT_DEVICEREMOVECOMPLETE ||
+         msg->wParam == DBT_DEVNODES_CHANGED)) {
+      scheduleRescan();
+    }
+  }
+#else
+  Q_UNUSED(eventType);
+  Q_UNUSED(message);
+#endif
+  return false;
+}
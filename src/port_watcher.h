@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ */
+
+#ifndef CS_MFT_SRC_PORT_WATCHER_H_
+#define CS_MFT_SRC_PORT_WATCHER_H_
+
+#include <QAbstractNativeEventFilter>
+#include <QList>
+#include <QMap>
+#include <QObject>
+#include <QSerialPortInfo>
+#include <QString>
+#include <QTimer>
+
+// Keeps track of serial ports that are present. Ports are enumerated when
+// the system reports a device being added or removed: udev on Linux, IOKit
+// on OS X, WM_DEVICECHANGE on Windows (GUI only, it needs a window to be
+// delivered to). Elsewhere ports are polled.
+class PortWatcher : public QObject, public QAbstractNativeEventFilter {
+  Q_OBJECT
+
+ public:
+  explicit PortWatcher(QObject *parent = nullptr);
+  ~PortWatcher() override;
+
+  // Ports currently present. Bluetooth ports on OS X are left out.
+  QList<QSerialPortInfo> ports() const;
+
+  bool nativeEventFilter(const QByteArray &eventType, void *message,
+                         long *result) override;
+
+ signals:
+  void portAdded(const QSerialPortInfo &info);
+  void portRemoved(const QString &systemLocation);
+  // After portAdded and portRemoved for a batch of changes.
+  void changed();
+
+ public slots:
+  // Enumerates ports shortly, letting a burst of notifications settle.
+  void scheduleRescan();
+
+ private slots:
+  void rescan();
+
+ private:
+  // Returns false if there is nothing to get notifications from.
+  bool startNotifications();
+  void stopNotifications();
+
+  QMap<QString, QSerialPortInfo> ports_;  // By system location.
+  QTimer rescanTimer_;
+  QTimer pollTimer_;  // Only used if there are no notifications.
+  void *notifier_ = nullptr;  // Platform-specific state.
+};
+
+#endif /* CS_MFT_SRC_PORT_WATCHER_H_ */
@@ -0,0 +1,61 @@
+#include "progress_meter.h"
+
+namespace {
+
+// Weight of a new measurement in the average rate.
+const double kRateSampleWeight = 0.2;
+
+}  // namespace
+
+void ProgressMeter::start(int total) {
+  timer_.start();
+  total_ = total;
+  bytes_ = 0;
+  lastReportMs_ = 0;
+  lastReportBytes_ = 0;
+  bytesPerSec_ = 0;
+}
+
+bool ProgressMeter::update(int bytes) {
+  if (!timer_.isValid()) timer_.start();
+  bytes_ = bytes;
+  const qint64 now = timer_.elapsed();
+  const qint64 sinceReport = now - lastReportMs_;
+  if (sinceReport < kIntervalMs && bytes < total_) return false;
+  report(now);
+  return true;
+}
+
+bool ProgressMeter::flush() {
+  if (bytes_ == lastReportBytes_) return false;
+  report(timer_.elapsed());
+  return true;
+}
+
+void ProgressMeter::report(qint64 now) {
+  const qint64 sinceReport = now - lastReportMs_;
+  // Progress may go back when a flasher moves on to another pass.
+  if (bytes_ > lastReportBytes_ && sinceReport > 0) {
+    const double sample =
+        double(bytes_ - lastReportBytes_) * 1000 / sinceReport;
+    bytesPerSec_ = (bytesPerSec_ == 0 ? sample
+                                      : bytesPerSec_ * (1 - kRateSampleWeight) +
+                                            sample * kRateSampleWeight);
+  }
+  lastReportMs_ = now;
+  lastReportBytes_ = bytes_;
+}
+
+int ProgressMeter::bytes() const {
+  return bytes_;
+}
+
+int ProgressMeter::bytesPerSec() const {
+  return bytesPerSec_;
+}
+
+int ProgressMeter::etaMs() const {
+  if (bytesPerSec_ <= 0 || total_ <= 0) return -1;
+  if (bytes_ >= total_) return 0;
+  return (total_ - bytes_) * 1000.0 / bytesPerSec_;
+}
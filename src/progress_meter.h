@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ */
+
+#ifndef CS_MFT_SRC_PROGRESS_METER_H_
+#define CS_MFT_SRC_PROGRESS_METER_H_
+
+#include <QElapsedTimer>
+
+// Coalesces progress updates of a flasher. Flasher clients report every
+// acknowledged block, thousands of times a second at high baud rates, and
+// each report would be a queued event for the thread that shows it. update
+// says when a report is due, at most kIntervalMs apart, and keeps track of
+// the transfer rate for the expected time to go. Used on the flasher's
+// thread only.
+class ProgressMeter {
+ public:
+  static const int kIntervalMs = 50;  // 20 Hz.
+
+  // Starts over, with the total the progress is going to get to.
+  void start(int total);
+  // Takes the current progress. Returns true if it's time to report it:
+  // the interval has passed, or the total has been reached.
+  bool update(int bytes);
+  // Returns true if there is progress that update held back. It counts as
+  // reported after that.
+  bool flush();
+
+  int bytes() const;
+  // Smoothed over the last few updates, 0 until there is a measurement.
+  int bytesPerSec() const;
+  // Time to reach the total at the current rate, -1 if not known.
+  int etaMs() const;
+
+ private:
+  void report(qint64 now);
+
+  QElapsedTimer timer_;
+  int total_ = 0;
+  int bytes_ = 0;
+  qint64 lastReportMs_ = 0;
+  int lastReportBytes_ = 0;
+  double bytesPerSec_ = 0;
+};
+
+#endif /* CS_MFT_SRC_PROGRESS_METER_H_ */
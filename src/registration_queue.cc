@@ -0,0 +1,132 @@
+#include "registration_queue.h"
+
+#include <QDebug>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QNetworkReply>
+#include <QNetworkRequest>
+#include <QTimer>
+#include <QUrl>
+#include <QUrlQuery>
+
+#include <common/util/error_codes.h>
+
+#include "status_qt.h"
+
+#if (QT_VERSION < QT_VERSION_CHECK(5, 5, 0))
+#define qInfo qWarning
+#endif
+
+namespace {
+
+// Requests in flight at once. The server handles one device per request,
+// this keeps a few round trips overlapping on reused connections.
+const int kMaxInFlight = 4;
+// A request that takes longer than this fails, the device can be added again.
+const int kRequestTimeoutMs = 30000;
+
+}  // namespace
+
+RegistrationQueue::RegistrationQueue(const QString &url, QObject *parent)
+    : QObject(parent), url_(url) {
+}
+
+RegistrationQueue::~RegistrationQueue() {
+  if (!pending_.isEmpty()) {
+    qWarning() << pending_.size() << "devices were not registered:"
+               << pending_.values();
+  }
+}
+
+void RegistrationQueue::add(const Device &dev) {
+  if (pending_.contains(dev.mac) || registered_.contains(dev.mac)) return;
+  qInfo() << "Queueing registration of" << dev.arch << dev.mac << dev.fwBuild;
+  pending_.insert(dev.mac);
+  queue_.append(dev);
+  sendMore();
+}
+
+util::StatusOr<RegistrationQueue::Credentials> RegistrationQueue::credentials(
+    const QString &mac) const {
+  auto it = registered_.constFind(mac);
+  if (it == registered_.constEnd()) {
+    return QS(util::error::NOT_FOUND, tr("%1 is not registered").arg(mac));
+  }
+  return *it;
+}
+
+int RegistrationQueue::pending() const {
+  return pending_.size();
+}
+
+// static
+util::StatusOr<RegistrationQueue::Credentials>
+RegistrationQueue::parseResponse(const QByteArray &response) {
+  QJsonParseError err;
+  const QJsonDocument doc = QJsonDocument::fromJson(response, &err);
+  const QJsonObject o = doc.object();
+  if (err.error == QJsonParseError::NoError &&
+      o["device_id"].toString() != "" && o["device_psk"].toString() != "") {
+    Credentials c;
+    c.id = o["device_id"].toString();
+    c.psk = o["device_psk"].toString();
+    return c;
+  }
+  if (err.error == QJsonParseError::NoError && o["error"].isString()) {
+    return QS(util::error::UNAVAILABLE, o["error"].toString());
+  }
+  return QS(util::error::UNAVAILABLE,
+            tr("Invalid response: %1").arg(QString(response)));
+}
+
+void RegistrationQueue::sendMore() {
+  while (!queue_.isEmpty() && inFlight_ < kMaxInFlight) {
+    const Device dev = queue_.takeFirst();
+    QNetworkRequest req(url_);
+    req.setHeader(QNetworkRequest::ContentTypeHeader,
+                  "application/x-www-form-urlencoded");
+    QUrlQuery q;
+    q.addQueryItem("arch", dev.arch);
+    q.addQueryItem("mac", dev.mac);
+    q.addQueryItem("fw", dev.fwBuild);
+    qDebug() << "Registering" << dev.mac << "at" << url_;
+    QNetworkReply *reply =
+        nam_.post(req, q.query(QUrl::FullyEncoded).toUtf8());
+    inFlight_++;
+    connect(reply, &QNetworkReply::finished, this,
+            [this, reply, dev]() { requestFinished(reply, dev); });
+    QTimer::singleShot(kRequestTimeoutMs, reply, [reply]() {
+      reply->setProperty("timed_out", true);
+      reply->abort();
+    });
+  }
+}
+
+void RegistrationQueue::requestFinished(QNetworkReply *reply,
+                                        const Device &dev) {
+  const int code =
+      reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+  const QByteArray response = reply->readAll();
+  qDebug() << "Registration of" << dev.mac << "finished:" << code << response;
+  reply->deleteLater();
+  inFlight_--;
+  pending_.remove(dev.mac);
+  auto cr = parseResponse(response);
+  if (reply->property("timed_out").toBool()) {
+    cr = QS(util::error::DEADLINE_EXCEEDED, tr("Request timed out"));
+  } else if (reply->error() != QNetworkReply::NoError && response.isEmpty()) {
+    cr = QS(util::error::UNAVAILABLE, reply->errorString());
+  }
+  // Following requests go out before handlers run, they may take a while.
+  sendMore();
+  if (cr.ok()) {
+    const Credentials c = cr.ValueOrDie();
+    registered_[dev.mac] = c;
+    qInfo() << "Registered" << dev.mac << "as" << c.id;
+    emit registered(dev.mac, c.id, c.psk);
+  } else {
+    qCritical() << "Failed to register" << dev.mac << ":" << cr.status();
+    emit failed(dev.mac, cr.status());
+  }
+  if (pending_.isEmpty()) emit idle();
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ */
+
+#ifndef CS_MFT_SRC_REGISTRATION_QUEUE_H_
+#define CS_MFT_SRC_REGISTRATION_QUEUE_H_
+
+#include <QByteArray>
+#include <QList>
+#include <QMap>
+#include <QNetworkAccessManager>
+#include <QObject>
+#include <QSet>
+#include <QString>
+
+#include <common/util/status.h>
+#include <common/util/statusor.h>
+
+class QNetworkReply;
+
+// Registers flashed devices with the cloud in the background, so nobody has
+// to wait for the round trip with the device still plugged in. Devices are
+// sent as they are added, a few requests at a time over the same connection,
+// the rest wait in the queue. Requests that get no response in time fail.
+// Lives on the thread that creates it.
+class RegistrationQueue : public QObject {
+  Q_OBJECT
+
+ public:
+  struct Device {
+    QString arch;
+    QString mac;
+    QString fwBuild;
+  };
+
+  struct Credentials {
+    QString id;
+    QString psk;
+  };
+
+  // url is where devices are POSTed to, e.g. <frontend>/register_device.
+  explicit RegistrationQueue(const QString &url, QObject *parent = nullptr);
+  ~RegistrationQueue() override;
+
+  // Does nothing if the device is already queued, being registered or
+  // registered. Devices that failed to register can be added again.
+  void add(const Device &dev);
+
+  // NOT_FOUND unless the device has been registered.
+  util::StatusOr<Credentials> credentials(const QString &mac) const;
+
+  // Devices queued or being registered.
+  int pending() const;
+
+  // What the server returns for a device: a JSON object with device_id and
+  // device_psk, or error.
+  static util::StatusOr<Credentials> parseResponse(const QByteArray &response);
+
+signals:
+  void registered(QString mac, QString id, QString psk);
+  void failed(QString mac, util::Status error);
+  // Emitted when the last pending device is done.
+  void idle();
+
+ private:
+  void sendMore();
+  void requestFinished(QNetworkReply *reply, const Device &dev);
+
+  const QString url_;
+  QNetworkAccessManager nam_;
+  QList<Device> queue_;
+  QSet<QString> pending_;  // MACs queued and in flight.
+  QMap<QString, Credentials> registered_;
+  int inFlight_ = 0;
+};
+
+#endif /* CS_MFT_SRC_REGISTRATION_QUEUE_H_ */
@@ -5,20 +5,89 @@
 #include <sys/ioctl.h>
 #include <IOKit/serial/ioss.h>
 #endif
+#ifdef Q_OS_LINUX
+// Not <termios.h>, its struct termios is not the one TCGETS2 works with.
+#include <asm/termbits.h>
+#include <linux/serial.h>
+#include <sys/ioctl.h>
+#endif
 
 #include <QCoreApplication>
 #include <QDebug>
+#include <QFile>
 #include <QSerialPort>
+#include <QVariant>
 
 #include <common/util/error_codes.h>
 #include <common/util/status.h>
 
+#include "net_serial.h"
+#include "serial_trace.h"
 #include "status_qt.h"
 
 #if (QT_VERSION < QT_VERSION_CHECK(5, 5, 0))
 #define qInfo qWarning
 #endif
 
+#ifdef Q_OS_LINUX
+namespace {
+
+// Sets any rate the driver can do, including ones that have no Bnnn
+// constant, which QSerialPort can only set through the deprecated
+// ASYNC_SPD_CUST that many drivers do not support.
+bool setCustomSpeed(int fd, int speed) {
+  struct termios2 tio;
+  if (ioctl(fd, TCGETS2, &tio) < 0) return false;
+  tio.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+  tio.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+  tio.c_ispeed = speed;
+  tio.c_ospeed = speed;
+  return ioctl(fd, TCSETS2, &tio) == 0;
+}
+
+// Sets the latency timer in sysfs, for drivers that have one. Returns the
+// value in effect afterwards, -1 if there is no such setting.
+int setLatencyTimer(const QString &name, int ms) {
+  QFile f(QString("/sys/bus/usb-serial/devices/%1/latency_timer").arg(name));
+  if (!f.open(QIODevice::ReadOnly)) return -1;
+  bool ok;
+  int latency = f.readAll().trimmed().toInt(&ok);
+  f.close();
+  if (!ok) return -1;
+  if (latency != ms) {
+    // Usually only writable by root, unless udev rules say otherwise.
+    const QByteArray value = QByteArray::number(ms);
+    if (f.open(QIODevice::WriteOnly) && f.write(value) == value.size() &&
+        f.flush()) {
+      latency = ms;
+    } else {
+      qDebug() << "Cannot change latency timer of" << name;
+    }
+  }
+  return latency;
+}
+
+// USB serial adapters hold received data for up to the latency timer (16 ms
+// by default for FTDI) before passing it on, which adds up for protocols
+// that wait for a short reply to every command. Asks the driver to deliver
+// data right away and, for drivers that have it, lowers the latency timer.
+// Returns the effective latency timer value in milliseconds, -1 if the
+// driver does not have one.
+int setLowLatency(int fd, const QString &name) {
+  struct serial_struct ss;
+  if (ioctl(fd, TIOCGSERIAL, &ss) == 0 &&
+      (ss.flags & ASYNC_LOW_LATENCY) == 0) {
+    ss.flags |= ASYNC_LOW_LATENCY;
+    if (ioctl(fd, TIOCSSERIAL, &ss) < 0) {
+      qDebug() << name << "does not support ASYNC_LOW_LATENCY";
+    }
+  }
+  return setLatencyTimer(name, 1);
+}
+
+}  // namespace
+#endif
+
 util::StatusOr<QSerialPortInfo> findSerial(const QString &systemLocation) {
   for (const auto &port : QSerialPortInfo::availablePorts()) {
     if (port.systemLocation() == systemLocation) {
@@ -30,9 +99,13 @@ util::StatusOr<QSerialPortInfo> findSerial(const QString &systemLocation) {
             QObject::tr("No such port (%1)").arg(systemLocation));
 }
 
-util::StatusOr<QSerialPort *> connectSerial(const QSerialPortInfo &port,
-                                            int speed) {
-  std::unique_ptr<QSerialPort> s(new QSerialPort(port));
+namespace {
+
+// Rate set behind QSerialPort's back, which it does not know about.
+const char kCustomBaudRateProperty[] = "custom_baud_rate";
+
+util::StatusOr<QSerialPort *> openSerial(std::unique_ptr<QSerialPort> s,
+                                         int speed) {
   if (!s->setParity(QSerialPort::NoParity)) {
     return util::Status(
         util::error::INTERNAL,
@@ -47,9 +120,15 @@ util::StatusOr<QSerialPort *> connectSerial(const QSerialPortInfo &port,
   }
   if (!s->open(QIODevice::ReadWrite)) {
     return QS(util::error::INTERNAL, QObject::tr("Failed to open %1: %2")
-                                         .arg(port.portName())
+                                         .arg(s->portName())
                                          .arg(s->errorString()));
   }
+#ifdef Q_OS_LINUX
+  const int latency = setLowLatency(s->handle(), s->portName());
+  if (latency >= 0) {
+    qInfo() << s->portName() << "latency timer:" << latency << "ms";
+  }
+#endif
   auto st = setSpeed(s.get(), speed);
   if (!st.ok()) {
     return st;
@@ -57,28 +136,129 @@ util::StatusOr<QSerialPort *> connectSerial(const QSerialPortInfo &port,
   return s.release();
 }
 
-util::Status setSpeed(QSerialPort *port, int speed) {
-  qInfo() << "Setting" << port->portName() << "speed to" << speed;
-  if (!port->setBaudRate(speed)) {
+}  // namespace
+
+util::StatusOr<QSerialPort *> connectSerial(const QSerialPortInfo &port,
+                                            int speed) {
+  return openSerial(std::unique_ptr<QSerialPort>(new QSerialPort(port)),
+                    speed);
+}
+
+util::Status setSpeed(QIODevice *port, int speed) {
+  qInfo() << "Setting" << portName(port) << "speed to" << speed;
+  QSerialPort *sp = qobject_cast<QSerialPort *>(port);
+  SerialControl *sc = dynamic_cast<SerialControl *>(port);
+  bool ok = sp != nullptr ? sp->setBaudRate(speed)
+                         : (sc != nullptr && sc->setBaudRate(speed));
+  if (ok && sp != nullptr) sp->setProperty(kCustomBaudRateProperty, QVariant());
+#ifdef Q_OS_LINUX
+  // QSerialPort keeps reporting the previous rate in this case, so baudRate()
+  // reports the one recorded here instead.
+  if (!ok && sp != nullptr && setCustomSpeed(sp->handle(), speed)) {
+    qDebug() << "Set custom speed" << speed << "with TCSETS2";
+    sp->clearError();
+    sp->setProperty(kCustomBaudRateProperty, speed);
+    ok = true;
+  }
+#endif
+  if (!ok) {
     return util::Status(
         util::error::INTERNAL,
         QCoreApplication::translate("setSpeed", "Failed to set baud rate")
             .toStdString());
   }
 #ifdef Q_OS_OSX
-  if (ioctl(port->handle(), IOSSIOSPEED, &speed) < 0) {
+  if (sp != nullptr && ioctl(sp->handle(), IOSSIOSPEED, &speed) < 0) {
     return util::Status(
         util::error::INTERNAL,
         QCoreApplication::translate(
             "setSpeed", "Failed to set baud rate with ioctl").toStdString());
   }
 #endif
+  SerialTrace::recordControl(port, SerialTrace::Event::BaudRate, speed);
   return util::Status::OK;
 }
 
+int setLatencyTimer(QIODevice *port, int ms) {
+#ifdef Q_OS_LINUX
+  QSerialPort *sp = qobject_cast<QSerialPort *>(port);
+  if (sp != nullptr) return setLatencyTimer(sp->portName(), ms);
+#else
+  Q_UNUSED(port);
+  Q_UNUSED(ms);
+#endif
+  return -1;
+}
+
+qint32 baudRate(QIODevice *port) {
+  QSerialPort *sp = qobject_cast<QSerialPort *>(port);
+  if (sp != nullptr) {
+    const QVariant custom = sp->property(kCustomBaudRateProperty);
+    return custom.isValid() ? custom.toInt() : sp->baudRate();
+  }
+  SerialControl *sc = dynamic_cast<SerialControl *>(port);
+  return sc != nullptr ? sc->baudRate() : 0;
+}
+
+bool setDataTerminalReady(QIODevice *port, bool set) {
+  QSerialPort *sp = qobject_cast<QSerialPort *>(port);
+  SerialControl *sc = dynamic_cast<SerialControl *>(port);
+  const bool ok =
+      sp != nullptr ? sp->setDataTerminalReady(set)
+                    : (sc != nullptr && sc->setDataTerminalReady(set));
+  if (ok) {
+    SerialTrace::recordControl(port, SerialTrace::Event::DataTerminalReady,
+                               set);
+  }
+  return ok;
+}
+
+bool setRequestToSend(QIODevice *port, bool set) {
+  QSerialPort *sp = qobject_cast<QSerialPort *>(port);
+  SerialControl *sc = dynamic_cast<SerialControl *>(port);
+  const bool ok = sp != nullptr ? sp->setRequestToSend(set)
+                                : (sc != nullptr && sc->setRequestToSend(set));
+  if (ok) {
+    SerialTrace::recordControl(port, SerialTrace::Event::RequestToSend, set);
+  }
+  return ok;
+}
+
+void clearInput(QIODevice *port) {
+  QSerialPort *sp = qobject_cast<QSerialPort *>(port);
+  SerialControl *sc = dynamic_cast<SerialControl *>(port);
+  if (sp != nullptr) {
+    sp->clear(QSerialPort::Input);
+  } else if (sc != nullptr) {
+    sc->clearInput();
+  }
+  const QByteArray dropped = port->readAll();
+  SerialTrace::recordRead(port, dropped.constData(), dropped.length());
+}
+
+QString portName(QIODevice *port) {
+  QSerialPort *sp = qobject_cast<QSerialPort *>(port);
+  return sp != nullptr ? sp->portName() : port->objectName();
+}
+
+util::StatusOr<QIODevice *> openPort(const QString &name, int speed) {
+  if (name.startsWith(NetSerialPort::kScheme)) {
+    std::unique_ptr<NetSerialPort> p(new NetSerialPort(name));
+    util::Status st = p->connectToBridge(speed);
+    if (!st.ok()) {
+      return QSP(QObject::tr("failed to connect to %1").arg(name), st);
+    }
+    return p.release();
+  }
+  auto sp = connectSerial(name, speed);
+  if (!sp.ok()) return sp.status();
+  return sp.ValueOrDie();
+}
+
+// The port is opened by name: enumerating all of them to find its info takes
+// longer than opening it, and does so again for every device.
 util::StatusOr<QSerialPort *> connectSerial(const QString &systemLocation,
                                             int speed) {
-  const auto qspi = findSerial(systemLocation);
-  if (!qspi.ok()) return qspi.status();
-  return connectSerial(qspi.ValueOrDie(), speed);
+  return openSerial(
+      std::unique_ptr<QSerialPort>(new QSerialPort(systemLocation)), speed);
 }
@@ -7,11 +7,31 @@
 #define CS_MFT_SRC_SERIAL_H_
 
 #include <QSerialPortInfo>
+#include <QString>
 
 #include <common/util/statusor.h>
 
+class QIODevice;
 class QSerialPort;
 
+// Control lines and line speed of a serial link whose data goes through a
+// QIODevice. QSerialPort is handled directly, other devices (e.g. network
+// bridges) may implement this. Setters return false if not supported.
+class SerialControl {
+ public:
+  virtual ~SerialControl() {
+  }
+  virtual bool setDataTerminalReady(bool set) = 0;
+  virtual bool setRequestToSend(bool set) = 0;
+  virtual qint32 baudRate() const = 0;
+  virtual bool setBaudRate(qint32 baudRate) = 0;
+  // Drops data that has been received but not read yet, including any that
+  // is still buffered on the other end of the link.
+  virtual bool clearInput() = 0;
+};
+
+// Enumerates all the ports, prefer connectSerial by name if only the port
+// itself is needed.
 util::StatusOr<QSerialPortInfo> findSerial(const QString &systemLocation);
 
 util::StatusOr<QSerialPort *> connectSerial(const QSerialPortInfo &port,
@@ -19,6 +39,23 @@ util::StatusOr<QSerialPort *> connectSerial(const QSerialPortInfo &port,
 util::StatusOr<QSerialPort *> connectSerial(const QString &systemLocation,
                                             int speed = 115200);
 
-util::Status setSpeed(QSerialPort *port, int speed);
+// Opens either a local serial port or, for tcp://host:port, a network
+// connection to a serial bridge (see NetSerialPort).
+util::StatusOr<QIODevice *> openPort(const QString &name, int speed = 115200);
+
+// These work with QSerialPort and devices that implement SerialControl, and
+// fail (or return 0) for others.
+util::Status setSpeed(QIODevice *port, int speed);
+// Sets the latency timer of a USB serial adapter whose driver has one, only
+// on Linux for now. Returns the value in effect afterwards, -1 if unknown.
+int setLatencyTimer(QIODevice *port, int ms);
+qint32 baudRate(QIODevice *port);
+bool setDataTerminalReady(QIODevice *port, bool set);
+bool setRequestToSend(QIODevice *port, bool set);
+// Falls back to reading everything available.
+void clearInput(QIODevice *port);
+
+// Name to use in messages and settings.
+QString portName(QIODevice *port);
 
 #endif /* CS_MFT_SRC_SERIAL_H_ */
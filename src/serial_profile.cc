@@ -0,0 +1,128 @@
+#include "serial_profile.h"
+
+#include <QSerialPort>
+#include <QStringList>
+
+#include "status_qt.h"
+
+namespace {
+
+struct BuiltinProfile {
+  const char *name;
+  quint16 vendorID, productID;
+  qint32 flashBaudRate, maxBaudRate;
+  quint32 writeWindow, readBlockSize, readMaxInFlight;
+  int latencyTimerMs;
+};
+
+// Rates and buffer sizes known to work reliably with ESP8266 boards that
+// use these bridges.
+const BuiltinProfile kProfiles[] = {
+    // CP2102, CP2104 and CP2102N share the IDs, the oldest does 921600.
+    {"CP210x", 0x10c4, 0xea60, 921600, 921600, 0, 0, 0, -1},
+    // 32 byte FIFO, loses data at high rates without flow control.
+    {"CH340", 0x1a86, 0x7523, 460800, 921600, 2048, 1024, 4096, -1},
+    {"FT232R", 0x0403, 0x6001, 921600, 3000000, 0, 4096, 4 * 4096, 1},
+    {"FT2232", 0x0403, 0x6010, 921600, 3000000, 0, 4096, 4 * 4096, 1},
+    {"FT231X", 0x0403, 0x6015, 921600, 3000000, 0, 4096, 4 * 4096, 1},
+};
+
+bool parseValue(const QString &s, quint32 *value) {
+  bool ok;
+  *value = s.toUInt(&ok, 0);
+  return ok;
+}
+
+}  // namespace
+
+QString SerialProfile::toString() const {
+  return QString("%1 (%2:%3)")
+      .arg(name)
+      .arg(vendorID, 4, 16, QChar('0'))
+      .arg(productID, 4, 16, QChar('0'));
+}
+
+util::StatusOr<QList<SerialProfile>> parseSerialProfiles(const QString &spec) {
+  QList<SerialProfile> result;
+  for (const QString &entry : spec.split(';', QString::SkipEmptyParts)) {
+    const QStringList parts = entry.simplified().split(' ');
+    const QStringList ids = parts[0].split(':');
+    bool ok1 = false, ok2 = false;
+    SerialProfile p;
+    p.name = "custom";
+    if (ids.size() == 2) {
+      p.vendorID = ids[0].toUShort(&ok1, 16);
+      p.productID = ids[1].toUShort(&ok2, 16);
+    }
+    if (!ok1 || !ok2) {
+      return QS(util::error::INVALID_ARGUMENT,
+                QObject::tr("invalid USB IDs: %1").arg(parts[0]));
+    }
+    for (int i = 1; i < parts.size(); i++) {
+      const int eq = parts[i].indexOf('=');
+      const QString key = parts[i].left(eq);
+      quint32 value = 0;
+      bool ok = eq > 0 && parseValue(parts[i].mid(eq + 1), &value);
+      if (ok && key == "baud") {
+        p.flashBaudRate = value;
+      } else if (ok && key == "max-baud") {
+        p.maxBaudRate = value;
+      } else if (ok && key == "window") {
+        p.writeWindow = value;
+      } else if (ok && key == "read-block") {
+        p.readBlockSize = value;
+      } else if (ok && key == "read-in-flight") {
+        p.readMaxInFlight = value;
+      } else if (ok && key == "latency") {
+        p.latencyTimerMs = value;
+      } else {
+        return QS(util::error::INVALID_ARGUMENT,
+                  QObject::tr("invalid setting for %1: %2")
+                      .arg(parts[0])
+                      .arg(parts[i]));
+      }
+    }
+    result << p;
+  }
+  return result;
+}
+
+SerialProfile serialProfile(quint16 vendorID, quint16 productID,
+                            const QList<SerialProfile> &overrides) {
+  SerialProfile r;
+  r.vendorID = vendorID;
+  r.productID = productID;
+  for (const BuiltinProfile &p : kProfiles) {
+    if (p.vendorID != vendorID || p.productID != productID) continue;
+    r.name = p.name;
+    r.flashBaudRate = p.flashBaudRate;
+    r.maxBaudRate = p.maxBaudRate;
+    r.writeWindow = p.writeWindow;
+    r.readBlockSize = p.readBlockSize;
+    r.readMaxInFlight = p.readMaxInFlight;
+    r.latencyTimerMs = p.latencyTimerMs;
+  }
+  for (const SerialProfile &o : overrides) {
+    if (o.vendorID != vendorID || o.productID != productID) continue;
+    r.name += "+" + o.name;
+    if (o.flashBaudRate > 0) r.flashBaudRate = o.flashBaudRate;
+    if (o.maxBaudRate > 0) r.maxBaudRate = o.maxBaudRate;
+    if (o.writeWindow > 0) r.writeWindow = o.writeWindow;
+    if (o.readBlockSize > 0) r.readBlockSize = o.readBlockSize;
+    if (o.readMaxInFlight > 0) r.readMaxInFlight = o.readMaxInFlight;
+    if (o.latencyTimerMs >= 0) r.latencyTimerMs = o.latencyTimerMs;
+  }
+  return r;
+}
+
+SerialProfile serialProfile(QIODevice *port,
+                            const QList<SerialProfile> &overrides) {
+  QSerialPort *sp = qobject_cast<QSerialPort *>(port);
+  if (sp == nullptr) return SerialProfile();
+  const QSerialPortInfo info(*sp);
+  if (!info.hasVendorIdentifier() || !info.hasProductIdentifier()) {
+    return SerialProfile();
+  }
+  return serialProfile(info.vendorIdentifier(), info.productIdentifier(),
+                       overrides);
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ */
+
+#ifndef CS_MFT_SRC_SERIAL_PROFILE_H_
+#define CS_MFT_SRC_SERIAL_PROFILE_H_
+
+#include <QList>
+#include <QSerialPortInfo>
+#include <QString>
+
+#include <common/util/statusor.h>
+
+class QIODevice;
+
+// Link settings that suit a USB serial bridge chip. Zero (or -1 for the
+// latency timer) means that the flasher's own default is used.
+struct SerialProfile {
+  QString name = "generic";
+  quint16 vendorID = 0;
+  quint16 productID = 0;
+  qint32 flashBaudRate = 0;  // Used unless a rate is set explicitly.
+  qint32 maxBaudRate = 0;    // Rate negotiation does not go above this.
+  quint32 writeWindow = 0;   // Cap on unacknowledged write data.
+  quint32 readBlockSize = 0;
+  quint32 readMaxInFlight = 0;
+  int latencyTimerMs = -1;
+
+  QString toString() const;
+};
+
+// Parses profile overrides: entries separated by ';', each of them the USB
+// vendor and product IDs in hex and settings to change, e.g.
+// "1a86:7523 baud=460800 max-baud=921600 window=2048 read-block=1024
+// read-in-flight=4096 latency=2". Settings not given are taken from the
+// built-in profile for the device.
+util::StatusOr<QList<SerialProfile>> parseSerialProfiles(const QString &spec);
+
+// Profile for the adapter with the given IDs: the built-in one, with
+// overrides applied.
+SerialProfile serialProfile(quint16 vendorID, quint16 productID,
+                            const QList<SerialProfile> &overrides = {});
+// Same, for the adapter behind a port. Ports other than local USB serial
+// ports get the generic profile.
+SerialProfile serialProfile(QIODevice *port,
+                            const QList<SerialProfile> &overrides = {});
+
+#endif /* CS_MFT_SRC_SERIAL_PROFILE_H_ */
@@ -0,0 +1,185 @@
+#include "serial_trace.h"
+
+#include <atomic>
+#include <memory>
+
+#include <QElapsedTimer>
+#include <QFile>
+#include <QHash>
+#include <QIODevice>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QObject>
+
+#include <common/util/error_codes.h>
+
+#include "serial.h"
+#include "status_qt.h"
+
+namespace SerialTrace {
+
+namespace {
+
+const char kMagic[] = "MFTTRACE";
+const int kMagicLen = sizeof(kMagic) - 1;
+const quint8 kVersion = 1;
+// Records are collected in memory and written out in chunks of this size,
+// to keep file writes away from the timing being recorded.
+const int kFlushSize = 64 * 1024;
+
+void appendVarint(QByteArray *buf, quint64 v) {
+  do {
+    quint8 b = v & 0x7f;
+    v >>= 7;
+    if (v != 0) b |= 0x80;
+    buf->append(char(b));
+  } while (v != 0);
+}
+
+bool readVarint(const QByteArray &buf, int *pos, quint64 *v) {
+  *v = 0;
+  for (int shift = 0; *pos < buf.length() && shift < 64; shift += 7) {
+    const quint8 b = buf[(*pos)++];
+    *v |= quint64(b & 0x7f) << shift;
+    if ((b & 0x80) == 0) return true;
+  }
+  return false;
+}
+
+struct Tracer {
+  QFile file;
+  QElapsedTimer timer;
+  qint64 lastUs = 0;
+  QByteArray buf;
+
+  void flush() {
+    file.write(buf);
+    buf.clear();
+  }
+};
+
+QMutex tracersLock;
+QHash<QIODevice *, Tracer *> tracers;
+// Checked before taking the lock, so untraced ports pay next to nothing.
+std::atomic<int> numTracers{0};
+
+void record(QIODevice *port, Event event, const char *data, qint64 len,
+            quint32 value) {
+  if (numTracers.load() == 0) return;
+  QMutexLocker lock(&tracersLock);
+  Tracer *t = tracers.value(port);
+  if (t == nullptr) return;
+  const qint64 us = t->timer.nsecsElapsed() / 1000;
+  t->buf.append(char(event));
+  appendVarint(&t->buf, us - t->lastUs);
+  t->lastUs = us;
+  if (data != nullptr) {
+    appendVarint(&t->buf, len);
+    t->buf.append(data, len);
+  } else {
+    appendVarint(&t->buf, value);
+  }
+  if (t->buf.length() >= kFlushSize) t->flush();
+}
+
+}  // namespace
+
+util::Status start(QIODevice *port, const QString &fileName) {
+  std::unique_ptr<Tracer> t(new Tracer);
+  t->file.setFileName(fileName);
+  if (!t->file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+    return QS(util::error::UNAVAILABLE,
+              QObject::tr("failed to open %1: %2")
+                  .arg(fileName)
+                  .arg(t->file.errorString()));
+  }
+  t->buf.append(kMagic, kMagicLen);
+  t->buf.append(char(kVersion));
+  const QByteArray name = portName(port).toUtf8();
+  appendVarint(&t->buf, name.length());
+  t->buf.append(name);
+  stop(port);
+  QObject::connect(port, &QObject::destroyed, [port]() { stop(port); });
+  QMutexLocker lock(&tracersLock);
+  t->timer.start();
+  tracers[port] = t.release();
+  numTracers++;
+  return util::Status::OK;
+}
+
+void stop(QIODevice *port) {
+  QMutexLocker lock(&tracersLock);
+  Tracer *t = tracers.take(port);
+  if (t == nullptr) return;
+  numTracers--;
+  t->flush();
+  delete t;
+}
+
+void recordWrite(QIODevice *port, const char *data, qint64 len) {
+  if (len > 0) record(port, Event::Write, data, len, 0);
+}
+
+void recordRead(QIODevice *port, const char *data, qint64 len) {
+  if (len > 0) record(port, Event::Read, data, len, 0);
+}
+
+void recordControl(QIODevice *port, Event event, quint32 value) {
+  record(port, event, nullptr, 0, value);
+}
+
+util::StatusOr<Trace> load(const QString &fileName) {
+  QFile f(fileName);
+  if (!f.open(QIODevice::ReadOnly)) {
+    return QS(util::error::UNAVAILABLE, QObject::tr("failed to open %1: %2")
+                                            .arg(fileName)
+                                            .arg(f.errorString()));
+  }
+  const QByteArray buf = f.readAll();
+  const util::Status corrupt =
+      QS(util::error::DATA_LOSS, QObject::tr("%1 is not a valid trace")
+                                     .arg(fileName));
+  if (buf.length() < kMagicLen + 1 || !buf.startsWith(kMagic) ||
+      quint8(buf[kMagicLen]) != kVersion) {
+    return corrupt;
+  }
+  int pos = kMagicLen + 1;
+  quint64 len;
+  if (!readVarint(buf, &pos, &len) || len > quint64(buf.length() - pos)) {
+    return corrupt;
+  }
+  Trace trace;
+  trace.portName = QString::fromUtf8(buf.mid(pos, len));
+  pos += len;
+  qint64 us = 0;
+  while (pos < buf.length()) {
+    Record r;
+    r.event = Event(buf[pos++]);
+    quint64 delta, v;
+    if (!readVarint(buf, &pos, &delta) || !readVarint(buf, &pos, &v)) {
+      return corrupt;
+    }
+    us += delta;
+    r.us = us;
+    switch (r.event) {
+      case Event::Write:
+      case Event::Read:
+        if (v > quint64(buf.length() - pos)) return corrupt;
+        r.data = buf.mid(pos, v);
+        pos += v;
+        break;
+      case Event::DataTerminalReady:
+      case Event::RequestToSend:
+      case Event::Break:
+      case Event::BaudRate:
+        r.value = v;
+        break;
+      default:
+        return corrupt;
+    }
+    trace.records.append(r);
+  }
+  return trace;
+}
+
+}  // namespace SerialTrace
@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ */
+
+#ifndef CS_MFT_SRC_SERIAL_TRACE_H_
+#define CS_MFT_SRC_SERIAL_TRACE_H_
+
+#include <QByteArray>
+#include <QString>
+#include <QVector>
+
+#include <common/util/status.h>
+#include <common/util/statusor.h>
+
+class QIODevice;
+
+// Timestamped record of the traffic on a serial port (see --trace-serial),
+// for finding where time goes in the flashing protocols. The I/O helpers of
+// the protocols (SLIP, the CC3200 framing, serial.h) report what they write
+// and read, recording functions do nothing for ports that are not traced.
+//
+// File format: "MFTTRACE", a version byte, the port name and then records,
+// each of them an event byte, microseconds since the previous record and the
+// data (Write, Read) or value (others). Numbers and lengths are unsigned
+// LEB128 varints.
+namespace SerialTrace {
+
+enum class Event {
+  Write = 1,
+  Read = 2,
+  DataTerminalReady = 3,  // Value is the new state of the line.
+  RequestToSend = 4,
+  Break = 5,
+  BaudRate = 6,  // Value is the new rate.
+};
+
+struct Record {
+  Event event;
+  qint64 us;  // Since the start of the trace.
+  QByteArray data;
+  quint32 value = 0;
+};
+
+struct Trace {
+  QString portName;
+  QVector<Record> records;
+};
+
+// Starts recording traffic of the port to a file. Recording stops when the
+// port is destroyed, or with stop().
+util::Status start(QIODevice *port, const QString &fileName);
+void stop(QIODevice *port);
+
+void recordWrite(QIODevice *port, const char *data, qint64 len);
+void recordRead(QIODevice *port, const char *data, qint64 len);
+void recordControl(QIODevice *port, Event event, quint32 value);
+
+util::StatusOr<Trace> load(const QString &fileName);
+
+}  // namespace SerialTrace
+
+#endif /* CS_MFT_SRC_SERIAL_TRACE_H_ */
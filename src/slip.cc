@@ -1,102 +1,186 @@
 #include "slip.h"
 
 #include <QDebug>
+#include <QHash>
+#include <QMutex>
+#include <QMutexLocker>
 
+#include "log.h"
+#include "serial.h"
+#include "serial_trace.h"
 #include "status_qt.h"
 
 namespace SLIP {
 
+namespace {
+
 // https://tools.ietf.org/html/rfc1055
 const unsigned char SLIPFrameDelimiter = 0xC0;
 const unsigned char SLIPEscape = 0xDB;
 const unsigned char SLIPEscapeFrameDelimiter = 0xDC;
 const unsigned char SLIPEscapeEscape = 0xDD;
 
-util::Status send(QSerialPort *port, const QByteArray &data, int timeoutMs) {
-  const QString prefix = QString("SLIP::send(%1, %2, %3):")
-                             .arg(port->portName())
-                             .arg(data.length())
-                             .arg(timeoutMs);
-  qDebug() << prefix << "=>" << data.toHex();
-  bool ok = port->putChar(SLIPFrameDelimiter);
-  for (int i = 0; ok && i < data.length(); i++) {
-    switch ((unsigned char) data[i]) {
+// Frames can be large, only log the beginning.
+const int kMaxLoggedBytes = 32;
+
+QByteArray forLog(const QByteArray &data) {
+  if (data.length() <= kMaxLoggedBytes) return data.toHex();
+  return data.left(kMaxLoggedBytes).toHex() + "...";
+}
+
+// Kept for as long as the port is there, so the buffers are not allocated
+// for every frame. A port is only used by one thread at a time, the lock
+// only guards the map.
+struct Codec {
+  Encoder enc;
+  Decoder dec;
+};
+
+QMutex codecsLock;
+QHash<QIODevice *, Codec *> codecs;
+
+Codec *codecFor(QIODevice *port) {
+  QMutexLocker lock(&codecsLock);
+  Codec *&c = codecs[port];
+  if (c == nullptr) {
+    c = new Codec;
+    QObject::connect(port, &QObject::destroyed, [port]() {
+      QMutexLocker lock(&codecsLock);
+      delete codecs.take(port);
+    });
+  }
+  return c;
+}
+
+}  // namespace
+
+const QByteArray &Encoder::encode(const QByteArray &data) {
+  buf_.resize(data.length() * 2 + 2);
+  char *p = buf_.data();
+  *p++ = SLIPFrameDelimiter;
+  for (const char c : data) {
+    switch ((unsigned char) c) {
       case SLIPFrameDelimiter:
-        ok = ok && port->putChar(SLIPEscape);
-        ok = ok && port->putChar(SLIPEscapeFrameDelimiter);
+        *p++ = SLIPEscape;
+        *p++ = SLIPEscapeFrameDelimiter;
         break;
       case SLIPEscape:
-        ok = ok && port->putChar(SLIPEscape);
-        ok = ok && port->putChar(SLIPEscapeEscape);
+        *p++ = SLIPEscape;
+        *p++ = SLIPEscapeEscape;
         break;
       default:
-        ok = ok && port->putChar(data[i]);
+        *p++ = c;
         break;
     }
   }
-  ok = ok && port->putChar(SLIPFrameDelimiter);
+  *p++ = SLIPFrameDelimiter;
+  buf_.resize(p - buf_.data());
+  return buf_;
+}
+
+int Decoder::feed(const char *data, int len, bool stopAfterFrame) {
+  int i = 0;
+  while (i < len) {
+    const unsigned char c = data[i++];
+    switch (state_) {
+      case State::Idle:
+        if (c == SLIPFrameDelimiter) state_ = State::Frame;
+        break;
+      case State::Frame:
+        if (c == SLIPFrameDelimiter) {
+          frames_.enqueue(frame_);
+          frame_.clear();
+          state_ = State::Idle;
+          if (stopAfterFrame) return i;
+        } else if (c == SLIPEscape) {
+          state_ = State::Escape;
+        } else {
+          frame_.append(c);
+        }
+        break;
+      case State::Escape:
+        if (c == SLIPEscapeFrameDelimiter) {
+          frame_.append(SLIPFrameDelimiter);
+          state_ = State::Frame;
+        } else if (c == SLIPEscapeEscape) {
+          frame_.append(SLIPEscape);
+          state_ = State::Frame;
+        } else {
+          status_ = QS(util::error::UNAVAILABLE,
+                       QObject::tr("invalid escape sequence: %1").arg(int(c)));
+          frame_.clear();
+          state_ = State::Idle;
+          return i;
+        }
+        break;
+    }
+  }
+  return i;
+}
+
+bool Decoder::hasFrame() const {
+  return !frames_.isEmpty();
+}
+
+QByteArray Decoder::takeFrame() {
+  return frames_.dequeue();
+}
+
+util::Status Decoder::status() const {
+  return status_;
+}
+
+void Decoder::reset() {
+  state_ = State::Idle;
+  frame_.clear();
+  frames_.clear();
+  status_ = util::Status::OK;
+}
+
+util::Status send(QIODevice *port, const QByteArray &data, int timeoutMs) {
+  // Only formatted for debug output and errors, send is called per frame.
+  const auto prefix = [port, &data, timeoutMs]() {
+    return QString("SLIP::send(%1, %2, %3):")
+        .arg(portName(port))
+        .arg(data.length())
+        .arg(timeoutMs);
+  };
+  qCDebug(Log::proto) << prefix() << "=>" << forLog(data);
+  const QByteArray &frame = codecFor(port)->enc.encode(data);
+  const qint64 written = port->write(frame);
+  SerialTrace::recordWrite(port, frame.constData(), written);
+  bool ok = (written == frame.length());
   ok = ok && port->waitForBytesWritten(timeoutMs);
   if (!ok) {
-    return QS(util::error::UNAVAILABLE, prefix + " " + port->errorString());
+    return QS(util::error::UNAVAILABLE, prefix() + " " + port->errorString());
   }
   return util::Status::OK;
 }
 
-util::StatusOr<QByteArray> recv(QSerialPort *port, int timeoutMs) {
-  const QString prefix =
-      QString("SLIP::recv(%1, %2): ").arg(port->portName()).arg(timeoutMs);
-  QByteArray ret;
-  char c = 0;
-  // Skip everything before the frame start.
-  do {
-    if (port->bytesAvailable() == 0 && !port->waitForReadyRead(timeoutMs)) {
-      return QS(util::error::UNAVAILABLE,
-                prefix + "no data 1: " + port->errorString());
-    }
-    if (!port->getChar(&c)) {
-      return QS(util::error::UNAVAILABLE,
-                prefix + "failed to read prefix: " + port->errorString());
-    }
-  } while ((unsigned char) c != SLIPFrameDelimiter);
-  for (;;) {
+util::StatusOr<QByteArray> recv(QIODevice *port, int timeoutMs) {
+  const auto prefix = [port, timeoutMs]() {
+    return QString("SLIP::recv(%1, %2): ").arg(portName(port)).arg(timeoutMs);
+  };
+  Decoder &dec = codecFor(port)->dec;
+  // A frame cut short by an earlier timeout or error is not continued.
+  dec.reset();
+  QByteArray chunk;
+  while (!dec.hasFrame()) {
     if (port->bytesAvailable() == 0 && !port->waitForReadyRead(timeoutMs)) {
       return QS(util::error::UNAVAILABLE,
-                prefix + "no data 2: " + port->errorString());
-    }
-    if (!port->getChar(&c)) {
-      return QS(util::error::UNAVAILABLE, prefix + "failed to read next char");
-    }
-    switch ((unsigned char) c) {
-      case SLIPFrameDelimiter:
-        // End of frame.
-        qDebug() << prefix << "<=" << ret.toHex();
-        return ret;
-      case SLIPEscape:
-        if (port->bytesAvailable() == 0 && !port->waitForReadyRead(timeoutMs)) {
-          return QS(util::error::UNAVAILABLE,
-                    prefix + "no data 3: " + port->errorString());
-        }
-        if (!port->getChar(&c)) {
-          return QS(util::error::UNAVAILABLE,
-                    prefix + "failed to read next char");
-        }
-        switch ((unsigned char) c) {
-          case SLIPEscapeFrameDelimiter:
-            ret.append(SLIPFrameDelimiter);
-            break;
-          case SLIPEscapeEscape:
-            ret.append(SLIPEscape);
-            break;
-          default:
-            return QS(util::error::UNAVAILABLE,
-                      prefix + "invalid escape sequence: " + int(c));
-        }
-        break;
-      default:
-        ret.append(c);
-        break;
+                prefix() + "no data: " + port->errorString());
     }
+    // Only consume input up to the end of the frame, the rest belongs to the
+    // next one.
+    chunk = port->peek(port->bytesAvailable());
+    const int n = dec.feed(chunk.constData(), chunk.length(), true);
+    port->read(chunk.data(), n);
+    SerialTrace::recordRead(port, chunk.constData(), n);
+    if (!dec.status().ok()) return QSP(prefix(), dec.status());
   }
+  QByteArray frame = dec.takeFrame();
+  qCDebug(Log::proto) << prefix() << "<=" << frame.length() << forLog(frame);
+  return frame;
 }
 
 }  // namespace SLIP
@@ -6,15 +6,56 @@
 #ifndef CS_MFT_SRC_SLIP_H_
 #define CS_MFT_SRC_SLIP_H_
 
-#include <QSerialPort>
 #include <QByteArray>
+#include <QIODevice>
+#include <QQueue>
 
 #include <common/util/statusor.h>
 
 namespace SLIP {
 
-util::StatusOr<QByteArray> recv(QSerialPort *in, int timeout = 500);
-util::Status send(QSerialPort *out, const QByteArray &bytes,
+// Encoder produces SLIP frames. Output buffer is reused between calls.
+class Encoder {
+ public:
+  // Returns the encoded frame, valid until the next call.
+  const QByteArray &encode(const QByteArray &data);
+
+ private:
+  QByteArray buf_;
+};
+
+// Decoder consumes input in arbitrary chunks and produces complete frames.
+class Decoder {
+ public:
+  // Consumes bytes from data. If stopAfterFrame is set, stops right after the
+  // end of the first complete frame. Also stops on a decoding error.
+  // Returns the number of bytes consumed.
+  int feed(const char *data, int len, bool stopAfterFrame = false);
+
+  bool hasFrame() const;
+  QByteArray takeFrame();
+
+  // Non-OK if an invalid escape sequence was encountered. The offending frame
+  // is dropped.
+  util::Status status() const;
+
+  void reset();
+
+ private:
+  enum class State {
+    Idle,  // Outside of a frame, skipping everything until a delimiter.
+    Frame,
+    Escape,
+  };
+
+  State state_ = State::Idle;
+  QByteArray frame_;
+  QQueue<QByteArray> frames_;
+  util::Status status_;
+};
+
+util::StatusOr<QByteArray> recv(QIODevice *in, int timeout = 500);
+util::Status send(QIODevice *out, const QByteArray &bytes,
                   int timeoutMs = 500);
 
 }  // namespace SLIP
@@ -28,6 +28,14 @@ typedef uint16_t u16_t;
 typedef int8_t s8_t;
 typedef uint8_t u8_t;
 
+// Images are handled in memory, the cache saves lookup page scans rather than
+// flash reads, and the extra RAM is of no concern on the host.
+#define SPIFFS_CACHE 1
+#define SPIFFS_CACHE_WR 1
+#define SPIFFS_CACHE_STATS 1
+// Lookups of free pages and of object ids scan whole multi-megabyte images.
+#define SPIFFS_LU_SCAN_WORDS 1
+
 #include "spiffs_config_common.h"
 
 #endif /* CS_MFT_SRC_SPIFFS_CONFIG_H_ */
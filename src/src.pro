@@ -1,7 +1,7 @@
 TEMPLATE = app
 TARGET = "MFT"
 INCLUDEPATH += .
-QT += serialport network
+QT += concurrent serialport network
 CONFIG += c++11
 
 CONFIG(asan) {
@@ -29,43 +29,84 @@ QMAKE_MACOSX_DEPLOYMENT_TARGET = 10.9
 
 HEADERS += \
   app_init.h \
+  bandwidth_scheduler.h \
   cc3200.h \
   cli.h \
   config.h \
+  crc32.h \
+  console_log.h \
   esp8266.h \
+  esp_erase_model.h \
+  esp_flash_cache.h \
+  esp_flash_index.h \
+  esp_flash_journal.h \
   esp_flasher_client.h \
   esp_rom_client.h \
   file_downloader.h \
+  flash_server.h \
+  flash_span.h \
   flasher.h \
   fs.h \
   fw_bundle.h \
+  fw_delta.h \
   fw_client.h \
+  latency_histogram.h \
   log.h \
+  metrics_registry.h \
+  net_serial.h \
+  ota_flasher.h \
+  port_watcher.h \
+  progress_meter.h \
   prompter.h \
+  registration_queue.h \
   serial.h \
+  serial_profile.h \
+  serial_trace.h \
   sigsource.h \
   slip.h \
-  status_qt.h
+  status_qt.h \
+  worker_pool.h
 
 SOURCES += \
   app_init.cc \
+  bandwidth_scheduler.cc \
   build_info.cc \
   cc3200.cc \
   cli.cc \
   config.cc \
+  crc32.cc \
+  console_log.cc \
   esp8266.cc \
+  esp_erase_model.cc \
+  esp_flash_cache.cc \
+  esp_flash_index.cc \
+  esp_flash_journal.cc \
   esp_flasher_client.cc \
   esp_rom_client.cc \
   file_downloader.cc \
+  flash_server.cc \
+  flash_span.cc \
   flasher.cc \
   fs.cc \
   fw_bundle.cc \
   fw_bundle_zip.cc \
+  fw_delta.cc \
   fw_client.cc \
+  hal.cc \
+  latency_histogram.cc \
   log.cc \
+  metrics_registry.cc \
+  net_serial.cc \
+  ota_flasher.cc \
+  port_watcher.cc \
+  progress_meter.cc \
+  registration_queue.cc \
   serial.cc \
+  serial_profile.cc \
+  serial_trace.cc \
   slip.cc \
-  status_qt.cc
+  status_qt.cc \
+  worker_pool.cc
 
 CONFIG(cli) {
   QT -= gui
@@ -76,6 +117,9 @@ CONFIG(cli) {
   HEADERS += about_dialog.h dialog.h gui_prompter.h log_viewer.h settings.h progress_widget/progress_widget.h wizard/wizard.h
   SOURCES += about_dialog.cc dialog.cc gui_prompter.cc log_viewer.cc main.cc settings.cc progress_widget/progress_widget.cc wizard/wizard.cc
   INCLUDEPATH += progress_widget
+  # Only the GUI uses these, the CLI does not have to register them on start.
+  RESOURCES += images.qrc wizard/wizard.qrc
+  FORMS = main.ui about.ui log_viewer.ui settings.ui wizard/wizard.ui
 }
 
 CONFIG(static):CONFIG(unix) {
@@ -125,8 +169,12 @@ unix {
   SOURCES += sigsource_dummy.cc
 }
 
-RESOURCES = blobs.qrc images.qrc wizard/wizard.qrc
-FORMS = main.ui about.ui log_viewer.ui settings.ui wizard/wizard.ui
+RESOURCES += blobs.qrc
+# Built along with the flasher stub (make embed in the stubs directory).
+# Without it the flasher is uploaded through the ROM.
+exists(esp8266/stub_loader.json) {
+  RESOURCES += stub_loader.qrc
+}
 
 # libftdi stuff.
 macx {
@@ -142,6 +190,14 @@ win32 {
   DEFINES += NO_LIBFTDI
 }
 
+# Hotplug notifications for PortWatcher.
+linux {
+  LIBS += -ludev
+}
+macx {
+  LIBS += -framework IOKit
+}
+
 macx {
   QMAKE_INFO_PLIST = Info.plist.in
   ICON = images/mg_iot.icns
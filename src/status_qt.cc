@@ -1,6 +1,6 @@
 #include "status_qt.h"
 
-#include <QString>
+#include <QtGlobal>
 
 QDebug operator<<(QDebug d, const util::Status &s) {
   return d << QString::fromStdString(s.ToString());
@@ -14,3 +14,37 @@ util::Status QSP(const QString &msg, util::Status s) {
   return QS(s.error_code(),
             msg + ": " + QString::fromStdString(s.error_message()));
 }
+
+LazyPrefix &LazyPrefix::arg(qint64 v, int base) {
+  Q_ASSERT(numArgs_ < kMaxArgs);
+  args_[numArgs_++] = {v, base, nullptr};
+  return *this;
+}
+
+LazyPrefix &LazyPrefix::arg(const char *s) {
+  Q_ASSERT(numArgs_ < kMaxArgs);
+  args_[numArgs_++] = {0, 10, s};
+  return *this;
+}
+
+QString LazyPrefix::toString() const {
+  QString r = QString::fromLatin1(format_);
+  for (int i = 0; i < numArgs_; i++) {
+    const Arg &a = args_[i];
+    r = a.s != nullptr ? r.arg(QString::fromLatin1(a.s))
+                       : r.arg(a.v, 0, a.base);
+  }
+  return r;
+}
+
+QString operator+(const LazyPrefix &p, const QString &s) {
+  return p.toString() + s;
+}
+
+QString operator+(const LazyPrefix &p, const char *s) {
+  return p.toString() + QString::fromLatin1(s);
+}
+
+QDebug operator<<(QDebug d, const LazyPrefix &p) {
+  return d << p.toString();
+}
@@ -7,6 +7,7 @@
 #define CS_MFT_SRC_STATUS_QT_H_
 
 #include <QDebug>
+#include <QString>
 
 #include <common/util/status.h>
 
@@ -15,4 +16,35 @@ QDebug operator<<(QDebug d, const util::Status &s);
 util::Status QS(util::error::Code code, const QString &msg);
 util::Status QSP(const QString &msg, util::Status s);
 
+// Context for the messages of a call, e.g. "read(0x1000, 4096): ". Keeps the
+// format and the arguments and only formats them when the text is used, to
+// build an error status or in a log message, so calls that succeed do not
+// pay for it. Format and string arguments must be literals.
+class LazyPrefix {
+ public:
+  explicit LazyPrefix(const char *format) : format_(format) {
+  }
+
+  LazyPrefix &arg(qint64 v, int base = 10);
+  LazyPrefix &arg(const char *s);
+
+  QString toString() const;
+
+ private:
+  static const int kMaxArgs = 4;
+  struct Arg {
+    qint64 v;
+    int base;
+    const char *s;  // Used instead of v if set.
+  };
+
+  const char *format_;
+  Arg args_[kMaxArgs];
+  int numArgs_ = 0;
+};
+
+QString operator+(const LazyPrefix &p, const QString &s);
+QString operator+(const LazyPrefix &p, const char *s);
+QDebug operator<<(QDebug d, const LazyPrefix &p);
+
 #endif /* CS_MFT_SRC_STATUS_QT_H_ */
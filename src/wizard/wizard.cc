@@ -26,9 +26,6 @@
 #define qInfo qWarning
 #endif
 
-// From build_info.cc (auto-generated).
-extern const char *build_id;
-
 namespace {
 
 const char kReleaseInfoFile[] = ":/releases.json";
@@ -48,6 +45,8 @@ const char kFwBuildVar[] = "fw_id";
 
 const char kCloudServerAddressOption[] = "cloud-server-address";
 const char kCloudFrontendUrlOption[] = "cloud-frontend-url";
+const char kFWChunkSizeOption[] = "fw-console-chunk-size";
+const char kFWEchoTimeoutOption[] = "fw-console-echo-timeout";
 const char kCloudDeviceRegistrationPath[] = "/register_device";
 const char kCloudDeviceClaimPath[] = "/claim";
 
@@ -73,6 +72,16 @@ void WizardDialog::addOptions(Config *config) {
   opts.append(QCommandLineOption(kCloudFrontendUrlOption,
                                  "URL of the cloud frontend", "URL",
                                  "https://console.mongoose-iot.com"));
+  opts.append(QCommandLineOption(
+      kFWChunkSizeOption,
+      "Size of the chunks commands are sent to the firmware in. No more than "
+      "two chunks are sent ahead of the echo from the device.",
+      "bytes", "64"));
+  opts.append(QCommandLineOption(
+      kFWEchoTimeoutOption,
+      "If the firmware does not echo a chunk back within this time, the next "
+      "one is sent anyway.",
+      "ms", "100"));
   config->addOptions(opts);
 }
 
@@ -90,9 +99,10 @@ WizardDialog::WizardDialog(Config *config, QWidget *parent)
   connect(ui_.prevBtn, &QPushButton::clicked, this, &WizardDialog::prevStep);
   connect(ui_.nextBtn, &QPushButton::clicked, this, &WizardDialog::nextStep);
 
-  portRefreshTimer_.start(1);
-  connect(&portRefreshTimer_, &QTimer::timeout, this,
+  portWatcher_ = new PortWatcher(this);
+  connect(portWatcher_, &PortWatcher::changed, this,
           &WizardDialog::updatePortList);
+  QTimer::singleShot(0, this, &WizardDialog::updatePortList);
 
   connect(ui_.platformSelector, &QComboBox::currentTextChanged, this,
           &WizardDialog::updateFirmwareSelector);
@@ -107,6 +117,8 @@ WizardDialog::WizardDialog(Config *config, QWidget *parent)
 
   connect(ui_.s5_claimBtn, &QPushButton::clicked, this,
           &WizardDialog::claimBtnClicked);
+  connect(ui_.s4_newID, &QRadioButton::toggled, this,
+          &WizardDialog::preregisterDevice);
 
   connect(ui_.aboutLink, &QLabel::linkActivated, this,
           &WizardDialog::showAboutBox);
@@ -114,6 +126,13 @@ WizardDialog::WizardDialog(Config *config, QWidget *parent)
   connect(ui_.logLink, &QLabel::linkActivated, this,
           &WizardDialog::showLogViewer);
 
+  registrations_.reset(new RegistrationQueue(
+      config_->value(kCloudFrontendUrlOption) + kCloudDeviceRegistrationPath));
+  connect(registrations_.get(), &RegistrationQueue::registered, this,
+          &WizardDialog::deviceRegistered);
+  connect(registrations_.get(), &RegistrationQueue::failed, this,
+          &WizardDialog::deviceRegistrationFailed);
+
   QTimer::singleShot(10, this, &WizardDialog::currentStepChanged);
   QTimer::singleShot(10, this, &WizardDialog::updateReleaseInfo);
 }
@@ -215,9 +234,11 @@ void WizardDialog::nextStep() {
     }
     case Step::WiFiConnect: {
       ni = Step::CloudRegistration;
-      fwc_->setConfValue(kWiFiStaEnableKey, true);
-      fwc_->setConfValue(kWiFiStaSsidKey, wifiName_);
-      fwc_->setConfValue(kWiFiStaPassKey, wifiPass_);
+      QJsonObject values;
+      values[kWiFiStaEnableKey] = true;
+      values[kWiFiStaSsidKey] = wifiName_;
+      values[kWiFiStaPassKey] = wifiPass_;
+      fwc_->setConfValues(values);
       fwc_->doGetConfig();
       break;
     }
@@ -239,11 +260,13 @@ void WizardDialog::nextStep() {
     }
     case Step::CloudConnect: {
       ni = Step::ClaimDevice;
-      fwc_->setConfValue(kClubbyConnectOnBootKey, true);
-      fwc_->setConfValue(kClubbyServerAddressKey,
-                         config_->value(kCloudServerAddressOption));
-      fwc_->setConfValue(kClubbyDeviceIdKey, cloudId_);
-      fwc_->setConfValue(kClubbyDevicePskKey, cloudKey_);
+      QJsonObject values;
+      values[kClubbyConnectOnBootKey] = true;
+      values[kClubbyServerAddressKey] =
+          config_->value(kCloudServerAddressOption);
+      values[kClubbyDeviceIdKey] = cloudId_;
+      values[kClubbyDevicePskKey] = cloudKey_;
+      fwc_->setConfValues(values);
       fwc_->doGetConfig();
       break;
     }
@@ -269,6 +292,7 @@ void WizardDialog::currentStepChanged() {
         settings_.value("wizard/selectedPlatform").toString());
     if (i >= 0) ui_.platformSelector->setCurrentIndex(i);
     ui_.platformSelector->setFocus();
+    if (hal_ != nullptr) hal_->release();
     hal_.reset();
     ui_.prevBtn->hide();
     ui_.nextBtn->setEnabled(ui_.portSelector->currentText() != "");
@@ -315,6 +339,7 @@ void WizardDialog::currentStepChanged() {
       qInfo() << "No Clubby ID";
       ui_.s4_newID->setChecked(true);
     }
+    preregisterDevice();
     ui_.nextBtn->setEnabled(true);
   }
   if (ci == Step::CloudCredentials) {
@@ -397,10 +422,7 @@ void WizardDialog::prevStep() {
 
 void WizardDialog::updatePortList() {
   QSet<QString> ports;
-  for (const auto &info : QSerialPortInfo::availablePorts()) {
-#ifdef Q_OS_MAC
-    if (info.portName().contains("Bluetooth")) continue;
-#endif
+  for (const auto &info : portWatcher_->ports()) {
     ports.insert(info.portName());
   }
 
@@ -421,7 +443,6 @@ void WizardDialog::updatePortList() {
     ui_.portSelector->addItem(portName, portName);
   }
 
-  portRefreshTimer_.start(500);
   if (currentStep() == Step::Connect) {
     ui_.nextBtn->setEnabled(ui_.portSelector->currentText() != "");
   }
@@ -447,6 +468,35 @@ void WizardDialog::updateReleaseInfo() {
     qFatal("Release list is not an array");
   }
   releases_ = doc.object()["releases"].toArray();
+  prefetchFirmware();
+}
+
+void WizardDialog::prefetchFirmware() {
+  // Whatever was picked last time, or the first release for the platform.
+  QString platform = settings_.value("wizard/selectedPlatform").toString();
+  if (platform.isEmpty()) platform = ui_.platformSelector->currentText();
+  platform = platform.toUpper();
+  const QString &selected = settings_.value("wizard/selectedFw").toString();
+  QString loc;
+  for (const auto &item : releases_) {
+    const QJsonObject &r = item.toObject();
+    const QJsonValue &l = r["locs"].toObject()[platform];
+    if (!l.isString()) continue;
+    if (loc.isEmpty() || r["name"].toString() == selected) {
+      loc = l.toString();
+    }
+    if (r["name"].toString() == selected) break;
+  }
+  const QUrl url(loc);
+  if (url.scheme() != "http" && url.scheme() != "https") return;
+  qInfo() << "Prefetching" << url;
+  prefetch_.reset(new FileDownloader(url));
+  prefetchDone_ = false;
+  connect(prefetch_.get(), &FileDownloader::finished, this, [this]() {
+    prefetchDone_ = true;
+    qDebug() << "Prefetch finished:" << prefetch_->status();
+  });
+  prefetch_->start();
 }
 
 void WizardDialog::updateFirmwareSelector() {
@@ -477,14 +527,36 @@ void WizardDialog::updateFirmwareSelector() {
 
 void WizardDialog::startFirmwareDownload(const QUrl &url) {
   ui_.s2_1_title->setText(tr("DOWNLOADING ..."));
-  if (fd_ == nullptr || fd_->url() != url) {
+  bool started = false;
+  if (prefetch_ != nullptr && prefetch_->url() == url &&
+      (!prefetchDone_ || prefetch_->status().ok())) {
+    // Carry on with the prefetch, or use what it got.
+    fd_ = std::move(prefetch_);
+    fd_->disconnect(this);
+    started = true;
+  } else if (fd_ == nullptr || fd_->url() != url) {
     fd_.reset(new FileDownloader(url));
-    connect(fd_.get(), &FileDownloader::progress, this,
-            &WizardDialog::downloadProgress);
-    connect(fd_.get(), &FileDownloader::finished, this,
-            &WizardDialog::downloadFinished);
+  } else {
+    fd_->disconnect(this);
+  }
+  connect(fd_.get(), &FileDownloader::progress, this,
+          &WizardDialog::downloadProgress);
+  connect(fd_.get(), &FileDownloader::finished, this,
+          &WizardDialog::downloadFinished);
+  if (!started) {
+    fd_->start();
+  } else if (prefetchDone_) {
+    QTimer::singleShot(0, this, &WizardDialog::downloadFinished);
+  }
+  // Get the device ready in the meantime. Errors are left for flashing to
+  // report.
+  if (preparedFlasher_ == nullptr && hal_ != nullptr && port_ != nullptr) {
+    auto fr = startFlasherThread();
+    if (fr.ok()) {
+      preparedFlasher_ = fr.ValueOrDie();
+      QTimer::singleShot(0, preparedFlasher_, &Flasher::prepare);
+    }
   }
-  fd_->start();
 }
 
 void WizardDialog::downloadProgress(qint64 recd, qint64 total) {
@@ -498,6 +570,10 @@ void WizardDialog::downloadFinished() {
   util::Status st = fd_->status();
   qDebug() << "downloadFinished" << st;
   if (!st.ok()) {
+    if (preparedFlasher_ != nullptr) {
+      releaseFlasher(preparedFlasher_);
+      preparedFlasher_ = nullptr;
+    }
     QMessageBox::critical(this, tr("Error"), st.ToString().c_str());
     prevStep();
     return;
@@ -510,8 +586,12 @@ void WizardDialog::flashFirmware(const QString &fileName) {
   qInfo() << "Loading" << fileName;
   ui_.s2_1_title->setText(tr("LOADING ..."));
 
+  // Flasher that has been connecting to the device during the download.
+  Flasher *f = preparedFlasher_;
+  preparedFlasher_ = nullptr;
   auto fwbs = NewZipFWBundle(fileName);
   if (!fwbs.ok()) {
+    if (f != nullptr) releaseFlasher(f);
     QMessageBox::critical(this, tr("Error"),
                           tr("Failed to load %1: %2")
                               .arg(fileName)
@@ -520,6 +600,7 @@ void WizardDialog::flashFirmware(const QString &fileName) {
   }
   std::unique_ptr<FirmwareBundle> fwb = fwbs.MoveValueOrDie();
   if (fwb->platform().toUpper() != selectedPlatform_) {
+    if (f != nullptr) releaseFlasher(f);
     QMessageBox::critical(this, tr("Error"),
                           tr("Platform mismatch: want %1, got %2")
                               .arg(selectedPlatform_)
@@ -529,36 +610,58 @@ void WizardDialog::flashFirmware(const QString &fileName) {
   qInfo() << "Flashing" << fwb->name() << fwb->buildId();
   ui_.s2_1_title->setText(tr("FLASHING ..."));
 
-  std::unique_ptr<Flasher> f(hal_->flasher(&prompter_));
-  auto s = f->setOptionsFromConfig(*config_);
-  if (!s.ok()) {
-    QMessageBox::critical(
-        this, tr("Error"),
-        tr("Invalid command line flag setting: %1").arg(s.ToString().c_str()));
-    return;
+  if (f == nullptr) {
+    auto fr = startFlasherThread();
+    if (!fr.ok()) {
+      QMessageBox::critical(this, tr("Error"),
+                            tr("Invalid command line flag setting: %1")
+                                .arg(fr.status().ToString().c_str()));
+      return;
+    }
+    f = fr.ValueOrDie();
   }
-  s = f->setFirmware(fwb.get());
+  auto s = f->setFirmware(fwb.get());
   if (!s.ok()) {
+    releaseFlasher(f);
     QMessageBox::critical(this, tr("Error"),
                           tr("Invalid firmware: %1").arg(s.ToString().c_str()));
     return;
   }
   bytesToFlash_ = f->totalBytes();
-  connect(f.get(), &Flasher::progress, this, &WizardDialog::flashingProgress);
+  connect(f, &Flasher::progress, this, &WizardDialog::flashingProgress);
+  connect(f, &Flasher::done, this, &WizardDialog::flashingDone);
+
+  // Can't go back while flashing thread is running.
+  ui_.prevBtn->setEnabled(false);
+  QTimer::singleShot(0, f, &Flasher::run);
+}
+
+util::StatusOr<Flasher *> WizardDialog::startFlasherThread() {
+  std::unique_ptr<Flasher> f(hal_->flasher(&prompter_));
+  auto s = f->setOptionsFromConfig(*config_);
+  if (!s.ok()) return s;
   connect(f.get(), &Flasher::done,
           [this]() { port_->moveToThread(this->thread()); });
   connect(f.get(), &Flasher::statusMessage, this,
           &WizardDialog::flasherStatusMessage);
-  connect(f.get(), &Flasher::done, this, &WizardDialog::flashingDone);
 
-  // Can't go back while flashing thread is running.
-  ui_.prevBtn->setEnabled(false);
   worker_.reset(new QThread);
   connect(worker_.get(), &QThread::finished, f.get(), &QObject::deleteLater);
   f->moveToThread(worker_.get());
   port_->moveToThread(worker_.get());
   worker_->start();
-  QTimer::singleShot(0, f.release(), &Flasher::run);
+  return f.release();
+}
+
+void WizardDialog::releaseFlasher(Flasher *f) {
+  // Runs after prepare(), if it was started. The device is let go of and the
+  // port given back from the thread it is in.
+  QThread *worker = worker_.get();
+  QTimer::singleShot(0, f, [this, f, worker]() {
+    f->release();
+    port_->moveToThread(this->thread());
+    worker->quit();
+  });
 }
 
 void WizardDialog::flasherStatusMessage(QString msg, bool important) {
@@ -584,6 +687,8 @@ void WizardDialog::flashingDone(QString msg, bool success) {
     ui_.s2_1_title->setText(tr("FIRMWARE IS BOOTING ..."));
     setSpeed(port_.get(), config_->value("console-baud-rate").toInt());
     fwc_.reset(new FWClient(port_.get()));
+    fwc_->setFlowControl(config_->value(kFWChunkSizeOption).toInt(),
+                         config_->value(kFWEchoTimeoutOption).toInt());
     connect(fwc_.get(), &FWClient::connectResult, this,
             &WizardDialog::fwConnectResult);
     fwc_->doConnect();
@@ -620,6 +725,7 @@ void WizardDialog::fwConnectResult(util::Status st) {
 void WizardDialog::updateSysConfig(QJsonObject config) {
   qInfo() << "Sys config:" << config;
   devConfig_ = config;
+  if (currentStep() == Step::CloudRegistration) preregisterDevice();
   if (currentStep() == Step::WiFiConfig) {
     ui_.nextBtn->setEnabled(!ui_.s3_wifiName->currentText().isEmpty());
   }
@@ -715,62 +821,52 @@ void WizardDialog::updateWiFiStatus(FWClient::WifiStatus ws) {
   }
 }
 
+void WizardDialog::preregisterDevice() {
+  // Only while the user is on the page and has a new ID picked.
+  if (currentStep() != Step::CloudRegistration || !ui_.s4_newID->isChecked()) {
+    return;
+  }
+  const RegistrationQueue::Device dev = devInfo();
+  if (dev.mac == "" || dev.arch == "") return;
+  registrations_->add(dev);
+}
+
 void WizardDialog::registerDevice() {
   ui_.s4_2_title->setText(tr("REGISTERING DEVICE ..."));
-  const QString arch = getDevVar(kFwArchVar).toString();
-  const QString mac = getDevVar(kMacAddressVar).toString();
-  const QString fwBuild = getDevVar(kFwBuildVar).toString();
-  const QString url =
-      config_->value(kCloudFrontendUrlOption) + kCloudDeviceRegistrationPath;
-  qInfo() << "registerDevice" << url << arch << mac << fwBuild;
-  if (mac == "" || arch == "") {
+  const RegistrationQueue::Device dev = devInfo();
+  qInfo() << "registerDevice" << dev.arch << dev.mac << dev.fwBuild;
+  if (dev.mac == "" || dev.arch == "") {
     const QString msg = tr("Did not find device arch and MAC address");
     qCritical() << msg;
     QMessageBox::critical(this, tr("Error"), msg);
     return;
   }
-  QNetworkRequest req(url);
-  req.setHeader(QNetworkRequest::ContentTypeHeader,
-                "application/x-www-form-urlencoded");
-  QUrlQuery q;
-  q.addQueryItem("arch", arch);
-  q.addQueryItem("mac", mac);
-  q.addQueryItem("fw", fwBuild);
-  q.addQueryItem("fnc", build_id);
-  const QByteArray params =
-      QString("arch=%1&mac=%2&fw=%3").arg(arch).arg(mac).arg(fwBuild).toUtf8();
-  registerDeviceReply_ = nam_.post(req, params);
-  connect(registerDeviceReply_, &QNetworkReply::finished, this,
-          &WizardDialog::registerDeviceRequestFinished);
-}
-
-void WizardDialog::registerDeviceRequestFinished() {
-  const int code =
-      registerDeviceReply_->attribute(QNetworkRequest::HttpStatusCodeAttribute)
-          .toInt();
-  const QByteArray response = registerDeviceReply_->readAll();
-  qDebug() << "registerDeviceRequestFinished" << code << response;
-  QJsonParseError err;
-  QJsonDocument doc = QJsonDocument::fromJson(response, &err);
-  if (err.error == QJsonParseError::NoError &&
-      doc.object()["device_id"].toString() != "" &&
-      doc.object()["device_psk"].toString() != "") {
-    cloudId_ = doc.object()["device_id"].toString();
-    cloudKey_ = doc.object()["device_psk"].toString();
-    testCloudConnection(cloudId_, cloudKey_);
-  } else {
-    QString msg;
-    if (err.error == QJsonParseError::NoError &&
-        doc.object()["error"].isString()) {
-      msg = doc.object()["error"].toString();
-    } else {
-      msg = tr("Invalid response: %1").arg(QString(response));
-    }
-    qCritical() << msg;
-    QMessageBox::critical(this, tr("Error"), msg);
+  registeringMac_ = dev.mac;
+  auto cr = registrations_->credentials(dev.mac);
+  if (cr.ok()) {
+    deviceRegistered(dev.mac, cr.ValueOrDie().id, cr.ValueOrDie().psk);
+    return;
   }
-  registerDeviceReply_->deleteLater();
-  registerDeviceReply_ = nullptr;
+  // Picks up the request started by preregisterDevice, if there is one.
+  registrations_->add(dev);
+}
+
+void WizardDialog::deviceRegistered(QString mac, QString id, QString psk) {
+  // Early registrations are picked up by registerDevice.
+  if (mac != registeringMac_) return;
+  registeringMac_.clear();
+  cloudId_ = id;
+  cloudKey_ = psk;
+  testCloudConnection(cloudId_, cloudKey_);
+}
+
+void WizardDialog::deviceRegistrationFailed(QString mac, util::Status error) {
+  // Failures of early registration are reported when the user gets there.
+  if (mac != registeringMac_) return;
+  registeringMac_.clear();
+  const QString msg = QString::fromStdString(error.error_message());
+  qCritical() << msg;
+  QMessageBox::critical(this, tr("Error"), msg);
 }
 
 void WizardDialog::testCloudConnection(const QString &cloudId,
@@ -868,6 +964,14 @@ QJsonValue WizardDialog::getDevVar(const QString &var) {
   return jsonLookup(devConfig_, QString("ro_vars.%1").arg(var));
 }
 
+RegistrationQueue::Device WizardDialog::devInfo() {
+  RegistrationQueue::Device dev;
+  dev.arch = getDevVar(kFwArchVar).toString();
+  dev.mac = getDevVar(kMacAddressVar).toString();
+  dev.fwBuild = getDevVar(kFwBuildVar).toString();
+  return dev;
+}
+
 void WizardDialog::closeEvent(QCloseEvent *event) {
   settings_.setValue("wizard/geometry", saveGeometry());
   QMainWindow::closeEvent(event);
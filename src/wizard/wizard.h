@@ -29,6 +29,8 @@
 #include "hal.h"
 #include "config.h"
 #include "log_viewer.h"
+#include "port_watcher.h"
+#include "registration_queue.h"
 #include "ui_wizard.h"
 
 class WizardDialog : public QMainWindow {
@@ -47,6 +49,8 @@ class WizardDialog : public QMainWindow {
 
   void updateReleaseInfo();
   void updateFirmwareSelector();
+  // Starts downloading the firmware the user is likely to pick.
+  void prefetchFirmware();
 
   void startFirmwareDownload(const QUrl &url);
   void downloadProgress(qint64 recd, qint64 total);
@@ -67,8 +71,12 @@ class WizardDialog : public QMainWindow {
   void wifiNameChanged();
   void updateWiFiStatus(FWClient::WifiStatus ws);
 
+  // Starts registering the device as soon as the user picks a new ID, the
+  // result is usually there by the time they get to the cloud step.
+  void preregisterDevice();
   void registerDevice();
-  void registerDeviceRequestFinished();
+  void deviceRegistered(QString mac, QString id, QString psk);
+  void deviceRegistrationFailed(QString mac, util::Status error);
 
   void testCloudConnection(const QString &cloudId, const QString &cloudKey);
   void clubbyStatus(int status);
@@ -104,29 +112,42 @@ signals:
 
   util::Status doConnect();
 
+  // Creates a flasher and starts a thread for it.
+  util::StatusOr<Flasher *> startFlasherThread();
+  // Stops the thread of a flasher that is not going to be run.
+  void releaseFlasher(Flasher *f);
+
   QJsonValue getDevConfKey(const QString &key);
   QJsonValue getDevVar(const QString &var);
+  RegistrationQueue::Device devInfo();
 
   void closeEvent(QCloseEvent *event);
 
   Config *config_ = nullptr;
   QSettings settings_;
 
-  QTimer portRefreshTimer_;
+  PortWatcher *portWatcher_ = nullptr;
   std::unique_ptr<HAL> hal_;
   std::unique_ptr<QSerialPort> port_;
   std::unique_ptr<QThread> worker_;
+  // Connects to the device while the firmware is being downloaded.
+  Flasher *preparedFlasher_ = nullptr;
   int bytesToFlash_ = 0;
 
   QJsonArray releases_;
   std::unique_ptr<FileDownloader> fd_;
+  // Download started by prefetchFirmware, until it is taken over by fd_.
+  std::unique_ptr<FileDownloader> prefetch_;
+  bool prefetchDone_ = false;
   std::unique_ptr<FWClient> fwc_;
   QMap<QString, int> scanResults_;
   bool gotNetworks_ = false;
   QJsonObject devConfig_;
   FWClient::WifiStatus wifiStatus_ = FWClient::WifiStatus::Disconnected;
 
-  QNetworkReply *registerDeviceReply_;
+  std::unique_ptr<RegistrationQueue> registrations_;
+  // MAC of the device the cloud step waits to be registered, if any.
+  QString registeringMac_;
 
   QString selectedPlatform_;
   QString selectedPort_;
@@ -0,0 +1,205 @@
+#include "worker_pool.h"
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include <QCoreApplication>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QJsonDocument>
+#include <QLocalSocket>
+#include <QProcess>
+#include <QThread>
+#include <QVector>
+
+#include <common/util/error_codes.h>
+
+#include "status_qt.h"
+
+#if (QT_VERSION < QT_VERSION_CHECK(5, 5, 0))
+#define qInfo qWarning
+#endif
+
+namespace {
+
+// Workers load nothing until asked, they are listening well within this.
+const int kStartTimeoutMs = 10000;
+const int kConnectRetryMs = 50;
+// Given to workers to exit after SIGTERM, before they are killed.
+const int kStopTimeoutMs = 3000;
+
+// CPUs this process may run on, e.g. within its cpuset. Empty if workers
+// are not pinned.
+QVector<int> allowedCPUs() {
+  QVector<int> cpus;
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) != 0) return cpus;
+  for (int i = 0; i < CPU_SETSIZE; i++) {
+    if (CPU_ISSET(i, &set)) cpus.append(i);
+  }
+#endif
+  return cpus;
+}
+
+// Threads inherit the affinity of the one that creates them, so pinning the
+// main thread right after start covers the flasher threads too.
+void pinToCPU(QProcess *p, int cpu) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(p->processId(), sizeof(set), &set) != 0) {
+    qWarning() << "Failed to pin worker" << p->processId() << "to CPU" << cpu;
+  }
+#else
+  Q_UNUSED(p);
+  Q_UNUSED(cpu);
+#endif
+}
+
+}  // namespace
+
+WorkerPool::WorkerPool(int numWorkers, const QStringList &args,
+                       QObject *parent)
+    : QObject(parent), numWorkers_(numWorkers), args_(args) {
+}
+
+WorkerPool::~WorkerPool() {
+  for (auto &w : workers_) {
+    if (w->socket != nullptr) w->socket->disconnect(this);
+    if (w->process == nullptr) continue;
+    w->process->disconnect(this);
+    if (w->process->state() == QProcess::NotRunning) continue;
+    w->process->terminate();
+    if (!w->process->waitForFinished(kStopTimeoutMs)) w->process->kill();
+  }
+}
+
+util::Status WorkerPool::start() {
+  const QVector<int> cpus = allowedCPUs();
+  for (int i = 0; i < numWorkers_; i++) {
+    std::unique_ptr<Worker> w(new Worker);
+    w->name = QString("mft-worker-%1-%2")
+                  .arg(QCoreApplication::applicationPid())
+                  .arg(i);
+    w->process.reset(new QProcess);
+    // Their logging goes where ours does.
+    w->process->setProcessChannelMode(QProcess::ForwardedErrorChannel);
+    w->process->setStandardOutputFile(QProcess::nullDevice());
+    w->process->start(QCoreApplication::applicationFilePath(),
+                      QStringList(args_) << "--server" << w->name);
+    if (!w->process->waitForStarted()) {
+      return QS(util::error::UNAVAILABLE,
+                tr("failed to start worker %1: %2")
+                    .arg(i)
+                    .arg(w->process->errorString()));
+    }
+    if (!cpus.isEmpty()) pinToCPU(w->process.get(), cpus[i % cpus.size()]);
+    workers_.push_back(std::move(w));
+  }
+  // They start up at the same time, so connecting goes after launching all.
+  for (size_t i = 0; i < workers_.size(); i++) {
+    Worker *w = workers_[i].get();
+    w->socket.reset(new QLocalSocket);
+    QElapsedTimer timer;
+    timer.start();
+    while (true) {
+      w->socket->connectToServer(w->name);
+      if (w->socket->waitForConnected(kConnectRetryMs)) break;
+      if (w->process->state() == QProcess::NotRunning) {
+        return QS(util::error::UNAVAILABLE,
+                  tr("worker %1 exited with code %2")
+                      .arg(i)
+                      .arg(w->process->exitCode()));
+      }
+      if (timer.elapsed() > kStartTimeoutMs) {
+        return QS(util::error::DEADLINE_EXCEEDED,
+                  tr("worker %1 is not listening on %2: %3")
+                      .arg(i)
+                      .arg(w->name)
+                      .arg(w->socket->errorString()));
+      }
+      QThread::msleep(kConnectRetryMs);
+    }
+    w->alive = true;
+    connect(w->socket.get(), &QLocalSocket::readyRead, this,
+            [this, w]() { readEvents(w); });
+    connect(w->socket.get(), &QLocalSocket::disconnected, this,
+            [this, w]() { workerDied(w); });
+    connect(w->process.get(),
+            static_cast<void (QProcess::*)(int, QProcess::ExitStatus)>(
+                &QProcess::finished),
+            this, [this, w]() { workerDied(w); });
+  }
+  qInfo() << "Started" << workers_.size() << "workers";
+  return util::Status::OK;
+}
+
+util::StatusOr<int> WorkerPool::flash(const QString &port,
+                                      const QString &firmware,
+                                      const QJsonObject &options) {
+  Worker *best = nullptr;
+  for (auto &w : workers_) {
+    if (w->alive && (best == nullptr || w->running < best->running)) {
+      best = w.get();
+    }
+  }
+  if (best == nullptr) {
+    return QS(util::error::UNAVAILABLE, tr("no workers left"));
+  }
+  const int id = nextId_++;
+  QJsonObject req;
+  req["id"] = id;
+  req["cmd"] = QString("flash");
+  req["port"] = port;
+  req["firmware"] = firmware;
+  req["options"] = options;
+  best->socket->write(QJsonDocument(req).toJson(QJsonDocument::Compact) +
+                      "\n");
+  best->running++;
+  requests_[id] = best;
+  return id;
+}
+
+void WorkerPool::readEvents(Worker *w) {
+  while (w->socket->canReadLine()) {
+    const QByteArray line = w->socket->readLine().trimmed();
+    if (line.isEmpty()) continue;
+    const QJsonObject e = QJsonDocument::fromJson(line).object();
+    const int id = e["id"].toInt();
+    auto it = requests_.find(id);
+    if (it == requests_.end()) {
+      qWarning() << w->name << "sent an event of no request:" << line;
+      continue;
+    }
+    if (e["event"].toString() == "done") {
+      w->running--;
+      requests_.erase(it);
+    }
+    emit event(id, e);
+  }
+}
+
+void WorkerPool::workerDied(Worker *w) {
+  if (!w->alive) return;
+  w->alive = false;
+  qCritical() << w->name << "is gone, exit code" << w->process->exitCode();
+  // Whatever it was flashing is left as it was.
+  std::vector<int> lost;
+  for (const auto &r : requests_) {
+    if (r.second == w) lost.push_back(r.first);
+  }
+  for (int id : lost) {
+    requests_.erase(id);
+    QJsonObject e;
+    e["id"] = id;
+    e["event"] = QString("done");
+    e["success"] = false;
+    e["message"] = tr("worker %1 exited").arg(w->name);
+    emit event(id, e);
+  }
+  w->running = 0;
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ */
+
+#ifndef CS_MFT_SRC_WORKER_POOL_H_
+#define CS_MFT_SRC_WORKER_POOL_H_
+
+#include <map>
+#include <memory>
+#include <vector>
+
+#include <QJsonObject>
+#include <QObject>
+#include <QString>
+#include <QStringList>
+
+#include <common/util/status.h>
+#include <common/util/statusor.h>
+
+class QLocalSocket;
+class QProcess;
+
+// Runs flash requests in worker processes, each of them a FlashServer (see
+// --server) started from the same executable. The coordinator decides what
+// goes where, workers open the ports and do the flashing, on threads of
+// their own. One process per core keeps a slow or stuck port from holding
+// up the others' event loops. On Linux, workers are pinned to one CPU each,
+// round robin over the CPUs this process is allowed to run on. Workers are
+// stopped when the pool is destroyed.
+class WorkerPool : public QObject {
+  Q_OBJECT
+
+ public:
+  // args are given to each worker, in addition to --server.
+  WorkerPool(int numWorkers, const QStringList &args,
+             QObject *parent = nullptr);
+  ~WorkerPool() override;
+
+  // Starts the workers and waits until all of them take requests.
+  util::Status start();
+
+  // Sends a flash request to the worker with the fewest requests running.
+  // Returns the request ID its events carry. Fails if no worker is left.
+  util::StatusOr<int> flash(const QString &port, const QString &firmware,
+                            const QJsonObject &options);
+
+ signals:
+  // Events of a request, as the worker sends them (see FlashServer). If the
+  // worker dies, its requests get a done event with success set to false.
+  void event(int id, QJsonObject e);
+
+ private:
+  struct Worker {
+    QString name;
+    std::unique_ptr<QProcess> process;
+    std::unique_ptr<QLocalSocket> socket;
+    int running = 0;
+    bool alive = false;
+  };
+
+  void readEvents(Worker *w);
+  void workerDied(Worker *w);
+
+  const int numWorkers_;
+  const QStringList args_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::map<int, Worker *> requests_;  // Running ones, by ID.
+  int nextId_ = 1;
+};
+
+#endif /* CS_MFT_SRC_WORKER_POOL_H_ */